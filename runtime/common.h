@@ -25,6 +25,41 @@ typedef unsigned long long uint64_t;
 #include <elf.h>
 #endif
 
+#if defined(__aarch64__)
+// Save all registers that a call may clobber and the flags, keeping 16B stack
+// alignment. The runtime is compiled without FP/SIMD registers.
+#define SAVE_ALL                                                               \
+  "stp x0, x1, [sp, #-16]!\n"                                                  \
+  "stp x2, x3, [sp, #-16]!\n"                                                  \
+  "stp x4, x5, [sp, #-16]!\n"                                                  \
+  "stp x6, x7, [sp, #-16]!\n"                                                  \
+  "stp x8, x9, [sp, #-16]!\n"                                                  \
+  "stp x10, x11, [sp, #-16]!\n"                                                \
+  "stp x12, x13, [sp, #-16]!\n"                                                \
+  "stp x14, x15, [sp, #-16]!\n"                                                \
+  "stp x16, x17, [sp, #-16]!\n"                                                \
+  "stp x18, x29, [sp, #-16]!\n"                                                \
+  "mrs x0, nzcv\n"                                                             \
+  "stp x0, x30, [sp, #-16]!\n"
+
+// Mirrors SAVE_ALL
+#define RESTORE_ALL                                                            \
+  "ldp x0, x30, [sp], #16\n"                                                   \
+  "msr nzcv, x0\n"                                                             \
+  "ldp x18, x29, [sp], #16\n"                                                  \
+  "ldp x16, x17, [sp], #16\n"                                                  \
+  "ldp x14, x15, [sp], #16\n"                                                  \
+  "ldp x12, x13, [sp], #16\n"                                                  \
+  "ldp x10, x11, [sp], #16\n"                                                  \
+  "ldp x8, x9, [sp], #16\n"                                                    \
+  "ldp x6, x7, [sp], #16\n"                                                    \
+  "ldp x4, x5, [sp], #16\n"                                                    \
+  "ldp x2, x3, [sp], #16\n"                                                    \
+  "ldp x0, x1, [sp], #16\n"
+
+// Offset of the saved x0 and x1 from the stack pointer after SAVE_ALL
+#define SAVED_X0_OFFSET "160"
+#else
 // Save all registers while keeping 16B stack alignment
 #define SAVE_ALL                                                               \
   "push %%rax\n"                                                               \
@@ -62,6 +97,7 @@ typedef unsigned long long uint64_t;
   "pop %%rcx\n"                                                                \
   "pop %%rbx\n"                                                                \
   "pop %%rax\n"
+#endif
 
 // Anonymous namespace covering everything but our library entry point
 namespace {
@@ -69,8 +105,32 @@ namespace {
 #define _STRINGIFY(x) #x
 #define STRINGIFY(x) _STRINGIFY(x)
 
+#if defined(__aarch64__)
+// Linux system calls take their number in x8 and up to six arguments in
+// x0-x5, and return their result in x0.
+uint64_t __syscall(uint64_t Num, uint64_t Arg0 = 0, uint64_t Arg1 = 0,
+                   uint64_t Arg2 = 0, uint64_t Arg3 = 0, uint64_t Arg4 = 0,
+                   uint64_t Arg5 = 0) {
+  register uint64_t x8 asm("x8") = Num;
+  register uint64_t x0 asm("x0") = Arg0;
+  register uint64_t x1 asm("x1") = Arg1;
+  register uint64_t x2 asm("x2") = Arg2;
+  register uint64_t x3 asm("x3") = Arg3;
+  register uint64_t x4 asm("x4") = Arg4;
+  register uint64_t x5 asm("x5") = Arg5;
+  __asm__ __volatile__("svc #0\n"
+                       : "+r"(x0)
+                       : "r"(x8), "r"(x1), "r"(x2), "r"(x3), "r"(x4), "r"(x5)
+                       : "cc", "memory");
+  return x0;
+}
+#endif
+
 
 uint64_t __write(uint64_t fd, const void *buf, uint64_t count) {
+#if defined(__aarch64__)
+  return __syscall(64, fd, reinterpret_cast<uint64_t>(buf), count);
+#else
   uint64_t ret;
 #if defined(__APPLE__)
 #define WRITE_SYSCALL 0x2000004
@@ -83,11 +143,16 @@ uint64_t __write(uint64_t fd, const void *buf, uint64_t count) {
                        : "D"(fd), "S"(buf), "d"(count)
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
 }
 
 
 void *__mmap(uint64_t addr, uint64_t size, uint64_t prot, uint64_t flags,
              uint64_t fd, uint64_t offset) {
+#if defined(__aarch64__)
+  return reinterpret_cast<void *>(
+      __syscall(222, addr, size, prot, flags, fd, offset));
+#else
 #if defined(__APPLE__)
 #define MMAP_SYSCALL 0x20000c5
 #else
@@ -104,9 +169,13 @@ void *__mmap(uint64_t addr, uint64_t size, uint64_t prot, uint64_t flags,
                          "r"(r9)
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
 }
 
 uint64_t __munmap(void *addr, uint64_t size) {
+#if defined(__aarch64__)
+  return __syscall(215, reinterpret_cast<uint64_t>(addr), size);
+#else
 #if defined(__APPLE__)
 #define MUNMAP_SYSCALL 0x2000049
 #else
@@ -119,6 +188,7 @@ uint64_t __munmap(void *addr, uint64_t size) {
                        : "D"(addr), "S"(size)
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
 }
 
 #if !defined(__APPLE__)
@@ -131,6 +201,10 @@ constexpr uint32_t BufSize = 10240;
 // Declare some syscall wrappers we use throughout this code to avoid linking
 // against system libc.
 uint64_t __open(const char *pathname, uint64_t flags, uint64_t mode) {
+#if defined(__aarch64__)
+  return __syscall(56, static_cast<uint64_t>(-100) /*AT_FDCWD*/,
+                   reinterpret_cast<uint64_t>(pathname), flags, mode);
+#else
   uint64_t ret;
   __asm__ __volatile__("movq $2, %%rax\n"
                        "syscall"
@@ -138,9 +212,13 @@ uint64_t __open(const char *pathname, uint64_t flags, uint64_t mode) {
                        : "D"(pathname), "S"(flags), "d"(mode)
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
 }
 
 uint64_t __lseek(uint64_t fd, uint64_t pos, uint64_t whence) {
+#if defined(__aarch64__)
+  return __syscall(62, fd, pos, whence);
+#else
   uint64_t ret;
   __asm__ __volatile__("movq $8, %%rax\n"
                        "syscall\n"
@@ -148,9 +226,55 @@ uint64_t __lseek(uint64_t fd, uint64_t pos, uint64_t whence) {
                        : "D"(fd), "S"(pos), "d"(whence)
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
+}
+
+uint64_t __read(uint64_t fd, void *buf, uint64_t count) {
+#if defined(__aarch64__)
+  return __syscall(63, fd, reinterpret_cast<uint64_t>(buf), count);
+#else
+  uint64_t ret;
+  __asm__ __volatile__("movq $0, %%rax\n"
+                       "syscall\n"
+                       : "=a"(ret)
+                       : "D"(fd), "S"(buf), "d"(count)
+                       : "cc", "rcx", "r11", "memory");
+  return ret;
+#endif
+}
+
+int __memfd_create(const char *name, uint64_t flags) {
+#if defined(__aarch64__)
+  return __syscall(279, reinterpret_cast<uint64_t>(name), flags);
+#else
+  int ret;
+  __asm__ __volatile__("movq $319, %%rax\n"
+                       "syscall\n"
+                       : "=a"(ret)
+                       : "D"(name), "S"(flags)
+                       : "cc", "rcx", "r11", "memory");
+  return ret;
+#endif
+}
+
+int __ftruncate(uint64_t fd, uint64_t length) {
+#if defined(__aarch64__)
+  return __syscall(46, fd, length);
+#else
+  int ret;
+  __asm__ __volatile__("movq $77, %%rax\n"
+                       "syscall\n"
+                       : "=a"(ret)
+                       : "D"(fd), "S"(length)
+                       : "cc", "rcx", "r11", "memory");
+  return ret;
+#endif
 }
 
 int __close(uint64_t fd) {
+#if defined(__aarch64__)
+  return __syscall(57, fd);
+#else
   uint64_t ret;
   __asm__ __volatile__("movq $3, %%rax\n"
                        "syscall\n"
@@ -158,9 +282,13 @@ int __close(uint64_t fd) {
                        : "D"(fd)
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
 }
 
 int __madvise(void *addr, size_t length, int advice) {
+#if defined(__aarch64__)
+  return __syscall(233, reinterpret_cast<uint64_t>(addr), length, advice);
+#else
   int ret;
   __asm__ __volatile__("movq $28, %%rax\n"
                        "syscall\n"
@@ -168,6 +296,7 @@ int __madvise(void *addr, size_t length, int advice) {
                        : "D"(addr), "S"(length), "d"(advice)
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
 }
 
 /* Length of the entries in `struct utsname' is 65.  */
@@ -184,6 +313,9 @@ struct utsname {
 };
 
 int __uname(struct utsname *buf) {
+#if defined(__aarch64__)
+  return __syscall(160, reinterpret_cast<uint64_t>(buf));
+#else
   int ret;
   __asm__ __volatile__("movq $63, %%rax\n"
                        "syscall\n"
@@ -191,6 +323,7 @@ int __uname(struct utsname *buf) {
                        : "D"(buf)
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
 }
 
 struct timespec {
@@ -199,6 +332,10 @@ struct timespec {
 };
 
 uint64_t __nanosleep(const timespec *req, timespec *rem) {
+#if defined(__aarch64__)
+  return __syscall(101, reinterpret_cast<uint64_t>(req),
+                   reinterpret_cast<uint64_t>(rem));
+#else
   uint64_t ret;
   __asm__ __volatile__("movq $35, %%rax\n"
                        "syscall\n"
@@ -206,9 +343,13 @@ uint64_t __nanosleep(const timespec *req, timespec *rem) {
                        : "D"(req), "S"(rem)
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
 }
 
 int64_t __fork() {
+#if defined(__aarch64__)
+  return __syscall(220 /*clone*/, 17 /*SIGCHLD*/, 0, 0, 0, 0);
+#else
   uint64_t ret;
   __asm__ __volatile__("movq $57, %%rax\n"
                        "syscall\n"
@@ -216,9 +357,13 @@ int64_t __fork() {
                        :
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
 }
 
 int __mprotect(void *addr, size_t len, int prot) {
+#if defined(__aarch64__)
+  return __syscall(226, reinterpret_cast<uint64_t>(addr), len, prot);
+#else
   int ret;
   __asm__ __volatile__("movq $10, %%rax\n"
                        "syscall\n"
@@ -226,9 +371,13 @@ int __mprotect(void *addr, size_t len, int prot) {
                        : "D"(addr), "S"(len), "d"(prot)
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
 }
 
 uint64_t __getpid() {
+#if defined(__aarch64__)
+  return __syscall(172);
+#else
   uint64_t ret;
   __asm__ __volatile__("movq $39, %%rax\n"
                        "syscall\n"
@@ -236,9 +385,13 @@ uint64_t __getpid() {
                        :
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
 }
 
 uint64_t __getppid() {
+#if defined(__aarch64__)
+  return __syscall(173);
+#else
   uint64_t ret;
   __asm__ __volatile__("movq $110, %%rax\n"
                        "syscall\n"
@@ -246,9 +399,139 @@ uint64_t __getppid() {
                        :
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
+}
+
+void *__mremap(void *old, uint64_t oldSize, uint64_t newSize, uint64_t flags,
+               void *newAddr) {
+#if defined(__aarch64__)
+  return reinterpret_cast<void *>(
+      __syscall(216, reinterpret_cast<uint64_t>(old), oldSize, newSize, flags,
+                reinterpret_cast<uint64_t>(newAddr)));
+#else
+  void *ret;
+  register uint64_t r8 asm("r8") = reinterpret_cast<uint64_t>(newAddr);
+  register uint64_t r10 asm("r10") = flags;
+  __asm__ __volatile__("movq $25, %%rax\n"
+                       "syscall\n"
+                       : "=a"(ret)
+                       : "D"(old), "S"(oldSize), "d"(newSize), "r"(r10),
+                         "r"(r8)
+                       : "cc", "rcx", "r11", "memory");
+  return ret;
+#endif
+}
+
+int __sigprocmask(int how, const uint64_t *set, uint64_t *oldSet) {
+#if defined(__aarch64__)
+  return __syscall(135, how, reinterpret_cast<uint64_t>(set),
+                   reinterpret_cast<uint64_t>(oldSet), sizeof(uint64_t));
+#else
+  int ret;
+  register uint64_t r10 asm("r10") = sizeof(uint64_t);
+  __asm__ __volatile__("movq $14, %%rax\n"
+                       "syscall\n"
+                       : "=a"(ret)
+                       : "D"(how), "S"(set), "d"(oldSet), "r"(r10)
+                       : "cc", "rcx", "r11", "memory");
+  return ret;
+#endif
+}
+
+int __sigaction(int sig, const void *act, void *oldAct) {
+#if defined(__aarch64__)
+  return __syscall(134, sig, reinterpret_cast<uint64_t>(act),
+                   reinterpret_cast<uint64_t>(oldAct), sizeof(uint64_t));
+#else
+  int ret;
+  register uint64_t r10 asm("r10") = sizeof(uint64_t);
+  __asm__ __volatile__("movq $13, %%rax\n"
+                       "syscall\n"
+                       : "=a"(ret)
+                       : "D"(sig), "S"(act), "d"(oldAct), "r"(r10)
+                       : "cc", "rcx", "r11", "memory");
+  return ret;
+#endif
+}
+
+int __setitimer(int which, const void *value, void *oldValue) {
+#if defined(__aarch64__)
+  return __syscall(103, which, reinterpret_cast<uint64_t>(value),
+                   reinterpret_cast<uint64_t>(oldValue));
+#else
+  int ret;
+  __asm__ __volatile__("movq $38, %%rax\n"
+                       "syscall\n"
+                       : "=a"(ret)
+                       : "D"(which), "S"(value), "d"(oldValue)
+                       : "cc", "rcx", "r11", "memory");
+  return ret;
+#endif
+}
+
+/// Start a thread sharing the address space that runs \p fn(\p arg) on the
+/// stack ending at \p stackTop and then exits. The thread has no TLS, so
+/// \p fn may only use the runtime itself. \returns the thread id or a negated
+/// error number.
+int64_t __clone_thread(void (*fn)(void *), void *arg, void *stackTop) {
+  const uint64_t flags = 0x100 /*CLONE_VM*/ | 0x200 /*CLONE_FS*/ |
+                         0x400 /*CLONE_FILES*/ | 0x800 /*CLONE_SIGHAND*/ |
+                         0x10000 /*CLONE_THREAD*/ | 0x40000 /*CLONE_SYSVSEM*/;
+#if defined(__aarch64__)
+  // Registers other than x0 survive the system call in both threads.
+  register uint64_t x8 asm("x8") = 220;
+  register uint64_t x0 asm("x0") = flags;
+  register uint64_t x1 asm("x1") = reinterpret_cast<uint64_t>(stackTop);
+  register uint64_t x2 asm("x2") = 0;
+  register uint64_t x3 asm("x3") = 0;
+  register uint64_t x4 asm("x4") = 0;
+  register uint64_t x10 asm("x10") = reinterpret_cast<uint64_t>(fn);
+  register uint64_t x11 asm("x11") = reinterpret_cast<uint64_t>(arg);
+  __asm__ __volatile__("svc #0\n"
+                       "cbnz x0, 1f\n"
+                       "mov x29, #0\n"
+                       "mov x0, x11\n"
+                       "blr x10\n"
+                       "mov x8, #93\n"
+                       "mov x0, #0\n"
+                       "svc #0\n"
+                       "1:\n"
+                       : "+r"(x0)
+                       : "r"(x8), "r"(x1), "r"(x2), "r"(x3), "r"(x4),
+                         "r"(x10), "r"(x11)
+                       : "cc", "memory");
+  return x0;
+#else
+  // The new thread starts on its own stack with every register but rax, rcx
+  // and r11 copied, so pass the function and its argument in r12 and r13.
+  int64_t ret;
+  register uint64_t r8 asm("r8") = 0;
+  register uint64_t r10 asm("r10") = 0;
+  register uint64_t r12 asm("r12") = reinterpret_cast<uint64_t>(fn);
+  register uint64_t r13 asm("r13") = reinterpret_cast<uint64_t>(arg);
+  __asm__ __volatile__("movq $56, %%rax\n"
+                       "syscall\n"
+                       "testq %%rax, %%rax\n"
+                       "jnz 1f\n"
+                       "xorl %%ebp, %%ebp\n"
+                       "movq %%r13, %%rdi\n"
+                       "callq *%%r12\n"
+                       "movq $60, %%rax\n"
+                       "xorl %%edi, %%edi\n"
+                       "syscall\n"
+                       "1:\n"
+                       : "=a"(ret)
+                       : "D"(flags), "S"(stackTop), "d"(0), "r"(r10), "r"(r8),
+                         "r"(r12), "r"(r13)
+                       : "cc", "rcx", "r11", "memory");
+  return ret;
+#endif
 }
 
 uint64_t __exit(uint64_t code) {
+#if defined(__aarch64__)
+  return __syscall(94 /*exit_group*/, code);
+#else
   uint64_t ret;
   __asm__ __volatile__("movq $231, %%rax\n"
                        "syscall\n"
@@ -256,6 +539,7 @@ uint64_t __exit(uint64_t code) {
                        : "D"(code)
                        : "cc", "rcx", "r11", "memory");
   return ret;
+#endif
 }
 
 // Helper functions for writing strings to the .fdata file. We intentionally
@@ -345,7 +629,11 @@ class Mutex {
 public:
   bool acquire() {
     bool Result = true;
+#if defined(__aarch64__)
+    Result = __atomic_exchange_n(&InUse, true, __ATOMIC_ACQUIRE);
+#else
     asm volatile("lock; xchg %0, %1" : "+m"(InUse), "=r"(Result) : : "cc");
+#endif
     return !Result;
   }
   void release() { InUse = false; }
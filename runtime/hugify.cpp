@@ -26,7 +26,63 @@ extern void (*__bolt_hugify_init_ptr)();
 extern uint64_t __hot_start;
 extern uint64_t __hot_end;
 
+// If true, back the hot text with a shared memfd instead of private anonymous
+// memory when the kernel cannot map the page cache with huge pages.
+extern bool __bolt_hugify_use_memfd;
+
+// If true, promote the hot text from a background thread and let the program
+// start right away.
+extern bool __bolt_hugify_async;
+
+// The hot data range laid out by BOLT on huge pages of its own, or null.
+extern uint8_t *__bolt_hugify_hot_data_start;
+extern uint8_t *__bolt_hugify_hot_data_end;
+extern bool __bolt_hugify_hot_data_writable;
+
+/// How the hot text was put on huge pages.
+enum hugify_method : uint32_t {
+  METHOD_NONE,      // Transparent huge pages are disabled or madvise failed.
+  METHOD_PAGECACHE, // The page cache of the executable.
+  METHOD_MEMFD,     // A shared memfd.
+  METHOD_ANONYMOUS, // A private anonymous copy.
+  METHOD_ASYNC,     // A private anonymous copy made in the background.
+};
+
+/// Telemetry for the application. It can define a global
+///   bolt_hugify_stats *__bolt_hugify_stats;
+/// with this layout, which the runtime points to its copy at startup. update()
+/// refreshes the huge page counts, since khugepaged can promote the page cache
+/// long after startup. It is not thread-safe.
+struct bolt_hugify_stats {
+  uint32_t version;
+  uint32_t method;
+  uint32_t failures;
+  uint64_t hotTextStart;
+  uint64_t hotTextEnd;
+  uint64_t hotDataStart;
+  uint64_t hotDataEnd;
+  // Bytes of the ranges above mapped with huge pages per /proc/self/smaps.
+  uint64_t filePmdMappedBytes;
+  uint64_t anonHugePagesBytes;
+  void (*update)(bolt_hugify_stats *);
+};
+
+// Address of __bolt_hugify_stats in the application, or null.
+extern bolt_hugify_stats **__bolt_hugify_stats_slot;
+
 #ifdef MADV_HUGEPAGE
+static const size_t hugePageBytes = 2L * 1024 * 1024;
+
+static bolt_hugify_stats stats;
+
+/// What to do when the hot code or data cannot be put on huge pages, set with
+/// BOLT_HUGIFY_ON_FAILURE=abort|warn|silent.
+enum failure_policy { FAILURE_ABORT, FAILURE_WARN, FAILURE_SILENT };
+static failure_policy failurePolicy = FAILURE_ABORT;
+
+/// Size of the stack of the background hugify thread.
+static const size_t asyncStackBytes = 64 * 1024;
+
 /// Starting from character at \p buf, find the longest consecutive sequence
 /// of digits (0-9) and convert it to uint32_t. The converted value
 /// is put into \p ret. \p end marks the end of the buffer to avoid buffer
@@ -46,21 +102,206 @@ static bool scanUInt32(const char *&buf, const char *end, uint32_t &ret) {
   return false;
 }
 
-/// Check whether the kernel supports THP by checking the kernel version.
-/// Only fb kernel 5.2 and latter supports it.
-static bool has_pagecache_thp_support() {
-  struct utsname u;
-  int ret = __uname(&u);
-  if (ret) {
+/// Raw system calls return the negated error number instead of MAP_FAILED.
+static bool mmap_failed(const void *ret) {
+  return reinterpret_cast<uint64_t>(ret) > static_cast<uint64_t>(-4096);
+}
+
+/// Read up to \p size - 1 bytes of the file at \p path to \p buf and null
+/// terminate them. \returns false if the file cannot be read.
+static bool read_file(const char *path, char *buf, uint64_t size) {
+  const int64_t fd = __open(path, 0 /*O_RDONLY*/, 0);
+  if (fd < 0)
+    return false;
+  const int64_t len = __read(fd, buf, size - 1);
+  __close(fd);
+  if (len < 0)
     return false;
+  buf[len] = '\0';
+  return true;
+}
+
+/// \returns whether \p str occurs in the first \p size bytes of \p buf.
+static bool contains(const char *buf, uint64_t size, const char *str) {
+  const uint64_t len = strLen(str);
+  for (uint64_t i = 0; i + len <= size; ++i) {
+    uint64_t j = 0;
+    while (j < len && buf[i + j] == str[j])
+      ++j;
+    if (j == len)
+      return true;
   }
+  return false;
+}
 
-  const char *buf = u.release;
-#ifdef ENABLE_DEBUG
-  report("[hugify] uname release: ");
-  report(buf);
-  report("\n");
-#endif
+static bool str_equals(const char *a, const char *b) {
+  while (*a && *a == *b) {
+    ++a;
+    ++b;
+  }
+  return *a == *b;
+}
+
+/// Copy the value of the environment variable \p name, at most \p size - 1
+/// bytes, to \p value. Read it from /proc/self/environ, since the program can
+/// call into hugify from anywhere and not only at the ELF entry. \returns
+/// false if it is not set.
+static bool get_env(const char *name, char *value, uint64_t size) {
+  const int64_t fd = __open("/proc/self/environ", 0 /*O_RDONLY*/, 0);
+  if (fd < 0)
+    return false;
+  const uint64_t nameLen = strLen(name);
+  char buf[512];
+  uint64_t pos = 0;
+  uint64_t len = 0;
+  bool mismatch = false;
+  bool found = false;
+  int64_t count;
+  while (!found && (count = __read(fd, buf, sizeof(buf))) > 0) {
+    for (int64_t i = 0; i < count; ++i) {
+      const char c = buf[i];
+      if (c == '\0') {
+        if (!mismatch && pos > nameLen) {
+          found = true;
+          break;
+        }
+        pos = 0;
+        mismatch = false;
+        continue;
+      }
+      if (mismatch)
+        continue;
+      if (pos < nameLen)
+        mismatch = c != name[pos];
+      else if (pos == nameLen)
+        mismatch = c != '=';
+      else if (len < size - 1)
+        value[len++] = c;
+      ++pos;
+    }
+  }
+  __close(fd);
+  value[len] = '\0';
+  return found;
+}
+
+/// Count a failure to get huge pages and handle it according to the failure
+/// policy. \returns only if the policy allows to carry on.
+static void hugify_failed(const char *msg) {
+  ++stats.failures;
+  if (failurePolicy == FAILURE_ABORT)
+    reportError(msg, strLen(msg));
+  if (failurePolicy == FAILURE_WARN)
+    report(msg);
+}
+
+static bool overlaps(uint64_t start, uint64_t end, uint64_t from,
+                     uint64_t to) {
+  return start < to && from < end;
+}
+
+/// Account one line of /proc/self/smaps in \p s. \p inRange tracks whether
+/// the current mapping overlaps the hot text or data.
+static void count_smaps_line(bolt_hugify_stats *s, const char *line,
+                             const char *end, bool &inRange) {
+  const char first = *line;
+  if ((first >= '0' && first <= '9') || (first >= 'a' && first <= 'f')) {
+    // A mapping starts with "<start>-<end> <perms> ...".
+    uint64_t bounds[2] = {0, 0};
+    for (int i = 0; i < 2; ++i) {
+      while (line < end && *line != '-' && *line != ' ') {
+        const char c = *line++;
+        bounds[i] = bounds[i] * 16 + (c <= '9' ? c - '0' : c - 'a' + 10);
+      }
+      ++line;
+    }
+    inRange =
+        overlaps(bounds[0], bounds[1], s->hotTextStart, s->hotTextEnd) ||
+        overlaps(bounds[0], bounds[1], s->hotDataStart, s->hotDataEnd);
+    return;
+  }
+  if (!inRange)
+    return;
+  uint64_t *counter = nullptr;
+  if (contains(line, end - line, "FilePmdMapped:"))
+    counter = &s->filePmdMappedBytes;
+  else if (contains(line, end - line, "AnonHugePages:"))
+    counter = &s->anonHugePagesBytes;
+  if (!counter)
+    return;
+  while (line < end && (*line < '0' || *line > '9'))
+    ++line;
+  uint32_t kb;
+  if (scanUInt32(line, end, kb))
+    *counter += uint64_t(kb) * 1024;
+}
+
+/// Refresh the huge page counts in \p s from /proc/self/smaps.
+static void update_stats(bolt_hugify_stats *s) {
+  s->filePmdMappedBytes = 0;
+  s->anonHugePagesBytes = 0;
+  const int64_t fd = __open("/proc/self/smaps", 0 /*O_RDONLY*/, 0);
+  if (fd < 0)
+    return;
+  char buf[4096];
+  uint64_t len = 0;
+  bool inRange = false;
+  int64_t count;
+  while ((count = __read(fd, buf + len, sizeof(buf) - len)) > 0) {
+    len += count;
+    const char *line = buf;
+    const char *end = buf + len;
+    for (const char *eol = line; eol < end; ++eol) {
+      if (*eol != '\n')
+        continue;
+      count_smaps_line(s, line, eol, inRange);
+      line = eol + 1;
+    }
+    // Keep the incomplete last line, or drop it if it fills the buffer.
+    len = end - line;
+    if (len == sizeof(buf))
+      len = 0;
+    memCpy(buf, line, len);
+  }
+  __close(fd);
+}
+
+/// Transparent huge pages can be disabled system-wide, in which case neither
+/// the page cache nor anonymous memory get huge pages on madvise(). Assume
+/// they are enabled if the setting cannot be read.
+static bool is_thp_enabled() {
+  char buf[128];
+  if (!read_file("/sys/kernel/mm/transparent_hugepage/enabled", buf,
+                 sizeof(buf)))
+    return true;
+  return !contains(buf, strLen(buf), "[never]");
+}
+
+/// Look for \p entry in the configuration of kernel \p release installed in
+/// /boot. \returns 1 if it is there, 0 if it is not, or -1 if there is no
+/// configuration to look at.
+static int find_kernel_config(const char *release, const char *entry) {
+  char path[128];
+  char *ptr = strCopy(path, "/boot/config-", sizeof(path) - 1);
+  ptr = strCopy(ptr, release, sizeof(path) - 1 - (ptr - path));
+  *ptr = '\0';
+  const int64_t fd = __open(path, 0 /*O_RDONLY*/, 0);
+  if (fd < 0)
+    return -1;
+  const uint64_t size = __lseek(fd, 0, 2 /*SEEK_END*/);
+  const char *config = reinterpret_cast<const char *>(
+      __mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0));
+  __close(fd);
+  if (mmap_failed(config))
+    return -1;
+  const int found = contains(config, size, entry);
+  __munmap(const_cast<char *>(config), size);
+  return found;
+}
+
+/// Check for a fb kernel 5.2 or later from its release string, which supports
+/// THP for the page cache without telling through its configuration.
+static bool is_fbk_with_pagecache_thp(const char *buf) {
   const char *end = buf + strLen(buf);
   uint32_t nums[5];
   char delims[4][5] = {".", ".", "-", "_fbk"};
@@ -93,16 +334,77 @@ static bool has_pagecache_thp_support() {
   return nums[1] > 2 || nums[4] >= 5;
 }
 
-static void hugify_for_old_kernel(uint8_t *from, uint8_t *to) {
+/// Check whether the kernel can map the page cache of the executable with
+/// huge pages. This needs CONFIG_READ_ONLY_THP_FOR_FS, which is in mainline
+/// since 5.4 but not enabled by default, so look for it in the kernel
+/// configuration and only trust kernels known to have it otherwise.
+static bool has_pagecache_thp_support() {
+  struct utsname u;
+  int ret = __uname(&u);
+  if (ret) {
+    return false;
+  }
+
+#ifdef ENABLE_DEBUG
+  report("[hugify] uname release: ");
+  report(u.release);
+  report("\n");
+#endif
+  const int config =
+      find_kernel_config(u.release, "\nCONFIG_READ_ONLY_THP_FOR_FS=y");
+  if (config >= 0)
+    return config;
+  return is_fbk_with_pagecache_thp(u.release);
+}
+
+/// Move the hot code to a shared memfd instead of private anonymous memory.
+/// It is shmem, which gets huge pages on madvise() with the default
+/// shmem_enabled=advise, and children forked later share the same pages
+/// through the mapping. \returns false if the text was left untouched.
+static bool hugify_with_memfd(uint8_t *from, uint8_t *to) {
+  const size_t size = to - from;
+  const int fd = __memfd_create("bolt_hot_text", 1 /*MFD_CLOEXEC*/);
+  if (fd < 0)
+    return false;
+  if (__ftruncate(fd, size)) {
+    __close(fd);
+    return false;
+  }
+  void *mem = __mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mmap_failed(mem)) {
+    __close(fd);
+    return false;
+  }
+  __madvise(mem, size, MADV_HUGEPAGE);
+  memCpy(mem, from, size);
+  __munmap(mem, size);
+
+  // Replace the hot code in place. This fails e.g. if memfds are not
+  // executable, and the original mapping stays then.
+  const bool mapped =
+      !mmap_failed(__mmap(reinterpret_cast<uint64_t>(from), size,
+                          PROT_READ | PROT_EXEC, MAP_SHARED | MAP_FIXED, fd,
+                          0));
+  __close(fd);
+#ifdef ENABLE_DEBUG
+  if (!mapped)
+    report("[hugify] failed to map the hot text memfd\n");
+#endif
+  return mapped;
+}
+
+/// Move [\p from, \p to) to anonymous memory backed by huge pages and give it
+/// the \p prot permissions. \returns false if it was left in place.
+static bool hugify_for_old_kernel(uint8_t *from, uint8_t *to, int prot) {
   size_t size = to - from;
 
   uint8_t *mem = reinterpret_cast<uint8_t *>(
       __mmap(0, size, 0x3 /* PROT_READ | PROT_WRITE*/,
              0x22 /* MAP_PRIVATE | MAP_ANONYMOUS*/, -1, 0));
 
-  if (mem == (void *)MAP_FAILED) {
-    char msg[] = "Could not allocate memory for text move\n";
-    reportError(msg, sizeof(msg));
+  if (mmap_failed(mem)) {
+    hugify_failed("Could not allocate memory for text move\n");
+    return false;
   }
 #ifdef ENABLE_DEBUG
   reportNumber("Allocated temporary space: ", (uint64_t)mem, 16);
@@ -111,28 +413,143 @@ static void hugify_for_old_kernel(uint8_t *from, uint8_t *to) {
   // Copy the hot code to a temproary location.
   memCpy(mem, from, size);
 
-  // Maps out the existing hot code.
-  if (__mmap(reinterpret_cast<uint64_t>(from), size,
-             PROT_READ | PROT_WRITE | PROT_EXEC,
-             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
-             0) == (void *)MAP_FAILED) {
+  // Maps out the existing hot code. There is no way back if this fails,
+  // whatever the failure policy.
+  if (mmap_failed(__mmap(reinterpret_cast<uint64_t>(from), size,
+                         PROT_READ | PROT_WRITE | PROT_EXEC,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0))) {
     char msg[] = "failed to mmap memory for large page move terminating\n";
     reportError(msg, sizeof(msg));
   }
 
   // Mark the hot code page to be huge page.
-  if (__madvise(from, size, MADV_HUGEPAGE) == -1) {
-    char msg[] = "failed to allocate large page\n";
-    reportError(msg, sizeof(msg));
-  }
+  const bool advised = !__madvise(from, size, MADV_HUGEPAGE);
+  if (!advised)
+    hugify_failed("failed to allocate large page\n");
 
   // Copy the hot code back.
   memCpy(from, mem, size);
 
-  // Change permission back to read-only, ignore failure
-  __mprotect(from, size, PROT_READ | PROT_EXEC);
+  // Change permission back, ignore failure
+  __mprotect(from, size, prot);
 
   __munmap(mem, size);
+  return advised;
+}
+
+/// Copy the hot code to huge pages one 2MB chunk at a time, starting from the
+/// hottest functions at the front, and swap each chunk in with mremap(). The
+/// old pages are replaced atomically with identical contents, so other threads
+/// can keep executing the code being moved.
+static void hugify_chunks_for_old_kernel(uint8_t *from, uint8_t *to) {
+  for (uint8_t *chunk = from; chunk < to; chunk += hugePageBytes) {
+    uint8_t *area = reinterpret_cast<uint8_t *>(
+        __mmap(0, 2 * hugePageBytes, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (mmap_failed(area))
+      return;
+    uint8_t *mem = area + (-(intptr_t)area & (hugePageBytes - 1));
+    __madvise(mem, hugePageBytes, MADV_HUGEPAGE);
+    memCpy(mem, chunk, hugePageBytes);
+    __mprotect(mem, hugePageBytes, PROT_READ | PROT_EXEC);
+    void *moved = __mremap(mem, hugePageBytes, hugePageBytes,
+                           3 /*MREMAP_MAYMOVE | MREMAP_FIXED*/, chunk);
+    __munmap(area, 2 * hugePageBytes);
+    if (mmap_failed(moved))
+      return;
+  }
+}
+
+/// Collapse the page cache of the hot code into huge pages in 2MB chunks,
+/// hottest first, instead of waiting for khugepaged to get to it.
+static void collapse_chunks(uint8_t *from, uint8_t *to) {
+  for (uint8_t *chunk = from; chunk < to; chunk += hugePageBytes) {
+    // Kernels before 6.1 do not know MADV_COLLAPSE and leave it to khugepaged.
+    if (__madvise(chunk, hugePageBytes, 25 /*MADV_COLLAPSE*/) == -22)
+      return;
+  }
+}
+
+struct hugify_range {
+  uint8_t *from;
+  uint8_t *to;
+  bool pagecache;
+};
+
+static void hugify_in_background(void *arg) {
+  const hugify_range *range = reinterpret_cast<const hugify_range *>(arg);
+  if (range->pagecache)
+    collapse_chunks(range->from, range->to);
+  else
+    hugify_chunks_for_old_kernel(range->from, range->to);
+}
+
+/// Promote the hot code from a new thread so that the program does not wait
+/// for it. The thread stack is not freed when it exits. \returns false if the
+/// thread could not be started.
+static bool start_async_hugify(uint8_t *from, uint8_t *to, bool pagecache) {
+  static hugify_range range;
+  range.from = from;
+  range.to = to;
+  range.pagecache = pagecache;
+  uint8_t *stack = reinterpret_cast<uint8_t *>(
+      __mmap(0, asyncStackBytes, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (mmap_failed(stack))
+    return false;
+
+  // Start the thread with all signals blocked. Their handlers would run
+  // without the thread state that libc expects.
+  const uint64_t all = ~0ULL;
+  uint64_t old;
+  __sigprocmask(2 /*SIG_SETMASK*/, &all, &old);
+  const int64_t tid =
+      __clone_thread(hugify_in_background, &range, stack + asyncStackBytes);
+  __sigprocmask(2 /*SIG_SETMASK*/, &old, nullptr);
+  if (tid < 0) {
+    __munmap(stack, asyncStackBytes);
+    return false;
+  }
+  return true;
+}
+
+static hugify_method hugify_text(uint8_t *from, uint8_t *to, bool pagecache) {
+  if (!pagecache) {
+    if (__bolt_hugify_use_memfd && hugify_with_memfd(from, to))
+      return METHOD_MEMFD;
+    if (__bolt_hugify_async && start_async_hugify(from, to, false))
+      return METHOD_ASYNC;
+    return hugify_for_old_kernel(from, to, PROT_READ | PROT_EXEC)
+               ? METHOD_ANONYMOUS
+               : METHOD_NONE;
+  }
+
+  if (__madvise(from, (to - from), MADV_HUGEPAGE)) {
+    hugify_failed("failed to allocate large page\n");
+    return METHOD_NONE;
+  }
+  if (__bolt_hugify_async)
+    start_async_hugify(from, to, true);
+  return METHOD_PAGECACHE;
+}
+
+/// Put the hot data on huge pages. Only read-only data can stay in the page
+/// cache. Writable data is private to the process and has to be copied, which
+/// is done right away since the program could overwrite it otherwise.
+static void hugify_data(uint8_t *from, uint8_t *to, bool pagecache) {
+#ifdef ENABLE_DEBUG
+  reportNumber("[hugify] hot data start: ", (uint64_t)from, 16);
+  reportNumber("[hugify] hot data end: ", (uint64_t)to, 16);
+#endif
+  if (!__bolt_hugify_hot_data_writable && pagecache) {
+    if (__madvise(from, to - from, MADV_HUGEPAGE))
+      hugify_failed("failed to allocate large page for hot data\n");
+    return;
+  }
+  hugify_for_old_kernel(from, to,
+                        __bolt_hugify_hot_data_writable
+                            ? PROT_READ | PROT_WRITE
+                            : PROT_READ);
 }
 #endif
 
@@ -141,11 +558,25 @@ extern "C" void __bolt_hugify_self_impl() {
   uint8_t *hotStart = (uint8_t *)&__hot_start;
   uint8_t *hotEnd = (uint8_t *)&__hot_end;
   // Make sure the start and end are aligned with huge page address
-  const size_t hugePageBytes = 2L * 1024 * 1024;
   uint8_t *from = hotStart - ((intptr_t)hotStart & (hugePageBytes - 1));
   uint8_t *to = hotEnd + (hugePageBytes - 1);
   to -= (intptr_t)to & (hugePageBytes - 1);
 
+  stats.version = 1;
+  stats.hotTextStart = (uint64_t)from;
+  stats.hotTextEnd = (uint64_t)to;
+  stats.update = update_stats;
+  if (__bolt_hugify_stats_slot)
+    *__bolt_hugify_stats_slot = &stats;
+
+  char policy[16];
+  if (get_env("BOLT_HUGIFY_ON_FAILURE", policy, sizeof(policy))) {
+    if (str_equals(policy, "warn"))
+      failurePolicy = FAILURE_WARN;
+    else if (str_equals(policy, "silent"))
+      failurePolicy = FAILURE_SILENT;
+  }
+
 #ifdef ENABLE_DEBUG
   reportNumber("[hugify] hot start: ", (uint64_t)hotStart, 16);
   reportNumber("[hugify] hot end: ", (uint64_t)hotEnd, 16);
@@ -153,20 +584,40 @@ extern "C" void __bolt_hugify_self_impl() {
   reportNumber("[hugify] aligned huge page to: ", (uint64_t)to, 16);
 #endif
 
-  if (!has_pagecache_thp_support()) {
-    hugify_for_old_kernel(from, to);
+  if (!is_thp_enabled()) {
+#ifdef ENABLE_DEBUG
+    report("[hugify] transparent huge pages are disabled\n");
+#endif
     return;
   }
 
-  if (__madvise(from, (to - from), MADV_HUGEPAGE) == -1) {
-    char msg[] = "failed to allocate large page\n";
-    // TODO: allow user to control the failure behavior.
-    reportError(msg, sizeof(msg));
+  const bool pagecache = has_pagecache_thp_support();
+  stats.method = hugify_text(from, to, pagecache);
+  // BOLT aligns the hot data to huge pages and pads it to the next one.
+  if (__bolt_hugify_hot_data_start) {
+    uint8_t *dataEnd = __bolt_hugify_hot_data_end + (hugePageBytes - 1);
+    dataEnd -= (intptr_t)dataEnd & (hugePageBytes - 1);
+    stats.hotDataStart = (uint64_t)__bolt_hugify_hot_data_start;
+    stats.hotDataEnd = (uint64_t)dataEnd;
+    hugify_data(__bolt_hugify_hot_data_start, dataEnd, pagecache);
   }
 #endif
 }
 
 /// This is hooking ELF's entry, it needs to save all machine state.
+#if defined(__aarch64__)
+__asm__(".text\n"
+        ".global __bolt_hugify_self\n"
+        ".type __bolt_hugify_self, %function\n"
+        "__bolt_hugify_self:\n"
+        SAVE_ALL
+        "bl __bolt_hugify_self_impl\n"
+        RESTORE_ALL
+        "adrp x16, __bolt_hugify_init_ptr\n"
+        "ldr x16, [x16, #:lo12:__bolt_hugify_init_ptr]\n"
+        "br x16\n"
+        ".size __bolt_hugify_self, .-__bolt_hugify_self\n");
+#else
 extern "C" __attribute((naked)) void __bolt_hugify_self() {
   __asm__ __volatile__(SAVE_ALL
                        "call __bolt_hugify_self_impl\n"
@@ -174,5 +625,6 @@ extern "C" __attribute((naked)) void __bolt_hugify_self() {
                        "jmp *__bolt_hugify_init_ptr(%%rip)\n"
                        :::);
 }
+#endif
 
 #endif
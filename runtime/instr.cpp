@@ -66,6 +66,27 @@
 // counted in order to infer the execution count of other edges of the CFG.
 extern uint64_t __bolt_instr_locations[];
 extern uint32_t __bolt_num_counters;
+// Counters may be sharded per CPU, in which case __bolt_instr_num_shards
+// copies of the counter array follow each other, __bolt_instr_shard_stride
+// bytes apart. The copies are summed into the first one before writing the
+// profile.
+extern uint32_t __bolt_instr_num_shards;
+extern uint64_t __bolt_instr_shard_stride;
+// With sampled instrumentation, counters are only updated while this flag is
+// non-zero. It follows the counters of the first shard, so it is shared with
+// the child process toggling it every __bolt_instr_sampling_period
+// milliseconds for bursts of __bolt_instr_sampling_burst milliseconds.
+extern volatile uint8_t __bolt_instr_sampling_on;
+extern uint32_t __bolt_instr_sampling_period;
+extern uint32_t __bolt_instr_sampling_burst;
+// Position of each of the __bolt_instr_num_first_calls functions in the order
+// of first execution, or zero if it did not run yet, and the last position
+// handed out. They follow the sampling flag. The string table offsets of the
+// function names are in __bolt_instr_first_call_names.
+extern uint32_t __bolt_instr_first_call_order[];
+extern uint32_t __bolt_instr_first_call_seq;
+extern uint32_t __bolt_instr_num_first_calls;
+extern uint32_t __bolt_instr_first_call_names[];
 // Descriptions are serialized metadata about binary functions written by BOLT,
 // so we have a minimal understanding about the program structure. For a
 // reference on the exact format of this metadata, see *Description structs,
@@ -74,15 +95,34 @@ extern uint32_t __bolt_num_counters;
 extern uint32_t __bolt_instr_num_ind_calls;
 // Number of indirect call target descriptions
 extern uint32_t __bolt_instr_num_ind_targets;
+// Number of value profiled call site descriptions
+extern uint32_t __bolt_instr_num_value_sites;
 // Number of function descriptions
 extern uint32_t __bolt_instr_num_funcs;
+// Number of loads and stores with profiled addresses. One in
+// __bolt_instr_mem_sample_rate accesses is attributed to one of the
+// __bolt_instr_num_data_objects global objects, and the rest are ignored.
+extern uint32_t __bolt_instr_num_mem_sites;
+extern uint32_t __bolt_instr_mem_sample_rate;
+extern uint32_t __bolt_instr_num_data_objects;
 // Time to sleep across dumps (when we write the fdata profile to disk)
 extern uint32_t __bolt_instr_sleep_time;
 // Filename to dump data to
 extern char __bolt_instr_filename[];
+// If not empty, name of the file the counters are mapped to, so they can be
+// read by an external collector at any time. Relative names are placed in
+// /dev/shm.
+extern char __bolt_instr_shm_name[];
 // If true, append current PID to the fdata filename when creating it so
 // different invocations of the same program can be differentiated.
 extern bool __bolt_instr_use_pid;
+// If true, write the raw counters instead of an fdata file. They are turned
+// into fdata offline by merge-fdata -instrumented-binary.
+extern bool __bolt_instr_binary_profile;
+// If true, processes forked from the instrumented one keep counting into the
+// shared counters and do not write profiles of their own. See
+// shouldWriteProfile().
+extern bool __bolt_instr_merge_processes;
 // Functions that will be used to instrument indirect calls. BOLT static pass
 // will identify indirect calls and modify them to load the address in these
 // trampolines and call this address instead. BOLT can't use direct calls to
@@ -92,6 +132,11 @@ extern bool __bolt_instr_use_pid;
 // TODO: We need better linking support to make that happen.
 extern void (*__bolt_trampoline_ind_call)();
 extern void (*__bolt_trampoline_ind_tailcall)();
+// Same as above, but for the handler recording the size argument of memcpy()
+// and memset() call sites.
+extern void (*__bolt_trampoline_value_prof)();
+// And for the handler recording the address of loads and stores
+extern void (*__bolt_trampoline_mem_access)();
 // Function pointers to init/fini routines in the binary, so we can resume
 // regular execution of these functions that we hooked
 extern void (*__bolt_instr_init_ptr)();
@@ -344,8 +389,63 @@ void SimpleHashTable<T, X, Y>::resetCounters() {
   forEachElement(resetIndCallCounter);
 }
 
+/// A hash table mapping a function target address (or a profiled value) to
+/// its counter that is updated without locks. Indirect call sites usually see
+/// very few targets, so each call site owns a small open-addressed array of
+/// slots claimed with a compare-and-swap of the key, and counts are bumped
+/// with an atomic add. Only keys that do not fit in the slots go to a locked
+/// overflow table, keeping the common case free of contention between
+/// threads calling through the same site.
+template <uint32_t NumSlots = 8> class LockFreeHashTable {
+public:
+  using MapEntry = SimpleHashTableEntryBase;
+
+  /// Increment by 1 the value of \p Key, adding it to the table if needed.
+  void incrementVal(uint64_t Key, BumpPtrAllocator &Alloc) {
+    const uint32_t Hash = (Key * 0x9e3779b97f4a7c15ull) >> 32;
+    for (uint32_t I = 0; I < NumSlots; ++I) {
+      MapEntry &Entry = Slots[(Hash + I) % NumSlots];
+      uint64_t SlotKey = __atomic_load_n(&Entry.Key, __ATOMIC_ACQUIRE);
+      if (SlotKey == VacantMarker &&
+          __atomic_compare_exchange_n(&Entry.Key, &SlotKey, Key,
+                                      /*weak=*/false, __ATOMIC_ACQ_REL,
+                                      __ATOMIC_ACQUIRE))
+        SlotKey = Key;
+      // Either a hit, or we lost the race for a vacant slot to the same key
+      if (SlotKey == Key) {
+        __atomic_fetch_add(&Entry.Val, 1, __ATOMIC_RELAXED);
+        return;
+      }
+    }
+    Overflow.incrementVal(Key, Alloc);
+  }
+
+  /// Traverses all elements in the table
+  template <typename... Args>
+  void forEachElement(void (*Callback)(MapEntry &, Args...), Args... args) {
+    for (uint32_t I = 0; I < NumSlots; ++I) {
+      if (__atomic_load_n(&Slots[I].Key, __ATOMIC_ACQUIRE) == VacantMarker)
+        continue;
+      Callback(Slots[I], args...);
+    }
+    Overflow.forEachElement(Callback, args...);
+  }
+
+  void resetCounters() {
+    for (uint32_t I = 0; I < NumSlots; ++I)
+      __atomic_store_n(&Slots[I].Val, 0, __ATOMIC_RELAXED);
+    Overflow.resetCounters();
+  }
+
+private:
+  constexpr static uint64_t VacantMarker = 0;
+
+  MapEntry Slots[NumSlots];
+  SimpleHashTable<> Overflow;
+};
+
 /// Represents a hash table mapping a function target address to its counter.
-using IndirectCallHashTable = SimpleHashTable<>;
+using IndirectCallHashTable = LockFreeHashTable<>;
 
 /// Initialize with number 1 instead of 0 so we don't go into .bss. This is the
 /// global array of all hash tables storing indirect call destinations happening
@@ -353,10 +453,36 @@ using IndirectCallHashTable = SimpleHashTable<>;
 IndirectCallHashTable *GlobalIndCallCounters{
     reinterpret_cast<IndirectCallHashTable *>(1)};
 
+/// Same as above, but each table maps an observed argument value of a value
+/// profiled call site to its frequency.
+IndirectCallHashTable *GlobalValueCounters{
+    reinterpret_cast<IndirectCallHashTable *>(1)};
+
+/// Same as above, but each table maps a data object accessed by a memory
+/// access site to its frequency.
+IndirectCallHashTable *GlobalMemAccessCounters{
+    reinterpret_cast<IndirectCallHashTable *>(1)};
+
+/// Number of accesses left to skip until the next sampled one. Races between
+/// threads only perturb the sampling.
+uint32_t MemAccessCountdown{1};
+
 /// Don't allow reentrancy in the fdata writing phase - only one thread writes
 /// it
 Mutex *GlobalWriteProfileMutex{reinterpret_cast<Mutex *>(1)};
 
+/// Processes sharing the counters with __bolt_instr_merge_processes. Kept in
+/// shared memory and updated atomically.
+struct ProcessRegistry {
+  /// The process that ran __bolt_instr_setup
+  uint64_t RootPID;
+  /// Number of processes that finished, including the root
+  uint32_t NumExited;
+  /// Whether the root process finished and wrote the profile
+  bool RootExited;
+};
+ProcessRegistry *GlobalProcesses{reinterpret_cast<ProcessRegistry *>(1)};
+
 /// Store number of calls in additional to target address (Key) and frequency
 /// as perceived by the basic block counter (Val).
 struct CallFlowEntryBase : public SimpleHashTableEntryBase {
@@ -419,6 +545,38 @@ struct IndCallTargetDescription {
   uint64_t Address;
 };
 
+using ValueSiteDescription = Location;
+
+/// A global object that memory accesses are attributed to, see
+/// InstrumentationRuntimeLibrary::emitBinary()
+struct DataObjectDescription {
+  uint64_t Address;
+  uint32_t Size;
+  uint32_t Name; // Offset in __bolt_instr_data_object_names
+};
+
+extern ValueSiteDescription __bolt_instr_mem_sites[];
+extern DataObjectDescription __bolt_instr_data_objects[];
+extern char __bolt_instr_data_object_names[];
+
+/// Return the index of the data object containing \p Addr, or -1 if there is
+/// none, e.g. for heap and stack addresses.
+int64_t lookupDataObject(uint64_t Addr) {
+  uint32_t B = 0;
+  uint32_t E = __bolt_instr_num_data_objects;
+  while (B < E) {
+    const uint32_t I = (E - B) / 2 + B;
+    const DataObjectDescription &Object = __bolt_instr_data_objects[I];
+    if (Addr < Object.Address)
+      E = I;
+    else if (Addr - Object.Address >= Object.Size)
+      B = I + 1;
+    else
+      return I;
+  }
+  return -1;
+}
+
 struct EdgeDescription {
   Location From;
   uint32_t FromNode;
@@ -466,12 +624,15 @@ struct FunctionDescription {
 struct ProfileWriterContext {
   IndCallDescription *IndCallDescriptions;
   IndCallTargetDescription *IndCallTargets;
+  ValueSiteDescription *ValueSites;
   uint8_t *FuncDescriptions;
   char *Strings;  // String table with function names used in this binary
   int FileDesc;   // File descriptor for the file on disk backing this
                   // information in memory via mmap
   void *MMapPtr;  // The mmap ptr
   int MMapSize;   // The mmap size
+  uint8_t *Tables;     // Contents of the .bolt.instr.tables note
+  uint32_t TablesSize; // and their size
 
   /// Hash table storing all possible call destinations to detect untracked
   /// calls and correctly report them as [unknown] in output fdata.
@@ -496,10 +657,12 @@ int compareStr(const char *Str1, const char *Str2, int Size) {
 
 /// Output Location to the fdata file
 char *serializeLoc(const ProfileWriterContext &Ctx, char *OutBuf,
-                   const Location Loc, uint32_t BufSize) {
+                   const Location Loc, uint32_t BufSize,
+                   bool IsMemEvent = false) {
   // fdata location format: Type Name Offset
   // Type 1 - regular symbol
-  OutBuf = strCopy(OutBuf, "1 ");
+  // Type 4 - regular symbol, as the source of a memory event record
+  OutBuf = strCopy(OutBuf, IsMemEvent ? "4 " : "1 ");
   const char *Str = Ctx.Strings + Loc.FunctionName;
   uint32_t Size = 25;
   while (*Str) {
@@ -581,22 +744,32 @@ ProfileWriterContext readDescriptions() {
     // Offset 8: Note type (4 bytes)
     // Offset 12: Producer name (BOLT\0) (5 bytes + align to 4-byte boundary)
     // Offset 20: Contents
+    Result.Tables = BinContents + Shdr->sh_offset + 20;
+    Result.TablesSize =
+        *reinterpret_cast<uint32_t *>(BinContents + Shdr->sh_offset + 4);
     uint32_t IndCallDescSize =
         *reinterpret_cast<uint32_t *>(BinContents + Shdr->sh_offset + 20);
     uint32_t IndCallTargetDescSize = *reinterpret_cast<uint32_t *>(
         BinContents + Shdr->sh_offset + 24 + IndCallDescSize);
-    uint32_t FuncDescSize =
+    uint32_t ValueSiteDescSize =
         *reinterpret_cast<uint32_t *>(BinContents + Shdr->sh_offset + 28 +
                                       IndCallDescSize + IndCallTargetDescSize);
+    uint32_t FuncDescSize = *reinterpret_cast<uint32_t *>(
+        BinContents + Shdr->sh_offset + 32 + IndCallDescSize +
+        IndCallTargetDescSize + ValueSiteDescSize);
     Result.IndCallDescriptions = reinterpret_cast<IndCallDescription *>(
         BinContents + Shdr->sh_offset + 24);
     Result.IndCallTargets = reinterpret_cast<IndCallTargetDescription *>(
         BinContents + Shdr->sh_offset + 28 + IndCallDescSize);
-    Result.FuncDescriptions = BinContents + Shdr->sh_offset + 32 +
-                              IndCallDescSize + IndCallTargetDescSize;
-    Result.Strings = reinterpret_cast<char *>(
+    Result.ValueSites = reinterpret_cast<ValueSiteDescription *>(
         BinContents + Shdr->sh_offset + 32 + IndCallDescSize +
-        IndCallTargetDescSize + FuncDescSize);
+        IndCallTargetDescSize);
+    Result.FuncDescriptions = BinContents + Shdr->sh_offset + 36 +
+                              IndCallDescSize + IndCallTargetDescSize +
+                              ValueSiteDescSize;
+    Result.Strings = reinterpret_cast<char *>(
+        BinContents + Shdr->sh_offset + 36 + IndCallDescSize +
+        IndCallTargetDescSize + ValueSiteDescSize + FuncDescSize);
     return Result;
   }
   const char ErrMsg[] =
@@ -605,7 +778,34 @@ ProfileWriterContext readDescriptions() {
   reportError(ErrMsg, sizeof(ErrMsg));
   return Result;
 }
+
+/// Find the build-id note of the binary mapped by readDescriptions(). Return
+/// its size and set \p BuildID to point at it, or return 0 if there is none.
+uint32_t readBuildID(const ProfileWriterContext &Ctx, const uint8_t *&BuildID) {
+  const uint8_t *BinContents = reinterpret_cast<uint8_t *>(Ctx.MMapPtr);
+  const Elf64_Ehdr *Hdr = reinterpret_cast<const Elf64_Ehdr *>(BinContents);
+  const Elf64_Shdr *StringTblHeader = reinterpret_cast<const Elf64_Shdr *>(
+      BinContents + Hdr->e_shoff + Hdr->e_shstrndx * Hdr->e_shentsize);
+  for (int I = 0; I < Hdr->e_shnum; ++I) {
+    const Elf64_Shdr *Shdr = reinterpret_cast<const Elf64_Shdr *>(
+        BinContents + Hdr->e_shoff + I * Hdr->e_shentsize);
+    const char *SecName = reinterpret_cast<const char *>(
+        BinContents + StringTblHeader->sh_offset + Shdr->sh_name);
+    if (compareStr(SecName, ".note.gnu.build-id", 64) != 0)
+      continue;
+    // Name size, descriptor size, type, name padded to 4 bytes, descriptor
+    const uint8_t *Note = BinContents + Shdr->sh_offset;
+    const uint32_t NameSize = *reinterpret_cast<const uint32_t *>(Note);
+    BuildID = Note + 12 + alignTo(NameSize, 4);
+    return *reinterpret_cast<const uint32_t *>(Note + 4);
+  }
+  return 0;
+}
 #else
+uint32_t readBuildID(const ProfileWriterContext &Ctx, const uint8_t *&BuildID) {
+  return 0;
+}
+
 ProfileWriterContext readDescriptions() {
   ProfileWriterContext Result;
   const char ErrMsg[] =
@@ -1224,6 +1424,65 @@ void writeIndirectCallProfile(int FD, ProfileWriterContext &Ctx) {
   }
 }
 
+/// Write a single <call site, argument value> pair to the fdata file. These
+/// are encoded as memory events with the reserved "[value]" address name, so
+/// that existing fdata tools handle them transparently.
+void visitValueCounter(IndirectCallHashTable::MapEntry &Entry, int FD,
+                       int SiteID, ProfileWriterContext *Ctx) {
+  if (Entry.Val == 0)
+    return;
+  char LineBuf[BufSize];
+  char *Ptr = LineBuf;
+  Ptr = serializeLoc(*Ctx, Ptr, Ctx->ValueSites[SiteID], BufSize,
+                     /*IsMemEvent=*/true);
+  Ptr = strCopy(Ptr, "3 [value] ", BufSize - (Ptr - LineBuf) - 40);
+  // Keys are biased by one since zero marks a vacant entry
+  Ptr = intToStr(Ptr, Entry.Key - 1, 16);
+  *Ptr++ = ' ';
+  Ptr = intToStr(Ptr, Entry.Val, 10);
+  *Ptr++ = '\n';
+  __write(FD, LineBuf, Ptr - LineBuf);
+}
+
+/// Write to \p FD all of the value profiles.
+void writeValueProfile(int FD, ProfileWriterContext &Ctx) {
+  for (int I = 0; I < __bolt_instr_num_value_sites; ++I) {
+    DEBUG(reportNumber("ValueSite #", I, 10));
+    GlobalValueCounters[I].forEachElement(visitValueCounter, FD, I, &Ctx);
+  }
+}
+
+/// Write a single <memory access site, data object> pair to the fdata file as
+/// a memory event record, with accesses anywhere in the object at offset 0.
+void visitMemAccessCounter(IndirectCallHashTable::MapEntry &Entry, int FD,
+                           int SiteID, ProfileWriterContext *Ctx) {
+  if (Entry.Val == 0)
+    return;
+  // Keys are biased by one since zero marks a vacant entry
+  const DataObjectDescription &Object =
+      __bolt_instr_data_objects[Entry.Key - 1];
+  char LineBuf[BufSize];
+  char *Ptr = LineBuf;
+  Ptr = serializeLoc(*Ctx, Ptr, __bolt_instr_mem_sites[SiteID], BufSize,
+                     /*IsMemEvent=*/true);
+  Ptr = strCopy(Ptr, "4 ", BufSize - (Ptr - LineBuf) - 40);
+  Ptr = strCopy(Ptr, __bolt_instr_data_object_names + Object.Name,
+                BufSize - (Ptr - LineBuf) - 40);
+  Ptr = strCopy(Ptr, " 0 ", BufSize - (Ptr - LineBuf) - 25);
+  Ptr = intToStr(Ptr, Entry.Val, 10);
+  *Ptr++ = '\n';
+  __write(FD, LineBuf, Ptr - LineBuf);
+}
+
+/// Write to \p FD all of the memory access profiles.
+void writeMemAccessProfile(int FD, ProfileWriterContext &Ctx) {
+  for (int I = 0; I < __bolt_instr_num_mem_sites; ++I) {
+    DEBUG(reportNumber("MemAccessSite #", I, 10));
+    GlobalMemAccessCounters[I].forEachElement(visitMemAccessCounter, FD, I,
+                                              &Ctx);
+  }
+}
+
 /// Check a single call flow for a callee versus all known callers. If there are
 /// less callers than what the callee expects, write the difference with source
 /// [unknown] in the profile.
@@ -1260,17 +1519,20 @@ void visitCallFlowEntry(CallFlowHashTable::MapEntry &Entry, int FD,
 
 /// Open fdata file for writing and return a valid file descriptor, aborting
 /// program upon failure.
-int openProfile() {
+int openProfile(const char *Suffix = "") {
   // Build the profile name string by appending our PID
   char Buf[BufSize];
   char *Ptr = Buf;
-  uint64_t PID = __getpid();
+  // Merged processes all write the profile of the root process.
+  uint64_t PID =
+      __bolt_instr_merge_processes ? GlobalProcesses->RootPID : __getpid();
   Ptr = strCopy(Buf, __bolt_instr_filename, BufSize);
   if (__bolt_instr_use_pid) {
     Ptr = strCopy(Ptr, ".", BufSize - (Ptr - Buf + 1));
     Ptr = intToStr(Ptr, PID, 10);
     Ptr = strCopy(Ptr, ".fdata", BufSize - (Ptr - Buf + 1));
   }
+  Ptr = strCopy(Ptr, Suffix, BufSize - (Ptr - Buf + 1));
   *Ptr++ = '\0';
   uint64_t FD = __open(Buf,
                        /*flags=*/0x241 /*O_WRONLY|O_TRUNC|O_CREAT*/,
@@ -1284,6 +1546,28 @@ int openProfile() {
   }
   return FD;
 }
+
+/// Write the functions that executed with their position in the order of first
+/// execution to "<profile>.temporal", one "<function> <position>" per line as
+/// read by BOLT's -temporal-profile option.
+void writeFirstCallOrder(const ProfileWriterContext &Ctx) {
+  if (!__bolt_instr_num_first_calls)
+    return;
+  const int FD = openProfile(".temporal");
+  for (uint32_t I = 0; I < __bolt_instr_num_first_calls; ++I) {
+    const uint32_t Position = __bolt_instr_first_call_order[I];
+    if (!Position)
+      continue;
+    char LineBuf[BufSize];
+    char *Ptr = strCopy(LineBuf, Ctx.Strings + __bolt_instr_first_call_names[I],
+                        BufSize - 25);
+    *Ptr++ = ' ';
+    Ptr = intToStr(Ptr, Position, 10);
+    *Ptr++ = '\n';
+    __write(FD, LineBuf, Ptr - LineBuf);
+  }
+  __close(FD);
+}
 } // anonymous namespace
 
 /// Reset all counters in case you want to start profiling a new phase of your
@@ -1297,11 +1581,122 @@ int openProfile() {
 /// Where 0xdeadbeef is this function address and PROCESSNAME your binary file
 /// name.
 extern "C" void __bolt_instr_clear_counters() {
-  memSet(reinterpret_cast<char *>(__bolt_instr_locations), 0,
-         __bolt_num_counters * 8);
+  const uint64_t StrideInCounters = __bolt_instr_shard_stride / 8;
+  for (uint32_t S = 0; S < __bolt_instr_num_shards; ++S)
+    memSet(reinterpret_cast<char *>(
+               &__bolt_instr_locations[S * StrideInCounters]),
+           0, __bolt_num_counters * 8);
   for (int I = 0; I < __bolt_instr_num_ind_calls; ++I) {
     GlobalIndCallCounters[I].resetCounters();
   }
+  for (int I = 0; I < __bolt_instr_num_value_sites; ++I) {
+    GlobalValueCounters[I].resetCounters();
+  }
+  for (int I = 0; I < __bolt_instr_num_mem_sites; ++I) {
+    GlobalMemAccessCounters[I].resetCounters();
+  }
+}
+
+/// Header of the binary profile, which is followed by the counters and by
+/// NumIndCallEntries entries for indirect call targets and NumValueEntries
+/// entries for profiled values
+struct RawProfileHeader {
+  char Magic[8]; // "BOLTRAW\0"
+  uint32_t Version;
+  uint32_t BuildIDSize;
+  uint8_t BuildID[32];
+  uint32_t NumCounters;
+  uint32_t NumIndCallEntries;
+  uint32_t NumValueEntries;
+  uint32_t Reserved;
+};
+
+/// An observed key of an indirect call or value profiling site and its count
+struct RawProfileEntry {
+  uint32_t Site;
+  uint32_t Reserved;
+  uint64_t Key;
+  uint64_t Count;
+};
+
+/// Buffers entries of the binary profile to write them in large chunks
+struct RawProfileEntryWriter {
+  int FD;
+  uint32_t Size{0};
+  RawProfileEntry Entries[256];
+
+  RawProfileEntryWriter(int FD) : FD(FD) {}
+
+  void add(uint32_t Site, uint64_t Key, uint64_t Count) {
+    Entries[Size].Site = Site;
+    Entries[Size].Reserved = 0;
+    Entries[Size].Key = Key;
+    Entries[Size].Count = Count;
+    if (++Size == sizeof(Entries) / sizeof(Entries[0]))
+      flush();
+  }
+
+  void flush() {
+    __write(FD, Entries, Size * sizeof(RawProfileEntry));
+    Size = 0;
+  }
+};
+
+void countRawEntry(IndirectCallHashTable::MapEntry &Entry, uint32_t *Count) {
+  if (Entry.Val)
+    ++*Count;
+}
+
+void writeRawEntry(IndirectCallHashTable::MapEntry &Entry,
+                   RawProfileEntryWriter *Writer, uint32_t Site) {
+  if (Entry.Val)
+    Writer->add(Site, Entry.Key, Entry.Val);
+}
+
+/// Write to \p FD the counters and the indirect call and value profiles as is,
+/// leaving it to merge-fdata to infer edge counts and resolve names.
+void writeRawProfile(int FD, const ProfileWriterContext &Ctx) {
+  RawProfileHeader Header;
+  memSet(reinterpret_cast<char *>(&Header), 0, sizeof(Header));
+  strCopy(Header.Magic, "BOLTRAW", sizeof(Header.Magic));
+  Header.Version = 1;
+  const uint8_t *BuildID = nullptr;
+  Header.BuildIDSize = readBuildID(Ctx, BuildID);
+  if (Header.BuildIDSize > sizeof(Header.BuildID))
+    Header.BuildIDSize = sizeof(Header.BuildID);
+  for (uint32_t I = 0; I < Header.BuildIDSize; ++I)
+    Header.BuildID[I] = BuildID[I];
+  Header.NumCounters = __bolt_num_counters;
+  for (uint32_t I = 0; I < __bolt_instr_num_ind_calls; ++I)
+    GlobalIndCallCounters[I].forEachElement(countRawEntry,
+                                            &Header.NumIndCallEntries);
+  for (uint32_t I = 0; I < __bolt_instr_num_value_sites; ++I)
+    GlobalValueCounters[I].forEachElement(countRawEntry,
+                                          &Header.NumValueEntries);
+  __write(FD, &Header, sizeof(Header));
+  __write(FD, __bolt_instr_locations, __bolt_num_counters * 8);
+
+  RawProfileEntryWriter Writer(FD);
+  for (uint32_t I = 0; I < __bolt_instr_num_ind_calls; ++I)
+    GlobalIndCallCounters[I].forEachElement(writeRawEntry, &Writer, I);
+  for (uint32_t I = 0; I < __bolt_instr_num_value_sites; ++I)
+    GlobalValueCounters[I].forEachElement(writeRawEntry, &Writer, I);
+  Writer.flush();
+}
+
+/// Add the counters of all shards to the first copy of the counter array and
+/// reset the others, so the profile writer only has to look at one copy.
+/// Increments racing with the merge on other CPUs may land in a shard that was
+/// already visited and are then reported by the next dump.
+void mergeCounterShards() {
+  const uint64_t StrideInCounters = __bolt_instr_shard_stride / 8;
+  for (uint32_t S = 1; S < __bolt_instr_num_shards; ++S) {
+    uint64_t *Shard = &__bolt_instr_locations[S * StrideInCounters];
+    for (uint32_t I = 0; I < __bolt_num_counters; ++I) {
+      __bolt_instr_locations[I] += Shard[I];
+      Shard[I] = 0;
+    }
+  }
 }
 
 /// This is the entry point for profile writing.
@@ -1323,10 +1718,24 @@ extern "C" void __bolt_instr_data_dump() {
   BumpPtrAllocator HashAlloc;
   HashAlloc.setMaxSize(0x6400000);
   ProfileWriterContext Ctx = readDescriptions();
+  writeFirstCallOrder(Ctx);
+  if (__bolt_instr_binary_profile) {
+    mergeCounterShards();
+    int FD = openProfile();
+    writeRawProfile(FD, Ctx);
+    __close(FD);
+    __munmap(Ctx.MMapPtr, Ctx.MMapSize);
+    __close(Ctx.FileDesc);
+    GlobalWriteProfileMutex->release();
+    DEBUG(report("Finished writing binary profile.\n"));
+    return;
+  }
   Ctx.CallFlowTable = new (HashAlloc, 0) CallFlowHashTable(HashAlloc);
 
   DEBUG(printStats(Ctx));
 
+  mergeCounterShards();
+
   int FD = openProfile();
 
   BumpPtrAllocator Alloc;
@@ -1341,6 +1750,9 @@ extern "C" void __bolt_instr_data_dump() {
 
   writeIndirectCallProfile(FD, Ctx);
   Ctx.CallFlowTable->forEachElement(visitCallFlowEntry, FD, &Ctx);
+  // Memory event records must follow all branch records
+  writeValueProfile(FD, Ctx);
+  writeMemAccessProfile(FD, Ctx);
 
   __close(FD);
   __munmap(Ctx.MMapPtr, Ctx.MMapSize);
@@ -1376,34 +1788,143 @@ void watchProcess() {
   __exit(0);
 }
 
+/// Header of the description file written next to shared counters. It is
+/// followed by the contents of the .bolt.instr.tables note, which describe
+/// the counters the same way the profile writer uses them.
+struct SharedCountersHeader {
+  char Magic[4];        // "BSHM"
+  uint32_t Version;     // 1
+  uint32_t NumCounters; // Counters per shard
+  uint32_t NumShards;
+  uint64_t ShardStride; // Distance between shards in bytes
+  uint32_t NumFuncs;
+  uint32_t TablesSize;
+};
+
+/// Back the counters with the file named by __bolt_instr_shm_name instead of
+/// anonymous memory and write the description file "<name>.desc", so that an
+/// external collector can map the counters and snapshot them at any time.
+/// Indirect call and value profiles are not part of the mapping and still
+/// need a regular dump.
+void mapSharedCounters(uint64_t CountersStart, uint64_t Size) {
+  char Buf[BufSize];
+  char *Ptr = Buf;
+  if (__bolt_instr_shm_name[0] != '/')
+    Ptr = strCopy(Ptr, "/dev/shm/", BufSize);
+  Ptr = strCopy(Ptr, __bolt_instr_shm_name, BufSize - (Ptr - Buf + 6));
+  *Ptr = '\0';
+  uint64_t FD = __open(Buf, /*flags=*/0x242 /*O_RDWR|O_TRUNC|O_CREAT*/,
+                       /*mode=*/0666);
+  if (static_cast<int64_t>(FD) < 0) {
+    report("Error while trying to open shared counters file: ");
+    report(Buf);
+    reportNumber("\nFailed with error number: 0x",
+                 0 - static_cast<int64_t>(FD), 16);
+    __exit(1);
+  }
+  __ftruncate(FD, Size);
+  __mmap(CountersStart, Size, 0x3 /*PROT_READ|PROT_WRITE*/,
+         0x11 /*MAP_SHARED | MAP_FIXED*/, FD, 0);
+  __close(FD);
+
+  *strCopy(Ptr, ".desc", 6) = '\0';
+  FD = __open(Buf, /*flags=*/0x241 /*O_WRONLY|O_TRUNC|O_CREAT*/,
+              /*mode=*/0666);
+  if (static_cast<int64_t>(FD) < 0) {
+    report("Error while trying to open counters description file: ");
+    report(Buf);
+    reportNumber("\nFailed with error number: 0x",
+                 0 - static_cast<int64_t>(FD), 16);
+    __exit(1);
+  }
+  ProfileWriterContext Ctx = readDescriptions();
+  SharedCountersHeader Header;
+  strCopy(Header.Magic, "BSHM", 4);
+  Header.Version = 1;
+  Header.NumCounters = __bolt_num_counters;
+  Header.NumShards = __bolt_instr_num_shards;
+  Header.ShardStride = __bolt_instr_shard_stride;
+  Header.NumFuncs = __bolt_instr_num_funcs;
+  Header.TablesSize = Ctx.TablesSize;
+  __write(FD, &Header, sizeof(Header));
+  __write(FD, Ctx.Tables, Ctx.TablesSize);
+  __close(FD);
+  __munmap(Ctx.MMapPtr, Ctx.MMapSize);
+  __close(Ctx.FileDesc);
+}
+
+/// Event loop for our child process spawned during setup to switch sampled
+/// counters on and off
+void toggleSampling() {
+  timespec Burst, Pause, Rem;
+  Burst.tv_sec = __bolt_instr_sampling_burst / 1000;
+  Burst.tv_nsec = (__bolt_instr_sampling_burst % 1000) * 1000000;
+  const uint32_t PauseTime =
+      __bolt_instr_sampling_period - __bolt_instr_sampling_burst;
+  Pause.tv_sec = PauseTime / 1000;
+  Pause.tv_nsec = (PauseTime % 1000) * 1000000;
+  while (1) {
+    __nanosleep(&Burst, &Rem);
+    __bolt_instr_sampling_on = 0;
+    __nanosleep(&Pause, &Rem);
+    // Our parent process died, see watchProcess()
+    if (__getppid() == 1)
+      break;
+    __bolt_instr_sampling_on = 1;
+  }
+  DEBUG(report("My parent process is dead, bye!\n"));
+  __exit(0);
+}
+
 extern "C" void __bolt_instr_indirect_call();
 extern "C" void __bolt_instr_indirect_tailcall();
+extern "C" void __bolt_instr_value_prof();
+extern "C" void __bolt_instr_mem_access();
 
 /// Initialization code
 extern "C" void __bolt_instr_setup() {
   const uint64_t CountersStart =
       reinterpret_cast<uint64_t>(&__bolt_instr_locations[0]);
-  const uint64_t CountersEnd = alignTo(
-      reinterpret_cast<uint64_t>(&__bolt_instr_locations[__bolt_num_counters]),
-      0x1000);
+  const uint64_t CountersEnd =
+      CountersStart + __bolt_instr_shard_stride * __bolt_instr_num_shards;
   DEBUG(reportNumber("replace mmap start: ", CountersStart, 16));
   DEBUG(reportNumber("replace mmap stop: ", CountersEnd, 16));
   assert (CountersEnd > CountersStart, "no counters");
   // Maps our counters to be shared instead of private, so we keep counting for
   // forked processes
-  __mmap(CountersStart, CountersEnd - CountersStart,
-         0x3 /*PROT_READ|PROT_WRITE*/,
-         0x31 /*MAP_ANONYMOUS | MAP_SHARED | MAP_FIXED*/, -1, 0);
+  if (__bolt_instr_shm_name[0])
+    mapSharedCounters(CountersStart, CountersEnd - CountersStart);
+  else
+    __mmap(CountersStart, CountersEnd - CountersStart,
+           0x3 /*PROT_READ|PROT_WRITE*/,
+           0x31 /*MAP_ANONYMOUS | MAP_SHARED | MAP_FIXED*/, -1, 0);
+  // The mapping above cleared the flag, start with a counting burst.
+  __bolt_instr_sampling_on = 1;
 
   __bolt_trampoline_ind_call = __bolt_instr_indirect_call;
   __bolt_trampoline_ind_tailcall = __bolt_instr_indirect_tailcall;
+  __bolt_trampoline_value_prof = __bolt_instr_value_prof;
+  __bolt_trampoline_mem_access = __bolt_instr_mem_access;
   // Conservatively reserve 100MiB shared pages
   GlobalAlloc.setMaxSize(0x6400000);
   GlobalAlloc.setShared(true);
   GlobalWriteProfileMutex = new (GlobalAlloc, 0) Mutex();
+  if (__bolt_instr_merge_processes) {
+    GlobalProcesses = new (GlobalAlloc, 0) ProcessRegistry();
+    GlobalProcesses->RootPID = __getpid();
+  }
   if (__bolt_instr_num_ind_calls > 0)
     GlobalIndCallCounters =
         new (GlobalAlloc, 0) IndirectCallHashTable[__bolt_instr_num_ind_calls];
+  if (__bolt_instr_num_value_sites > 0)
+    GlobalValueCounters = new (GlobalAlloc, 0)
+        IndirectCallHashTable[__bolt_instr_num_value_sites];
+  if (__bolt_instr_num_mem_sites > 0)
+    GlobalMemAccessCounters = new (GlobalAlloc, 0)
+        IndirectCallHashTable[__bolt_instr_num_mem_sites];
+
+  if (__bolt_instr_sampling_period != 0 && !__fork())
+    toggleSampling();
 
   if (__bolt_instr_sleep_time != 0) {
     if (auto PID = __fork())
@@ -1413,9 +1934,12 @@ extern "C" void __bolt_instr_setup() {
 }
 
 extern "C" void instrumentIndirectCall(uint64_t Target, uint64_t IndCallID) {
+  if (!__bolt_instr_sampling_on)
+    return;
   GlobalIndCallCounters[IndCallID].incrementVal(Target, GlobalAlloc);
 }
 
+#if !defined(__aarch64__)
 /// We receive as in-stack arguments the identifier of the indirect call site
 /// as well as the target address for the call
 extern "C" __attribute((naked)) void __bolt_instr_indirect_call()
@@ -1431,7 +1955,9 @@ extern "C" __attribute((naked)) void __bolt_instr_indirect_call()
                        "jmp *-8(%%rsp)\n"
                        :::);
 }
+#endif
 
+#if !defined(__aarch64__)
 extern "C" __attribute((naked)) void __bolt_instr_indirect_tailcall()
 {
   __asm__ __volatile__(SAVE_ALL
@@ -1444,7 +1970,64 @@ extern "C" __attribute((naked)) void __bolt_instr_indirect_tailcall()
                        "jmp *-16(%%rsp)\n"
                        :::);
 }
+#endif
 
+extern "C" void instrumentValue(uint64_t Value, uint64_t SiteID) {
+  if (!__bolt_instr_sampling_on)
+    return;
+  // Bias by one since zero marks a vacant entry, and keep clear of the follow
+  // up table marker.
+  if (Value > 0xffffffffull)
+    Value = 0xffffffffull;
+  GlobalValueCounters[SiteID].incrementVal(Value + 1, GlobalAlloc);
+}
+
+#if !defined(__aarch64__)
+/// We receive as in-stack arguments the identifier of the value profiled call
+/// site as well as the observed value. The caller cleans up the stack.
+extern "C" __attribute((naked)) void __bolt_instr_value_prof()
+{
+  __asm__ __volatile__(SAVE_ALL
+                       "mov 0x90(%%rsp), %%rdi\n"
+                       "mov 0x88(%%rsp), %%rsi\n"
+                       "call instrumentValue\n"
+                       RESTORE_ALL
+                       "ret\n"
+                       :::);
+}
+#endif
+
+extern "C" void instrumentMemAccess(uint64_t Addr, uint64_t SiteID) {
+  if (!__bolt_instr_sampling_on)
+    return;
+  const uint32_t Countdown = MemAccessCountdown;
+  if (Countdown > 1) {
+    MemAccessCountdown = Countdown - 1;
+    return;
+  }
+  MemAccessCountdown = __bolt_instr_mem_sample_rate;
+  const int64_t Object = lookupDataObject(Addr);
+  if (Object < 0)
+    return;
+  // Bias by one since zero marks a vacant entry
+  GlobalMemAccessCounters[SiteID].incrementVal(Object + 1, GlobalAlloc);
+}
+
+#if !defined(__aarch64__)
+/// Same as __bolt_instr_value_prof(), with the accessed address as the value
+extern "C" __attribute((naked)) void __bolt_instr_mem_access()
+{
+  __asm__ __volatile__(SAVE_ALL
+                       "mov 0x90(%%rsp), %%rdi\n"
+                       "mov 0x88(%%rsp), %%rsi\n"
+                       "call instrumentMemAccess\n"
+                       RESTORE_ALL
+                       "ret\n"
+                       :::);
+}
+#endif
+
+#if !defined(__aarch64__)
 /// This is hooking ELF's entry, it needs to save all machine state.
 extern "C" __attribute((naked)) void __bolt_instr_start()
 {
@@ -1454,11 +2037,94 @@ extern "C" __attribute((naked)) void __bolt_instr_start()
                        "jmp *__bolt_instr_init_ptr(%%rip)\n"
                        :::);
 }
+#endif
+
+#if defined(__aarch64__)
+// On AArch64 the instrumented code passes the arguments of the handlers in x0
+// and x1 and saves them along with the link register. The handlers only record
+// the arguments and return, also for indirect calls, which follow the call to
+// the handler. GCC does not support naked functions on AArch64, hence these
+// are written in assembly.
+__asm__(".text\n"
+        ".global __bolt_instr_indirect_call\n"
+        ".type __bolt_instr_indirect_call, %function\n"
+        "__bolt_instr_indirect_call:\n"
+        SAVE_ALL
+        "ldp x0, x1, [sp, #" SAVED_X0_OFFSET "]\n"
+        "bl instrumentIndirectCall\n"
+        RESTORE_ALL
+        "ret\n"
+        ".size __bolt_instr_indirect_call, .-__bolt_instr_indirect_call\n");
+
+__asm__(".text\n"
+        ".global __bolt_instr_indirect_tailcall\n"
+        ".type __bolt_instr_indirect_tailcall, %function\n"
+        "__bolt_instr_indirect_tailcall:\n"
+        SAVE_ALL
+        "ldp x0, x1, [sp, #" SAVED_X0_OFFSET "]\n"
+        "bl instrumentIndirectCall\n"
+        RESTORE_ALL
+        "ret\n"
+        ".size __bolt_instr_indirect_tailcall, "
+        ".-__bolt_instr_indirect_tailcall\n");
+
+__asm__(".text\n"
+        ".global __bolt_instr_value_prof\n"
+        ".type __bolt_instr_value_prof, %function\n"
+        "__bolt_instr_value_prof:\n"
+        SAVE_ALL
+        "ldp x0, x1, [sp, #" SAVED_X0_OFFSET "]\n"
+        "bl instrumentValue\n"
+        RESTORE_ALL
+        "ret\n"
+        ".size __bolt_instr_value_prof, .-__bolt_instr_value_prof\n");
+
+__asm__(".text\n"
+        ".global __bolt_instr_mem_access\n"
+        ".type __bolt_instr_mem_access, %function\n"
+        "__bolt_instr_mem_access:\n"
+        SAVE_ALL
+        "ldp x0, x1, [sp, #" SAVED_X0_OFFSET "]\n"
+        "bl instrumentMemAccess\n"
+        RESTORE_ALL
+        "ret\n"
+        ".size __bolt_instr_mem_access, .-__bolt_instr_mem_access\n");
+
+/// This is hooking ELF's entry, it needs to save all machine state.
+__asm__(".text\n"
+        ".global __bolt_instr_start\n"
+        ".type __bolt_instr_start, %function\n"
+        "__bolt_instr_start:\n"
+        SAVE_ALL
+        "bl __bolt_instr_setup\n"
+        RESTORE_ALL
+        "adrp x16, __bolt_instr_init_ptr\n"
+        "ldr x16, [x16, #:lo12:__bolt_instr_init_ptr]\n"
+        "br x16\n"
+        ".size __bolt_instr_start, .-__bolt_instr_start\n");
+#endif
+
+/// With __bolt_instr_merge_processes, register the exit of this process and
+/// only write the profile from the root process, or from processes exiting
+/// after it that add to the counts it wrote, so a pre-fork server with many
+/// short-lived workers ends up with one profile covering all of them.
+bool shouldWriteProfile() {
+  if (!__bolt_instr_merge_processes)
+    return true;
+  __atomic_add_fetch(&GlobalProcesses->NumExited, 1, __ATOMIC_SEQ_CST);
+  if (__getpid() == GlobalProcesses->RootPID) {
+    __atomic_store_n(&GlobalProcesses->RootExited, true, __ATOMIC_SEQ_CST);
+    DEBUG(reportNumber("Processes merged into the profile: ",
+                       GlobalProcesses->NumExited, 10));
+    return true;
+  }
+  return __atomic_load_n(&GlobalProcesses->RootExited, __ATOMIC_SEQ_CST);
+}
 
 /// This is hooking into ELF's DT_FINI
 extern "C" void __bolt_instr_fini() {
   __bolt_instr_fini_ptr();
-  if (__bolt_instr_sleep_time == 0)
+  if (__bolt_instr_sleep_time == 0 && shouldWriteProfile())
     __bolt_instr_data_dump();
   DEBUG(report("Finished.\n"));
 }
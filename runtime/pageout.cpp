@@ -0,0 +1,100 @@
+//===-- pageout.cpp ---------------------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+// This file contains code that is linked to the final binary with a function
+// that is called at program entry to reclaim the cold segment laid out by
+// -cold-segment once the startup is over.
+//
+//===----------------------------------------------------------------------===//
+
+#if !defined(__APPLE__)
+
+#include "common.h"
+#include <sys/mman.h>
+
+// Function pointer to the entry of the binary, so we can resume regular
+// execution of the function that we hooked.
+extern void (*__bolt_pageout_init_ptr)();
+
+// The range of the cold segment, aligned to pages by BOLT.
+extern uint8_t *__bolt_pageout_cold_segment_start;
+extern uint8_t *__bolt_pageout_cold_segment_end;
+
+// Time to wait from the program entry before advising the cold segment.
+extern uint32_t __bolt_pageout_delay_ms;
+
+// MADV_COLD or MADV_PAGEOUT.
+extern uint32_t __bolt_pageout_advice;
+
+/// Size of the stack of the background page-out thread.
+static const size_t pageOutStackBytes = 16 * 1024;
+
+static void page_out_in_background(void *) {
+  timespec delay;
+  delay.tv_sec = __bolt_pageout_delay_ms / 1000;
+  delay.tv_nsec = (__bolt_pageout_delay_ms % 1000) * 1000000;
+  __nanosleep(&delay, nullptr);
+
+  // Kernels before 5.4 reject the advice, and the pages stay as they are.
+  // They are faulted back in from the file if the program needs them later.
+  __madvise(__bolt_pageout_cold_segment_start,
+            __bolt_pageout_cold_segment_end - __bolt_pageout_cold_segment_start,
+            __bolt_pageout_advice);
+}
+
+extern "C" void __bolt_pageout_self_impl() {
+#ifdef ENABLE_DEBUG
+  reportNumber("[pageout] cold start: ",
+               (uint64_t)__bolt_pageout_cold_segment_start, 16);
+  reportNumber("[pageout] cold end: ",
+               (uint64_t)__bolt_pageout_cold_segment_end, 16);
+#endif
+  if (__bolt_pageout_cold_segment_start == __bolt_pageout_cold_segment_end)
+    return;
+
+  uint8_t *stack = reinterpret_cast<uint8_t *>(
+      __mmap(0, pageOutStackBytes, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+  if (reinterpret_cast<uint64_t>(stack) > static_cast<uint64_t>(-4096))
+    return;
+
+  // Start the thread with all signals blocked. Their handlers would run
+  // without the thread state that libc expects. The stack is not freed when
+  // the thread exits.
+  const uint64_t all = ~0ULL;
+  uint64_t old;
+  __sigprocmask(2 /*SIG_SETMASK*/, &all, &old);
+  const int64_t tid = __clone_thread(page_out_in_background, nullptr,
+                                     stack + pageOutStackBytes);
+  __sigprocmask(2 /*SIG_SETMASK*/, &old, nullptr);
+  if (tid < 0)
+    __munmap(stack, pageOutStackBytes);
+}
+
+/// This is hooking ELF's entry, it needs to save all machine state.
+#if defined(__aarch64__)
+__asm__(".text\n"
+        ".global __bolt_pageout_self\n"
+        ".type __bolt_pageout_self, %function\n"
+        "__bolt_pageout_self:\n"
+        SAVE_ALL
+        "bl __bolt_pageout_self_impl\n"
+        RESTORE_ALL
+        "adrp x16, __bolt_pageout_init_ptr\n"
+        "ldr x16, [x16, #:lo12:__bolt_pageout_init_ptr]\n"
+        "br x16\n"
+        ".size __bolt_pageout_self, .-__bolt_pageout_self\n");
+#else
+extern "C" __attribute((naked)) void __bolt_pageout_self() {
+  __asm__ __volatile__(SAVE_ALL
+                       "call __bolt_pageout_self_impl\n"
+                       RESTORE_ALL
+                       "jmp *__bolt_pageout_init_ptr(%%rip)\n"
+                       :::);
+}
+#endif
+
+#endif
@@ -0,0 +1,77 @@
+//===-- prefetch.cpp --------------------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+// This file contains code that is linked to the final binary with a function
+// that is called at program entry to read the hot and startup code ahead of
+// its execution.
+//
+//===----------------------------------------------------------------------===//
+
+#if !defined(__APPLE__)
+
+#include "common.h"
+#include <sys/mman.h>
+
+// Function pointer to the entry of the binary, so we can resume regular
+// execution of the function that we hooked.
+extern void (*__bolt_prefetch_init_ptr)();
+
+// The __hot_start and __hot_end symbols set by Bolt. The functions are laid
+// out between them in the order of the profile, followed by the startup
+// functions with -reorder-functions=temporal.
+extern uint64_t __hot_start;
+extern uint64_t __hot_end;
+
+// If true, also map the pages instead of only reading them into the page
+// cache.
+extern bool __bolt_prefetch_populate;
+
+extern "C" void __bolt_prefetch_self_impl() {
+  // Align to the largest base page size, 64KB on AArch64.
+  const uint64_t pageBytes = 64 * 1024;
+  uint8_t *from = (uint8_t *)&__hot_start;
+  from -= (intptr_t)from & (pageBytes - 1);
+  uint8_t *to = (uint8_t *)&__hot_end + (pageBytes - 1);
+  to -= (intptr_t)to & (pageBytes - 1);
+
+#ifdef ENABLE_DEBUG
+  reportNumber("[prefetch] from: ", (uint64_t)from, 16);
+  reportNumber("[prefetch] to: ", (uint64_t)to, 16);
+#endif
+
+  // MADV_POPULATE_READ waits for the reads and avoids the page faults as well.
+  // Older kernels reject it, and the range is only read ahead then.
+  if (__bolt_prefetch_populate &&
+      !__madvise(from, to - from, 22 /*MADV_POPULATE_READ*/))
+    return;
+  // Errors are ignored. The code will be faulted in as usual.
+  __madvise(from, to - from, MADV_WILLNEED);
+}
+
+/// This is hooking ELF's entry, it needs to save all machine state.
+#if defined(__aarch64__)
+__asm__(".text\n"
+        ".global __bolt_prefetch_self\n"
+        ".type __bolt_prefetch_self, %function\n"
+        "__bolt_prefetch_self:\n"
+        SAVE_ALL
+        "bl __bolt_prefetch_self_impl\n"
+        RESTORE_ALL
+        "adrp x16, __bolt_prefetch_init_ptr\n"
+        "ldr x16, [x16, #:lo12:__bolt_prefetch_init_ptr]\n"
+        "br x16\n"
+        ".size __bolt_prefetch_self, .-__bolt_prefetch_self\n");
+#else
+extern "C" __attribute((naked)) void __bolt_prefetch_self() {
+  __asm__ __volatile__(SAVE_ALL
+                       "call __bolt_prefetch_self_impl\n"
+                       RESTORE_ALL
+                       "jmp *__bolt_prefetch_init_ptr(%%rip)\n"
+                       :::);
+}
+#endif
+
+#endif
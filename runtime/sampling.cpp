@@ -0,0 +1,350 @@
+//===-- sampling.cpp --------------------------------------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+// This file contains code that is linked to the final binary to sample it with
+// a profiling timer, and a function that is called at program exit to write
+// the samples as a pre-aggregated profile for perf2bolt -pa.
+//
+//===----------------------------------------------------------------------===//
+//
+// Each sample counts the interrupted address, written as a fall-through range
+// of one address ("F <addr> <addr> <count>"), and walks up to
+// __bolt_sampling_depth frame pointers to count one call edge per frame
+// ("B <call site> <callee> <count> 0"). Call edges need the binary to be
+// built with frame pointers. Addresses are translated to the input binary
+// with the function ranges emitted by BOLT, so the profile can be used
+// without -enable-bat. Offsets in functions that BOLT rewrote are only
+// approximate, which is fine for function ordering.
+//
+//===----------------------------------------------------------------------===//
+
+#if !defined(__APPLE__)
+
+#include "common.h"
+
+// Function pointers to init/fini routines in the binary, so we can resume
+// regular execution of the functions that we hooked.
+extern void (*__bolt_sampling_init_ptr)();
+extern void (*__bolt_sampling_fini_ptr)();
+
+/// Address range of a function or fragment in the output and the address
+/// range it corresponds to in the input.
+struct FunctionRange {
+  uint64_t OutputStart;
+  uint64_t OutputEnd;
+  uint64_t InputAddress;
+  uint64_t InputSize;
+};
+
+// Function ranges written by BOLT in no particular order, sorted at startup.
+extern FunctionRange __bolt_sampling_funcs[];
+extern uint32_t __bolt_sampling_num_funcs;
+// CPU time between samples in microseconds
+extern uint32_t __bolt_sampling_interval;
+// Maximum number of frames walked per sample
+extern uint32_t __bolt_sampling_depth;
+// Filename to write the profile to
+extern char __bolt_sampling_filename[];
+
+namespace {
+
+/// Open addressing hash table of counters, updated from the signal handler of
+/// any thread. Keys are never removed and are inserted with a CAS from the
+/// empty key 0.
+struct CounterTable {
+  static constexpr uint32_t Size = 1 << 16;
+  static constexpr uint32_t MaxProbes = 32;
+
+  struct Entry {
+    uint64_t Key;
+    uint64_t Count;
+  };
+  Entry Entries[Size];
+  /// Number of samples lost because the table was too full
+  uint64_t Dropped;
+
+  void increment(uint64_t Key) {
+    const uint64_t Hash = Key * 0x9e3779b97f4a7c15ull;
+    for (uint32_t Probe = 0; Probe < MaxProbes; ++Probe) {
+      Entry &E = Entries[((Hash >> 48) + Probe) & (Size - 1)];
+      uint64_t Current = __atomic_load_n(&E.Key, __ATOMIC_RELAXED);
+      if (Current == 0 &&
+          __atomic_compare_exchange_n(&E.Key, &Current, Key, false,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        Current = Key;
+      if (Current == Key) {
+        __atomic_add_fetch(&E.Count, 1, __ATOMIC_RELAXED);
+        return;
+      }
+    }
+    __atomic_add_fetch(&Dropped, 1, __ATOMIC_RELAXED);
+  }
+};
+
+/// Initialize with number 1 instead of 0 so we don't go into .bss. The tables
+/// are allocated by __bolt_sampling_setup in memory shared with forked
+/// processes, so that whoever exits last writes all the samples.
+CounterTable *Samples{reinterpret_cast<CounterTable *>(1)};
+CounterTable *CallEdges{reinterpret_cast<CounterTable *>(1)};
+
+/// Frame pointers further than this above the stack pointer are not trusted.
+constexpr uint64_t MaxStackBytes = 8 << 20;
+
+/// Sort the function ranges by output address with a heap sort, which needs
+/// neither recursion nor extra memory.
+void sortFunctions() {
+  FunctionRange *Ranges = __bolt_sampling_funcs;
+  const uint32_t N = __bolt_sampling_num_funcs;
+  auto siftDown = [&](uint32_t Root, uint32_t End) {
+    while (2 * Root + 1 < End) {
+      uint32_t Child = 2 * Root + 1;
+      if (Child + 1 < End &&
+          Ranges[Child].OutputStart < Ranges[Child + 1].OutputStart)
+        ++Child;
+      if (Ranges[Root].OutputStart >= Ranges[Child].OutputStart)
+        return;
+      const FunctionRange Tmp = Ranges[Root];
+      Ranges[Root] = Ranges[Child];
+      Ranges[Child] = Tmp;
+      Root = Child;
+    }
+  };
+  for (uint32_t I = N / 2; I > 0; --I)
+    siftDown(I - 1, N);
+  for (uint32_t End = N; End > 1; --End) {
+    const FunctionRange Tmp = Ranges[0];
+    Ranges[0] = Ranges[End - 1];
+    Ranges[End - 1] = Tmp;
+    siftDown(0, End - 1);
+  }
+}
+
+/// Return the range of the function containing \p Address or null if it is
+/// not in the binary.
+const FunctionRange *findFunction(uint64_t Address) {
+  uint32_t Low = 0;
+  uint32_t High = __bolt_sampling_num_funcs;
+  while (Low < High) {
+    const uint32_t Mid = Low + (High - Low) / 2;
+    if (__bolt_sampling_funcs[Mid].OutputStart <= Address)
+      Low = Mid + 1;
+    else
+      High = Mid;
+  }
+  if (Low == 0 || Address >= __bolt_sampling_funcs[Low - 1].OutputEnd)
+    return nullptr;
+  return &__bolt_sampling_funcs[Low - 1];
+}
+
+/// Translate \p Address in \p Function to the input binary.
+uint64_t getInputAddress(const FunctionRange &Function, uint64_t Address) {
+  const uint64_t Offset = Address - Function.OutputStart;
+  return Function.InputAddress +
+         (Offset < Function.InputSize ? Offset : Function.InputSize - 1);
+}
+
+/// Return the address of the call instruction returning to \p ReturnAddress.
+uint64_t getCallSite(uint64_t ReturnAddress) {
+#if defined(__aarch64__)
+  return ReturnAddress - 4;
+#else
+  const uint8_t *Return = reinterpret_cast<const uint8_t *>(ReturnAddress);
+  // call rel32
+  if (Return[-5] == 0xe8)
+    return ReturnAddress - 5;
+  // call with a register or memory operand, ff /2, by increasing size
+  const uint32_t Sizes[] = {2, 3, 6, 7};
+  for (const uint32_t Size : Sizes) {
+    if (Return[-Size] == 0xff && ((Return[1 - Size] >> 3) & 7) == 2)
+      return ReturnAddress - Size;
+  }
+  return ReturnAddress - 1;
+#endif
+}
+
+/// SIGPROF handler recording the interrupted address and the call edges on
+/// the stack of the interrupted thread.
+void handleSample(int, void *, void *Context) {
+  const uint8_t *UContext = reinterpret_cast<const uint8_t *>(Context);
+  auto getRegister = [&](uint32_t Offset) {
+    return *reinterpret_cast<const uint64_t *>(UContext + Offset);
+  };
+  // Offsets of the registers in the ucontext_t of the kernel
+#if defined(__aarch64__)
+  const uint64_t PC = getRegister(440);
+  const uint64_t SP = getRegister(432);
+  uint64_t FP = getRegister(416);
+#else
+  const uint64_t PC = getRegister(168);
+  const uint64_t SP = getRegister(160);
+  uint64_t FP = getRegister(120);
+#endif
+
+  const FunctionRange *Callee = findFunction(PC);
+  if (!Callee)
+    return;
+  Samples->increment(getInputAddress(*Callee, PC));
+
+  for (uint32_t Depth = 0; Depth < __bolt_sampling_depth; ++Depth) {
+    if (FP < SP || FP - SP >= MaxStackBytes || (FP & 7))
+      return;
+    const uint64_t *Frame = reinterpret_cast<const uint64_t *>(FP);
+    const uint64_t ReturnAddress = Frame[1];
+    const FunctionRange *Caller = findFunction(ReturnAddress);
+    if (!Caller)
+      return;
+    const uint64_t From =
+        getInputAddress(*Caller, getCallSite(ReturnAddress));
+    const uint64_t To = Callee->InputAddress;
+    // Both addresses are packed in the key.
+    if ((From >> 32) || (To >> 32))
+      return;
+    CallEdges->increment(From << 32 | To);
+    Callee = Caller;
+    if (Frame[0] <= FP)
+      return;
+    FP = Frame[0];
+  }
+}
+
+#if !defined(__aarch64__)
+/// Without SA_RESTORER, x86-64 kernels do not know how to return from the
+/// handler.
+extern "C" void __bolt_sampling_sigreturn();
+__asm__(".text\n"
+        "__bolt_sampling_sigreturn:\n"
+        "movq $15, %rax\n"
+        "syscall\n");
+#endif
+
+/// Buffers the lines of the profile to write them in large chunks
+struct ProfileWriter {
+  int FD;
+  uint32_t Size{0};
+  char Buf[4096];
+
+  ProfileWriter(int FD) : FD(FD) {}
+
+  void add(const char *Type, uint64_t From, uint64_t To, uint64_t Count,
+           bool Mispreds) {
+    if (Size + 80 > sizeof(Buf))
+      flush();
+    char *Ptr = Buf + Size;
+    Ptr = strCopy(Ptr, Type);
+    Ptr = intToStr(Ptr, From, 16);
+    *Ptr++ = ' ';
+    Ptr = intToStr(Ptr, To, 16);
+    *Ptr++ = ' ';
+    Ptr = intToStr(Ptr, Count, 10);
+    if (Mispreds)
+      Ptr = strCopy(Ptr, " 0");
+    *Ptr++ = '\n';
+    Size = Ptr - Buf;
+  }
+
+  void flush() {
+    __write(FD, Buf, Size);
+    Size = 0;
+  }
+};
+
+void writeProfile() {
+  const int64_t FD = __open(__bolt_sampling_filename,
+                            /*flags=*/0x241 /*O_WRONLY|O_TRUNC|O_CREAT*/,
+                            /*mode=*/0666);
+  if (FD < 0) {
+    report("Error while trying to open profile file for writing: ");
+    report(__bolt_sampling_filename);
+    reportNumber("\nFailed with error number: 0x", -FD, 16);
+    return;
+  }
+  ProfileWriter Writer(FD);
+  for (const auto &E : CallEdges->Entries)
+    if (E.Key)
+      Writer.add("B ", E.Key >> 32, E.Key & 0xffffffff, E.Count, true);
+  for (const auto &E : Samples->Entries)
+    if (E.Key)
+      Writer.add("F ", E.Key, E.Key, E.Count, false);
+  Writer.flush();
+  __close(FD);
+  if (const uint64_t Dropped = Samples->Dropped + CallEdges->Dropped)
+    reportNumber("BOLT sampling runtime: dropped samples: ", Dropped, 10);
+}
+
+} // anonymous namespace
+
+extern "C" void __bolt_sampling_setup() {
+  sortFunctions();
+  Samples = reinterpret_cast<CounterTable *>(
+      __mmap(0, sizeof(CounterTable), 0x3 /*PROT_READ|PROT_WRITE*/,
+             0x21 /*MAP_SHARED | MAP_ANONYMOUS*/, -1, 0));
+  CallEdges = reinterpret_cast<CounterTable *>(
+      __mmap(0, sizeof(CounterTable), 0x3 /*PROT_READ|PROT_WRITE*/,
+             0x21 /*MAP_SHARED | MAP_ANONYMOUS*/, -1, 0));
+
+  struct {
+    void (*Handler)(int, void *, void *);
+    uint64_t Flags;
+    void (*Restorer)();
+    uint64_t Mask;
+  } Action;
+  Action.Handler = handleSample;
+  Action.Flags = 0x4 /*SA_SIGINFO*/ | 0x10000000 /*SA_RESTART*/;
+#if defined(__aarch64__)
+  Action.Restorer = nullptr;
+#else
+  Action.Flags |= 0x04000000 /*SA_RESTORER*/;
+  Action.Restorer = __bolt_sampling_sigreturn;
+#endif
+  Action.Mask = 0;
+  if (__sigaction(27 /*SIGPROF*/, &Action, nullptr)) {
+    report("BOLT sampling runtime: failed to install the SIGPROF handler\n");
+    return;
+  }
+
+  struct {
+    uint64_t IntervalSec;
+    uint64_t IntervalUsec;
+    uint64_t ValueSec;
+    uint64_t ValueUsec;
+  } Timer;
+  Timer.IntervalSec = Timer.ValueSec = __bolt_sampling_interval / 1000000;
+  Timer.IntervalUsec = Timer.ValueUsec = __bolt_sampling_interval % 1000000;
+  __setitimer(2 /*ITIMER_PROF*/, &Timer, nullptr);
+}
+
+/// This is hooking into ELF's DT_FINI
+extern "C" void __bolt_sampling_fini() {
+  __bolt_sampling_fini_ptr();
+  const uint64_t Disarm[4] = {0, 0, 0, 0};
+  __setitimer(2 /*ITIMER_PROF*/, Disarm, nullptr);
+  writeProfile();
+}
+
+/// This is hooking ELF's entry, it needs to save all machine state.
+#if defined(__aarch64__)
+__asm__(".text\n"
+        ".global __bolt_sampling_start\n"
+        ".type __bolt_sampling_start, %function\n"
+        "__bolt_sampling_start:\n"
+        SAVE_ALL
+        "bl __bolt_sampling_setup\n"
+        RESTORE_ALL
+        "adrp x16, __bolt_sampling_init_ptr\n"
+        "ldr x16, [x16, #:lo12:__bolt_sampling_init_ptr]\n"
+        "br x16\n"
+        ".size __bolt_sampling_start, .-__bolt_sampling_start\n");
+#else
+extern "C" __attribute((naked)) void __bolt_sampling_start() {
+  __asm__ __volatile__(SAVE_ALL
+                       "call __bolt_sampling_setup\n"
+                       RESTORE_ALL
+                       "jmp *__bolt_sampling_init_ptr(%%rip)\n"
+                       :::);
+}
+#endif
+
+#endif
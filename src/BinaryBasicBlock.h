@@ -130,6 +130,10 @@ private:
   /// Indicates if the block could be outlined.
   bool CanOutline{true};
 
+  /// Indicates if the block is the first one of a hot loop in the layout,
+  /// i.e. the target of the loop back edge that should be aligned.
+  bool IsLoopTop{false};
+
   /// Flag to indicate whether this block is valid or not.  Invalid
   /// blocks may contain out of date or incorrect information.
   bool IsValid{true};
@@ -712,6 +716,14 @@ public:
     IsCold = Flag;
   }
 
+  bool isLoopTop() const {
+    return IsLoopTop;
+  }
+
+  void setIsLoopTop(const bool Flag) {
+    IsLoopTop = Flag;
+  }
+
   /// Return true if the block can be outlined. At the moment we disallow
   /// outlining of blocks that can potentially throw exceptions or are
   /// the beginning of a landing pad. The entry basic block also can
@@ -752,6 +764,13 @@ public:
     NumPseudos = 0;
   }
 
+  /// Release unused capacity of the instruction storage. Instructions are
+  /// appended one at a time while the CFG is built, leaving the vector with
+  /// up to twice the memory it needs.
+  void shrinkInstructions() {
+    Instructions.shrink_to_fit();
+  }
+
   /// Retrieve iterator for \p Inst or return end iterator if instruction is not
   /// from this basic block.
   decltype(Instructions)::iterator findInstruction(const MCInst *Inst) {
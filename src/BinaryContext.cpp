@@ -44,6 +44,7 @@ extern cl::OptionCategory BoltCategory;
 extern cl::opt<bool> AggregateOnly;
 extern cl::opt<bool> HotText;
 extern cl::opt<bool> HotData;
+extern cl::opt<bool> NoThreads;
 extern cl::opt<bool> StrictMode;
 extern cl::opt<bool> UseOldText;
 extern cl::opt<unsigned> Verbosity;
@@ -507,15 +508,22 @@ BinaryContext::analyzeMemoryAt(uint64_t Address, BinaryFunction &BF) {
   if (Section->isText())
     return MemoryContentsType::UNKNOWN;
 
+  // The classification only depends on the function being disassembled and
+  // on the data, hence it is memoized until the end of disassembly.
+  auto MCI = BF.MemoryContents.find(Address);
+  if (MCI != BF.MemoryContents.end())
+    return MCI->second;
+
   // Start with checking for PIC jump table. We expect non-PIC jump tables
   // to have high 32 bits set to 0.
+  auto Type = MemoryContentsType::UNKNOWN;
   if (analyzeJumpTable(Address, JumpTable::JTT_PIC, BF))
-    return MemoryContentsType::POSSIBLE_PIC_JUMP_TABLE;
-
-  if (analyzeJumpTable(Address, JumpTable::JTT_NORMAL, BF))
-    return MemoryContentsType::POSSIBLE_JUMP_TABLE;
+    Type = MemoryContentsType::POSSIBLE_PIC_JUMP_TABLE;
+  else if (analyzeJumpTable(Address, JumpTable::JTT_NORMAL, BF))
+    Type = MemoryContentsType::POSSIBLE_JUMP_TABLE;
 
-  return MemoryContentsType::UNKNOWN;
+  BF.MemoryContents.emplace(Address, Type);
+  return Type;
 }
 
 bool BinaryContext::analyzeJumpTable(const uint64_t Address,
@@ -777,6 +785,8 @@ MCSymbol *BinaryContext::getOrCreateGlobalSymbol(uint64_t Address,
 BinaryFunction *BinaryContext::createBinaryFunction(
     const std::string &Name, BinarySection &Section, uint64_t Address,
     uint64_t Size, uint64_t SymbolSize, uint16_t Alignment) {
+  FunctionIndexAddresses.clear();
+  FunctionIndexFunctions.clear();
   auto Result = BinaryFunctions.emplace(
       Address, BinaryFunction(Name, Section, Address, Size, *this));
   assert(Result.second == true && "unexpected duplicate function");
@@ -1234,17 +1244,13 @@ void BinaryContext::foldFunction(BinaryFunction &ChildBF,
 
   std::unique_lock<std::shared_timed_mutex> WriteCtxLock(CtxMutex,
                                                          std::defer_lock);
-  std::unique_lock<std::shared_timed_mutex> WriteSymbolMapLock(
-      SymbolToFunctionMapMutex, std::defer_lock);
 
   const auto ChildName = ChildBF.getOneName();
 
   // Move symbols over and update bookkeeping info.
   for (auto *Symbol : ChildBF.getSymbols()) {
     ParentBF.getSymbols().push_back(Symbol);
-    WriteSymbolMapLock.lock();
-    SymbolToFunctionMap[Symbol] = &ParentBF;
-    WriteSymbolMapLock.unlock();
+    setSymbolToFunctionMap(Symbol, &ParentBF);
     // NB: there's no need to update BinaryDataMap and GlobalSymbols.
   }
   ChildBF.getSymbols().clear();
@@ -1273,6 +1279,7 @@ void BinaryContext::foldFunction(BinaryFunction &ChildBF,
     assert(&ChildBF == &FI->second && "function mismatch");
 
     WriteBfsLock.lock();
+    removeFromFunctionIndex(ChildBF.getAddress());
     FI = BinaryFunctions.erase(FI);
     WriteBfsLock.unlock();
 
@@ -1385,7 +1392,7 @@ unsigned BinaryContext::addDebugFilenameToUnit(const uint32_t DestCUID,
                                                const uint32_t SrcCUID,
                                                unsigned FileIndex) {
   auto SrcUnit = DwCtx->getCompileUnitForOffset(SrcCUID);
-  auto LineTable = DwCtx->getLineTableForUnit(SrcUnit);
+  auto LineTable = getLineTableForUnit(SrcUnit);
   const auto &FileNames = LineTable->Prologue.FileNames;
   // Dir indexes start at 1, as DWARF file numbers, and a dir index 0
   // means empty dir.
@@ -1414,6 +1421,10 @@ std::vector<BinaryFunction *> BinaryContext::getSortedFunctions() {
                  [](std::pair<const uint64_t, BinaryFunction> &BFI) {
                    return &BFI.second;
                  });
+  for (auto *BF : InjectedBinaryFunctions) {
+    if (BF->hasValidIndex())
+      SortedFunctions.push_back(BF);
+  }
 
   std::stable_sort(SortedFunctions.begin(), SortedFunctions.end(),
                    [] (const BinaryFunction *A, const BinaryFunction *B) {
@@ -1439,6 +1450,25 @@ std::vector<BinaryFunction *> BinaryContext::getAllBinaryFunctions() {
   return AllFunctions;
 }
 
+namespace {
+
+/// Return the offset of the line table of \p Unit in its line section.
+Optional<uint32_t> getLineTableOffset(DWARFUnit &Unit) {
+  auto Offset =
+      dwarf::toSectionOffset(Unit.getUnitDIE().find(dwarf::DW_AT_stmt_list));
+  if (!Offset)
+    return NoneType();
+  return *Offset + Unit.getLineTableOffset();
+}
+
+DWARFDataExtractor getLineData(const DWARFContext &DwCtx,
+                               const DWARFUnit &Unit) {
+  return DWARFDataExtractor(DwCtx.getDWARFObj(), Unit.getLineSection(),
+                            DwCtx.isLittleEndian(), Unit.getAddressByteSize());
+}
+
+} // anonymous namespace
+
 void BinaryContext::preprocessDebugInfo() {
   struct CURange {
     uint64_t LowPC;
@@ -1475,12 +1505,19 @@ void BinaryContext::preprocessDebugInfo() {
     }
   }
 
-  // Populate MCContext with DWARF files from all units.
+  // Populate MCContext with DWARF files from all units. The file names are
+  // in the headers of line tables, and the line programs of units that are
+  // not processed are only decoded if they are needed.
   for (const auto &CU : DwCtx->compile_units()) {
     const uint32_t CUID = CU->getOffset();
-    const DWARFDebugLine::LineTable *LineTable =
-      DwCtx->getLineTableForUnit(CU.get());
-    const auto &FileNames = LineTable->Prologue.FileNames;
+    DWARFDebugLine::Prologue Prologue;
+    auto Offset = getLineTableOffset(*CU);
+    if (Offset) {
+      auto LineData = getLineData(*DwCtx, *CU);
+      if (!Prologue.parse(LineData, Offset.getPointer(), *DwCtx, CU.get()))
+        Prologue.clear();
+    }
+    const auto &FileNames = Prologue.FileNames;
     // Make sure empty debug line tables are registered too.
     if (FileNames.empty()) {
       cantFail(Ctx->getDwarfFile("", "<unknown>", 0, nullptr, None, CUID));
@@ -1492,7 +1529,7 @@ void BinaryContext::preprocessDebugInfo() {
       StringRef Dir = "";
       if (FileNames[I].DirIdx != 0)
         if (auto DirName =
-                LineTable->Prologue.IncludeDirectories[FileNames[I].DirIdx - 1]
+                Prologue.IncludeDirectories[FileNames[I].DirIdx - 1]
                     .getAsCString())
           Dir = *DirName;
       StringRef FileName = "";
@@ -1504,6 +1541,46 @@ void BinaryContext::preprocessDebugInfo() {
   }
 }
 
+void BinaryContext::parseLineTables() {
+  for (auto &BFI : BinaryFunctions) {
+    auto &Function = BFI.second;
+    if (Function.isIgnored() || !Function.getDWARFUnit())
+      continue;
+    auto &LineTable = LineTables[Function.getDWARFUnit()];
+    if (!LineTable)
+      LineTable = llvm::make_unique<DWARFDebugLine::LineTable>();
+  }
+
+  // Every unit is parsed into its own table, independently of DwCtx.
+  auto parseUnit = [&](DWARFUnit *Unit,
+                       DWARFDebugLine::LineTable *LineTable) {
+    auto Offset = getLineTableOffset(*Unit);
+    if (!Offset)
+      return;
+    auto LineData = getLineData(*DwCtx, *Unit);
+    if (!LineTable->parse(LineData, Offset.getPointer(), *DwCtx, Unit))
+      LineTable->clear();
+  };
+
+  if (opts::NoThreads) {
+    for (auto &UnitTable : LineTables)
+      parseUnit(UnitTable.first, UnitTable.second.get());
+  } else {
+    auto &ThreadPool = ParallelUtilities::getThreadPool();
+    for (auto &UnitTable : LineTables)
+      ThreadPool.async(parseUnit, UnitTable.first, UnitTable.second.get());
+    ThreadPool.wait();
+  }
+}
+
+const DWARFDebugLine::LineTable *
+BinaryContext::getLineTableForUnit(DWARFUnit *Unit) const {
+  auto I = LineTables.find(Unit);
+  if (I != LineTables.end())
+    return I->second.get();
+  return DwCtx->getLineTableForUnit(Unit);
+}
+
 bool BinaryContext::shouldEmit(const BinaryFunction &Function) const {
   if (opts::processAllFunctions())
     return true;
@@ -1881,9 +1958,10 @@ void BinaryContext::markAmbiguousRelocations(BinaryData &BD,
 
 BinaryFunction *BinaryContext::getFunctionForSymbol(const MCSymbol *Symbol,
                                                     uint64_t *EntryDesc) {
-  std::shared_lock<std::shared_timed_mutex> Lock(SymbolToFunctionMapMutex);
-  auto BFI = SymbolToFunctionMap.find(Symbol);
-  if (BFI == SymbolToFunctionMap.end())
+  auto &Shard = getSymbolToFunctionMapShard(Symbol);
+  std::shared_lock<std::shared_timed_mutex> Lock(Shard.Mutex);
+  auto BFI = Shard.Map.find(Symbol);
+  if (BFI == Shard.Map.end())
     return nullptr;
 
   auto *BF = BFI->second;
@@ -2027,22 +2105,55 @@ uint64_t BinaryContext::getHotThreshold() const {
   return Threshold;
 }
 
+void BinaryContext::buildFunctionIndex() {
+  FunctionIndexAddresses.clear();
+  FunctionIndexFunctions.clear();
+  FunctionIndexAddresses.reserve(BinaryFunctions.size());
+  FunctionIndexFunctions.reserve(BinaryFunctions.size());
+  for (auto &BFI : BinaryFunctions) {
+    FunctionIndexAddresses.push_back(BFI.first);
+    FunctionIndexFunctions.push_back(&BFI.second);
+  }
+}
+
+void BinaryContext::removeFromFunctionIndex(uint64_t Address) {
+  auto AI = std::lower_bound(FunctionIndexAddresses.begin(),
+                             FunctionIndexAddresses.end(), Address);
+  if (AI != FunctionIndexAddresses.end() && *AI == Address)
+    FunctionIndexFunctions[AI - FunctionIndexAddresses.begin()] = nullptr;
+}
+
 BinaryFunction *
 BinaryContext::getBinaryFunctionContainingAddress(uint64_t Address,
                                                   bool CheckPastEnd,
                                                   bool UseMaxSize) {
-  auto FI = BinaryFunctions.upper_bound(Address);
-  if (FI == BinaryFunctions.begin())
+  BinaryFunction *BF = nullptr;
+  uint64_t StartAddress = 0;
+  if (!FunctionIndexAddresses.empty()) {
+    auto AI = std::upper_bound(FunctionIndexAddresses.begin(),
+                               FunctionIndexAddresses.end(), Address);
+    // Skip removed functions the same way the map lookup would.
+    for (auto I = AI - FunctionIndexAddresses.begin(); I > 0 && !BF; --I) {
+      BF = FunctionIndexFunctions[I - 1];
+      StartAddress = FunctionIndexAddresses[I - 1];
+    }
+  } else {
+    auto FI = BinaryFunctions.upper_bound(Address);
+    if (FI != BinaryFunctions.begin()) {
+      --FI;
+      BF = &FI->second;
+      StartAddress = FI->first;
+    }
+  }
+  if (!BF)
     return nullptr;
-  --FI;
 
-  const auto UsedSize = UseMaxSize ? FI->second.getMaxSize()
-                                   : FI->second.getSize();
+  const auto UsedSize = UseMaxSize ? BF->getMaxSize() : BF->getSize();
 
-  if (Address >= FI->first + UsedSize + (CheckPastEnd ? 1 : 0))
+  if (Address >= StartAddress + UsedSize + (CheckPastEnd ? 1 : 0))
     return nullptr;
 
-  return &FI->second;
+  return BF;
 }
 
 BinaryFunction *
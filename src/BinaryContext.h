@@ -46,6 +46,9 @@
 #include "llvm/Support/ErrorOr.h"
 #include "llvm/Support/TargetRegistry.h"
 #include "llvm/Support/raw_ostream.h"
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <functional>
 #include <map>
 #include <set>
@@ -54,6 +57,7 @@
 #include <system_error>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 namespace llvm {
@@ -187,6 +191,15 @@ class BinaryContext {
   /// A mutex that is used to control parallel accesses to BinaryFunctions
   mutable std::shared_timed_mutex BinaryFunctionsMutex;
 
+  /// Start addresses of functions in BinaryFunctions, and the functions at
+  /// the same positions in FunctionIndexFunctions. The index is built by
+  /// buildFunctionIndex() once function discovery is complete and serves
+  /// containing-address queries with a binary search over a contiguous array.
+  /// Functions removed from BinaryFunctions afterwards are left as null
+  /// entries. Creating a function discards the index.
+  std::vector<uint64_t> FunctionIndexAddresses;
+  std::vector<BinaryFunction *> FunctionIndexFunctions;
+
   /// Functions injected by BOLT
   std::vector<BinaryFunction *> InjectedBinaryFunctions;
 
@@ -295,6 +308,14 @@ public:
                                                      bool CheckPastEnd = false,
                                                      bool UseMaxSize = false);
 
+  /// Build the index used by getBinaryFunctionContainingAddress(). Should be
+  /// called once all functions are created.
+  void buildFunctionIndex();
+
+  /// Remove the function starting at \p Address from the function index
+  /// before it is erased from BinaryFunctions.
+  void removeFromFunctionIndex(uint64_t Address);
+
   /// Return a BinaryFunction that starts at a given \p Address.
   BinaryFunction *getBinaryFunctionAtAddress(uint64_t Address);
 
@@ -339,15 +360,28 @@ public:
     }
   }
 
+  /// A part of [MCSymbol] -> [BinaryFunction] map together with the mutex
+  /// that is used to control parallel accesses to it.
+  struct SymbolToFunctionMapShard {
+    std::unordered_map<const MCSymbol *, BinaryFunction *> Map;
+    mutable std::shared_timed_mutex Mutex;
+  };
+
   /// [MCSymbol] -> [BinaryFunction]
   ///
   /// As we fold identical functions, multiple symbols can point
-  /// to the same BinaryFunction.
-  std::unordered_map<const MCSymbol *,
-                     BinaryFunction *> SymbolToFunctionMap;
+  /// to the same BinaryFunction. The map is split into shards by symbol, so
+  /// that threads looking up different symbols rarely share a lock.
+  static constexpr unsigned NumSymbolToFunctionMapShards = 64;
+  std::array<SymbolToFunctionMapShard, NumSymbolToFunctionMapShards>
+      SymbolToFunctionMap;
 
-  /// A mutex that is used to control parallel accesses to SymbolToFunctionMap
-  mutable std::shared_timed_mutex SymbolToFunctionMapMutex;
+  SymbolToFunctionMapShard &
+  getSymbolToFunctionMapShard(const MCSymbol *Symbol) {
+    // Symbols are allocated with at least 8-byte alignment.
+    const auto Key = reinterpret_cast<uintptr_t>(Symbol) >> 3;
+    return SymbolToFunctionMap[Key % NumSymbolToFunctionMapShards];
+  }
 
   /// Look up the symbol entry that contains the given \p Address (based on
   /// the start address and size for each symbol).  Returns a pointer to
@@ -483,6 +517,17 @@ public:
 
   std::unique_ptr<DWARFContext> DwCtx;
 
+  /// Line tables of compilation units with functions to process, parsed
+  /// ahead of disassembly by parseLineTables(). Line tables of other units
+  /// are parsed by DwCtx when they are first used.
+  std::unordered_map<DWARFUnit *, std::unique_ptr<DWARFDebugLine::LineTable>>
+    LineTables;
+
+  /// Line tables of compilation units written to .debug_line while functions
+  /// are emitted, in the order they were written, with the labels at their
+  /// start. The remaining line tables of MCContext are written after them.
+  std::vector<std::pair<uint32_t, MCSymbol *>> StreamedLineTables;
+
   std::unique_ptr<Triple> TheTriple;
 
   const Target *TheTarget;
@@ -533,6 +578,11 @@ public:
   /// Number of functions with profile information
   uint64_t NumProfiledFuncs{0};
 
+  /// Number of functions at the start of the output order that are placed in
+  /// the hot text limited with -hot-text-hugepages. Zero if the hot text is
+  /// not limited.
+  uint32_t NumHotTextFunctions{0};
+
   /// Number of objects in profile whose profile was ignored.
   uint64_t NumUnusedProfiledObjects{0};
 
@@ -540,8 +590,35 @@ public:
   uint64_t TotalScore{0};
 
   /// Binary-wide stats for macro-fusion.
-  uint64_t MissedMacroFusionPairs{0};
-  uint64_t MissedMacroFusionExecCount{0};
+  std::atomic<uint64_t> MissedMacroFusionPairs{0};
+  std::atomic<uint64_t> MissedMacroFusionExecCount{0};
+
+  /// Counters of the profile collection, filled in when the profile is
+  /// aggregated from perf data and reported with -print-profile-stats.
+  struct ProfileCollectionStats {
+    bool IsAvailable{false};
+    uint64_t NumSamples{0};          /// samples read
+    uint64_t NumIgnoredSamples{0};   /// samples not attributed to the binary
+    uint64_t NumIgnoredMMaps{0};     /// mappings not matching any segment
+    uint64_t NumLBREntries{0};       /// LBR entries kept
+    uint64_t NumKernelLBREntries{0}; /// LBR entries dropped in the kernel
+    uint64_t NumTraces{0};
+    uint64_t NumInvalidTraces{0};    /// traces mismatching function contents
+    uint64_t NumLongRangeTraces{0};  /// traces involving unknown addresses
+    uint64_t NumColdSamples{0};      /// samples in cold fragments
+
+    /// The PC of every branch sample is a basic sample of the same event.
+    /// Their number in each function is checked against the profile from
+    /// LBRs.
+    std::unordered_map<const BinaryFunction *, uint64_t> PCSamples;
+  } ProfileCollection;
+
+  /// Deadline of optimization passes set by -time-budget. Expensive
+  /// optimizations fall back to cheaper settings once it has passed.
+  Optional<std::chrono::steady_clock::time_point> OptimizationDeadline;
+
+  /// Set once the first pass observes that the deadline has passed.
+  mutable std::atomic<bool> IsTimeBudgetExhausted{false};
 
   // Address of the first allocated segment.
   uint64_t FirstAllocAddress{std::numeric_limits<uint64_t>::max()};
@@ -583,6 +660,10 @@ public:
   /// special linux kernel sections
   std::unordered_map<uint64_t, std::vector<LKInstructionMarkerInfo>> LKMarkers;
 
+  /// Linux kernel code locations patched at boot or at run time: static key
+  /// jump sites and alternative instructions.
+  std::unordered_set<uint64_t> LKPatchSites;
+
   BinaryContext(std::unique_ptr<MCContext> Ctx,
                 std::unique_ptr<DWARFContext> DwCtx,
                 std::unique_ptr<Triple> TheTriple,
@@ -792,6 +873,10 @@ public:
     return ".text";
   }
 
+  const char *getWarmCodeSectionName() const {
+    return ".text.warm";
+  }
+
   const char *getColdCodeSectionName() const {
     return ".text.cold";
   }
@@ -1056,18 +1141,36 @@ public:
   /// Associate the symbol \p Sym with the function \p BF for lookups with
   /// getFunctionForSymbol().
   void setSymbolToFunctionMap(const MCSymbol *Sym, BinaryFunction *BF) {
-    SymbolToFunctionMap[Sym] = BF;
+    auto &Shard = getSymbolToFunctionMapShard(Sym);
+    std::unique_lock<std::shared_timed_mutex> Lock(Shard.Mutex);
+    Shard.Map[Sym] = BF;
   }
 
-  /// Populate some internal data structures with debug info.
+  /// Remove the association of the symbol \p Sym with a function.
+  void eraseSymbolToFunctionMap(const MCSymbol *Sym) {
+    auto &Shard = getSymbolToFunctionMapShard(Sym);
+    std::unique_lock<std::shared_timed_mutex> Lock(Shard.Mutex);
+    Shard.Map.erase(Sym);
+  }
+
+  /// Populate some internal data structures with debug info. Only the
+  /// headers of line tables are read.
   void preprocessDebugInfo();
 
+  /// Parse in parallel the line tables of compilation units containing
+  /// functions that are not ignored.
+  void parseLineTables();
+
+  /// Return the line table of \p Unit, or nullptr if it has none.
+  const DWARFDebugLine::LineTable *getLineTableForUnit(DWARFUnit *Unit) const;
+
   /// Add a filename entry from SrcCUID to DestCUID.
   unsigned addDebugFilenameToUnit(const uint32_t DestCUID,
                                   const uint32_t SrcCUID,
                                   unsigned FileIndex);
 
-  /// Return functions in output layout order
+  /// Return functions in output layout order. Functions created by BOLT are
+  /// included once they are assigned an index.
   std::vector<BinaryFunction *> getSortedFunctions();
 
   /// Do the best effort to calculate the size of the function by emitting
@@ -1122,6 +1225,23 @@ public:
   /// count of profiled functions.
   uint64_t getHotThreshold() const;
 
+  /// Return true if the optimization passes run with a time budget. Parallel
+  /// work on functions is then scheduled in the order of decreasing execution
+  /// count, so that the hottest functions are optimized before the deadline.
+  bool hasTimeBudget() const { return OptimizationDeadline.hasValue(); }
+
+  /// Return true if the time budget of optimization passes is spent.
+  bool isTimeBudgetExhausted() const {
+    if (!hasTimeBudget())
+      return false;
+    if (IsTimeBudgetExhausted)
+      return true;
+    if (std::chrono::steady_clock::now() < *OptimizationDeadline)
+      return false;
+    IsTimeBudgetExhausted = true;
+    return true;
+  }
+
   /// Return true if instruction \p Inst requires an offset for further
   /// processing (e.g. assigning a profile).
   bool keepOffsetForInstruction(const MCInst &Inst) const {
@@ -12,9 +12,17 @@
 #include "BinaryContext.h"
 #include "BinaryEmitter.h"
 #include "BinaryFunction.h"
+#include "ParallelUtilities.h"
+#include "Progress.h"
+#include "llvm/MC/MCDwarf.h"
+#include "llvm/MC/MCExpr.h"
+#include "llvm/MC/MCObjectFileInfo.h"
+#include "llvm/MC/MCObjectStreamer.h"
 #include "llvm/MC/MCSection.h"
 #include "llvm/Support/LEB128.h"
 #include "llvm/Support/SMLoc.h"
+#include <unordered_map>
+#include <unordered_set>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt"
@@ -32,6 +40,7 @@ extern cl::OptionCategory BoltRelocCategory;
 
 extern cl::opt<unsigned> AlignText;
 extern cl::opt<bool> HotText;
+extern cl::opt<bool> PLTAlignCalls;
 extern cl::opt<JumpTableSupportLevel> JumpTables;
 extern cl::opt<bool> PreserveBlocksAlignment;
 extern cl::opt<bool> PrintCacheMetrics;
@@ -58,6 +67,24 @@ AlignMacroOpFusion("align-macro-fusion",
   cl::ZeroOrMore,
   cl::cat(BoltRelocCategory));
 
+cl::opt<bool>
+CompactLSDA("compact-lsda",
+  cl::desc("emit exception tables with ULEB128-encoded call site tables, "
+           "share type tables between fragments of split functions, and with "
+           "-split-eh group cold landing pads at the end of cold fragments"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+StreamDebugLine("stream-debug-line",
+  cl::desc("write the line table of each compilation unit as soon as all its "
+           "functions are emitted, instead of keeping all line tables until "
+           "the end of the emission"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 static cl::list<std::string>
 BreakFunctionNames("break-funcs",
   cl::CommaSeparated,
@@ -132,6 +159,24 @@ private:
   MCStreamer &Streamer;
   BinaryContext &BC;
 
+  /// Labels of type tables that the main fragment of a split function shares
+  /// with the cold one, to be placed when the cold fragment LSDA is emitted.
+  std::unordered_map<const BinaryFunction *, MCSymbol *> SharedTypeTables;
+
+  /// Functions of a compilation unit with debug line info, and the number of
+  /// them that are yet to be emitted. Used with -stream-debug-line.
+  struct UnitLineInfo {
+    std::vector<const BinaryFunction *> Functions;
+    size_t NumPending{0};
+  };
+
+  /// Compilation units with line tables that are yet to be written, indexed
+  /// by the unit offset.
+  std::unordered_map<uint32_t, UnitLineInfo> PendingLineTables;
+
+  /// Compilation units with line tables written while emitting functions.
+  std::unordered_set<uint32_t> StreamedUnits;
+
 public:
   BinaryEmitter(MCStreamer &Streamer, BinaryContext &BC)
     : Streamer(Streamer),
@@ -167,6 +212,20 @@ private:
   /// Emit exception handling ranges for the function.
   void emitLSDA(BinaryFunction &BF, bool EmitColdPart);
 
+  /// Emit LSDA for the function fragment with -compact-lsda. Return false
+  /// without emitting anything if the compact form cannot be used.
+  bool emitCompactLSDA(BinaryFunction &BF, bool EmitColdPart);
+
+  /// Set \p LPBase to the start of the fragment that contains all landing
+  /// pads of the call sites of the fragment, or to nullptr if there are no
+  /// landing pads. Return false if landing pads are in both fragments.
+  bool getLandingPadBase(BinaryFunction &BF, bool EmitColdPart,
+                         const MCSymbol *&LPBase) const;
+
+  /// Emit the type table of the function followed by \p TTBaseLabel, if set,
+  /// and the type index table.
+  void emitLSDATypeTables(const BinaryFunction &BF, MCSymbol *TTBaseLabel);
+
   /// Emit line number information corresponding to \p NewLoc. \p PrevLoc
   /// provides a context for de-duplication of line number info.
   /// \p FirstInstr indicates if \p NewLoc represents the first instruction
@@ -179,6 +238,22 @@ private:
   /// Emit debug line information for functions that were not emitted.
   void emitDebugLineInfoForOriginalFunctions();
 
+  /// Emit debug line information for \p Function that was not emitted,
+  /// using its addresses in the input binary.
+  void emitDebugLineInfoForOriginalFunction(const BinaryFunction &Function);
+
+  /// With -stream-debug-line, collect compilation units of functions that
+  /// have debug line info.
+  void initializeLineTableStreaming();
+
+  /// Mark that no more code of \p Function is going to be emitted, and write
+  /// the line table of its unit once that holds for all functions of the unit.
+  void finishFunctionLineInfo(const BinaryFunction &Function);
+
+  /// Write the line table of the unit at \p CUOffset to .debug_line and
+  /// release its rows.
+  void streamLineTable(uint32_t CUOffset, const UnitLineInfo &Info);
+
   /// Emit function as a blob with relocations and labels for relocations.
   void emitFunctionBodyRaw(BinaryFunction &BF) LLVM_ATTRIBUTE_UNUSED;
 
@@ -208,14 +283,68 @@ void BinaryEmitter::emitAll(StringRef OrgSecPrefix) {
 }
 
 void BinaryEmitter::emitFunctions() {
+  const uint32_t OriginalBranchBoundaryAlign = X86AlignBranchBoundary;
+
+  // Functions with an assigned cold fragment order and whether their hot part
+  // was emitted. Their cold parts are emitted after all hot parts.
+  std::vector<std::pair<BinaryFunction *, bool>> OrderedColdParts;
+
+  // Mark the end of hot text. With the limited hot text, functions past the
+  // limit follow the end of the region aligned to a huge page.
+  bool HotTextEndEmitted{false};
+  auto emitHotTextEnd = [&]() {
+    if (!opts::HotText || HotTextEndEmitted)
+      return;
+    Streamer.SwitchSection(BC.getTextSection());
+    if (BC.NumHotTextFunctions)
+      Streamer.EmitCodeAlignment(BC.HugePageSize);
+    Streamer.EmitLabel(BC.getHotTextEndSymbol());
+    HotTextEndEmitted = true;
+  };
+
+  // Releasing the CFG of an emitted function does not involve the streamer,
+  // so it is done on the thread pool while the following functions are
+  // encoded. Functions are released in batches to amortize scheduling.
+  constexpr size_t ReleaseBatchSize = 64;
+  std::vector<BinaryFunction *> ReleaseBatch;
+  auto flushReleaseBatch = [&]() {
+    if (ReleaseBatch.empty())
+      return;
+    ParallelUtilities::getThreadPool().async(
+        [](std::vector<BinaryFunction *> Batch) {
+          for (auto *Function : Batch)
+            Function->releaseEmittedCFG();
+        },
+        std::move(ReleaseBatch));
+    ReleaseBatch.clear();
+  };
+  auto setEmitted = [&](BinaryFunction *Function) {
+    if (opts::PrintCacheMetrics || opts::NoThreads) {
+      Function->setEmitted(/*KeepCFG=*/opts::PrintCacheMetrics);
+      return;
+    }
+    Function->setEmitted(/*KeepCFG=*/true);
+    ReleaseBatch.push_back(Function);
+    if (ReleaseBatch.size() >= ReleaseBatchSize)
+      flushReleaseBatch();
+  };
+
+  initializeLineTableStreaming();
+
   auto emit = [&](const std::vector<BinaryFunction *> &Functions) {
     const auto HasProfile = BC.NumProfiledFuncs > 0;
-    const uint32_t OriginalBranchBoundaryAlign = X86AlignBranchBoundary;
     for (auto *Function : Functions) {
+      Progress::advance();
       if (!BC.shouldEmit(*Function)) {
+        finishFunctionLineInfo(*Function);
         continue;
       }
 
+      if (BC.NumHotTextFunctions &&
+          (!Function->hasValidIndex() ||
+           Function->getIndex() >= BC.NumHotTextFunctions))
+        emitHotTextEnd();
+
       DEBUG(dbgs() << "BOLT: generating code for function \""
                    << *Function << "\" : "
                    << Function->getFunctionNumber() << '\n');
@@ -230,6 +359,12 @@ void BinaryEmitter::emitFunctions() {
 
       Emitted |= emitFunction(*Function, /*EmitColdPart=*/false);
 
+      if (Function->isSplit() && Function->hasValidColdIndex()) {
+        X86AlignBranchBoundary = OriginalBranchBoundaryAlign;
+        OrderedColdParts.emplace_back(Function, Emitted);
+        continue;
+      }
+
       if (Function->isSplit()) {
         if (opts::X86AlignBranchBoundaryHotOnly)
           X86AlignBranchBoundary = 0;
@@ -238,7 +373,8 @@ void BinaryEmitter::emitFunctions() {
       X86AlignBranchBoundary = OriginalBranchBoundaryAlign;
 
       if (Emitted)
-        Function->setEmitted(/*KeepCFG=*/opts::PrintCacheMetrics);
+        setEmitted(Function);
+      finishFunctionLineInfo(*Function);
     }
   };
 
@@ -250,16 +386,41 @@ void BinaryEmitter::emitFunctions() {
 
   // Emit functions in sorted order.
   std::vector<BinaryFunction *> SortedFunctions = BC.getSortedFunctions();
+  std::vector<BinaryFunction *> InjectedFunctions;
+  for (auto *Function : BC.getInjectedBinaryFunctions()) {
+    if (!Function->hasValidIndex())
+      InjectedFunctions.push_back(Function);
+  }
+  ProgressTask PT("emit", SortedFunctions.size() + InjectedFunctions.size());
   emit(SortedFunctions);
 
-  // Emit functions added by BOLT.
-  emit(BC.getInjectedBinaryFunctions());
-
-  // Mark the end of hot text.
-  if (opts::HotText) {
-    Streamer.SwitchSection(BC.getTextSection());
-    Streamer.EmitLabel(BC.getHotTextEndSymbol());
+  // Emit functions added by BOLT that are not in the sorted order.
+  emit(InjectedFunctions);
+
+  std::stable_sort(OrderedColdParts.begin(), OrderedColdParts.end(),
+                   [](const std::pair<BinaryFunction *, bool> &A,
+                      const std::pair<BinaryFunction *, bool> &B) {
+                     return A.first->getColdIndex() < B.first->getColdIndex();
+                   });
+  for (auto &FunctionEmitted : OrderedColdParts) {
+    auto *Function = FunctionEmitted.first;
+    if (opts::X86AlignBranchBoundaryHotOnly)
+      X86AlignBranchBoundary = 0;
+    const bool Emitted =
+        emitFunction(*Function, /*EmitColdPart=*/true) ||
+        FunctionEmitted.second;
+    X86AlignBranchBoundary = OriginalBranchBoundaryAlign;
+
+    if (Emitted)
+      setEmitted(Function);
+    finishFunctionLineInfo(*Function);
   }
+
+  emitHotTextEnd();
+
+  flushReleaseBatch();
+  if (!opts::PrintCacheMetrics && !opts::NoThreads)
+    ParallelUtilities::getThreadPool().wait();
 }
 
 bool BinaryEmitter::emitFunction(BinaryFunction &Function, bool EmitColdPart) {
@@ -456,13 +617,21 @@ void BinaryEmitter::emitFunctionBody(BinaryFunction &BF, bool EmitColdPart,
       // Prepare to tag this location with a label if we need to keep track of
       // the location of calls/returns for BOLT address translation maps
       if (!EmitCodeOnly && BF.requiresAddressTranslation() &&
-          BC.MIB->hasAnnotation(Instr, "Offset")) {
-        const auto Offset = BC.MIB->getAnnotationAs<uint32_t>(Instr, "Offset");
+          BC.MIB->hasAnnotation(Instr, MCPlus::OffsetAnnotation)) {
+        const auto Offset =
+            BC.MIB->getAnnotationAs(Instr, MCPlus::OffsetAnnotation);
         MCSymbol *LocSym = BC.Ctx->createTempSymbol(/*CanBeUnnamed=*/true);
         Streamer.EmitLabel(LocSym);
         BB->getLocSyms().emplace_back(std::make_pair(Offset, LocSym));
       }
 
+      // A 6-byte call through GOT starting at an 8-byte boundary never
+      // crosses a 16-byte fetch block.
+      if (opts::PLTAlignCalls && !BB->isCold() &&
+          BB->getKnownExecutionCount() > 0 && BC.MIB->isIndirectCall(Instr) &&
+          BC.MIB->hasPCRelOperand(Instr))
+        Streamer.EmitCodeAlignment(8);
+
       Streamer.EmitInstruction(Instr, *BC.STI);
       LastIsPrefix = BC.MIB->isPrefix(Instr);
     }
@@ -627,7 +796,7 @@ SMLoc BinaryEmitter::emitLineInfo(const BinaryFunction &BF, SMLoc NewLoc,
   const auto FunctionUnitIndex = FunctionCU->getOffset();
   const auto CurrentUnitIndex = RowReference.DwCompileUnitIndex;
   if (CurrentUnitIndex != FunctionUnitIndex) {
-    CurrentLineTable = BC.DwCtx->getLineTableForUnit(
+    CurrentLineTable = BC.getLineTableForUnit(
         BC.DwCtx->getCompileUnitForOffset(CurrentUnitIndex));
     // Add filename from the inlined function to the current CU.
     CurrentFilenum =
@@ -744,16 +913,22 @@ void BinaryEmitter::emitJumpTable(const JumpTable &JT, MCSection *HotSection,
         }
         Streamer.EmitValueToAlignment(JT.EntrySize);
       }
+      if (!Offset && JT.OutputAlignment) {
+        Streamer.EmitValueToAlignment(JT.OutputAlignment);
+        Streamer.EmitZeros(JT.OutputPadding);
+      }
       Streamer.EmitLabel(LI->second);
       LastLabel = LI->second;
     }
     if (JT.Type == JumpTable::JTT_NORMAL) {
       Streamer.EmitSymbolValue(Entry, JT.OutputEntrySize);
     } else { // JTT_PIC
-      auto JTExpr = MCSymbolRefExpr::create(LastLabel, Streamer.getContext());
+      auto JTExpr = MCSymbolRefExpr::create(
+          JT.OutputEntryBase ? JT.OutputEntryBase : LastLabel,
+          Streamer.getContext());
       auto E = MCSymbolRefExpr::create(Entry, Streamer.getContext());
       auto Value = MCBinaryExpr::createSub(E, JTExpr, Streamer.getContext());
-      Streamer.EmitValue(Value, JT.EntrySize);
+      Streamer.EmitValue(Value, JT.OutputEntrySize);
     }
     Offset += JT.EntrySize;
   }
@@ -767,6 +942,9 @@ void BinaryEmitter::emitLSDA(BinaryFunction &BF, bool EmitColdPart) {
     return;
   }
 
+  if (opts::CompactLSDA && emitCompactLSDA(BF, EmitColdPart))
+    return;
+
   // Calculate callsite table size. Size of each callsite entry is:
   //
   //  sizeof(start) + sizeof(length) + sizeof(LP) + sizeof(uleb128(action))
@@ -897,6 +1075,15 @@ void BinaryEmitter::emitLSDA(BinaryFunction &BF, bool EmitColdPart) {
     Streamer.EmitIntValue(Byte, 1);
   }
 
+  emitLSDATypeTables(BF, /*TTBaseLabel=*/nullptr);
+}
+
+void BinaryEmitter::emitLSDATypeTables(const BinaryFunction &BF,
+                                       MCSymbol *TTBaseLabel) {
+  const auto TTypeEncoding = BC.MOFI->getTTypeEncoding();
+  const auto TTypeEncodingSize = BC.getDWARFEncodingSize(TTypeEncoding);
+  const auto TTypeAlignment = 4;
+
   const auto &TypeTable = (TTypeEncoding & dwarf::DW_EH_PE_indirect)
       ? BF.getLSDATypeAddressTable()
       : BF.getLSDATypeTable();
@@ -929,11 +1116,145 @@ void BinaryEmitter::emitLSDA(BinaryFunction &BF, bool EmitColdPart) {
     }
     }
   }
+  if (TTBaseLabel)
+    Streamer.EmitLabel(TTBaseLabel);
   for (auto const &Byte : BF.getLSDATypeIndexTable()) {
     Streamer.EmitIntValue(Byte, 1);
   }
 }
 
+bool BinaryEmitter::getLandingPadBase(BinaryFunction &BF,
+                                      bool EmitColdPart,
+                                      const MCSymbol *&LPBase) const {
+  const auto &Sites = EmitColdPart ? BF.getColdCallSites() : BF.getCallSites();
+  LPBase = nullptr;
+  for (const auto &CallSite : Sites) {
+    if (!CallSite.LP)
+      continue;
+    const auto *LPBlock = BF.getBasicBlockForLabel(CallSite.LP);
+    if (!LPBlock)
+      return false;
+    const auto *Base = LPBlock->isCold() ? BF.getColdSymbol() : BF.getSymbol();
+    if (LPBase && LPBase != Base)
+      return false;
+    LPBase = Base;
+  }
+
+  // Without a fixed load address landing pads are encoded relative to the
+  // fragment start, see emitLSDA().
+  if (!BC.HasFixedLoadAddress && LPBase &&
+      LPBase != (EmitColdPart ? BF.getColdSymbol() : BF.getSymbol()))
+    return false;
+
+  return true;
+}
+
+bool BinaryEmitter::emitCompactLSDA(BinaryFunction &BF, bool EmitColdPart) {
+  const MCSymbol *LPBase;
+  if (!getLandingPadBase(BF, EmitColdPart, LPBase))
+    return false;
+
+  const auto &Sites = EmitColdPart ? BF.getColdCallSites() : BF.getCallSites();
+  const MCSymbol *StartSymbol = EmitColdPart ? BF.getColdSymbol()
+                                             : BF.getSymbol();
+  auto *LSDASymbol = EmitColdPart ? BF.getColdLSDASymbol() : BF.getLSDASymbol();
+  assert(LSDASymbol && "no LSDA symbol set");
+
+  auto createDiff = [&](const MCSymbol *A, const MCSymbol *B) {
+    return MCBinaryExpr::createSub(MCSymbolRefExpr::create(A, *BC.Ctx),
+                                   MCSymbolRefExpr::create(B, *BC.Ctx),
+                                   *BC.Ctx);
+  };
+
+  // The type table is used by both fragments of a split function. The main
+  // fragment refers to the copy emitted with the cold fragment LSDA that
+  // follows it in the section.
+  const bool HasTypeTables = !BF.getLSDATypeTable().empty() ||
+                             !BF.getLSDATypeIndexTable().empty();
+  MCSymbol *TTBaseLabel = nullptr;
+  bool EmitTypeTables = HasTypeTables;
+  if (HasTypeTables) {
+    auto STI = SharedTypeTables.find(&BF);
+    if (EmitColdPart && STI != SharedTypeTables.end()) {
+      TTBaseLabel = STI->second;
+    } else {
+      const MCSymbol *ColdLPBase;
+      TTBaseLabel = BC.Ctx->createTempSymbol("TTBase", true);
+      if (!EmitColdPart && BF.isSplit() && !BF.getColdCallSites().empty() &&
+          getLandingPadBase(BF, /*EmitColdPart=*/true, ColdLPBase)) {
+        SharedTypeTables[&BF] = TTBaseLabel;
+        EmitTypeTables = false;
+      }
+    }
+  }
+
+  Streamer.SwitchSection(BC.MOFI->getLSDASection());
+  Streamer.EmitLabel(LSDASymbol);
+
+  // Zero landing pad offset denotes the absence of a landing pad. Landing
+  // pads are encoded relative to a base preceding the fragment start by one
+  // byte if LPStart can be emitted, see the comment in emitLSDA().
+  const MCExpr *LPBaseOffset = nullptr;
+  if (!LPBase || !BC.HasFixedLoadAddress) {
+    Streamer.EmitIntValue(dwarf::DW_EH_PE_omit, 1); // LPStart format
+  } else {
+    Streamer.EmitIntValue(dwarf::DW_EH_PE_udata4, 1); // LPStart format
+    Streamer.EmitValue(
+        MCBinaryExpr::createSub(MCSymbolRefExpr::create(LPBase, *BC.Ctx),
+                                MCConstantExpr::create(1, *BC.Ctx), *BC.Ctx),
+        4);
+    LPBaseOffset = MCConstantExpr::create(1, *BC.Ctx);
+  }
+  if (!LPBase)
+    LPBase = StartSymbol;
+
+  // Table sizes are emitted as label differences and are resolved by the
+  // assembler during layout.
+  if (HasTypeTables) {
+    Streamer.EmitIntValue(BC.MOFI->getTTypeEncoding(), 1); // TType format
+    auto *TTBaseRefLabel = BC.Ctx->createTempSymbol("TTBaseRef", true);
+    Streamer.EmitULEB128Value(createDiff(TTBaseLabel, TTBaseRefLabel));
+    Streamer.EmitLabel(TTBaseRefLabel);
+  } else {
+    Streamer.EmitIntValue(dwarf::DW_EH_PE_omit, 1); // TType format
+  }
+
+  auto *CSTBeginLabel = BC.Ctx->createTempSymbol("CSTBegin", true);
+  auto *CSTEndLabel = BC.Ctx->createTempSymbol("CSTEnd", true);
+  Streamer.EmitIntValue(dwarf::DW_EH_PE_uleb128, 1); // Call site format
+  Streamer.EmitULEB128Value(createDiff(CSTEndLabel, CSTBeginLabel));
+  Streamer.EmitLabel(CSTBeginLabel);
+  for (const auto &CallSite : Sites) {
+    assert(CallSite.Start && "start EH label expected");
+    assert(CallSite.End && "end EH label expected");
+
+    Streamer.EmitULEB128Value(createDiff(CallSite.Start, StartSymbol));
+    Streamer.EmitULEB128Value(createDiff(CallSite.End, CallSite.Start));
+    if (!CallSite.LP) {
+      Streamer.EmitULEB128IntValue(0);
+    } else {
+      const MCExpr *LPOffset = createDiff(CallSite.LP, LPBase);
+      if (LPBaseOffset)
+        LPOffset = MCBinaryExpr::createAdd(LPOffset, LPBaseOffset, *BC.Ctx);
+      Streamer.EmitULEB128Value(LPOffset);
+    }
+    Streamer.EmitULEB128IntValue(CallSite.Action);
+  }
+  Streamer.EmitLabel(CSTEndLabel);
+
+  for (auto const &Byte : BF.getLSDAActionTable()) {
+    Streamer.EmitIntValue(Byte, 1);
+  }
+
+  if (EmitTypeTables) {
+    // Type tables have to be aligned at 4 bytes.
+    Streamer.EmitValueToAlignment(4);
+    emitLSDATypeTables(BF, TTBaseLabel);
+  }
+
+  return true;
+}
+
 void BinaryEmitter::emitDebugLineInfoForOriginalFunctions() {
   for (auto &It : BC.getBinaryFunctions()) {
     const auto &Function = It.second;
@@ -942,52 +1263,323 @@ void BinaryEmitter::emitDebugLineInfoForOriginalFunctions() {
     if (Function.isEmitted())
       continue;
 
-    DWARFUnit *Unit = Function.getDWARFUnit();
-    const DWARFDebugLine::LineTable *LineTable = Function.getDWARFLineTable();
-
-    if (!LineTable)
-      continue; // nothing to update for this function
-
-    std::vector<uint32_t> Results;
-    MCSection *FunctionSection =
-        BC.getCodeSection(Function.getCodeSectionName());
-
-    uint64_t Address = It.first;
-    if (LineTable->lookupAddressRange(Address, Function.getMaxSize(),
-                                      Results)) {
-      auto &OutputLineTable =
-          BC.Ctx->getMCDwarfLineTable(Unit->getOffset()).getMCLineSections();
-      for (auto RowIndex : Results) {
-        const auto &Row = LineTable->Rows[RowIndex];
-        BC.Ctx->setCurrentDwarfLoc(
-            Row.File,
-            Row.Line,
-            Row.Column,
-            (DWARF2_FLAG_IS_STMT * Row.IsStmt) |
-            (DWARF2_FLAG_BASIC_BLOCK * Row.BasicBlock) |
-            (DWARF2_FLAG_PROLOGUE_END * Row.PrologueEnd) |
-            (DWARF2_FLAG_EPILOGUE_BEGIN * Row.EpilogueBegin),
-            Row.Isa,
-            Row.Discriminator,
-            Row.Address);
-        auto Loc = BC.Ctx->getCurrentDwarfLoc();
-        BC.Ctx->clearDwarfLocSeen();
-        OutputLineTable.addLineEntry(MCDwarfLineEntry{nullptr, Loc},
-                                     FunctionSection);
-      }
-      // Add an empty entry past the end of the function
-      // for end_sequence mark.
-      BC.Ctx->setCurrentDwarfLoc(0, 0, 0, 0, 0, 0,
-                                 Address + Function.getMaxSize());
+    // Line tables that were already written include the function.
+    if (Function.getDWARFUnit() &&
+        StreamedUnits.count(Function.getDWARFUnit()->getOffset()))
+      continue;
+
+    emitDebugLineInfoForOriginalFunction(Function);
+  }
+}
+
+void BinaryEmitter::emitDebugLineInfoForOriginalFunction(
+    const BinaryFunction &Function) {
+  DWARFUnit *Unit = Function.getDWARFUnit();
+  const DWARFDebugLine::LineTable *LineTable = Function.getDWARFLineTable();
+
+  if (!LineTable)
+    return; // nothing to update for this function
+
+  std::vector<uint32_t> Results;
+  MCSection *FunctionSection =
+      BC.getCodeSection(Function.getCodeSectionName());
+
+  uint64_t Address = Function.getAddress();
+  if (LineTable->lookupAddressRange(Address, Function.getMaxSize(),
+                                    Results)) {
+    auto &OutputLineTable =
+        BC.Ctx->getMCDwarfLineTable(Unit->getOffset()).getMCLineSections();
+    for (auto RowIndex : Results) {
+      const auto &Row = LineTable->Rows[RowIndex];
+      BC.Ctx->setCurrentDwarfLoc(
+          Row.File,
+          Row.Line,
+          Row.Column,
+          (DWARF2_FLAG_IS_STMT * Row.IsStmt) |
+          (DWARF2_FLAG_BASIC_BLOCK * Row.BasicBlock) |
+          (DWARF2_FLAG_PROLOGUE_END * Row.PrologueEnd) |
+          (DWARF2_FLAG_EPILOGUE_BEGIN * Row.EpilogueBegin),
+          Row.Isa,
+          Row.Discriminator,
+          Row.Address);
       auto Loc = BC.Ctx->getCurrentDwarfLoc();
       BC.Ctx->clearDwarfLocSeen();
       OutputLineTable.addLineEntry(MCDwarfLineEntry{nullptr, Loc},
                                    FunctionSection);
+    }
+    // Add an empty entry past the end of the function
+    // for end_sequence mark.
+    BC.Ctx->setCurrentDwarfLoc(0, 0, 0, 0, 0, 0,
+                               Address + Function.getMaxSize());
+    auto Loc = BC.Ctx->getCurrentDwarfLoc();
+    BC.Ctx->clearDwarfLocSeen();
+    OutputLineTable.addLineEntry(MCDwarfLineEntry{nullptr, Loc},
+                                 FunctionSection);
+  } else {
+    DEBUG(dbgs() << "BOLT-DEBUG: function " << Function
+                 << " has no associated line number information\n");
+  }
+}
+
+void BinaryEmitter::initializeLineTableStreaming() {
+  // Units of DWARF 5 need .debug_line_str that is only written with all line
+  // tables.
+  if (!opts::StreamDebugLine || !opts::UpdateDebugSections ||
+      BC.Ctx->getDwarfVersion() >= 5)
+    return;
+
+  for (auto &It : BC.getBinaryFunctions()) {
+    const auto &Function = It.second;
+    if (!Function.getDWARFUnit())
+      continue;
+    auto &Info = PendingLineTables[Function.getDWARFUnit()->getOffset()];
+    Info.Functions.push_back(&Function);
+    ++Info.NumPending;
+  }
+}
+
+void BinaryEmitter::finishFunctionLineInfo(const BinaryFunction &Function) {
+  if (PendingLineTables.empty() || !Function.getDWARFUnit())
+    return;
+
+  const uint32_t CUOffset = Function.getDWARFUnit()->getOffset();
+  auto UI = PendingLineTables.find(CUOffset);
+  if (UI == PendingLineTables.end())
+    return;
+
+  assert(UI->second.NumPending && "function finished more than once");
+  if (--UI->second.NumPending)
+    return;
+
+  streamLineTable(CUOffset, UI->second);
+  PendingLineTables.erase(UI);
+}
+
+namespace {
+
+/// Write the line number program for \p LineEntries of \p Section, ending
+/// the sequence at \p EndLabel. Follows MCDwarfLineTable::EmitCU(), including
+/// rows with absolute addresses of functions that were not emitted.
+void emitDwarfLineTable(
+    MCObjectStreamer &Streamer, const MCSymbol *EndLabel,
+    const MCLineSection::MCDwarfLineEntryCollection &LineEntries) {
+  MCContext &Ctx = Streamer.getContext();
+  const unsigned PointerSize = Ctx.getAsmInfo()->getCodePointerSize();
+  unsigned FileNum = 1;
+  unsigned LastLine = 1;
+  unsigned Column = 0;
+  unsigned Flags = DWARF2_LINE_DEFAULT_IS_STMT ? DWARF2_FLAG_IS_STMT : 0;
+  unsigned Isa = 0;
+  unsigned Discriminator = 0;
+  uint64_t LastAddress = -1ULL;
+  const MCSymbol *LastLabel = nullptr;
+
+  for (auto I = LineEntries.begin(), E = LineEntries.end(); I != E; ++I) {
+    const MCDwarfLineEntry &LineEntry = *I;
+    const int64_t LineDelta =
+      static_cast<int64_t>(LineEntry.getLine()) - LastLine;
+
+    // The last row with an absolute address ends the sequence.
+    const uint64_t Address = LineEntry.getAbsoluteAddr();
+    if (Address != -1ULL && std::next(I) == E) {
+      Streamer.EmitDwarfAdvanceLineAddr(INT64_MAX, -1ULL,
+                                        Address - LastAddress, PointerSize);
+      return;
+    }
+
+    if (FileNum != LineEntry.getFileNum()) {
+      FileNum = LineEntry.getFileNum();
+      Streamer.EmitIntValue(dwarf::DW_LNS_set_file, 1);
+      Streamer.EmitULEB128IntValue(FileNum);
+    }
+    if (Column != LineEntry.getColumn()) {
+      Column = LineEntry.getColumn();
+      Streamer.EmitIntValue(dwarf::DW_LNS_set_column, 1);
+      Streamer.EmitULEB128IntValue(Column);
+    }
+    if (Discriminator != LineEntry.getDiscriminator() &&
+        Ctx.getDwarfVersion() >= 4) {
+      Discriminator = LineEntry.getDiscriminator();
+      Streamer.EmitIntValue(dwarf::DW_LNS_extended_op, 1);
+      Streamer.EmitULEB128IntValue(getULEB128Size(Discriminator) + 1);
+      Streamer.EmitIntValue(dwarf::DW_LNE_set_discriminator, 1);
+      Streamer.EmitULEB128IntValue(Discriminator);
+    }
+    if (Isa != LineEntry.getIsa()) {
+      Isa = LineEntry.getIsa();
+      Streamer.EmitIntValue(dwarf::DW_LNS_set_isa, 1);
+      Streamer.EmitULEB128IntValue(Isa);
+    }
+    if ((LineEntry.getFlags() ^ Flags) & DWARF2_FLAG_IS_STMT) {
+      Flags = LineEntry.getFlags();
+      Streamer.EmitIntValue(dwarf::DW_LNS_negate_stmt, 1);
+    }
+    if (LineEntry.getFlags() & DWARF2_FLAG_BASIC_BLOCK)
+      Streamer.EmitIntValue(dwarf::DW_LNS_set_basic_block, 1);
+    if (LineEntry.getFlags() & DWARF2_FLAG_PROLOGUE_END)
+      Streamer.EmitIntValue(dwarf::DW_LNS_set_prologue_end, 1);
+    if (LineEntry.getFlags() & DWARF2_FLAG_EPILOGUE_BEGIN)
+      Streamer.EmitIntValue(dwarf::DW_LNS_set_epilogue_begin, 1);
+
+    if (Address == -1ULL) {
+      assert(LastAddress == -1ULL &&
+             "absolute addresses can only be added at the end of the table");
+      const MCSymbol *Label = LineEntry.getLabel();
+      Streamer.EmitDwarfAdvanceLineAddr(LineDelta, LastLabel, Label,
+                                        PointerSize);
+      LastLabel = Label;
     } else {
-      DEBUG(dbgs() << "BOLT-DEBUG: function " << Function
-                   << " has no associated line number information\n");
+      if (LastAddress == -1ULL) {
+        Streamer.EmitDwarfAdvanceLineAddr(LineDelta, Address, 0, PointerSize);
+      } else {
+        Streamer.EmitDwarfAdvanceLineAddr(LineDelta, -1ULL,
+                                          Address - LastAddress, PointerSize);
+      }
+      LastAddress = Address;
+      LastLabel = nullptr;
     }
+
+    Discriminator = 0;
+    LastLine = LineEntry.getLine();
+  }
+
+  // Emit a DW_LNE_end_sequence for the end of the section.
+  Streamer.EmitDwarfAdvanceLineAddr(INT64_MAX, LastLabel, EndLabel,
+                                    PointerSize);
+}
+
+/// Write the header of \p LineTable for DWARF versions 2 to 4. Follows
+/// MCDwarfLineTableHeader::Emit(). Return labels at the start and the end of
+/// the table, the latter to be emitted by the caller.
+std::pair<MCSymbol *, MCSymbol *>
+emitLineTableHeader(MCObjectStreamer &Streamer,
+                    const MCDwarfLineTable &LineTable) {
+  static const char StandardOpcodeLengths[] = {
+    0, // length of DW_LNS_copy
+    1, // length of DW_LNS_advance_pc
+    1, // length of DW_LNS_advance_line
+    1, // length of DW_LNS_set_file
+    1, // length of DW_LNS_set_column
+    0, // length of DW_LNS_negate_stmt
+    0, // length of DW_LNS_set_basic_block
+    0, // length of DW_LNS_const_add_pc
+    1, // length of DW_LNS_fixed_advance_pc
+    0, // length of DW_LNS_set_prologue_end
+    0, // length of DW_LNS_set_epilogue_begin
+    1  // DW_LNS_set_isa
+  };
+
+  MCContext &Ctx = Streamer.getContext();
+  const MCDwarfLineTableParams Params =
+    Streamer.getAssembler().getDWARFLinetableParams();
+  assert(array_lengthof(StandardOpcodeLengths) >=
+         (Params.DWARF2LineOpcodeBase - 1U) && "unexpected opcode base");
+
+  auto emitLength = [&](const MCSymbol *Start, const MCSymbol *End,
+                        int64_t Bias) {
+    const MCExpr *Length = MCBinaryExpr::createSub(
+        MCBinaryExpr::createSub(MCSymbolRefExpr::create(End, Ctx),
+                                MCSymbolRefExpr::create(Start, Ctx), Ctx),
+        MCConstantExpr::create(Bias, Ctx), Ctx);
+    Streamer.EmitValue(Length, 4);
+  };
+
+  MCSymbol *LineStartSym = LineTable.getLabel();
+  if (!LineStartSym)
+    LineStartSym = Ctx.createTempSymbol();
+  Streamer.EmitLabel(LineStartSym);
+  MCSymbol *LineEndSym = Ctx.createTempSymbol();
+  MCSymbol *ProEndSym = Ctx.createTempSymbol();
+
+  const unsigned LineTableVersion = Ctx.getDwarfVersion();
+  emitLength(LineStartSym, LineEndSym, 4);
+  Streamer.EmitIntValue(LineTableVersion, 2);
+  emitLength(LineStartSym, ProEndSym, 4 + 2 + 4);
+
+  Streamer.EmitIntValue(Ctx.getAsmInfo()->getMinInstAlignment(), 1);
+  if (LineTableVersion >= 4)
+    Streamer.EmitIntValue(1, 1); // maximum_operations_per_instruction
+  Streamer.EmitIntValue(DWARF2_LINE_DEFAULT_IS_STMT, 1);
+  Streamer.EmitIntValue(Params.DWARF2LineBase, 1);
+  Streamer.EmitIntValue(Params.DWARF2LineRange, 1);
+  Streamer.EmitIntValue(Params.DWARF2LineOpcodeBase, 1);
+  for (unsigned I = 0; I + 1 < Params.DWARF2LineOpcodeBase; ++I)
+    Streamer.EmitIntValue(StandardOpcodeLengths[I], 1);
+
+  for (const auto &Dir : LineTable.getMCDwarfDirs()) {
+    Streamer.EmitBytes(Dir);
+    Streamer.EmitBytes(StringRef("\0", 1));
+  }
+  Streamer.EmitIntValue(0, 1); // Terminate the directory list.
+
+  const auto &Files = LineTable.getMCDwarfFiles();
+  for (unsigned I = 1; I < Files.size(); ++I) {
+    assert(!Files[I].Name.empty() && "unnamed file");
+    Streamer.EmitBytes(Files[I].Name);
+    Streamer.EmitBytes(StringRef("\0", 1));
+    Streamer.EmitULEB128IntValue(Files[I].DirIndex);
+    Streamer.EmitIntValue(0, 1); // Last modification timestamp.
+    Streamer.EmitIntValue(0, 1); // File size.
+  }
+  Streamer.EmitIntValue(0, 1); // Terminate the file list.
+
+  Streamer.EmitLabel(ProEndSym);
+
+  return std::make_pair(LineStartSym, LineEndSym);
+}
+
+} // anonymous namespace
+
+void BinaryEmitter::streamLineTable(uint32_t CUOffset,
+                                    const UnitLineInfo &Info) {
+  // Rows of functions that were not emitted follow the rows of emitted code.
+  for (const auto *Function : Info.Functions) {
+    if (!Function->isEmitted())
+      emitDebugLineInfoForOriginalFunction(*Function);
+  }
+  StreamedUnits.insert(CUOffset);
+
+  auto &LineTables = BC.Ctx->getMCDwarfLineTables();
+  auto TI = LineTables.find(CUOffset);
+  if (TI == LineTables.end())
+    return;
+  auto &LineTable = TI->second;
+
+  auto &ObjStreamer = static_cast<MCObjectStreamer &>(Streamer);
+  const auto &LineEntries = LineTable.getMCLineSections().getMCLineEntries();
+
+  // Unlike MC, which ends sequences at the end of the section once all code
+  // is emitted, end them at the code emitted so far. Later code in the section
+  // belongs to other units. Sequences of functions that were not emitted end
+  // at their last row.
+  Streamer.PushSection();
+  std::vector<MCSymbol *> EndLabels;
+  for (const auto &LineSection : LineEntries) {
+    EndLabels.push_back(nullptr);
+    if (LineSection.second.empty() ||
+        LineSection.second.back().getAbsoluteAddr() != -1ULL)
+      continue;
+    EndLabels.back() = BC.Ctx->createTempSymbol();
+    Streamer.SwitchSection(LineSection.first);
+    Streamer.EmitLabel(EndLabels.back());
   }
+
+  Streamer.SwitchSection(BC.Ctx->getObjectFileInfo()->getDwarfLineSection());
+  MCSymbol *LineStartSym;
+  MCSymbol *LineEndSym;
+  std::tie(LineStartSym, LineEndSym) =
+    emitLineTableHeader(ObjStreamer, LineTable);
+  size_t Index = 0;
+  for (const auto &LineSection : LineEntries) {
+    const MCSymbol *EndLabel = EndLabels[Index++];
+    if (!LineSection.second.empty())
+      emitDwarfLineTable(ObjStreamer, EndLabel, LineSection.second);
+  }
+  Streamer.EmitLabel(LineEndSym);
+  Streamer.PopSection();
+
+  BC.StreamedLineTables.emplace_back(CUOffset, LineStartSym);
+  LineTables.erase(TI);
 }
 
 void BinaryEmitter::emitFunctionBodyRaw(BinaryFunction &BF) {
@@ -16,6 +16,7 @@
 #include "MCPlusBuilder.h"
 #include "NameResolver.h"
 #include "NameShortener.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/edit_distance.h"
 #include "llvm/ADT/SmallSet.h"
 #include "llvm/ADT/StringRef.h"
@@ -56,6 +57,7 @@ extern cl::OptionCategory BoltOptCategory;
 extern cl::OptionCategory BoltRelocCategory;
 
 extern cl::opt<bool> EnableBAT;
+extern cl::opt<std::string> SymbolizationMap;
 extern cl::opt<bool> Instrument;
 extern cl::opt<bool> StrictMode;
 extern cl::opt<bool> UpdateDebugSections;
@@ -101,7 +103,7 @@ JumpTables("jump-tables",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
-static cl::opt<bool>
+cl::opt<bool>
 NoScan("no-scan",
   cl::desc("do not scan cold functions for external references (may result in "
            "slower binary)"),
@@ -176,6 +178,9 @@ namespace bolt {
 
 constexpr unsigned BinaryFunction::MinAlign;
 
+const MCPlus::AnnotationKey<IndirectCallSiteProfile>
+    MCPlus::CallProfileAnnotation("CallProfile");
+
 namespace {
 
 template <typename R>
@@ -675,19 +680,45 @@ void BinaryFunction::print(raw_ostream &OS, std::string Annotation,
   OS << "End of Function \"" << *this << "\"\n\n";
 }
 
+void BinaryFunction::sortRelocations() {
+  auto sameOffset = [](const Relocation &A, const Relocation &B) {
+    return A.Offset == B.Offset;
+  };
+  if (std::is_sorted(Relocations.begin(), Relocations.end()) &&
+      std::adjacent_find(Relocations.begin(), Relocations.end(), sameOffset) ==
+          Relocations.end())
+    return;
+
+  std::stable_sort(Relocations.begin(), Relocations.end());
+  // Keep the relocation registered last at each offset.
+  auto FirstKept =
+      std::unique(Relocations.rbegin(), Relocations.rend(), sameOffset).base();
+  Relocations.erase(Relocations.begin(), FirstKept);
+}
+
+iterator_range<std::vector<Relocation>::const_iterator>
+BinaryFunction::getRelocationsInRange(uint64_t Offset, uint64_t Size) const {
+  auto lessThanOffset = [](const Relocation &Rel, uint64_t Offset) {
+    return Rel.Offset < Offset;
+  };
+  auto Begin = std::lower_bound(Relocations.begin(), Relocations.end(),
+                                Offset, lessThanOffset);
+  auto End = std::lower_bound(Begin, Relocations.end(), Offset + Size,
+                              lessThanOffset);
+  return make_range(Begin, End);
+}
+
 void BinaryFunction::printRelocations(raw_ostream &OS,
                                       uint64_t Offset,
                                       uint64_t Size) const {
   const char *Sep = " # Relocs: ";
 
-  auto RI = Relocations.lower_bound(Offset);
-  while (RI != Relocations.end() && RI->first < Offset + Size) {
-    OS << Sep << "(R: " << RI->second << ")";
+  for (const auto &Rel : getRelocationsInRange(Offset, Size)) {
+    OS << Sep << "(R: " << Rel << ")";
     Sep = ", ";
-    ++RI;
   }
 
-  RI = MoveRelocations.lower_bound(Offset);
+  auto RI = MoveRelocations.lower_bound(Offset);
   while (RI != MoveRelocations.end() && RI->first < Offset + Size) {
     OS << Sep << "(M: " << RI->second << ")";
     Sep = ", ";
@@ -727,7 +758,7 @@ BinaryFunction::processIndirectBranch(MCInst &Instruction,
     // This is a heuristic, since the full set of labels have yet to be
     // determined
     for (auto LI = Labels.rbegin(); LI != Labels.rend(); ++LI) {
-      auto II = Instructions.find(LI->first);
+      auto II = findInstruction(LI->first);
       if (II != Instructions.end()) {
         Begin = II;
         break;
@@ -970,6 +1001,51 @@ bool BinaryFunction::isZeroPaddingAt(uint64_t Offset) const {
   return true;
 }
 
+void BinaryFunction::predecodeInstructions(const MCDisassembler &DisAsm,
+                                           ArrayRef<uint8_t> FunctionData) {
+  // Follow the same sequence of offsets as disassemble().
+  uint64_t Size = 0;
+  for (uint64_t Offset = 0; Offset < getSize(); Offset += Size) {
+    if (const auto DataInCodeSize = getSizeOfDataInCodeAt(Offset)) {
+      Size = DataInCodeSize;
+      continue;
+    }
+
+    PredecodedInstructions.push_back({Offset, 0, MCInst()});
+    auto &PI = PredecodedInstructions.back();
+    if (!DisAsm.getInstruction(PI.Inst, Size, FunctionData.slice(Offset),
+                               getAddress() + Offset, nulls(), nulls())) {
+      PI.Size = 0;
+      break;
+    }
+    PI.Size = Size;
+  }
+}
+
+bool BinaryFunction::decodeInstructionAt(MCInst &Instruction, uint64_t &Size,
+                                         ArrayRef<uint8_t> FunctionData,
+                                         uint64_t Offset,
+                                         size_t &PredecodedIndex) {
+  while (PredecodedIndex < PredecodedInstructions.size() &&
+         PredecodedInstructions[PredecodedIndex].Offset < Offset)
+    ++PredecodedIndex;
+  if (PredecodedIndex < PredecodedInstructions.size() &&
+      PredecodedInstructions[PredecodedIndex].Offset == Offset) {
+    auto &PI = PredecodedInstructions[PredecodedIndex++];
+    if (!PI.Size)
+      return false;
+    Instruction = std::move(PI.Inst);
+    Size = PI.Size;
+    return true;
+  }
+  return BC.DisAsm->getInstruction(Instruction,
+                                   Size,
+                                   FunctionData.slice(Offset),
+                                   getAddress() + Offset,
+                                   nulls(),
+                                   nulls());
+}
+
 bool BinaryFunction::disassemble() {
   NamedRegionTimer T("disassemble", "Disassemble function", "buildfuncs",
                      "Build Binary Functions", opts::TimeBuild);
@@ -986,6 +1062,11 @@ bool BinaryFunction::disassemble() {
   // basic block.
   Labels[0] = Ctx->createTempSymbol("BB0", false);
 
+  if (!PredecodedInstructions.empty())
+    Instructions.reserve(PredecodedInstructions.size());
+  else if (BC.isAArch64())
+    Instructions.reserve(FunctionData.size() / 4);
+
   auto handlePCRelOperand =
       [&](MCInst &Instruction, uint64_t Address, uint64_t Size) {
     uint64_t TargetAddress{0};
@@ -1037,6 +1118,14 @@ bool BinaryFunction::disassemble() {
                                  Val, ELF::R_AARCH64_ADD_ABS_LO12_NC);
   };
 
+  // Use instructions decoded by predecodeInstructions() if available.
+  size_t PredecodedIndex = 0;
+  auto decodeInstruction = [&](MCInst &Instruction, uint64_t &Size,
+                               uint64_t Offset) {
+    return decodeInstructionAt(Instruction, Size, FunctionData, Offset,
+                               PredecodedIndex);
+  };
+
   uint64_t Size = 0;  // instruction size
   for (uint64_t Offset = 0; Offset < getSize(); Offset += Size) {
     MCInst Instruction;
@@ -1048,12 +1137,7 @@ bool BinaryFunction::disassemble() {
       continue;
     }
 
-    if (!BC.DisAsm->getInstruction(Instruction,
-                                   Size,
-                                   FunctionData.slice(Offset),
-                                   AbsoluteInstrAddr,
-                                   nulls(),
-                                   nulls())) {
+    if (!decodeInstruction(Instruction, Size, Offset)) {
       // Functions with "soft" boundaries, e.g. coming from assembly source,
       // can have 0-byte padding at the end.
       if (isZeroPaddingAt(Offset))
@@ -1109,9 +1193,7 @@ bool BinaryFunction::disassemble() {
 
     // Check if there's a relocation associated with this instruction.
     bool UsedReloc{false};
-    for (auto Itr = Relocations.lower_bound(Offset),
-         ItrE = Relocations.lower_bound(Offset + Size); Itr != ItrE; ++Itr) {
-      const auto &Relocation = Itr->second;
+    for (const auto &Relocation : getRelocationsInRange(Offset, Size)) {
 
       DEBUG(dbgs() << "BOLT-DEBUG: replacing immediate 0x"
             << Twine::utohexstr(Relocation.Value) << " with relocation"
@@ -1376,13 +1458,16 @@ add_instruction:
 
     // Record offset of the instruction for profile matching.
     if (BC.keepOffsetForInstruction(Instruction)) {
-      MIB->addAnnotation(Instruction, "Offset", static_cast<uint32_t>(Offset));
+      MIB->addAnnotation(Instruction, MCPlus::OffsetAnnotation,
+                         static_cast<uint32_t>(Offset));
     }
 
     addInstruction(Offset, std::move(Instruction));
   }
 
   clearList(Relocations);
+  clearList(PredecodedInstructions);
+  clearList(MemoryContents);
 
   if (!IsSimple) {
     clearList(Instructions);
@@ -1420,6 +1505,7 @@ bool BinaryFunction::scanExternalRefs() {
   assert(FunctionData.size() == getMaxSize() &&
          "function size does not match raw data size");
 
+  size_t PredecodedIndex = 0;
   uint64_t Size = 0;  // instruction size
   for (uint64_t Offset = 0; Offset < getSize(); Offset += Size) {
     // Check for data inside code and ignore it
@@ -1430,12 +1516,8 @@ bool BinaryFunction::scanExternalRefs() {
 
     const uint64_t AbsoluteInstrAddr = getAddress() + Offset;
     MCInst Instruction;
-    if (!BC.DisAsm->getInstruction(Instruction,
-                                   Size,
-                                   FunctionData.slice(Offset),
-                                   AbsoluteInstrAddr,
-                                   nulls(),
-                                   nulls())) {
+    if (!decodeInstructionAt(Instruction, Size, FunctionData, Offset,
+                             PredecodedIndex)) {
       if (opts::Verbosity >= 1 && !isZeroPaddingAt(Offset)) {
         errs() << "BOLT-WARNING: unable to disassemble instruction at offset 0x"
                << Twine::utohexstr(Offset) << " (address 0x"
@@ -1529,9 +1611,7 @@ bool BinaryFunction::scanExternalRefs() {
 
     // Create more relocations based on input file relocations.
     bool HasRel = false;
-    for (auto Itr = Relocations.lower_bound(Offset),
-         ItrE = Relocations.lower_bound(Offset + Size); Itr != ItrE; ++Itr) {
-      auto &Relocation = Itr->second;
+    for (const auto &Relocation : getRelocationsInRange(Offset, Size)) {
       if (ignoreReference(Relocation.Symbol))
         continue;
 
@@ -1601,6 +1681,7 @@ bool BinaryFunction::scanExternalRefs() {
 
   clearList(Relocations);
   clearList(ExternallyReferencedOffsets);
+  clearList(PredecodedInstructions);
 
   if (Success && BC.HasRelocations) {
     HasExternalRefRelocations = true;
@@ -1979,9 +2060,9 @@ bool BinaryFunction::buildCFG(MCPlusBuilder::AllocatorIdTy AllocatorId) {
   auto updateOffset = [&](uint64_t Offset) {
     assert(PrevBB && PrevBB != InsertBB && "invalid previous block");
     auto *PrevInstr = PrevBB->getLastNonPseudoInstr();
-    if (PrevInstr && !MIB->hasAnnotation(*PrevInstr, "Offset"))
-      MIB->addAnnotation(*PrevInstr, "Offset", static_cast<uint32_t>(Offset),
-                         AllocatorId);
+    if (PrevInstr && !MIB->hasAnnotation(*PrevInstr, MCPlus::OffsetAnnotation))
+      MIB->addAnnotation(*PrevInstr, MCPlus::OffsetAnnotation,
+                         static_cast<uint32_t>(Offset), AllocatorId);
   };
 
   for (auto I = Instructions.begin(), E = Instructions.end(); I != E; ++I) {
@@ -2006,9 +2087,9 @@ bool BinaryFunction::buildCFG(MCPlusBuilder::AllocatorIdTy AllocatorId) {
       HasSDTMarker = true;
       DEBUG(dbgs() << "SDTMarker or LKMarker detected in the input at : "
                    << utohexstr(InstrInputAddr) << "\n");
-      if (!MIB->hasAnnotation(Instr, "Offset")) {
-        MIB->addAnnotation(Instr, "Offset", static_cast<uint32_t>(Offset),
-                           AllocatorId);
+      if (!MIB->hasAnnotation(Instr, MCPlus::OffsetAnnotation)) {
+        MIB->addAnnotation(Instr, MCPlus::OffsetAnnotation,
+                           static_cast<uint32_t>(Offset), AllocatorId);
       }
     }
 
@@ -2215,7 +2296,12 @@ void BinaryFunction::postProcessCFG() {
   if (!requiresAddressTranslation() && !opts::Instrument)
     for (auto *BB : layout())
       for (auto &Inst : *BB)
-        BC.MIB->removeAnnotation(Inst, "Offset");
+        BC.MIB->removeAnnotation(Inst, MCPlus::OffsetAnnotation);
+
+  // The instruction lists are mostly final at this point. Passes that grow
+  // a block will reallocate its storage on demand.
+  for (auto *BB : BasicBlocks)
+    BB->shrinkInstructions();
 
   assert((!isSimple() || validateCFG()) &&
          "invalid CFG detected after post-processing");
@@ -2231,8 +2317,8 @@ void BinaryFunction::calculateMacroOpFusionStats() {
 
     // Check offset of the second instruction.
     // FIXME: arch-specific.
-    const auto Offset =
-      BC.MIB->getAnnotationWithDefault<uint32_t>(*std::next(II), "Offset", 0);
+    const auto Offset = BC.MIB->getAnnotationWithDefault<uint32_t>(
+        *std::next(II), MCPlus::OffsetAnnotation, 0);
     if (!Offset || (getAddress() + Offset) % 64)
       continue;
 
@@ -2279,11 +2365,10 @@ void BinaryFunction::removeConditionalTailCalls() {
     uint64_t CTCTakenCount = BinaryBasicBlock::COUNT_NO_PROFILE;
     uint64_t CTCMispredCount = BinaryBasicBlock::COUNT_NO_PROFILE;
     if (hasValidProfile()) {
-      CTCTakenCount =
-        BC.MIB->getAnnotationWithDefault<uint64_t>(*CTCInstr, "CTCTakenCount");
-      CTCMispredCount =
-        BC.MIB->getAnnotationWithDefault<uint64_t>(*CTCInstr,
-                                                   "CTCMispredCount");
+      CTCTakenCount = BC.MIB->getAnnotationWithDefault(
+          *CTCInstr, MCPlus::CTCTakenCountAnnotation);
+      CTCMispredCount = BC.MIB->getAnnotationWithDefault(
+          *CTCInstr, MCPlus::CTCMispredCountAnnotation);
     }
 
     // Assert that the tail call does not throw.
@@ -2295,12 +2380,16 @@ void BinaryFunction::removeConditionalTailCalls() {
     const auto *CTCTargetLabel = BC.MIB->getTargetSymbol(*CTCInstr);
     assert(CTCTargetLabel && "symbol expected for conditional tail call");
     MCInst TailCallInstr;
-    BC.MIB->createTailCall(TailCallInstr, CTCTargetLabel, BC.Ctx.get());
+    MCSymbol *TailCallLabel;
+    {
+      auto L = BC.scopeLock();
+      BC.MIB->createTailCall(TailCallInstr, CTCTargetLabel, BC.Ctx.get());
+      TailCallLabel = BC.Ctx->createTempSymbol("TC", true);
+    }
     // Link new BBs to the original input offset of the BB where the CTC
     // is, so we can map samples recorded in new BBs back to the original BB
     // seem in the input binary (if using BAT)
-    auto TailCallBB = createBasicBlock(BB.getInputOffset(),
-                                       BC.Ctx->createTempSymbol("TC", true));
+    auto TailCallBB = createBasicBlock(BB.getInputOffset(), TailCallLabel);
     TailCallBB->addInstruction(TailCallInstr);
     TailCallBB->setCFIState(CFIStateBeforeCTC);
 
@@ -2312,8 +2401,11 @@ void BinaryFunction::removeConditionalTailCalls() {
 
     BC.MIB->convertTailCallToJmp(*CTCInstr);
 
-    BC.MIB->replaceBranchTarget(*CTCInstr, TailCallBB->getLabel(),
-                                BC.Ctx.get());
+    {
+      auto L = BC.scopeLock();
+      BC.MIB->replaceBranchTarget(*CTCInstr, TailCallBB->getLabel(),
+                                  BC.Ctx.get());
+    }
 
     // Add basic block to the list that will be added to the end.
     NewBlocks.emplace_back(std::move(TailCallBB));
@@ -2844,7 +2936,8 @@ bool BinaryFunction::finalizeCFIState() {
 }
 
 bool BinaryFunction::requiresAddressTranslation() const {
-  return opts::EnableBAT || hasSDTMarker();
+  return opts::EnableBAT || !opts::SymbolizationMap.empty() ||
+         hasSDTMarker();
 }
 
 uint64_t BinaryFunction::getInstructionCount() const {
@@ -3572,23 +3665,16 @@ BinaryFunction::BasicBlockOrderType BinaryFunction::dfs() const {
   return DFS;
 }
 
-size_t BinaryFunction::computeHash(bool UseDFS,
-                                   OperandHashFuncTy OperandHashFunc) const {
-  if (size() == 0)
-    return 0;
-
-  assert(hasCFG() && "function is expected to have CFG");
-
-  const auto &Order = UseDFS ? dfs() : BasicBlocksLayout;
+namespace {
 
-  // The hash is computed by creating a string of all instruction opcodes and
-  // possibly their operands and then hashing that string with std::hash.
-  std::string HashString;
+/// Call \p Callback for every instruction of the function with the basic
+/// block order \p Order that contributes to the function hash.
+void forEachHashedInstruction(const BinaryContext &BC,
+                              const BinaryFunction::BasicBlockOrderType &Order,
+                              function_ref<void(const MCInst &)> Callback) {
   for (const auto *BB : Order) {
     for (const auto &Inst : *BB) {
-      unsigned Opcode = Inst.getOpcode();
-
-      if (BC.MII->get(Opcode).isPseudo())
+      if (BC.MII->get(Inst.getOpcode()).isPseudo())
         continue;
 
       // Ignore unconditional jumps since we check CFG consistency by processing
@@ -3597,24 +3683,78 @@ size_t BinaryFunction::computeHash(bool UseDFS,
       if (BC.MIB->isUnconditionalBranch(Inst))
         continue;
 
-      if (Opcode == 0)
-        HashString.push_back(0);
+      Callback(Inst);
+    }
+  }
+}
 
-      while (Opcode) {
-        uint8_t LSB = Opcode & 0xff;
-        HashString.push_back(LSB);
-        Opcode = Opcode >> 8;
-      }
+} // anonymous namespace
 
-      for (int I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E; ++I) {
-        HashString.append(OperandHashFunc(Inst.getOperand(I)));
-      }
+size_t BinaryFunction::computeHash(bool UseDFS) const {
+  if (size() == 0)
+    return 0;
+
+  assert(hasCFG() && "function is expected to have CFG");
+
+  // The hash is computed by creating a string of all instruction opcodes and
+  // then hashing that string with std::hash. The hash is stored in profiles,
+  // hence it should not change.
+  std::string HashString;
+  forEachHashedInstruction(BC, UseDFS ? dfs() : BasicBlocksLayout,
+                           [&](const MCInst &Inst) {
+    unsigned Opcode = Inst.getOpcode();
+    if (Opcode == 0)
+      HashString.push_back(0);
+
+    while (Opcode) {
+      uint8_t LSB = Opcode & 0xff;
+      HashString.push_back(LSB);
+      Opcode = Opcode >> 8;
     }
-  }
+  });
 
   return Hash = std::hash<std::string>{}(HashString);
 }
 
+size_t BinaryFunction::computeBlockHash(const BinaryBasicBlock &BB) const {
+  std::string HashString;
+  forEachHashedInstruction(
+      BC, BasicBlockOrderType{const_cast<BinaryBasicBlock *>(&BB)},
+      [&](const MCInst &Inst) {
+    unsigned Opcode = Inst.getOpcode();
+    if (Opcode == 0)
+      HashString.push_back(0);
+
+    while (Opcode) {
+      uint8_t LSB = Opcode & 0xff;
+      HashString.push_back(LSB);
+      Opcode = Opcode >> 8;
+    }
+  });
+
+  return std::hash<std::string>{}(HashString);
+}
+
+size_t BinaryFunction::computeHash(bool UseDFS,
+                                   OperandHashFuncTy OperandHashFunc) const {
+  if (size() == 0)
+    return 0;
+
+  assert(hasCFG() && "function is expected to have CFG");
+
+  // Opcodes and operand hashes are combined into the hash as instructions are
+  // visited, without building an intermediate string.
+  hash_code HashCode(0);
+  forEachHashedInstruction(BC, UseDFS ? dfs() : BasicBlocksLayout,
+                           [&](const MCInst &Inst) {
+    HashCode = hash_combine(HashCode, Inst.getOpcode());
+    for (int I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E; ++I)
+      HashCode = hash_combine(HashCode, OperandHashFunc(Inst.getOperand(I)));
+  });
+
+  return Hash = HashCode;
+}
+
 void BinaryFunction::insertBasicBlocks(
     BinaryBasicBlock *Start,
     std::vector<std::unique_ptr<BinaryBasicBlock>> &&NewBBs,
@@ -4311,7 +4451,7 @@ DebugAddressRangesVector BinaryFunction::translateInputToOutputRanges(
 
 MCInst *BinaryFunction::getInstructionAtOffset(uint64_t Offset) {
   if (CurrentState == State::Disassembled) {
-    auto II = Instructions.find(Offset);
+    auto II = findInstruction(Offset);
     return (II == Instructions.end()) ? nullptr : &II->second;
   } else if (CurrentState == State::CFG) {
     auto *BB = getBasicBlockContainingOffset(Offset);
@@ -4320,8 +4460,8 @@ MCInst *BinaryFunction::getInstructionAtOffset(uint64_t Offset) {
 
     for (auto &Inst : *BB) {
       constexpr auto InvalidOffset = std::numeric_limits<uint32_t>::max();
-      if (Offset == BC.MIB->getAnnotationWithDefault<uint32_t>(Inst, "Offset",
-                                                               InvalidOffset))
+      if (Offset == BC.MIB->getAnnotationWithDefault(
+                        Inst, MCPlus::OffsetAnnotation, InvalidOffset))
         return &Inst;
     }
 
@@ -108,6 +108,61 @@ inline raw_ostream &operator<<(raw_ostream &OS,
   return OS;
 }
 
+namespace MCPlus {
+
+/// Targets and counts of an indirect call or of an indirect branch.
+extern const AnnotationKey<IndirectCallSiteProfile> CallProfileAnnotation;
+
+} // namespace MCPlus
+
+/// Number of times an argument value was observed at a value profiled call
+/// site.
+struct ValueProfileEntry {
+  uint64_t Value;
+  uint64_t Count;
+
+  bool operator==(const ValueProfileEntry &Other) const {
+    return Value == Other.Value && Count == Other.Count;
+  }
+};
+
+/// Aggregated value profile of a call site, as read from the profile.
+using ValueProfile = SmallVector<ValueProfileEntry, 4>;
+
+inline raw_ostream &operator<<(raw_ostream &OS, const bolt::ValueProfile &VP) {
+  const char *Sep = "";
+  for (auto &Entry : VP) {
+    OS << Sep << "{ " << Entry.Value << ": " << Entry.Count << " }";
+    Sep = ", ";
+  }
+  return OS;
+}
+
+/// Number of times a basic block of the callee, identified by its input
+/// offset, was executed when called from a particular call site.
+struct ContextProfileEntry {
+  uint32_t Offset;
+  uint64_t Count;
+
+  bool operator==(const ContextProfileEntry &Other) const {
+    return Offset == Other.Offset && Count == Other.Count;
+  }
+};
+
+/// Context-sensitive profile of the callee of a call site, sorted by offset.
+using ContextProfile = SmallVector<ContextProfileEntry, 8>;
+
+inline raw_ostream &operator<<(raw_ostream &OS,
+                               const bolt::ContextProfile &CP) {
+  const char *Sep = "";
+  for (auto &Entry : CP) {
+    OS << Sep << "{ 0x" << Twine::utohexstr(Entry.Offset) << ": "
+       << Entry.Count << " }";
+    Sep = ", ";
+  }
+  return OS;
+}
+
 /// BinaryFunction is a representation of machine-level function.
 ///
 /// In the input binary, an instance of BinaryFunction can represent a fragment
@@ -133,6 +188,14 @@ public:
     PF_MEMEVENT = 4,     /// Profile has mem events.
   };
 
+  /// Instruction decoded ahead of disassembly. A zero size marks an offset
+  /// that failed to decode.
+  struct PredecodedInstruction {
+    uint64_t Offset;
+    uint64_t Size;
+    MCInst Inst;
+  };
+
   /// Struct for tracking exception handling ranges.
   struct CallSite {
     const MCSymbol *Start;
@@ -357,6 +420,9 @@ private:
   /// Raw branch count for this function in the profile
   uint64_t RawBranchCount{0};
 
+  /// Number of entries into this function from other DSOs in the profile
+  uint64_t ExternalEntryCount{0};
+
   /// Indicates the type of profile the function is using.
   uint16_t ProfileFlags{PF_NONE};
 
@@ -386,6 +452,14 @@ private:
   /// Function order for streaming into the destination binary.
   uint32_t Index{-1U};
 
+  /// NUMA node of the thread that last ran parallel work on the function
+  /// with -numa-threads, or -1U.
+  unsigned NUMANode{-1U};
+
+  /// Order of the cold fragment in the cold section, if it is laid out
+  /// separately from the function order.
+  uint32_t ColdIndex{-1U};
+
   /// Get basic block index assuming it belongs to this function.
   unsigned getIndex(const BinaryBasicBlock *BB) const {
     assert(BB->getIndex() < BasicBlocks.size());
@@ -448,11 +522,38 @@ private:
   using LabelsMapType = std::map<uint32_t, MCSymbol *>;
   LabelsMapType Labels;
 
-  /// Temporary holder of instructions before CFG is constructed.
-  /// Map offset in the function to MCInst.
-  using InstrMapType = std::map<uint32_t, MCInst>;
+  /// Temporary holder of instructions before CFG is constructed, with their
+  /// offsets in the function. Instructions are disassembled in the order of
+  /// their offsets, so they are appended to a vector sorted by offset that is
+  /// denser and faster to search than a map.
+  using InstrMapType = std::vector<std::pair<uint32_t, MCInst>>;
   InstrMapType Instructions;
 
+  /// Return the first instruction at or after \p Offset.
+  InstrMapType::iterator getInstructionLowerBound(uint64_t Offset) {
+    return std::lower_bound(Instructions.begin(), Instructions.end(), Offset,
+                            [](const std::pair<uint32_t, MCInst> &II,
+                               uint64_t Offset) { return II.first < Offset; });
+  }
+
+  /// Return the instruction at \p Offset, or Instructions.end().
+  InstrMapType::iterator findInstruction(uint64_t Offset) {
+    auto II = getInstructionLowerBound(Offset);
+    if (II != Instructions.end() && II->first != Offset)
+      return Instructions.end();
+    return II;
+  }
+
+  /// Instructions decoded by predecodeInstructions() ahead of disassemble(),
+  /// sorted by offset.
+  std::vector<PredecodedInstruction> PredecodedInstructions;
+
+  /// Contents of memory referenced by the function, as classified by
+  /// BinaryContext::analyzeMemoryAt() while disassembling. A jump table is
+  /// referenced by the instructions computing the target and again by the
+  /// indirect jump, and every classification scans the table twice.
+  std::unordered_map<uint64_t, MemoryContentsType> MemoryContents;
+
   /// List of DWARF CFI instructions. Original CFI from the binary must be
   /// sorted w.r.t. offset that it appears. We rely on this to replay CFIs
   /// if needed (to fix state after reordering BBs).
@@ -529,8 +630,9 @@ private:
   /// All jump table sites in the function before CFG is built.
   std::vector<std::pair<uint64_t, uint64_t>> JTSites;
 
-  /// List of relocations in this function.
-  std::map<uint64_t, Relocation> Relocations;
+  /// List of relocations in this function. Relocations are appended as they
+  /// are read and are sorted by offset with sortRelocations() afterwards.
+  std::vector<Relocation> Relocations;
 
   /// Map of relocations used for moving the function body as it is.
   using MoveRelocationsTy = std::map<uint64_t, Relocation>;
@@ -644,7 +746,13 @@ private:
   }
 
   void addInstruction(uint64_t Offset, MCInst &&Instruction) {
-    Instructions.emplace(Offset, std::forward<MCInst>(Instruction));
+    if (Instructions.empty() || Instructions.back().first < Offset) {
+      Instructions.emplace_back(Offset, std::forward<MCInst>(Instruction));
+      return;
+    }
+    auto II = getInstructionLowerBound(Offset);
+    if (II == Instructions.end() || II->first != Offset)
+      Instructions.emplace(II, Offset, std::forward<MCInst>(Instruction));
   }
 
   /// Convert CFI instructions to a standard form (remove remember/restore).
@@ -722,6 +830,10 @@ private:
 
     clearList(FrameInstructions);
     clearList(FrameRestoreEquivalents);
+    clearList(OffsetToCFI);
+    clearList(JTSites);
+    clearList(PredecodedInstructions);
+    clearList(BasicBlocksPreviousLayout);
   }
 
 public:
@@ -1129,6 +1241,37 @@ public:
     Index = Idx;
   }
 
+  /// Invalidate the streaming order index so it could be assigned again.
+  void resetIndex() {
+    Index = -1U;
+  }
+
+  /// Return the NUMA node holding most of the data of the function, or -1U
+  /// if it is not known.
+  unsigned getNUMANode() const {
+    return NUMANode;
+  }
+
+  void setNUMANode(unsigned Node) {
+    NUMANode = Node;
+  }
+
+  /// Does the cold fragment of this function have a valid order index?
+  bool hasValidColdIndex() const {
+    return ColdIndex != -1U;
+  }
+
+  /// Get the order index of the cold fragment in the cold section.
+  uint32_t getColdIndex() const {
+    return ColdIndex;
+  }
+
+  /// Set the order index of the cold fragment in the cold section.
+  void setColdIndex(uint32_t Idx) {
+    assert(!hasValidColdIndex());
+    ColdIndex = Idx;
+  }
+
   /// Get the original address for the given basic block within this function.
   uint64_t getBasicBlockOriginalAddress(const BinaryBasicBlock *BB) const {
     return Address + BB->getOffset();
@@ -1326,7 +1469,8 @@ public:
     case ELF::R_AARCH64_ADR_GOT_PAGE:
     case ELF::R_AARCH64_TLSDESC_ADR_PAGE21:
     case ELF::R_AARCH64_ADR_PREL_PG_HI21:
-      Relocations[Offset] = Relocation{Offset, Symbol, RelType, Addend, Value};
+      Relocations.emplace_back(
+          Relocation{Offset, Symbol, RelType, Addend, Value});
       break;
     case ELF::R_X86_64_PC32:
     case ELF::R_X86_64_PC8:
@@ -1353,6 +1497,15 @@ public:
     //      Relocation{Offset, Symbol, RelType, Addend, Value};
   }
 
+  /// Sort relocations registered with addRelocation() by offset. If there are
+  /// multiple relocations at the same offset, the last one registered is kept.
+  void sortRelocations();
+
+  /// Return relocations of the function at offsets from \p Offset up to but
+  /// not including \p Offset + \p Size. Relocations have to be sorted.
+  iterator_range<std::vector<Relocation>::const_iterator>
+  getRelocationsInRange(uint64_t Offset, uint64_t Size) const;
+
   /// Return the name of the section this function originated from.
   Optional<StringRef> getOriginSectionName() const {
     if (!OriginSection)
@@ -1555,6 +1708,12 @@ public:
     return !FrameInstructions.empty() || !CIEFrameInstructions.empty();
   }
 
+  /// Set the CFI program of the CIE to the one of \p Other, for a function
+  /// created as a copy of \p Other.
+  void copyCIEFrameInstructions(const BinaryFunction &Other) {
+    CIEFrameInstructions = Other.CIEFrameInstructions;
+  }
+
   /// Return unique number associated with the function.
   uint64_t getFunctionNumber() const {
     return FunctionNumber;
@@ -1791,7 +1950,7 @@ public:
     // harder for us to recover this information, since we can create empty BBs
     // with NOPs and then reorder it away.
     // We fix this by moving the CFI instruction just before any NOPs.
-    auto I = Instructions.lower_bound(Offset);
+    auto I = getInstructionLowerBound(Offset);
     if (Offset == getSize()) {
       assert(I == Instructions.end() && "unexpected iterator value");
       // Sometimes compiler issues restore_state after all instructions
@@ -2030,6 +2189,10 @@ public:
   /// executions corresponding to this function.
   uint64_t getRawBranchCount() const { return RawBranchCount; }
 
+  /// Return the number of times the function was entered from code in other
+  /// DSOs, as attributed by perf2bolt -cross-dso-profile.
+  uint64_t getExternalEntryCount() const { return ExternalEntryCount; }
+
   /// Return the execution count for functions with known profile.
   /// Return 0 if the function has no profile.
   uint64_t getKnownExecutionCount() const {
@@ -2216,6 +2379,35 @@ public:
   /// Returns false if disassembly failed.
   bool disassemble();
 
+  /// Decode instructions of the function from \p FunctionData using
+  /// \p DisAsm for a subsequent call to disassemble() or scanExternalRefs().
+  /// Only the function contents and data-in-code markers are read, hence it
+  /// could run in parallel for different functions as long as each thread
+  /// uses its own disassembler.
+  void predecodeInstructions(const MCDisassembler &DisAsm,
+                             ArrayRef<uint8_t> FunctionData);
+
+  /// Return instructions decoded by predecodeInstructions() that were not
+  /// consumed yet.
+  const std::vector<PredecodedInstruction> &getPredecodedInstructions() const {
+    return PredecodedInstructions;
+  }
+
+  /// Use \p Instructions decoded elsewhere, e.g. loaded from a disassembly
+  /// cache, in place of predecodeInstructions().
+  void setPredecodedInstructions(
+      std::vector<PredecodedInstruction> &&Instructions) {
+    PredecodedInstructions = std::move(Instructions);
+  }
+
+  /// Decode the instruction at \p Offset into \p Instruction, reusing the
+  /// result of predecodeInstructions() when available. Offsets have to be
+  /// requested in increasing order, and \p PredecodedIndex tracks the
+  /// position in the list of predecoded instructions between the calls.
+  bool decodeInstructionAt(MCInst &Instruction, uint64_t &Size,
+                           ArrayRef<uint8_t> FunctionData, uint64_t Offset,
+                           size_t &PredecodedIndex);
+
   /// Scan function for references to other functions. In relocation mode,
   /// add relocations for external references.
   ///
@@ -2364,6 +2556,15 @@ public:
     }
   }
 
+  /// Release the CFG of a function emitted with setEmitted(/*KeepCFG=*/true)
+  /// once it is no longer needed. The function should not be accessed while
+  /// this runs, but the call is safe to make from a worker thread.
+  void releaseEmittedCFG() {
+    assert(CurrentState == State::EmittedCFG && "CFG not kept after emission");
+    releaseCFG();
+    CurrentState = State::Emitted;
+  }
+
   /// Process LSDA information for the function.
   void parseLSDA(ArrayRef<uint8_t> LSDAData, uint64_t LSDAAddress);
 
@@ -2385,20 +2586,26 @@ public:
     return Hash;
   }
 
-  using OperandHashFuncTy =
-    function_ref<typename std::string(const MCOperand&)>;
+  using OperandHashFuncTy = function_ref<size_t(const MCOperand &)>;
 
   /// Compute the hash value of the function based on its contents.
   ///
   /// If \p UseDFS is set, process basic blocks in DFS order. Otherwise, use
   /// the existing layout order.
   ///
-  /// By default, instruction operands are ignored while calculating the hash.
-  /// The caller can change this via passing \p OperandHashFunc function.
-  /// The return result of this function will be mixed with internal hash.
-  size_t computeHash(bool UseDFS = false,
-                     OperandHashFuncTy OperandHashFunc =
-                       [](const MCOperand&) { return std::string(); }) const;
+  /// Instruction operands are ignored while calculating the hash. The value
+  /// only depends on opcodes and is stable between runs.
+  size_t computeHash(bool UseDFS = false) const;
+
+  /// Compute the hash value of the function based on its contents, including
+  /// instruction operands hashed with \p OperandHashFunc. The return result
+  /// of this function will be mixed with internal hash.
+  size_t computeHash(bool UseDFS, OperandHashFuncTy OperandHashFunc) const;
+
+  /// Compute the hash value of \p BB based on its instruction opcodes, with
+  /// the same rules as for the function hash. Used to match blocks of a
+  /// function that changed since it was profiled.
+  size_t computeBlockHash(const BinaryBasicBlock &BB) const;
 
   void setDWARFUnit(DWARFUnit *Unit) {
     DwarfUnit = Unit;
@@ -2411,8 +2618,7 @@ public:
 
   /// Return line info table for this function.
   const DWARFDebugLine::LineTable *getDWARFLineTable() const {
-    return getDWARFUnit() ? BC.DwCtx->getLineTableForUnit(getDWARFUnit())
-                          : nullptr;
+    return getDWARFUnit() ? BC.getLineTableForUnit(getDWARFUnit()) : nullptr;
   }
 
   /// Finalize profile for the function.
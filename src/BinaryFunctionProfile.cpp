@@ -31,7 +31,7 @@ extern cl::OptionCategory BoltOptCategory;
 extern cl::opt<IndirectCallPromotionType> IndirectCallPromotion;
 extern cl::opt<JumpTableSupportLevel> JumpTables;
 
-static cl::opt<MCFCostFunction>
+cl::opt<MCFCostFunction>
 DoMCF("mcf",
   cl::desc("solve a min cost flow problem on the CFG to fix edge counts "
            "(default=disable)"),
@@ -46,7 +46,10 @@ DoMCF("mcf",
     clEnumValN(MCF_LOG, "log",
                "cost function is inversely proportional to log of edge count"),
     clEnumValN(MCF_BLAMEFTS, "blamefts",
-               "tune cost to blame fall-through edges for surplus flow")),
+               "tune cost to blame fall-through edges for surplus flow"),
+    clEnumValN(MCF_INFER, "infer",
+               "infer block and edge counts that deviate the least from the "
+               "profile")),
   cl::ZeroOrMore,
   cl::Hidden,
   cl::cat(BoltOptCategory));
@@ -139,7 +142,8 @@ void BinaryFunction::postProcessProfile() {
         if (!BC.MIA->isCall(Inst))
           continue;
 
-        auto CountAnnt = BC.MIB->tryGetAnnotationAs<uint64_t>(Inst, "Count");
+        auto CountAnnt =
+            BC.MIB->tryGetAnnotationAs(Inst, MCPlus::CountAnnotation);
         if (CountAnnt) {
           BB->setExecutionCount(std::max(BB->getExecutionCount(), *CountAnnt));
         }
@@ -303,8 +307,8 @@ void BinaryFunction::inferFallThroughCounts() {
     uint64_t CTCTakenCount = 0;
     const auto CTCInstr = BB->getLastNonPseudoInstr();
     if (CTCInstr && BC.MIB->getConditionalTailCall(*CTCInstr)) {
-      CTCTakenCount =
-        BC.MIB->getAnnotationWithDefault<uint64_t>(*CTCInstr, "CTCTakenCount");
+      CTCTakenCount = BC.MIB->getAnnotationWithDefault(
+          *CTCInstr, MCPlus::CTCTakenCountAnnotation);
     }
 
     // Calculate frequency of throws from this node according to LBR data
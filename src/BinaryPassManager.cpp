@@ -10,25 +10,35 @@
 //===----------------------------------------------------------------------===//
 
 #include "BinaryPassManager.h"
+#include "ParallelUtilities.h"
 #include "Passes/Aligner.h"
 #include "Passes/AllocCombiner.h"
+#include "Passes/ColdOutliner.h"
 #include "Passes/FrameOptimizer.h"
+#include "Passes/HotRegionExport.h"
 #include "Passes/IdenticalCodeFolding.h"
 #include "Passes/IndirectCallPromotion.h"
 #include "Passes/Inliner.h"
 #include "Passes/Instrumentation.h"
+#include "Passes/JTCompaction.h"
 #include "Passes/JTFootprintReduction.h"
+#include "Passes/LayoutPlan.h"
+#include "Passes/LayoutTuning.h"
 #include "Passes/LongJmp.h"
 #include "Passes/PLTCall.h"
 #include "Passes/PatchEntries.h"
+#include "Passes/PrefetchInsertion.h"
 #include "Passes/RegReAssign.h"
 #include "Passes/ReorderData.h"
 #include "Passes/ReorderFunctions.h"
 #include "Passes/RetpolineInsertion.h"
 #include "Passes/SplitFunctions.h"
 #include "Passes/StokeInfo.h"
+#include "Passes/TailDuplication.h"
 #include "Passes/ValidateInternalCalls.h"
 #include "Passes/VeneerElimination.h"
+#include "SpeedupModel.h"
+#include "Telemetry.h"
 #include "llvm/Support/FormatVariadic.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/Support/raw_ostream.h"
@@ -42,6 +52,7 @@ extern cl::OptionCategory BoltOptCategory;
 extern cl::OptionCategory BoltCategory;
 
 extern cl::opt<bool> Instrument;
+extern cl::opt<bool> InsertPrefetches;
 
 extern cl::opt<unsigned> Verbosity;
 extern cl::opt<bool> PrintAll;
@@ -69,6 +80,62 @@ ICF("icf",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+TimeBudget("time-budget",
+  cl::desc("time budget in seconds for optimization passes. Once spent, "
+           "expensive optimizations fall back to cheaper settings for the "
+           "remaining functions, which are processed hottest first "
+           "(0 = no budget)"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::value_desc("seconds"),
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+FuseLocalPasses("fuse-local-passes",
+  cl::desc("run consecutive function-local passes in a single sweep over "
+           "functions"),
+  cl::init(true),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+OutlineCold("outline-cold",
+  cl::desc("outline instruction sequences repeated in cold fragments of split "
+           "functions into shared stubs"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+PrintOutlineCold("print-after-outline-cold",
+  cl::desc("print function after outline-cold pass"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+TailDuplicationFlag("tail-duplication",
+  cl::desc("copy small blocks shared by several predecessors into their hot "
+           "predecessors before block reordering"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+PrintTailDuplication("print-after-tail-duplication",
+  cl::desc("print function after tail-duplication pass"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+TuneLayout("tune-layout",
+  cl::desc("search the parameters of ext-tsp block layout and hfsort+ "
+           "function layout that minimize simulated instruction cache and "
+           "TLB misses before running them"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 JTFootprintReductionFlag("jt-footprint-reduction",
   cl::desc("make jump tables size smaller at the cost of using more "
@@ -76,6 +143,20 @@ JTFootprintReductionFlag("jt-footprint-reduction",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+JTCompactionFlag("jt-compaction",
+  cl::desc("re-encode PIC jump tables of hot code with 8- or 16-bit entries "
+           "when the function is small enough"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+PrintJTCompaction("print-after-jt-compaction",
+  cl::desc("print function after jt-compaction pass"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 PrintJTFootprintReduction("print-after-jt-footprint-reduction",
   cl::desc("print function after jt-footprint-reduction pass"),
@@ -102,6 +183,13 @@ PrintAfterLowering("print-after-lowering",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+PrintPrefetchInsertion("print-after-prefetch-insertion",
+  cl::desc("print functions after prefetch insertion pass"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 PrintFOP("print-fop",
   cl::desc("print functions after frame optimizer pass"),
@@ -178,7 +266,7 @@ PrintReordered("print-reordered",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
-static cl::opt<bool>
+cl::opt<bool>
 PrintReorderedFunctions("print-reordered-functions",
   cl::desc("print functions after clustering"),
   cl::ZeroOrMore,
@@ -199,7 +287,7 @@ PrintSimplifyROLoads("print-simplify-rodata-loads",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
-static cl::opt<bool>
+cl::opt<bool>
 PrintSplit("print-split",
   cl::desc("print functions after code splitting"),
   cl::ZeroOrMore,
@@ -213,7 +301,7 @@ PrintUCE("print-uce",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
-static cl::opt<bool>
+cl::opt<bool>
 PrintProfileStats("print-profile-stats",
   cl::desc("print profile quality/bias analysis"),
   cl::ZeroOrMore,
@@ -256,6 +344,14 @@ SpecializeMemcpy1("memcpy1-spec",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+SpecializeMemcpyBySize("memcpy-size-spec",
+  cl::desc("specialize memcpy() and memset() call sites for their dominant "
+           "sizes according to the value profile (X86-only)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 StripRepRet("strip-rep-ret",
   cl::desc("strip 'repz' prefix from 'repz retq' sequence (on by default)"),
@@ -318,14 +414,85 @@ const char BinaryFunctionPassManager::TimerGroupName[] =
 const char BinaryFunctionPassManager::TimerGroupDesc[] =
     "Binary Function Pass Manager";
 
+bool BinaryFunctionPassManager::canFuse(const BinaryFunctionPass &Pass) {
+  // Per-pass printing and verification need the state between the passes.
+  return opts::FuseLocalPasses && Pass.isFunctionLocal() && !Pass.printPass() &&
+         !opts::PrintAll && !opts::DumpDotAll && !opts::DynoStatsAll &&
+         !opts::VerifyCFG;
+}
+
+void BinaryFunctionPassManager::runFusedPasses(
+    ArrayRef<BinaryFunctionPass *> FusedPasses) {
+  std::string Name;
+  for (const auto *Pass : FusedPasses) {
+    if (!Name.empty())
+      Name += '+';
+    Name += Pass->getName();
+  }
+
+  if (opts::Verbosity > 0) {
+    outs() << "BOLT-INFO: Starting fused passes: " << Name << "\n";
+  }
+
+  NamedRegionTimer T(Name, Name, TimerGroupName, TimerGroupDesc, TimeOpts);
+  TelemetryScope TS("pass", Name);
+
+  for (auto *Pass : FusedPasses)
+    Pass->setupLocalRun(BC);
+
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR,
+      [&](BinaryFunction &BF) {
+        for (auto *Pass : FusedPasses)
+          Pass->runOnFunction(BF);
+      },
+      ParallelUtilities::PredicateTy(nullptr), Name);
+
+  for (auto *Pass : FusedPasses)
+    Pass->finishLocalRun(BC);
+
+  if (opts::Verbosity > 0) {
+    outs() << "BOLT-INFO: Finished fused passes: " << Name << "\n";
+  }
+}
+
 void BinaryFunctionPassManager::runPasses() {
   auto &BFs = BC.getBinaryFunctions();
+  bool ReportedTimeBudget = false;
   for (size_t PassIdx = 0; PassIdx < Passes.size(); PassIdx++) {
     const auto &OptPassPair = Passes[PassIdx];
     if (!OptPassPair.first)
       continue;
 
+    if (!ReportedTimeBudget && BC.isTimeBudgetExhausted()) {
+      outs() << "BOLT-WARNING: time budget of " << opts::TimeBudget
+             << " seconds exhausted before pass "
+             << OptPassPair.second->getName()
+             << ", using cheaper settings for the remaining work\n";
+      ReportedTimeBudget = true;
+    }
+
     auto &Pass = OptPassPair.second;
+
+    // Run consecutive function-local passes in a single sweep. Disabled
+    // passes in between do not break the sequence.
+    if (canFuse(*Pass)) {
+      std::vector<BinaryFunctionPass *> FusedPasses{Pass.get()};
+      auto NextIdx = PassIdx + 1;
+      for (; NextIdx < Passes.size(); ++NextIdx) {
+        if (!Passes[NextIdx].first)
+          continue;
+        if (!canFuse(*Passes[NextIdx].second))
+          break;
+        FusedPasses.push_back(Passes[NextIdx].second.get());
+      }
+      if (FusedPasses.size() > 1) {
+        runFusedPasses(FusedPasses);
+        PassIdx = NextIdx - 1;
+        continue;
+      }
+    }
+
     auto PassIdName = formatv("{0:2}_{1}", PassIdx, Pass->getName()).str();
 
     if (opts::Verbosity > 0) {
@@ -334,12 +501,13 @@ void BinaryFunctionPassManager::runPasses() {
 
     NamedRegionTimer T(Pass->getName(), Pass->getName(), TimerGroupName,
                        TimerGroupDesc, TimeOpts);
+    TelemetryScope TS("pass", Pass->getName());
 
     callWithDynoStats(
       [this,&Pass] {
         Pass->runOnFunctions(BC);
       },
-      BFs,
+      BC,
       Pass->getName(),
       opts::DynoStatsAll
     );
@@ -383,7 +551,8 @@ void BinaryFunctionPassManager::runPasses() {
 void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
   BinaryFunctionPassManager Manager(BC);
 
-  const auto InitialDynoStats = getDynoStats(BC.getBinaryFunctions());
+  const auto InitialDynoStats = getDynoStats(BC);
+  SpeedupModel::recordDynoStats(BC, /*AfterOptimizations=*/false);
 
   if (opts::Instrument) {
     Manager.registerPass(llvm::make_unique<Instrumentation>(NeverPrint));
@@ -414,6 +583,9 @@ void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
       llvm::make_unique<SpecializeMemcpy1>(NeverPrint, opts::SpecializeMemcpy1),
       !opts::SpecializeMemcpy1.empty());
 
+  Manager.registerPass(llvm::make_unique<SpecializeMemcpyBySize>(NeverPrint),
+                       opts::SpecializeMemcpyBySize);
+
   Manager.registerPass(llvm::make_unique<InlineMemcpy>(NeverPrint),
                        opts::StringOps);
 
@@ -437,6 +609,17 @@ void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
 
   Manager.registerPass(llvm::make_unique<PLTCall>(PrintPLT));
 
+  Manager.registerPass(
+    llvm::make_unique<PrefetchInsertion>(PrintPrefetchInsertion),
+    opts::InsertPrefetches);
+
+  Manager.registerPass(
+    llvm::make_unique<TailDuplication>(PrintTailDuplication),
+    opts::TailDuplicationFlag);
+
+  Manager.registerPass(llvm::make_unique<LayoutTuning>(NeverPrint),
+                       opts::TuneLayout);
+
   Manager.registerPass(llvm::make_unique<ReorderBasicBlocks>(PrintReordered));
 
   Manager.registerPass(
@@ -445,6 +628,12 @@ void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
 
   Manager.registerPass(llvm::make_unique<SplitFunctions>(PrintSplit));
 
+  // Replaces the block layout and the split points with the ones of a
+  // layout plan, before the branches are fixed.
+  Manager.registerPass(
+    llvm::make_unique<LayoutPlan>(NeverPrint, /*AfterAlignment=*/false),
+    LayoutPlan::isApplied());
+
   // This pass syncs local branches with CFG. If any of the following
   // passes breaks the sync - they either need to re-run the pass or
   // fix branches consistency internally.
@@ -462,10 +651,18 @@ void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
       InitialDynoStats, "after all optimizations before SCTC and FOP"),
     opts::PrintDynoStats | opts::DynoStatsAll);
 
+  Manager.registerPass(llvm::make_unique<SpeedupModelStatsPass>(),
+                       SpeedupModel::isEnabled());
+
   // Add the StokeInfo pass, which extract functions for stoke optimization and
   // get the liveness information for them
   Manager.registerPass(llvm::make_unique<StokeInfo>(PrintStoke), opts::Stoke);
 
+  // Exports hot regions for an external superoptimizer and imports the
+  // optimized code, at the same point of the pipeline.
+  Manager.registerPass(llvm::make_unique<HotRegionExport>(PrintStoke),
+                       HotRegionExport::isEnabled());
+
   // This pass introduces conditional jumps into external functions.
   // Between extending CFG to support this and isolating this pass we chose
   // the latter. Thus this pass will do double jump removal and unreachable
@@ -481,8 +678,23 @@ void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
 
   Manager.registerPass(llvm::make_unique<Peepholes>(PrintPeepholes));
 
+  // Runs once the layout is final, so that only code staying cold is
+  // outlined.
+  Manager.registerPass(llvm::make_unique<ColdOutliner>(PrintOutlineCold),
+                       OutlineCold);
+
+  // Entries are relative to the function start, so the code should not grow
+  // by much after this pass.
+  Manager.registerPass(llvm::make_unique<JTCompaction>(PrintJTCompaction),
+                       JTCompactionFlag);
+
   Manager.registerPass(llvm::make_unique<AlignerPass>());
 
+  // Writes the layout plan, or applies its function order and alignment.
+  Manager.registerPass(
+    llvm::make_unique<LayoutPlan>(NeverPrint, /*AfterAlignment=*/true),
+    LayoutPlan::isEnabled());
+
   // Perform reordering on data contained in one or more sections using
   // memory profiling data.
   Manager.registerPass(llvm::make_unique<ReorderData>());
@@ -528,6 +740,11 @@ void BinaryFunctionPassManager::runAllPasses(BinaryContext &BC) {
 
   Manager.registerPass(llvm::make_unique<LowerAnnotations>(NeverPrint));
 
+  if (opts::TimeBudget) {
+    BC.OptimizationDeadline = std::chrono::steady_clock::now() +
+                              std::chrono::seconds(opts::TimeBudget);
+  }
+
   Manager.runPasses();
 }
 
@@ -30,6 +30,12 @@ private:
   std::vector<std::pair<const bool,
                         std::unique_ptr<BinaryFunctionPass>>> Passes;
 
+  /// Return true if \p Pass could run in a sweep fused with other passes.
+  static bool canFuse(const BinaryFunctionPass &Pass);
+
+  /// Run function-local \p FusedPasses in a single sweep over functions.
+  void runFusedPasses(ArrayRef<BinaryFunctionPass *> FusedPasses);
+
  public:
   static const char TimerGroupName[];
   static const char TimerGroupDesc[];
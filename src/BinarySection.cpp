@@ -210,6 +210,20 @@ BinarySection::~BinarySection() {
   }
 }
 
+void BinarySection::releaseOutputContents() {
+  assert(!isAllocatable() && "cannot release allocatable section contents");
+  if (isReordered() || !OutputContents.data())
+    return;
+  if (!hasSectionRef() ||
+      OutputContents.data() != getContents(Section).data()) {
+    if (Contents.data() == OutputContents.data())
+      Contents = StringRef();
+    delete[] getOutputData();
+  }
+  OutputContents = StringRef();
+  clearRelocations();
+}
+
 void BinarySection::clearRelocations() {
   clearList(Relocations);
 }
@@ -328,6 +328,12 @@ public:
     return make_range(Relocations.begin(), Relocations.end());
   }
 
+  /// Iterate over all dynamic relocations for this section.
+  iterator_range<RelocationSetType::const_iterator>
+  dynamicRelocations() const {
+    return make_range(DynamicRelocations.begin(), DynamicRelocations.end());
+  }
+
   /// Does this section have any non-pending relocations?
   bool hasRelocations() const {
     return !Relocations.empty();
@@ -422,6 +428,9 @@ public:
     return reinterpret_cast<const uint8_t *>(getOutputContents().data());
   }
   StringRef getOutputContents() const { return OutputContents; }
+  /// Free the output contents of a non-allocatable section once they are
+  /// written to the output file. The output size is preserved.
+  void releaseOutputContents();
   uint64_t getAllocAddress() const {
     return reinterpret_cast<uint64_t>(getOutputData());
   }
@@ -486,7 +495,8 @@ public:
   /// Code for ELF notes written by producer 'BOLT'
   enum {
     NT_BOLT_BAT = 1,
-    NT_BOLT_INSTRUMENTATION_TABLES = 2
+    NT_BOLT_INSTRUMENTATION_TABLES = 2,
+    NT_BOLT_BAT_COMPACT = 3
   };
 };
 
@@ -11,11 +11,30 @@
 #include "BoltAddressTranslation.h"
 #include "BinaryFunction.h"
 #include "llvm/MC/MCAsmLayout.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/DataExtractor.h"
 #include "llvm/Support/Errc.h"
+#include "llvm/Support/LEB128.h"
+#include <limits>
 
 #define DEBUG_TYPE "bolt-bat"
 
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltCategory;
+
+static cl::opt<bool>
+CompactBAT("compact-bat",
+  cl::desc("write address translation tables in the compact format"),
+  cl::init(true),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
+}
+
 namespace llvm {
 namespace bolt {
 
@@ -79,6 +98,7 @@ void BoltAddressTranslation::write(raw_ostream &OS) {
       writeEntriesForBB(Map, *BB, Function.getOutputAddress());
     }
     Maps.insert(std::pair<uint64_t, MapTy>(Function.getOutputAddress(), Map));
+    InputAddresses.emplace(Function.getOutputAddress(), Function.getAddress());
 
     if (!IsSplit)
       continue;
@@ -96,6 +116,22 @@ void BoltAddressTranslation::write(raw_ostream &OS) {
         Function.cold().getAddress(), Function.getOutputAddress()));
   }
 
+  if (opts::CompactBAT)
+    writeCompactMaps(OS);
+  else
+    writeMaps(OS);
+
+  outs() << "BOLT-INFO: Wrote " << Maps.size() << " BAT maps\n";
+  outs() << "BOLT-INFO: Wrote " << ColdPartSource.size()
+         << " BAT cold-to-hot entries\n";
+}
+
+uint32_t BoltAddressTranslation::getNoteType() const {
+  return opts::CompactBAT ? BinarySection::NT_BOLT_BAT_COMPACT
+                          : BinarySection::NT_BOLT_BAT;
+}
+
+void BoltAddressTranslation::writeMaps(raw_ostream &OS) {
   const uint32_t NumFuncs = Maps.size();
   OS.write(reinterpret_cast<const char *>(&NumFuncs), 4);
   DEBUG(dbgs() << "Writing " << NumFuncs << " functions for BAT.\n");
@@ -121,10 +157,64 @@ void BoltAddressTranslation::write(raw_ostream &OS) {
     DEBUG(dbgs() << " " << Twine::utohexstr(ColdEntry.first) << " -> "
           << Twine::utohexstr(ColdEntry.second) << "\n");
   }
+  const uint32_t NumInputAddresses = InputAddresses.size();
+  OS.write(reinterpret_cast<const char *>(&NumInputAddresses), 4);
+  for (auto &InputEntry : InputAddresses) {
+    OS.write(reinterpret_cast<const char *>(&InputEntry.first), 8);
+    OS.write(reinterpret_cast<const char *>(&InputEntry.second), 8);
+  }
+}
 
-  outs() << "BOLT-INFO: Wrote " << Maps.size() << " BAT maps\n";
-  outs() << "BOLT-INFO: Wrote " << NumColdEntries
-         << " BAT cold-to-hot entries\n";
+void BoltAddressTranslation::writeCompactMaps(raw_ostream &OS) {
+  encodeULEB128(Maps.size(), OS);
+  uint64_t PrevAddress = 0;
+  std::string EntriesStr;
+  for (auto &MapEntry : Maps) {
+    const uint64_t Address = MapEntry.first;
+    const MapTy &Map = MapEntry.second;
+
+    EntriesStr.clear();
+    raw_string_ostream EntriesOS(EntriesStr);
+    uint32_t PrevOutputOffset = 0;
+    int64_t PrevInputOffset = 0;
+    for (auto &KeyVal : Map) {
+      const int64_t InputOffset = KeyVal.second & ~BRANCHENTRY;
+      const bool IsBranch = KeyVal.second & BRANCHENTRY;
+      encodeULEB128(KeyVal.first - PrevOutputOffset, EntriesOS);
+      encodeSLEB128((InputOffset - PrevInputOffset) * 2 + IsBranch,
+                    EntriesOS);
+      PrevOutputOffset = KeyVal.first;
+      PrevInputOffset = InputOffset;
+    }
+    EntriesOS.flush();
+
+    DEBUG(dbgs() << "Writing " << Map.size() << " entries in "
+                 << EntriesStr.size() << " bytes for 0x"
+                 << Twine::utohexstr(Address) << ".\n");
+    encodeULEB128(Address - PrevAddress, OS);
+    encodeULEB128(Map.size(), OS);
+    encodeULEB128(EntriesStr.size(), OS);
+    OS << EntriesStr;
+    PrevAddress = Address;
+  }
+
+  encodeULEB128(ColdPartSource.size(), OS);
+  PrevAddress = 0;
+  for (auto &ColdEntry : ColdPartSource) {
+    encodeULEB128(ColdEntry.first - PrevAddress, OS);
+    encodeSLEB128(static_cast<int64_t>(ColdEntry.second - ColdEntry.first),
+                  OS);
+    PrevAddress = ColdEntry.first;
+  }
+
+  encodeULEB128(InputAddresses.size(), OS);
+  PrevAddress = 0;
+  for (auto &InputEntry : InputAddresses) {
+    encodeULEB128(InputEntry.first - PrevAddress, OS);
+    encodeSLEB128(static_cast<int64_t>(InputEntry.second - InputEntry.first),
+                  OS);
+    PrevAddress = InputEntry.first;
+  }
 }
 
 std::error_code BoltAddressTranslation::parse(StringRef Buf) {
@@ -137,7 +227,8 @@ std::error_code BoltAddressTranslation::parse(StringRef Buf) {
   const uint32_t DescSz = DE.getU32(&Offset);
   const uint32_t Type = DE.getU32(&Offset);
 
-  if (Type != BinarySection::NT_BOLT_BAT ||
+  if ((Type != BinarySection::NT_BOLT_BAT &&
+       Type != BinarySection::NT_BOLT_BAT_COMPACT) ||
       Buf.size() + Offset < alignTo(NameSz, 4) + DescSz)
     return make_error_code(llvm::errc::io_error);
 
@@ -146,6 +237,24 @@ std::error_code BoltAddressTranslation::parse(StringRef Buf) {
   if (Name.substr(0, 4) != "BOLT")
     return make_error_code(llvm::errc::io_error);
 
+  std::error_code EC;
+  if (Type == BinarySection::NT_BOLT_BAT_COMPACT)
+    EC = parseCompactMaps(Buf.slice(Offset, Offset + DescSz));
+  else
+    EC = parseMaps(Buf.slice(0, Offset + DescSz), Offset);
+  if (EC)
+    return EC;
+
+  outs() << "BOLT-INFO: Parsed " << FuncIndex.size() << " BAT entries\n";
+  outs() << "BOLT-INFO: Parsed " << ColdIndex.size()
+         << " BAT cold-to-hot entries\n";
+
+  return std::error_code();
+}
+
+std::error_code BoltAddressTranslation::parseMaps(StringRef Buf,
+                                                  uint32_t Offset) {
+  DataExtractor DE = DataExtractor(Buf, true, 8);
   if (Buf.size() - Offset < 4)
     return make_error_code(llvm::errc::io_error);
 
@@ -188,34 +297,210 @@ std::error_code BoltAddressTranslation::parse(StringRef Buf) {
     DEBUG(dbgs() << Twine::utohexstr(ColdAddress) << " -> "
                  << Twine::utohexstr(HotAddress) << "\n");
   }
-  outs() << "BOLT-INFO: Parsed " << Maps.size() << " BAT entries\n";
-  outs() << "BOLT-INFO: Parsed " << NumColdEntries
-         << " BAT cold-to-hot entries\n";
+
+  InputIndex.clear();
+  if (Buf.size() - Offset >= 4) {
+    const uint32_t NumInputAddresses = DE.getU32(&Offset);
+    if ((Buf.size() - Offset) / 16 < NumInputAddresses)
+      return make_error_code(llvm::errc::io_error);
+    for (uint32_t I = 0; I < NumInputAddresses; ++I) {
+      const uint64_t OutputAddress = DE.getU64(&Offset);
+      const uint64_t InputAddress = DE.getU64(&Offset);
+      InputIndex.emplace_back(OutputAddress, InputAddress);
+    }
+  }
+  buildIndex();
+
+  return std::error_code();
+}
+
+std::error_code BoltAddressTranslation::parseCompactMaps(StringRef Buf) {
+  const uint8_t *Cur = Buf.bytes_begin();
+  const uint8_t *const End = Buf.bytes_end();
+  const char *Error = nullptr;
+  auto readULEB = [&]() -> uint64_t {
+    if (Error)
+      return 0;
+    unsigned Size;
+    const auto Value = decodeULEB128(Cur, &Size, End, &Error);
+    Cur += Error ? 0 : Size;
+    return Value;
+  };
+  auto readSLEB = [&]() -> int64_t {
+    if (Error)
+      return 0;
+    unsigned Size;
+    const auto Value = decodeSLEB128(Cur, &Size, End, &Error);
+    Cur += Error ? 0 : Size;
+    return Value;
+  };
+
+  const uint64_t NumFunctions = readULEB();
+  DEBUG(dbgs() << "Parsing " << NumFunctions << " functions\n");
+  if (NumFunctions > Buf.size())
+    return make_error_code(llvm::errc::io_error);
+
+  FuncIndex.clear();
+  FuncIndex.reserve(NumFunctions);
+  uint64_t Address = 0;
+  uint64_t NumEntries = 0;
+  for (uint64_t I = 0; I < NumFunctions; ++I) {
+    FuncIndexEntry Entry;
+    Address += readULEB();
+    Entry.Address = Address;
+    const uint64_t FuncEntries = readULEB();
+    const uint64_t Size = readULEB();
+    if (Error || Size > static_cast<uint64_t>(End - Cur) ||
+        FuncEntries > Size)
+      return make_error_code(llvm::errc::io_error);
+    Entry.Begin = NumEntries;
+    NumEntries += FuncEntries;
+    Entry.End = NumEntries;
+    Entry.Data = StringRef(reinterpret_cast<const char *>(Cur), Size);
+    Cur += Size;
+    FuncIndex.push_back(Entry);
+  }
+
+  const uint64_t NumColdEntries = readULEB();
+  DEBUG(dbgs() << "Parsing " << NumColdEntries << " cold part mappings\n");
+  if (NumColdEntries > static_cast<uint64_t>(End - Cur))
+    return make_error_code(llvm::errc::io_error);
+  ColdIndex.clear();
+  ColdIndex.reserve(NumColdEntries);
+  Address = 0;
+  for (uint64_t I = 0; I < NumColdEntries; ++I) {
+    Address += readULEB();
+    const uint64_t HotAddress = Address + readSLEB();
+    ColdIndex.emplace_back(Address, HotAddress);
+  }
+
+  InputIndex.clear();
+  if (Cur < End) {
+    const uint64_t NumInputAddresses = readULEB();
+    if (NumInputAddresses > static_cast<uint64_t>(End - Cur))
+      return make_error_code(llvm::errc::io_error);
+    InputIndex.reserve(NumInputAddresses);
+    Address = 0;
+    for (uint64_t I = 0; I < NumInputAddresses; ++I) {
+      Address += readULEB();
+      const uint64_t InputAddress = Address + readSLEB();
+      InputIndex.emplace_back(Address, InputAddress);
+    }
+  }
+  if (Error)
+    return make_error_code(llvm::errc::io_error);
+
+  // Entries are decoded on the first lookup in each function.
+  EntryKeys.assign(NumEntries, 0);
+  EntryVals.assign(NumEntries, 0);
+  DecodeFlags.reset(new std::once_flag[FuncIndex.size()]);
 
   return std::error_code();
 }
 
+void BoltAddressTranslation::decodeEntries(const FuncIndexEntry &Entry) const {
+  const uint8_t *Cur = Entry.Data.bytes_begin();
+  const uint8_t *const End = Entry.Data.bytes_end();
+  const char *Error = nullptr;
+  uint32_t OutputOffset = 0;
+  int64_t InputOffset = 0;
+  for (uint32_t I = Entry.Begin; I < Entry.End; ++I) {
+    unsigned Size;
+    OutputOffset += decodeULEB128(Cur, &Size, End, &Error);
+    if (Error)
+      break;
+    Cur += Size;
+    const int64_t Value = decodeSLEB128(Cur, &Size, End, &Error);
+    if (Error)
+      break;
+    Cur += Size;
+    InputOffset += Value >> 1;
+    EntryKeys[I] = OutputOffset;
+    EntryVals[I] = InputOffset | (Value & 1 ? BRANCHENTRY : 0);
+  }
+  if (Error) {
+    errs() << "BOLT-WARNING: malformed BAT entries for function at 0x"
+           << Twine::utohexstr(Entry.Address) << '\n';
+    // Leave the function without translation.
+    std::fill(EntryKeys.begin() + Entry.Begin, EntryKeys.begin() + Entry.End,
+              std::numeric_limits<uint32_t>::max());
+  }
+}
+
+void BoltAddressTranslation::buildIndex() {
+  size_t NumEntries = 0;
+  for (const auto &MapEntry : Maps)
+    NumEntries += MapEntry.second.size();
+
+  FuncIndex.clear();
+  FuncIndex.reserve(Maps.size());
+  EntryKeys.clear();
+  EntryKeys.reserve(NumEntries);
+  EntryVals.clear();
+  EntryVals.reserve(NumEntries);
+  for (const auto &MapEntry : Maps) {
+    FuncIndexEntry Entry;
+    Entry.Address = MapEntry.first;
+    Entry.Begin = EntryKeys.size();
+    for (const auto &KeyVal : MapEntry.second) {
+      EntryKeys.push_back(KeyVal.first);
+      EntryVals.push_back(KeyVal.second);
+    }
+    Entry.End = EntryKeys.size();
+    FuncIndex.push_back(Entry);
+  }
+
+  ColdIndex.assign(ColdPartSource.begin(), ColdPartSource.end());
+  DecodeFlags.reset();
+
+  Maps.clear();
+  ColdPartSource.clear();
+}
+
+const BoltAddressTranslation::FuncIndexEntry *
+BoltAddressTranslation::getFuncIndexEntry(uint64_t Address) const {
+  size_t Index = LastFuncIndex.load(std::memory_order_relaxed);
+  if (Index >= FuncIndex.size() || FuncIndex[Index].Address != Address) {
+    auto Iter =
+        std::lower_bound(FuncIndex.begin(), FuncIndex.end(), Address,
+                         [](const FuncIndexEntry &Entry, uint64_t Addr) {
+                           return Entry.Address < Addr;
+                         });
+    if (Iter == FuncIndex.end() || Iter->Address != Address)
+      return nullptr;
+
+    Index = Iter - FuncIndex.begin();
+    LastFuncIndex.store(Index, std::memory_order_relaxed);
+  }
+
+  const FuncIndexEntry &Entry = FuncIndex[Index];
+  if (DecodeFlags)
+    std::call_once(DecodeFlags[Index], [&] { decodeEntries(Entry); });
+  return &Entry;
+}
+
 uint64_t BoltAddressTranslation::translate(const BinaryFunction &Func,
                                            uint64_t Offset,
                                            bool IsBranchSrc) const {
-  auto Iter = Maps.find(Func.getAddress());
-  if (Iter == Maps.end())
+  const auto *Entry = getFuncIndexEntry(Func.getAddress());
+  if (!Entry)
     return Offset;
 
-  const MapTy &Map = Iter->second;
-  auto KeyVal = Map.upper_bound(Offset);
-  if (KeyVal == Map.begin())
+  const auto Begin = EntryKeys.begin() + Entry->Begin;
+  const auto End = EntryKeys.begin() + Entry->End;
+  auto KeyIter = std::upper_bound(Begin, End, Offset);
+  if (KeyIter == Begin)
     return Offset;
 
-  --KeyVal;
+  --KeyIter;
 
-  const uint32_t Val = KeyVal->second & ~BRANCHENTRY;
+  const uint32_t Val = EntryVals[KeyIter - EntryKeys.begin()] & ~BRANCHENTRY;
   // Branch source addresses are translated to the first instruction of the
   // source BB to avoid accounting for modifications BOLT may have made in the
   // BB regarding deletion/addition of instructions.
   if (IsBranchSrc)
     return Val;
-  return Offset - KeyVal->first + Val;
+  return Offset - *KeyIter + Val;
 }
 
 Optional<SmallVector<std::pair<uint64_t, uint64_t>, 16>>
@@ -230,56 +515,100 @@ BoltAddressTranslation::getFallthroughsInTrace(
   From -= Func.getAddress();
   To -= Func.getAddress();
 
-  auto Iter = Maps.find(Func.getAddress());
-  if (Iter == Maps.end()) {
+  const auto *Entry = getFuncIndexEntry(Func.getAddress());
+  if (!Entry) {
     return NoneType();
   }
 
-  const MapTy &Map = Iter->second;
-  auto FromIter = Map.upper_bound(From);
-  if (FromIter == Map.begin())
+  const auto Begin = EntryKeys.begin() + Entry->Begin;
+  const auto End = EntryKeys.begin() + Entry->End;
+  auto isBranch = [&](uint32_t I) { return EntryVals[I] & BRANCHENTRY; };
+
+  uint32_t FromIdx = std::upper_bound(Begin, End, From) - EntryKeys.begin();
+  if (FromIdx == Entry->Begin)
     return Res;
   // Skip instruction entries, to create fallthroughs we are only interested in
   // BB boundaries
   do {
-    if (FromIter == Map.begin())
+    if (FromIdx == Entry->Begin)
       return Res;
-    --FromIter;
-  } while (FromIter->second & BRANCHENTRY);
+    --FromIdx;
+  } while (isBranch(FromIdx));
 
-  auto ToIter = Map.upper_bound(To);
-  if (ToIter == Map.begin())
+  uint32_t ToIdx = std::upper_bound(Begin, End, To) - EntryKeys.begin();
+  if (ToIdx == Entry->Begin)
     return Res;
-  --ToIter;
-  if (FromIter->first >= ToIter->first)
+  --ToIdx;
+  if (EntryKeys[FromIdx] >= EntryKeys[ToIdx])
     return Res;
 
-  for (auto Iter = FromIter; Iter != ToIter; ) {
-    const auto Src = Iter->first;
-    if (Iter->second & BRANCHENTRY) {
-      ++Iter;
+  for (auto Idx = FromIdx; Idx != ToIdx; ) {
+    const auto Src = EntryKeys[Idx];
+    if (isBranch(Idx)) {
+      ++Idx;
       continue;
     }
 
-    ++Iter;
-    while (Iter->second & BRANCHENTRY && Iter != ToIter) {
-      ++Iter;
+    ++Idx;
+    while (isBranch(Idx) && Idx != ToIdx) {
+      ++Idx;
     }
-    if (Iter->second & BRANCHENTRY)
+    if (isBranch(Idx))
       break;
-    Res.emplace_back(std::make_pair(Src, Iter->first));
+    Res.emplace_back(std::make_pair(Src, EntryKeys[Idx]));
   }
 
   return Res;
 }
 
 uint64_t BoltAddressTranslation::fetchParentAddress(uint64_t Address) const {
-  auto Iter = ColdPartSource.find(Address);
-  if (Iter == ColdPartSource.end())
+  auto Iter = std::lower_bound(
+      ColdIndex.begin(), ColdIndex.end(), Address,
+      [](const std::pair<uint64_t, uint64_t> &Entry, uint64_t Addr) {
+        return Entry.first < Addr;
+      });
+  if (Iter == ColdIndex.end() || Iter->first != Address)
+    return 0;
+  return Iter->second;
+}
+
+uint64_t BoltAddressTranslation::getInputAddress(uint64_t Address) const {
+  auto Iter = std::lower_bound(
+      InputIndex.begin(), InputIndex.end(), Address,
+      [](const std::pair<uint64_t, uint64_t> &Entry, uint64_t Addr) {
+        return Entry.first < Addr;
+      });
+  if (Iter == InputIndex.end() || Iter->first != Address)
     return 0;
   return Iter->second;
 }
 
+SmallVector<std::pair<uint64_t, uint64_t>, 16>
+BoltAddressTranslation::translateRange(const BinaryFunction &Func,
+                                       uint64_t From, uint64_t To) const {
+  SmallVector<std::pair<uint64_t, uint64_t>, 16> Res;
+  const auto *Entry = getFuncIndexEntry(Func.getAddress());
+  if (!Entry || From > To) {
+    Res.emplace_back(From, To);
+    return Res;
+  }
+
+  // Code between two consecutive entries is contiguous in the input.
+  const auto Begin = EntryKeys.begin() + Entry->Begin;
+  const auto End = EntryKeys.begin() + Entry->End;
+  auto KeyIter = std::upper_bound(Begin, End, From);
+  uint64_t Start = From;
+  while (KeyIter != End && *KeyIter <= To) {
+    if (*KeyIter > Start)
+      Res.emplace_back(translate(Func, Start, /*IsBranchSrc=*/false),
+                       translate(Func, *KeyIter - 1, /*IsBranchSrc=*/false));
+    Start = *KeyIter++;
+  }
+  Res.emplace_back(translate(Func, Start, /*IsBranchSrc=*/false),
+                   translate(Func, To, /*IsBranchSrc=*/false));
+  return Res;
+}
+
 bool BoltAddressTranslation::enabledFor(
     llvm::object::ELFObjectFileBase *InputFile) const {
   for (const auto &Section : InputFile->sections()) {
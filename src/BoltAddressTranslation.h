@@ -14,6 +14,8 @@
 
 #include "BinaryContext.h"
 #include "llvm/Object/ELFObjectFile.h"
+#include <atomic>
+#include <mutex>
 
 namespace llvm {
 
@@ -70,8 +72,13 @@ public:
   /// function
   void write(raw_ostream &OS);
 
+  /// Return the type of the ELF note holding the tables written by write().
+  uint32_t getNoteType() const;
+
   /// Read the serialized address translation tables and load them internally
-  /// in memory. Return a parse error if failed.
+  /// in memory. Return a parse error if failed. Entries of the compact format
+  /// are decoded on the first lookup in a function, and \p Buf must outlive
+  /// this object.
   std::error_code parse(StringRef Buf);
 
   /// If the maps are loaded in memory, perform the lookup to translate LBR
@@ -91,6 +98,19 @@ public:
   /// at \p Address. Return 0 otherwise.
   uint64_t fetchParentAddress(uint64_t Address) const;
 
+  /// Return the address in the input binary of the function at the output
+  /// \p Address, or 0 if the table does not record it.
+  uint64_t getInputAddress(uint64_t Address) const;
+
+  /// Return true if the table records the input addresses of functions.
+  bool hasInputAddresses() const { return !InputIndex.empty(); }
+
+  /// Translate the output range [\p From, \p To] of offsets in \p Func to the
+  /// ranges of input offsets holding the same code, one per translation
+  /// entry crossed by the range.
+  SmallVector<std::pair<uint64_t, uint64_t>, 16>
+  translateRange(const BinaryFunction &Func, uint64_t From, uint64_t To) const;
+
   /// True if the input binary has a translation table we can use to convert
   /// addresses when aggregating profile
   bool enabledFor(llvm::object::ELFObjectFileBase *InputFile) const;
@@ -103,6 +123,61 @@ private:
   void writeEntriesForBB(MapTy &Map, const BinaryBasicBlock &BB,
                          uint64_t FuncAddress);
 
+  /// Write Maps, ColdPartSource and InputAddresses in the original format
+  /// with fixed-width entries.
+  void writeMaps(raw_ostream &OS);
+
+  /// Write Maps and ColdPartSource in the compact format. Functions and cold
+  /// parts are sorted by address and every function is:
+  ///
+  ///   <address delta> <number of entries> <size of entries in bytes>
+  ///   {<output offset delta> <input offset delta * 2 + is branch>}*
+  ///
+  /// where deltas are relative to the previous function or entry and are
+  /// ULEB128-encoded, except for input offset deltas which are SLEB128. Cold
+  /// parts follow the functions:
+  ///
+  ///   <number of cold parts> {<address delta> <hot address - address>}*
+  ///
+  /// with the difference to the hot address SLEB128-encoded. The input
+  /// addresses of the functions come last:
+  ///
+  ///   <number of functions> {<address delta> <input address - address>}*
+  ///
+  /// Tables written before the input addresses were added end with the cold
+  /// parts.
+  void writeCompactMaps(raw_ostream &OS);
+
+  /// Parse the tables written by writeMaps() at \p Offset in \p Buf.
+  std::error_code parseMaps(StringRef Buf, uint32_t Offset);
+
+  /// Parse the function headers and cold part mappings written by
+  /// writeCompactMaps().
+  std::error_code parseCompactMaps(StringRef Buf);
+
+  /// Build the lookup index from Maps and ColdPartSource once the tables are
+  /// parsed, and release the maps.
+  void buildIndex();
+
+  /// Index entry for the translation table of a function.
+  struct FuncIndexEntry {
+    uint64_t Address;
+
+    /// Range of the function entries in EntryKeys and EntryVals.
+    uint32_t Begin;
+    uint32_t End;
+
+    /// Encoded entries not yet decoded into EntryKeys and EntryVals.
+    StringRef Data;
+  };
+
+  /// Return the index entry for the function at \p Address or nullptr.
+  /// Entries of the function are decoded if necessary.
+  const FuncIndexEntry *getFuncIndexEntry(uint64_t Address) const;
+
+  /// Decode the entries of a function from the compact format.
+  void decodeEntries(const FuncIndexEntry &Entry) const;
+
   BinaryContext &BC;
 
   std::map<uint64_t, MapTy> Maps;
@@ -110,6 +185,29 @@ private:
   /// Links outlined cold bocks to their original function
   std::map<uint64_t, uint64_t> ColdPartSource;
 
+  /// Input addresses of the functions, keyed by their output addresses.
+  std::map<uint64_t, uint64_t> InputAddresses;
+
+  /// Lookup index used for translation. Functions are sorted by address and
+  /// the entries of all functions are stored in two flat arrays, keys and
+  /// values, with the entries of every function sorted by the key.
+  std::vector<FuncIndexEntry> FuncIndex;
+  mutable std::vector<uint32_t> EntryKeys;
+  mutable std::vector<uint32_t> EntryVals;
+
+  /// Guards decoding of compact entries for each function in FuncIndex.
+  std::unique_ptr<std::once_flag[]> DecodeFlags;
+
+  /// Sorted pairs of cold part and hot part addresses.
+  std::vector<std::pair<uint64_t, uint64_t>> ColdIndex;
+
+  /// Sorted pairs of output and input addresses of functions.
+  std::vector<std::pair<uint64_t, uint64_t>> InputIndex;
+
+  /// Position in FuncIndex of the last function looked up. Consecutive
+  /// lookups are likely to be for the same function.
+  mutable std::atomic<size_t> LastFuncIndex{0};
+
   /// Identifies the address of a control-flow changing instructions in a
   /// translation map entry
   const static uint32_t BRANCHENTRY = 0x80000000;
@@ -13,8 +13,11 @@
 //===----------------------------------------------------------------------===//
 
 #include "RewriteInstance.h"
+#include "ParallelUtilities.h"
 #include "Passes/IdenticalCodeFolding.h"
 #include "llvm/Support/CommandLine.h"
+#include <unordered_map>
+#include <unordered_set>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "boltdiff"
@@ -146,21 +149,21 @@ class RewriteInstanceDiff {
 
   // The map of functions keyed by functions in binary 2, providing its
   // corresponding function in binary 1
-  std::map<const BinaryFunction *, const BinaryFunction *> FuncMap;
+  std::unordered_map<const BinaryFunction *, const BinaryFunction *> FuncMap;
 
-  // The map of basic blocks correspondence, analogue to FuncMap for BBs,
-  // sorted by score difference
-  std::map<const BinaryBasicBlock *, const BinaryBasicBlock *> BBMap;
+  // The map of basic blocks correspondence, analogue to FuncMap for BBs
+  std::unordered_map<const BinaryBasicBlock *, const BinaryBasicBlock *> BBMap;
 
-  // The map of edge correspondence
+  // The map of edge correspondence, sorted by score difference
   std::map<double, std::pair<EdgeTy, EdgeTy>> EdgeMap;
 
   // Maps all known basic blocks back to their parent function
-  std::map<const BinaryBasicBlock *, const BinaryFunction *> BBToFuncMap;
+  std::unordered_map<const BinaryBasicBlock *, const BinaryFunction *>
+      BBToFuncMap;
 
   // Accounting which functions were matched
-  std::set<const BinaryFunction *> Bin1MappedFuncs;
-  std::set<const BinaryFunction *> Bin2MappedFuncs;
+  std::unordered_set<const BinaryFunction *> Bin1MappedFuncs;
+  std::unordered_set<const BinaryFunction *> Bin2MappedFuncs;
 
   // Structures for our 3 matching strategies: by name, by hash and by lto name,
   // from the strongest to the weakest bind between two functions
@@ -175,10 +178,10 @@ class RewriteInstanceDiff {
 
   // Map multiple functions in the same LTO bucket to a single parent function
   // representing all functions sharing the same prefix
-  std::map<const BinaryFunction *, const BinaryFunction *> LTOMap1;
-  std::map<const BinaryFunction *, const BinaryFunction *> LTOMap2;
-  std::map<const BinaryFunction *, double> LTOAggregatedScore1;
-  std::map<const BinaryFunction *, double> LTOAggregatedScore2;
+  std::unordered_map<const BinaryFunction *, const BinaryFunction *> LTOMap1;
+  std::unordered_map<const BinaryFunction *, const BinaryFunction *> LTOMap2;
+  std::unordered_map<const BinaryFunction *, double> LTOAggregatedScore1;
+  std::unordered_map<const BinaryFunction *, double> LTOAggregatedScore2;
 
   // Map scores in bin2 and 1 keyed by a binary 2 function - post-matching
   DenseMap<const BinaryFunction *, std::pair<double, double>> ScoreMap;
@@ -208,6 +211,28 @@ class RewriteInstanceDiff {
     return Score / RI1.getTotalScore();
   }
 
+  /// Compute the hash of every function with CFG in both binaries. Later
+  /// lookups and comparisons use the stored value from getHash().
+  void computeHashes() {
+    ParallelUtilities::WorkFuncTy WorkFun = [](BinaryFunction &BF) {
+      BF.computeHash(/*UseDFS=*/true);
+    };
+    ParallelUtilities::PredicateTy SkipFunc = [](const BinaryFunction &BF) {
+      return !BF.hasCFG() || BF.empty();
+    };
+    ParallelUtilities::runOnEachFunction(
+        *RI1.BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+        SkipFunc, "BoltDiff::computeHashes");
+    ParallelUtilities::runOnEachFunction(
+        *RI2.BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+        SkipFunc, "BoltDiff::computeHashes");
+  }
+
+  /// Return the hash computed by computeHashes().
+  static size_t getHash(const BinaryFunction &BF) {
+    return BF.hasCFG() && !BF.empty() ? BF.getHash() : 0;
+  }
+
   /// Initialize data structures used for function lookup in binary 1, used
   /// later when matching functions in binary 2 to corresponding functions
   /// in binary 1
@@ -223,7 +248,7 @@ class RewriteInstanceDiff {
         NameLookup[Name] = &Function;
       }
       if (opts::MatchByHash && Function.hasCFG())
-        HashLookup[Function.computeHash(/*UseDFS=*/true)] = &Function;
+        HashLookup[getHash(Function)] = &Function;
       if (opts::IgnoreLTOSuffix && !LTOName.empty()) {
         if (!LTONameLookup1.count(LTOName))
           LTONameLookup1[LTOName] = &Function;
@@ -249,56 +274,59 @@ class RewriteInstanceDiff {
     }
   }
 
+  /// Return the function in binary 1 matching \p Function2 by name, by hash
+  /// or by LTO name, in this order, or nullptr if there is none.
+  const BinaryFunction *findMatch(const BinaryFunction &Function2) const {
+    StringRef LTOName;
+    for (const auto Name : Function2.getNames()) {
+      auto Iter = NameLookup.find(Name);
+      if (auto OptionalLTOName = getLTOCommonName(Name))
+        LTOName = *OptionalLTOName;
+      if (Iter != NameLookup.end())
+        return Iter->second;
+    }
+    if (!Function2.hasCFG())
+      return nullptr;
+    auto Iter = HashLookup.find(getHash(Function2));
+    if (Iter != HashLookup.end())
+      return Iter->second;
+    if (LTOName.empty())
+      return nullptr;
+    auto LTOIter = LTONameLookup1.find(LTOName);
+    if (LTOIter != LTONameLookup1.end())
+      return LTOIter->second;
+    return nullptr;
+  }
+
   /// Match functions in binary 2 with functions in binary 1
   void matchFunctions() {
     outs() << "BOLT-DIFF: Mapping functions in Binary2 to Binary1\n";
     uint64_t BothHaveProfile = 0ull;
-    std::set<const BinaryFunction *> Bin1ProfiledMapped;
+    std::unordered_set<const BinaryFunction *> Bin1ProfiledMapped;
+
+    // Lookups only read the tables built for binary 1, so they are done in
+    // parallel. Every worker writes the entry of its own function.
+    std::unordered_map<const BinaryFunction *, const BinaryFunction *> Matches;
+    for (const auto &BFI2 : RI2.BC->getBinaryFunctions())
+      Matches[&BFI2.second] = nullptr;
+    ParallelUtilities::runOnEachFunction(
+        *RI2.BC, ParallelUtilities::SchedulingPolicy::SP_TRIVIAL,
+        [&](BinaryFunction &Function2) {
+          Matches.at(&Function2) = findMatch(Function2);
+        },
+        ParallelUtilities::PredicateTy(), "BoltDiff::matchFunctions");
 
     for (const auto &BFI2 : RI2.BC->getBinaryFunctions()) {
       const auto &Function2 = BFI2.second;
-      StringRef LTOName;
-      bool Match = false;
-      for (const auto Name : Function2.getNames()) {
-        auto Iter = NameLookup.find(Name);
-        if (auto OptionalLTOName = getLTOCommonName(Name))
-          LTOName = *OptionalLTOName;
-        if (Iter == NameLookup.end())
-          continue;
-        FuncMap.insert(std::make_pair<>(&Function2, Iter->second));
-        Bin1MappedFuncs.insert(Iter->second);
-        Bin2MappedFuncs.insert(&Function2);
-        if (Function2.hasValidProfile() && Iter->second->hasValidProfile()) {
-          ++BothHaveProfile;
-          Bin1ProfiledMapped.insert(Iter->second);
-        }
-        Match = true;
-        break;
-      }
-      if (Match || !Function2.hasCFG())
+      const auto *Function1 = Matches.at(&Function2);
+      if (!Function1)
         continue;
-      auto Iter = HashLookup.find(Function2.computeHash(/*UseDFS*/true));
-      if (Iter != HashLookup.end()) {
-        FuncMap.insert(std::make_pair<>(&Function2, Iter->second));
-        Bin1MappedFuncs.insert(Iter->second);
-        Bin2MappedFuncs.insert(&Function2);
-        if (Function2.hasValidProfile() && Iter->second->hasValidProfile()) {
-          ++BothHaveProfile;
-          Bin1ProfiledMapped.insert(Iter->second);
-        }
-        continue;
-      }
-      if (LTOName.empty())
-        continue;
-      auto LTOIter = LTONameLookup1.find(LTOName);
-      if (LTOIter != LTONameLookup1.end()) {
-        FuncMap.insert(std::make_pair<>(&Function2, LTOIter->second));
-        Bin1MappedFuncs.insert(LTOIter->second);
-        Bin2MappedFuncs.insert(&Function2);
-        if (Function2.hasValidProfile() && LTOIter->second->hasValidProfile()) {
-          ++BothHaveProfile;
-          Bin1ProfiledMapped.insert(LTOIter->second);
-        }
+      FuncMap.insert(std::make_pair<>(&Function2, Function1));
+      Bin1MappedFuncs.insert(Function1);
+      Bin2MappedFuncs.insert(&Function2);
+      if (Function2.hasValidProfile() && Function1->hasValidProfile()) {
+        ++BothHaveProfile;
+        Bin1ProfiledMapped.insert(Function1);
       }
     }
     PrintProgramStats PPS(opts::NeverPrint);
@@ -357,16 +385,31 @@ class RewriteInstanceDiff {
   /// individual basic block in it to its corresponding blocks in binary 1.
   /// Also match each edge in binary 2 to the corresponding ones in binary 1.
   void matchBasicBlocks() {
-    for (const auto &MapEntry : FuncMap) {
-      const auto &Func1 = MapEntry.second;
-      const auto &Func2 = MapEntry.first;
+    // Functions are diffed in parallel into their own results, which are then
+    // merged in the order of binary 2.
+    struct FunctionDiff {
+      bool Match{true};
+      std::vector<std::pair<const BinaryBasicBlock *,
+                            const BinaryBasicBlock *>> Map;
+      std::map<double, std::pair<EdgeTy, EdgeTy>> EMap;
+      std::vector<const BinaryBasicBlock *> Blocks1;
+      std::vector<const BinaryBasicBlock *> Blocks2;
+    };
+    std::unordered_map<const BinaryFunction *, FunctionDiff> Diffs;
+    for (const auto &MapEntry : FuncMap)
+      Diffs[MapEntry.first];
+
+    ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
+      const auto *Func2 = &BF;
+      const auto *Func1 = FuncMap.at(Func2);
+      auto &Diff = Diffs.at(Func2);
+      auto &Match = Diff.Match;
+      auto &Map = Diff.Map;
+      auto &EMap = Diff.EMap;
 
       auto Iter1 = Func1->layout_begin();
       auto Iter2 = Func2->layout_begin();
 
-      bool Match{true};
-      std::map<const BinaryBasicBlock *, const BinaryBasicBlock *> Map;
-      std::map<double, std::pair<EdgeTy, EdgeTy>> EMap;
       while (Iter1 != Func1->layout_end()) {
         if (Iter2 == Func2->layout_end()) {
           Match = false;
@@ -376,7 +419,7 @@ class RewriteInstanceDiff {
           Match = false;
           break;
         }
-        Map.insert(std::make_pair<>(*Iter2, *Iter1));
+        Map.emplace_back(*Iter2, *Iter1);
 
         auto SuccIter1 = (*Iter1)->succ_begin();
         auto SuccIter2 = (*Iter2)->succ_begin();
@@ -405,16 +448,36 @@ class RewriteInstanceDiff {
         if (!Match)
           break;
 
-        BBToFuncMap[*Iter1] = Func1;
-        BBToFuncMap[*Iter2] = Func2;
+        Diff.Blocks1.push_back(*Iter1);
+        Diff.Blocks2.push_back(*Iter2);
         ++Iter1;
         ++Iter2;
       }
-      if (!Match || Iter2 != Func2->layout_end())
+      if (Iter2 != Func2->layout_end())
+        Match = false;
+    };
+    ParallelUtilities::PredicateTy SkipFunc = [&](const BinaryFunction &BF) {
+      return !FuncMap.count(&BF);
+    };
+    ParallelUtilities::runOnEachFunction(
+        *RI2.BC, ParallelUtilities::SchedulingPolicy::SP_BB_LINEAR, WorkFun,
+        SkipFunc, "BoltDiff::matchBasicBlocks");
+
+    for (const auto &BFI2 : RI2.BC->getBinaryFunctions()) {
+      auto DiffIter = Diffs.find(&BFI2.second);
+      if (DiffIter == Diffs.end())
+        continue;
+      const auto &Diff = DiffIter->second;
+      const auto *Func1 = FuncMap.at(&BFI2.second);
+      for (const auto *BB : Diff.Blocks1)
+        BBToFuncMap[BB] = Func1;
+      for (const auto *BB : Diff.Blocks2)
+        BBToFuncMap[BB] = &BFI2.second;
+      if (!Diff.Match)
         continue;
 
-      BBMap.insert(Map.begin(), Map.end());
-      EdgeMap.insert(EMap.begin(), EMap.end());
+      BBMap.insert(Diff.Map.begin(), Diff.Map.end());
+      EdgeMap.insert(Diff.EMap.begin(), Diff.EMap.end());
     }
   }
 
@@ -568,8 +631,7 @@ class RewriteInstanceDiff {
     for (auto I = LargestDiffs.rbegin(), E = LargestDiffs.rend(); I != E; ++I) {
       const auto &MapEntry = I->second;
       if (opts::IgnoreUnchanged &&
-          MapEntry.second->computeHash(/*UseDFS=*/true) ==
-          MapEntry.first->computeHash(/*UseDFS=*/true))
+          getHash(*MapEntry.second) == getHash(*MapEntry.first))
         continue;
       const auto &Scores = ScoreMap[MapEntry.first];
       outs() << "Function " << MapEntry.first->getDemangledName();
@@ -581,8 +643,7 @@ class RewriteInstanceDiff {
              << "%\t(Difference: ";
       printColoredPercentage((Scores.second - Scores.first) * 100.0);
       outs() << ")";
-      if (MapEntry.second->computeHash(/*UseDFS=*/true) !=
-          MapEntry.first->computeHash(/*UseDFS=*/true)) {
+      if (getHash(*MapEntry.second) != getHash(*MapEntry.first)) {
         outs() << "\t[Functions have different contents]";
         if (opts::PrintDiffCFG) {
           outs() << "\n *** CFG for function in binary 1:\n";
@@ -657,6 +718,7 @@ class RewriteInstanceDiff {
 public:
   /// Main entry point: coordinate all tasks necessary to compare two binaries
   void compareAndReport() {
+    computeHashes();
     buildLookupMaps();
     matchFunctions();
     if (opts::IgnoreLTOSuffix)
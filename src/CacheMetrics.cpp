@@ -8,7 +8,13 @@
 //===----------------------------------------------------------------------===//
 
 #include "CacheMetrics.h"
+#include "Heatmap.h"
+#include "SpeedupModel.h"
+#include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Options.h"
+#include <map>
+#include <random>
+#include <unordered_set>
 
 using namespace llvm;
 using namespace bolt;
@@ -25,6 +31,96 @@ extern cl::opt<unsigned> BackwardDistance;
 extern cl::opt<unsigned> ITLBPageSize;
 extern cl::opt<unsigned> ITLBEntries;
 
+static cl::opt<bool>
+CacheSim("cache-sim",
+  cl::desc("with -print-cache-metrics, replay an execution synthesized from "
+           "the profile against simulated caches and TLBs for the input and "
+           "the output code layouts"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<std::string>
+CacheMetricsFile("cache-metrics-file",
+  cl::desc("with -print-cache-metrics, write the ExtTSP score, hot code bytes, "
+           "hot cache lines and hot pages of every profiled function and "
+           "every output code section to a JSON file"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimTraceLength("cache-sim-trace-length",
+  cl::desc("number of basic block executions replayed by -cache-sim"),
+  cl::init(10000000),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimLineSize("cache-sim-line-size",
+  cl::desc("cache line size in bytes for -cache-sim and "
+           "-cache-metrics-file"),
+  cl::init(64),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimL1ISize("cache-sim-l1i-size",
+  cl::desc("L1 instruction cache size in bytes for -cache-sim"),
+  cl::init(32 << 10),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimL1IWays("cache-sim-l1i-ways",
+  cl::desc("L1 instruction cache associativity for -cache-sim"),
+  cl::init(8),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimL2Size("cache-sim-l2-size",
+  cl::desc("L2 cache size in bytes for -cache-sim"),
+  cl::init(1 << 20),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimL2Ways("cache-sim-l2-ways",
+  cl::desc("L2 cache associativity for -cache-sim"),
+  cl::init(16),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimITLBEntries("cache-sim-itlb-entries",
+  cl::desc("number of i-TLB entries for -cache-sim, pages are "
+           "-itlb-page-size bytes"),
+  cl::init(128),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimITLBWays("cache-sim-itlb-ways",
+  cl::desc("i-TLB associativity for -cache-sim"),
+  cl::init(8),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimSTLBEntries("cache-sim-stlb-entries",
+  cl::desc("number of second level TLB entries for -cache-sim"),
+  cl::init(1536),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CacheSimSTLBWays("cache-sim-stlb-ways",
+  cl::desc("second level TLB associativity for -cache-sim"),
+  cl::init(12),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 }
 
 namespace {
@@ -140,6 +236,37 @@ extractFunctionCalls(const std::vector<BinaryFunction *> &BinaryFunctions) {
   return Calls;
 }
 
+/// Print the number of i-TLB pages holding most of the executed instructions,
+/// for the original and the new code layout. The executed instructions of a
+/// basic block are attributed to the page containing the start of the block.
+void printPageCoverage(
+  const std::vector<BinaryFunction *> &BinaryFunctions,
+  const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr) {
+
+  const uint64_t PageSizes[] = {opts::ITLBPageSize, 2 << 20};
+  for (const auto PageSize : PageSizes) {
+    Heatmap InputHM(PageSize);
+    Heatmap OutputHM(PageSize);
+    for (auto BF : BinaryFunctions) {
+      if (!BF->hasProfile())
+        continue;
+      for (auto BB : BF->layout()) {
+        const auto Count = BB->getKnownExecutionCount() * BB->size();
+        if (!Count)
+          continue;
+        InputHM.registerAddress(BF->getAddress() + BB->getInputOffset(),
+                                Count);
+        OutputHM.registerAddress(BBAddr.at(BB), Count);
+      }
+    }
+    if (!InputHM.size())
+      return;
+    InputHM.printPageCoverage(outs(), PageSize, "  Input ");
+    OutputHM.printPageCoverage(outs(), PageSize, "  Output ");
+  }
+  outs() << "  There are " << opts::ITLBEntries << " i-TLB entries\n";
+}
+
 /// Compute expected hit ratio of the i-TLB cache (optimized by HFSortPlus alg).
 /// Given an assignment of functions to the i-TLB pages), we divide all
 /// functions calls into two categories:
@@ -212,8 +339,426 @@ double expectedCacheHitRatio(
   return 100.0 * (1.0 - Misses / TotalSamples);
 }
 
+/// Set-associative cache with LRU replacement, indexed by line or page number
+class SimulatedCache {
+  const uint64_t NumSets;
+  const uint64_t NumWays;
+  std::vector<uint64_t> Tags;
+  std::vector<uint64_t> LastUse;
+  uint64_t Clock{0};
+
+public:
+  uint64_t Accesses{0};
+  uint64_t Misses{0};
+
+  SimulatedCache(uint64_t NumEntries, uint64_t NumWays)
+      : NumSets(std::max<uint64_t>(NumEntries / NumWays, 1)), NumWays(NumWays),
+        Tags(NumSets * NumWays, -1ULL), LastUse(NumSets * NumWays, 0) {}
+
+  /// Return true if \p Key was cached, bring it in otherwise.
+  bool access(uint64_t Key) {
+    ++Accesses;
+    ++Clock;
+    const uint64_t Base = (Key % NumSets) * NumWays;
+    uint64_t Victim = Base;
+    for (uint64_t I = Base; I < Base + NumWays; ++I) {
+      if (Tags[I] == Key) {
+        LastUse[I] = Clock;
+        return true;
+      }
+      if (LastUse[I] < LastUse[Victim])
+        Victim = I;
+    }
+    ++Misses;
+    Tags[Victim] = Key;
+    LastUse[Victim] = Clock;
+    return false;
+  }
+};
+
+/// Instruction fetch path of one code layout
+struct SimulatedHierarchy {
+  SimulatedCache L1I;
+  SimulatedCache L2;
+  SimulatedCache ITLB;
+  SimulatedCache STLB;
+  uint64_t Instructions{0};
+  /// Misses of every function, kept for the speedup estimate
+  std::unordered_map<const BinaryFunction *, SpeedupModel::FetchMisses>
+      FunctionMisses;
+
+  SimulatedHierarchy()
+      : L1I(opts::CacheSimL1ISize / opts::CacheSimLineSize,
+            opts::CacheSimL1IWays),
+        L2(opts::CacheSimL2Size / opts::CacheSimLineSize, opts::CacheSimL2Ways),
+        ITLB(opts::CacheSimITLBEntries, opts::CacheSimITLBWays),
+        STLB(opts::CacheSimSTLBEntries, opts::CacheSimSTLBWays) {}
+
+  /// Fetch \p NumInstrs instructions of \p BF from
+  /// [\p Addr, \p Addr + \p Size).
+  void fetch(const BinaryFunction *BF, uint64_t Addr, uint64_t Size,
+             uint64_t NumInstrs) {
+    Instructions += NumInstrs;
+    if (!Size)
+      return;
+    auto &Misses = FunctionMisses[BF];
+    const uint64_t LastByte = Addr + Size - 1;
+    for (uint64_t Page = Addr / opts::ITLBPageSize;
+         Page <= LastByte / opts::ITLBPageSize; ++Page) {
+      if (ITLB.access(Page))
+        continue;
+      ++Misses.ITLB;
+      if (!STLB.access(Page))
+        ++Misses.STLB;
+    }
+    for (uint64_t Line = Addr / opts::CacheSimLineSize;
+         Line <= LastByte / opts::CacheSimLineSize; ++Line) {
+      if (L1I.access(Line))
+        continue;
+      ++Misses.L1I;
+      if (!L2.access(Line))
+        ++Misses.L2;
+    }
+  }
+
+  void print(const char *Layout) const {
+    auto printLevel = [&](const char *Name, const SimulatedCache &Cache) {
+      outs() << "  Simulated " << Name << " misses for the " << Layout
+             << " layout: " << Cache.Misses
+             << format(" (%.2lf%% of accesses, %.2lf per 1K instructions)\n",
+                       Cache.Accesses ? 100.0 * Cache.Misses / Cache.Accesses
+                                      : 0.0,
+                       Instructions ? 1000.0 * Cache.Misses / Instructions
+                                    : 0.0);
+    };
+    printLevel("L1i", L1I);
+    printLevel("L2", L2);
+    printLevel("i-TLB", ITLB);
+    printLevel("STLB", STLB);
+  }
+};
+
+void checkSimulationOptions() {
+  if (!opts::CacheSimLineSize || !opts::CacheSimL1IWays ||
+      !opts::CacheSimL2Ways || !opts::CacheSimITLBWays ||
+      !opts::CacheSimSTLBWays || !opts::ITLBPageSize) {
+    errs() << "BOLT-ERROR: -cache-sim line size, page size and associativity "
+              "must be positive\n";
+    exit(1);
+  }
+}
+
+/// Profiled block of the replayed execution
+struct BlockInfo {
+  uint64_t InputAddr;
+  uint64_t InputSize;
+  uint64_t NumInstrs;
+  std::vector<BinaryBasicBlock *> Callees;
+  std::vector<uint64_t> SuccWeights;
+};
+
+/// Replay an execution of the profiled code of \p BinaryFunctions, invoking
+/// \p Execute for every executed block, and return the number of blocks
+/// executed in the profile. Without the original LBR traces, the execution
+/// is a random walk through the CFGs: every block transfers control to a
+/// successor with the probability of the profiled branch, after calling the
+/// functions called from it, and functions without successors return to
+/// their caller. Each walk starts at a function picked by its execution
+/// count. The walk uses a fixed seed so that layouts of the same binary in
+/// different runs are compared on the same execution.
+uint64_t replayExecution(
+  const std::vector<BinaryFunction *> &BinaryFunctions,
+  function_ref<void(BinaryBasicBlock *, const BlockInfo &)> Execute) {
+
+  std::unordered_map<const BinaryBasicBlock *, BlockInfo> Blocks;
+  std::vector<BinaryBasicBlock *> Roots;
+  std::vector<uint64_t> RootWeights;
+  uint64_t ProfiledBlocks = 0;
+  for (auto BF : BinaryFunctions) {
+    if (!BF->hasProfile() || BF->layout_empty())
+      continue;
+    auto &BC = BF->getBinaryContext();
+    for (auto BB : BF->layout()) {
+      auto &Info = Blocks[BB];
+      Info.InputAddr = BF->getAddress() + BB->getInputOffset();
+      Info.InputSize = BB->getOriginalSize();
+      Info.NumInstrs = BB->getNumNonPseudos();
+      ProfiledBlocks += BB->getKnownExecutionCount();
+      for (auto &Inst : *BB) {
+        // A tail call returns from the callee straight to our caller, which
+        // is the same as calling it from a block without successors.
+        if (!BC.MIB->isCall(Inst))
+          continue;
+        const auto *Target = BC.MIB->getTargetSymbol(Inst);
+        auto *Callee = Target ? BC.getFunctionForSymbol(Target) : nullptr;
+        if (!Callee || !Callee->hasProfile() || Callee->layout_empty())
+          continue;
+        auto *Entry = Callee->getBasicBlockForLabel(Target);
+        Info.Callees.push_back(Entry ? Entry : *Callee->layout_begin());
+      }
+      auto BI = BB->branch_info_begin();
+      for (unsigned I = 0; I < BB->succ_size(); ++I, ++BI)
+        Info.SuccWeights.push_back(
+            BI->Count == BinaryBasicBlock::COUNT_NO_PROFILE ? 0 : BI->Count);
+    }
+    if (BF->getKnownExecutionCount()) {
+      Roots.push_back(*BF->layout_begin());
+      RootWeights.push_back(BF->getKnownExecutionCount());
+    }
+  }
+  if (Roots.empty())
+    return 0;
+
+  // Calls to functions outside of the replayed set are skipped.
+  for (auto &Entry : Blocks) {
+    auto &Callees = Entry.second.Callees;
+    Callees.erase(std::remove_if(Callees.begin(), Callees.end(),
+                                 [&](const BinaryBasicBlock *BB) {
+                                   return !Blocks.count(BB);
+                                 }),
+                  Callees.end());
+  }
+
+  std::mt19937_64 RNG(0);
+  std::discrete_distribution<size_t> PickRoot(RootWeights.begin(),
+                                              RootWeights.end());
+  struct Frame {
+    BinaryBasicBlock *BB;
+    size_t NextCall;
+  };
+  std::vector<Frame> Stack;
+  const size_t MaxDepth = 256;
+  auto execute = [&](BinaryBasicBlock *BB) {
+    Execute(BB, Blocks.at(BB));
+    Stack.push_back(Frame{BB, 0});
+  };
+
+  for (uint64_t Executed = 0; Executed < opts::CacheSimTraceLength;) {
+    if (Stack.empty()) {
+      execute(Roots[PickRoot(RNG)]);
+      ++Executed;
+      continue;
+    }
+    auto &Top = Stack.back();
+    const auto &Info = Blocks.at(Top.BB);
+    if (Top.NextCall < Info.Callees.size() && Stack.size() < MaxDepth) {
+      auto *Callee = Info.Callees[Top.NextCall++];
+      execute(Callee);
+      ++Executed;
+      continue;
+    }
+    uint64_t TotalWeight = 0;
+    for (auto Weight : Info.SuccWeights)
+      TotalWeight += Weight;
+    auto *BB = Top.BB;
+    Stack.pop_back();
+    if (!TotalWeight)
+      continue; // Return to the caller
+    uint64_t Pick = std::uniform_int_distribution<uint64_t>(
+        0, TotalWeight - 1)(RNG);
+    unsigned Succ = 0;
+    while (Pick >= Info.SuccWeights[Succ])
+      Pick -= Info.SuccWeights[Succ++];
+    execute(*(BB->succ_begin() + Succ));
+    ++Executed;
+  }
+
+  return ProfiledBlocks;
+}
+
+/// Simulate the instruction fetches of the profiled code in the input and
+/// the output layouts.
+void simulateCaches(
+  const std::vector<BinaryFunction *> &BinaryFunctions,
+  const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
+  const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
+
+  checkSimulationOptions();
+
+  SimulatedHierarchy Input;
+  SimulatedHierarchy Output;
+  const auto ProfiledBlocks = replayExecution(
+      BinaryFunctions, [&](BinaryBasicBlock *BB, const BlockInfo &Info) {
+        Input.fetch(BB->getFunction(), Info.InputAddr, Info.InputSize,
+                    Info.NumInstrs);
+        Output.fetch(BB->getFunction(), BBAddr.at(BB), BBSize.at(BB),
+                     Info.NumInstrs);
+      });
+  if (!ProfiledBlocks)
+    return;
+
+  Input.print("input");
+  Output.print("output");
+
+  if (!SpeedupModel::isEnabled())
+    return;
+
+  // Scale the misses of the synthesized execution to the number of blocks
+  // executed in the profile.
+  const double Scale = double(ProfiledBlocks) / opts::CacheSimTraceLength;
+  auto getMisses = [&](const SimulatedHierarchy &Hierarchy,
+                       const BinaryFunction *BF) {
+    SpeedupModel::FetchMisses Misses;
+    auto I = Hierarchy.FunctionMisses.find(BF);
+    if (I != Hierarchy.FunctionMisses.end()) {
+      Misses.L1I = I->second.L1I * Scale;
+      Misses.L2 = I->second.L2 * Scale;
+      Misses.ITLB = I->second.ITLB * Scale;
+      Misses.STLB = I->second.STLB * Scale;
+    }
+    return Misses;
+  };
+  for (auto BF : BinaryFunctions)
+    if (Input.FunctionMisses.count(BF) || Output.FunctionMisses.count(BF))
+      SpeedupModel::recordFetchMisses(*BF, getMisses(Input, BF),
+                                      getMisses(Output, BF));
+}
+
+/// Layout quality of a function or of an output section
+struct LayoutStats {
+  uint64_t ExecutionCount{0};
+  uint64_t Bytes{0};
+  uint64_t HotBytes{0};
+  double ExtTSPScore{0.0};
+  std::unordered_set<uint64_t> HotLines;
+  std::unordered_set<uint64_t> HotPages;
+  std::unordered_set<uint64_t> InputHotLines;
+  std::unordered_set<uint64_t> InputHotPages;
+
+  /// Record a block at \p Addr in the input at \p InputAddr.
+  void addBlock(uint64_t Addr, uint64_t Size, uint64_t InputAddr,
+                uint64_t InputSize, uint64_t Count) {
+    Bytes += Size;
+    if (!Count)
+      return;
+    HotBytes += Size;
+    addRange(HotLines, Addr, Size, opts::CacheSimLineSize);
+    addRange(HotPages, Addr, Size, opts::ITLBPageSize);
+    addRange(InputHotLines, InputAddr, InputSize, opts::CacheSimLineSize);
+    addRange(InputHotPages, InputAddr, InputSize, opts::ITLBPageSize);
+  }
+
+  void write(raw_ostream &OS) const {
+    OS << "\"execution_count\": " << ExecutionCount
+       << ", \"bytes\": " << Bytes
+       << ", \"hot_bytes\": " << HotBytes
+       << ", \"ext_tsp_score\": " << format("%.0lf", ExtTSPScore)
+       << ", \"hot_lines\": " << HotLines.size()
+       << ", \"hot_pages\": " << HotPages.size()
+       << ", \"input_hot_lines\": " << InputHotLines.size()
+       << ", \"input_hot_pages\": " << InputHotPages.size();
+  }
+
+private:
+  static void addRange(std::unordered_set<uint64_t> &Set, uint64_t Addr,
+                       uint64_t Size, uint64_t Granule) {
+    if (!Size)
+      return;
+    for (uint64_t I = Addr / Granule; I <= (Addr + Size - 1) / Granule; ++I)
+      Set.insert(I);
+  }
+};
+
+/// Write the layout quality of every profiled function and of every output
+/// code section to opts::CacheMetricsFile. Hot code is code of blocks with a
+/// non-zero execution count, and the ExtTSP score of a jump is attributed to
+/// the function and the section of its source block.
+void writeLayoutReport(
+  const std::vector<BinaryFunction *> &BinaryFunctions,
+  const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
+  const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
+
+  if (!opts::CacheSimLineSize || !opts::ITLBPageSize) {
+    errs() << "BOLT-ERROR: cache line and page sizes must be positive\n";
+    exit(1);
+  }
+
+  std::error_code EC;
+  raw_fd_ostream OS(opts::CacheMetricsFile, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-WARNING: cannot write cache metrics to "
+           << opts::CacheMetricsFile << ": " << EC.message() << '\n';
+    return;
+  }
+
+  std::map<std::string, LayoutStats> Sections;
+  OS << "{\n  \"functions\": [";
+  const char *Separator = "\n";
+  for (auto BF : BinaryFunctions) {
+    LayoutStats Stats;
+    const bool HasProfile = BF->hasProfile();
+    for (auto BB : BF->layout()) {
+      const auto Count = HasProfile ? BB->getKnownExecutionCount() : 0;
+      const auto InputAddr = BF->getAddress() + BB->getInputOffset();
+      double Score = 0.0;
+      if (HasProfile) {
+        auto BI = BB->branch_info_begin();
+        for (auto DstBB : BB->successors()) {
+          if (DstBB != BB && BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE)
+            Score += CacheMetrics::extTSPScore(BBAddr.at(BB), BBSize.at(BB),
+                                               BBAddr.at(DstBB), BI->Count);
+          ++BI;
+        }
+      }
+      auto &Section = Sections[BB->isCold()
+                                   ? BF->getColdCodeSectionName().str()
+                                   : BF->getCodeSectionName().str()];
+      for (auto *S : {&Stats, &Section}) {
+        S->addBlock(BBAddr.at(BB), BBSize.at(BB), InputAddr,
+                    BB->getOriginalSize(), Count);
+        S->ExtTSPScore += Score;
+      }
+    }
+    if (!HasProfile)
+      continue;
+    Stats.ExecutionCount = BF->getKnownExecutionCount();
+    OS << Separator << "    {\"name\": \"";
+    OS.write_escaped(BF->getPrintName());
+    OS << "\", \"section\": \"";
+    OS.write_escaped(BF->getCodeSectionName());
+    OS << "\", \"split\": " << (BF->isSplit() ? "true" : "false") << ", ";
+    Stats.write(OS);
+    OS << "}";
+    Separator = ",\n";
+  }
+  OS << "\n  ],\n  \"sections\": [";
+  Separator = "\n";
+  for (const auto &Section : Sections) {
+    OS << Separator << "    {\"name\": \"";
+    OS.write_escaped(Section.first);
+    OS << "\", ";
+    Section.second.write(OS);
+    OS << "}";
+    Separator = ",\n";
+  }
+  OS << "\n  ]\n}\n";
+}
+
 } // end namespace anonymous
 
+SpeedupModel::FetchMisses CacheMetrics::simulateFetchMisses(
+    const std::vector<BinaryFunction *> &BinaryFunctions,
+    const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
+    const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize) {
+  checkSimulationOptions();
+
+  SimulatedHierarchy Hierarchy;
+  replayExecution(BinaryFunctions,
+                  [&](BinaryBasicBlock *BB, const BlockInfo &Info) {
+                    Hierarchy.fetch(BB->getFunction(), BBAddr.at(BB),
+                                    BBSize.at(BB), Info.NumInstrs);
+                  });
+
+  SpeedupModel::FetchMisses Total;
+  for (const auto &Entry : Hierarchy.FunctionMisses) {
+    Total.L1I += Entry.second.L1I;
+    Total.L2 += Entry.second.L2;
+    Total.ITLB += Entry.second.ITLB;
+    Total.STLB += Entry.second.STLB;
+  }
+  return Total;
+}
+
 double CacheMetrics::extTSPScore(uint64_t SrcAddr,
                                  uint64_t SrcSize,
                                  uint64_t DstAddr,
@@ -298,6 +843,8 @@ void CacheMetrics::printAll(const std::vector<BinaryFunction *> &BFs) {
   std::unordered_map<BinaryBasicBlock *, uint64_t> BBSize;
   extractBasicBlockInfo(BFs, BBAddr, BBSize);
 
+  printPageCoverage(BFs, BBAddr);
+
   outs() << "  Expected i-TLB cache hit ratio: "
          << format("%.2lf%%\n", expectedCacheHitRatio(BFs, BBAddr, BBSize));
 
@@ -306,4 +853,10 @@ void CacheMetrics::printAll(const std::vector<BinaryFunction *> &BFs) {
 
   outs() << "  ExtTSP score: "
          << format("%.0lf\n", calcExtTSPScore(BFs, BBAddr, BBSize));
+
+  if (opts::CacheSim || SpeedupModel::isEnabled())
+    simulateCaches(BFs, BBAddr, BBSize);
+
+  if (!opts::CacheMetricsFile.empty())
+    writeLayoutReport(BFs, BBAddr, BBSize);
 }
@@ -11,6 +11,8 @@
 #define LLVM_TOOLS_LLVM_BOLT_CACHEMETRICS_H
 
 #include "BinaryFunction.h"
+#include "SpeedupModel.h"
+#include <unordered_map>
 #include <vector>
 
 namespace llvm {
@@ -20,6 +22,14 @@ namespace CacheMetrics {
 /// Calculate various metrics related to instruction cache performance.
 void printAll(const std::vector<BinaryFunction *> &BinaryFunctions);
 
+/// Return the instruction cache and TLB misses of a simulated execution of
+/// the profile of \p BinaryFunctions, with every basic block placed at
+/// \p BBAddr with the size \p BBSize. Calls to other functions are skipped.
+SpeedupModel::FetchMisses simulateFetchMisses(
+    const std::vector<BinaryFunction *> &BinaryFunctions,
+    const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBAddr,
+    const std::unordered_map<BinaryBasicBlock *, uint64_t> &BBSize);
+
 /// Calculate Extended-TSP metric, which quantifies the expected number of
 /// i-cache misses for a given pair of basic blocks. The parameters are:
 /// - SrcAddr is the address of the source block;
@@ -14,6 +14,7 @@
 #include "BinaryFunction.h"
 #include "ParallelUtilities.h"
 #include "Utils.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/BinaryFormat/Dwarf.h"
 #include "llvm/DebugInfo/DWARF/DWARFContext.h"
@@ -33,9 +34,12 @@
 #include "llvm/Support/Debug.h"
 #include "llvm/Support/Endian.h"
 #include "llvm/Support/Errc.h"
+#include "llvm/Support/LEB128.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/Timer.h"
 #include <algorithm>
+#include <memory>
+#include <unordered_set>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt"
@@ -49,6 +53,7 @@ namespace opts {
 
 extern cl::OptionCategory BoltCategory;
 extern cl::opt<unsigned> Verbosity;
+extern cl::opt<bool> SymbolizationDebugInfo;
 
 static cl::opt<bool>
 KeepARanges("keep-aranges",
@@ -59,13 +64,33 @@ KeepARanges("keep-aranges",
 
 static cl::opt<bool>
 DeterministicDebugInfo("deterministic-debuginfo",
-  cl::desc("disables parallel execution of tasks that may produce"
-           "nondeterministic debug info"),
+  cl::desc("ignored, debug info is always updated deterministically"),
   cl::init(true),
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
+static cl::opt<bool>
+LazyDebugInfo("lazy-debug-info",
+  cl::desc("only update debug info of compilation units with functions that "
+           "were emitted or folded, and keep other units as they are"),
+  cl::init(false),
+  cl::ZeroOrMore,
   cl::cat(BoltCategory));
 
 } // namespace opts
 
+namespace {
+
+/// Return true if \p Unit is a skeleton unit of split DWARF, i.e. the rest of
+/// its debug info is in a .dwo or .dwp file.
+bool isSkeletonUnit(DWARFUnit *Unit) {
+  auto UnitDIE = Unit->getUnitDIE(/*ExtractUnitDIEOnly=*/true);
+  return UnitDIE.getTag() == dwarf::DW_TAG_skeleton_unit ||
+         UnitDIE.find({dwarf::DW_AT_GNU_dwo_name, dwarf::DW_AT_dwo_name});
+}
+
+} // namespace
+
 void DWARFRewriter::updateDebugInfo() {
   SectionPatchers[".debug_abbrev"] = llvm::make_unique<DebugAbbrevPatcher>();
   SectionPatchers[".debug_info"] = llvm::make_unique<SimpleBinaryPatcher>();
@@ -77,51 +102,356 @@ void DWARFRewriter::updateDebugInfo() {
   assert(DebugInfoPatcher && AbbrevPatcher && "Patchers not initialized.");
 
   ARangesSectionWriter = llvm::make_unique<DebugARangesSectionWriter>();
-  RangesSectionWriter = llvm::make_unique<DebugRangesSectionWriter>(&BC);
 
-  size_t NumCUs = BC.DwCtx->getNumCompileUnits();
-  if (opts::NoThreads || opts::DeterministicDebugInfo) {
-    // Use single entry for efficiency when running single-threaded
-    NumCUs = 1;
+  if (opts::SymbolizationDebugInfo) {
+    writeSymbolizationDebugInfo();
+    return;
   }
 
-  LocListWritersByCU.resize(NumCUs);
-
-  for (size_t CUIndex = 0; CUIndex < NumCUs; ++CUIndex) {
-    LocListWritersByCU[CUIndex] = llvm::make_unique<DebugLocWriter>(&BC);
+  // Each unit writes its ranges, location lists and patches to its own
+  // output. The outputs are merged in the order of units once all of them are
+  // processed, hence the result is the same regardless of the scheduling.
+  // DWARF 5 units reference .debug_rnglists instead of .debug_ranges.
+  CUOutputs.resize(BC.DwCtx->getNumCompileUnits());
+  {
+    size_t CUIndex = 0;
+    for (auto &CU : BC.DwCtx->compile_units()) {
+      auto &Output = CUOutputs[CUIndex++];
+      Output.Index = CUIndex - 1;
+      Output.IsDWARF5 = CU->getVersion() >= 5;
+      Output.RangesTable = Output.IsDWARF5 ? &RangeListsTable : &RangesTable;
+      // DW_AT_ranges in .dwo files are relative to DW_AT_GNU_ranges_base and
+      // reference the input .debug_ranges.
+      if (CU->getUnitDIE(/*ExtractUnitDIEOnly=*/true)
+              .find(dwarf::DW_AT_GNU_ranges_base))
+        KeepInputRanges = true;
+      if (Output.IsDWARF5) {
+        Output.RangesWriter =
+          llvm::make_unique<DebugRangeListsSectionWriter>(&BC);
+      } else {
+        Output.RangesWriter =
+          llvm::make_unique<DebugRangesSectionWriter>(&BC, /*IsPartial=*/true);
+      }
+      Output.LocWriter = llvm::make_unique<DebugLocWriter>(&BC);
+    }
   }
 
-  auto processUnitDIE = [&](size_t CUIndex, DWARFUnit *Unit) {
-    updateUnitDebugInfo(CUIndex, Unit);
+  findModifiedUnits();
+
+  auto updateUnit = [this](DWARFUnit *Unit, CUOutputType &Output) {
+    if (Output.IsModified)
+      updateUnitDebugInfo(Unit, Output);
+    else
+      updateUnitARanges(Unit);
   };
 
-  if (opts::NoThreads || opts::DeterministicDebugInfo) {
-    for (auto &CU : BC.DwCtx->compile_units()) {
-      processUnitDIE(0, CU.get());
-    }
+  if (opts::NoThreads) {
+    size_t CUIndex = 0;
+    for (auto &CU : BC.DwCtx->compile_units())
+      updateUnit(CU.get(), CUOutputs[CUIndex++]);
+    for (auto &Output : CUOutputs)
+      flushPendingRanges(Output);
+    for (auto &Output : CUOutputs)
+      Output.writeRanges();
   } else {
     // Update unit debug info in parallel
     auto &ThreadPool = ParallelUtilities::getThreadPool();
     size_t CUIndex = 0;
     for (auto &CU : BC.DwCtx->compile_units()) {
-      ThreadPool.async(processUnitDIE, CUIndex, CU.get());
-      CUIndex++;
+      ThreadPool.async([&](DWARFUnit *Unit, CUOutputType *Output) {
+        updateUnit(Unit, *Output);
+      }, CU.get(), &CUOutputs[CUIndex++]);
+    }
+    ThreadPool.wait();
+
+    // All abbreviations that need DW_AT_ranges are known at this point.
+    for (auto &Output : CUOutputs) {
+      ThreadPool.async([this](CUOutputType *Output) {
+        flushPendingRanges(*Output);
+      }, &Output);
     }
+    ThreadPool.wait();
 
+    // Owners of shared range lists are known at this point.
+    for (auto &Output : CUOutputs) {
+      ThreadPool.async([](CUOutputType *Output) {
+        Output->writeRanges();
+      }, &Output);
+    }
     ThreadPool.wait();
   }
 
-  flushPendingRanges();
+  updateDebugAddressSection();
 
   finalizeDebugSections();
 
   updateGdbIndexSection();
 }
 
-void DWARFRewriter::updateUnitDebugInfo(size_t CUIndex, DWARFUnit *Unit) {
-  // Cache debug ranges so that the offset for identical ranges could be reused.
-  std::map<DebugAddressRangesVector, uint64_t> CachedRanges;
+void DWARFRewriter::findModifiedUnits() {
+  if (!opts::LazyDebugInfo) {
+    for (auto &Output : CUOutputs)
+      Output.IsModified = true;
+    return;
+  }
+
+  // Index subprograms of every unit by their start address, and check if any
+  // of them belongs to a function that is no longer where it was.
+  auto scanUnit = [this](DWARFUnit *Unit, CUOutputType &Output) {
+    // Skeleton units have no subprograms, but their ranges cover all
+    // functions of the unit.
+    if (isSkeletonUnit(Unit)) {
+      Output.IsModified = true;
+      return;
+    }
+
+    const uint32_t HeaderSize = Unit->getVersion() <= 4 ? 11 : 12;
+    uint32_t DIEOffset = Unit->getOffset() + HeaderSize;
+    uint32_t NextCUOffset = Unit->getNextUnitOffset();
+    DWARFDebugInfoEntry Die;
+    DWARFDataExtractor DebugInfoData = Unit->getDebugInfoExtractor();
+    uint32_t Depth = 0;
+    while (Die.extractFast(*Unit, &DIEOffset, DebugInfoData, NextCUOffset,
+                           Depth)) {
+      if (const DWARFAbbreviationDeclaration *AbbrDecl =
+              Die.getAbbreviationDeclarationPtr()) {
+        if (AbbrDecl->hasChildren())
+          ++Depth;
+      } else {
+        // NULL entry.
+        if (Depth > 0)
+          --Depth;
+        if (Depth == 0)
+          break;
+      }
+
+      DWARFDie DIE(Unit, &Die);
+      if (DIE.getTag() != dwarf::DW_TAG_subprogram)
+        continue;
+
+      uint64_t Address;
+      uint64_t SectionIndex, HighPC;
+      if (!DIE.getLowAndHighPC(Address, HighPC, SectionIndex)) {
+        auto Ranges = DIE.getAddressRanges();
+        if (Ranges.empty())
+          continue;
+        Address = Ranges.front().LowPC;
+      }
+
+      const BinaryFunction *Function =
+        BC.getBinaryFunctionContainingAddress(Address);
+      if (Function && (Function->isEmitted() || Function->isFolded())) {
+        Output.IsModified = true;
+        return;
+      }
+    }
+  };
+
+  if (opts::NoThreads) {
+    size_t CUIndex = 0;
+    for (auto &CU : BC.DwCtx->compile_units())
+      scanUnit(CU.get(), CUOutputs[CUIndex++]);
+  } else {
+    auto &ThreadPool = ParallelUtilities::getThreadPool();
+    size_t CUIndex = 0;
+    for (auto &CU : BC.DwCtx->compile_units()) {
+      ThreadPool.async([&](DWARFUnit *Unit, CUOutputType *Output) {
+        scanUnit(Unit, *Output);
+      }, CU.get(), &CUOutputs[CUIndex++]);
+    }
+    ThreadPool.wait();
+  }
+
+  // Converting DIEs to DW_AT_ranges modifies their abbreviations, thus units
+  // sharing abbreviations with a modified unit are updated as well.
+  std::unordered_set<const DWARFAbbreviationDeclarationSet *> ModifiedAbbrevs;
+  size_t CUIndex = 0;
+  for (auto &CU : BC.DwCtx->compile_units()) {
+    if (CUOutputs[CUIndex++].IsModified)
+      ModifiedAbbrevs.insert(CU->getAbbreviations());
+  }
+
+  size_t NumModified = 0;
+  CUIndex = 0;
+  for (auto &CU : BC.DwCtx->compile_units()) {
+    auto &Output = CUOutputs[CUIndex++];
+    if (ModifiedAbbrevs.count(CU->getAbbreviations()))
+      Output.IsModified = true;
+    NumModified += Output.IsModified;
+  }
+
+  outs() << "BOLT-INFO: updating debug info of " << NumModified << " out of "
+         << CUOutputs.size() << " compilation units\n";
+}
+
+void DWARFRewriter::updateDebugAddressSection() {
+  auto DebugAddr = BC.getUniqueSectionByName(".debug_addr");
+  if (!DebugAddr)
+    return;
+
+  // Find the tables of .debug_addr referenced by skeleton units. Tables of
+  // DWARF 5 units have a header with their size. Otherwise, a table extends
+  // to the next one.
+  const auto Contents = DebugAddr->getContents();
+  std::map<uint64_t, uint64_t> Tables;
+  for (auto &CU : BC.DwCtx->compile_units()) {
+    auto UnitDIE = CU->getUnitDIE(/*ExtractUnitDIEOnly=*/true);
+    auto AddrBase =
+      UnitDIE.find({dwarf::DW_AT_GNU_addr_base, dwarf::DW_AT_addr_base});
+    if (!AddrBase || !AddrBase->getAsSectionOffset())
+      continue;
+    const auto Base = *AddrBase->getAsSectionOffset();
+    uint64_t End = 0;
+    if (CU->getVersion() >= 5 && Base >= 8 && Base <= Contents.size())
+      End = Base - 4 + read32le(Contents.data() + Base - 8);
+    Tables.emplace(Base, End);
+  }
+  if (Tables.empty())
+    return;
+
+  SectionPatchers[".debug_addr"] = llvm::make_unique<SimpleBinaryPatcher>();
+  auto *DebugAddrPatcher =
+    static_cast<SimpleBinaryPatcher *>(SectionPatchers[".debug_addr"].get());
+
+  // Addresses of code that moved are updated in place. A .dwo file references
+  // them by index, hence it is valid without changes.
+  uint64_t NumUpdated = 0;
+  for (auto TI = Tables.begin(), TE = Tables.end(); TI != TE; ++TI) {
+    uint64_t End = TI->second;
+    if (!End)
+      End = std::next(TI) == TE ? Contents.size() : std::next(TI)->first;
+    End = std::min<uint64_t>(End, Contents.size());
+    for (uint64_t Offset = TI->first; Offset + 8 <= End; Offset += 8) {
+      const auto Address = read64le(Contents.data() + Offset);
+      const auto *Function =
+        BC.getBinaryFunctionContainingAddress(Address, /*CheckPastEnd=*/true);
+      if (!Function || !Function->isEmitted())
+        continue;
+      const auto OutputAddress =
+        Function->translateInputToOutputAddress(Address);
+      if (!OutputAddress || OutputAddress == Address)
+        continue;
+      DebugAddrPatcher->addLE64Patch(Offset, OutputAddress);
+      ++NumUpdated;
+    }
+  }
+
+  outs() << "BOLT-INFO: updated " << NumUpdated << " entries of .debug_addr "
+         << "referenced by " << Tables.size() << " skeleton units\n";
+}
+
+void DWARFRewriter::writeSymbolizationDebugInfo() {
+  // All units share a single abbreviation.
+  SmallVector<char, 32> AbbrevBuffer;
+  raw_svector_ostream AbbrevOS(AbbrevBuffer);
+  encodeULEB128(1, AbbrevOS);
+  encodeULEB128(dwarf::DW_TAG_compile_unit, AbbrevOS);
+  AbbrevOS << static_cast<char>(dwarf::DW_CHILDREN_no);
+  const std::pair<dwarf::Attribute, dwarf::Form> Attributes[] = {
+    {dwarf::DW_AT_name, dwarf::DW_FORM_string},
+    {dwarf::DW_AT_comp_dir, dwarf::DW_FORM_string},
+    {dwarf::DW_AT_stmt_list, dwarf::DW_FORM_sec_offset},
+    {dwarf::DW_AT_low_pc, dwarf::DW_FORM_addr},
+    {dwarf::DW_AT_ranges, dwarf::DW_FORM_sec_offset},
+  };
+  for (const auto &AttrForm : Attributes) {
+    encodeULEB128(AttrForm.first, AbbrevOS);
+    encodeULEB128(AttrForm.second, AbbrevOS);
+  }
+  encodeULEB128(0, AbbrevOS);
+  encodeULEB128(0, AbbrevOS);
+  encodeULEB128(0, AbbrevOS);
+
+  DebugRangesSectionWriter RangesWriter(&BC);
+  SmallVector<char, 16> InfoBuffer;
+  raw_svector_ostream InfoOS(InfoBuffer);
+  auto Writer = std::unique_ptr<MCObjectWriter>(BC.createObjectWriter(InfoOS));
+  for (auto &CU : BC.DwCtx->compile_units()) {
+    auto UnitDIE = CU->getUnitDIE(/*ExtractUnitDIEOnly=*/true);
+    const std::string Name =
+      dwarf::toString(UnitDIE.find(dwarf::DW_AT_name), "");
+    const std::string CompDir =
+      dwarf::toString(UnitDIE.find(dwarf::DW_AT_comp_dir), "");
+
+    DebugAddressRangesVector OutputRanges =
+      BC.translateModuleAddressRanges(UnitDIE.getAddressRanges());
+    const auto RangesOffset = RangesWriter.addRanges(OutputRanges);
+    ARangesSectionWriter->addCURanges(InfoBuffer.size(),
+                                      std::move(OutputRanges));
+
+    const auto LTI = LineTableOffsets.find(CU->getOffset());
+    const uint32_t LineTableOffset =
+      LTI != LineTableOffsets.end() ? LTI->second : 0;
+
+    // Unit length excludes the length field itself.
+    const uint32_t UnitLength =
+      2 + 4 + 1 + 1 + Name.size() + 1 + CompDir.size() + 1 + 4 + 8 + 4;
+    Writer->writeLE32(UnitLength);
+    Writer->writeLE16(4);   // version
+    Writer->writeLE32(0);   // debug_abbrev_offset
+    Writer->write8(8);      // address_size
+    Writer->write8(1);      // abbreviation code
+    Writer->writeBytes(StringRef(Name.data(), Name.size() + 1));
+    Writer->writeBytes(StringRef(CompDir.data(), CompDir.size() + 1));
+    Writer->writeLE32(LineTableOffset);
+    Writer->writeLE64(0);   // DW_AT_low_pc is the base of ranges
+    Writer->writeLE32(RangesOffset);
+  }
+
+  auto RangesContents = RangesWriter.finalize();
+  BC.registerOrUpdateNoteSection(".debug_ranges",
+                                  copyByteArray(*RangesContents),
+                                  RangesContents->size());
+  BC.registerOrUpdateNoteSection(".debug_abbrev",
+                                  copyByteArray(AbbrevOS.str()),
+                                  AbbrevBuffer.size());
+  BC.registerOrUpdateNoteSection(".debug_info",
+                                  copyByteArray(InfoOS.str()),
+                                  InfoBuffer.size());
+
+  SmallVector<char, 16> ARangesBuffer;
+  raw_svector_ostream ARangesOS(ARangesBuffer);
+  auto ARangesWriter =
+    std::unique_ptr<MCObjectWriter>(BC.createObjectWriter(ARangesOS));
+  ARangesSectionWriter->writeARangesSection(ARangesWriter.get());
+  BC.registerOrUpdateNoteSection(".debug_aranges",
+                                  copyByteArray(ARangesOS.str()),
+                                  ARangesBuffer.size());
+
+  outs() << "BOLT-INFO: wrote symbolization debug info for "
+         << BC.DwCtx->getNumCompileUnits() << " compilation units\n";
+}
+
+void DWARFRewriter::updateUnitARanges(DWARFUnit *Unit) {
+  const DWARFAddressRangesVector ModuleRanges =
+    Unit->getUnitDIE().getAddressRanges();
+  ARangesSectionWriter->addCURanges(
+      Unit->getOffset(), BC.translateModuleAddressRanges(ModuleRanges));
+}
+
+uint64_t DWARFRewriter::CUOutputType::addRanges(
+    const DebugAddressRangesVector &Ranges) {
+  if (Ranges.empty())
+    return EmptyRangesTag;
+  UsedRanges.emplace_back(RangesTable->addRanges(Ranges, Index));
+  return UsedRanges.size() - 1;
+}
+
+void DWARFRewriter::CUOutputType::writeRanges() {
+  for (auto *Value : UsedRanges) {
+    auto &Entry = Value->second;
+    if (Entry.OwnerIndex == Index && Entry.Offset == -1ULL)
+      Entry.Offset = RangesWriter->addRanges(Value->first);
+  }
+}
+
+void DWARFRewriter::CUOutputType::addRangesPatch(uint32_t Offset,
+                                                 uint64_t RangesOffset) {
+  RangesPatches.emplace_back(Offset, RangesOffset);
+}
 
+void DWARFRewriter::updateUnitDebugInfo(DWARFUnit *Unit,
+                                        CUOutputType &Output) {
   const uint32_t HeaderSize = Unit->getVersion() <= 4 ? 11 : 12;
   uint32_t DIEOffset = Unit->getOffset() + HeaderSize;
   uint32_t NextCUOffset = Unit->getNextUnitOffset();
@@ -143,20 +473,22 @@ void DWARFRewriter::updateUnitDebugInfo(size_t CUIndex, DWARFUnit *Unit) {
     }
 
     DWARFDie DIE(Unit, &Die);
+    // The DIE is only valid until the next one is extracted.
+    DWARFDieWrapper SavedDIE(DIE);
     switch (DIE.getTag()) {
-    case dwarf::DW_TAG_compile_unit: {
+    case dwarf::DW_TAG_compile_unit:
+    case dwarf::DW_TAG_skeleton_unit: {
       const DWARFAddressRangesVector ModuleRanges = DIE.getAddressRanges();
       DebugAddressRangesVector OutputRanges =
-        BC.translateModuleAddressRanges(ModuleRanges);
-      const uint64_t RangesSectionOffset =
-        RangesSectionWriter->addRanges(OutputRanges);
+          BC.translateModuleAddressRanges(ModuleRanges);
+      const uint64_t RangesSectionOffset = Output.addRanges(OutputRanges);
       ARangesSectionWriter->addCURanges(Unit->getOffset(),
                                         std::move(OutputRanges));
-      updateDWARFObjectAddressRanges(DIE, RangesSectionOffset);
+      updateDWARFObjectAddressRanges(Output, SavedDIE, RangesSectionOffset);
       break;
     }
     case dwarf::DW_TAG_subprogram: {
-      // Get function address either from ranges or [LowPC, HighPC) pair.
+      // The function cannot have multiple ranges on the input.
       bool UsesRanges = false;
       uint64_t Address;
       uint64_t SectionIndex, HighPC;
@@ -170,9 +502,6 @@ void DWARFRewriter::updateUnitDebugInfo(size_t CUIndex, DWARFUnit *Unit) {
         UsesRanges = true;
       }
 
-      // Clear cached ranges as the new function will have its own set.
-      CachedRanges.clear();
-
       DebugAddressRangesVector FunctionRanges;
       if (const BinaryFunction *Function =
               BC.getBinaryFunctionAtAddress(Address))
@@ -180,60 +509,46 @@ void DWARFRewriter::updateUnitDebugInfo(size_t CUIndex, DWARFUnit *Unit) {
 
       // Update ranges.
       if (UsesRanges) {
-        updateDWARFObjectAddressRanges(DIE,
-            RangesSectionWriter->addRanges(FunctionRanges));
-      } else {
-        // Delay conversion of [LowPC, HighPC) into DW_AT_ranges if possible.
-        const auto *Abbrev = DIE.getAbbreviationDeclarationPtr();
-        assert(Abbrev && "abbrev expected");
+        updateDWARFObjectAddressRanges(Output, SavedDIE,
+                                       Output.addRanges(FunctionRanges));
+        break;
+      }
 
-        // Create a critical section.
-        static std::shared_timed_mutex CriticalSectionMutex;
-        std::unique_lock<std::shared_timed_mutex> Lock(CriticalSectionMutex);
-
-        if (FunctionRanges.size() > 1) {
-          convertPending(Abbrev);
-          // Exit critical section early.
-          Lock.unlock();
-          convertToRanges(DIE, FunctionRanges);
-        } else if (ConvertedRangesAbbrevs.find(Abbrev) !=
-                   ConvertedRangesAbbrevs.end()) {
-          // Exit critical section early.
-          Lock.unlock();
-          convertToRanges(DIE, FunctionRanges);
-        } else {
-          if (FunctionRanges.empty())
-            FunctionRanges.emplace_back(DebugAddressRange());
-          PendingRanges[Abbrev].emplace_back(
-              std::make_pair(DWARFDieWrapper(DIE), FunctionRanges.front()));
-        }
+      // Delay conversion of [LowPC, HighPC) into DW_AT_ranges if possible.
+      // The abbreviation could be shared with DIEs in other units, hence
+      // the conversion of the DIE is decided once all units were processed.
+      if (FunctionRanges.size() > 1) {
+        const auto *Abbrev = SavedDIE.DIE.getAbbreviationDeclarationPtr();
+        assert(Abbrev && "abbrev expected");
+        convertToRanges(Abbrev);
       }
+      Output.PendingRanges.emplace_back(SavedDIE, std::move(FunctionRanges));
       break;
     }
     case dwarf::DW_TAG_lexical_block:
     case dwarf::DW_TAG_inlined_subroutine:
     case dwarf::DW_TAG_try_block:
     case dwarf::DW_TAG_catch_block: {
-      uint64_t RangesSectionOffset =
-          RangesSectionWriter->getEmptyRangesOffset();
       const DWARFAddressRangesVector Ranges = DIE.getAddressRanges();
       const BinaryFunction *Function = Ranges.empty() ? nullptr :
           BC.getBinaryFunctionContainingAddress(Ranges.front().LowPC);
-      if (Function) {
-        DebugAddressRangesVector OutputRanges =
-            Function->translateInputToOutputRanges(Ranges);
-        DEBUG(
-          if (OutputRanges.empty() != Ranges.empty()) {
-            dbgs() << "BOLT-DEBUG: problem with DIE at 0x"
-                   << Twine::utohexstr(DIE.getOffset()) << " in CU at 0x"
-                   << Twine::utohexstr(Unit->getOffset())
-                   << '\n';
-          }
-        );
-        RangesSectionOffset = RangesSectionWriter->addRanges(
-            std::move(OutputRanges), CachedRanges);
+      if (!Function) {
+        updateDWARFObjectAddressRanges(Output, SavedDIE, EmptyRangesTag);
+        break;
       }
-      updateDWARFObjectAddressRanges(DIE, RangesSectionOffset);
+
+      DebugAddressRangesVector OutputRanges =
+          Function->translateInputToOutputRanges(Ranges);
+      DEBUG(
+        if (OutputRanges.empty() != Ranges.empty()) {
+          dbgs() << "BOLT-DEBUG: problem with DIE at 0x"
+                 << Twine::utohexstr(DIE.getOffset()) << " in CU at 0x"
+                 << Twine::utohexstr(Unit->getOffset())
+                 << '\n';
+        }
+      );
+      updateDWARFObjectAddressRanges(Output, SavedDIE,
+                                     Output.addRanges(OutputRanges));
       break;
     }
     default: {
@@ -244,9 +559,6 @@ void DWARFRewriter::updateUnitDebugInfo(size_t CUIndex, DWARFUnit *Unit) {
         Value = *V;
         if (Value.isFormClass(DWARFFormValue::FC_Constant) ||
             Value.isFormClass(DWARFFormValue::FC_SectionOffset)) {
-          // Location list offset in the output section.
-          uint64_t LocListOffset = DebugLocWriter::EmptyListTag;
-
           // Limit parsing to a single list to save memory.
           DWARFDebugLoc::LocationList LL;
           LL.Offset = Value.isFormClass(DWARFFormValue::FC_Constant) ?
@@ -257,6 +569,8 @@ void DWARFRewriter::updateUnitDebugInfo(size_t CUIndex, DWARFUnit *Unit) {
           Optional<DWARFDebugLoc::LocationList> InputLL =
             Unit->getContext().getOneDebugLocList(
                 &LLOff, Unit->getBaseAddress()->Address);
+          DWARFDebugLoc::LocationList OutputLL;
+          bool HasOutputLL = false;
           if (!InputLL || InputLL->Entries.empty()) {
             errs() << "BOLT-WARNING: empty location list detected at 0x"
                    << Twine::utohexstr(LLOff) << " for DIE at 0x"
@@ -267,9 +581,9 @@ void DWARFRewriter::updateUnitDebugInfo(size_t CUIndex, DWARFUnit *Unit) {
             if (const BinaryFunction *Function =
                     BC.getBinaryFunctionContainingAddress(
                         InputLL->Entries.front().Begin)) {
-              const DWARFDebugLoc::LocationList OutputLL =
-                  Function->translateInputToOutputLocationList(
-                      std::move(*InputLL));
+              OutputLL = Function->translateInputToOutputLocationList(
+                  std::move(*InputLL));
+              HasOutputLL = true;
               DEBUG(if (OutputLL.Entries.empty()) {
                 dbgs() << "BOLT-DEBUG: location list translated to an empty "
                           "one at 0x"
@@ -277,19 +591,15 @@ void DWARFRewriter::updateUnitDebugInfo(size_t CUIndex, DWARFUnit *Unit) {
                        << Twine::utohexstr(Unit->getOffset())
                        << '\n';
               });
-              LocListOffset = LocListWritersByCU[CUIndex]->addList(OutputLL);
             }
           }
 
-          if (LocListOffset != DebugLocWriter::EmptyListTag) {
-            std::lock_guard<std::mutex> Lock(LocListDebugInfoPatchesMutex);
-            LocListDebugInfoPatches.push_back(
-                {AttrOffset, CUIndex, LocListOffset});
-          } else {
-            std::lock_guard<std::mutex> Lock(DebugInfoPatcherMutex);
-            DebugInfoPatcher->addLE32Patch(AttrOffset,
-                                           DebugLocWriter::EmptyListOffset);
-          }
+          // Location list offset in the output section.
+          uint64_t LocListOffset = DebugLocWriter::EmptyListTag;
+          if (HasOutputLL)
+            LocListOffset = Output.LocWriter->addList(OutputLL);
+
+          Output.LocListPatches.emplace_back(AttrOffset, LocListOffset);
         } else {
           assert((Value.isFormClass(DWARFFormValue::FC_Exprloc) ||
                   Value.isFormClass(DWARFFormValue::FC_Block)) &&
@@ -310,8 +620,7 @@ void DWARFRewriter::updateUnitDebugInfo(size_t CUIndex, DWARFUnit *Unit) {
                          << " to 0x" << Twine::utohexstr(NewAddress) << '\n');
           }
 
-          std::lock_guard<std::mutex> Lock(DebugInfoPatcherMutex);
-          DebugInfoPatcher->addLE64Patch(AttrOffset, NewAddress);
+          Output.DebugInfoPatcher.addLE64Patch(AttrOffset, NewAddress);
         } else if (opts::Verbosity >= 1) {
           errs() << "BOLT-WARNING: unexpected form value for attribute at 0x"
                  << Twine::utohexstr(AttrOffset);
@@ -328,7 +637,7 @@ void DWARFRewriter::updateUnitDebugInfo(size_t CUIndex, DWARFUnit *Unit) {
 }
 
 void DWARFRewriter::updateDWARFObjectAddressRanges(
-    const DWARFDie DIE, uint64_t DebugRangesOffset) {
+    CUOutputType &Output, const DWARFDie DIE, uint64_t DebugRangesOffset) {
 
   // Some objects don't have an associated DIE and cannot be updated (such as
   // compiler-generated functions).
@@ -350,11 +659,20 @@ void DWARFRewriter::updateDWARFObjectAddressRanges(
     // Case 1: The object was already non-contiguous and had DW_AT_ranges.
     // In this case we simply need to update the value of DW_AT_ranges.
     uint32_t AttrOffset = -1U;
-    DIE.find(dwarf::DW_AT_ranges, &AttrOffset);
+    auto RangesFormValue = DIE.find(dwarf::DW_AT_ranges, &AttrOffset);
     assert(AttrOffset != -1U &&  "failed to locate DWARF attribute");
 
-    std::lock_guard<std::mutex> Lock(DebugInfoPatcherMutex);
-    DebugInfoPatcher->addLE32Patch(AttrOffset, DebugRangesOffset);
+    // Indices into the offsets table of .debug_rnglists are not supported.
+    if (RangesFormValue &&
+        RangesFormValue->getForm() != dwarf::DW_FORM_sec_offset &&
+        RangesFormValue->getForm() != dwarf::DW_FORM_data4) {
+      errs() << "BOLT-WARNING: unexpected form of DW_AT_ranges. Cannot update "
+             << "DIE at offset 0x" << Twine::utohexstr(DIE.getOffset())
+             << '\n';
+      return;
+    }
+
+    Output.addRangesPatch(AttrOffset, DebugRangesOffset);
   } else {
     // Case 2: The object has both DW_AT_low_pc and DW_AT_high_pc emitted back
     // to back. We replace the attributes with DW_AT_ranges and DW_AT_low_pc.
@@ -371,7 +689,7 @@ void DWARFRewriter::updateDWARFObjectAddressRanges(
     if (AbbreviationDecl->findAttributeIndex(dwarf::DW_AT_low_pc) &&
         AbbreviationDecl->findAttributeIndex(dwarf::DW_AT_high_pc)) {
       convertToRanges(AbbreviationDecl);
-      convertToRanges(DIE, DebugRangesOffset);
+      convertToRanges(Output, DIE, DebugRangesOffset);
     } else {
       if (opts::Verbosity >= 1) {
         errs() << "BOLT-WARNING: Cannot update ranges for DIE at offset 0x"
@@ -388,16 +706,24 @@ void DWARFRewriter::updateLineTableOffsets() {
   uint32_t CurrentOffset = 0;
   uint32_t Offset = 0;
 
-  // Line tables are stored in MCContext in ascending order of offset in the
-  // output file, thus we can compute all table's offset by passing through
-  // each fragment at most once, continuing from the last CU's beginning
-  // instead of from the first fragment.
+  // Line tables written during the emission precede the ones stored in
+  // MCContext, which are in ascending order of offset in the output file.
+  // Thus we can compute all table's offset by passing through each fragment
+  // at most once, continuing from the last CU's beginning instead of from the
+  // first fragment.
+  std::vector<std::pair<uint32_t, MCSymbol *>> LineTableLabels =
+    BC.StreamedLineTables;
   for (const auto &CUIDLineTablePair : BC.Ctx->getMCDwarfLineTables()) {
-    auto Label = CUIDLineTablePair.second.getLabel();
+    LineTableLabels.emplace_back(CUIDLineTablePair.first,
+                                 CUIDLineTablePair.second.getLabel());
+  }
+
+  for (const auto &CUOffsetLabelPair : LineTableLabels) {
+    auto Label = CUOffsetLabelPair.second;
     if (!Label)
       continue;
 
-    auto CUOffset = CUIDLineTablePair.first;
+    auto CUOffset = CUOffsetLabelPair.first;
     if (CUOffset == -1U)
       continue;
 
@@ -430,6 +756,12 @@ void DWARFRewriter::updateLineTableOffsets() {
     Offset += Label->getOffset() - CurrentOffset;
     CurrentOffset = Label->getOffset();
 
+    // The output .debug_info is written from scratch with the offsets.
+    if (opts::SymbolizationDebugInfo) {
+      LineTableOffsets[CUOffset] = Offset;
+      continue;
+    }
+
     auto DbgInfoSection = BC.getUniqueSectionByName(".debug_info");
     assert(DbgInfoSection && ".debug_info section must exist");
     DbgInfoSection->addRelocation(LTOffset,
@@ -443,7 +775,7 @@ void DWARFRewriter::updateLineTableOffsets() {
     // that the pending relocations will be processed and not ignored.
     DbgInfoSection->setIsFinalized();
 
-    DEBUG(dbgs() << "BOLT-DEBUG: CU " << CUIDLineTablePair.first
+    DEBUG(dbgs() << "BOLT-DEBUG: CU " << CUOffset
                 << " has line table at " << Offset << "\n");
   }
 }
@@ -466,11 +798,21 @@ void DWARFRewriter::finalizeDebugSections() {
                                     ARangesContents.size());
   }
 
-  auto RangesSectionContents = RangesSectionWriter->finalize();
+  // Patches of location lists complete the patches of each unit, hence they
+  // are merged after ranges.
+  auto RangesSectionContents = makeFinalRangesSection();
   BC.registerOrUpdateNoteSection(".debug_ranges",
                                   copyByteArray(*RangesSectionContents),
                                   RangesSectionContents->size());
 
+  if (std::any_of(CUOutputs.begin(), CUOutputs.end(),
+                  [](const CUOutputType &Output) { return Output.IsDWARF5; })) {
+    auto RangeListsSectionContents = makeFinalRangeListsSection();
+    BC.registerOrUpdateNoteSection(".debug_rnglists",
+                                    copyByteArray(*RangeListsSectionContents),
+                                    RangeListsSectionContents->size());
+  }
+
   auto LocationListSectionContents = makeFinalLocListsSection();
   BC.registerOrUpdateNoteSection(".debug_loc",
                                   copyByteArray(*LocationListSectionContents),
@@ -506,7 +848,7 @@ void DWARFRewriter::updateGdbIndexSection() {
   Data += 24;
 
   // Map CUs offsets to indices and verify existing index table.
-  std::map<uint32_t, uint32_t> OffsetToIndexMap;
+  DenseMap<uint64_t, uint32_t> OffsetToIndexMap;
   const auto CUListSize = CUTypesOffset - CUListOffset;
   const auto NumCUs = BC.DwCtx->getNumCompileUnits();
   if (CUListSize != NumCUs * 16) {
@@ -529,10 +871,19 @@ void DWARFRewriter::updateGdbIndexSection() {
   // Move Data to the beginning of symbol table.
   Data += SymbolTableOffset - CUTypesOffset;
 
-  // Calculate the size of the new address table.
+  // Calculate the size of the new address table and the offset of the
+  // entries of each unit in it.
+  struct CUEntriesType {
+    uint32_t CUIndex;
+    const DebugAddressRangesVector *Ranges;
+    uint32_t TableOffset;
+  };
+  std::vector<CUEntriesType> CUEntries;
   uint32_t NewAddressTableSize = 0;
   for (const auto &CURangesPair : ARangesSectionWriter->getCUAddressRanges()) {
     const auto &Ranges = CURangesPair.second;
+    CUEntries.push_back({OffsetToIndexMap[CURangesPair.first], &Ranges,
+                         NewAddressTableSize});
     NewAddressTableSize += Ranges.size() * 20;
   }
 
@@ -559,17 +910,39 @@ void DWARFRewriter::updateGdbIndexSection() {
          AddressTableOffset - CUListOffset);
   Buffer += AddressTableOffset - CUListOffset;
 
-  // Generate new address table.
-  for (const auto &CURangesPair : ARangesSectionWriter->getCUAddressRanges()) {
-    const auto CUIndex = OffsetToIndexMap[CURangesPair.first];
-    const auto &Ranges = CURangesPair.second;
-    for (const auto &Range : Ranges) {
-      write64le(Buffer, Range.LowPC);
-      write64le(Buffer + 8, Range.HighPC);
-      write32le(Buffer + 16, CUIndex);
-      Buffer += 20;
+  // Generate new address table. Entries of units are written to known
+  // offsets, hence blocks of units are processed in parallel.
+  auto writeEntries = [Buffer, &CUEntries](size_t Begin, size_t End) {
+    for (size_t I = Begin; I < End; ++I) {
+      auto *EntryBuffer = Buffer + CUEntries[I].TableOffset;
+      for (const auto &Range : *CUEntries[I].Ranges) {
+        write64le(EntryBuffer, Range.LowPC);
+        write64le(EntryBuffer + 8, Range.HighPC);
+        write32le(EntryBuffer + 16, CUEntries[I].CUIndex);
+        EntryBuffer += 20;
+      }
+    }
+  };
+
+  if (opts::NoThreads) {
+    writeEntries(0, CUEntries.size());
+  } else {
+    auto &ThreadPool = ParallelUtilities::getThreadPool();
+    const uint64_t BlockSize = std::max<uint64_t>(
+        NewAddressTableSize / (opts::ThreadCount * opts::TaskCount), 4096);
+    size_t Begin = 0;
+    while (Begin < CUEntries.size()) {
+      size_t End = Begin + 1;
+      while (End < CUEntries.size() &&
+             CUEntries[End].TableOffset - CUEntries[Begin].TableOffset <
+                 BlockSize)
+        ++End;
+      ThreadPool.async(writeEntries, Begin, End);
+      Begin = End;
     }
+    ThreadPool.wait();
   }
+  Buffer += NewAddressTableSize;
 
   const auto TrailingSize =
     GdbIndexContents.data() + GdbIndexContents.size() - Data;
@@ -589,6 +962,8 @@ void
 DWARFRewriter::convertToRanges(const DWARFAbbreviationDeclaration *Abbrev) {
   dwarf::Form HighPCForm = Abbrev->findAttribute(dwarf::DW_AT_high_pc)->Form;
   std::lock_guard<std::mutex> Lock(AbbrevPatcherMutex);
+  if (!ConvertedRangesAbbrevs.emplace(Abbrev).second)
+    return;
   AbbrevPatcher->addAttributePatch(Abbrev,
                                    dwarf::DW_AT_low_pc,
                                    dwarf::DW_AT_ranges,
@@ -611,33 +986,128 @@ DWARFRewriter::convertToRanges(const DWARFAbbreviationDeclaration *Abbrev) {
   }
 }
 
-void DWARFRewriter::convertToRanges(DWARFDie DIE,
+void DWARFRewriter::convertToRanges(CUOutputType &Output, DWARFDie DIE,
                                     const DebugAddressRangesVector &Ranges) {
-  uint64_t RangesSectionOffset;
-  if (Ranges.empty()) {
-    RangesSectionOffset = RangesSectionWriter->getEmptyRangesOffset();
-  } else {
-    RangesSectionOffset = RangesSectionWriter->addRanges(Ranges);
+  convertToRanges(Output, DIE, Output.addRanges(Ranges));
+}
+
+std::unique_ptr<RangesBufferVector> DWARFRewriter::makeFinalRangesSection() {
+  auto RangesBuffer = llvm::make_unique<RangesBufferVector>();
+  auto RangesStream = llvm::make_unique<raw_svector_ostream>(*RangesBuffer);
+  auto Writer =
+    std::unique_ptr<MCObjectWriter>(BC.createObjectWriter(*RangesStream));
+
+  // Units that were not modified, and .dwo files, keep referencing the input
+  // section.
+  uint64_t SectionOffset = 0;
+  if (opts::LazyDebugInfo || KeepInputRanges) {
+    if (auto DebugRanges = BC.getUniqueSectionByName(".debug_ranges")) {
+      Writer->writeBytes(DebugRanges->getContents());
+      SectionOffset += DebugRanges->getContents().size();
+    }
   }
 
-  convertToRanges(DIE, RangesSectionOffset);
-}
+  // Add an empty range before the ranges of units.
+  const uint64_t EmptyRangesOffset = SectionOffset;
+  Writer->writeLE64(0);
+  Writer->writeLE64(0);
+  SectionOffset += 2 * 8;
 
-void DWARFRewriter::convertPending(const DWARFAbbreviationDeclaration *Abbrev) {
-  if (ConvertedRangesAbbrevs.count(Abbrev))
-    return;
+  std::vector<uint64_t> PartOffsets(CUOutputs.size());
+  for (auto &Output : CUOutputs) {
+    if (Output.IsDWARF5)
+      continue;
+
+    PartOffsets[Output.Index] = SectionOffset;
+    auto CURanges = Output.RangesWriter->finalize();
+    Writer->writeBytes(*CURanges);
+    SectionOffset += CURanges->size();
+    Output.RangesWriter.reset();
+  }
+
+  patchRanges(/*IsDWARF5=*/false, PartOffsets, EmptyRangesOffset);
 
-  convertToRanges(Abbrev);
+  return RangesBuffer;
+}
 
-  auto I = PendingRanges.find(Abbrev);
-  if (I != PendingRanges.end()) {
-    for (auto &Pair : I->second) {
-      convertToRanges(Pair.first, {Pair.second});
+void DWARFRewriter::patchRanges(bool IsDWARF5,
+                                const std::vector<uint64_t> &PartOffsets,
+                                uint64_t EmptyRangesOffset) {
+  forEachCUOutput([&](CUOutputType &Output) {
+    if (Output.IsDWARF5 != IsDWARF5)
+      return;
+
+    for (const auto &Patch : Output.RangesPatches) {
+      if (Patch.second == EmptyRangesTag) {
+        Output.DebugInfoPatcher.addLE32Patch(Patch.first, EmptyRangesOffset);
+        continue;
+      }
+      const auto &Entry = Output.UsedRanges[Patch.second]->second;
+      Output.DebugInfoPatcher.addLE32Patch(Patch.first,
+          PartOffsets[Entry.OwnerIndex] + Entry.Offset);
+    }
+    clearList(Output.RangesPatches);
+    clearList(Output.UsedRanges);
+  });
+}
+
+std::unique_ptr<RangesBufferVector>
+DWARFRewriter::makeFinalRangeListsSection() {
+  auto RangesBuffer = llvm::make_unique<RangesBufferVector>();
+  auto RangesStream = llvm::make_unique<raw_svector_ostream>(*RangesBuffer);
+  auto Writer =
+    std::unique_ptr<MCObjectWriter>(BC.createObjectWriter(*RangesStream));
+
+  // Units that were not modified keep referencing the input section.
+  uint64_t SectionOffset = 0;
+  if (opts::LazyDebugInfo) {
+    if (auto DebugRngLists = BC.getUniqueSectionByName(".debug_rnglists")) {
+      Writer->writeBytes(DebugRngLists->getContents());
+      SectionOffset += DebugRngLists->getContents().size();
     }
-    PendingRanges.erase(I);
   }
 
-  ConvertedRangesAbbrevs.emplace(Abbrev);
+  std::vector<std::unique_ptr<RangesBufferVector>> CURangesParts;
+  uint64_t ListsSize = 1;
+  for (auto &Output : CUOutputs) {
+    if (!Output.IsDWARF5)
+      continue;
+    CURangesParts.emplace_back(Output.RangesWriter->finalize());
+    ListsSize += CURangesParts.back()->size();
+    Output.RangesWriter.reset();
+  }
+
+  // All lists are written in a single contribution without an offsets table,
+  // since DIEs reference them with DW_FORM_sec_offset.
+  const uint64_t UnitLength =
+    DebugRangeListsSectionWriter::HeaderSize - 4 + ListsSize;
+  Writer->writeLE32(UnitLength);
+  Writer->writeLE16(5);  // version
+  Writer->write8(8);     // address_size
+  Writer->write8(0);     // segment_selector_size
+  Writer->writeLE32(0);  // offset_entry_count
+  SectionOffset += DebugRangeListsSectionWriter::HeaderSize;
+
+  // Add an empty list before the lists of units.
+  const uint64_t EmptyRangesOffset = SectionOffset;
+  Writer->write8(dwarf::DW_RLE_end_of_list);
+  SectionOffset += 1;
+
+  std::vector<uint64_t> PartOffsets(CUOutputs.size());
+  auto PartI = CURangesParts.begin();
+  for (auto &Output : CUOutputs) {
+    if (!Output.IsDWARF5)
+      continue;
+
+    PartOffsets[Output.Index] = SectionOffset;
+    const auto &CURanges = *PartI++;
+    Writer->writeBytes(*CURanges);
+    SectionOffset += CURanges->size();
+  }
+
+  patchRanges(/*IsDWARF5=*/true, PartOffsets, EmptyRangesOffset);
+
+  return RangesBuffer;
 }
 
 std::unique_ptr<LocBufferVector> DWARFRewriter::makeFinalLocListsSection() {
@@ -648,36 +1118,84 @@ std::unique_ptr<LocBufferVector> DWARFRewriter::makeFinalLocListsSection() {
 
   uint32_t SectionOffset = 0;
 
-  // Add an empty list as the first entry;
+  // Units that were not modified keep referencing the input section.
+  if (opts::LazyDebugInfo) {
+    if (auto DebugLoc = BC.getUniqueSectionByName(".debug_loc")) {
+      Writer->writeBytes(DebugLoc->getContents());
+      SectionOffset += DebugLoc->getContents().size();
+    }
+  }
+
+  // Add an empty list before the lists of units.
+  const uint32_t EmptyListOffset = SectionOffset;
   Writer->writeLE64(0);
   Writer->writeLE64(0);
   SectionOffset += 2 * 8;
 
-  std::vector<uint32_t> SectionOffsetByCU(LocListWritersByCU.size());
-
-  for (size_t CUIndex = 0; CUIndex < LocListWritersByCU.size(); ++CUIndex) {
-    SectionOffsetByCU[CUIndex] = SectionOffset;
-    auto CurrCULocationLists = LocListWritersByCU[CUIndex]->finalize();
-    Writer->writeBytes(*CurrCULocationLists);
-    SectionOffset += CurrCULocationLists->size();
+  // Offsets of parts of units are known before any of them is copied, hence
+  // the parts are copied and patches are created in parallel.
+  std::vector<std::unique_ptr<LocBufferVector>> CULocParts;
+  std::vector<uint32_t> PartOffsets;
+  CULocParts.reserve(CUOutputs.size());
+  PartOffsets.reserve(CUOutputs.size());
+  for (auto &Output : CUOutputs) {
+    CULocParts.emplace_back(Output.LocWriter->finalize());
+    Output.LocWriter.reset();
+    PartOffsets.push_back(SectionOffset);
+    SectionOffset += CULocParts.back()->size();
   }
+  LocBuffer->resize(SectionOffset);
+
+  forEachCUOutput([&](CUOutputType &Output) {
+    const auto PartOffset = PartOffsets[Output.Index];
+    for (const auto &Patch : Output.LocListPatches) {
+      Output.DebugInfoPatcher.addLE32Patch(Patch.first,
+          Patch.second == DebugLocWriter::EmptyListTag
+            ? EmptyListOffset
+            : PartOffset + Patch.second);
+    }
+    clearList(Output.LocListPatches);
 
-  for (auto &Patch : LocListDebugInfoPatches) {
-    DebugInfoPatcher
-      ->addLE32Patch(Patch.DebugInfoOffset,
-                     SectionOffsetByCU[Patch.CUIndex] + Patch.CUWriterOffset);
-  }
+    auto &Part = CULocParts[Output.Index];
+    std::copy(Part->begin(), Part->end(), LocBuffer->begin() + PartOffset);
+    Part.reset();
+  });
+
+  // All patches of units are known at this point.
+  for (auto &Output : CUOutputs)
+    DebugInfoPatcher->append(std::move(Output.DebugInfoPatcher));
 
   return LocBuffer;
 }
 
-void DWARFRewriter::flushPendingRanges() {
-  for (auto &I : PendingRanges) {
-    for (auto &RangePair : I.second) {
-      patchLowHigh(RangePair.first, RangePair.second);
+void DWARFRewriter::forEachCUOutput(
+    std::function<void(CUOutputType &)> Callback) {
+  if (opts::NoThreads) {
+    for (auto &Output : CUOutputs)
+      Callback(Output);
+    return;
+  }
+
+  auto &ThreadPool = ParallelUtilities::getThreadPool();
+  for (auto &Output : CUOutputs)
+    ThreadPool.async([&Callback](CUOutputType *Output) {
+      Callback(*Output);
+    }, &Output);
+  ThreadPool.wait();
+}
+
+void DWARFRewriter::flushPendingRanges(CUOutputType &Output) {
+  for (auto &RangesPair : Output.PendingRanges) {
+    const DWARFDie DIE = RangesPair.first;
+    const auto &Ranges = RangesPair.second;
+    if (ConvertedRangesAbbrevs.count(DIE.getAbbreviationDeclarationPtr())) {
+      convertToRanges(Output, DIE, Ranges);
+    } else {
+      patchLowHigh(Output, DIE,
+                   Ranges.empty() ? DebugAddressRange() : Ranges.front());
     }
   }
-  clearList(PendingRanges);
+  clearList(Output.PendingRanges);
 }
 
 namespace {
@@ -709,21 +1227,24 @@ void getRangeAttrData(
 
 }
 
-void DWARFRewriter::patchLowHigh(DWARFDie DIE, DebugAddressRange Range) {
+void DWARFRewriter::patchLowHigh(CUOutputType &Output, DWARFDie DIE,
+                                 DebugAddressRange Range) {
   uint32_t LowPCOffset, HighPCOffset;
   DWARFFormValue LowPCFormValue, HighPCFormValue;
   getRangeAttrData(
       DIE, LowPCOffset, HighPCOffset, LowPCFormValue, HighPCFormValue);
-  DebugInfoPatcher->addLE64Patch(LowPCOffset, Range.LowPC);
+  Output.DebugInfoPatcher.addLE64Patch(LowPCOffset, Range.LowPC);
   if (HighPCFormValue.getForm() == dwarf::DW_FORM_addr ||
       HighPCFormValue.getForm() == dwarf::DW_FORM_data8) {
-    DebugInfoPatcher->addLE64Patch(HighPCOffset, Range.HighPC - Range.LowPC);
+    Output.DebugInfoPatcher.addLE64Patch(HighPCOffset,
+                                         Range.HighPC - Range.LowPC);
   } else {
-    DebugInfoPatcher->addLE32Patch(HighPCOffset, Range.HighPC - Range.LowPC);
+    Output.DebugInfoPatcher.addLE32Patch(HighPCOffset,
+                                         Range.HighPC - Range.LowPC);
   }
 }
 
-void DWARFRewriter::convertToRanges(DWARFDie DIE,
+void DWARFRewriter::convertToRanges(CUOutputType &Output, DWARFDie DIE,
                                     uint64_t RangesSectionOffset) {
   uint32_t LowPCOffset, HighPCOffset;
   DWARFFormValue LowPCFormValue, HighPCFormValue;
@@ -741,15 +1262,15 @@ void DWARFRewriter::convertToRanges(DWARFDie DIE,
     llvm_unreachable("unexpected form");
   }
 
-  std::lock_guard<std::mutex> Lock(DebugInfoPatcherMutex);
-  DebugInfoPatcher->addLE32Patch(LowPCOffset, RangesSectionOffset);
+  Output.addRangesPatch(LowPCOffset, RangesSectionOffset);
   if (LowPCSize == 12) {
     // Write an indirect 0 value for DW_AT_low_pc so that we can fill
     // 12 bytes of space (see T56239836 for more details)
-    DebugInfoPatcher->addUDataPatch(LowPCOffset + 4, dwarf::DW_FORM_addr, 4);
-    DebugInfoPatcher->addLE64Patch(LowPCOffset + 8, 0);
+    Output.DebugInfoPatcher.addUDataPatch(LowPCOffset + 4,
+                                          dwarf::DW_FORM_addr, 4);
+    Output.DebugInfoPatcher.addLE64Patch(LowPCOffset + 8, 0);
   } else {
-    DebugInfoPatcher->addLE64Patch(LowPCOffset + 4, 0);
+    Output.DebugInfoPatcher.addLE64Patch(LowPCOffset + 4, 0);
   }
 }
 
@@ -14,6 +14,7 @@
 
 #include "DebugData.h"
 #include "RewriteInstance.h"
+#include <functional>
 #include <map>
 #include <mutex>
 #include <vector>
@@ -35,48 +36,146 @@ class DWARFRewriter {
 
   SimpleBinaryPatcher *DebugInfoPatcher{nullptr};
 
-  std::mutex DebugInfoPatcherMutex;
-
   DebugAbbrevPatcher *AbbrevPatcher{nullptr};
 
   std::mutex AbbrevPatcherMutex;
 
-  /// Stores and serializes information that will be put into the
-  /// .debug_ranges DWARF section.
-  std::unique_ptr<DebugRangesSectionWriter> RangesSectionWriter;
-
   /// Stores and serializes information that will be put into the
   /// .debug_aranges DWARF section.
   std::unique_ptr<DebugARangesSectionWriter> ARangesSectionWriter;
 
-  /// Use a separate location list writer for each compilation unit
-  std::vector<std::unique_ptr<DebugLocWriter>> LocListWritersByCU;
+  /// Abbreviations that were converted to use DW_AT_ranges. Guarded by
+  /// AbbrevPatcherMutex while units are processed.
+  std::set<const DWARFAbbreviationDeclaration *> ConvertedRangesAbbrevs;
+
+  /// DWARFDie contains a pointer to a DIE and hence gets invalidated once the
+  /// embedded DIE is destroyed. This wrapper class stores a DIE internally and
+  /// could be cast to a DWARFDie that is valid even after the initial DIE is
+  /// destroyed.
+  struct DWARFDieWrapper {
+    DWARFUnit *Unit;
+    DWARFDebugInfoEntry DIE;
+
+    DWARFDieWrapper(DWARFUnit *Unit, DWARFDebugInfoEntry DIE) :
+      Unit(Unit),
+      DIE(DIE) {}
+
+    DWARFDieWrapper(DWARFDie &Die) :
+      Unit(Die.getDwarfUnit()),
+      DIE(*Die.getDebugInfoEntry()) {}
+
+    operator DWARFDie() const {
+      return DWARFDie(Unit, &DIE);
+    }
+  };
+
+  /// Output of a single compilation unit. Units are processed in parallel
+  /// without sharing any writer, and their outputs are merged in the order of
+  /// units, so that the result does not depend on the scheduling of threads.
+  struct CUOutputType {
+    /// Part of .debug_ranges with the address ranges of the unit.
+    std::unique_ptr<DebugRangesSectionWriter> RangesWriter;
+
+    /// Part of .debug_loc with the location lists of the unit.
+    std::unique_ptr<DebugLocWriter> LocWriter;
+
+    /// Patches of .debug_info with values that do not depend on other units.
+    SimpleBinaryPatcher DebugInfoPatcher;
+
+    /// Pairs of a .debug_info offset and a value returned by addRanges(), or
+    /// an offset in the part of .debug_loc of the unit, or the empty list tag,
+    /// to be patched once the offsets of all parts in the output sections are
+    /// known.
+    std::vector<std::pair<uint32_t, uint64_t>> RangesPatches;
+    std::vector<std::pair<uint32_t, uint64_t>> LocListPatches;
+
+    /// Range lists used by the unit, shared with other units.
+    std::vector<DebugRangesDedupTable::ValueType *> UsedRanges;
+
+    /// Table of range lists of units writing to the same section.
+    DebugRangesDedupTable *RangesTable{nullptr};
+
+    /// Index of the unit.
+    uint32_t Index{0};
+
+    /// Functions using DW_AT_(low|high)_pc, with their output ranges. Whether
+    /// they are converted to DW_AT_ranges depends on other DIEs sharing the
+    /// abbreviation, and is decided once all units were processed.
+    std::vector<std::pair<DWARFDieWrapper, DebugAddressRangesVector>>
+      PendingRanges;
+
+    /// Set if the unit has to be updated. Otherwise, it is kept as it is in
+    /// the input with -lazy-debug-info.
+    bool IsModified{false};
 
-  struct LocListDebugInfoPatchType {
-    uint32_t DebugInfoOffset;
-    size_t CUIndex;
-    uint64_t CUWriterOffset;
+    /// Set for DWARF 5 units, which reference .debug_rnglists.
+    bool IsDWARF5{false};
+
+    /// Register \p Ranges used by the unit and return its index in
+    /// UsedRanges, or EmptyRangesTag if the list is empty.
+    uint64_t addRanges(const DebugAddressRangesVector &Ranges);
+
+    /// Write range lists owned by the unit to RangesWriter. Called once all
+    /// units registered their lists.
+    void writeRanges();
+
+    /// Patch .debug_info at \p Offset with the output offset of the ranges
+    /// returned by addRanges().
+    void addRangesPatch(uint32_t Offset, uint64_t RangesOffset);
   };
 
-  /// The list of debug info patches to be made once individual
-  /// location list writers have been filled
-  std::vector<LocListDebugInfoPatchType> LocListDebugInfoPatches;
+  /// Value returned by CUOutputType::addRanges() for an empty list.
+  static constexpr uint64_t EmptyRangesTag = -1;
+
+  /// Outputs of compilation units, in the order of the units.
+  std::vector<CUOutputType> CUOutputs;
+
+  /// Run \p Callback on the output of each unit, in parallel unless
+  /// -no-threads is set.
+  void forEachCUOutput(std::function<void(CUOutputType &)> Callback);
 
-  std::mutex LocListDebugInfoPatchesMutex;
+  /// Range lists of units using .debug_ranges and .debug_rnglists.
+  DebugRangesDedupTable RangesTable;
+  DebugRangesDedupTable RangeListsTable;
 
-  /// Update debug info for all DIEs in \p Unit.
-  void updateUnitDebugInfo(size_t CUIndex, DWARFUnit *Unit);
+  /// Set CUOutputType::IsModified for units that have to be updated. With
+  /// -lazy-debug-info, these are units with functions that were emitted or
+  /// folded, and units sharing abbreviations with them.
+  void findModifiedUnits();
+
+  /// Add address ranges of \p Unit that is not updated to .debug_aranges.
+  void updateUnitARanges(DWARFUnit *Unit);
+
+  /// Update debug info for all DIEs in \p Unit, writing the results to
+  /// \p Output.
+  void updateUnitDebugInfo(DWARFUnit *Unit, CUOutputType &Output);
 
   /// Patches the binary for an object's address ranges to be updated.
   /// The object can be a anything that has associated address ranges via either
   /// DW_AT_low/high_pc or DW_AT_ranges (i.e. functions, lexical blocks, etc).
-  /// \p DebugRangesOffset is the offset in .debug_ranges of the object's
-  /// new address ranges in the output binary.
-  /// \p Unit Compile unit the object belongs to.
+  /// \p DebugRangesOffset is the offset of the object's new address ranges
+  /// as returned by CUOutputType::addRanges().
+  /// \p Output Output of the compile unit the object belongs to.
   /// \p DIE is the object's DIE in the input binary.
-  void updateDWARFObjectAddressRanges(const DWARFDie DIE,
+  void updateDWARFObjectAddressRanges(CUOutputType &Output,
+                                      const DWARFDie DIE,
                                       uint64_t DebugRangesOffset);
 
+  /// Once all units were processed, convert pending functions of \p Output
+  /// to DW_AT_ranges if their abbreviation was converted, or update their
+  /// DW_AT_(low|high)_pc values otherwise.
+  void flushPendingRanges(CUOutputType &Output);
+
+  /// Concatenate parts of .debug_ranges and .debug_loc of all units, and
+  /// apply patches of .debug_info of all units in the order of units.
+  std::unique_ptr<RangesBufferVector> makeFinalRangesSection();
+  std::unique_ptr<RangesBufferVector> makeFinalRangeListsSection();
+
+  /// Patch references to range lists from units using .debug_rnglists if
+  /// \p IsDWARF5 is set, or .debug_ranges otherwise. \p PartOffsets are the
+  /// offsets of parts of units in the output section, indexed by unit.
+  void patchRanges(bool IsDWARF5, const std::vector<uint64_t> &PartOffsets,
+                   uint64_t EmptyRangesOffset);
   std::unique_ptr<LocBufferVector> makeFinalLocListsSection();
 
   /// Generate new contents for .debug_ranges and .debug_aranges section.
@@ -86,60 +185,43 @@ class DWARFRewriter {
   /// blocks) to be updated.
   void updateDebugAddressRanges();
 
-  /// Rewrite .gdb_index section if present.
-  void updateGdbIndexSection();
+  /// Update addresses in .debug_addr referenced by skeleton units of split
+  /// DWARF. Contents of .dwo and .dwp files are not loaded or changed.
+  void updateDebugAddressSection();
 
-  /// Abbreviations that were converted to use DW_AT_ranges.
-  std::set<const DWARFAbbreviationDeclaration *> ConvertedRangesAbbrevs;
+  /// Set if .dwo files reference the input .debug_ranges, which is then
+  /// kept at the start of the output section.
+  bool KeepInputRanges{false};
 
-  /// DWARFDie contains a pointer to a DIE and hence gets invalidated once the
-  /// embedded DIE is destroyed. This wrapper class stores a DIE internally and
-  /// could be cast to a DWARFDie that is valid even after the initial DIE is
-  /// destroyed.
-  struct DWARFDieWrapper {
-    DWARFUnit *Unit;
-    DWARFDebugInfoEntry DIE;
+  /// Output offsets of line tables of units in .debug_line with
+  /// -symbolization-debug-info.
+  std::map<uint32_t, uint32_t> LineTableOffsets;
 
-    DWARFDieWrapper(DWARFUnit *Unit, DWARFDebugInfoEntry DIE) :
-      Unit(Unit),
-      DIE(DIE) {}
-
-    DWARFDieWrapper(DWARFDie &Die) :
-      Unit(Die.getDwarfUnit()),
-      DIE(*Die.getDebugInfoEntry()) {}
-
-    operator DWARFDie() {
-      return DWARFDie(Unit, &DIE);
-    }
-  };
-
-  /// DIEs with abbrevs that were not converted to DW_AT_ranges.
-  /// We only update those when all DIEs have been processed to guarantee that
-  /// the abbrev (which is shared) is intact.
-  using PendingRangesType = std::unordered_map<
-    const DWARFAbbreviationDeclaration *,
-    std::vector<std::pair<DWARFDieWrapper, DebugAddressRange>>>;
+  /// Replace .debug_info with units that only have a DW_TAG_compile_unit
+  /// DIE referencing the line table and the output address ranges of the
+  /// unit, and write matching .debug_abbrev, .debug_ranges and
+  /// .debug_aranges.
+  void writeSymbolizationDebugInfo();
 
-  PendingRangesType PendingRanges;
+  /// Rewrite .gdb_index section if present.
+  void updateGdbIndexSection();
 
   /// Convert \p Abbrev from using a simple DW_AT_(low|high)_pc range to
   /// DW_AT_ranges.
   void convertToRanges(const DWARFAbbreviationDeclaration *Abbrev);
 
-  /// Update \p DIE that was using DW_AT_(low|high)_pc with DW_AT_ranges offset.
-  void convertToRanges(DWARFDie DIE, uint64_t RangesSectionOffset);
+  /// Update \p DIE that was using DW_AT_(low|high)_pc with DW_AT_ranges offset
+  /// returned by CUOutputType::addRanges().
+  void convertToRanges(CUOutputType &Output, DWARFDie DIE,
+                       uint64_t RangesSectionOffset);
 
   /// Same as above, but takes a vector of \p Ranges as a parameter.
-  void convertToRanges(DWARFDie DIE, const DebugAddressRangesVector &Ranges);
+  void convertToRanges(CUOutputType &Output, DWARFDie DIE,
+                       const DebugAddressRangesVector &Ranges);
 
   /// Patch DW_AT_(low|high)_pc values for the \p DIE based on \p Range.
-  void patchLowHigh(DWARFDie DIE, DebugAddressRange Range);
-
-  /// Convert pending ranges associated with the given \p Abbrev.
-  void convertPending(const DWARFAbbreviationDeclaration *Abbrev);
-
-  /// Once all DIEs were seen, update DW_AT_(low|high)_pc values.
-  void flushPendingRanges();
+  void patchLowHigh(CUOutputType &Output, DWARFDie DIE,
+                    DebugAddressRange Range);
 
 public:
   DWARFRewriter(BinaryContext &BC,
@@ -18,19 +18,30 @@
 #include "DataAggregator.h"
 #include "ExecutableFileMemoryManager.h"
 #include "Heatmap.h"
+#include "ParallelUtilities.h"
 #include "Utils.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Endian.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LEB128.h"
 #include "llvm/Support/Options.h"
 #include "llvm/Support/Process.h"
 #include "llvm/Support/Program.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/Regex.h"
 #include "llvm/Support/Timer.h"
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <functional>
 #include <map>
+#include <queue>
 #include <sstream>
+#include <tuple>
 #include <unordered_map>
 
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #define DEBUG_TYPE "aggregator"
@@ -45,7 +56,17 @@ extern bool HeatmapMode;
 extern bool LinuxKernelMode;
 extern cl::SubCommand HeatmapCommand;
 extern cl::opt<bool> AggregateOnly;
+extern cl::opt<bool> PrintProfileStats;
 extern cl::opt<std::string> OutputFilename;
+extern cl::opt<unsigned> Verbosity;
+
+static cl::opt<unsigned long long>
+AggregationMemoryLimit("aggr-memory-limit",
+  cl::desc("spill aggregated branch traces to disk once they use more than "
+           "the given number of megabytes (0 means no limit)"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
 
 static cl::opt<bool>
 BasicAggregation("nl",
@@ -54,6 +75,31 @@ BasicAggregation("nl",
   cl::ZeroOrMore,
   cl::cat(AggregatorCategory));
 
+cl::opt<bool>
+CheckProfile("check-profile",
+  cl::desc("only report the coverage of the samples per function and per "
+           "mapping of the binary, without disassembling it"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<double>
+CheckProfileMinCoverage("check-profile-min-coverage",
+  cl::desc("with -check-profile, fail if the percentage of samples in "
+           "functions of the binary is lower than the given value"),
+  cl::init(0.0),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<bool>
+ContextProfile("context-profile",
+  cl::desc("record the blocks executed by callees separately for every call "
+           "site found in LBR call chains, and use them to set the profile of "
+           "inlined code (not saved in aggregated profiles)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
 static cl::opt<bool>
 FilterMemProfile("filter-mem-profile",
   cl::desc("if processing a memory profile, filter out stack or heap accesses "
@@ -74,6 +120,37 @@ HeatmapBlock("block-size",
   cl::init(64),
   cl::sub(HeatmapCommand));
 
+static cl::list<unsigned long long>
+HeatmapZoomBlocks("zoom-block-sizes",
+  cl::CommaSeparated,
+  cl::desc("block sizes of additional heat maps written to <output>-<size>, "
+           "e.g. 4096,2097152 for pages and huge pages"),
+  cl::value_desc("size1,size2,..."),
+  cl::sub(HeatmapCommand));
+
+static cl::opt<std::string>
+HeatmapCountsFile("save-counts",
+  cl::desc("save heat map bucket counts to a file for use with -diff-with"),
+  cl::value_desc("filename"),
+  cl::Optional,
+  cl::sub(HeatmapCommand));
+
+static cl::opt<std::string>
+HeatmapDiffFile("diff-with",
+  cl::desc("print the difference with heat map counts saved by -save-counts "
+           "for another binary or profile to <output>-diff"),
+  cl::value_desc("filename"),
+  cl::Optional,
+  cl::sub(HeatmapCommand));
+
+cl::opt<std::string>
+HeatmapCountsInput("from-counts",
+  cl::desc("print the heat map from bucket counts saved by -save-counts "
+           "instead of aggregating a profile"),
+  cl::value_desc("filename"),
+  cl::Optional,
+  cl::sub(HeatmapCommand));
+
 static cl::opt<std::string>
 HeatmapFile("o",
   cl::init("-"),
@@ -95,6 +172,15 @@ HeatmapMinAddress("min-address",
   cl::Optional,
   cl::sub(HeatmapCommand));
 
+cl::opt<bool>
+HeatmapUseBAT("use-bat",
+  cl::desc("for a binary processed by BOLT, map samples in the functions to "
+           "the addresses of the input binary with the address translation "
+           "table"),
+  cl::init(false),
+  cl::Optional,
+  cl::sub(HeatmapCommand));
+
 static cl::opt<bool>
 IgnoreBuildID("ignore-build-id",
   cl::desc("continue even if build-ids in input binary and perf.data mismatch"),
@@ -116,6 +202,100 @@ MaxSamples("max-samples",
   cl::Hidden,
   cl::cat(AggregatorCategory));
 
+static cl::opt<bool>
+NativePerfReader("native-perf-reader",
+  cl::desc("read perf.data directly instead of parsing perf script output"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<std::string>
+ITraceAggregation("itrace",
+  cl::desc("generate branch stacks from an instruction trace, such as Arm "
+           "ETM/ETE or Intel PT, with the given perf script --itrace options, "
+           "e.g. 'i100000il'"),
+  cl::value_desc("options"),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned>
+ITraceWindow("itrace-window",
+  cl::desc("read every branch decoded from an instruction trace, such as "
+           "Intel PT, and aggregate them in windows of the given number of "
+           "consecutive branches, for exact path profiles that include the "
+           "rarely executed paths missed by sampling (0 disables)"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned>
+ITraceWindowPeriod("itrace-window-period",
+  cl::desc("with -itrace-window, aggregate one window out of the given number "
+           "of consecutive windows to bound the processing time"),
+  cl::init(1),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<bool>
+CrossDSOProfile("cross-dso-profile",
+  cl::desc("attribute branches to and from other DSOs mapped by the profiled "
+           "processes, e.g. calls from an executable into a shared library, "
+           "and report the branch counts between DSOs"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<std::string>
+MemEventName("mem-event",
+  cl::desc("name of the perf events sampling data addresses of memory "
+           "accesses, e.g. 'memory' or 'l1d-miss' for Arm SPE"),
+  cl::init("mem-loads"),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<std::string>
+MergeWith("merge-with",
+  cl::desc("add counts from an existing profile written by perf2bolt for the "
+           "same binary to the output profile"),
+  cl::value_desc("fdata"),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<double>
+MergeDecay("merge-decay",
+  cl::desc("factor applied to counts of the profile merged with -merge-with "
+           "(1.0 keeps them unchanged)"),
+  cl::init(1.0),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<bool>
+DedupLBRStacks("dedup-lbr-stacks",
+  cl::desc("count identical LBR stacks of consecutive samples and aggregate "
+           "every distinct stack once, which is faster for profiles "
+           "dominated by hot loops"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned>
+LBRStackCacheSize("lbr-stack-cache-size",
+  cl::desc("maximum number of distinct LBR stacks counted with "
+           "-dedup-lbr-stacks before they are aggregated"),
+  cl::init(1 << 16),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned long long>
+ParallelAggregationThreshold("parallel-aggregation-threshold",
+  cl::desc("minimum size in bytes of perf script output for parsing branch "
+           "events on multiple threads (0 disables parallel parsing)"),
+  cl::init(16ULL << 20),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(AggregatorCategory));
+
 static cl::opt<bool>
 ReadPreAggregated("pa",
   cl::desc("skip perf and read data from a pre-aggregated file format"),
@@ -123,6 +303,39 @@ ReadPreAggregated("pa",
   cl::ZeroOrMore,
   cl::cat(AggregatorCategory));
 
+static cl::opt<bool>
+WriteFdataIndex("write-fdata-index",
+  cl::desc("write an index of the output profile to <output>.idx, so that "
+           "llvm-bolt parses branch data only for functions it processes"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<std::string>
+WritePreAggregated("write-pre-aggregated",
+  cl::desc("write aggregated branch events to a file in the binary "
+           "pre-aggregated format"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<bool>
+StreamAggregation("stream-aggr",
+  cl::desc("read perf script branch events through a pipe and aggregate them "
+           "incrementally instead of buffering the whole output"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
+
+static cl::opt<unsigned>
+StreamBlockSize("stream-aggr-block-size",
+  cl::desc("size in megabytes of the buffer used to read streamed perf "
+           "script output"),
+  cl::init(64),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(AggregatorCategory));
+
 static cl::opt<bool>
 TimeAggregator("time-aggr",
   cl::desc("time BOLT aggregator"),
@@ -157,6 +370,7 @@ constexpr uint64_t DataAggregator::KernelBaseAddr;
 
 DataAggregator::~DataAggregator() {
   deleteTempFiles();
+  deleteSpills();
 }
 
 namespace {
@@ -169,12 +383,36 @@ void deleteTempFile(const std::string &FileName) {
 }
 
 void DataAggregator::deleteTempFiles() {
+  if (MainEventsPPI.StdoutFD != -1) {
+    ::close(MainEventsPPI.StdoutFD);
+    MainEventsPPI.StdoutFD = -1;
+  }
   for (auto &FileName : TempFiles) {
     deleteTempFile(FileName);
   }
   TempFiles.clear();
 }
 
+bool DataAggregator::SharePerfOutputs = false;
+StringMap<DataAggregator::PerfProcessInfo> DataAggregator::SharedPerfOutputs;
+
+void DataAggregator::deleteSharedPerfOutputs() {
+  for (auto &Entry : SharedPerfOutputs) {
+    deleteTempFile(Entry.getValue().StdoutPath.data());
+    deleteTempFile(Entry.getValue().StderrPath.data());
+  }
+  SharedPerfOutputs.clear();
+}
+
+void DataAggregator::deleteSpills() {
+  for (auto &FileName : BranchSpills)
+    deleteTempFile(FileName);
+  for (auto &FileName : FallthroughSpills)
+    deleteTempFile(FileName);
+  BranchSpills.clear();
+  FallthroughSpills.clear();
+}
+
 void DataAggregator::findPerfExecutable() {
   auto PerfExecutable = sys::Process::FindInEnvPath("PATH", "perf");
   if (!PerfExecutable) {
@@ -192,18 +430,55 @@ void DataAggregator::start() {
   if (opts::ReadPreAggregated)
     return;
 
+  // perf.data will be read directly, without spawning perf jobs
+  if (opts::NativePerfReader) {
+    if (!opts::ITraceAggregation.empty() || opts::ITraceWindow) {
+      errs() << "PERF2BOLT-ERROR: -itrace and -itrace-window are not "
+                "supported with -native-perf-reader\n";
+      exit(1);
+    }
+    return;
+  }
+
   findPerfExecutable();
 
+  if (opts::ITraceWindow && !opts::ITraceAggregation.empty()) {
+    errs() << "PERF2BOLT-ERROR: -itrace cannot be used with -itrace-window\n";
+    exit(1);
+  }
+
   if (opts::BasicAggregation) {
     launchPerfProcess("events without LBR",
                       MainEventsPPI,
                       "script -F pid,event,ip",
                       /*Wait = */false);
+  } else if (opts::ITraceWindow) {
+    // Every branch of the trace is printed on its own line and grouped into
+    // windows while parsing.
+    launchPerfProcess("branches from instruction trace",
+                      MainEventsPPI,
+                      "script -F pid,ip,addr --itrace=b",
+                      /*Wait = */false,
+                      /*Stream = */opts::StreamAggregation &&
+                                   !opts::HeatmapMode);
+  } else if (!opts::ITraceAggregation.empty()) {
+    // Branch stacks synthesized by perf from the trace have the same format
+    // as the sampled ones.
+    const std::string Args =
+        "script -F pid,ip,brstack --itrace=" + opts::ITraceAggregation;
+    launchPerfProcess("branch events from instruction trace",
+                      MainEventsPPI,
+                      Args.c_str(),
+                      /*Wait = */false,
+                      /*Stream = */opts::StreamAggregation &&
+                                   !opts::HeatmapMode);
   } else {
     launchPerfProcess("branch events",
                       MainEventsPPI,
                       "script -F pid,ip,brstack",
-                      /*Wait = */false);
+                      /*Wait = */false,
+                      /*Stream = */opts::StreamAggregation &&
+                                   !opts::HeatmapMode);
   }
 
   // Note: we launch script for mem events regardless of the option, as the
@@ -228,6 +503,9 @@ void DataAggregator::abort() {
   if (opts::ReadPreAggregated)
     return;
 
+  if (opts::NativePerfReader)
+    exit(1);
+
   std::string Error;
 
   // Kill subprocesses in case they are not finished
@@ -242,7 +520,20 @@ void DataAggregator::abort() {
 }
 
 void DataAggregator::launchPerfProcess(StringRef Name, PerfProcessInfo &PPI,
-                                       const char *ArgsString, bool Wait) {
+                                       const char *ArgsString, bool Wait,
+                                       bool Stream) {
+  if (SharePerfOutputs && !Stream) {
+    auto Iter = SharedPerfOutputs.find(ArgsString);
+    if (Iter != SharedPerfOutputs.end()) {
+      outs() << "PERF2BOLT: reusing output of perf " << Name << "\n";
+      PPI = Iter->second;
+      return;
+    }
+  }
+  // Streamed output could not be read again.
+  if (!Stream)
+    PPI.Args = ArgsString;
+
   SmallVector<const char*, 4> Argv;
 
   outs() << "PERF2BOLT: spawning perf job to read " << Name << '\n';
@@ -264,14 +555,35 @@ void DataAggregator::launchPerfProcess(StringRef Name, PerfProcessInfo &PPI,
   Argv.push_back(Filename.c_str());
   Argv.push_back(nullptr);
 
-  if (auto Errc = sys::fs::createTemporaryFile("perf.script", "out",
-                                               PPI.StdoutPath)) {
+  if (Stream) {
+    // Connect perf stdout to a named pipe. The read end is opened without
+    // blocking before perf is spawned, so that perf can open the write end.
+    sys::fs::createUniquePath("perf.script-%%%%%%.fifo", PPI.StdoutPath,
+                              /*MakeAbsolute=*/true);
+    // Make sure the path is NUL-terminated.
+    PPI.StdoutPath.push_back(0);
+    PPI.StdoutPath.pop_back();
+    if (::mkfifo(PPI.StdoutPath.data(), 0600) == -1) {
+      errs() << "PERF2BOLT: failed to create pipe " << PPI.StdoutPath.data()
+             << " with error " << strerror(errno) << "\n";
+      exit(1);
+    }
+    TempFiles.push_back(PPI.StdoutPath.data());
+    PPI.StdoutFD = ::open(PPI.StdoutPath.data(), O_RDONLY | O_NONBLOCK);
+    if (PPI.StdoutFD == -1) {
+      errs() << "PERF2BOLT: failed to open pipe " << PPI.StdoutPath.data()
+             << " with error " << strerror(errno) << "\n";
+      exit(1);
+    }
+  } else if (auto Errc = sys::fs::createTemporaryFile("perf.script", "out",
+                                                      PPI.StdoutPath)) {
     errs() << "PERF2BOLT: failed to create temporary file "
            << PPI.StdoutPath << " with error " << Errc.message()
            << "\n";
     exit(1);
+  } else {
+    TempFiles.push_back(PPI.StdoutPath.data());
   }
-  TempFiles.push_back(PPI.StdoutPath.data());
 
   if (auto Errc = sys::fs::createTemporaryFile("perf.script", "err",
                                                PPI.StderrPath)) {
@@ -304,10 +616,44 @@ void DataAggregator::launchPerfProcess(StringRef Name, PerfProcessInfo &PPI,
                                 Redirects);
   }
 
+  // Reopen the pipe for blocking reads. The open returns once perf holds
+  // the write end, so that an early read does not see a spurious EOF.
+  if (PPI.StdoutFD != -1) {
+    const int NonBlockingFD = PPI.StdoutFD;
+    PPI.StdoutFD = -1;
+    if (Wait || PPI.PI.Pid != 0)
+      PPI.StdoutFD = ::open(PPI.StdoutPath.data(), O_RDONLY);
+    ::close(NonBlockingFD);
+    if (PPI.StdoutFD == -1) {
+      errs() << "PERF2BOLT: failed to read perf output from pipe "
+             << PPI.StdoutPath.data() << "\n";
+      exit(1);
+    }
+  }
+
   free(WritableArgsString);
 }
 
 void DataAggregator::processFileBuildID(StringRef FileBuildID) {
+  if (PerfReader) {
+    const auto &BuildIDs = PerfReader->getBuildIDs();
+    if (BuildIDs.empty()) {
+      errs() << "PERF2BOLT-WARNING: build-id will not be checked because perf "
+                "data was recorded without it\n";
+      return;
+    }
+
+    Optional<StringRef> FileName;
+    for (const auto &NameBuildID : BuildIDs) {
+      if (StringRef(NameBuildID.second).startswith(FileBuildID)) {
+        FileName = sys::path::filename(NameBuildID.first);
+        break;
+      }
+    }
+    checkBuildIDFileName(FileName);
+    return;
+  }
+
   PerfProcessInfo BuildIDProcessInfo;
   launchPerfProcess("buildid list",
                     BuildIDProcessInfo,
@@ -343,7 +689,10 @@ void DataAggregator::processFileBuildID(StringRef FileBuildID) {
 
   Col = 0;
   Line = 1;
-  auto FileName = getFileNameForBuildID(FileBuildID);
+  checkBuildIDFileName(getFileNameForBuildID(FileBuildID));
+}
+
+void DataAggregator::checkBuildIDFileName(Optional<StringRef> FileName) {
   if (!FileName) {
     errs() << "PERF2BOLT-ERROR: failed to match build-id from perf output. "
               "This indicates the input binary supplied for data aggregation "
@@ -359,8 +708,6 @@ void DataAggregator::processFileBuildID(StringRef FileBuildID) {
   } else {
     outs() << "PERF2BOLT: matched build-id and file name\n";
   }
-
-  return;
 }
 
 bool DataAggregator::checkPerfDataMagic(StringRef FileName) {
@@ -385,6 +732,15 @@ bool DataAggregator::checkPerfDataMagic(StringRef FileName) {
   return false;
 }
 
+namespace {
+
+/// Magic and layout of the binary pre-aggregated format.
+const char BinaryPreAggregatedMagic[] = "BOLTPAGG";
+const uint32_t BinaryPreAggregatedVersion = 1;
+const uint64_t BinaryPreAggregatedHeaderSize = 56;
+
+}
+
 void DataAggregator::parsePreAggregated() {
   std::string Error;
 
@@ -396,6 +752,14 @@ void DataAggregator::parsePreAggregated() {
   }
 
   FileBuf.reset(MB->release());
+  if (FileBuf->getBuffer().startswith(BinaryPreAggregatedMagic)) {
+    if (parseBinaryPreAggregatedLBRSamples(FileBuf->getBuffer())) {
+      errs() << "PERF2BOLT: failed to parse samples\n";
+      exit(1);
+    }
+    return;
+  }
+
   ParsingBuf = FileBuf->getBuffer();
   Col = 0;
   Line = 1;
@@ -501,6 +865,49 @@ void DataAggregator::filterBinaryMMapInfo() {
   }
 }
 
+void DataAggregator::waitForPerfProcess(StringRef Name,
+                                        PerfProcessInfo &Process) {
+  if (Process.IsFinished)
+    return;
+
+  std::string Error;
+  outs() << "PERF2BOLT: waiting for perf " << Name
+         << " collection to finish...\n";
+  auto PI = sys::Wait(Process.PI, 0, true, &Error);
+
+  if (!Error.empty()) {
+    errs() << "PERF-ERROR: " << PerfPath << ": " << Error << "\n";
+    deleteTempFiles();
+    exit(1);
+  }
+
+  if (PI.ReturnCode != 0) {
+    ErrorOr<std::unique_ptr<MemoryBuffer>> ErrorMB =
+      MemoryBuffer::getFileOrSTDIN(Process.StderrPath.data());
+    StringRef ErrBuf = (*ErrorMB)->getBuffer();
+
+    errs() << "PERF-ERROR: return code " << PI.ReturnCode << "\n";
+    errs() << ErrBuf;
+    deleteTempFiles();
+    exit(1);
+  }
+  Process.IsFinished = true;
+
+  // Transfer the ownership of the output files to the shared list.
+  if (SharePerfOutputs && !Process.Args.empty() &&
+      !SharedPerfOutputs.count(Process.Args)) {
+    SharedPerfOutputs[Process.Args] = Process;
+    TempFiles.erase(std::remove_if(TempFiles.begin(), TempFiles.end(),
+                                   [&](const std::string &FileName) {
+                                     return FileName ==
+                                                Process.StdoutPath.data() ||
+                                            FileName ==
+                                                Process.StderrPath.data();
+                                   }),
+                    TempFiles.end());
+  }
+}
+
 Error DataAggregator::preprocessProfile(BinaryContext &BC) {
   this->BC = &BC;
 
@@ -509,6 +916,17 @@ Error DataAggregator::preprocessProfile(BinaryContext &BC) {
     return Error::success();
   }
 
+  if (opts::NativePerfReader) {
+    outs() << "PERF2BOLT: reading perf.data directly\n";
+    auto ReaderOrErr = PerfDataReader::create(Filename);
+    if (std::error_code EC = ReaderOrErr.getError()) {
+      errs() << "PERF2BOLT-ERROR: cannot read " << Filename << ": "
+             << EC.message() << "\n";
+      exit(1);
+    }
+    PerfReader = std::move(*ReaderOrErr);
+  }
+
   if (auto FileBuildID = BC.getFileBuildID()) {
     outs() << "BOLT-INFO: binary build-id is:     " << *FileBuildID << "\n";
     processFileBuildID(*FileBuildID);
@@ -518,27 +936,15 @@ Error DataAggregator::preprocessProfile(BinaryContext &BC) {
   }
 
   auto prepareToParse = [&] (StringRef Name, PerfProcessInfo &Process) {
-    std::string Error;
-    outs() << "PERF2BOLT: waiting for perf " << Name
-           << " collection to finish...\n";
-    auto PI = sys::Wait(Process.PI, 0, true, &Error);
-
-    if (!Error.empty()) {
-      errs() << "PERF-ERROR: " << PerfPath << ": " << Error << "\n";
-      deleteTempFiles();
-      exit(1);
-    }
+    // Events are read from perf.data on demand.
+    if (PerfReader)
+      return;
 
-    if (PI.ReturnCode != 0) {
-      ErrorOr<std::unique_ptr<MemoryBuffer>> ErrorMB =
-        MemoryBuffer::getFileOrSTDIN(Process.StderrPath.data());
-      StringRef ErrBuf = (*ErrorMB)->getBuffer();
+    // Streamed output is consumed while perf is still running.
+    if (Process.StdoutFD != -1)
+      return;
 
-      errs() << "PERF-ERROR: return code " << PI.ReturnCode << "\n";
-      errs() << ErrBuf;
-      deleteTempFiles();
-      exit(1);
-    }
+    waitForPerfProcess(Name, Process);
 
     ErrorOr<std::unique_ptr<MemoryBuffer>> MB =
       MemoryBuffer::getFileOrSTDIN(Process.StdoutPath.data());
@@ -598,8 +1004,18 @@ Error DataAggregator::preprocessProfile(BinaryContext &BC) {
     errs() << "PERF2BOLT: failed to parse samples\n";
   }
 
+  if (opts::CheckProfile) {
+    if (std::error_code EC = reloadSpills())
+      report_error("cannot read spilled traces", EC);
+    const bool Passed = checkProfile();
+    deleteTempFiles();
+    exit(Passed ? 0 : 1);
+  }
+
   // We can finish early if the goal is just to generate data for autofdo
   if (opts::WriteAutoFDOData) {
+    if (std::error_code EC = reloadSpills())
+      report_error("cannot read spilled traces", EC);
     if (std::error_code EC = writeAutoFDOData(opts::OutputFilename)) {
       errs() << "Error writing autofdo data to file: " << EC.message() << "\n";
     }
@@ -607,6 +1023,14 @@ Error DataAggregator::preprocessProfile(BinaryContext &BC) {
     exit(0);
   }
 
+  if (PerfReader) {
+    if (const auto EC = parseMemEvents()) {
+      errs() << "PERF2BOLT: failed to parse memory events: "
+             << EC.message() << '\n';
+    }
+    return Error::success();
+  }
+
   // Special handling for memory events
   std::string Error;
   auto PI = sys::Wait(MemEventsPPI.PI, 0, true, &Error);
@@ -658,7 +1082,23 @@ Error DataAggregator::readProfile(BinaryContext &BC) {
     convertBranchData(Function);
   }
 
+  if (opts::ContextProfile) {
+    if (opts::AggregateOnly)
+      errs() << "PERF2BOLT-WARNING: context-sensitive profile is not saved "
+                "in aggregated profiles\n";
+    else
+      attachContextProfiles(BC);
+    clear(ContextTraces);
+  }
+
   if (opts::AggregateOnly) {
+    if (!opts::MergeWith.empty()) {
+      if (opts::MergeDecay < 0.0 || opts::MergeDecay > 1.0)
+        report_error("-merge-decay must be in [0, 1]",
+                     make_error_code(llvm::errc::invalid_argument));
+      if (auto EC = mergeAggregatedFile(opts::MergeWith, opts::MergeDecay))
+        report_error(opts::MergeWith, EC);
+    }
     if (auto EC = writeAggregatedFile(opts::OutputFilename)) {
       report_error("cannot create output data file", EC);
     }
@@ -667,6 +1107,111 @@ Error DataAggregator::readProfile(BinaryContext &BC) {
   return Error::success();
 }
 
+void DataAggregator::recordCollectionStats() {
+  auto &Collection = BC->ProfileCollection;
+  if (!Collection.IsAvailable)
+    return;
+  Collection.NumIgnoredMMaps = NumIgnoredMMaps;
+  Collection.NumKernelLBREntries = NumKernelLBREntries;
+  Collection.NumInvalidTraces = NumInvalidTraces;
+  Collection.NumLongRangeTraces = NumLongRangeTraces;
+  Collection.NumColdSamples = NumColdSamples;
+  if (!opts::PrintProfileStats)
+    return;
+  for (const auto &Sample : BasicSamples)
+    if (auto *BF = getBinaryFunctionContainingAddress(Sample.first))
+      Collection.PCSamples[BF] += Sample.second;
+}
+
+bool DataAggregator::checkProfile() const {
+  // Only the functions from the symbol table are known at this point, their
+  // sizes come from the symbols.
+  std::unordered_map<const BinaryFunction *, uint64_t> FunctionSamples;
+  uint64_t NumSamples = 0;
+  uint64_t NumInFunctions = 0;
+  uint64_t NumInBinary = 0;
+  for (const auto &Sample : BasicSamples) {
+    NumSamples += Sample.second;
+    if (!BC->containsAddress(Sample.first))
+      continue;
+    NumInBinary += Sample.second;
+    if (auto *BF = getBinaryFunctionContainingAddress(Sample.first)) {
+      FunctionSamples[BF] += Sample.second;
+      NumInFunctions += Sample.second;
+    }
+  }
+
+  // Taken branches are attributed to the function they originate from.
+  uint64_t NumBranches = 0;
+  uint64_t NumBranchesInFunctions = 0;
+  for (const auto &Entry : BranchLBRs) {
+    NumBranches += Entry.second.TakenCount;
+    if (getBinaryFunctionContainingAddress(Entry.first.From) ||
+        getBinaryFunctionContainingAddress(Entry.first.To))
+      NumBranchesInFunctions += Entry.second.TakenCount;
+  }
+
+  auto percent = [](uint64_t Part, uint64_t Total) {
+    return Total ? 100.0 * Part / Total : 0.0;
+  };
+  outs() << "PERF2BOLT: profile check: " << NumSamples << " samples, "
+         << format("%.2lf%% in functions, %.2lf%% in the binary outside of "
+                   "functions, %.2lf%% outside of the binary\n",
+                   percent(NumInFunctions, NumSamples),
+                   percent(NumInBinary - NumInFunctions, NumSamples),
+                   percent(NumSamples - NumInBinary, NumSamples));
+  if (NumBranches)
+    outs() << "PERF2BOLT: profile check: " << NumBranches
+           << " taken branches, "
+           << format("%.2lf%%", percent(NumBranchesInFunctions, NumBranches))
+           << " in functions\n";
+  outs() << "PERF2BOLT: profile check: " << FunctionSamples.size() << " out of "
+         << BC->getBinaryFunctions().size() << " functions have samples\n";
+
+  std::vector<std::pair<uint64_t, const BinaryFunction *>> Hottest;
+  for (const auto &Entry : FunctionSamples)
+    Hottest.emplace_back(Entry.second, Entry.first);
+  std::sort(Hottest.begin(), Hottest.end(),
+            [](const std::pair<uint64_t, const BinaryFunction *> &A,
+               const std::pair<uint64_t, const BinaryFunction *> &B) {
+              if (A.first != B.first)
+                return A.first > B.first;
+              return A.second->getAddress() < B.second->getAddress();
+            });
+  const size_t NumHottest = opts::Verbosity >= 1
+                                ? Hottest.size()
+                                : std::min<size_t>(Hottest.size(), 10);
+  for (size_t I = 0; I < NumHottest; ++I)
+    outs() << format("  %6.2lf%%  ", percent(Hottest[I].first, NumSamples))
+           << Hottest[I].second->getPrintName() << " (" << Hottest[I].first
+           << " samples)\n";
+
+  std::map<uint64_t, const MMapInfo *> MMaps;
+  for (const auto &Entry : BinaryMMapInfo)
+    MMaps[Entry.first] = &Entry.second;
+  outs() << "PERF2BOLT: profile check: " << MMaps.size()
+         << " mappings of the binary\n";
+  for (const auto &Entry : MMaps) {
+    const auto &MMap = *Entry.second;
+    auto SI = SamplesPerPID.find(Entry.first);
+    const uint64_t Samples = SI == SamplesPerPID.end() ? 0 : SI->second;
+    outs() << "  PID " << Entry.first << ": 0x"
+           << Twine::utohexstr(MMap.BaseAddress) << " size 0x"
+           << Twine::utohexstr(MMap.Size) << " offset 0x"
+           << Twine::utohexstr(MMap.Offset) << (MMap.Forked ? " (forked)" : "")
+           << ", " << Samples << " samples\n";
+  }
+
+  if (percent(NumInFunctions, NumSamples) < opts::CheckProfileMinCoverage) {
+    errs() << "PERF2BOLT-ERROR: "
+           << format("%.2lf%%", percent(NumInFunctions, NumSamples))
+           << " of samples are in functions, expected at least "
+           << format("%.2lf%%", (double)opts::CheckProfileMinCoverage) << '\n';
+    return false;
+  }
+  return true;
+}
+
 bool DataAggregator::mayHaveProfileData(const BinaryFunction &Function) {
   return Function.hasProfileAvailable();
 }
@@ -681,6 +1226,8 @@ void DataAggregator::processProfile(BinaryContext &BC) {
 
   processMemEvents();
 
+  recordCollectionStats();
+
   // Mark all functions with registered events as having a valid profile.
   for (auto &BFI : BC.getBinaryFunctions()) {
     auto &BF = BFI.second;
@@ -790,6 +1337,12 @@ bool DataAggregator::doInterBranch(BinaryFunction *FromFunc,
   FuncBranchData *ToAggrData{nullptr};
   StringRef SrcFunc;
   StringRef DstFunc;
+  StringRef SrcDSO;
+  StringRef DstDSO;
+  if (!FromFunc)
+    SrcDSO = decodeForeignAddress(From);
+  if (!ToFunc)
+    DstDSO = decodeForeignAddress(To);
   if (FromFunc) {
     SrcFunc = getLocationName(*FromFunc, Count);
     FromAggrData = getBranchData(*FromFunc);
@@ -819,12 +1372,56 @@ bool DataAggregator::doInterBranch(BinaryFunction *FromFunc,
     recordEntry(*ToFunc, To, Mispreds, Count);
   }
 
+  if (!SrcDSO.empty() && !DstFunc.empty())
+    CrossDSOBranches[std::make_pair(SrcDSO, DstFunc)] += Count;
+  if (!DstDSO.empty() && !SrcFunc.empty())
+    CrossDSOBranches[std::make_pair(SrcFunc, DstDSO)] += Count;
+
+  // Locations in other DSOs are recorded as non-symbol locations named after
+  // the DSO.
   if (FromAggrData)
-    FromAggrData->bumpCallCount(From, Location(!DstFunc.empty(), DstFunc, To),
-                                Count, Mispreds);
+    FromAggrData->bumpCallCount(
+        From,
+        Location(!DstFunc.empty(), DstFunc.empty() ? DstDSO : DstFunc, To),
+        Count, Mispreds);
   if (ToAggrData)
-    ToAggrData->bumpEntryCount(Location(!SrcFunc.empty(), SrcFunc, From), To,
-                               Count, Mispreds);
+    ToAggrData->bumpEntryCount(
+        Location(!SrcFunc.empty(), SrcFunc.empty() ? SrcDSO : SrcFunc, From),
+        To, Count, Mispreds);
+  return true;
+}
+
+BinaryFunction &DataAggregator::getBATParentFunction(BinaryFunction &Func) {
+  if (!BAT)
+    return Func;
+  if (const auto HotAddr = BAT->fetchParentAddress(Func.getAddress()))
+    if (auto *HotFunc = getBinaryFunctionContainingAddress(HotAddr))
+      return *HotFunc;
+  return Func;
+}
+
+bool DataAggregator::doInterFragmentBranch(BinaryFunction &FromFunc,
+                                           BinaryFunction &ToFunc,
+                                           uint64_t From, uint64_t To,
+                                           uint64_t Count, uint64_t Mispreds) {
+  // The data of both fragments is written under the name of the function in
+  // the input binary, and BAT translates the offsets in both fragments to
+  // offsets in that function.
+  FuncBranchData *AggrData = getBranchData(FromFunc);
+  if (!AggrData) {
+    AggrData = &NamesToBranches[FromFunc.getOneName()];
+    AggrData->Name = getLocationName(FromFunc, Count);
+    setBranchData(FromFunc, AggrData);
+  }
+  From = BAT->translate(FromFunc, From - FromFunc.getAddress(),
+                        /*IsBranchSrc=*/true);
+  To = BAT->translate(ToFunc, To - ToFunc.getAddress(), /*IsBranchSrc=*/false);
+  DEBUG(dbgs() << "BOLT-DEBUG: branch between fragments of "
+               << AggrData->Name << " @ " << Twine::utohexstr(From) << " -> "
+               << Twine::utohexstr(To) << '\n');
+
+  AggrData->bumpBranchCount(From, To, Count, Mispreds);
+  NumInterFragmentBranches += Count;
   return true;
 }
 
@@ -841,6 +1438,14 @@ bool DataAggregator::doBranch(uint64_t From, uint64_t To, uint64_t Count,
     return doIntraBranch(*FromFunc, From, To, Count, Mispreds);
   }
 
+  // Splitting turned branches within a function of the input binary into
+  // jumps between its fragments. Recording them as calls would also count
+  // them as exits and entries of the function.
+  if (BAT && FromFunc && ToFunc &&
+      &getBATParentFunction(*FromFunc) == &getBATParentFunction(*ToFunc))
+    return doInterFragmentBranch(*FromFunc, *ToFunc, From, To, Count,
+                                 Mispreds);
+
   return doInterBranch(FromFunc, ToFunc, From, To, Count, Mispreds);
 }
 
@@ -966,7 +1571,8 @@ bool DataAggregator::recordTrace(
       const auto *Instr = BB->getLastNonPseudoInstr();
       uint64_t Offset{0};
       if (Instr) {
-        Offset = BC.MIB->getAnnotationWithDefault<uint32_t>(*Instr, "Offset");
+        Offset =
+            BC.MIB->getAnnotationWithDefault(*Instr, MCPlus::OffsetAnnotation);
       } else {
         Offset = BB->getOffset();
       }
@@ -1101,6 +1707,9 @@ void DataAggregator::consumeRestOfLine() {
 }
 
 ErrorOr<DataAggregator::PerfBranchSample> DataAggregator::parseBranchSample() {
+  if (opts::ITraceWindow)
+    return parseITraceWindow();
+
   PerfBranchSample Res;
 
   while (checkAndConsumeFS()) {}
@@ -1113,6 +1722,8 @@ ErrorOr<DataAggregator::PerfBranchSample> DataAggregator::parseBranchSample() {
     consumeRestOfLine();
     return make_error_code(errc::no_such_process);
   }
+  if (opts::CheckProfile)
+    ++SamplesPerPID[*PIDRes];
 
   while (checkAndConsumeFS()) {}
 
@@ -1131,8 +1742,10 @@ ErrorOr<DataAggregator::PerfBranchSample> DataAggregator::parseBranchSample() {
     if (std::error_code EC = LBRRes.getError())
       return EC;
     auto LBR = LBRRes.get();
-    if (ignoreKernelInterrupt(LBR))
+    if (ignoreKernelInterrupt(LBR)) {
+      ++NumKernelLBREntries;
       continue;
+    }
     if (!BC->HasFixedLoadAddress)
       adjustLBR(LBR, MMapInfoIter->second);
     Res.LBR.push_back(LBR);
@@ -1141,22 +1754,108 @@ ErrorOr<DataAggregator::PerfBranchSample> DataAggregator::parseBranchSample() {
   return Res;
 }
 
-ErrorOr<DataAggregator::PerfBasicSample> DataAggregator::parseBasicSample() {
-  while (checkAndConsumeFS()) {}
+ErrorOr<DataAggregator::PerfBranchSample> DataAggregator::parseITraceWindow() {
+  PerfBranchSample Res;
+  Res.PC = 0;
+
+  // Read consecutive branches of the same process, stopping at a gap in the
+  // trace. Lines are in the format "<pid> <from> => <to>".
+  int64_t PID = -1;
+  decltype(BinaryMMapInfo)::iterator MMapInfoIter;
+  SmallVector<LBREntry, 32> Branches;
+  while (hasData() && Branches.size() < opts::ITraceWindow) {
+    const auto SavedBuf = ParsingBuf;
+    const auto SavedCol = Col;
+    const auto SavedLine = Line;
 
-  auto PIDRes = parseNumberField(FieldSeparator, true);
-  if (std::error_code EC = PIDRes.getError())
-    return EC;
+    while (checkAndConsumeFS()) {}
 
-  auto MMapInfoIter = BinaryMMapInfo.find(*PIDRes);
-  if (MMapInfoIter == BinaryMMapInfo.end()) {
-    consumeRestOfLine();
-    return PerfBasicSample{StringRef(), 0};
-  }
+    auto PIDRes = parseNumberField(FieldSeparator, true);
+    if (std::error_code EC = PIDRes.getError())
+      return EC;
+    if (!Branches.empty() && *PIDRes != PID) {
+      ParsingBuf = SavedBuf;
+      Col = SavedCol;
+      Line = SavedLine;
+      break;
+    }
+    MMapInfoIter = BinaryMMapInfo.find(*PIDRes);
+    if (!opts::LinuxKernelMode && MMapInfoIter == BinaryMMapInfo.end()) {
+      consumeRestOfLine();
+      continue;
+    }
+    if (opts::CheckProfile && Branches.empty())
+      ++SamplesPerPID[*PIDRes];
+    PID = *PIDRes;
 
-  while (checkAndConsumeFS()) {}
+    while (checkAndConsumeFS()) {}
 
-  auto Event = parseString(FieldSeparator);
+    auto FromRes = parseHexField(FieldSeparator, true);
+    if (std::error_code EC = FromRes.getError())
+      return EC;
+
+    while (checkAndConsumeFS()) {}
+    if (ParsingBuf.startswith("=>")) {
+      ParsingBuf = ParsingBuf.drop_front(2);
+      Col += 2;
+      while (checkAndConsumeFS()) {}
+    }
+
+    auto ToRes = parseHexField(FieldSeparator, true);
+    if (std::error_code EC = ToRes.getError())
+      return EC;
+    if (!checkAndConsumeNewLine())
+      consumeRestOfLine();
+
+    LBREntry LBR{*FromRes, *ToRes, false};
+    if (!LBR.From || !LBR.To) {
+      if (!Branches.empty())
+        break;
+      continue;
+    }
+    if (ignoreKernelInterrupt(LBR)) {
+      ++NumKernelLBREntries;
+      continue;
+    }
+    if (!BC->HasFixedLoadAddress)
+      adjustLBR(LBR, MMapInfoIter->second);
+    Branches.push_back(LBR);
+  }
+
+  // Branch stacks are in reverse execution order.
+  Res.LBR.append(Branches.rbegin(), Branches.rend());
+
+  // Skip the windows that are not sampled.
+  const uint64_t NumSkipped =
+      uint64_t(opts::ITraceWindowPeriod ? opts::ITraceWindowPeriod - 1 : 0) *
+      opts::ITraceWindow;
+  for (uint64_t I = 0; I < NumSkipped && hasData(); ++I)
+    consumeRestOfLine();
+
+  if (Res.LBR.empty())
+    return make_error_code(errc::no_such_process);
+
+  return Res;
+}
+
+ErrorOr<DataAggregator::PerfBasicSample> DataAggregator::parseBasicSample() {
+  while (checkAndConsumeFS()) {}
+
+  auto PIDRes = parseNumberField(FieldSeparator, true);
+  if (std::error_code EC = PIDRes.getError())
+    return EC;
+
+  auto MMapInfoIter = BinaryMMapInfo.find(*PIDRes);
+  if (MMapInfoIter == BinaryMMapInfo.end()) {
+    consumeRestOfLine();
+    return PerfBasicSample{StringRef(), 0};
+  }
+  if (opts::CheckProfile)
+    ++SamplesPerPID[*PIDRes];
+
+  while (checkAndConsumeFS()) {}
+
+  auto Event = parseString(FieldSeparator);
   if (std::error_code EC = Event.getError())
     return EC;
 
@@ -1199,7 +1898,7 @@ ErrorOr<DataAggregator::PerfMemSample> DataAggregator::parseMemSample() {
   auto Event = parseString(FieldSeparator);
   if (std::error_code EC = Event.getError())
     return EC;
-  if (Event.get().find("mem-loads") == StringRef::npos) {
+  if (Event.get().find(opts::MemEventName) == StringRef::npos) {
     consumeRestOfLine();
     return Res;
   }
@@ -1321,6 +2020,114 @@ bool DataAggregator::ignoreKernelInterrupt(LBREntry &LBR) const {
          (LBR.From >= KernelBaseAddr || LBR.To >= KernelBaseAddr);
 }
 
+namespace {
+/// Write the heat maps at every zoom level, the main one first, and the
+/// outputs derived from the main one.
+void printHeatMaps(const std::vector<Heatmap> &HMs) {
+  const auto &HM = HMs.front();
+  for (size_t L = 0; L < HMs.size(); ++L) {
+    std::string FileName = opts::HeatmapFile;
+    if (L && FileName != "-")
+      FileName += "-" + std::to_string(HMs[L].getBucketSize());
+    if (L)
+      outs() << "HEATMAP: writing heat map with " << HMs[L].getBucketSize()
+             << "-byte blocks to " << FileName << '\n';
+    HMs[L].print(FileName);
+    if (FileName == "-") {
+      HMs[L].printCDF(FileName);
+    } else {
+      HMs[L].printCDF(FileName + ".csv");
+    }
+  }
+
+  // Page-level footprint of the hot code.
+  for (const uint64_t PageSize : {4096ULL, 2ULL * 1024 * 1024})
+    if (PageSize % HM.getBucketSize() == 0)
+      HM.printPageCoverage(outs(), PageSize, "HEATMAP: ");
+
+  if (!opts::HeatmapCountsFile.empty())
+    HM.printCounts(opts::HeatmapCountsFile);
+
+  if (!opts::HeatmapDiffFile.empty()) {
+    auto BaseOrErr = Heatmap::readCounts(opts::HeatmapDiffFile);
+    if (auto EC = BaseOrErr.getError()) {
+      errs() << "HEATMAP-ERROR: cannot read heat map counts from "
+             << opts::HeatmapDiffFile << ": " << EC.message() << '\n';
+      exit(1);
+    }
+    if (BaseOrErr->getBucketSize() != HM.getBucketSize()) {
+      errs() << "HEATMAP-ERROR: block size " << BaseOrErr->getBucketSize()
+             << " in " << opts::HeatmapDiffFile << " does not match "
+             << HM.getBucketSize() << '\n';
+      exit(1);
+    }
+    std::string FileName = opts::HeatmapFile;
+    if (FileName != "-")
+      FileName += "-diff";
+    outs() << "HEATMAP: writing difference with " << opts::HeatmapDiffFile
+           << " to " << FileName << '\n';
+    HM.printDiff(FileName, *BaseOrErr);
+
+    // Report the number of 4KB pages touched within each 2MB region, which
+    // approximates the number of iTLB entries needed to cover the region.
+    outs() << "HEATMAP: iTLB pages per 2MB region:\n";
+    HM.printPageDiff(outs(), *BaseOrErr, 4096, 2 * 1024 * 1024);
+  }
+}
+}
+
+bool DataAggregator::printSavedHeatMap() {
+  if (opts::HeatmapCountsInput.empty())
+    return false;
+
+  auto HMOrErr = Heatmap::readCounts(opts::HeatmapCountsInput);
+  if (auto EC = HMOrErr.getError()) {
+    errs() << "HEATMAP-ERROR: cannot read heat map counts from "
+           << opts::HeatmapCountsInput << ": " << EC.message() << '\n';
+    exit(1);
+  }
+  outs() << "HEATMAP: read " << HMOrErr->getTotalCount() << " samples in "
+         << HMOrErr->size() << " blocks of " << HMOrErr->getBucketSize()
+         << " bytes from " << opts::HeatmapCountsInput << '\n';
+  if (!opts::HeatmapZoomBlocks.empty())
+    errs() << "HEATMAP-WARNING: -zoom-block-sizes is ignored with "
+              "-from-counts\n";
+
+  std::vector<Heatmap> HMs;
+  HMs.emplace_back(std::move(*HMOrErr));
+  printHeatMaps(HMs);
+  return true;
+}
+
+void DataAggregator::forEachHeatMapRange(
+    uint64_t From, uint64_t To,
+    function_ref<void(uint64_t From, uint64_t To)> Callback) const {
+  if (!opts::HeatmapUseBAT || !BAT) {
+    Callback(From, To);
+    return;
+  }
+
+  // Functions that did not move keep their input addresses.
+  const auto *Func = getBinaryFunctionContainingAddress(From);
+  if (!Func || To >= Func->getAddress() + Func->getMaxSize()) {
+    Callback(From, To);
+    return;
+  }
+  auto HotAddress = BAT->fetchParentAddress(Func->getAddress());
+  if (!HotAddress)
+    HotAddress = Func->getAddress();
+  const auto InputAddress = BAT->getInputAddress(HotAddress);
+  if (!InputAddress) {
+    Callback(From, To);
+    return;
+  }
+
+  const auto Ranges = BAT->translateRange(*Func, From - Func->getAddress(),
+                                          To - Func->getAddress());
+  for (const auto &Range : Ranges)
+    Callback(InputAddress + Range.first, InputAddress + Range.second);
+}
+
 std::error_code DataAggregator::printLBRHeatMap() {
   outs() << "PERF2BOLT: parse branch events...\n";
   NamedRegionTimer T("parseBranch", "Parsing branch events", TimerGroupName,
@@ -1330,20 +2137,35 @@ std::error_code DataAggregator::printLBRHeatMap() {
     opts::HeatmapMaxAddress = 0xffffffffffffffff;
     opts::HeatmapMinAddress = KernelBaseAddr;
   }
-  Heatmap HM(opts::HeatmapBlock, opts::HeatmapMinAddress,
-             opts::HeatmapMaxAddress);
-  uint64_t NumTotalSamples{0};
-
-  while (hasData()) {
-    auto SampleRes = parseBranchSample();
-    if (auto EC = SampleRes.getError()) {
-      if (EC == errc::no_such_process)
-        continue;
-      return EC;
+  if (opts::HeatmapUseBAT) {
+    if (!BAT) {
+      errs() << "HEATMAP-ERROR: -use-bat requires a binary with an address "
+                "translation table\n";
+      exit(1);
     }
+    if (!BAT->hasInputAddresses()) {
+      errs() << "HEATMAP-ERROR: the address translation table does not "
+                "record input addresses of functions, process the binary "
+                "with a newer BOLT to use -use-bat\n";
+      exit(1);
+    }
+    outs() << "HEATMAP: translating samples to input addresses\n";
+  }
+  // The main heat map comes first, followed by heat maps for zoom levels.
+  std::vector<Heatmap> HMs;
+  HMs.emplace_back(opts::HeatmapBlock, opts::HeatmapMinAddress,
+                   opts::HeatmapMaxAddress);
+  for (const auto BlockSize : opts::HeatmapZoomBlocks) {
+    if (!BlockSize) {
+      errs() << "HEATMAP-ERROR: invalid zoom block size 0\n";
+      exit(1);
+    }
+    HMs.emplace_back(BlockSize, opts::HeatmapMinAddress,
+                     opts::HeatmapMaxAddress);
+  }
+  uint64_t NumTotalSamples{0};
 
-    auto &Sample = SampleRes.get();
-
+  auto registerSample = [&](const PerfBranchSample &Sample) {
     // LBRs are stored in reverse execution order. NextLBR refers to the next
     // executed branch record.
     const LBREntry *NextLBR{nullptr};
@@ -1357,10 +2179,39 @@ std::error_code DataAggregator::printLBRHeatMap() {
       NextLBR = &LBR;
     }
     if (!Sample.LBR.empty()) {
-      HM.registerAddress(Sample.LBR.front().To);
-      HM.registerAddress(Sample.LBR.back().From);
+      auto registerAddress = [&](uint64_t Address) {
+        forEachHeatMapRange(Address, Address, [&](uint64_t From, uint64_t) {
+          for (auto &HM : HMs)
+            HM.registerAddress(From);
+        });
+      };
+      registerAddress(Sample.LBR.front().To);
+      registerAddress(Sample.LBR.back().From);
     }
     NumTotalSamples += Sample.LBR.size();
+  };
+
+  if (PerfReader) {
+    PerfDataReader::RecordHandlers Handlers;
+    PerfBranchSample Sample;
+    Handlers.Sample = [&](const PerfDataReader::SampleEvent &Event) {
+      if (convertPerfDataSample(Event, Sample))
+        registerSample(Sample);
+      return true;
+    };
+    if (std::error_code EC = PerfReader->readRecords(Handlers))
+      return EC;
+  }
+
+  while (hasData()) {
+    auto SampleRes = parseBranchSample();
+    if (auto EC = SampleRes.getError()) {
+      if (EC == errc::no_such_process)
+        continue;
+      return EC;
+    }
+
+    registerSample(SampleRes.get());
   }
 
   if (!NumTotalSamples) {
@@ -1374,12 +2225,52 @@ std::error_code DataAggregator::printLBRHeatMap() {
 
   outs() << "HEATMAP: building heat map...\n";
 
-  for (const auto &LBR : FallthroughLBRs) {
-    const auto &Trace = LBR.first;
-    const auto &Info = LBR.second;
-    HM.registerAddressRange(Trace.From, Trace.To, Info.InternCount);
+  // Ranges are registered in parallel into one set of heat maps per chunk
+  // of traces. The sets are merged afterwards.
+  std::vector<std::pair<Trace, uint64_t>> Traces;
+  Traces.reserve(FallthroughLBRs.size());
+  for (const auto &LBR : FallthroughLBRs)
+    Traces.emplace_back(LBR.first, LBR.second.InternCount);
+  FallthroughLBRs.clear();
+
+  const size_t NumChunks =
+      std::max<size_t>(1, std::min<size_t>(opts::NoThreads ? 1
+                                                           : opts::ThreadCount,
+                                           Traces.size()));
+  std::vector<std::vector<Heatmap>> ChunkHMs;
+  for (size_t I = 0; I < NumChunks; ++I) {
+    ChunkHMs.emplace_back();
+    for (const auto &HM : HMs)
+      ChunkHMs.back().emplace_back(HM.getBucketSize(),
+                                   opts::HeatmapMinAddress,
+                                   opts::HeatmapMaxAddress);
+  }
+  auto registerChunk = [&](size_t I) {
+    const auto Begin = I * Traces.size() / NumChunks;
+    const auto End = (I + 1) * Traces.size() / NumChunks;
+    for (auto J = Begin; J < End; ++J) {
+      const auto &Trace = Traces[J].first;
+      auto registerRange = [&](uint64_t From, uint64_t To) {
+        for (auto &HM : ChunkHMs[I])
+          HM.registerAddressRange(From, To, Traces[J].second);
+      };
+      forEachHeatMapRange(Trace.From, Trace.To, registerRange);
+    }
+  };
+  if (NumChunks == 1) {
+    registerChunk(0);
+  } else {
+    ThreadPool &Pool = ParallelUtilities::getThreadPool();
+    for (size_t I = 0; I < NumChunks; ++I)
+      Pool.async(registerChunk, I);
+    Pool.wait();
   }
+  for (auto &Chunk : ChunkHMs)
+    for (size_t L = 0; L < HMs.size(); ++L)
+      HMs[L].merge(Chunk[L]);
+  ChunkHMs.clear();
 
+  auto &HM = HMs.front();
   if (HM.getNumInvalidRanges())
     outs() << "HEATMAP: invalid traces: " << HM.getNumInvalidRanges() << '\n';
 
@@ -1388,30 +2279,234 @@ std::error_code DataAggregator::printLBRHeatMap() {
     exit(1);
   }
 
-  HM.print(opts::HeatmapFile);
-  if (opts::HeatmapFile == "-") {
-    HM.printCDF(opts::HeatmapFile);
-  } else {
-    HM.printCDF(opts::HeatmapFile + ".csv");
-  }
+  printHeatMaps(HMs);
 
   return std::error_code();
 }
 
-std::error_code DataAggregator::parseBranchEvents() {
-  outs() << "PERF2BOLT: parse branch events...\n";
-  NamedRegionTimer T("parseBranch", "Parsing branch events", TimerGroupName,
-                     TimerGroupDesc, opts::TimeAggregator);
+DataAggregator::DataAggregator(const DataAggregator &Parent, StringRef Chunk)
+    : DataReader(Parent.Filename), BinaryMMapInfo(Parent.BinaryMMapInfo),
+      ForeignMMaps(Parent.ForeignMMaps), BC(Parent.BC), BAT(Parent.BAT) {
+  ParsingBuf = Chunk;
+  Col = 0;
+  Line = 1;
+}
 
-  uint64_t NumTotalSamples{0};
-  uint64_t NumEntries{0};
-  uint64_t NumSamples{0};
-  uint64_t NumSamplesNoLBR{0};
-  uint64_t NumTraces{0};
-  bool NeedsSkylakeFix{false};
+void DataAggregator::registerBranchSample(PerfBranchSample &Sample,
+                                          BranchEventStats &Stats) {
+  if (!opts::DedupLBRStacks) {
+    aggregateBranchSample(Sample, Stats);
+    return;
+  }
+
+  // Samples in a loop usually differ only in the PC, which is ignored unless
+  // it ends a trace or is counted as a basic sample.
+  if (!opts::UseEventPC && !opts::WriteAutoFDOData &&
+      !opts::PrintProfileStats && !opts::CheckProfile)
+    Sample.PC = 0;
+
+  auto I = LBRStacks.find(Sample);
+  if (I != LBRStacks.end()) {
+    ++I->second;
+    return;
+  }
+  if (LBRStacks.size() >= opts::LBRStackCacheSize)
+    flushLBRStacks(Stats);
+  LBRStacks.emplace(Sample, 1);
+  ++Stats.NumUniqueStacks;
+}
+
+void DataAggregator::flushLBRStacks(BranchEventStats &Stats) {
+  for (const auto &Entry : LBRStacks)
+    aggregateBranchSample(Entry.first, Stats, Entry.second);
+  clear(LBRStacks);
+}
+
+void DataAggregator::aggregateBranchSample(const PerfBranchSample &Sample,
+                                           BranchEventStats &Stats,
+                                           uint64_t Count) {
+  if (opts::WriteAutoFDOData || opts::PrintProfileStats || opts::CheckProfile)
+    BasicSamples[Sample.PC] += Count;
+
+  if (Sample.LBR.empty()) {
+    Stats.NumSamplesNoLBR += Count;
+    return;
+  }
+
+  Stats.NumEntries += Sample.LBR.size() * Count;
+  if (BAT && Sample.LBR.size() == 32 && !opts::ITraceWindow)
+    Stats.NeedsSkylakeFix = true;
+
+  // LBRs are stored in reverse execution order. NextPC refers to the next
+  // recorded executed PC.
+  uint64_t NextPC = opts::UseEventPC ? Sample.PC : 0;
+  uint32_t NumEntry{0};
+  for (const auto &LBR : Sample.LBR) {
+    ++NumEntry;
+    // Hardware bug workaround: Intel Skylake (which has 32 LBR entries)
+    // sometimes record entry 32 as an exact copy of entry 31. This will cause
+    // us to likely record an invalid trace and generate a stale function for
+    // BAT mode (non BAT disassembles the function and is able to ignore this
+    // trace at aggregation time). Drop first 2 entries (last two, in
+    // chronological order)
+    if (Stats.NeedsSkylakeFix && NumEntry <= 2)
+      continue;
+    if (NextPC) {
+      // Record fall-through trace.
+      const auto TraceFrom = LBR.To;
+      const auto TraceTo = NextPC;
+      const auto *TraceBF = getBinaryFunctionContainingAddress(TraceFrom);
+      if (TraceBF && TraceBF->containsAddress(TraceTo)) {
+          auto &Info = FallthroughLBRs[Trace(TraceFrom, TraceTo)];
+          if (TraceBF->containsAddress(LBR.From)) {
+            Info.InternCount += Count;
+          } else {
+            Info.ExternCount += Count;
+          }
+      } else {
+        if (TraceBF && getBinaryFunctionContainingAddress(TraceTo)) {
+          DEBUG(dbgs() << "Invalid trace starting in "
+                       << TraceBF->getPrintName() << " @ "
+                       << Twine::utohexstr(TraceFrom - TraceBF->getAddress())
+                       << " and ending @ " << Twine::utohexstr(TraceTo)
+                       << '\n');
+          NumInvalidTraces += Count;
+        } else {
+          DEBUG(
+              dbgs() << "Out of range trace starting in "
+                     << (TraceBF ? TraceBF->getPrintName() : "None") << " @ "
+                     << Twine::utohexstr(
+                            TraceFrom - (TraceBF ? TraceBF->getAddress() : 0))
+                     << " and ending in "
+                     << (getBinaryFunctionContainingAddress(TraceTo)
+                             ? getBinaryFunctionContainingAddress(TraceTo)
+                                   ->getPrintName()
+                             : "None")
+                     << " @ "
+                     << Twine::utohexstr(
+                            TraceTo -
+                            (getBinaryFunctionContainingAddress(TraceTo)
+                                 ? getBinaryFunctionContainingAddress(TraceTo)
+                                       ->getAddress()
+                                 : 0))
+                     << '\n');
+          NumLongRangeTraces += Count;
+        }
+      }
+      Stats.NumTraces += Count;
+    }
+    NextPC = LBR.From;
+
+    auto From = LBR.From;
+    if (!getBinaryFunctionContainingAddress(From))
+      From = 0;
+    auto To = LBR.To;
+    if (!getBinaryFunctionContainingAddress(To))
+      To = 0;
+    if (!From && !To)
+      continue;
+    auto &Info = BranchLBRs[Trace(From, To)];
+    Info.TakenCount += Count;
+    Info.MispredCount += LBR.Mispred * Count;
+  }
+
+  if (opts::ContextProfile)
+    aggregateContextTraces(Sample, Stats, Count);
+}
 
-  while (hasData() && NumTotalSamples < opts::MaxSamples) {
-    ++NumTotalSamples;
+void DataAggregator::aggregateContextTraces(const PerfBranchSample &Sample,
+                                            const BranchEventStats &Stats,
+                                            uint64_t Count) {
+  // Shadow call stack of the sample. Every context is the call site and the
+  // function entered at that site. Chains that cannot be followed, such as
+  // jumps out of a callee or returns to an unknown caller, reset the stack.
+  struct Context {
+    uint64_t CallSite;
+    const BinaryFunction *Callee;
+  };
+  SmallVector<Context, 8> Stack;
+
+  // Walk the entries in execution order, skipping the two most recent ones
+  // if they could be affected by the Skylake bug.
+  const size_t NumSkipped = Stats.NeedsSkylakeFix ? 2 : 0;
+  for (size_t I = Sample.LBR.size(); I-- > NumSkipped;) {
+    const auto &LBR = Sample.LBR[I];
+    const auto *FromBF = getBinaryFunctionContainingAddress(LBR.From);
+    const auto *ToBF = getBinaryFunctionContainingAddress(LBR.To);
+    if (ToBF && LBR.To == ToBF->getAddress() && FromBF && FromBF != ToBF) {
+      Stack.push_back({LBR.From, ToBF});
+    } else if (!Stack.empty() && Stack.back().Callee == FromBF &&
+               FromBF != ToBF) {
+      Stack.pop_back();
+      if (!Stack.empty() && Stack.back().Callee != ToBF)
+        Stack.clear();
+    } else if (!Stack.empty() && Stack.back().Callee != FromBF) {
+      Stack.clear();
+    }
+
+    if (Stack.empty())
+      continue;
+
+    // The callee executed from the target of the branch to the source of the
+    // next one.
+    uint64_t NextPC = 0;
+    if (I > NumSkipped)
+      NextPC = Sample.LBR[I - 1].From;
+    else if (!NumSkipped && opts::UseEventPC)
+      NextPC = Sample.PC;
+    if (!NextPC)
+      continue;
+    const auto *Callee = Stack.back().Callee;
+    if (Callee->containsAddress(LBR.To) && Callee->containsAddress(NextPC) &&
+        LBR.To <= NextPC)
+      ContextTraces[ContextTrace(Stack.back().CallSite, LBR.To, NextPC)] +=
+          Count;
+  }
+}
+
+void DataAggregator::attachContextProfiles(BinaryContext &BC) {
+  uint64_t NumCallSites = 0;
+  std::unordered_map<MCInst *, std::map<uint32_t, uint64_t>> Counts;
+  for (const auto &Entry : ContextTraces) {
+    const auto &CT = Entry.first;
+    auto *Caller = getBinaryFunctionContainingAddress(CT.CallSite);
+    auto *Callee = getBinaryFunctionContainingAddress(CT.From);
+    if (!Caller || !Callee || !Caller->hasCFG() || !Callee->hasCFG())
+      continue;
+
+    auto *CallInst =
+        Caller->getInstructionAtOffset(CT.CallSite - Caller->getAddress());
+    if (!CallInst || !BC.MIB->isCall(*CallInst))
+      continue;
+
+    // Count every block of the callee covered by the trace.
+    auto &BlockCounts = Counts[CallInst];
+    const auto ToOffset = CT.To - Callee->getAddress();
+    auto *BB =
+        Callee->getBasicBlockContainingOffset(CT.From - Callee->getAddress());
+    while (BB && BB->getOffset() <= ToOffset) {
+      BlockCounts[BB->getInputOffset()] += Entry.second;
+      BB = Callee->getBasicBlockContainingOffset(BB->getEndOffset());
+    }
+  }
+
+  for (auto &Entry : Counts) {
+    auto &CP = BC.MIB->getOrCreateAnnotationAs<ContextProfile>(
+        *Entry.first, "ContextProfile");
+    for (const auto &BlockCount : Entry.second)
+      CP.push_back({BlockCount.first, BlockCount.second});
+    ++NumCallSites;
+  }
+
+  outs() << "PERF2BOLT: recorded context-sensitive profile for "
+         << NumCallSites << " call sites\n";
+}
+
+std::error_code
+DataAggregator::parseBranchEventsChunk(BranchEventStats &Stats,
+                                       uint64_t MaxSamples) {
+  while (hasData() && Stats.NumTotalSamples < MaxSamples) {
+    ++Stats.NumTotalSamples;
 
     auto SampleRes = parseBranchSample();
     if (auto EC = SampleRes.getError()) {
@@ -1419,97 +2514,406 @@ std::error_code DataAggregator::parseBranchEvents() {
         continue;
       return EC;
     }
-    ++NumSamples;
+    ++Stats.NumSamples;
+
+    registerBranchSample(SampleRes.get(), Stats);
+
+    if (opts::AggregationMemoryLimit &&
+        getBranchStorageSize() > (opts::AggregationMemoryLimit << 20)) {
+      if (auto EC = spillBranchEvents())
+        return EC;
+    }
+  }
+
+  return std::error_code();
+}
+
+void DataAggregator::mergeBranchEvents(const DataAggregator &Worker) {
+  for (const auto &Entry : Worker.BranchLBRs) {
+    auto &Info = BranchLBRs[Entry.first];
+    Info.TakenCount += Entry.second.TakenCount;
+    Info.MispredCount += Entry.second.MispredCount;
+  }
+  for (const auto &Entry : Worker.FallthroughLBRs) {
+    auto &Info = FallthroughLBRs[Entry.first];
+    Info.InternCount += Entry.second.InternCount;
+    Info.ExternCount += Entry.second.ExternCount;
+  }
+  for (const auto &Entry : Worker.ContextTraces)
+    ContextTraces[Entry.first] += Entry.second;
+  for (const auto &Entry : Worker.BasicSamples)
+    BasicSamples[Entry.first] += Entry.second;
+  for (const auto &Entry : Worker.SamplesPerPID)
+    SamplesPerPID[Entry.first] += Entry.second;
+
+  NumInvalidTraces += Worker.NumInvalidTraces;
+  NumLongRangeTraces += Worker.NumLongRangeTraces;
+  NumKernelLBREntries += Worker.NumKernelLBREntries;
+}
+
+std::error_code
+DataAggregator::parseBranchEventsInParallel(BranchEventStats &Stats) {
+  // Split the buffer into one chunk per thread. Chunks always end on a line
+  // boundary, so every sample is parsed by exactly one worker.
+  const unsigned NumChunks = opts::ThreadCount;
+  const size_t ChunkSize = ParsingBuf.size() / NumChunks + 1;
+  std::vector<std::unique_ptr<DataAggregator>> Workers;
+  StringRef Buf = ParsingBuf;
+  while (!Buf.empty()) {
+    size_t End = Buf.find('\n', std::min(ChunkSize, Buf.size()) - 1);
+    End = End == StringRef::npos ? Buf.size() : End + 1;
+    Workers.emplace_back(new DataAggregator(*this, Buf.substr(0, End)));
+    Buf = Buf.drop_front(End);
+  }
+  ParsingBuf = StringRef();
+
+  std::vector<BranchEventStats> WorkerStats(Workers.size());
+  std::vector<std::error_code> WorkerErrors(Workers.size());
+  ThreadPool &Pool = ParallelUtilities::getThreadPool();
+  for (size_t I = 0; I < Workers.size(); ++I) {
+    Pool.async([&, I] {
+      WorkerErrors[I] = Workers[I]->parseBranchEventsChunk(WorkerStats[I],
+                                                           opts::MaxSamples);
+      Workers[I]->flushLBRStacks(WorkerStats[I]);
+    });
+  }
+  Pool.wait();
+
+  for (size_t I = 0; I < Workers.size(); ++I) {
+    if (WorkerErrors[I])
+      return WorkerErrors[I];
+
+    mergeBranchEvents(*Workers[I]);
+    Workers[I].reset();
+
+    const auto &WS = WorkerStats[I];
+    Stats.NumTotalSamples += WS.NumTotalSamples;
+    Stats.NumEntries += WS.NumEntries;
+    Stats.NumSamples += WS.NumSamples;
+    Stats.NumSamplesNoLBR += WS.NumSamplesNoLBR;
+    Stats.NumTraces += WS.NumTraces;
+    Stats.NumUniqueStacks += WS.NumUniqueStacks;
+    Stats.NeedsSkylakeFix |= WS.NeedsSkylakeFix;
+  }
+
+  return std::error_code();
+}
+
+std::error_code DataAggregator::parseBranchEvents() {
+  outs() << "PERF2BOLT: parse branch events...\n";
+  NamedRegionTimer T("parseBranch", "Parsing branch events", TimerGroupName,
+                     TimerGroupDesc, opts::TimeAggregator);
+
+  BranchEventStats Stats;
+  const auto StartTime = std::chrono::steady_clock::now();
+
+  // The sample limit is global, and memory limit is applied to the storage
+  // of a single aggregator, hence they require sequential parsing.
+  const bool UseParallelParsing =
+      !opts::NoThreads && opts::ThreadCount > 1 &&
+      opts::MaxSamples == -1ULL && !opts::AggregationMemoryLimit &&
+      opts::ParallelAggregationThreshold &&
+      ParsingBuf.size() >= opts::ParallelAggregationThreshold;
+  if (PerfReader) {
+    if (auto EC = readPerfDataBranchEvents(Stats))
+      return EC;
+  } else if (MainEventsPPI.StdoutFD != -1) {
+    if (auto EC = parseBranchEventsFromStream(Stats))
+      return EC;
+  } else if (UseParallelParsing) {
+    if (auto EC = parseBranchEventsInParallel(Stats))
+      return EC;
+  } else if (auto EC = parseBranchEventsChunk(Stats, opts::MaxSamples)) {
+    return EC;
+  }
+  flushLBRStacks(Stats);
+
+  // Keep the remainder of traces on disk, so that all of them can be merged
+  // in order when processing.
+  if (!BranchSpills.empty()) {
+    if (auto EC = spillBranchEvents())
+      return EC;
+    outs() << "PERF2BOLT: spilled aggregated traces to " << BranchSpills.size()
+           << " runs on disk\n";
+  }
 
-    auto &Sample = SampleRes.get();
-    if (opts::WriteAutoFDOData)
-      ++BasicSamples[Sample.PC];
+  finishBranchEvents(Stats);
+
+  if (opts::TimeAggregator) {
+    const std::chrono::duration<double> Elapsed =
+        std::chrono::steady_clock::now() - StartTime;
+    outs() << "PERF2BOLT: aggregated " << Stats.NumTotalSamples
+           << " samples and " << BranchLBRs.size() + FallthroughLBRs.size()
+           << " unique traces in " << format("%.2f", Elapsed.count())
+           << " seconds";
+    if (Elapsed.count() > 0)
+      outs() << " (" << format("%.0f", Stats.NumTotalSamples / Elapsed.count())
+             << " samples/s)";
+    outs() << "\n";
+  }
+
+  return std::error_code();
+}
 
-    if (Sample.LBR.empty()) {
-      ++NumSamplesNoLBR;
+bool DataAggregator::convertPerfDataSample(
+    const PerfDataReader::SampleEvent &Event, PerfBranchSample &Sample) const {
+  auto MMapInfoIter = BinaryMMapInfo.find(Event.PID);
+  if (!opts::LinuxKernelMode && MMapInfoIter == BinaryMMapInfo.end())
+    return false;
+  if (opts::CheckProfile)
+    ++SamplesPerPID[Event.PID];
+
+  Sample.PC = Event.PC;
+  Sample.LBR.clear();
+  for (auto LBR : Event.LBR) {
+    if (ignoreKernelInterrupt(LBR)) {
+      ++NumKernelLBREntries;
       continue;
     }
+    if (!BC->HasFixedLoadAddress)
+      adjustLBR(LBR, MMapInfoIter->second);
+    Sample.LBR.push_back(LBR);
+  }
+  return true;
+}
 
-    NumEntries += Sample.LBR.size();
-    if (BAT && Sample.LBR.size() == 32 && !NeedsSkylakeFix) {
-      errs() << "PERF2BOLT-WARNING: using Intel Skylake bug workaround\n";
-      NeedsSkylakeFix = true;
+std::error_code
+DataAggregator::readPerfDataBranchEvents(BranchEventStats &Stats) {
+  PerfDataReader::RecordHandlers Handlers;
+  PerfBranchSample Sample;
+  std::error_code SpillError;
+  Handlers.Sample = [&](const PerfDataReader::SampleEvent &Event) {
+    if (Stats.NumTotalSamples >= opts::MaxSamples)
+      return false;
+    ++Stats.NumTotalSamples;
+    if (!convertPerfDataSample(Event, Sample))
+      return true;
+    ++Stats.NumSamples;
+    registerBranchSample(Sample, Stats);
+
+    if (opts::AggregationMemoryLimit &&
+        getBranchStorageSize() > (opts::AggregationMemoryLimit << 20)) {
+      if ((SpillError = spillBranchEvents()))
+        return false;
     }
+    return true;
+  };
 
-    // LBRs are stored in reverse execution order. NextPC refers to the next
-    // recorded executed PC.
-    uint64_t NextPC = opts::UseEventPC ? Sample.PC : 0;
-    uint32_t NumEntry{0};
-    for (const auto &LBR : Sample.LBR) {
-      ++NumEntry;
-      // Hardware bug workaround: Intel Skylake (which has 32 LBR entries)
-      // sometimes record entry 32 as an exact copy of entry 31. This will cause
-      // us to likely record an invalid trace and generate a stale function for
-      // BAT mode (non BAT disassembles the function and is able to ignore this
-      // trace at aggregation time). Drop first 2 entries (last two, in
-      // chronological order)
-      if (NeedsSkylakeFix && NumEntry <= 2)
-        continue;
-      if (NextPC) {
-        // Record fall-through trace.
-        const auto TraceFrom = LBR.To;
-        const auto TraceTo = NextPC;
-        const auto *TraceBF = getBinaryFunctionContainingAddress(TraceFrom);
-        if (TraceBF && TraceBF->containsAddress(TraceTo)) {
-            auto &Info = FallthroughLBRs[Trace(TraceFrom, TraceTo)];
-            if (TraceBF->containsAddress(LBR.From)) {
-              ++Info.InternCount;
-            } else {
-              ++Info.ExternCount;
-            }
-        } else {
-          if (TraceBF && getBinaryFunctionContainingAddress(TraceTo)) {
-            DEBUG(dbgs() << "Invalid trace starting in "
-                         << TraceBF->getPrintName() << " @ "
-                         << Twine::utohexstr(TraceFrom - TraceBF->getAddress())
-                         << " and ending @ " << Twine::utohexstr(TraceTo)
-                         << '\n');
-            ++NumInvalidTraces;
-          } else {
-            DEBUG(
-                dbgs() << "Out of range trace starting in "
-                       << (TraceBF ? TraceBF->getPrintName() : "None") << " @ "
-                       << Twine::utohexstr(
-                              TraceFrom - (TraceBF ? TraceBF->getAddress() : 0))
-                       << " and ending in "
-                       << (getBinaryFunctionContainingAddress(TraceTo)
-                               ? getBinaryFunctionContainingAddress(TraceTo)
-                                     ->getPrintName()
-                               : "None")
-                       << " @ "
-                       << Twine::utohexstr(
-                              TraceTo -
-                              (getBinaryFunctionContainingAddress(TraceTo)
-                                   ? getBinaryFunctionContainingAddress(TraceTo)
-                                         ->getAddress()
-                                   : 0))
-                       << '\n');
-            ++NumLongRangeTraces;
-          }
-        }
-        ++NumTraces;
-      }
-      NextPC = LBR.From;
-
-      auto From = LBR.From;
-      if (!getBinaryFunctionContainingAddress(From))
-        From = 0;
-      auto To = LBR.To;
-      if (!getBinaryFunctionContainingAddress(To))
-        To = 0;
-      if (!From && !To)
+  if (auto EC = PerfReader->readRecords(Handlers))
+    return EC;
+  return SpillError;
+}
+
+std::error_code
+DataAggregator::parseBranchEventsFromStream(BranchEventStats &Stats) {
+  const int FD = MainEventsPPI.StdoutFD;
+  std::vector<char> Buffer(static_cast<size_t>(opts::StreamBlockSize) << 20);
+  size_t BufferSize = 0;
+  bool IsEOF = false;
+  Col = 0;
+  Line = 1;
+  while (!IsEOF && Stats.NumTotalSamples < opts::MaxSamples) {
+    // Grow the buffer if it cannot hold a single line.
+    if (BufferSize == Buffer.size())
+      Buffer.resize(Buffer.size() * 2);
+
+    ssize_t BytesRead = ::read(FD, Buffer.data() + BufferSize,
+                               Buffer.size() - BufferSize);
+    if (BytesRead == -1) {
+      if (errno == EINTR)
         continue;
-      auto &Info = BranchLBRs[Trace(From, To)];
-      ++Info.TakenCount;
-      Info.MispredCount += LBR.Mispred;
+      return std::error_code(errno, std::generic_category());
     }
+    IsEOF = BytesRead == 0;
+    BufferSize += BytesRead;
+
+    // Parse complete lines only and carry the rest over to the next read.
+    StringRef Data(Buffer.data(), BufferSize);
+    size_t End = IsEOF ? BufferSize : Data.rfind('\n');
+    if (End == StringRef::npos)
+      continue;
+    if (!IsEOF)
+      ++End;
+
+    ParsingBuf = Data.substr(0, End);
+    if (auto EC = parseBranchEventsChunk(Stats, opts::MaxSamples))
+      return EC;
+
+    std::copy(Buffer.begin() + End, Buffer.begin() + BufferSize,
+              Buffer.begin());
+    BufferSize -= End;
+  }
+  ParsingBuf = StringRef();
+
+  ::close(FD);
+  MainEventsPPI.StdoutFD = -1;
+
+  if (!IsEOF) {
+    // The sample limit was reached. Closing the pipe terminates perf.
+    std::string Error;
+    sys::Wait(MainEventsPPI.PI, 0, true, &Error);
+    return std::error_code();
   }
 
+  waitForPerfProcess("events", MainEventsPPI);
+
+  return std::error_code();
+}
+
+uint64_t DataAggregator::getBranchStorageSize() const {
+  return BranchLBRs.getMemorySize() + FallthroughLBRs.getMemorySize();
+}
+
+namespace {
+
+/// Write \p Records sorted by trace to a new temporary file and append its name
+/// to \p Spills.
+std::error_code
+writeSpill(std::vector<std::array<uint64_t, 4>> &Records, StringRef Prefix,
+           std::vector<std::string> &Spills) {
+  std::sort(Records.begin(), Records.end());
+
+  SmallString<128> Path;
+  int FD;
+  if (auto EC = sys::fs::createTemporaryFile(Prefix, "bin", FD, Path))
+    return EC;
+  Spills.emplace_back(Path.str());
+
+  raw_fd_ostream OS(FD, /*shouldClose=*/true);
+  // Spills are only read back by this process, hence use the host byte order.
+  OS.write(reinterpret_cast<const char *>(Records.data()),
+           Records.size() * sizeof(Records[0]));
+  OS.close();
+  if (OS.has_error())
+    return make_error_code(llvm::errc::io_error);
+
+  return std::error_code();
+}
+
+} // namespace
+
+std::error_code DataAggregator::spillBranchEvents() {
+  DEBUG(dbgs() << "PERF2BOLT: spilling " << BranchLBRs.size()
+               << " branches and " << FallthroughLBRs.size()
+               << " fall-throughs\n");
+
+  std::vector<std::array<uint64_t, 4>> Records;
+  Records.reserve(BranchLBRs.size());
+  for (const auto &LBR : BranchLBRs) {
+    const auto &Trace = LBR.first;
+    // Spilled branches are not visible to finishBranchEvents().
+    if (auto *BF = getBinaryFunctionContainingAddress(Trace.From))
+      BF->setHasProfileAvailable();
+    if (auto *BF = getBinaryFunctionContainingAddress(Trace.To))
+      BF->setHasProfileAvailable();
+    Records.push_back({Trace.From, Trace.To, LBR.second.TakenCount,
+                       LBR.second.MispredCount});
+  }
+  clear(BranchLBRs);
+  if (auto EC = writeSpill(Records, "perf2bolt.branches", BranchSpills))
+    return EC;
+
+  Records.clear();
+  Records.reserve(FallthroughLBRs.size());
+  for (const auto &FT : FallthroughLBRs) {
+    Records.push_back({FT.first.From, FT.first.To, FT.second.InternCount,
+                       FT.second.ExternCount});
+  }
+  clear(FallthroughLBRs);
+  return writeSpill(Records, "perf2bolt.fallthroughs", FallthroughSpills);
+}
+
+std::error_code DataAggregator::mergeSpills(
+    const std::vector<std::string> &Spills,
+    function_ref<void(const Trace &, uint64_t, uint64_t)> Callback) {
+  constexpr size_t RecordSize = 4 * sizeof(uint64_t);
+  std::vector<std::unique_ptr<MemoryBuffer>> Buffers;
+  for (const auto &FileName : Spills) {
+    auto MB = MemoryBuffer::getFile(FileName, /*FileSize=*/-1,
+                                    /*RequiresNullTerminator=*/false);
+    if (std::error_code EC = MB.getError())
+      return EC;
+    Buffers.emplace_back(std::move(*MB));
+  }
+
+  auto getRecord = [&](size_t Spill, size_t Offset) {
+    std::array<uint64_t, 4> Record;
+    memcpy(Record.data(), Buffers[Spill]->getBufferStart() + Offset,
+           RecordSize);
+    return Record;
+  };
+
+  // Min-heap of <record, spill index, offset of the record in the spill>.
+  using HeapEntryTy = std::tuple<std::array<uint64_t, 4>, size_t, size_t>;
+  std::priority_queue<HeapEntryTy, std::vector<HeapEntryTy>,
+                      std::greater<HeapEntryTy>> Heap;
+  for (size_t I = 0; I < Buffers.size(); ++I)
+    if (Buffers[I]->getBufferSize() >= RecordSize)
+      Heap.emplace(getRecord(I, 0), I, 0);
+
+  while (!Heap.empty()) {
+    auto Record = std::get<0>(Heap.top());
+    const Trace Key(Record[0], Record[1]);
+    uint64_t Count1 = 0;
+    uint64_t Count2 = 0;
+    while (!Heap.empty() && std::get<0>(Heap.top())[0] == Key.From &&
+           std::get<0>(Heap.top())[1] == Key.To) {
+      size_t Spill;
+      size_t Offset;
+      std::tie(Record, Spill, Offset) = Heap.top();
+      Heap.pop();
+      Count1 += Record[2];
+      Count2 += Record[3];
+      Offset += RecordSize;
+      if (Offset + RecordSize <= Buffers[Spill]->getBufferSize())
+        Heap.emplace(getRecord(Spill, Offset), Spill, Offset);
+    }
+    Callback(Key, Count1, Count2);
+  }
+
+  return std::error_code();
+}
+
+std::error_code DataAggregator::reloadSpills() {
+  if (BranchSpills.empty() && FallthroughSpills.empty())
+    return std::error_code();
+
+  auto EC = mergeSpills(BranchSpills, [&](const Trace &T, uint64_t Taken,
+                                          uint64_t Mispreds) {
+    auto &Info = BranchLBRs[T];
+    Info.TakenCount += Taken;
+    Info.MispredCount += Mispreds;
+  });
+  if (EC)
+    return EC;
+
+  EC = mergeSpills(FallthroughSpills, [&](const Trace &T, uint64_t Intern,
+                                          uint64_t Extern) {
+    auto &Info = FallthroughLBRs[T];
+    Info.InternCount += Intern;
+    Info.ExternCount += Extern;
+  });
+  deleteSpills();
+  return EC;
+}
+
+void DataAggregator::finishBranchEvents(const BranchEventStats &Stats) {
+  if (Stats.NeedsSkylakeFix)
+    errs() << "PERF2BOLT-WARNING: using Intel Skylake bug workaround\n";
+
+  const uint64_t NumTotalSamples = Stats.NumTotalSamples;
+  const uint64_t NumEntries = Stats.NumEntries;
+  const uint64_t NumSamples = Stats.NumSamples;
+  const uint64_t NumSamplesNoLBR = Stats.NumSamplesNoLBR;
+  const uint64_t NumTraces = Stats.NumTraces;
+
+  auto &Collection = BC->ProfileCollection;
+  Collection.IsAvailable = true;
+  Collection.NumSamples += NumTotalSamples;
+  Collection.NumIgnoredSamples += NumTotalSamples - NumSamples;
+  Collection.NumLBREntries += NumEntries;
+  Collection.NumTraces += NumTraces;
+
   for (const auto &LBR : BranchLBRs) {
     const auto &Trace = LBR.first;
     if (auto *BF = getBinaryFunctionContainingAddress(Trace.From))
@@ -1537,6 +2941,9 @@ std::error_code DataAggregator::parseBranchEvents() {
 
   outs() << "PERF2BOLT: read " << NumSamples << " samples and "
          << NumEntries << " LBR entries\n";
+  if (opts::DedupLBRStacks)
+    outs() << "PERF2BOLT: aggregated " << Stats.NumUniqueStacks
+           << " distinct LBR stacks\n";
   if (NumTotalSamples) {
     if (NumSamples && NumSamplesNoLBR == NumSamples) {
       // Note: we don't know if perf2bolt is being used to parse memory samples
@@ -1591,8 +2998,6 @@ std::error_code DataAggregator::parseBranchEvents() {
              "profile. You may want to audit this.\n";
     }
   }
-
-  return std::error_code();
 }
 
 void DataAggregator::processBranchEvents() {
@@ -1600,49 +3005,191 @@ void DataAggregator::processBranchEvents() {
   NamedRegionTimer T("processBranch", "Processing branch events",
                      TimerGroupName, TimerGroupDesc, opts::TimeAggregator);
 
-  for (const auto &AggrLBR : FallthroughLBRs) {
-    auto &Loc = AggrLBR.first;
-    auto &Info = AggrLBR.second;
+  // Aggregated events saved with -write-pre-aggregated.
+  const bool SaveEntries = !opts::WritePreAggregated.empty();
+  std::vector<AggregatedLBREntry> Entries;
+
+  auto processFallthrough = [&](const Trace &Loc, uint64_t InternCount,
+                                uint64_t ExternCount) {
     LBREntry First{Loc.From, Loc.From, false};
     LBREntry Second{Loc.To, Loc.To, false};
-    if (Info.InternCount) {
-      doTrace(First, Second, Info.InternCount);
+    if (InternCount) {
+      doTrace(First, Second, InternCount);
+      if (SaveEntries)
+        Entries.emplace_back(AggregatedLBREntry{
+            Location(Loc.From), Location(Loc.To), InternCount, 0,
+            AggregatedLBREntry::FT});
     }
-    if (Info.ExternCount) {
+    if (ExternCount) {
       First.From = 0;
-      doTrace(First, Second, Info.ExternCount);
+      doTrace(First, Second, ExternCount);
+      if (SaveEntries)
+        Entries.emplace_back(AggregatedLBREntry{
+            Location(Loc.From), Location(Loc.To), ExternCount, 0,
+            AggregatedLBREntry::FT_EXTERNAL_ORIGIN});
     }
+  };
+
+  auto processBranch = [&](const Trace &Loc, uint64_t TakenCount,
+                           uint64_t MispredCount) {
+    doBranch(Loc.From, Loc.To, TakenCount, MispredCount);
+    if (SaveEntries)
+      Entries.emplace_back(AggregatedLBREntry{
+          Location(Loc.From), Location(Loc.To), TakenCount, MispredCount,
+          AggregatedLBREntry::BRANCH});
+  };
+
+  for (const auto &AggrLBR : FallthroughLBRs) {
+    processFallthrough(AggrLBR.first, AggrLBR.second.InternCount,
+                       AggrLBR.second.ExternCount);
   }
 
   for (const auto &AggrLBR : BranchLBRs) {
-    auto &Loc = AggrLBR.first;
-    auto &Info = AggrLBR.second;
-    doBranch(Loc.From, Loc.To, Info.TakenCount, Info.MispredCount);
+    processBranch(AggrLBR.first, AggrLBR.second.TakenCount,
+                  AggrLBR.second.MispredCount);
+  }
+
+  // Stream traces spilled to disk without loading them back in memory.
+  auto EC = mergeSpills(FallthroughSpills, processFallthrough);
+  if (!EC)
+    EC = mergeSpills(BranchSpills, processBranch);
+  if (EC)
+    report_error("cannot read spilled traces", EC);
+  deleteSpills();
+
+  if (SaveEntries) {
+    if (auto EC = writeBinaryPreAggregatedFile(opts::WritePreAggregated,
+                                               Entries))
+      report_error("cannot write pre-aggregated file", EC);
+  }
+
+  if (NumInterFragmentBranches) {
+    outs() << "PERF2BOLT: " << NumInterFragmentBranches
+           << " branches between fragments of split functions recorded as "
+              "branches within the functions\n";
   }
+
+  printCrossDSOBranches();
+}
+
+bool DataAggregator::encodeForeignAddress(uint64_t &Address,
+                                          pid_t PID) const {
+  const auto PIDIter = ForeignMMaps.find(PID);
+  if (PIDIter == ForeignMMaps.end())
+    return false;
+
+  const auto &MMaps = PIDIter->second;
+  auto MMapIter = MMaps.upper_bound(Address);
+  if (MMapIter == MMaps.begin())
+    return false;
+  --MMapIter;
+  const auto &MMI = MMapIter->second.MMap;
+  const auto Offset = Address - MMI.BaseAddress + MMI.Offset;
+  if (Address >= MMI.BaseAddress + MMI.Size ||
+      Offset >= (1ULL << ForeignDSOIdShift))
+    return false;
+
+  Address = ForeignAddressTag |
+            (uint64_t(MMapIter->second.DSOId) << ForeignDSOIdShift) | Offset;
+  return true;
+}
+
+StringRef DataAggregator::decodeForeignAddress(uint64_t &Address) const {
+  if ((Address & ~(ForeignAddressTag - 1)) != ForeignAddressTag ||
+      ForeignDSONames.empty())
+    return StringRef();
+
+  const auto DSOId = (Address & (ForeignAddressTag - 1)) >> ForeignDSOIdShift;
+  if (DSOId >= ForeignDSONames.size())
+    return StringRef();
+  Address &= (1ULL << ForeignDSOIdShift) - 1;
+  return ForeignDSONames[DSOId];
+}
+
+void DataAggregator::printCrossDSOBranches() const {
+  if (!opts::CrossDSOProfile)
+    return;
+
+  // Totals by DSO show which libraries are worth linking statically, the
+  // hottest edges show through which functions (often PLT entries) the
+  // binary and the libraries call each other.
+  std::map<StringRef, std::pair<uint64_t, uint64_t>> DSOTotals;
+  std::vector<std::pair<std::pair<StringRef, StringRef>, uint64_t>> Edges;
+  for (const auto &Entry : CrossDSOBranches) {
+    const auto &Key = Entry.first;
+    if (std::find(ForeignDSONames.begin(), ForeignDSONames.end(), Key.first) !=
+        ForeignDSONames.end())
+      DSOTotals[Key.first].first += Entry.second;
+    else
+      DSOTotals[Key.second].second += Entry.second;
+    Edges.emplace_back(Entry);
+  }
+  std::stable_sort(Edges.begin(), Edges.end(),
+                   [](const std::pair<std::pair<StringRef, StringRef>,
+                                      uint64_t> &A,
+                      const std::pair<std::pair<StringRef, StringRef>,
+                                      uint64_t> &B) {
+                     return A.second > B.second;
+                   });
+
+  outs() << "PERF2BOLT: branches between " << BC->getFilename()
+         << " and other DSOs:\n";
+  for (const auto &Entry : DSOTotals)
+    outs() << "  " << Entry.first << ": " << Entry.second.first
+           << " into the binary, " << Entry.second.second
+           << " out of the binary\n";
+  if (Edges.empty())
+    return;
+  outs() << "PERF2BOLT: hottest cross-DSO edges:\n";
+  for (size_t I = 0, E = std::min<size_t>(Edges.size(), 20); I < E; ++I)
+    outs() << "  " << Edges[I].first.first << " -> " << Edges[I].first.second
+           << " : " << Edges[I].second << '\n';
 }
 
 std::error_code DataAggregator::parseBasicEvents() {
   outs() << "PERF2BOLT: parsing basic events (without LBR)...\n";
   NamedRegionTimer T("parseBasic", "Parsing basic events", TimerGroupName,
                      TimerGroupDesc, opts::TimeAggregator);
+  if (PerfReader) {
+    PerfDataReader::RecordHandlers Handlers;
+    Handlers.Sample = [&](const PerfDataReader::SampleEvent &Event) {
+      auto MMapInfoIter = BinaryMMapInfo.find(Event.PID);
+      if (MMapInfoIter == BinaryMMapInfo.end())
+        return true;
+      if (opts::CheckProfile)
+        ++SamplesPerPID[Event.PID];
+
+      auto Address = Event.PC;
+      if (!BC->HasFixedLoadAddress)
+        adjustAddress(Address, MMapInfoIter->second);
+      aggregateBasicSample(PerfBasicSample{Event.EventName, Address});
+      return true;
+    };
+    return PerfReader->readRecords(Handlers);
+  }
+
   while (hasData()) {
     auto Sample = parseBasicSample();
     if (std::error_code EC = Sample.getError())
       return EC;
 
-    if (!Sample->PC)
-      continue;
-
-    if (auto *BF = getBinaryFunctionContainingAddress(Sample->PC))
-      BF->setHasProfileAvailable();
-
-    ++BasicSamples[Sample->PC];
-    EventNames.insert(Sample->EventName);
+    aggregateBasicSample(*Sample);
   }
 
   return std::error_code();
 }
 
+void DataAggregator::aggregateBasicSample(const PerfBasicSample &Sample) {
+  if (!Sample.PC)
+    return;
+
+  if (auto *BF = getBinaryFunctionContainingAddress(Sample.PC))
+    BF->setHasProfileAvailable();
+
+  ++BasicSamples[Sample.PC];
+  EventNames.insert(Sample.EventName);
+}
+
 void DataAggregator::processBasicEvents() {
   outs() << "PERF2BOLT: processing basic events (without LBR)...\n";
   NamedRegionTimer T("processBasic", "Processing basic events",
@@ -1696,20 +3243,44 @@ std::error_code DataAggregator::parseMemEvents() {
   outs() << "PERF2BOLT: parsing memory events...\n";
   NamedRegionTimer T("parseMemEvents", "Parsing mem events", TimerGroupName,
                      TimerGroupDesc, opts::TimeAggregator);
+  if (PerfReader) {
+    PerfDataReader::RecordHandlers Handlers;
+    Handlers.Sample = [&](const PerfDataReader::SampleEvent &Event) {
+      if (!Event.HasAddr ||
+          Event.EventName.find(opts::MemEventName) == StringRef::npos)
+        return true;
+
+      auto MMapInfoIter = BinaryMMapInfo.find(Event.PID);
+      if (MMapInfoIter == BinaryMMapInfo.end())
+        return true;
+
+      auto Address = Event.Addr;
+      if (!BC->HasFixedLoadAddress)
+        adjustAddress(Address, MMapInfoIter->second);
+      aggregateMemSample(PerfMemSample{Event.PC, Address});
+      return true;
+    };
+    return PerfReader->readRecords(Handlers);
+  }
+
   while (hasData()) {
     auto Sample = parseMemSample();
     if (std::error_code EC = Sample.getError())
       return EC;
 
-    if (auto *BF = getBinaryFunctionContainingAddress(Sample->PC))
-      BF->setHasProfileAvailable();
-
-    MemSamples.emplace_back(std::move(Sample.get()));
+    aggregateMemSample(*Sample);
   }
 
   return std::error_code();
 }
 
+void DataAggregator::aggregateMemSample(const PerfMemSample &Sample) {
+  if (auto *BF = getBinaryFunctionContainingAddress(Sample.PC))
+    BF->setHasProfileAvailable();
+
+  MemSamples.emplace_back(Sample);
+}
+
 void DataAggregator::processMemEvents() {
   NamedRegionTimer T("ProcessMemEvents", "Processing mem events",
                      TimerGroupName, TimerGroupDesc, opts::TimeAggregator);
@@ -1771,6 +3342,215 @@ std::error_code DataAggregator::parsePreAggregatedLBRSamples() {
   return std::error_code();
 }
 
+std::error_code
+DataAggregator::parseBinaryPreAggregatedLBRSamples(StringRef Buffer) {
+  outs() << "PERF2BOLT: parsing binary pre-aggregated profile...\n";
+  NamedRegionTimer T("parseAggregated", "Parsing aggregated branch events",
+                     TimerGroupName, TimerGroupDesc, opts::TimeAggregator);
+
+  auto reportMalformed = [](const Twine &Msg) {
+    errs() << "PERF2BOLT-ERROR: malformed pre-aggregated profile: " << Msg
+           << "\n";
+    return make_error_code(llvm::errc::io_error);
+  };
+
+  if (Buffer.size() < BinaryPreAggregatedHeaderSize)
+    return reportMalformed("truncated header");
+
+  const char *Ptr = Buffer.data() + sizeof(BinaryPreAggregatedMagic) - 1;
+  const auto Version = support::endian::read32le(Ptr);
+  if (Version != BinaryPreAggregatedVersion)
+    return reportMalformed("unsupported version " + Twine(Version));
+  const auto CountWidth = support::endian::read32le(Ptr + 4);
+  if (CountWidth != 4 && CountWidth != 8)
+    return reportMalformed("invalid count width " + Twine(CountWidth));
+  uint64_t NumEntries[3];
+  uint64_t NumTotalEntries{0};
+  for (unsigned I = 0; I < 3; ++I) {
+    NumEntries[I] = support::endian::read64le(Ptr + 8 + I * 8);
+    if (NumEntries[I] > Buffer.size())
+      return reportMalformed("truncated counts");
+    NumTotalEntries += NumEntries[I];
+  }
+  const auto NumStrings = support::endian::read32le(Ptr + 32);
+  const auto StringTableSize = support::endian::read32le(Ptr + 36);
+  const auto AddressTableSize = support::endian::read64le(Ptr + 40);
+
+  const uint64_t CountsSize =
+      (NumTotalEntries + NumEntries[AggregatedLBREntry::BRANCH]) * CountWidth;
+  if (AddressTableSize > Buffer.size() ||
+      BinaryPreAggregatedHeaderSize + CountsSize + StringTableSize +
+              AddressTableSize > Buffer.size())
+    return reportMalformed("truncated file");
+
+  const char *Counts = Buffer.data() + BinaryPreAggregatedHeaderSize;
+  StringRef StringTable(Counts + CountsSize, StringTableSize);
+  const auto *Cur =
+      reinterpret_cast<const uint8_t *>(StringTable.end());
+  const auto *End = Cur + AddressTableSize;
+
+  // Build ids point directly into the buffer.
+  std::vector<StringRef> Strings;
+  Strings.reserve(NumStrings);
+  while (!StringTable.empty()) {
+    const auto Length = StringTable.find('\0');
+    if (Length == StringRef::npos)
+      return reportMalformed("unterminated string");
+    Strings.push_back(StringTable.substr(0, Length));
+    StringTable = StringTable.drop_front(Length + 1);
+  }
+  if (Strings.size() != NumStrings)
+    return reportMalformed("string table size mismatch");
+
+  auto readCount = [&](uint64_t Index) -> uint64_t {
+    const char *Count = Counts + Index * CountWidth;
+    return CountWidth == 4 ? support::endian::read32le(Count)
+                           : support::endian::read64le(Count);
+  };
+
+  auto readLocation = [&](uint64_t Base, Location &Loc) {
+    const char *Error{nullptr};
+    unsigned Size;
+    const auto ID = decodeULEB128(Cur, &Size, End, &Error);
+    if (Error || ID > Strings.size())
+      return false;
+    Cur += Size;
+    const auto Delta = decodeSLEB128(Cur, &Size, End, &Error);
+    if (Error)
+      return false;
+    Cur += Size;
+    const uint64_t Offset = Base + static_cast<uint64_t>(Delta);
+    Loc = ID ? Location(true, Strings[ID - 1], Offset) : Location(Offset);
+    return true;
+  };
+
+  const AggregatedLBREntry::Type Types[] = {
+      AggregatedLBREntry::BRANCH, AggregatedLBREntry::FT,
+      AggregatedLBREntry::FT_EXTERNAL_ORIGIN};
+  AggregatedLBRs.reserve(AggregatedLBRs.size() + NumTotalEntries);
+  uint64_t Index{0};
+  uint64_t PrevFrom{0};
+  for (const auto Type : Types) {
+    for (uint64_t I = 0; I < NumEntries[Type]; ++I, ++Index) {
+      Location From(0);
+      Location To(0);
+      if (!readLocation(PrevFrom, From) || !readLocation(From.Offset, To))
+        return reportMalformed("invalid address table");
+      PrevFrom = From.Offset;
+
+      if (auto *BF = getBinaryFunctionContainingAddress(From.Offset))
+        BF->setHasProfileAvailable();
+      if (auto *BF = getBinaryFunctionContainingAddress(To.Offset))
+        BF->setHasProfileAvailable();
+
+      const uint64_t Mispreds = Type == AggregatedLBREntry::BRANCH
+                                    ? readCount(NumTotalEntries + Index)
+                                    : 0;
+      AggregatedLBRs.emplace_back(
+          AggregatedLBREntry{From, To, readCount(Index), Mispreds, Type});
+    }
+  }
+
+  return std::error_code();
+}
+
+std::error_code DataAggregator::writeBinaryPreAggregatedFile(
+    StringRef OutputFilename, std::vector<AggregatedLBREntry> &Entries) {
+  // Group entries by type and sort them by address to keep deltas small.
+  auto getKey = [](const AggregatedLBREntry &Entry) {
+    return std::make_tuple(Entry.EntryType, Entry.From.IsSymbol,
+                           Entry.From.Name, Entry.From.Offset,
+                           Entry.To.IsSymbol, Entry.To.Name, Entry.To.Offset);
+  };
+  std::sort(Entries.begin(), Entries.end(),
+            [&](const AggregatedLBREntry &A, const AggregatedLBREntry &B) {
+              return getKey(A) < getKey(B);
+            });
+
+  // Merge duplicate entries.
+  size_t NumUnique{0};
+  for (size_t I = 0; I < Entries.size(); ++I) {
+    if (NumUnique && getKey(Entries[NumUnique - 1]) == getKey(Entries[I])) {
+      Entries[NumUnique - 1].Count += Entries[I].Count;
+      Entries[NumUnique - 1].Mispreds += Entries[I].Mispreds;
+      continue;
+    }
+    Entries[NumUnique++] = Entries[I];
+  }
+  Entries.erase(Entries.begin() + NumUnique, Entries.end());
+
+  StringMap<uint32_t> StringIDs;
+  std::string StringTable;
+  auto getStringID = [&](const Location &Loc) -> uint32_t {
+    if (!Loc.IsSymbol)
+      return 0;
+    auto Res = StringIDs.insert(std::make_pair(Loc.Name, StringIDs.size() + 1));
+    if (Res.second) {
+      StringTable += Loc.Name;
+      StringTable.push_back('\0');
+    }
+    return Res.first->second;
+  };
+
+  uint64_t NumEntries[3] = {0, 0, 0};
+  uint64_t MaxCount{0};
+  std::string AddressTable;
+  raw_string_ostream AddressOS(AddressTable);
+  uint64_t PrevFrom{0};
+  for (const auto &Entry : Entries) {
+    ++NumEntries[Entry.EntryType];
+    MaxCount = std::max(MaxCount, std::max(Entry.Count, Entry.Mispreds));
+    encodeULEB128(getStringID(Entry.From), AddressOS);
+    encodeSLEB128(static_cast<int64_t>(Entry.From.Offset - PrevFrom),
+                  AddressOS);
+    encodeULEB128(getStringID(Entry.To), AddressOS);
+    encodeSLEB128(static_cast<int64_t>(Entry.To.Offset - Entry.From.Offset),
+                  AddressOS);
+    PrevFrom = Entry.From.Offset;
+  }
+  AddressOS.flush();
+
+  const uint32_t CountWidth = MaxCount > UINT32_MAX ? 8 : 4;
+  const auto NumBranches = NumEntries[AggregatedLBREntry::BRANCH];
+  std::vector<char> Counts((Entries.size() + NumBranches) * CountWidth);
+  auto writeCount = [&](uint64_t Index, uint64_t Count) {
+    char *Ptr = Counts.data() + Index * CountWidth;
+    if (CountWidth == 4)
+      support::endian::write32le(Ptr, Count);
+    else
+      support::endian::write64le(Ptr, Count);
+  };
+  for (size_t I = 0; I < Entries.size(); ++I) {
+    writeCount(I, Entries[I].Count);
+    if (I < NumBranches)
+      writeCount(Entries.size() + I, Entries[I].Mispreds);
+  }
+
+  char Header[BinaryPreAggregatedHeaderSize];
+  memcpy(Header, BinaryPreAggregatedMagic,
+         sizeof(BinaryPreAggregatedMagic) - 1);
+  support::endian::write32le(Header + 8, BinaryPreAggregatedVersion);
+  support::endian::write32le(Header + 12, CountWidth);
+  for (unsigned I = 0; I < 3; ++I)
+    support::endian::write64le(Header + 16 + I * 8, NumEntries[I]);
+  support::endian::write32le(Header + 40, StringIDs.size());
+  support::endian::write32le(Header + 44, StringTable.size());
+  support::endian::write64le(Header + 48, AddressTable.size());
+
+  std::error_code EC;
+  raw_fd_ostream OutFile(OutputFilename, EC, sys::fs::OpenFlags::F_None);
+  if (EC)
+    return EC;
+  OutFile.write(Header, sizeof(Header));
+  OutFile.write(Counts.data(), Counts.size());
+  OutFile << StringTable << AddressTable;
+
+  outs() << "PERF2BOLT: wrote " << Entries.size()
+         << " pre-aggregated entries to " << OutputFilename << "\n";
+
+  return std::error_code();
+}
+
 void DataAggregator::processPreAggregated() {
   outs() << "PERF2BOLT: processing pre-aggregated profile...\n";
   NamedRegionTimer T("processAggregated", "Processing aggregated branch events",
@@ -1799,6 +3579,13 @@ void DataAggregator::processPreAggregated() {
 
   outs() << "PERF2BOLT: read " << AggregatedLBRs.size()
          << " aggregated LBR entries\n";
+
+  if (!opts::WritePreAggregated.empty()) {
+    if (auto EC = writeBinaryPreAggregatedFile(opts::WritePreAggregated,
+                                               AggregatedLBRs))
+      report_error("cannot write pre-aggregated file", EC);
+  }
+
   outs() << "PERF2BOLT: traces mismatching disassembled function contents: "
          << NumInvalidTraces;
   float Perc{0.0f};
@@ -2008,30 +3795,57 @@ std::error_code DataAggregator::parseMMapEvents() {
                      TimerGroupDesc, opts::TimeAggregator);
 
   std::multimap<StringRef, MMapInfo> GlobalMMapInfo;
+  if (PerfReader) {
+    PerfDataReader::RecordHandlers Handlers;
+    Handlers.MMap = [&](const PerfDataReader::MMapEvent &Event) {
+      if (Event.FileName.startswith("//") || Event.FileName.startswith("["))
+        return;
+
+      MMapInfo ParsedInfo;
+      ParsedInfo.PID = Event.PID;
+      ParsedInfo.BaseAddress = Event.Address;
+      ParsedInfo.Size = Event.Size;
+      ParsedInfo.Offset = Event.Offset;
+      ParsedInfo.Time = Event.Time;
+      registerMMapEvent(
+          GlobalMMapInfo,
+          std::make_pair(sys::path::filename(Event.FileName), ParsedInfo));
+    };
+    if (std::error_code EC = PerfReader->readRecords(Handlers))
+      return EC;
+  }
+
   while (hasData()) {
     auto FileMMapInfoRes = parseMMapEvent();
     if (std::error_code EC = FileMMapInfoRes.getError())
       return EC;
 
-    auto FileMMapInfo = FileMMapInfoRes.get();
-    if (FileMMapInfo.second.PID == -1)
-      continue;
+    registerMMapEvent(GlobalMMapInfo, FileMMapInfoRes.get());
+  }
 
-    // Consider only the first mapping of the file for any given PID
-    bool PIDExists = false;
-    auto Range = GlobalMMapInfo.equal_range(FileMMapInfo.first);
-    for (auto MI = Range.first; MI != Range.second; ++MI) {
-      if (MI->second.PID == FileMMapInfo.second.PID) {
-        PIDExists = true;
-        break;
-      }
-    }
-    if (PIDExists)
-      continue;
+  matchBinaryMMapInfo(GlobalMMapInfo);
+
+  return std::error_code();
+}
+
+void DataAggregator::registerMMapEvent(
+    std::multimap<StringRef, MMapInfo> &GlobalMMapInfo,
+    const std::pair<StringRef, MMapInfo> &FileMMapInfo) {
+  if (FileMMapInfo.second.PID == -1)
+    return;
 
-    GlobalMMapInfo.insert(FileMMapInfo);
+  // Consider only the first mapping of the file for any given PID
+  auto Range = GlobalMMapInfo.equal_range(FileMMapInfo.first);
+  for (auto MI = Range.first; MI != Range.second; ++MI) {
+    if (MI->second.PID == FileMMapInfo.second.PID)
+      return;
   }
 
+  GlobalMMapInfo.insert(FileMMapInfo);
+}
+
+void DataAggregator::matchBinaryMMapInfo(
+    const std::multimap<StringRef, MMapInfo> &GlobalMMapInfo) {
   DEBUG(
     dbgs() << "FileName -> mmap info:\n";
     for (const auto &Pair : GlobalMMapInfo) {
@@ -2066,6 +3880,7 @@ std::error_code DataAggregator::parseMMapEvents() {
       if (!MatchFound) {
         errs() << "PERF2BOLT-WARNING: ignoring mapping of " << NameToUse
                << " at 0x" << Twine::utohexstr(I->second.BaseAddress) << '\n';
+        ++NumIgnoredMMaps;
         continue;
       }
     }
@@ -2073,6 +3888,21 @@ std::error_code DataAggregator::parseMMapEvents() {
     BinaryMMapInfo.insert(std::make_pair(I->second.PID, I->second));
   }
 
+  if (opts::CrossDSOProfile) {
+    std::map<StringRef, unsigned> DSOIds;
+    for (const auto &Pair : GlobalMMapInfo) {
+      if (Pair.first == NameToUse || !BinaryMMapInfo.count(Pair.second.PID))
+        continue;
+      auto IdIter = DSOIds.find(Pair.first);
+      if (IdIter == DSOIds.end()) {
+        IdIter = DSOIds.emplace(Pair.first, ForeignDSONames.size()).first;
+        ForeignDSONames.emplace_back(Pair.first);
+      }
+      ForeignMMaps[Pair.second.PID][Pair.second.BaseAddress] =
+          ForeignMMapInfo{Pair.second, IdIter->second};
+    }
+  }
+
   if (BinaryMMapInfo.empty()) {
     if (errs().has_colors())
       errs().changeColor(raw_ostream::RED);
@@ -2093,8 +3923,6 @@ std::error_code DataAggregator::parseMMapEvents() {
 
     exit(1);
   }
-
-  return std::error_code();
 }
 
 std::error_code DataAggregator::parseTaskEvents() {
@@ -2102,39 +3930,31 @@ std::error_code DataAggregator::parseTaskEvents() {
   NamedRegionTimer T("parseTaskEvents", "Parsing task events", TimerGroupName,
                      TimerGroupDesc, opts::TimeAggregator);
 
+  if (PerfReader) {
+    PerfDataReader::RecordHandlers Handlers;
+    Handlers.CommExec = [&](const PerfDataReader::CommExecEvent &Event) {
+      registerCommExecEvent(Event.PID);
+    };
+    Handlers.Fork = [&](const PerfDataReader::ForkEvent &Event) {
+      ForkInfo FI;
+      FI.ParentPID = Event.ParentPID;
+      FI.ChildPID = Event.ChildPID;
+      FI.Time = Event.Time;
+      registerForkEvent(FI);
+    };
+    if (std::error_code EC = PerfReader->readRecords(Handlers))
+      return EC;
+  }
+
   while (hasData()) {
     if (auto CommInfo = parseCommExecEvent()) {
-      // Remove forked child that ran execve
-      auto MMapInfoIter = BinaryMMapInfo.find(*CommInfo);
-      if (MMapInfoIter != BinaryMMapInfo.end() &&
-          MMapInfoIter->second.Forked) {
-        BinaryMMapInfo.erase(MMapInfoIter);
-      }
+      registerCommExecEvent(*CommInfo);
       consumeRestOfLine();
       continue;
     }
 
-    auto ForkInfo = parseForkEvent();
-    if (!ForkInfo)
-      continue;
-
-    if (ForkInfo->ParentPID == ForkInfo->ChildPID)
-      continue;
-
-    if (ForkInfo->Time == 0) {
-      // Process was forked and mmaped before perf ran. In this case the child
-      // should have its own mmap entry unless it was execve'd.
-      continue;
-    }
-
-    auto MMapInfoIter = BinaryMMapInfo.find(ForkInfo->ParentPID);
-    if (MMapInfoIter == BinaryMMapInfo.end())
-      continue;
-
-    auto MMapInfo = MMapInfoIter->second;
-    MMapInfo.PID = ForkInfo->ChildPID;
-    MMapInfo.Forked = true;
-    BinaryMMapInfo.insert(std::make_pair(MMapInfo.PID, MMapInfo));
+    if (auto ForkInfo = parseForkEvent())
+      registerForkEvent(*ForkInfo);
   }
 
   outs() << "PERF2BOLT: input binary is associated with "
@@ -2151,6 +3971,39 @@ std::error_code DataAggregator::parseTaskEvents() {
   return std::error_code();
 }
 
+void DataAggregator::registerCommExecEvent(pid_t PID) {
+  // Remove forked child that ran execve
+  auto MMapInfoIter = BinaryMMapInfo.find(PID);
+  if (MMapInfoIter != BinaryMMapInfo.end() && MMapInfoIter->second.Forked)
+    BinaryMMapInfo.erase(MMapInfoIter);
+}
+
+void DataAggregator::registerForkEvent(const ForkInfo &FI) {
+  if (FI.ParentPID == FI.ChildPID)
+    return;
+
+  if (FI.Time == 0) {
+    // Process was forked and mmaped before perf ran. In this case the child
+    // should have its own mmap entry unless it was execve'd.
+    return;
+  }
+
+  auto MMapInfoIter = BinaryMMapInfo.find(FI.ParentPID);
+  if (MMapInfoIter == BinaryMMapInfo.end())
+    return;
+
+  auto MMapInfo = MMapInfoIter->second;
+  MMapInfo.PID = FI.ChildPID;
+  MMapInfo.Forked = true;
+  BinaryMMapInfo.insert(std::make_pair(MMapInfo.PID, MMapInfo));
+
+  auto ForeignIter = ForeignMMaps.find(FI.ParentPID);
+  if (ForeignIter != ForeignMMaps.end()) {
+    auto ChildMMaps = ForeignIter->second;
+    ForeignMMaps[FI.ChildPID] = std::move(ChildMMaps);
+  }
+}
+
 Optional<std::pair<StringRef, StringRef>>
 DataAggregator::parseNameBuildIDPair() {
   while (checkAndConsumeFS()) {}
@@ -2202,6 +4055,16 @@ DataAggregator::writeAggregatedFile(StringRef OutputFilename) const {
   uint64_t BranchValues{0};
   uint64_t MemValues{0};
 
+  // Ranges of lines with branches of each function for the index. The
+  // assignment of lines to functions matches DataReader::parse().
+  struct IndexEntry {
+    int64_t ExecutionCount{0};
+    std::vector<std::pair<uint64_t, uint64_t>> Ranges;
+  };
+  StringMap<IndexEntry> Index;
+  std::vector<StringRef> IndexOrder;
+  uint64_t MemDataOffset{0};
+
   if (BAT)
     OutFile << "boltedcollection\n";
   if (opts::BasicAggregation) {
@@ -2219,25 +4082,54 @@ DataAggregator::writeAggregatedFile(StringRef OutputFilename) const {
       }
     }
   } else {
+    auto addToIndex = [&](StringRef Name, uint64_t Start, uint64_t End) {
+      auto Res = Index.insert(std::make_pair(Name, IndexEntry()));
+      if (Res.second)
+        IndexOrder.push_back(Res.first->getKey());
+      auto &Ranges = Res.first->second.Ranges;
+      if (!Ranges.empty() &&
+          Ranges.back().first + Ranges.back().second == Start)
+        Ranges.back().second += End - Start;
+      else
+        Ranges.emplace_back(Start, End - Start);
+    };
+
+    auto writeBranch = [&](const bolt::BranchInfo &BI) {
+      const uint64_t Start = OutFile.tell();
+      writeLocation(BI.From);
+      writeLocation(BI.To);
+      OutFile << BI.Mispreds << " " << BI.Branches << "\n";
+      ++BranchValues;
+
+      if (!opts::WriteFdataIndex || (!BI.From.IsSymbol && !BI.To.IsSymbol))
+        return;
+      const uint64_t End = OutFile.tell();
+      auto getName = [](const Location &Loc) {
+        return Loc.Name.empty() ? StringRef("[unknown]") : Loc.Name;
+      };
+      const auto FromName = getName(BI.From);
+      const auto ToName = getName(BI.To);
+      addToIndex(FromName, Start, End);
+      if (BI.To.IsSymbol && (FromName != ToName || BI.To.Offset == 0))
+        addToIndex(ToName, Start, End);
+      if (BI.To.IsSymbol && BI.To.Offset == 0)
+        Index[ToName].ExecutionCount += BI.Branches;
+    };
+
     for (const auto &Func : NamesToBranches) {
-      for (const auto &BI : Func.getValue().Data) {
-        writeLocation(BI.From);
-        writeLocation(BI.To);
-        OutFile << BI.Mispreds << " " << BI.Branches << "\n";
-        ++BranchValues;
-      }
+      for (const auto &BI : Func.getValue().Data)
+        writeBranch(BI);
       for (const auto &BI : Func.getValue().EntryData) {
         // Do not output if source is a known symbol, since this was already
         // accounted for in the source function
         if (BI.From.IsSymbol)
           continue;
-        writeLocation(BI.From);
-        writeLocation(BI.To);
-        OutFile << BI.Mispreds << " " << BI.Branches << "\n";
-        ++BranchValues;
+        writeBranch(BI);
       }
     }
 
+    MemDataOffset = OutFile.tell();
+
     WriteMemLocs = true;
     for (const auto &Func : NamesToMemEvents) {
       for (const auto &MemEvent : Func.getValue().Data) {
@@ -2252,6 +4144,157 @@ DataAggregator::writeAggregatedFile(StringRef OutputFilename) const {
   outs() << "PERF2BOLT: wrote " << BranchValues << " objects and "
          << MemValues << " memory objects to " << OutputFilename << "\n";
 
+  if (opts::WriteFdataIndex && !opts::BasicAggregation) {
+    const auto IndexFilename = OutputFilename.str() + ".idx";
+    raw_fd_ostream IndexFile(IndexFilename, EC, sys::fs::OpenFlags::F_None);
+    if (EC)
+      return EC;
+    IndexFile << "fdata-index 1 " << Twine::utohexstr(OutFile.tell()) << " "
+              << Twine::utohexstr(MemDataOffset) << "\n";
+    for (const auto Name : IndexOrder) {
+      const auto &Entry = Index[Name];
+      IndexFile << Name << " " << Entry.ExecutionCount;
+      for (const auto &Range : Entry.Ranges)
+        IndexFile << " " << Twine::utohexstr(Range.first) << " "
+                  << Twine::utohexstr(Range.second);
+      IndexFile << "\n";
+    }
+    outs() << "PERF2BOLT: wrote index for " << IndexOrder.size()
+           << " functions to " << IndexFilename << "\n";
+  }
+
+  return std::error_code();
+}
+
+std::error_code DataAggregator::mergeAggregatedFile(StringRef FileName,
+                                                    double Decay) {
+  outs() << "PERF2BOLT: merging with profile " << FileName << "...\n";
+  NamedRegionTimer T("mergeProfile", "Merging existing profile",
+                     TimerGroupName, TimerGroupDesc, opts::TimeAggregator);
+
+  auto MB = MemoryBuffer::getFileOrSTDIN(FileName);
+  if (std::error_code EC = MB.getError())
+    return EC;
+  MergedFileBuf = std::move(*MB);
+  ParsingBuf = MergedFileBuf->getBuffer();
+  Col = 0;
+  Line = 1;
+
+  auto NoLBRFlagOrErr = maybeParseNoLBRFlag();
+  if (!NoLBRFlagOrErr)
+    return NoLBRFlagOrErr.getError();
+  auto BATFlagOrErr = maybeParseBATFlag();
+  if (!BATFlagOrErr)
+    return BATFlagOrErr.getError();
+  if (*NoLBRFlagOrErr != opts::BasicAggregation || *BATFlagOrErr != !!BAT) {
+    errs() << "PERF2BOLT-ERROR: " << FileName
+           << " was collected in a different mode\n";
+    return make_error_code(llvm::errc::invalid_argument);
+  }
+
+  auto scale = [&](int64_t Count) {
+    return static_cast<uint64_t>(std::llround(Count * Decay));
+  };
+
+  // Profile names are locations names, which could differ from the keys of
+  // the maps, so index existing entries by the IDs of their location names.
+  std::vector<FuncBranchData *> BranchDataByName;
+  auto getOrCreateBranchData = [&](StringRef Name) -> FuncBranchData *& {
+    const auto ID = Names.getID(Name);
+    if (ID >= BranchDataByName.size())
+      BranchDataByName.resize(ID + 1);
+    return BranchDataByName[ID];
+  };
+  for (auto &Entry : NamesToBranches)
+    getOrCreateBranchData(Entry.getValue().Name) = &Entry.getValue();
+  auto getFuncBranchData = [&](StringRef Name) {
+    auto &FBD = getOrCreateBranchData(Name);
+    if (!FBD) {
+      FBD = &NamesToBranches[Name];
+      FBD->Name = Names.intern(Name);
+    }
+    return FBD;
+  };
+
+  std::vector<FuncSampleData *> SampleDataByName;
+  auto getOrCreateSampleData = [&](StringRef Name) -> FuncSampleData *& {
+    const auto ID = Names.getID(Name);
+    if (ID >= SampleDataByName.size())
+      SampleDataByName.resize(ID + 1);
+    return SampleDataByName[ID];
+  };
+  for (auto &Entry : NamesToSamples)
+    getOrCreateSampleData(Entry.getValue().Name) = &Entry.getValue();
+
+  uint64_t NumEntries{0};
+  while (hasBranchData()) {
+    if (opts::BasicAggregation) {
+      auto SI = parseSampleInfo();
+      if (std::error_code EC = SI.getError())
+        return EC;
+      const auto Count = scale(SI->Hits);
+      if (!SI->Loc.IsSymbol || !Count)
+        continue;
+      internLocation(SI->Loc);
+      auto &FSD = getOrCreateSampleData(SI->Loc.Name);
+      if (!FSD) {
+        FSD = &NamesToSamples
+                   .insert(std::make_pair(
+                       SI->Loc.Name,
+                       FuncSampleData(SI->Loc.Name,
+                                      FuncSampleData::ContainerTy())))
+                   .first->second;
+      }
+      FSD->bumpCount(SI->Loc.Offset, Count);
+      ++NumEntries;
+      continue;
+    }
+
+    auto BI = parseBranchInfo();
+    if (std::error_code EC = BI.getError())
+      return EC;
+    const auto Count = scale(BI->Branches);
+    const auto Mispreds = std::min(scale(BI->Mispreds), Count);
+    if (!Count)
+      continue;
+    internLocation(BI->From);
+    internLocation(BI->To);
+    if (!BI->From.IsSymbol) {
+      if (BI->To.IsSymbol)
+        getFuncBranchData(BI->To.Name)
+            ->bumpEntryCount(BI->From, BI->To.Offset, Count, Mispreds);
+    } else if (BI->To.IsSymbol && BI->To.Name == BI->From.Name) {
+      getFuncBranchData(BI->From.Name)
+          ->bumpBranchCount(BI->From.Offset, BI->To.Offset, Count, Mispreds);
+    } else {
+      getFuncBranchData(BI->From.Name)
+          ->bumpCallCount(BI->From.Offset, BI->To, Count, Mispreds);
+    }
+    ++NumEntries;
+  }
+
+  while (hasMemData()) {
+    auto MI = parseMemInfo();
+    if (std::error_code EC = MI.getError())
+      return EC;
+    const auto Count = scale(MI->Count);
+    if (!Count)
+      continue;
+    internLocation(MI->Offset);
+    internLocation(MI->Addr);
+    NamesToMemEvents[MI->Offset.Name].update(MI->Offset, MI->Addr, Count);
+    ++NumEntries;
+  }
+
+  if (!ParsingBuf.empty()) {
+    reportError("expected branch or memory profile entry");
+    return make_error_code(llvm::errc::io_error);
+  }
+
+  outs() << "PERF2BOLT: merged " << NumEntries << " profile entries\n";
+  if (opts::Verbosity >= 1)
+    Names.printStats(outs(), "PERF2BOLT: ");
+
   return std::error_code();
 }
 
@@ -16,11 +16,15 @@
 #define LLVM_TOOLS_LLVM_BOLT_DATA_AGGREGATOR_H
 
 #include "DataReader.h"
+#include "PerfDataReader.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/Support/Error.h"
 #include "llvm/Support/Path.h"
 #include "llvm/Support/Program.h"
+#include <deque>
 #include <map>
 #include <unordered_map>
 
@@ -86,9 +90,33 @@ public:
   static bool checkPerfDataMagic(StringRef FileName);
 
 private:
+  /// Create a worker aggregator that parses a \p Chunk of perf script output
+  /// produced for the \p Parent aggregator. The worker shares the binary
+  /// context and the memory map info of the parent, but keeps its own
+  /// intermediate storage that is later merged into the parent.
+  DataAggregator(const DataAggregator &Parent, StringRef Chunk);
+
   struct PerfBranchSample {
     SmallVector<LBREntry, 32> LBR;
     uint64_t PC;
+    bool operator==(const PerfBranchSample &Other) const {
+      return PC == Other.PC && LBR.size() == Other.LBR.size() &&
+             std::equal(LBR.begin(), LBR.end(), Other.LBR.begin(),
+                        [](const LBREntry &A, const LBREntry &B) {
+                          return A.From == B.From && A.To == B.To &&
+                                 A.Mispred == B.Mispred;
+                        });
+    }
+  };
+
+  /// Hash of a whole LBR stack for de-duplicating samples.
+  struct PerfBranchSampleHash {
+    size_t operator()(const PerfBranchSample &Sample) const {
+      auto Hash = hash_value(Sample.PC);
+      for (const auto &LBR : Sample.LBR)
+        Hash = hash_combine(Hash, LBR.From, LBR.To, LBR.Mispred);
+      return Hash;
+    }
   };
 
   struct PerfBasicSample {
@@ -121,9 +149,51 @@ private:
     }
   };
 
+  /// DenseMap traits for traces. The hash mixes all bits of both addresses,
+  /// since shifting one of them out loses the high bits of 64-bit addresses.
   struct TraceHash {
-    size_t operator()(const Trace &L) const {
-      return std::hash<uint64_t>()(L.From << 32 | L.To);
+    static Trace getEmptyKey() { return Trace(-1ULL, -1ULL); }
+    static Trace getTombstoneKey() { return Trace(-2ULL, -2ULL); }
+    static unsigned getHashValue(const Trace &L) {
+      uint64_t Hash = L.From * 0x9E3779B97F4A7C15ULL ^ L.To;
+      Hash ^= Hash >> 33;
+      Hash *= 0xFF51AFD7ED558CCDULL;
+      Hash ^= Hash >> 33;
+      Hash *= 0xC4CEB9FE1A85EC53ULL;
+      Hash ^= Hash >> 33;
+      return static_cast<unsigned>(Hash);
+    }
+    static bool isEqual(const Trace &LHS, const Trace &RHS) {
+      return LHS == RHS;
+    }
+  };
+
+  /// Trace executed by a callee entered from the call at \p CallSite.
+  struct ContextTrace {
+    uint64_t CallSite;
+    uint64_t From;
+    uint64_t To;
+    ContextTrace(uint64_t CallSite, uint64_t From, uint64_t To)
+      : CallSite(CallSite), From(From), To(To) {}
+    bool operator==(const ContextTrace &Other) const {
+      return CallSite == Other.CallSite && From == Other.From &&
+             To == Other.To;
+    }
+  };
+
+  struct ContextTraceHash {
+    static ContextTrace getEmptyKey() {
+      return ContextTrace(-1ULL, -1ULL, -1ULL);
+    }
+    static ContextTrace getTombstoneKey() {
+      return ContextTrace(-2ULL, -2ULL, -2ULL);
+    }
+    static unsigned getHashValue(const ContextTrace &L) {
+      return TraceHash::getHashValue(Trace(L.From, L.To)) ^
+             TraceHash::getHashValue(Trace(L.CallSite, 0));
+    }
+    static bool isEqual(const ContextTrace &LHS, const ContextTrace &RHS) {
+      return LHS == RHS;
     }
   };
 
@@ -137,10 +207,28 @@ private:
     uint64_t MispredCount{0};
   };
 
+  /// Statistics gathered while parsing branch events.
+  struct BranchEventStats {
+    uint64_t NumTotalSamples{0};
+    uint64_t NumEntries{0};
+    uint64_t NumSamples{0};
+    uint64_t NumSamplesNoLBR{0};
+    uint64_t NumTraces{0};
+    uint64_t NumUniqueStacks{0};
+    bool NeedsSkylakeFix{false};
+  };
+
   /// Intermediate storage for profile data. We save the results of parsing
   /// and use them later for processing and assigning profile.
-  std::unordered_map<Trace, BranchInfo, TraceHash> BranchLBRs;
-  std::unordered_map<Trace, FTInfo, TraceHash> FallthroughLBRs;
+  DenseMap<Trace, BranchInfo, TraceHash> BranchLBRs;
+  DenseMap<Trace, FTInfo, TraceHash> FallthroughLBRs;
+  /// Traces of callees by call site with -context-profile. They are kept in
+  /// memory even if other traces are spilled.
+  DenseMap<ContextTrace, uint64_t, ContextTraceHash> ContextTraces;
+  /// LBR stacks read since the last flush with -dedup-lbr-stacks, with the
+  /// number of samples that recorded them.
+  std::unordered_map<PerfBranchSample, uint64_t, PerfBranchSampleHash>
+      LBRStacks;
   std::vector<AggregatedLBREntry> AggregatedLBRs;
   std::unordered_map<uint64_t, uint64_t> BasicSamples;
   std::vector<PerfMemSample> MemSamples;
@@ -153,14 +241,28 @@ private:
   /// Perf utility full path name
   std::string PerfPath;
 
+  /// Reader used instead of perf script jobs when perf.data is read directly.
+  std::unique_ptr<PerfDataReader> PerfReader;
+
   /// Perf process spawning bookkeeping
   struct PerfProcessInfo {
     bool IsFinished{false};
     sys::ProcessInfo PI;
     SmallVector<char, 256> StdoutPath;
     SmallVector<char, 256> StderrPath;
+    /// Read end of the pipe connected to perf stdout if the output is
+    /// streamed, -1 otherwise.
+    int StdoutFD{-1};
+    /// Arguments of the perf job if its output could be shared.
+    std::string Args;
   };
 
+  /// Keep the output of finished perf jobs for aggregators created later.
+  static bool SharePerfOutputs;
+
+  /// Outputs of finished perf jobs keyed by their arguments.
+  static StringMap<PerfProcessInfo> SharedPerfOutputs;
+
   /// Process info for spawned processes
   PerfProcessInfo MainEventsPPI;
   PerfProcessInfo MemEventsPPI;
@@ -171,9 +273,17 @@ private:
   /// https://www.kernel.org/doc/Documentation/x86/x86_64/mm.txt
   static constexpr uint64_t KernelBaseAddr = 0xffff800000000000;
 
+  /// Buffer owning the names of a profile merged with -merge-with.
+  std::unique_ptr<MemoryBuffer> MergedFileBuf;
+
   /// Current list of created temporary files
   std::vector<std::string> TempFiles;
 
+  /// Sorted runs of aggregated branches and fall-throughs spilled to disk
+  /// once the intermediate storage exceeded the memory limit.
+  std::vector<std::string> BranchSpills;
+  std::vector<std::string> FallthroughSpills;
+
   /// Name of the binary with matching build-id from perf.data if different
   /// from the file name in BC.
   std::string BuildIDBinaryName;
@@ -191,6 +301,27 @@ private:
   /// Per-PID map info for the binary
   std::unordered_map<uint64_t, MMapInfo> BinaryMMapInfo;
 
+  /// Mapping of another DSO in a process of the binary, with the index of
+  /// the DSO name in ForeignDSONames.
+  struct ForeignMMapInfo {
+    MMapInfo MMap;
+    unsigned DSOId;
+  };
+
+  /// Per-PID maps of other DSOs by base address, with -cross-dso-profile.
+  std::unordered_map<uint64_t, std::map<uint64_t, ForeignMMapInfo>>
+      ForeignMMaps;
+  std::deque<std::string> ForeignDSONames;
+
+  /// Addresses in other DSOs are replaced by the DSO id and the file offset
+  /// in the DSO, tagged so that they are never mistaken for code addresses.
+  static constexpr uint64_t ForeignAddressTag = 1ULL << 62;
+  static constexpr unsigned ForeignDSOIdShift = 40;
+
+  /// Branch counts between functions of the binary and other DSOs, keyed by
+  /// source and destination names.
+  std::map<std::pair<StringRef, StringRef>, uint64_t> CrossDSOBranches;
+
   /// Fork event info
   struct ForkInfo {
     pid_t ParentPID;
@@ -236,19 +367,43 @@ private:
   uint64_t NumInvalidTraces{0};
   uint64_t NumLongRangeTraces{0};
   uint64_t NumColdSamples{0};
+  uint64_t NumInterFragmentBranches{0};
+  mutable uint64_t NumKernelLBREntries{0};
+  uint64_t NumIgnoredMMaps{0};
+
+  /// Save the aggregation statistics for -print-profile-stats.
+  void recordCollectionStats();
+
+  /// Number of samples of every process mapping the binary, for
+  /// -check-profile.
+  mutable std::unordered_map<uint64_t, uint64_t> SamplesPerPID;
+
+  /// Report the coverage of the samples by the functions discovered from the
+  /// symbol table and by the mappings of the binary, without disassembling
+  /// the binary. Return false if the coverage is below
+  /// -check-profile-min-coverage.
+  bool checkProfile() const;
 
   /// Looks into system PATH for Linux Perf and set up the aggregator to use it
   void findPerfExecutable();
 
   /// Launch a perf subprocess with given args and save output for later
-  /// parsing.
+  /// parsing. If \p Stream is set, the output is sent to a pipe that has to be
+  /// consumed while perf is running.
   void launchPerfProcess(StringRef Name, PerfProcessInfo &PPI,
-                         const char *ArgsString, bool Wait);
+                         const char *ArgsString, bool Wait,
+                         bool Stream = false);
+
+  /// Wait for perf subprocess \p Process to finish and abort if it failed.
+  void waitForPerfProcess(StringRef Name, PerfProcessInfo &Process);
 
   /// Delete all temporary files created to hold the output generated by spawned
   /// subprocesses during the aggregation job
   void deleteTempFiles();
 
+  /// Delete files holding spilled traces
+  void deleteSpills();
+
   // Semantic pass helpers
 
   /// Look up which function contains an address by using out map of
@@ -278,6 +433,17 @@ private:
                      uint64_t From, uint64_t To, uint64_t Count,
                      uint64_t Mispreds);
 
+  /// Register a branch between two fragments of the same function of the
+  /// input binary, e.g. from a hot to a cold fragment, with BAT. It is a
+  /// branch within the function in the input binary.
+  bool doInterFragmentBranch(BinaryFunction &FromFunc, BinaryFunction &ToFunc,
+                             uint64_t From, uint64_t To, uint64_t Count,
+                             uint64_t Mispreds);
+
+  /// With BAT, return the function \p Func is a fragment of in the binary
+  /// processed by BOLT, or \p Func itself.
+  BinaryFunction &getBATParentFunction(BinaryFunction &Func);
+
   /// Register a \p Branch.
   bool doBranch(uint64_t From, uint64_t To, uint64_t Count, uint64_t Mispreds);
 
@@ -293,12 +459,24 @@ private:
   /// Print heat map based on LBR samples.
   std::error_code printLBRHeatMap();
 
+  /// Call \p Callback with the ranges of input addresses holding the code at
+  /// [\p From, \p To] in a binary processed by BOLT, if heat maps are
+  /// translated with -use-bat. Otherwise, or if the range is outside of the
+  /// translated functions, call it with the range itself.
+  void forEachHeatMapRange(
+      uint64_t From, uint64_t To,
+      function_ref<void(uint64_t From, uint64_t To)> Callback) const;
+
   /// Parse a single perf sample containing a PID associated with a sequence of
   /// LBR entries. If the PID does not correspond to the binary we are looking
   /// for, return std::errc::no_such_process. If other parsing errors occur,
   /// return the error. Otherwise, return the parsed sample.
   ErrorOr<PerfBranchSample> parseBranchSample();
 
+  /// Parse a window of consecutive branches printed by perf script from an
+  /// instruction trace with -itrace-window, as a branch stack.
+  ErrorOr<PerfBranchSample> parseITraceWindow();
+
   /// Parse a single perf sample containing a PID associated with an event name
   /// and a PC
   ErrorOr<PerfBasicSample> parseBasicSample();
@@ -327,6 +505,76 @@ private:
   /// Parse and pre-aggregate branch events.
   std::error_code parseBranchEvents();
 
+  /// Register a parsed branch \p Sample in the intermediate storage,
+  /// updating \p Stats. With -dedup-lbr-stacks, the sample is only counted
+  /// in LBRStacks and its branches are registered by flushLBRStacks(). Its PC
+  /// is then cleared unless it is used.
+  void registerBranchSample(PerfBranchSample &Sample, BranchEventStats &Stats);
+
+  /// Register the LBR stacks counted in LBRStacks and clear them.
+  void flushLBRStacks(BranchEventStats &Stats);
+
+  /// Register the branches and traces of \p Sample, recorded by \p Count
+  /// samples, in the intermediate storage, updating \p Stats.
+  void aggregateBranchSample(const PerfBranchSample &Sample,
+                             BranchEventStats &Stats, uint64_t Count = 1);
+
+  /// Follow the calls and returns in the LBR stack of \p Sample and record
+  /// the traces executed by every callee under its call site.
+  void aggregateContextTraces(const PerfBranchSample &Sample,
+                              const BranchEventStats &Stats,
+                              uint64_t Count);
+
+  /// Attach the blocks executed by callees from every call site recorded in
+  /// ContextTraces to the call instructions as ContextProfile annotations.
+  void attachContextProfiles(BinaryContext &BC);
+
+  /// Mark functions with recorded branches as having profile available and
+  /// report statistics gathered while parsing branch events.
+  void finishBranchEvents(const BranchEventStats &Stats);
+
+  /// Convert a sample read from perf.data into \p Sample, applying the same
+  /// filtering and address adjustments as parseBranchSample(). Return false if
+  /// the sample does not belong to the input binary.
+  bool convertPerfDataSample(const PerfDataReader::SampleEvent &Event,
+                             PerfBranchSample &Sample) const;
+
+  /// Read branch events directly from perf.data, updating \p Stats.
+  std::error_code readPerfDataBranchEvents(BranchEventStats &Stats);
+
+  /// Read branch events from the pipe connected to perf script block by block
+  /// and aggregate them, updating \p Stats.
+  std::error_code parseBranchEventsFromStream(BranchEventStats &Stats);
+
+  /// Estimate the memory used by BranchLBRs and FallthroughLBRs.
+  uint64_t getBranchStorageSize() const;
+
+  /// Write BranchLBRs and FallthroughLBRs to new sorted runs on disk and
+  /// release the memory they use.
+  std::error_code spillBranchEvents();
+
+  /// Merge sorted runs of traces \p Spills invoking \p Callback once for each
+  /// distinct trace with its counts summed across all runs.
+  static std::error_code
+  mergeSpills(const std::vector<std::string> &Spills,
+              function_ref<void(const Trace &, uint64_t, uint64_t)> Callback);
+
+  /// Load all spilled traces back into BranchLBRs and FallthroughLBRs.
+  std::error_code reloadSpills();
+
+  /// Parse and pre-aggregate branch events remaining in the parsing buffer,
+  /// updating \p Stats. Stop after \p MaxSamples samples were read.
+  std::error_code parseBranchEventsChunk(BranchEventStats &Stats,
+                                         uint64_t MaxSamples);
+
+  /// Split the parsing buffer on line boundaries into chunks, parse each chunk
+  /// on the thread pool using a worker aggregator, and merge the results.
+  std::error_code parseBranchEventsInParallel(BranchEventStats &Stats);
+
+  /// Merge intermediate branch storage of the worker aggregator \p Worker into
+  /// this one.
+  void mergeBranchEvents(const DataAggregator &Worker);
+
   /// Process all branch events.
   void processBranchEvents();
 
@@ -336,12 +584,18 @@ private:
   /// Parse the full output generated by perf script to report non-LBR samples.
   std::error_code parseBasicEvents();
 
+  /// Register a parsed non-LBR \p Sample in the intermediate storage.
+  void aggregateBasicSample(const PerfBasicSample &Sample);
+
   /// Process non-LBR events.
   void processBasicEvents();
 
   /// Parse the full output generated by perf script to report memory events.
   std::error_code parseMemEvents();
 
+  /// Register a parsed memory \p Sample in the intermediate storage.
+  void aggregateMemSample(const PerfMemSample &Sample);
+
   /// Process parsed memory events profile.
   void processMemEvents();
 
@@ -362,10 +616,26 @@ private:
   /// all PIDs.
   std::error_code parseMMapEvents();
 
+  /// Add mapping \p FileMMapInfo to \p GlobalMMapInfo unless the same file
+  /// was already mapped by the process.
+  void registerMMapEvent(std::multimap<StringRef, MMapInfo> &GlobalMMapInfo,
+                         const std::pair<StringRef, MMapInfo> &FileMMapInfo);
+
+  /// Populate BinaryMMapInfo with mappings of the input binary found in
+  /// \p GlobalMMapInfo.
+  void matchBinaryMMapInfo(
+      const std::multimap<StringRef, MMapInfo> &GlobalMMapInfo);
+
   /// Parse output of `perf script --show-task-events`, and forked processes
   /// to the set of tracked PIDs.
   std::error_code parseTaskEvents();
 
+  /// Stop tracking a forked child \p PID that ran execve.
+  void registerCommExecEvent(pid_t PID);
+
+  /// Start tracking a child forked from a tracked process.
+  void registerForkEvent(const ForkInfo &FI);
+
   /// Parse a single pair of binary full path and associated build-id
   Optional<std::pair<StringRef, StringRef>> parseNameBuildIDPair();
 
@@ -373,6 +643,10 @@ private:
   /// and return a file name matching a given \p FileBuildID.
   Optional<StringRef> getFileNameForBuildID(StringRef FileBuildID);
 
+  /// Report the result of matching the input binary build-id against the
+  /// profile. \p FileName is the name of the matching file in the profile.
+  void checkBuildIDFileName(Optional<StringRef> FileName);
+
   /// Coordinate reading and parsing of pre-aggregated file
   ///
   /// The regular perf2bolt aggregation job is to read perf output directly.
@@ -416,12 +690,44 @@ private:
   /// F 41be90 41be90 4
   /// B 4b1942 39b57f0 3 0
   /// B 4b196f 4b19e0 2 0
+  ///
+  /// The same data could be stored in a compact binary format recognized by
+  /// its magic. All values are little-endian:
+  ///
+  /// Header:
+  ///   char[8]   "BOLTPAGG"
+  ///   uint32    version (1)
+  ///   uint32    width in bytes of counts (4 or 8)
+  ///   uint64[3] number of B, F and f entries
+  ///   uint32    number of strings
+  ///   uint32    string table size in bytes
+  ///   uint64    address table size in bytes
+  /// Counts:     <count> of every entry, followed by <mispred_count> of every
+  ///             branch entry
+  /// Strings:    NUL-terminated build ids
+  /// Addresses:  for every entry, ULEB128 <start_id> (0 for none, otherwise
+  ///             the 1-based string index), SLEB128 <start_offset> minus
+  ///             <start_offset> of the previous entry, ULEB128 <end_id>, and
+  ///             SLEB128 <end_offset> minus <start_offset>
+  ///
+  /// Entries are grouped by type in the order B, F, f, and are sorted by
+  /// address within each group.
   void parsePreAggregated();
 
   /// Parse the full output of pre-aggregated LBR samples generated by
   /// an external tool.
   std::error_code parsePreAggregatedLBRSamples();
 
+  /// Load pre-aggregated LBR samples stored in the binary format from
+  /// \p Buffer.
+  std::error_code parseBinaryPreAggregatedLBRSamples(StringRef Buffer);
+
+  /// Write \p Entries to \p OutputFilename in the binary pre-aggregated
+  /// format.
+  static std::error_code
+  writeBinaryPreAggregatedFile(StringRef OutputFilename,
+                               std::vector<AggregatedLBREntry> &Entries);
+
   /// Process parsed pre-aggregated data.
   void processPreAggregated();
 
@@ -437,12 +743,26 @@ private:
       //  There aren't multiple executable segments loaded because MMapInfo
       //  doesn't support them.
       Address -= MMI.BaseAddress - MMI.Offset;
+    } else if (encodeForeignAddress(Address, MMI.PID)) {
+      // Keep the location in the other DSO for cross-DSO attribution.
     } else if (Address < MMI.Size) {
       // Make sure the address is not treated as belonging to the binary.
       Address = (-1ULL);
     }
   }
 
+  /// Replace \p Address with its encoding as a location in another DSO
+  /// mapped by process \p PID. Return false if no such DSO is known.
+  bool encodeForeignAddress(uint64_t &Address, pid_t PID) const;
+
+  /// If \p Address was encoded by encodeForeignAddress(), replace it with the
+  /// offset in the DSO and return the DSO name. Otherwise return an empty
+  /// name.
+  StringRef decodeForeignAddress(uint64_t &Address) const;
+
+  /// Print the branch counts between the binary and other DSOs.
+  void printCrossDSOBranches() const;
+
   /// Adjust addresses in \p LBR entry.
   void adjustLBR(LBREntry &LBR, const MMapInfo &MMI) const {
     adjustAddress(LBR.From, MMI);
@@ -465,9 +785,26 @@ private:
   /// Force all subprocesses to stop and cancel aggregation
   void abort();
 
+  /// Reuse the output of perf jobs across aggregators for different binaries
+  /// profiled in the same perf data. Outputs are kept on disk until
+  /// deleteSharedPerfOutputs() is called.
+  static void setSharePerfOutputs(bool Value) { SharePerfOutputs = Value; }
+
+  /// Delete temporary files holding shared perf outputs.
+  static void deleteSharedPerfOutputs();
+
+  /// Print the heat map from bucket counts saved earlier if requested with
+  /// -from-counts, without reading any profile. Return false if it was not
+  /// requested.
+  static bool printSavedHeatMap();
+
   /// Dump data structures into a file readable by llvm-bolt
   std::error_code writeAggregatedFile(StringRef OutputFilename) const;
 
+  /// Add the profile previously written to \p FileName by perf2bolt to the
+  /// aggregated data, scaling its counts by \p Decay.
+  std::error_code mergeAggregatedFile(StringRef FileName, double Decay);
+
   /// Filter out binaries based on PID
   void filterBinaryMMapInfo();
 
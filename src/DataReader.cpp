@@ -15,6 +15,7 @@
 
 #include "BinaryFunction.h"
 #include "DataReader.h"
+#include "ParallelUtilities.h"
 #include "Passes/MCF.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
@@ -29,6 +30,7 @@ namespace opts {
 
 extern cl::OptionCategory BoltCategory;
 extern llvm::cl::opt<unsigned> Verbosity;
+extern llvm::cl::opt<llvm::bolt::MCFCostFunction> DoMCF;
 
 static cl::opt<bool>
 DumpData("dump-data",
@@ -36,6 +38,15 @@ DumpData("dump-data",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<unsigned long long>
+ParallelFdataThreshold("parallel-fdata-threshold",
+  cl::desc("minimum size in bytes of branch data in the profile for parsing "
+           "it on multiple threads (0 disables parallel parsing)"),
+  cl::init(16ULL << 20),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
 } // namespace opts
 
 namespace llvm {
@@ -265,14 +276,15 @@ void MemInfo::prettyPrint(raw_ostream &OS) const {
   OS << "(PC: " << Offset << ", M: " << Addr << ", C: " << Count << ")";
 }
 
-void FuncMemData::update(const Location &Offset, const Location &Addr) {
+void FuncMemData::update(const Location &Offset, const Location &Addr,
+                         uint64_t Count) {
   auto Iter = EventIndex[Offset.Offset].find(Addr);
   if (Iter == EventIndex[Offset.Offset].end()) {
-    Data.emplace_back(MemInfo(Offset, Addr, 1));
+    Data.emplace_back(MemInfo(Offset, Addr, Count));
     EventIndex[Offset.Offset][Addr] = Data.size() - 1;
     return;
   }
-  ++Data[Iter->second].Count;
+  Data[Iter->second].Count += Count;
 }
 
 Error DataReader::preprocessProfile(BinaryContext &BC) {
@@ -281,6 +293,8 @@ Error DataReader::preprocessProfile(BinaryContext &BC) {
   }
 
   if (opts::DumpData) {
+    for (auto &FuncData : NamesToBranches)
+      loadBranchData(&FuncData.getValue());
     dump();
   }
 
@@ -319,12 +333,21 @@ Error DataReader::readProfilePreCFG(BinaryContext &BC) {
 
     for (auto &MI : MemoryData->Data) {
       const uint64_t Offset = MI.Offset.Offset;
-      auto II = Function.Instructions.find(Offset);
+      auto II = Function.findInstruction(Offset);
       if (II == Function.Instructions.end()) {
         // Ignore bad instruction address.
         continue;
       }
 
+      // Value profiles share the memory event record format, using a
+      // reserved name in place of the accessed address.
+      if (!MI.Addr.IsSymbol && MI.Addr.Name == "[value]") {
+        auto &VP = BC.MIB->getOrCreateAnnotationAs<ValueProfile>(
+            II->second, "ValueProfile");
+        VP.push_back({MI.Addr.Offset, MI.Count});
+        continue;
+      }
+
       auto &MemAccessProfile =
         BC.MIB->getOrCreateAnnotationAs<MemoryAccessProfile>(
             II->second, "MemoryAccessProfile");
@@ -348,11 +371,25 @@ Error DataReader::readProfilePreCFG(BinaryContext &BC) {
 }
 
 Error DataReader::readProfile(BinaryContext &BC) {
+  // Matching profiles to functions updates the shared profile state, hence
+  // it is done sequentially.
   for (auto &BFI : BC.getBinaryFunctions()) {
     auto &Function = BFI.second;
     readProfile(Function);
   }
 
+  // Attaching the matched branch data only modifies the function and uses
+  // annotation keys, hence it can run on multiple threads.
+  ParallelUtilities::runOnEachFunctionWithUniqueAllocId(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR,
+      [&](BinaryFunction &BF, MCPlusBuilder::AllocatorIdTy AllocatorId) {
+        attachBranchData(BF, AllocatorId);
+      },
+      [&](const BinaryFunction &BF) {
+        return !hasLBR() || BF.empty() || !getBranchData(BF);
+      },
+      "attachBranchData");
+
   uint64_t NumUnused{0};
   for (const auto &FuncData : NamesToBranches)
     if (!FuncData.getValue().Used)
@@ -380,6 +417,9 @@ std::error_code DataReader::parseInput() {
 
   buildLTONameMaps();
 
+  if (opts::Verbosity >= 1)
+    Names.printStats(outs(), "BOLT-INFO: profile reader ");
+
   return std::error_code();
 }
 
@@ -398,6 +438,11 @@ void DataReader::readProfile(BinaryFunction &BF) {
   // Possibly assign/re-assign branch profile data.
   matchProfileData(BF);
 
+  loadBranchData(getBranchData(BF));
+}
+
+void DataReader::attachBranchData(BinaryFunction &BF,
+                                  MCPlusBuilder::AllocatorIdTy AllocatorId) {
   FuncBranchData *FBD = getBranchData(BF);
   if (!FBD)
     return;
@@ -410,6 +455,9 @@ void DataReader::readProfile(BinaryFunction &BF) {
   // instruction in a predecessor fall-through block is a call. This situation
   // should rarely happen because there are few multiple-entry functions.
   for (const auto &BI : FBD->EntryData) {
+    // Entries from other DSOs are named after the DSO.
+    if (!BI.From.IsSymbol && BI.From.Name != "[unknown]")
+      BF.ExternalEntryCount += BI.Branches;
     BinaryBasicBlock *BB = BF.getBasicBlockAtOffset(BI.To.Offset);
     if (BB && (BB->isEntryPoint() || BB->isLandingPad())) {
       auto Count = BB->getExecutionCount();
@@ -434,7 +482,7 @@ void DataReader::readProfile(BinaryFunction &BF) {
   }
 
   // Convert branch data into annotations.
-  convertBranchData(BF);
+  convertBranchData(BF, AllocatorId);
 }
 
 void DataReader::matchProfileData(BinaryFunction &BF) {
@@ -444,7 +492,7 @@ void DataReader::matchProfileData(BinaryFunction &BF) {
   if (!hasLBR())
     return;
 
-  FuncBranchData *FBD = getBranchData(BF);
+  FuncBranchData *FBD = loadBranchData(getBranchData(BF));
   if (FBD) {
     BF.ProfileMatchRatio = evaluateProfileData(BF, *FBD);
     BF.RawBranchCount = FBD->getNumExecutedBranches();
@@ -471,7 +519,7 @@ void DataReader::matchProfileData(BinaryFunction &BF) {
     if (NewBranchData->Used)
       continue;
 
-    if (evaluateProfileData(BF, *NewBranchData) != 1.0f)
+    if (evaluateProfileData(BF, *loadBranchData(NewBranchData)) != 1.0f)
       continue;
 
     if (FBD)
@@ -506,7 +554,7 @@ void DataReader::matchProfileMemData(BinaryFunction &BF) {
 bool DataReader::fetchProfileForOtherEntryPoints(BinaryFunction &BF) {
   auto &BC = BF.getBinaryContext();
 
-  FuncBranchData *FBD = getBranchData(BF);
+  FuncBranchData *FBD = loadBranchData(getBranchData(BF));
   if (!FBD)
     return false;
 
@@ -523,7 +571,7 @@ bool DataReader::fetchProfileForOtherEntryPoints(BinaryFunction &BF) {
       // Look for branch data associated with this entry point
       if (auto *BD = BC.getBinaryDataAtAddress(EntryAddress)) {
         if (FuncBranchData *Data = getBranchDataForSymbols(BD->getSymbols())) {
-          FBD->appendFrom(*Data, BB->getOffset());
+          FBD->appendFrom(*loadBranchData(Data), BB->getOffset());
           Data->Used = true;
           Updated = true;
         }
@@ -645,10 +693,14 @@ void DataReader::readSampleData(BinaryFunction &BF) {
 
   BF.ExecutionCount = TotalEntryCount;
 
-  estimateEdgeCounts(BF);
+  // Profile inference computes edge counts from scratch while post-processing
+  // the CFG.
+  if (opts::DoMCF != MCF_INFER)
+    estimateEdgeCounts(BF);
 }
 
-void DataReader::convertBranchData(BinaryFunction &BF) const {
+void DataReader::convertBranchData(
+    BinaryFunction &BF, MCPlusBuilder::AllocatorIdTy AllocatorId) const {
   auto &BC = BF.getBinaryContext();
 
   if (BF.empty())
@@ -677,20 +729,21 @@ void DataReader::convertBranchData(BinaryFunction &BF) const {
         (!BC.MIB->isCall(*Instr) && !BC.MIB->isIndirectBranch(*Instr)))
       continue;
 
-    auto setOrUpdateAnnotation = [&](StringRef Name, uint64_t Count) {
-      if (opts::Verbosity >= 1 && BC.MIB->hasAnnotation(*Instr, Name)) {
-        errs() << "BOLT-WARNING: duplicate " << Name << " info for offset 0x"
-               << Twine::utohexstr(BI.From.Offset)
+    auto setOrUpdateAnnotation =
+        [&](const MCPlus::AnnotationKey<uint64_t> &Key, uint64_t Count) {
+      if (opts::Verbosity >= 1 && BC.MIB->hasAnnotation(*Instr, Key)) {
+        errs() << "BOLT-WARNING: duplicate " << Key.getName()
+               << " info for offset 0x" << Twine::utohexstr(BI.From.Offset)
                << " in function " << BF << '\n';
       }
-      auto &Value = BC.MIB->getOrCreateAnnotationAs<uint64_t>(*Instr, Name);
+      auto &Value = BC.MIB->getOrCreateAnnotationAs(*Instr, Key, AllocatorId);
       Value += Count;
     };
 
     if (BC.MIB->isIndirectCall(*Instr) || BC.MIB->isIndirectBranch(*Instr)) {
       IndirectCallSiteProfile &CSP =
-        BC.MIB->getOrCreateAnnotationAs<IndirectCallSiteProfile>(
-            *Instr, "CallProfile");
+        BC.MIB->getOrCreateAnnotationAs(
+            *Instr, MCPlus::CallProfileAnnotation, AllocatorId);
       MCSymbol *CalleeSymbol{nullptr};
       if (BI.To.IsSymbol) {
         if (auto *BD = BC.getBinaryDataByName(BI.To.Name)) {
@@ -699,10 +752,10 @@ void DataReader::convertBranchData(BinaryFunction &BF) const {
       }
       CSP.emplace_back(CalleeSymbol, BI.Branches, BI.Mispreds);
     } else if (BC.MIB->getConditionalTailCall(*Instr)) {
-      setOrUpdateAnnotation("CTCTakenCount", BI.Branches);
-      setOrUpdateAnnotation("CTCMispredCount", BI.Mispreds);
+      setOrUpdateAnnotation(MCPlus::CTCTakenCountAnnotation, BI.Branches);
+      setOrUpdateAnnotation(MCPlus::CTCMispredCountAnnotation, BI.Mispreds);
     } else {
-      setOrUpdateAnnotation("Count", BI.Branches);
+      setOrUpdateAnnotation(MCPlus::CountAnnotation, BI.Branches);
     }
   }
 }
@@ -749,7 +802,7 @@ bool DataReader::recordBranch(BinaryFunction &BF,
     const auto *LastInstr = ToBB->getLastNonPseudoInstr();
     if (LastInstr) {
       const auto LastInstrOffset =
-        BC.MIB->getAnnotationWithDefault<uint32_t>(*LastInstr, "Offset");
+        BC.MIB->getAnnotationWithDefault(*LastInstr, MCPlus::OffsetAnnotation);
 
       // With old .fdata we are getting FT branches for "jcc,jmp" sequences.
       if (To == LastInstrOffset && BC.MIB->isUnconditionalBranch(*LastInstr)) {
@@ -1129,6 +1182,7 @@ std::error_code DataReader::parseInNoLBRMode() {
     if (!SI.Loc.IsSymbol)
       continue;
 
+    internLocation(SI.Loc);
     auto I = GetOrCreateFuncEntry(SI.Loc.Name);
     I->getValue().Data.emplace_back(std::move(SI));
   }
@@ -1144,6 +1198,9 @@ std::error_code DataReader::parseInNoLBRMode() {
     if (!MI.Offset.IsSymbol)
       continue;
 
+    internLocation(MI.Offset);
+    internLocation(MI.Addr);
+
     auto I = GetOrCreateFuncMemEntry(MI.Offset.Name);
     I->getValue().Data.emplace_back(std::move(MI));
   }
@@ -1206,16 +1263,20 @@ std::error_code DataReader::parse() {
   if (NoLBRMode)
     return parseInNoLBRMode();
 
-  while (hasBranchData()) {
-    auto Res = parseBranchInfo();
-    if (std::error_code EC = Res.getError())
-      return EC;
-
-    BranchInfo BI = Res.get();
+  // With an index, branch data is parsed on demand and only memory events
+  // are parsed here.
+  uint64_t MemDataOffset;
+  const bool IsIndexed = parseIndex(MemDataOffset);
+  if (IsIndexed)
+    ParsingBuf = FileBuf->getBuffer().drop_front(MemDataOffset);
 
+  auto addBranch = [&](BranchInfo BI) {
     // Ignore branches not involving known location.
     if (!BI.From.IsSymbol && !BI.To.IsSymbol)
-      continue;
+      return;
+
+    internLocation(BI.From);
+    internLocation(BI.To);
 
     auto I = GetOrCreateFuncEntry(BI.From.Name);
     I->getValue().Data.emplace_back(std::move(BI));
@@ -1235,6 +1296,28 @@ std::error_code DataReader::parse() {
       I = GetOrCreateFuncEntry(BI.To.Name);
       I->getValue().ExecutionCount += BI.Branches;
     }
+  };
+
+  const bool UseParallelParsing =
+      !IsIndexed && !opts::NoThreads && opts::ThreadCount > 1 &&
+      opts::ParallelFdataThreshold &&
+      ParsingBuf.size() >= opts::ParallelFdataThreshold;
+  if (UseParallelParsing) {
+    std::vector<std::vector<BranchInfo>> Shards;
+    if (std::error_code EC = parseBranchDataInParallel(Shards))
+      return EC;
+    // Keep the order of the file for a deterministic result.
+    for (auto &Shard : Shards)
+      for (auto &BI : Shard)
+        addBranch(std::move(BI));
+  }
+
+  while (!IsIndexed && !UseParallelParsing && hasBranchData()) {
+    auto Res = parseBranchInfo();
+    if (std::error_code EC = Res.getError())
+      return EC;
+
+    addBranch(Res.get());
   }
 
   while (hasMemData()) {
@@ -1248,6 +1331,9 @@ std::error_code DataReader::parse() {
     if (!MI.Offset.IsSymbol)
       continue;
 
+    internLocation(MI.Offset);
+    internLocation(MI.Addr);
+
     auto I = GetOrCreateFuncMemEntry(MI.Offset.Name);
     I->getValue().Data.emplace_back(std::move(MI));
   }
@@ -1265,6 +1351,155 @@ std::error_code DataReader::parse() {
   return std::error_code();
 }
 
+std::error_code DataReader::parseBranchDataInParallel(
+    std::vector<std::vector<BranchInfo>> &Shards) {
+  // Split the buffer at line boundaries into one chunk per thread.
+  std::vector<StringRef> Chunks;
+  StringRef Buf = ParsingBuf;
+  const size_t ChunkSize = Buf.size() / opts::ThreadCount + 1;
+  while (!Buf.empty()) {
+    auto End = Buf.find('\n', std::min(ChunkSize, Buf.size()) - 1);
+    End = End == StringRef::npos ? Buf.size() : End + 1;
+    Chunks.push_back(Buf.substr(0, End));
+    Buf = Buf.drop_front(End);
+  }
+
+  Shards.resize(Chunks.size());
+  std::vector<std::error_code> Errors(Chunks.size());
+  std::vector<StringRef> Remainders(Chunks.size());
+  ThreadPool &Pool = ParallelUtilities::getThreadPool();
+  for (size_t I = 0; I < Chunks.size(); ++I) {
+    Pool.async([&, I]() {
+      DataReader Shard(Filename);
+      Shard.ParsingBuf = Chunks[I];
+      Shard.Line = 1;
+      while (Shard.hasBranchData()) {
+        auto Res = Shard.parseBranchInfo();
+        if (!Res) {
+          Errors[I] = Res.getError();
+          return;
+        }
+        Shards[I].emplace_back(std::move(Res.get()));
+      }
+      Remainders[I] = Shard.ParsingBuf;
+    });
+  }
+  Pool.wait();
+
+  for (const auto &EC : Errors)
+    if (EC)
+      return EC;
+
+  // Branch data ends in the first chunk that was not parsed completely. The
+  // rest of the buffer is left for parsing memory events.
+  for (size_t I = 0; I < Chunks.size(); ++I) {
+    if (Remainders[I].empty())
+      continue;
+    ParsingBuf = StringRef(Remainders[I].data(),
+                           ParsingBuf.end() - Remainders[I].data());
+    Shards.resize(I + 1);
+    return std::error_code();
+  }
+  ParsingBuf = StringRef();
+
+  return std::error_code();
+}
+
+bool DataReader::parseIndex(uint64_t &MemDataOffset) {
+  const auto IndexName = Filename + ".idx";
+  auto MB = MemoryBuffer::getFile(IndexName);
+  if (!MB)
+    return false;
+
+  auto reportInvalid = [&]() {
+    Diag << "WARNING: ignoring invalid profile index " << IndexName << "\n";
+    return false;
+  };
+
+  StringRef Buf = (*MB)->getBuffer();
+  StringRef Header;
+  std::tie(Header, Buf) = Buf.split('\n');
+  SmallVector<StringRef, 16> Fields;
+  Header.split(Fields, FieldSeparator);
+  unsigned Version;
+  uint64_t FileSize;
+  if (Fields.size() != 4 || Fields[0] != "fdata-index" ||
+      Fields[1].getAsInteger(10, Version) || Version != 1 ||
+      Fields[2].getAsInteger(16, FileSize) ||
+      Fields[3].getAsInteger(16, MemDataOffset))
+    return reportInvalid();
+
+  if (FileSize != FileBuf->getBufferSize() || MemDataOffset > FileSize) {
+    Diag << "WARNING: profile index " << IndexName << " does not match "
+         << Filename << ", reading the whole profile\n";
+    return false;
+  }
+
+  std::vector<FuncBranchData> Functions;
+  while (!Buf.empty()) {
+    StringRef IndexLine;
+    std::tie(IndexLine, Buf) = Buf.split('\n');
+    if (IndexLine.empty())
+      continue;
+
+    Fields.clear();
+    IndexLine.split(Fields, FieldSeparator);
+    if (Fields.size() < 4 || Fields.size() % 2)
+      return reportInvalid();
+
+    FuncBranchData FBD(Fields[0], FuncBranchData::ContainerTy(),
+                       FuncBranchData::ContainerTy());
+    if (Fields[1].getAsInteger(10, FBD.ExecutionCount))
+      return reportInvalid();
+    for (unsigned I = 2; I < Fields.size(); I += 2) {
+      uint64_t Offset, Size;
+      if (Fields[I].getAsInteger(16, Offset) ||
+          Fields[I + 1].getAsInteger(16, Size) ||
+          Offset > MemDataOffset || Size > MemDataOffset - Offset)
+        return reportInvalid();
+      FBD.LazyRanges.emplace_back(Offset, Size);
+    }
+    Functions.emplace_back(std::move(FBD));
+  }
+
+  for (auto &FBD : Functions) {
+    const auto Name = FBD.Name;
+    NamesToBranches.insert(std::make_pair(Name, std::move(FBD)));
+  }
+  IndexBuf = std::move(*MB);
+
+  return true;
+}
+
+FuncBranchData *DataReader::loadBranchData(FuncBranchData *FBD) {
+  if (!FBD || FBD->LazyRanges.empty())
+    return FBD;
+
+  for (const auto &Range : FBD->LazyRanges) {
+    ParsingBuf = FileBuf->getBuffer().substr(Range.first, Range.second);
+    while (hasBranchData()) {
+      auto Res = parseBranchInfo();
+      if (!Res) {
+        Diag << "WARNING: invalid profile data for " << FBD->Name << '\n';
+        break;
+      }
+
+      BranchInfo &BI = Res.get();
+      internLocation(BI.From);
+      internLocation(BI.To);
+      if (BI.To.IsSymbol && BI.To.Name == FBD->Name &&
+          (!BI.From.Name.equals(BI.To.Name) || BI.To.Offset == 0))
+        FBD->EntryData.push_back(BI);
+      if (BI.From.Name == FBD->Name)
+        FBD->Data.emplace_back(std::move(BI));
+    }
+  }
+  FBD->LazyRanges.clear();
+  std::stable_sort(FBD->Data.begin(), FBD->Data.end());
+
+  return FBD;
+}
+
 void DataReader::buildLTONameMaps() {
   for (auto &FuncData : NamesToBranches) {
     const auto FuncName = FuncData.getKey();
@@ -15,6 +15,7 @@
 #ifndef LLVM_TOOLS_LLVM_BOLT_DATA_READER_H
 #define LLVM_TOOLS_LLVM_BOLT_DATA_READER_H
 
+#include "MCPlusBuilder.h"
 #include "ProfileReaderBase.h"
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/Optional.h"
@@ -59,8 +60,10 @@ struct Location {
       : IsSymbol(IsSymbol), Name(Name), Offset(Offset) {}
 
   bool operator==(const Location &RHS) const {
+    // Names interned by a profile reader share the storage.
     return IsSymbol == RHS.IsSymbol &&
-           Name == RHS.Name &&
+           ((Name.data() == RHS.Name.data() &&
+             Name.size() == RHS.Name.size()) || Name == RHS.Name) &&
            (Name == "[heap]" || Offset == RHS.Offset);
   }
 
@@ -123,6 +126,10 @@ struct FuncBranchData {
   /// Indicate if the data was used.
   bool Used{false};
 
+  /// Byte ranges of profile lines with branches of this function that are
+  /// not parsed yet when the profile is loaded using an index.
+  std::vector<std::pair<uint64_t, uint64_t>> LazyRanges;
+
   FuncBranchData() {}
 
   FuncBranchData(StringRef Name, ContainerTy Data)
@@ -216,9 +223,10 @@ struct FuncMemData {
 
   DenseMap<uint64_t, DenseMap<Location, size_t>> EventIndex;
 
-  /// Update \p Data with a memory event.  Events with the same
+  /// Update \p Data with \p Count memory events.  Events with the same
   /// \p Offset and \p Addr will be coalesced.
-  void update(const Location &Offset, const Location &Addr);
+  void update(const Location &Offset, const Location &Addr,
+              uint64_t Count = 1);
 
   FuncMemData() {}
 
@@ -304,9 +312,16 @@ public:
   }
 
 protected:
-  /// Read profile information available for the function.
+  /// Match profile information available for the function. Samples are
+  /// read here, while branch data is attached by attachBranchData().
   void readProfile(BinaryFunction &BF);
 
+  /// Attach branch data matched to \p BF. This only modifies \p BF and could
+  /// run concurrently for different functions, allocating annotations with
+  /// \p AllocatorId.
+  void attachBranchData(BinaryFunction &BF,
+                        MCPlusBuilder::AllocatorIdTy AllocatorId);
+
   /// In functions with multiple entry points, the profile collection records
   /// data for other entry points in a different function entry. This function
   /// attempts to fetch extra profile data for each secondary entry point.
@@ -335,7 +350,8 @@ protected:
   void readSampleData(BinaryFunction &BF);
 
   /// Convert function-level branch data into instruction annotations.
-  void convertBranchData(BinaryFunction &BF) const;
+  void convertBranchData(BinaryFunction &BF,
+                         MCPlusBuilder::AllocatorIdTy AllocatorId = 0) const;
 
   /// Update function \p BF profile with a taken branch.
   /// \p Count could be 0 if verification of the branch is required.
@@ -396,6 +412,29 @@ protected:
   ///
   std::error_code parseInNoLBRMode();
 
+  /// Read the index written by perf2bolt next to the profile, in a file with
+  /// the ".idx" suffix appended to the profile name. The index lists, for
+  /// every function, its execution count and the byte ranges of the profile
+  /// lines describing its branches:
+  ///
+  /// fdata-index 1 <profile size> <offset of memory events>
+  /// <function name> <execution count> {<offset> <size>}+
+  /// ...
+  ///
+  /// On success, create an entry for every function with the branch data
+  /// left unparsed until loadBranchData() is called, set \p MemDataOffset and
+  /// return true. Return false if there is no matching index.
+  bool parseIndex(uint64_t &MemDataOffset);
+
+  /// Parse branch lines at the start of ParsingBuf on multiple threads into
+  /// \p Shards, one per consecutive chunk of the buffer. Leave ParsingBuf at
+  /// the first line that is not a branch.
+  std::error_code
+  parseBranchDataInParallel(std::vector<std::vector<BranchInfo>> &Shards);
+
+  /// Parse branch data of \p FBD deferred by parseIndex(). Return \p FBD.
+  FuncBranchData *loadBranchData(FuncBranchData *FBD);
+
   /// Return branch data matching one of the names in \p FuncNames.
   FuncBranchData *
   getBranchDataForNames(const std::vector<StringRef> &FuncNames);
@@ -485,6 +524,12 @@ protected:
   /// Build suffix map once the profile data is parsed.
   void buildLTONameMaps();
 
+  /// Make the name of a symbol location \p Loc point to the name table.
+  void internLocation(Location &Loc) {
+    if (Loc.IsSymbol)
+      Loc.Name = Names.intern(Loc.Name);
+  }
+
   void reportError(StringRef ErrorMsg);
   bool expectAndConsumeFS();
   void consumeAllRemainingFS();
@@ -509,6 +554,8 @@ protected:
 
   /// An in-memory copy of the input data file - owns strings used in reader.
   std::unique_ptr<MemoryBuffer> FileBuf;
+  /// Index of the input data file - owns names of lazily loaded functions.
+  std::unique_ptr<MemoryBuffer> IndexBuf;
   raw_ostream &Diag;
   StringRef ParsingBuf;
   unsigned Line{0};
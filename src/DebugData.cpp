@@ -12,12 +12,15 @@
 #include "DebugData.h"
 #include "BinaryBasicBlock.h"
 #include "BinaryFunction.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/MC/MCSymbol.h"
 #include "llvm/MC/MCObjectWriter.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/LEB128.h"
 #include <algorithm>
 #include <cassert>
+#include <numeric>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt-debug-info"
@@ -55,46 +58,82 @@ uint64_t writeAddressRanges(
 
 } // namespace
 
-DebugRangesSectionWriter::DebugRangesSectionWriter(BinaryContext *BC) {
+DebugRangesSectionWriter::DebugRangesSectionWriter(BinaryContext *BC,
+                                                   bool IsPartial) {
   RangesBuffer = llvm::make_unique<RangesBufferVector>();
   RangesStream = llvm::make_unique<raw_svector_ostream>(*RangesBuffer);
   Writer =
     std::unique_ptr<MCObjectWriter>(BC->createObjectWriter(*RangesStream));
 
   // Add an empty range as the first entry;
-  SectionOffset += writeAddressRanges(Writer.get(), DebugAddressRangesVector{});
+  if (!IsPartial)
+    SectionOffset +=
+      writeAddressRanges(Writer.get(), DebugAddressRangesVector{});
 }
 
-uint64_t DebugRangesSectionWriter::addRanges(
-    DebugAddressRangesVector &&Ranges,
-    std::map<DebugAddressRangesVector, uint64_t> &CachedRanges) {
+uint64_t
+DebugRangesSectionWriter::addRanges(const DebugAddressRangesVector &Ranges) {
   if (Ranges.empty())
     return getEmptyRangesOffset();
 
-  const auto RI = CachedRanges.find(Ranges);
-  if (RI != CachedRanges.end())
-    return RI->second;
-
-  const uint64_t EntryOffset = addRanges(Ranges);
-  CachedRanges.emplace(std::move(Ranges), EntryOffset);
+  // Reading the SectionOffset and updating it should be atomic to guarantee
+  // unique and correct offsets in patches.
+  std::lock_guard<std::mutex> Lock(WriterMutex);
+  const auto EntryOffset = SectionOffset;
+  SectionOffset += writeAddressRanges(Writer.get(), Ranges);
 
   return EntryOffset;
 }
 
-uint64_t
-DebugRangesSectionWriter::addRanges(const DebugAddressRangesVector &Ranges) {
+uint64_t DebugRangeListsSectionWriter::addRanges(
+    const DebugAddressRangesVector &Ranges) {
   if (Ranges.empty())
     return getEmptyRangesOffset();
 
-  // Reading the SectionOffset and updating it should be atomic to guarantee
-  // unique and correct offsets in patches.
+  uint64_t BaseAddress = Ranges.front().LowPC;
+  for (const auto &Range : Ranges)
+    BaseAddress = std::min(BaseAddress, Range.LowPC);
+
+  // Entries following the base address.
+  SmallString<64> Entries;
+  raw_svector_ostream OS(Entries);
+  for (const auto &Range : Ranges) {
+    OS << static_cast<char>(dwarf::DW_RLE_offset_pair);
+    encodeULEB128(Range.LowPC - BaseAddress, OS);
+    encodeULEB128(Range.HighPC - BaseAddress, OS);
+  }
+  OS << static_cast<char>(dwarf::DW_RLE_end_of_list);
+
   std::lock_guard<std::mutex> Lock(WriterMutex);
   const auto EntryOffset = SectionOffset;
-  SectionOffset += writeAddressRanges(Writer.get(), Ranges);
+  Writer->write8(dwarf::DW_RLE_base_address);
+  Writer->writeLE64(BaseAddress);
+  Writer->writeBytes(OS.str());
+  SectionOffset += 1 + 8 + Entries.size();
 
   return EntryOffset;
 }
 
+size_t DebugRangesDedupTable::RangesHash::operator()(
+    const DebugAddressRangesVector &Ranges) const {
+  hash_code Hash = hash_value(Ranges.size());
+  for (const auto &Range : Ranges)
+    Hash = hash_combine(Hash, Range.LowPC, Range.HighPC);
+  return Hash;
+}
+
+DebugRangesDedupTable::ValueType *
+DebugRangesDedupTable::addRanges(const DebugAddressRangesVector &Ranges,
+                                 uint32_t UnitIndex) {
+  auto &Shard = Shards[RangesHash()(Ranges) % NumShards];
+  std::lock_guard<std::mutex> Lock(Shard.Mutex);
+  auto Result = Shard.Map.emplace(Ranges, EntryType(UnitIndex));
+  auto &Entry = Result.first->second;
+  Entry.OwnerIndex = std::min(Entry.OwnerIndex, UnitIndex);
+
+  return &*Result.first;
+}
+
 void DebugARangesSectionWriter::addCURanges(uint64_t CUOffset,
                                             DebugAddressRangesVector &&Ranges) {
   std::lock_guard<std::mutex> Lock(CUAddressRangesMutex);
@@ -207,6 +246,17 @@ void SimpleBinaryPatcher::addLE32Patch(uint32_t Offset, uint32_t NewValue) {
   addLEPatch(Offset, NewValue, 4);
 }
 
+void SimpleBinaryPatcher::append(SimpleBinaryPatcher &&Other) {
+  if (Patches.empty()) {
+    Patches = std::move(Other.Patches);
+  } else {
+    Patches.insert(Patches.end(),
+                   std::make_move_iterator(Other.Patches.begin()),
+                   std::make_move_iterator(Other.Patches.end()));
+  }
+  Other.Patches.clear();
+}
+
 void SimpleBinaryPatcher::patchBinary(std::string &BinaryContents) {
   for (const auto &Patch : Patches) {
     uint32_t Offset = Patch.first;
@@ -219,6 +269,39 @@ void SimpleBinaryPatcher::patchBinary(std::string &BinaryContents) {
   }
 }
 
+void SimpleBinaryPatcher::writePatched(raw_ostream &OS, StringRef Contents) {
+  // Patches are applied in offset order. Overlapping patches are merged into
+  // one region, where they are applied in the order they were added.
+  std::vector<size_t> Order(Patches.size());
+  std::iota(Order.begin(), Order.end(), 0);
+  std::stable_sort(Order.begin(), Order.end(), [&](size_t A, size_t B) {
+    return Patches[A].first < Patches[B].first;
+  });
+
+  uint64_t Written = 0;
+  std::string Region;
+  for (size_t I = 0, E = Order.size(); I < E;) {
+    const uint64_t Start = Patches[Order[I]].first;
+    uint64_t End = Start + Patches[Order[I]].second.size();
+    size_t J = I + 1;
+    for (; J < E && Patches[Order[J]].first < End; ++J)
+      End = std::max<uint64_t>(End, Patches[Order[J]].first +
+                                        Patches[Order[J]].second.size());
+    assert(End <= Contents.size() && "Applied patch runs over binary size.");
+
+    OS << Contents.slice(Written, Start);
+    Region = Contents.slice(Start, End).str();
+    std::sort(Order.begin() + I, Order.begin() + J);
+    for (; I < J; ++I) {
+      const auto &Patch = Patches[Order[I]];
+      Region.replace(Patch.first - Start, Patch.second.size(), Patch.second);
+    }
+    OS << Region;
+    Written = End;
+  }
+  OS << Contents.substr(Written);
+}
+
 void DebugAbbrevPatcher::addAttributePatch(
     const DWARFAbbreviationDeclaration *Abbrev,
     dwarf::Attribute AttrTag,
@@ -229,7 +312,7 @@ void DebugAbbrevPatcher::addAttributePatch(
       AbbrevAttrPatch{Abbrev, AttrTag, NewAttrTag, NewAttrForm});
 }
 
-void DebugAbbrevPatcher::patchBinary(std::string &Contents) {
+SimpleBinaryPatcher DebugAbbrevPatcher::getBytePatches() const {
   SimpleBinaryPatcher Patcher;
 
   for (const auto &Patch : AbbrevPatches) {
@@ -243,7 +326,15 @@ void DebugAbbrevPatcher::patchBinary(std::string &Contents) {
     Patcher.addBytePatch(Attribute->AttrOffset, Patch.NewAttr);
     Patcher.addBytePatch(Attribute->FormOffset, Patch.NewForm);
   }
-  Patcher.patchBinary(Contents);
+  return Patcher;
+}
+
+void DebugAbbrevPatcher::patchBinary(std::string &Contents) {
+  getBytePatches().patchBinary(Contents);
+}
+
+void DebugAbbrevPatcher::writePatched(raw_ostream &OS, StringRef Contents) {
+  getBytePatches().writePatched(OS, Contents);
 }
 
 
@@ -22,6 +22,7 @@
 #include <map>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
@@ -52,6 +53,11 @@ static inline bool operator<(const DebugAddressRange &LHS,
   return std::tie(LHS.LowPC, LHS.HighPC) < std::tie(RHS.LowPC, RHS.HighPC);
 }
 
+static inline bool operator==(const DebugAddressRange &LHS,
+                              const DebugAddressRange &RHS) {
+  return LHS.LowPC == RHS.LowPC && LHS.HighPC == RHS.HighPC;
+}
+
 /// DebugAddressRangesVector - represents a set of absolute address ranges.
 using DebugAddressRangesVector = SmallVector<DebugAddressRange, 2>;
 
@@ -99,25 +105,25 @@ using RangesBufferVector = SmallVector<char, 16>;
 /// Serializes the .debug_ranges DWARF section.
 class DebugRangesSectionWriter {
 public:
-  DebugRangesSectionWriter(BinaryContext *BC);
+  /// If \p IsPartial is set, the writer produces a part of the section, e.g.
+  /// for a single compilation unit, and the empty list reserved at the start
+  /// of the section is not written.
+  DebugRangesSectionWriter(BinaryContext *BC, bool IsPartial = false);
 
-  /// Add ranges with caching.
-  uint64_t
-  addRanges(DebugAddressRangesVector &&Ranges,
-            std::map<DebugAddressRangesVector, uint64_t> &CachedRanges);
+  virtual ~DebugRangesSectionWriter() {}
 
   /// Add ranges and return offset into section.
-  uint64_t addRanges(const DebugAddressRangesVector &Ranges);
+  virtual uint64_t addRanges(const DebugAddressRangesVector &Ranges);
 
   /// Returns an offset of an empty address ranges list that is always written
   /// to .debug_ranges
-  uint64_t getEmptyRangesOffset() const { return EmptyRangesOffset; }
+  static uint64_t getEmptyRangesOffset() { return EmptyRangesOffset; }
 
   std::unique_ptr<RangesBufferVector> finalize() {
     return std::move(RangesBuffer);
   }
 
-private:
+protected:
   std::unique_ptr<RangesBufferVector> RangesBuffer;
 
   std::unique_ptr<raw_svector_ostream> RangesStream;
@@ -127,13 +133,71 @@ private:
   std::mutex WriterMutex;
 
   /// Current offset in the section (updated as new entries are written).
-  /// Starts with 16 since the first 16 bytes are reserved for an empty range.
+  /// Starts with 16 since the first 16 bytes are reserved for an empty range,
+  /// unless the writer is partial.
   uint32_t SectionOffset{0};
 
   /// Offset of an empty address ranges list.
   static constexpr uint64_t EmptyRangesOffset{0};
 };
 
+/// Serializes range lists of DWARF 5 units for a part of .debug_rnglists that
+/// follows a section header. Each list is a DW_RLE_base_address entry with
+/// the lowest address of the list, followed by DW_RLE_offset_pair entries
+/// with ULEB128 offsets from it. Unlike .debug_ranges entries, these take a
+/// few bytes instead of two addresses each.
+class DebugRangeListsSectionWriter : public DebugRangesSectionWriter {
+public:
+  DebugRangeListsSectionWriter(BinaryContext *BC)
+    : DebugRangesSectionWriter(BC, /*IsPartial=*/true) {}
+
+  uint64_t addRanges(const DebugAddressRangesVector &Ranges) override;
+
+  /// Size of the header of a .debug_rnglists contribution without offsets.
+  static constexpr uint64_t HeaderSize{12};
+};
+
+/// Address range lists shared by all compilation units. A list used by
+/// several units is written once, to the part of the section of the unit with
+/// the lowest index among them, so that the output does not depend on the
+/// order in which units are processed. Safe to use from multiple threads.
+class DebugRangesDedupTable {
+public:
+  struct EntryType {
+    explicit EntryType(uint32_t OwnerIndex) : OwnerIndex(OwnerIndex) {}
+
+    /// Index of the unit that writes the list.
+    uint32_t OwnerIndex;
+
+    /// Offset of the list in the part of the section of the owner, or -1 if
+    /// the list was not written yet.
+    uint64_t Offset{-1ULL};
+  };
+
+  using ValueType = std::pair<const DebugAddressRangesVector, EntryType>;
+
+  /// Register \p Ranges used by the unit with index \p UnitIndex, and return
+  /// the entry of the list. The owner of the entry is final once all units
+  /// registered their lists. The entry is valid as long as the table is.
+  ValueType *addRanges(const DebugAddressRangesVector &Ranges,
+                       uint32_t UnitIndex);
+
+private:
+  struct RangesHash {
+    size_t operator()(const DebugAddressRangesVector &Ranges) const;
+  };
+
+  /// Lists are distributed over shards by their hash to reduce contention.
+  static constexpr size_t NumShards{64};
+
+  struct ShardType {
+    std::mutex Mutex;
+    std::unordered_map<DebugAddressRangesVector, EntryType, RangesHash> Map;
+  };
+
+  ShardType Shards[NumShards];
+};
+
 /// Serializes the .debug_aranges DWARF section.
 class DebugARangesSectionWriter {
 public:
@@ -206,6 +270,14 @@ public:
   virtual ~BinaryPatcher() {}
   /// Applies in-place modifications to the binary string \p BinaryContents .
   virtual void patchBinary(std::string &BinaryContents) = 0;
+
+  /// Write \p Contents with the modifications applied to \p OS. Patchers
+  /// replacing a few bytes override it to avoid copying all of \p Contents.
+  virtual void writePatched(raw_ostream &OS, StringRef Contents) {
+    std::string Data = Contents.str();
+    patchBinary(Data);
+    OS << Data;
+  }
 };
 
 /// Applies simple modifications to a binary string, such as directly replacing
@@ -243,7 +315,14 @@ public:
   /// needed to encode \p Value.
   void addUDataPatch(uint32_t Offset, uint64_t Value, uint64_t Size);
 
+  /// Move all patches of \p Other after the patches of this patcher.
+  void append(SimpleBinaryPatcher &&Other);
+
   void patchBinary(std::string &BinaryContents) override;
+
+  /// Write the unmodified ranges of \p Contents directly, so that only the
+  /// patched bytes are copied.
+  void writePatched(raw_ostream &OS, StringRef Contents) override;
 };
 
 /// Apply small modifications to the .debug_abbrev DWARF section.
@@ -269,6 +348,9 @@ private:
 
   std::unordered_set<AbbrevAttrPatch, AbbrevHash> AbbrevPatches;
 
+  /// Return the patches of attribute and form bytes.
+  SimpleBinaryPatcher getBytePatches() const;
+
 public:
   ~DebugAbbrevPatcher() { }
   /// Adds a patch to change an attribute of the abbreviation
@@ -283,6 +365,8 @@ public:
                          uint8_t NewAttrForm);
 
   void patchBinary(std::string &Contents) override;
+
+  void writePatched(raw_ostream &OS, StringRef Contents) override;
 };
 
 } // namespace bolt
@@ -0,0 +1,285 @@
+//===--- DisassemblyCache.cpp - On-disk cache of decoded instructions -----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "DisassemblyCache.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <cstring>
+
+#undef  DEBUG_TYPE
+#define DEBUG_TYPE "bolt"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace {
+
+const char DisassemblyCacheMagic[] = "BOLTDISC";
+constexpr size_t DisassemblyCacheMagicSize = sizeof(DisassemblyCacheMagic) - 1;
+
+enum OperandKind : uint8_t {
+  OK_Reg = 0,
+  OK_Imm,
+  OK_FPImm,
+};
+
+void writeString(raw_ostream &OS, StringRef Str) {
+  encodeULEB128(Str.size(), OS);
+  OS << Str;
+}
+
+/// Sequential decoder of the cache file. Once an error is encountered, all
+/// subsequent reads return zero values.
+class Decoder {
+  const uint8_t *Cur;
+  const uint8_t *End;
+  bool HasError{false};
+
+public:
+  explicit Decoder(StringRef Buffer)
+    : Cur(Buffer.bytes_begin()), End(Buffer.bytes_end()) {}
+
+  bool hasError() const { return HasError; }
+
+  bool atEnd() const { return HasError || Cur == End; }
+
+  uint64_t readULEB() {
+    if (HasError)
+      return 0;
+    unsigned Size;
+    const char *Error = nullptr;
+    const auto Value = decodeULEB128(Cur, &Size, End, &Error);
+    if (Error) {
+      HasError = true;
+      return 0;
+    }
+    Cur += Size;
+    return Value;
+  }
+
+  StringRef readBytes(uint64_t Size) {
+    if (HasError || Size > static_cast<uint64_t>(End - Cur)) {
+      HasError = true;
+      return StringRef();
+    }
+    StringRef Bytes(reinterpret_cast<const char *>(Cur), Size);
+    Cur += Size;
+    return Bytes;
+  }
+
+  StringRef readString() { return readBytes(readULEB()); }
+};
+
+/// Return true if all operands of \p Inst could be written to the cache.
+bool isCacheable(const MCInst &Inst) {
+  for (const auto &Operand : Inst) {
+    if (!Operand.isReg() && !Operand.isImm() && !Operand.isFPImm())
+      return false;
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+namespace llvm {
+namespace bolt {
+
+uint64_t DisassemblyCache::computeHash(ArrayRef<uint8_t> FunctionData) {
+  return hash_combine_range(FunctionData.begin(), FunctionData.end());
+}
+
+void DisassemblyCache::load(StringRef FileName, StringRef BuildID) {
+  auto MB = MemoryBuffer::getFile(FileName);
+  if (!MB)
+    return;
+
+  StringRef Contents = (*MB)->getBuffer();
+  if (!Contents.startswith(StringRef(DisassemblyCacheMagic,
+                                     DisassemblyCacheMagicSize))) {
+    errs() << "BOLT-WARNING: ignoring invalid disassembly cache " << FileName
+           << '\n';
+    return;
+  }
+
+  Decoder D(Contents.drop_front(DisassemblyCacheMagicSize));
+  if (D.readString() != BuildID) {
+    outs() << "BOLT-INFO: disassembly cache " << FileName
+           << " was created for a different binary and will be replaced\n";
+    return;
+  }
+
+  while (!D.atEnd()) {
+    const auto Address = D.readULEB();
+    FunctionEntry Entry;
+    Entry.Size = D.readULEB();
+    Entry.Hash = D.readULEB();
+    Entry.Body = D.readString();
+    Functions[Address] = Entry;
+  }
+
+  if (D.hasError()) {
+    errs() << "BOLT-WARNING: ignoring corrupted disassembly cache " << FileName
+           << '\n';
+    Functions.clear();
+    return;
+  }
+
+  Buffer = std::move(*MB);
+  DEBUG(dbgs() << "BOLT-DEBUG: loaded " << Functions.size()
+               << " functions from disassembly cache\n");
+}
+
+void DisassemblyCache::save(StringRef FileName, StringRef BuildID) {
+  if (NewFunctions.empty())
+    return;
+
+  std::error_code EC;
+  raw_fd_ostream OS(FileName, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-WARNING: cannot write disassembly cache " << FileName
+           << ": " << EC.message() << '\n';
+    return;
+  }
+
+  OS.write(DisassemblyCacheMagic, DisassemblyCacheMagicSize);
+  writeString(OS, BuildID);
+
+  // Functions recorded in this run replace the loaded ones. They are written
+  // in the order of addresses, since they are recorded in parallel.
+  std::vector<std::pair<uint64_t, const std::string *>> Records;
+  for (const auto &Record : NewFunctions) {
+    const auto *Data = reinterpret_cast<const uint8_t *>(Record.data());
+    Records.emplace_back(decodeULEB128(Data), &Record);
+  }
+  std::sort(Records.begin(), Records.end());
+  DenseSet<uint64_t> NewAddresses;
+  for (const auto &Record : Records) {
+    NewAddresses.insert(Record.first);
+    OS << *Record.second;
+  }
+
+  for (const auto &Entry : Functions) {
+    if (NewAddresses.count(Entry.first))
+      continue;
+    encodeULEB128(Entry.first, OS);
+    encodeULEB128(Entry.second.Size, OS);
+    encodeULEB128(Entry.second.Hash, OS);
+    writeString(OS, Entry.second.Body);
+  }
+}
+
+bool DisassemblyCache::lookup(BinaryFunction &BF,
+                              ArrayRef<uint8_t> FunctionData) const {
+  auto FI = Functions.find(BF.getAddress());
+  if (FI == Functions.end())
+    return false;
+
+  const auto &Entry = FI->second;
+  if (Entry.Size != BF.getSize() || Entry.Hash != computeHash(FunctionData))
+    return false;
+
+  Decoder D(Entry.Body);
+  std::vector<BinaryFunction::PredecodedInstruction> Instructions(
+      D.readULEB());
+  for (auto &PI : Instructions) {
+    PI.Offset = D.readULEB();
+    PI.Size = D.readULEB();
+    if (!PI.Size)
+      continue;
+    PI.Inst.setOpcode(D.readULEB());
+    PI.Inst.setFlags(D.readULEB());
+    const auto NumOperands = D.readULEB();
+    for (uint64_t I = 0; I < NumOperands && !D.hasError(); ++I) {
+      switch (D.readULEB()) {
+      case OK_Reg:
+        PI.Inst.addOperand(MCOperand::createReg(D.readULEB()));
+        break;
+      case OK_Imm:
+        PI.Inst.addOperand(MCOperand::createImm(D.readULEB()));
+        break;
+      case OK_FPImm: {
+        const uint64_t Bits = D.readULEB();
+        double Value;
+        std::memcpy(&Value, &Bits, sizeof(Value));
+        PI.Inst.addOperand(MCOperand::createFPImm(Value));
+        break;
+      }
+      default:
+        return false;
+      }
+    }
+    if (D.hasError())
+      return false;
+  }
+
+  if (D.hasError() || !D.atEnd())
+    return false;
+
+  BF.setPredecodedInstructions(std::move(Instructions));
+  return true;
+}
+
+void DisassemblyCache::record(const BinaryFunction &BF,
+                              ArrayRef<uint8_t> FunctionData) {
+  const auto &Instructions = BF.getPredecodedInstructions();
+  for (const auto &PI : Instructions) {
+    if (PI.Size && !isCacheable(PI.Inst))
+      return;
+  }
+
+  std::string Body;
+  raw_string_ostream BodyOS(Body);
+  encodeULEB128(Instructions.size(), BodyOS);
+  for (const auto &PI : Instructions) {
+    encodeULEB128(PI.Offset, BodyOS);
+    encodeULEB128(PI.Size, BodyOS);
+    if (!PI.Size)
+      continue;
+    encodeULEB128(PI.Inst.getOpcode(), BodyOS);
+    encodeULEB128(PI.Inst.getFlags(), BodyOS);
+    encodeULEB128(PI.Inst.getNumOperands(), BodyOS);
+    for (const auto &Operand : PI.Inst) {
+      if (Operand.isReg()) {
+        encodeULEB128(OK_Reg, BodyOS);
+        encodeULEB128(Operand.getReg(), BodyOS);
+      } else if (Operand.isImm()) {
+        encodeULEB128(OK_Imm, BodyOS);
+        encodeULEB128(static_cast<uint64_t>(Operand.getImm()), BodyOS);
+      } else {
+        uint64_t Bits;
+        const double Value = Operand.getFPImm();
+        std::memcpy(&Bits, &Value, sizeof(Bits));
+        encodeULEB128(OK_FPImm, BodyOS);
+        encodeULEB128(Bits, BodyOS);
+      }
+    }
+  }
+  BodyOS.flush();
+
+  std::string Record;
+  raw_string_ostream OS(Record);
+  encodeULEB128(BF.getAddress(), OS);
+  encodeULEB128(BF.getSize(), OS);
+  encodeULEB128(computeHash(FunctionData), OS);
+  writeString(OS, Body);
+  OS.flush();
+
+  std::lock_guard<std::mutex> Lock(NewFunctionsLock);
+  NewFunctions.emplace_back(std::move(Record));
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,92 @@
+//===--- DisassemblyCache.h - On-disk cache of instructions ----*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Cache of instructions decoded from an input binary. It is stored on disk
+// and reused by later runs on the same binary, e.g. with different profiles
+// or options, to skip the instruction decoder during disassembly.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_DISASSEMBLY_CACHE_H
+#define LLVM_TOOLS_LLVM_BOLT_DISASSEMBLY_CACHE_H
+
+#include "BinaryFunction.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llvm {
+namespace bolt {
+
+/// Instructions are cached per function and keyed by the function address,
+/// size and a hash of its contents. The whole cache is tied to the build-id
+/// of the input binary and is discarded if the build-id does not match.
+///
+/// The file starts with an 8-byte magic followed by the build-id and the
+/// functions. All integers are ULEB128-encoded. Each function is:
+///
+///   <address> <size> <hash> <body size> <number of instructions> <insns>
+///
+/// and each instruction:
+///
+///   <offset> <size> [<opcode> <flags> <number of operands> <operands>]
+///
+/// where the part in brackets is omitted for instructions that failed to
+/// decode, and every operand is a kind followed by a register number, an
+/// immediate, or the bits of a floating-point immediate. Function bodies are
+/// kept encoded in memory and decoded on lookup.
+class DisassemblyCache {
+  struct FunctionEntry {
+    uint64_t Size;
+    uint64_t Hash;
+    StringRef Body;
+  };
+
+  /// Contents of the loaded cache file.
+  std::unique_ptr<MemoryBuffer> Buffer;
+
+  /// Functions of the loaded cache indexed by address. Not modified after
+  /// load(), so lookups are safe to run concurrently with record().
+  DenseMap<uint64_t, FunctionEntry> Functions;
+
+  /// Encoded functions recorded in this run.
+  std::vector<std::string> NewFunctions;
+  std::mutex NewFunctionsLock;
+
+  static uint64_t computeHash(ArrayRef<uint8_t> FunctionData);
+
+public:
+  /// Read the cache from \p FileName if it exists and was created for a
+  /// binary with \p BuildID.
+  void load(StringRef FileName, StringRef BuildID);
+
+  /// Write the cache to \p FileName if new functions were recorded.
+  void save(StringRef FileName, StringRef BuildID);
+
+  /// Set predecoded instructions of \p BF from the cache and return true if
+  /// they were cached for the function with contents \p FunctionData.
+  bool lookup(BinaryFunction &BF, ArrayRef<uint8_t> FunctionData) const;
+
+  /// Record the predecoded instructions of \p BF with contents
+  /// \p FunctionData. Instructions with operands other than registers and
+  /// immediates are not cached. Safe to call concurrently.
+  void record(const BinaryFunction &BF, ArrayRef<uint8_t> FunctionData);
+
+  /// Return the number of functions in the loaded cache.
+  size_t size() const { return Functions.size(); }
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
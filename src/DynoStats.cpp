@@ -13,6 +13,8 @@
 #include "DynoStats.h"
 #include "BinaryBasicBlock.h"
 #include "BinaryFunction.h"
+#include "ParallelUtilities.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/ADT/StringRef.h"
 #include "llvm/MC/MCInst.h"
 #include "llvm/Support/CommandLine.h"
@@ -40,8 +42,59 @@ DynoStatsScale("dyno-stats-scale",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<bool>
+DynoStatsCache("dyno-stats-cache",
+  cl::desc("reuse the dyno stats of functions whose code and profile did not "
+           "change since they were last computed"),
+  cl::init(true),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
 } // namespace opts
 
+namespace {
+
+/// Dyno stats of a function and the fingerprint of the function they were
+/// computed for.
+struct CachedDynoStats {
+  uint64_t Hash{0};
+  bool Valid{false};
+  DynoStats Stats{false};
+};
+
+std::unordered_map<const BinaryFunction *, CachedDynoStats> StatsCache;
+
+/// Hash everything about \p BF that getDynoStats() depends on: block layout
+/// and profile, instruction opcodes, call targets and jump tables. This is
+/// much cheaper to compute than the stats themselves.
+uint64_t hashForDynoStats(const BinaryFunction &BF) {
+  const auto &BC = BF.getBinaryContext();
+  hash_code Hash = hash_combine(BF.isSimple(), BF.hasValidProfile(),
+                                BF.hasCanonicalCFG(),
+                                BF.getKnownExecutionCount());
+  for (const auto *BB : BF.layout()) {
+    Hash = hash_combine(Hash, BB, BB->getKnownExecutionCount());
+    for (const auto &Inst : *BB) {
+      Hash = hash_combine(Hash, Inst.getOpcode());
+      if (BC.MIB->isCall(Inst))
+        Hash = hash_combine(Hash, BC.MIB->getTargetSymbol(Inst),
+                            BC.MIB->getAnnotationWithDefault(
+                                Inst, MCPlus::CTCTakenCountAnnotation));
+    }
+    if (const auto *LastInstr = BB->getLastNonPseudoInstr())
+      Hash = hash_combine(Hash, BC.MIB->getJumpTable(*LastInstr));
+    auto BI = BB->branch_info_begin();
+    for (const auto *Succ : BB->successors()) {
+      Hash = hash_combine(Hash, Succ, BI->Count);
+      ++BI;
+    }
+  }
+  return Hash;
+}
+
+} // anonymous namespace
+
 namespace llvm {
 namespace bolt {
 
@@ -108,6 +161,44 @@ void DynoStats::operator+=(const DynoStats &Other) {
   }
 }
 
+DynoStats getDynoStats(BinaryContext &BC) {
+  // Make room for every function before going parallel, so the workers only
+  // update their own entries.
+  std::vector<CachedDynoStats *> Entries;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &Entry = StatsCache[&BFI.second];
+    if (!opts::DynoStatsCache)
+      Entry.Valid = false;
+    Entries.push_back(&Entry);
+  }
+
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
+    auto &Entry = StatsCache.at(&BF);
+    const auto Hash = hashForDynoStats(BF);
+    if (Entry.Valid && Entry.Hash == Hash)
+      return;
+    Entry.Stats = getDynoStats(BF);
+    Entry.Hash = Hash;
+    Entry.Valid = true;
+  };
+  ParallelUtilities::PredicateTy SkipFunc = [&](const BinaryFunction &BF) {
+    return !BF.isSimple();
+  };
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_BB_LINEAR, WorkFun, SkipFunc,
+      "getDynoStats");
+
+  // Sum up in address order so the result does not depend on scheduling.
+  DynoStats Stats(BC.isAArch64());
+  auto Entry = Entries.begin();
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    if (BFI.second.isSimple())
+      Stats += (*Entry)->Stats;
+    ++Entry;
+  }
+  return Stats;
+}
+
 DynoStats getDynoStats(const BinaryFunction &BF) {
   auto &BC = BF.getBinaryContext();
 
@@ -150,8 +241,8 @@ DynoStats getDynoStats(const BinaryFunction &BF) {
 
       uint64_t CallFreq = BBExecutionCount;
       if (BC.MIB->getConditionalTailCall(Instr)) {
-        CallFreq =
-          BC.MIB->getAnnotationWithDefault<uint64_t>(Instr, "CTCTakenCount");
+        CallFreq = BC.MIB->getAnnotationWithDefault(
+            Instr, MCPlus::CTCTakenCountAnnotation);
       }
       Stats[DynoStats::FUNCTION_CALLS] += CallFreq;
       if (BC.MIB->isIndirectCall(Instr)) {
@@ -131,37 +131,26 @@ DynoStats operator+(const DynoStats &A, const DynoStats &B);
 /// fixBranches().
 DynoStats getDynoStats(const BinaryFunction &BF);
 
-/// Return program-wide dynostats.
-template <typename FuncsType>
-inline DynoStats getDynoStats(const FuncsType &Funcs) {
-  bool IsAArch64 = Funcs.begin()->second.getBinaryContext().isAArch64();
-  DynoStats dynoStats(IsAArch64);
-  for (auto &BFI : Funcs) {
-    auto &BF = BFI.second;
-    if (BF.isSimple()) {
-      dynoStats += getDynoStats(BF);
-    }
-  }
-  return dynoStats;
-}
+/// Return program-wide dynostats. Functions are processed in parallel and
+/// the stats of a function are reused until its code or profile changes.
+DynoStats getDynoStats(BinaryContext &BC);
 
 /// Call a function with optional before and after dynostats printing.
-template <typename FnType, typename FuncsType>
+template <typename FnType>
 inline void
 callWithDynoStats(FnType &&Func,
-                  const FuncsType &Funcs,
+                  BinaryContext &BC,
                   StringRef Phase,
                   const bool Flag) {
-  bool IsAArch64 = Funcs.begin()->second.getBinaryContext().isAArch64();
-  DynoStats DynoStatsBefore(IsAArch64);
+  DynoStats DynoStatsBefore(BC.isAArch64());
   if (Flag) {
-    DynoStatsBefore = getDynoStats(Funcs);
+    DynoStatsBefore = getDynoStats(BC);
   }
 
   Func();
 
   if (Flag) {
-    const auto DynoStatsAfter = getDynoStats(Funcs);
+    const auto DynoStatsAfter = getDynoStats(BC);
     const auto Changed = (DynoStatsAfter != DynoStatsBefore);
     outs() << "BOLT-INFO: program-wide dynostats after running "
            << Phase << (Changed ? "" : " (no change)") << ":\n\n"
@@ -28,8 +28,9 @@
 #include "llvm/Support/LEB128.h"
 #include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 #include <functional>
-#include <map>
+#include <vector>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt-exceptions"
@@ -690,13 +691,25 @@ std::vector<char> CFIReaderWriter::generateEHFrameHeader(
     const DWARFDebugFrame &NewEHFrame,
     uint64_t EHFrameHeaderAddress,
     std::vector<uint64_t> &FailedAddresses) const {
-  // Common PC -> FDE map to be written into .eh_frame_hdr.
-  std::map<uint64_t, uint64_t> PCToFDE;
+  // PC -> FDE entries to be written into .eh_frame_hdr. The table is built
+  // from sorted vectors instead of a map since it can have 100Ks of entries.
+  using PCToFDETy = std::vector<std::pair<uint64_t, uint64_t>>;
+  PCToFDETy NewPCToFDE;
+  PCToFDETy OldPCToFDE;
+
+  auto comparePC = [](const PCToFDETy::value_type &A,
+                      const PCToFDETy::value_type &B) {
+    return A.first < B.first;
+  };
+  auto samePC = [](const PCToFDETy::value_type &A,
+                   const PCToFDETy::value_type &B) {
+    return A.first == B.first;
+  };
 
   // Presort array for binary search.
   std::sort(FailedAddresses.begin(), FailedAddresses.end());
 
-  // Initialize PCToFDE using NewEHFrame.
+  // Initialize PC-to-FDE entries using NewEHFrame.
   NewEHFrame.for_each_FDE([&](const dwarf::FDE *FDE) {
     const auto FuncAddress = FDE->getInitialLocation();
     const auto FDEAddress = NewEHFrame.getEHFrameAddress() + FDE->getOffset();
@@ -711,10 +724,16 @@ std::vector<char> CFIReaderWriter::generateEHFrameHeader(
       DEBUG(dbgs() << "BOLT-DEBUG: FDE for function at 0x"
                    << Twine::utohexstr(FuncAddress) << " is at 0x"
                    << Twine::utohexstr(FDEAddress) << '\n');
-      PCToFDE[FuncAddress] = FDEAddress;
+      NewPCToFDE.emplace_back(FuncAddress, FDEAddress);
     }
   });
 
+  // The last new FDE for a function takes precedence.
+  std::stable_sort(NewPCToFDE.begin(), NewPCToFDE.end(), comparePC);
+  NewPCToFDE.erase(NewPCToFDE.begin(),
+                   std::unique(NewPCToFDE.rbegin(), NewPCToFDE.rend(), samePC)
+                       .base());
+
   DEBUG(dbgs() << "BOLT-DEBUG: new .eh_frame contains "
                << std::distance(NewEHFrame.entries().begin(),
                                 NewEHFrame.entries().end())
@@ -727,14 +746,26 @@ std::vector<char> CFIReaderWriter::generateEHFrameHeader(
     const auto FDEAddress = OldEHFrame.getEHFrameAddress() + FDE->getOffset();
 
     // Add the address if we failed to write it.
-    if (PCToFDE.count(FuncAddress) == 0) {
+    if (!std::binary_search(NewPCToFDE.begin(), NewPCToFDE.end(),
+                            std::make_pair(FuncAddress, uint64_t(0)),
+                            comparePC)) {
       DEBUG(dbgs() << "BOLT-DEBUG: old FDE for function at 0x"
                    << Twine::utohexstr(FuncAddress) << " is at 0x"
                    << Twine::utohexstr(FDEAddress) << '\n');
-      PCToFDE[FuncAddress] = FDEAddress;
+      OldPCToFDE.emplace_back(FuncAddress, FDEAddress);
     }
   });
 
+  // The first old FDE for a function takes precedence.
+  std::stable_sort(OldPCToFDE.begin(), OldPCToFDE.end(), comparePC);
+  OldPCToFDE.erase(std::unique(OldPCToFDE.begin(), OldPCToFDE.end(), samePC),
+                   OldPCToFDE.end());
+
+  PCToFDETy PCToFDE;
+  PCToFDE.reserve(NewPCToFDE.size() + OldPCToFDE.size());
+  std::merge(NewPCToFDE.begin(), NewPCToFDE.end(), OldPCToFDE.begin(),
+             OldPCToFDE.end(), std::back_inserter(PCToFDE), comparePC);
+
   DEBUG(dbgs() << "BOLT-DEBUG: old .eh_frame contains "
                << std::distance(OldEHFrame.entries().begin(),
                                 OldEHFrame.entries().end())
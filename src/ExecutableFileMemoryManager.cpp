@@ -11,6 +11,11 @@
 
 #include "ExecutableFileMemoryManager.h"
 #include "RewriteInstance.h"
+#include "Telemetry.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/MathExtras.h"
+#include <cstdlib>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "efmm"
@@ -38,17 +43,11 @@ uint8_t *ExecutableFileMemoryManager::allocateSection(intptr_t Size,
                                                    Alignment);
     Section.setSectionID(SectionID);
     assert(!Section.isAllocatable() && "note sections cannot be allocatable");
+    Telemetry::recordSectionAllocation(SectionName, "note", Size);
     return DataCopy;
   }
 
-  uint8_t *Ret;
-  if (IsCode) {
-    Ret = SectionMemoryManager::allocateCodeSection(Size, Alignment,
-                                                    SectionID, SectionName);
-  } else {
-    Ret = SectionMemoryManager::allocateDataSection(Size, Alignment, SectionID,
-                                                    SectionName, IsReadOnly);
-  }
+  uint8_t *Ret = allocateFromArena(Size, Alignment);
 
   SmallVector<char, 256> Buf;
   if (ObjectsLoaded > 0) {
@@ -70,6 +69,8 @@ uint8_t *ExecutableFileMemoryManager::allocateSection(intptr_t Size,
   Section.setSectionID(SectionID);
   assert(Section.isAllocatable() &&
          "verify that allocatable is marked as allocatable");
+  Telemetry::recordSectionAllocation(
+      SectionName, IsCode ? "code" : (IsReadOnly ? "rodata" : "data"), Size);
 
   DEBUG(dbgs() << "BOLT: allocating "
                << (IsCode ? "code" : (IsReadOnly ? "read-only data" : "data"))
@@ -79,13 +80,65 @@ uint8_t *ExecutableFileMemoryManager::allocateSection(intptr_t Size,
   return Ret;
 }
 
+void ExecutableFileMemoryManager::reserveAllocationSpace(
+    uintptr_t CodeSize, uint32_t CodeAlign, uintptr_t RODataSize,
+    uint32_t RODataAlign, uintptr_t RWDataSize, uint32_t RWDataAlign) {
+  // The totals include padding between sections of the same kind, but not
+  // the alignment of the first section of each kind.
+  const uint64_t Size = CodeSize + CodeAlign + RODataSize + RODataAlign +
+                        RWDataSize + RWDataAlign;
+  if (!Size)
+    return;
+
+  auto *Buffer = static_cast<uint8_t *>(std::calloc(Size, 1));
+  if (!Buffer)
+    report_bad_alloc_error("cannot allocate section arena");
+  Arenas.emplace_back(Arena{Buffer, Size, 0});
+
+  DEBUG(dbgs() << "BOLT: reserved arena of " << Size << " bytes for code ("
+               << CodeSize << "), read-only data (" << RODataSize
+               << ") and data (" << RWDataSize << ")\n");
+}
+
+uint8_t *ExecutableFileMemoryManager::allocateFromArena(uint64_t Size,
+                                                        unsigned Alignment) {
+  Alignment = std::max(Alignment, 1u);
+  // The reservation may still have room after a section that did not fit
+  // into it got an arena of its own.
+  for (auto &A : llvm::reverse(Arenas)) {
+    const uint64_t Start =
+        alignAddr(A.Buffer + A.Used, Alignment) -
+        reinterpret_cast<uintptr_t>(A.Buffer);
+    if (Start + Size <= A.Size) {
+      A.Used = Start + Size;
+      return A.Buffer + Start;
+    }
+  }
+
+  // The reservation did not account for this section, e.g. for a section
+  // with stubs. Give it an arena of its own.
+  const uint64_t ArenaSize = Size + Alignment;
+  auto *Buffer = static_cast<uint8_t *>(std::calloc(ArenaSize, 1));
+  if (!Buffer)
+    report_bad_alloc_error("cannot allocate section arena");
+  const uint64_t Start =
+      alignAddr(Buffer, Alignment) - reinterpret_cast<uintptr_t>(Buffer);
+  Arenas.emplace_back(Arena{Buffer, ArenaSize, Start + Size});
+  return Buffer + Start;
+}
+
 bool ExecutableFileMemoryManager::finalizeMemory(std::string *ErrMsg) {
   DEBUG(dbgs() << "BOLT: finalizeMemory()\n");
   ++ObjectsLoaded;
-  return SectionMemoryManager::finalizeMemory(ErrMsg);
+  // Sections are never executed in place, hence there are no permissions to
+  // apply or caches to invalidate.
+  return false;
 }
 
-ExecutableFileMemoryManager::~ExecutableFileMemoryManager() { }
+ExecutableFileMemoryManager::~ExecutableFileMemoryManager() {
+  for (auto &A : Arenas)
+    std::free(A.Buffer);
+}
 
 }
 
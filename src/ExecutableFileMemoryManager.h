@@ -17,6 +17,7 @@
 #include "llvm/ADT/Twine.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/Support/raw_ostream.h"
+#include <vector>
 
 namespace llvm {
 
@@ -31,6 +32,20 @@ private:
                            StringRef SectionName,
                            bool IsCode,
                            bool IsReadOnly);
+
+  /// Return \p Size bytes aligned at \p Alignment from the current arena,
+  /// starting a new one if the reservation made for the object is exhausted.
+  uint8_t *allocateFromArena(uint64_t Size, unsigned Alignment);
+
+  /// Zero-initialized buffer holding allocatable sections of an object.
+  /// Pages past the used part are never touched and stay non-resident.
+  struct Arena {
+    uint8_t *Buffer;
+    uint64_t Size;
+    uint64_t Used;
+  };
+  std::vector<Arena> Arenas;
+
   BinaryContext &BC;
   bool AllowStubs;
 
@@ -64,6 +79,15 @@ public:
 
   bool allowStubAllocation() const override { return AllowStubs; }
 
+  /// Allocatable sections of every object are placed into a single arena
+  /// sized from the totals RuntimeDyld computes before loading the object.
+  bool needsToReserveAllocationSpace() override { return true; }
+
+  void reserveAllocationSpace(uintptr_t CodeSize, uint32_t CodeAlign,
+                              uintptr_t RODataSize, uint32_t RODataAlign,
+                              uintptr_t RWDataSize,
+                              uint32_t RWDataAlign) override;
+
   bool finalizeMemory(std::string *ErrMsg = nullptr) override;
 };
 
@@ -13,9 +13,12 @@
 #include "llvm/ADT/Twine.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Errc.h"
 #include "llvm/Support/FileSystem.h"
 #include "llvm/Support/Format.h"
+#include "llvm/Support/LineIterator.h"
 #include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/raw_ostream.h"
 #include <algorithm>
 #include <cmath>
@@ -62,6 +65,13 @@ void Heatmap::registerAddressRange(uint64_t StartAddress, uint64_t EndAddress,
   }
 }
 
+void Heatmap::merge(const Heatmap &Other) {
+  assert(BucketSize == Other.BucketSize && "mismatching bucket sizes");
+  for (const auto &Entry : Other.Map)
+    Map[Entry.first] += Entry.second;
+  NumSkippedRanges += Other.NumSkippedRanges;
+}
+
 void Heatmap::print(StringRef FileName) const {
   std::error_code EC;
   raw_fd_ostream OS(FileName, EC, sys::fs::OpenFlags::F_None);
@@ -72,30 +82,30 @@ void Heatmap::print(StringRef FileName) const {
   print(OS);
 }
 
-void Heatmap::print(raw_ostream &OS) const {
+namespace {
+
+void changeColor(raw_ostream &OS, raw_ostream::Colors Color) {
+  static auto CurrentColor = raw_ostream::BLACK;
+  if (CurrentColor == Color)
+    return;
+  OS.changeColor(Color);
+  CurrentColor = Color;
+}
+
+} // anonymous namespace
+
+void Heatmap::printGrid(raw_ostream &OS, const std::vector<uint64_t> &Buckets,
+                        function_ref<void(uint64_t Bucket)> PrintBucket) const {
   const char FillChar = '.';
 
   const auto DefaultColor = raw_ostream::WHITE;
-  auto changeColor = [&](raw_ostream::Colors Color) -> void {
-    static auto CurrentColor = raw_ostream::BLACK;
-    if (CurrentColor == Color)
-      return;
-    OS.changeColor(Color);
-    CurrentColor = Color;
-  };
 
   const uint64_t BytesPerLine = opts::BucketsPerLine * BucketSize;
 
-  // Calculate the max value for scaling.
-  uint64_t MaxValue = 0;
-  for (auto &Entry : Map) {
-    MaxValue = std::max<uint64_t>(MaxValue, Entry.second);
-  }
-
   // Print start of the line and fill it with an empty space right before
   // the Address.
   auto startLine = [&](uint64_t Address, bool Empty = false) {
-    changeColor(DefaultColor);
+    changeColor(OS, DefaultColor);
     const auto LineAddress = Address / BytesPerLine * BytesPerLine;
 
     if (MaxAddress > 0xffffffff)
@@ -122,13 +132,13 @@ void Heatmap::print(raw_ostream &OS) const {
   auto fillRange = [&](uint64_t Start, uint64_t End) {
     if ((Start / BytesPerLine) == (End / BytesPerLine)) {
       for (auto Fill = Start + BucketSize; Fill < End; Fill += BucketSize) {
-        changeColor(DefaultColor);
+        changeColor(OS, DefaultColor);
         OS << FillChar;
       }
       return;
     }
 
-    changeColor(DefaultColor);
+    changeColor(OS, DefaultColor);
     finishLine(Start);
     Start = alignTo(Start, BytesPerLine);
 
@@ -147,6 +157,56 @@ void Heatmap::print(raw_ostream &OS) const {
     startLine(End);
   };
 
+  // Pos - character position from right in hex form.
+  auto printHeader = [&](unsigned Pos) {
+    OS << "            ";
+    if (MaxAddress > 0xffffffff)
+      OS << "        ";
+    unsigned PrevValue = unsigned(-1);
+    for (unsigned I = 0; I < BytesPerLine; I += BucketSize) {
+      const auto Value = (I & ((1 << Pos * 4) - 1)) >> (Pos - 1) * 4;
+      if (Value != PrevValue) {
+        OS << Twine::utohexstr(Value);
+        PrevValue = Value;
+      } else {
+        OS << ' ';
+      }
+    }
+    OS << '\n';
+  };
+  for (unsigned I = 5; I > 0; --I)
+    printHeader(I);
+
+  uint64_t PrevAddress = 0;
+  for (const auto Bucket : Buckets) {
+    uint64_t Address = Bucket * BucketSize;
+
+    if (PrevAddress) {
+      fillRange(PrevAddress, Address);
+    } else {
+      startLine(Address);
+    }
+
+    PrintBucket(Bucket);
+
+    PrevAddress = Address;
+  }
+
+  if (PrevAddress) {
+    changeColor(OS, DefaultColor);
+    finishLine(PrevAddress);
+  }
+}
+
+void Heatmap::print(raw_ostream &OS) const {
+  const auto DefaultColor = raw_ostream::WHITE;
+
+  // Calculate the max value for scaling.
+  uint64_t MaxValue = 0;
+  for (auto &Entry : Map) {
+    MaxValue = std::max<uint64_t>(MaxValue, Entry.second);
+  }
+
   static raw_ostream::Colors Colors[] = {
     raw_ostream::WHITE,
     raw_ostream::WHITE,
@@ -169,7 +229,7 @@ void Heatmap::print(raw_ostream &OS) const {
     assert(Value && "should only print positive values");
     for (unsigned I = 0; I < sizeof(Range) / sizeof(Range[0]); ++I) {
       if (Value <= Range[I]) {
-        changeColor(Colors[I]);
+        changeColor(OS, Colors[I]);
         break;
       }
     }
@@ -179,12 +239,12 @@ void Heatmap::print(raw_ostream &OS) const {
       OS << 'O';
     }
     if (ResetColor)
-      changeColor(DefaultColor);
+      changeColor(OS, DefaultColor);
   };
 
   // Print against black background
   OS.changeColor(raw_ostream::BLACK, /*Bold=*/false, /*Background=*/true);
-  changeColor(DefaultColor);
+  changeColor(OS, DefaultColor);
 
   // Print map legend
   OS << "Legend:\n";
@@ -197,46 +257,217 @@ void Heatmap::print(raw_ostream &OS) const {
     PrevValue = Value;
   }
 
-  // Pos - character position from right in hex form.
-  auto printHeader = [&](unsigned Pos) {
-    OS << "            ";
-    if (MaxAddress > 0xffffffff)
-      OS << "        ";
-    unsigned PrevValue = unsigned(-1);
-    for (unsigned I = 0; I < BytesPerLine; I += BucketSize) {
-      const auto Value = (I & ((1 << Pos * 4) - 1)) >> (Pos - 1) * 4;
-      if (Value != PrevValue) {
-        OS << Twine::utohexstr(Value);
-        PrevValue = Value;
-      } else {
-        OS << ' ';
-      }
+  std::vector<uint64_t> Buckets;
+  Buckets.reserve(Map.size());
+  for (const auto &Entry : Map)
+    Buckets.push_back(Entry.first);
+
+  printGrid(OS, Buckets, [&](uint64_t Bucket) {
+    printValue(Map.find(Bucket)->second);
+  });
+}
+
+uint64_t Heatmap::getTotalCount() const {
+  uint64_t Total = 0;
+  for (const auto &Entry : Map)
+    Total += Entry.second;
+  return Total;
+}
+
+uint64_t Heatmap::getNumPagesForCoverage(uint64_t PageSize,
+                                         double Fraction) const {
+  assert(PageSize >= BucketSize && PageSize % BucketSize == 0 &&
+         "page size should be a multiple of the bucket size");
+  std::map<uint64_t, uint64_t> PageCounts;
+  for (const auto &Entry : Map)
+    PageCounts[Entry.first * BucketSize / PageSize] += Entry.second;
+
+  std::vector<uint64_t> Counts;
+  Counts.reserve(PageCounts.size());
+  for (const auto &Entry : PageCounts)
+    Counts.push_back(Entry.second);
+  std::sort(Counts.begin(), Counts.end(), std::greater<uint64_t>());
+
+  const auto Target = Fraction * getTotalCount();
+  uint64_t RunningCount = 0;
+  uint64_t NumPages = 0;
+  for (const auto Count : Counts) {
+    if (RunningCount >= Target)
+      break;
+    RunningCount += Count;
+    ++NumPages;
+  }
+  return NumPages;
+}
+
+void Heatmap::printPageCoverage(raw_ostream &OS, uint64_t PageSize,
+                                StringRef Prefix) const {
+  OS << Prefix;
+  if (PageSize >= 1024 * 1024)
+    OS << PageSize / (1024 * 1024) << "MB";
+  else
+    OS << PageSize / 1024 << "KB";
+  OS << " pages covering 50%/90%/99% of samples: ";
+  const double Fractions[] = {0.5, 0.9, 0.99};
+  const char *Sep = "";
+  for (const auto Fraction : Fractions) {
+    OS << Sep << getNumPagesForCoverage(PageSize, Fraction);
+    Sep = "/";
+  }
+  OS << '\n';
+}
+
+void Heatmap::printDiff(StringRef FileName, const Heatmap &Base) const {
+  std::error_code EC;
+  raw_fd_ostream OS(FileName, EC, sys::fs::OpenFlags::F_None);
+  if (EC) {
+    errs() << "error opening output file: " << EC.message() << '\n';
+    exit(1);
+  }
+  printDiff(OS, Base);
+}
+
+void Heatmap::printDiff(raw_ostream &OS, const Heatmap &Base) const {
+  assert(BucketSize == Base.BucketSize && "mismatching bucket sizes");
+  const auto DefaultColor = raw_ostream::WHITE;
+
+  // Counts are normalized by the total number of samples in each heat map so
+  // that profiles collected over different periods could be compared.
+  const auto Total = std::max<uint64_t>(1, getTotalCount());
+  const auto BaseTotal = std::max<uint64_t>(1, Base.getTotalCount());
+
+  std::map<uint64_t, double> Delta;
+  for (const auto &Entry : Map)
+    Delta[Entry.first] += (double) Entry.second / Total;
+  for (const auto &Entry : Base.Map)
+    Delta[Entry.first] -= (double) Entry.second / BaseTotal;
+
+  double MaxDelta = 0;
+  for (const auto &Entry : Delta)
+    MaxDelta = std::max(MaxDelta, std::fabs(Entry.second));
+
+  // Changes below 1% of the largest one are shown as unchanged, and changes
+  // above 10% of it are highlighted.
+  auto printDelta = [&](double Value) {
+    const auto Ratio = MaxDelta > 0 ? std::fabs(Value) / MaxDelta : 0;
+    if (Ratio < 0.01) {
+      changeColor(OS, DefaultColor);
+      OS << '=';
+    } else if (Value > 0) {
+      changeColor(OS, Ratio < 0.1 ? raw_ostream::YELLOW : raw_ostream::RED);
+      OS << '+';
+    } else {
+      changeColor(OS, Ratio < 0.1 ? raw_ostream::CYAN : raw_ostream::BLUE);
+      OS << '-';
     }
-    OS << '\n';
   };
-  for (unsigned I = 5; I > 0; --I)
-    printHeader(I);
 
-  uint64_t PrevAddress = 0;
-  for (auto MI = Map.begin(), ME = Map.end(); MI != ME; ++MI) {
-    auto &Entry = *MI;
-    uint64_t Address = Entry.first * BucketSize;
+  OS.changeColor(raw_ostream::BLACK, /*Bold=*/false, /*Background=*/true);
+  changeColor(OS, DefaultColor);
+
+  OS << "Legend (change of the share of samples, max "
+     << format("%.4f", MaxDelta * 100) << "%):\n";
+  const std::pair<double, const char *> LegendEntries[] = {
+    {0, " : unchanged (< 1% of max)\n"},
+    {MaxDelta * 0.05, " : hotter (< 10% of max)\n"},
+    {MaxDelta, " : hotter\n"},
+    {-MaxDelta * 0.05, " : colder (< 10% of max)\n"},
+    {-MaxDelta, " : colder\n"}
+  };
+  for (const auto &Entry : LegendEntries) {
+    OS << "  ";
+    printDelta(Entry.first);
+    changeColor(OS, DefaultColor);
+    OS << Entry.second;
+  }
 
-    if (PrevAddress) {
-      fillRange(PrevAddress, Address);
-    } else {
-      startLine(Address);
+  std::vector<uint64_t> Buckets;
+  Buckets.reserve(Delta.size());
+  for (const auto &Entry : Delta)
+    Buckets.push_back(Entry.first);
+
+  printGrid(OS, Buckets, [&](uint64_t Bucket) {
+    printDelta(Delta.find(Bucket)->second);
+  });
+  changeColor(OS, DefaultColor);
+}
+
+std::map<uint64_t, uint64_t>
+Heatmap::countPagesPerRegion(uint64_t PageSize, uint64_t RegionSize) const {
+  std::map<uint64_t, uint64_t> Pages;
+  uint64_t LastPage = std::numeric_limits<uint64_t>::max();
+  for (const auto &Entry : Map) {
+    const auto Start = Entry.first * BucketSize;
+    for (auto Page = Start / PageSize;
+         Page <= (Start + BucketSize - 1) / PageSize; ++Page) {
+      // Buckets are sorted, so a page can only repeat for adjacent buckets.
+      if (Page == LastPage)
+        continue;
+      ++Pages[Page * PageSize / RegionSize];
+      LastPage = Page;
     }
+  }
+  return Pages;
+}
 
-    printValue(Entry.second);
+void Heatmap::printPageDiff(raw_ostream &OS, const Heatmap &Base,
+                            uint64_t PageSize, uint64_t RegionSize) const {
+  const auto Pages = countPagesPerRegion(PageSize, RegionSize);
+  const auto BasePages = Base.countPagesPerRegion(PageSize, RegionSize);
+
+  std::map<uint64_t, std::pair<uint64_t, uint64_t>> Regions;
+  for (const auto &Entry : BasePages)
+    Regions[Entry.first].first = Entry.second;
+  for (const auto &Entry : Pages)
+    Regions[Entry.first].second = Entry.second;
+
+  OS << "Region, " << PageSize / 1024 << "KB pages before, "
+     << PageSize / 1024 << "KB pages after\n";
+  uint64_t TotalBefore = 0;
+  uint64_t TotalAfter = 0;
+  for (const auto &Entry : Regions) {
+    OS << format("0x%08" PRIx64, Entry.first * RegionSize) << ", "
+       << Entry.second.first << ", " << Entry.second.second << '\n';
+    TotalBefore += Entry.second.first;
+    TotalAfter += Entry.second.second;
+  }
+  OS << "Total, " << TotalBefore << ", " << TotalAfter << '\n';
+}
 
-    PrevAddress = Address;
+void Heatmap::printCounts(StringRef FileName) const {
+  std::error_code EC;
+  raw_fd_ostream OS(FileName, EC, sys::fs::OpenFlags::F_None);
+  if (EC) {
+    errs() << "error opening output file: " << EC.message() << '\n';
+    exit(1);
   }
+  OS << "heatmap " << BucketSize << '\n';
+  for (const auto &Entry : Map)
+    OS << Twine::utohexstr(Entry.first) << ' ' << Entry.second << '\n';
+}
 
-  if (PrevAddress) {
-    changeColor(DefaultColor);
-    finishLine(PrevAddress);
+ErrorOr<Heatmap> Heatmap::readCounts(StringRef FileName) {
+  auto MB = MemoryBuffer::getFileOrSTDIN(FileName);
+  if (auto EC = MB.getError())
+    return EC;
+
+  line_iterator LI(*MB.get(), /*SkipBlanks=*/true);
+  uint64_t BucketSize;
+  if (LI.is_at_eof() || !LI->startswith("heatmap ") ||
+      LI->drop_front(8).getAsInteger(10, BucketSize) || !BucketSize)
+    return make_error_code(llvm::errc::invalid_argument);
+
+  Heatmap HM(BucketSize);
+  for (++LI; !LI.is_at_eof(); ++LI) {
+    StringRef BucketStr, CountStr;
+    std::tie(BucketStr, CountStr) = LI->split(' ');
+    uint64_t Bucket, Count;
+    if (BucketStr.getAsInteger(16, Bucket) ||
+        CountStr.getAsInteger(10, Count))
+      return make_error_code(llvm::errc::invalid_argument);
+    HM.Map[Bucket] += Count;
   }
+  return HM;
 }
 
 void Heatmap::printCDF(StringRef FileName) const {
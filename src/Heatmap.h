@@ -12,8 +12,11 @@
 #ifndef LLVM_TOOLS_LLVM_BOLT_HEATMAP_H
 #define LLVM_TOOLS_LLVM_BOLT_HEATMAP_H
 
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/ErrorOr.h"
 #include "llvm/Support/raw_ostream.h"
 #include <map>
+#include <vector>
 
 namespace llvm {
 namespace bolt {
@@ -34,6 +37,16 @@ class Heatmap {
   /// Map buckets to the number of samples.
   std::map<uint64_t, uint64_t> Map;
 
+  /// Print the address grid for sorted \p Buckets, calling \p PrintBucket to
+  /// output the character for every bucket in the list.
+  void printGrid(raw_ostream &OS, const std::vector<uint64_t> &Buckets,
+                 function_ref<void(uint64_t Bucket)> PrintBucket) const;
+
+  /// Return the number of distinct pages of \p PageSize bytes with samples,
+  /// grouped by aligned regions of \p RegionSize bytes.
+  std::map<uint64_t, uint64_t>
+  countPagesPerRegion(uint64_t PageSize, uint64_t RegionSize) const;
+
 public:
   explicit Heatmap(uint64_t BucketSize = 4096,
                    uint64_t MinAddress = 0,
@@ -45,10 +58,10 @@ public:
     return (Address > MaxAddress) || (Address < MinAddress);
   }
 
-  /// Register a single sample at \p Address.
-  void registerAddress(uint64_t Address) {
+  /// Register \p Count samples at \p Address.
+  void registerAddress(uint64_t Address, uint64_t Count = 1) {
     if (!ignoreAddress(Address))
-      ++Map[Address / BucketSize];
+      Map[Address / BucketSize] += Count;
   }
 
   /// Register \p Count samples at [\p StartAddress, \p EndAddress ].
@@ -60,6 +73,14 @@ public:
     return NumSkippedRanges;
   }
 
+  uint64_t getBucketSize() const {
+    return BucketSize;
+  }
+
+  /// Add samples and invalid ranges of \p Other with the same bucket size to
+  /// this heat map.
+  void merge(const Heatmap &Other);
+
   void print(StringRef FileName) const;
 
   void print(raw_ostream &OS) const;
@@ -68,6 +89,34 @@ public:
 
   void printCDF(raw_ostream &OS) const;
 
+  /// Print the change of the normalized sample distribution relative to
+  /// \p Base, which should have the same bucket size.
+  void printDiff(StringRef FileName, const Heatmap &Base) const;
+
+  void printDiff(raw_ostream &OS, const Heatmap &Base) const;
+
+  /// Print the number of pages with samples per region in \p Base and in
+  /// this heat map.
+  void printPageDiff(raw_ostream &OS, const Heatmap &Base,
+                     uint64_t PageSize, uint64_t RegionSize) const;
+
+  /// Save raw bucket counts in a form that can be read by readCounts().
+  void printCounts(StringRef FileName) const;
+
+  /// Read bucket counts saved by printCounts().
+  static ErrorOr<Heatmap> readCounts(StringRef FileName);
+
+  uint64_t getTotalCount() const;
+
+  /// Return the minimum number of pages of \p PageSize bytes, which should be
+  /// a multiple of the bucket size, that hold \p Fraction of all samples.
+  uint64_t getNumPagesForCoverage(uint64_t PageSize, double Fraction) const;
+
+  /// Print the number of pages of \p PageSize bytes that hold 50%, 90% and
+  /// 99% of samples on a single line starting with \p Prefix.
+  void printPageCoverage(raw_ostream &OS, uint64_t PageSize,
+                         StringRef Prefix) const;
+
   size_t size() const {
     return Map.size();
   }
@@ -64,6 +64,15 @@ public:
   /// The type of this jump table.
   JumpTableType Type;
 
+  /// For PIC jump tables, the symbol that entries are relative to in the
+  /// output. If not set, entries are relative to the jump table label.
+  const MCSymbol *OutputEntryBase{nullptr};
+
+  /// If set, the table is emitted at the given alignment after the given
+  /// number of padding bytes, e.g. to place its hot entries in one cache line.
+  uint64_t OutputAlignment{0};
+  uint64_t OutputPadding{0};
+
   /// All the entries as labels.
   std::vector<MCSymbol *> Entries;
 
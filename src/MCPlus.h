@@ -16,6 +16,7 @@
 #include "llvm/MC/MCExpr.h"
 #include "llvm/MC/MCInst.h"
 #include "llvm/Support/Casting.h"
+#include <vector>
 
 namespace llvm {
 namespace bolt {
@@ -96,6 +97,34 @@ private:
   ValueType Value;
 };
 
+/// Reserve an annotation index for \p Name at static initialization time.
+/// Every MCPlusBuilder registers the reserved names ahead of the names
+/// created at run time, so that the reserved indices are valid in all of
+/// them. The same index is returned for repeated registrations of a name.
+unsigned registerStaticAnnotation(const char *Name);
+
+/// Return the names registered with registerStaticAnnotation() in the order
+/// of their indices.
+const std::vector<const char *> &getStaticAnnotationNames();
+
+/// Typed key of an annotation with a name known at compile time. Keys are
+/// defined at namespace scope and resolve their index once during static
+/// initialization, so that MCPlusBuilder annotation accessors taking a key
+/// neither hash the name nor need a lock, and the value type is checked by
+/// the compiler instead of being repeated at every call site.
+template <typename ValueType>
+class AnnotationKey {
+  const char *Name;
+  unsigned Index;
+
+public:
+  explicit AnnotationKey(const char *Name)
+    : Name(Name), Index(registerStaticAnnotation(Name)) {}
+
+  const char *getName() const { return Name; }
+  unsigned getIndex() const { return Index; }
+};
+
 /// Return a number of operands in \Inst excluding operands representing
 /// annotations.
 inline unsigned getNumPrimeOperands(const MCInst &Inst) {
@@ -18,7 +18,9 @@
 #include "llvm/MC/MCInstrDesc.h"
 #include "llvm/MC/MCInstrInfo.h"
 #include "llvm/Support/Debug.h"
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <queue>
 
 #define DEBUG_TYPE "mcplus"
@@ -27,6 +29,36 @@ using namespace llvm;
 using namespace bolt;
 using namespace MCPlus;
 
+namespace {
+
+std::vector<const char *> &staticAnnotationNames() {
+  static std::vector<const char *> Names;
+  return Names;
+}
+
+} // end anonymous namespace
+
+unsigned MCPlus::registerStaticAnnotation(const char *Name) {
+  auto &Names = staticAnnotationNames();
+  auto NI = std::find_if(Names.begin(), Names.end(), [&](const char *N) {
+    return !strcmp(N, Name);
+  });
+  if (NI == Names.end())
+    NI = Names.insert(Names.end(), Name);
+  return MCAnnotation::kGeneric + (NI - Names.begin());
+}
+
+const std::vector<const char *> &MCPlus::getStaticAnnotationNames() {
+  return staticAnnotationNames();
+}
+
+const AnnotationKey<uint32_t> MCPlus::OffsetAnnotation("Offset");
+const AnnotationKey<uint64_t> MCPlus::CountAnnotation("Count");
+const AnnotationKey<uint64_t> MCPlus::CTCTakenCountAnnotation("CTCTakenCount");
+const AnnotationKey<uint64_t>
+    MCPlus::CTCMispredCountAnnotation("CTCMispredCount");
+const AnnotationKey<uint16_t> MCPlus::JTIndexRegAnnotation("JTIndexReg");
+
 bool MCPlusBuilder::equals(const MCInst &A, const MCInst &B,
                            CompFuncTy Comp) const {
   if (A.getOpcode() != B.getOpcode())
@@ -165,7 +197,7 @@ uint64_t MCPlusBuilder::getJumpTable(const MCInst &Inst) const {
 }
 
 uint16_t MCPlusBuilder::getJumpTableIndexReg(const MCInst &Inst) const {
-  return getAnnotationAs<uint16_t>(Inst, "JTIndexReg");
+  return getAnnotationAs(Inst, JTIndexRegAnnotation);
 }
 
 bool MCPlusBuilder::setJumpTable(MCInst &Inst, uint64_t Value,
@@ -173,7 +205,7 @@ bool MCPlusBuilder::setJumpTable(MCInst &Inst, uint64_t Value,
   if (!isIndirectBranch(Inst))
     return false;
   setAnnotationOpValue(Inst, MCAnnotation::kJumpTable, Value, AllocId);
-  getOrCreateAnnotationAs<uint16_t>(Inst, "JTIndexReg", AllocId) = IndexReg;
+  getOrCreateAnnotationAs(Inst, JTIndexRegAnnotation, AllocId) = IndexReg;
   return true;
 }
 
@@ -181,7 +213,7 @@ bool MCPlusBuilder::unsetJumpTable(MCInst &Inst) {
   if (!getJumpTable(Inst))
     return false;
   removeAnnotation(Inst, MCAnnotation::kJumpTable);
-  removeAnnotation(Inst, "JTIndexReg");
+  removeAnnotation(Inst, JTIndexRegAnnotation);
   return true;
 }
 
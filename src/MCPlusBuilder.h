@@ -36,6 +36,7 @@
 #include "llvm/Support/StringPool.h"
 #include <cassert>
 #include <cstdint>
+#include <deque>
 #include <map>
 #include <mutex>
 #include <set>
@@ -57,20 +58,49 @@ enum class IndirectBranchType : char {
   POSSIBLE_FIXED_BRANCH,   /// Possibly an indirect branch to a fixed location.
 };
 
+namespace MCPlus {
+
+/// Offset of an instruction from the start of its function in the input.
+extern const AnnotationKey<uint32_t> OffsetAnnotation;
+
+/// Execution count of a call or of an indirect branch.
+extern const AnnotationKey<uint64_t> CountAnnotation;
+
+/// Execution and misprediction counts of a conditional tail call.
+extern const AnnotationKey<uint64_t> CTCTakenCountAnnotation;
+extern const AnnotationKey<uint64_t> CTCMispredCountAnnotation;
+
+/// Register holding the index into the jump table of an indirect jump.
+extern const AnnotationKey<uint16_t> JTIndexRegAnnotation;
+
+} // namespace MCPlus
+
 class MCPlusBuilder {
 public:
   using AllocatorIdTy = uint16_t;
 
 private:
-  /// A struct that represents a single annotation allocator
+  /// A struct that represents a single annotation allocator. All memory of
+  /// the allocator is released at once, and the pool only tracks annotations
+  /// with values that have to be destroyed before that.
   struct AnnotationAllocator {
     SpecificBumpPtrAllocator<MCInst> MCInstAllocator;
     BumpPtrAllocator ValueAllocator;
-    std::unordered_set<MCPlus::MCAnnotation *> AnnotationPool;
+    std::vector<MCPlus::MCAnnotation *> AnnotationPool;
+
+    /// Destroy non-trivial annotation values and release the value memory.
+    void resetValues() {
+      for (auto *Annotation : AnnotationPool)
+        Annotation->~MCAnnotation();
+      AnnotationPool.clear();
+      AnnotationPool.shrink_to_fit();
+      ValueAllocator.Reset();
+    }
   };
 
-  /// A set of annotation allocators
-  std::unordered_map<AllocatorIdTy, AnnotationAllocator> AnnotationAllocators;
+  /// Annotation allocators indexed by their ids. A deque keeps references to
+  /// existing allocators valid while new ones are added.
+  std::deque<AnnotationAllocator> AnnotationAllocators;
 
   /// A variable that is used to generate unique ids for annotation allocators
   AllocatorIdTy MaxAllocatorId = 0;
@@ -284,6 +314,11 @@ public:
     // TODO: it would be nice to templatize this on the key type.
     InstructionIterator(std::map<uint32_t, MCInst>::iterator Itr)
       : Itr(new MapImpl<std::map<uint32_t, MCInst>::iterator>(Itr)) { }
+
+    InstructionIterator(
+        std::vector<std::pair<uint32_t, MCInst>>::iterator Itr)
+      : Itr(new MapImpl<std::vector<std::pair<uint32_t, MCInst>>::iterator>(
+            Itr)) { }
   private:
     std::unique_ptr<Impl> Itr;
   };
@@ -293,51 +328,45 @@ public:
                 const MCRegisterInfo *RegInfo)
       : Analysis(Analysis), Info(Info), RegInfo(RegInfo) {
     // Initialize the default annotation allocator with id 0
-    AnnotationAllocators.emplace(0, AnnotationAllocator());
+    AnnotationAllocators.emplace_back();
     MaxAllocatorId++;
+
+    // Reserve the indices of annotation keys
+    for (const char *Name : MCPlus::getStaticAnnotationNames())
+      getOrCreateAnnotationIndex(Name);
   }
 
   /// Initialize a new annotation allocator and return its id
   AllocatorIdTy initializeNewAnnotationAllocator() {
-    AnnotationAllocators.emplace(MaxAllocatorId, AnnotationAllocator());
+    AnnotationAllocators.emplace_back();
     return MaxAllocatorId++;
   }
 
   /// Return the annotation allocator of a given id
   AnnotationAllocator &getAnnotationAllocator(AllocatorIdTy AllocatorId) {
-    assert(AnnotationAllocators.count(AllocatorId) &&
-           "allocator not initialized");
-    return AnnotationAllocators.find(AllocatorId)->second;
+    assert(checkAllocatorExists(AllocatorId) && "allocator not initialized");
+    return AnnotationAllocators[AllocatorId];
   }
 
   // Check if an annotation allocator with the given id exists
   bool checkAllocatorExists(AllocatorIdTy AllocatorId) {
-    return AnnotationAllocators.count(AllocatorId);
+    return AllocatorId < AnnotationAllocators.size();
   }
 
   /// Free the values allocator within the annotation allocator
   void freeValuesAllocator(AllocatorIdTy AllocatorId) {
-    auto &Allocator = getAnnotationAllocator(AllocatorId);
-    for (auto *Annotation : Allocator.AnnotationPool)
-      Annotation->~MCAnnotation();
-
-    Allocator.AnnotationPool.clear();
-    Allocator.ValueAllocator.Reset();
+    getAnnotationAllocator(AllocatorId).resetValues();
   }
 
   virtual ~MCPlusBuilder() {
     freeAnnotations();
   }
 
-  /// Free all memory allocated for annotations
+  /// Free all memory allocated for annotations. The cost is proportional to
+  /// the number of allocators and of annotations with non-trivial values.
   void freeAnnotations() {
-    for (auto &Element : AnnotationAllocators) {
-      auto &Allocator = Element.second;
-      for (auto *Annotation : Allocator.AnnotationPool)
-        Annotation->~MCAnnotation();
-
-      Allocator.AnnotationPool.clear();
-      Allocator.ValueAllocator.Reset();
+    for (auto &Allocator : AnnotationAllocators) {
+      Allocator.resetValues();
       Allocator.MCInstAllocator.DestroyAll();
     }
   }
@@ -1204,6 +1233,13 @@ public:
     return 0;
   }
 
+  /// Returns the maximum distance in bytes, backward or forward, between the
+  /// branch \p Inst and a target it can encode.
+  virtual uint64_t getBranchReach(const MCInst &Inst) const {
+    llvm_unreachable("not implemented");
+    return 0;
+  }
+
   /// Replace instruction opcode to be a tail call instead of jump.
   virtual bool convertJmpToTailCall(MCInst &Inst) {
     llvm_unreachable("not implemented");
@@ -1424,18 +1460,71 @@ public:
     return false;
   }
 
+  /// Create a load of \p Size bytes sign-extended to the full width of
+  /// \p DstReg.
+  virtual bool createSignExtLoad(MCInst &Inst, const MCPhysReg &BaseReg,
+                                 int64_t Scale, const MCPhysReg &IndexReg,
+                                 int64_t Offset, const MCExpr *OffsetExpr,
+                                 const MCPhysReg &AddrSegmentReg,
+                                 const MCPhysReg &DstReg, int Size) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
+  /// Create an instruction that puts the address of \p Target into \p Reg.
+  virtual bool createLoadAddress(MCInst &Inst, const MCSymbol *Target,
+                                 const MCPhysReg &Reg, MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
+  /// Create a prefetch of the cache line at the given address to all levels
+  /// of the cache hierarchy.
+  virtual bool createPrefetch(MCInst &Inst, const MCPhysReg &BaseReg,
+                              int64_t Scale, const MCPhysReg &IndexReg,
+                              int64_t Offset,
+                              const MCPhysReg &AddrSegmentReg) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
   virtual void createLoadImmediate(MCInst &Inst, const MCPhysReg Dest,
                                    uint32_t Imm) const {
     llvm_unreachable("not implemented");
   }
 
-  /// Create instruction to increment contents of target by 1
+  /// Create instruction to increment contents of target by 1. The increment
+  /// is atomic unless \p IsAtomic is false.
   virtual bool createIncMemory(MCInst &Inst, const MCSymbol *Target,
-                               MCContext *Ctx) const {
+                               MCContext *Ctx, bool IsAtomic = true) const {
     llvm_unreachable("not implemented");
     return false;
   }
 
+  /// Create a sequence incrementing the 64-bit counter at \p Target for
+  /// instrumentation, for targets that cannot do it with a single instruction
+  /// from createIncMemory(). Flags are not guaranteed to be preserved.
+  virtual std::vector<MCInst>
+  createInstrIncMemory(const MCSymbol *Target, MCContext *Ctx,
+                       bool IsAtomic = true) const {
+    std::vector<MCInst> Insts(1);
+    createIncMemory(Insts.back(), Target, Ctx, IsAtomic);
+    return Insts;
+  }
+
+  /// Create a sequence incrementing the copy of the counter at \p Target
+  /// that belongs to the current CPU. Copies of the counter array are
+  /// \p NumShards apart by the number of bytes stored at \p ShardStride.
+  /// \p NumShards must be a power of two. The sequence clobbers the flags
+  /// but preserves all other registers, using the stack to save them.
+  virtual std::vector<MCInst>
+  createShardedIncMemory(const MCSymbol *Target, const MCSymbol *ShardStride,
+                         unsigned NumShards, MCContext *Ctx,
+                         bool IsAtomic = true) const {
+    llvm_unreachable("not implemented");
+    return std::vector<MCInst>();
+  }
+
   /// Create a fragment of code (sequence of instructions) that load a 32-bit
   /// address from memory, zero-extends it to 64 and jump to it (indirect jump).
   virtual bool
@@ -1481,6 +1570,34 @@ public:
     return {};
   }
 
+  /// Create a sequence of instructions to compare the byte stored at \p Flag
+  /// to zero and jump to \p Target if they are equal.
+  virtual std::vector<MCInst>
+  createCmpMemZeroJE(const MCSymbol *Flag, const MCSymbol *Target,
+                     MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return {};
+  }
+
+  /// Create a sequence of instructions to compare the 32-bit value stored at
+  /// \p Slot to zero and jump to \p Target if they are not equal.
+  virtual std::vector<MCInst>
+  createCmpMem32ZeroJNE(const MCSymbol *Slot, const MCSymbol *Target,
+                        MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return {};
+  }
+
+  /// Create a sequence of instructions to atomically increment the 32-bit
+  /// value stored at \p Sequence and store the incremented value at \p Slot.
+  /// Flags are clobbered and the stack is used, other registers are preserved.
+  virtual std::vector<MCInst>
+  createStoreNextSequenceNumber(const MCSymbol *Slot, const MCSymbol *Sequence,
+                                MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return {};
+  }
+
   /// Creates inline memcpy instruction. If \p ReturnEnd is true, then return
   /// (dest + n) instead of dest.
   virtual std::vector<MCInst> createInlineMemcpy(bool ReturnEnd) const {
@@ -1488,6 +1605,20 @@ public:
     return {};
   }
 
+  /// Create an inline version of memcpy(dest, src, \p Size) for a small
+  /// constant \p Size. Only registers clobbered by a call may be used.
+  virtual std::vector<MCInst> createFixedSizeMemcpy(uint64_t Size) const {
+    llvm_unreachable("not implemented");
+    return {};
+  }
+
+  /// Create an inline version of memset(dest, c, \p Size) for a small
+  /// constant \p Size. Only registers clobbered by a call may be used.
+  virtual std::vector<MCInst> createFixedSizeMemset(uint64_t Size) const {
+    llvm_unreachable("not implemented");
+    return {};
+  }
+
   /// Create a target-specific relocation out of the \p Fixup.
   /// Note that not every fixup could be converted into a relocation.
   virtual Optional<Relocation> createRelocation(const MCFixup &Fixup,
@@ -1510,6 +1641,17 @@ public:
     return false;
   }
 
+  /// Create a conditional move of register \p Src into register \p Dst that
+  /// happens under the condition of \p CondBranch, or under the opposite
+  /// condition if \p Invert is set.
+  ///
+  /// Returns false if no conditional move matches the branch condition.
+  virtual bool createCMov(MCInst &Inst, const MCInst &CondBranch,
+                          MCPhysReg Dst, MCPhysReg Src, bool Invert) const {
+    llvm_unreachable("not implemented");
+    return false;
+  }
+
   /// Return canonical branch opcode for a reversible branch opcode. For every
   /// opposite branch opcode pair Op <-> OpR this function returns one of the
   /// opcodes which is considered a canonical.
@@ -1570,7 +1712,7 @@ public:
         MCPlus::MCSimpleAnnotation<ValueType>(Val);
 
     if (!std::is_trivial<ValueType>::value) {
-      Allocator.AnnotationPool.insert(A);
+      Allocator.AnnotationPool.push_back(A);
     }
     setAnnotationOpValue(Inst, Index, reinterpret_cast<int64_t>(A),
                          AllocatorId);
@@ -1587,6 +1729,14 @@ public:
                          AllocatorId);
   }
 
+  template <typename ValueType>
+  const ValueType &addAnnotation(MCInst &Inst,
+                                 const MCPlus::AnnotationKey<ValueType> &Key,
+                                 const ValueType &Val,
+                                 AllocatorIdTy AllocatorId = 0) {
+    return addAnnotation(Inst, Key.getIndex(), Val, AllocatorId);
+  }
+
   /// Get an annotation as a specific value, but if the annotation does not
   /// exist, create a new annotation with the default constructor for that type.
   /// Return a non-const ref so caller can freely modify its contents
@@ -1612,6 +1762,15 @@ public:
     return getOrCreateAnnotationAs<ValueType>(Inst, Index, AllocatorId);
   }
 
+  template <typename ValueType>
+  ValueType &
+  getOrCreateAnnotationAs(MCInst &Inst,
+                          const MCPlus::AnnotationKey<ValueType> &Key,
+                          AllocatorIdTy AllocatorId = 0) {
+    return getOrCreateAnnotationAs<ValueType>(Inst, Key.getIndex(),
+                                              AllocatorId);
+  }
+
   /// Get an annotation as a specific value. Assumes that the annotation exists.
   /// Use hasAnnotation() if the annotation may not exist.
   template <typename ValueType>
@@ -1631,6 +1790,13 @@ public:
     return getAnnotationAs<ValueType>(Inst, *Index);
   }
 
+  template <typename ValueType>
+  ValueType &
+  getAnnotationAs(const MCInst &Inst,
+                  const MCPlus::AnnotationKey<ValueType> &Key) const {
+    return getAnnotationAs<ValueType>(Inst, Key.getIndex());
+  }
+
   /// Get an annotation as a specific value. If the annotation does not exist,
   /// return the \p DefaultValue.
   template <typename ValueType> const ValueType &
@@ -1650,6 +1816,14 @@ public:
     return getAnnotationWithDefault<ValueType>(Inst, Index, DefaultValue);
   }
 
+  template <typename ValueType> const ValueType &
+  getAnnotationWithDefault(const MCInst &Inst,
+                           const MCPlus::AnnotationKey<ValueType> &Key,
+                           const ValueType &DefaultValue = ValueType()) {
+    return getAnnotationWithDefault<ValueType>(Inst, Key.getIndex(),
+                                               DefaultValue);
+  }
+
   /// Check if the specified annotation exists on this instruction.
   bool hasAnnotation(const MCInst &Inst, unsigned Index) const;
 
@@ -1661,6 +1835,12 @@ public:
     return hasAnnotation(Inst, *Index);
   }
 
+  template <typename ValueType>
+  bool hasAnnotation(const MCInst &Inst,
+                     const MCPlus::AnnotationKey<ValueType> &Key) const {
+    return hasAnnotation(Inst, Key.getIndex());
+  }
+
   /// Get an annotation as a specific value, but if the annotation does not
   /// exist, return errc::result_out_of_range.
   template <typename ValueType>
@@ -1682,6 +1862,13 @@ public:
     return tryGetAnnotationAs<ValueType>(Inst, *Index);
   }
 
+  template <typename ValueType>
+  ErrorOr<const ValueType &>
+  tryGetAnnotationAs(const MCInst &Inst,
+                     const MCPlus::AnnotationKey<ValueType> &Key) const {
+    return tryGetAnnotationAs<ValueType>(Inst, Key.getIndex());
+  }
+
   template <typename ValueType>
   ErrorOr<ValueType &> tryGetAnnotationAs(MCInst &Inst, unsigned Index) const {
     if (!hasAnnotation(Inst, Index))
@@ -1697,6 +1884,13 @@ public:
     return tryGetAnnotationAs<ValueType>(Inst, *Index);
   }
 
+  template <typename ValueType>
+  ErrorOr<ValueType &>
+  tryGetAnnotationAs(MCInst &Inst,
+                     const MCPlus::AnnotationKey<ValueType> &Key) const {
+    return tryGetAnnotationAs<ValueType>(Inst, Key.getIndex());
+  }
+
   /// Print each annotation attached to \p Inst.
   void printAnnotations(const MCInst &Inst, raw_ostream &OS) const;
 
@@ -1717,6 +1911,12 @@ public:
     return removeAnnotation(Inst, *Index);
   }
 
+  template <typename ValueType>
+  bool removeAnnotation(MCInst &Inst,
+                        const MCPlus::AnnotationKey<ValueType> &Key) {
+    return removeAnnotation(Inst, Key.getIndex());
+  }
+
   /// Remove meta-data, but don't destroy it.
   void stripAnnotations(MCInst &Inst);
 
@@ -1728,6 +1928,29 @@ public:
     return std::vector<MCInst>();
   }
 
+  /// Create a sequence passing the value of \p ValueReg and \p SiteID to the
+  /// value profiling handler stored at \p HandlerFuncAddr. The sequence is
+  /// inserted right before a call and preserves all argument registers.
+  virtual std::vector<MCInst>
+  createInstrumentedValueProfile(MCPhysReg ValueReg, MCSymbol *HandlerFuncAddr,
+                                 int SiteID, MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return std::vector<MCInst>();
+  }
+
+  /// Create a sequence passing the address accessed by the memory operand of
+  /// \p Inst and \p SiteID to the memory access profiling handler stored at
+  /// \p HandlerFuncAddr. The sequence goes right before \p Inst, preserves
+  /// all registers and flags, and skips the red zone. Return an empty vector
+  /// if the access cannot be profiled or cannot hit a global object, e.g. a
+  /// stack or thread-local access.
+  virtual std::vector<MCInst>
+  createInstrumentedMemoryAccess(const MCInst &Inst, MCSymbol *HandlerFuncAddr,
+                                 int SiteID, MCContext *Ctx) const {
+    llvm_unreachable("not implemented");
+    return std::vector<MCInst>();
+  }
+
   virtual std::vector<MCInst> createInstrumentedNoopIndCallHandler() const {
     llvm_unreachable("not implemented");
     return std::vector<MCInst>();
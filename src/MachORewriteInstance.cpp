@@ -18,14 +18,21 @@
 #include "JumpTable.h"
 #include "Passes/Instrumentation.h"
 #include "Passes/PatchEntries.h"
+#include "Passes/ReorderFunctions.h"
+#include "Passes/SplitFunctions.h"
 #include "Utils.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/MC/MCAsmBackend.h"
 #include "llvm/MC/MCAsmInfo.h"
 #include "llvm/MC/MCAsmLayout.h"
 #include "llvm/MC/MCObjectStreamer.h"
+#include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/LEB128.h"
 #include "llvm/Support/Timer.h"
 #include "llvm/Support/ToolOutputFile.h"
+#include <cstddef>
 
 namespace opts {
 
@@ -42,10 +49,14 @@ extern cl::opt<std::string> OutputFilename;
 extern cl::opt<bool> PrintAfterBranchFixup;
 extern cl::opt<bool> PrintFinalized;
 extern cl::opt<bool> PrintReordered;
+extern cl::opt<bool> PrintReorderedFunctions;
+extern cl::opt<bool> PrintSplit;
 extern cl::opt<bool> PrintSections;
 extern cl::opt<bool> PrintDisasm;
 extern cl::opt<bool> PrintCFG;
+extern cl::opt<bolt::ReorderFunctions::ReorderType> ReorderFunctions;
 extern cl::opt<std::string> RuntimeInstrumentationLib;
+extern cl::opt<bolt::SplitFunctions::SplittingType> SplitFunctions;
 extern cl::opt<unsigned> Verbosity;
 } // namespace opts
 
@@ -114,16 +125,10 @@ std::vector<DataInCodeRegion> readDataInCode(const MachOObjectFile &O) {
   return DataInCode;
 }
 
-Optional<uint64_t> readStartAddress(const MachOObjectFile &O) {
-  Optional<uint64_t> StartOffset;
+Optional<uint64_t> readTextVMAddr(const MachOObjectFile &O) {
   Optional<uint64_t> TextVMAddr;
   for (const auto &LC : O.load_commands()) {
     switch (LC.C.cmd) {
-    case MachO::LC_MAIN: {
-      MachO::entry_point_command LCMain = O.getEntryPointCommand(LC);
-      StartOffset = LCMain.entryoff;
-      break;
-    }
     case MachO::LC_SEGMENT: {
       MachO::segment_command LCSeg = O.getSegmentLoadCommand(LC);
       StringRef SegmentName(LCSeg.segname,
@@ -144,13 +149,158 @@ Optional<uint64_t> readStartAddress(const MachOObjectFile &O) {
       continue;
     }
   }
+  return TextVMAddr;
+}
+
+Optional<uint64_t> readStartAddress(const MachOObjectFile &O) {
+  Optional<uint64_t> StartOffset;
+  for (const auto &LC : O.load_commands()) {
+    if (LC.C.cmd == MachO::LC_MAIN)
+      StartOffset = O.getEntryPointCommand(LC).entryoff;
+  }
+  const Optional<uint64_t> TextVMAddr = readTextVMAddr(O);
   return (TextVMAddr && StartOffset)
              ? Optional<uint64_t>(*TextVMAddr + *StartOffset)
              : llvm::None;
 }
 
+/// Bits and values of the compact unwind info, as described in
+/// <mach-o/compact_unwind_encoding.h>.
+const uint32_t UNWIND_SECTION_VERSION = 1;
+const uint32_t UNWIND_SECOND_LEVEL_REGULAR = 2;
+const uint32_t UNWIND_SECOND_LEVEL_COMPRESSED = 3;
+const uint32_t UNWIND_HAS_LSDA = 0x40000000;
+const uint32_t UNWIND_MODE_MASK = 0x0F000000;
+const uint32_t UNWIND_X86_64_MODE_DWARF = 0x04000000;
+const uint32_t UNWIND_ARM64_MODE_DWARF = 0x03000000;
+
+/// Size of the header of __unwind_info and of its first-level index entries.
+const uint32_t UnwindHeaderSize = 7 * 4;
+const uint32_t UnwindIndexEntrySize = 3 * 4;
+
+/// Maximum number of entries in a regular second-level page of 4KB.
+const uint32_t UnwindEntriesPerPage = (4096 - 8) / 8;
+
 } // anonymous namespace
 
+bool MachORewriteInstance::isMoved(const BinaryFunction &Function) {
+  return Function.isEmitted() && Function.getOutputAddress() &&
+         Function.getOutputAddress() != Function.getAddress();
+}
+
+void MachORewriteInstance::readUnwindInfo() {
+  ErrorOr<BinarySection &> Section =
+      BC->getUniqueSectionByName("__unwind_info");
+  if (!Section)
+    return;
+
+  DataExtractor DE(Section->getContents(), BC->AsmInfo->isLittleEndian(),
+                   /*AddressSize=*/8);
+  uint32_t Offset = 0;
+  const uint32_t Version = DE.getU32(&Offset);
+  const uint32_t CommonEncodingsOffset = DE.getU32(&Offset);
+  const uint32_t CommonEncodingsCount = DE.getU32(&Offset);
+  const uint32_t PersonalitiesOffset = DE.getU32(&Offset);
+  const uint32_t PersonalitiesCount = DE.getU32(&Offset);
+  const uint32_t IndexOffset = DE.getU32(&Offset);
+  const uint32_t IndexCount = DE.getU32(&Offset);
+  if (Version != UNWIND_SECTION_VERSION || !IndexCount) {
+    errs() << "BOLT-WARNING: unsupported __unwind_info version " << Version
+           << ", the unwind info will not be updated\n";
+    return;
+  }
+
+  std::vector<uint32_t> CommonEncodings;
+  Offset = CommonEncodingsOffset;
+  for (uint32_t I = 0; I < CommonEncodingsCount; ++I)
+    CommonEncodings.push_back(DE.getU32(&Offset));
+
+  Offset = PersonalitiesOffset;
+  for (uint32_t I = 0; I < PersonalitiesCount; ++I)
+    UnwindPersonalities.push_back(DE.getU32(&Offset));
+
+  // The last first-level index entry only marks the end of the code and of
+  // the LSDA array.
+  for (uint32_t I = 0; I + 1 < IndexCount; ++I) {
+    Offset = IndexOffset + I * UnwindIndexEntrySize;
+    const uint32_t FunctionOffset = DE.getU32(&Offset);
+    const uint32_t PageOffset = DE.getU32(&Offset);
+
+    uint32_t PageHeaderOffset = PageOffset;
+    const uint32_t Kind = DE.getU32(&PageHeaderOffset);
+    const uint16_t EntriesOffset = DE.getU16(&PageHeaderOffset);
+    const uint16_t EntriesCount = DE.getU16(&PageHeaderOffset);
+    uint32_t EntryOffset = PageOffset + EntriesOffset;
+    if (Kind == UNWIND_SECOND_LEVEL_REGULAR) {
+      for (uint16_t J = 0; J < EntriesCount; ++J) {
+        const uint32_t EntryFunctionOffset = DE.getU32(&EntryOffset);
+        const uint32_t Encoding = DE.getU32(&EntryOffset);
+        UnwindEntries.push_back({TextVMAddress + EntryFunctionOffset,
+                                 Encoding});
+      }
+    } else if (Kind == UNWIND_SECOND_LEVEL_COMPRESSED) {
+      const uint16_t EncodingsOffset = DE.getU16(&PageHeaderOffset);
+      for (uint16_t J = 0; J < EntriesCount; ++J) {
+        const uint32_t Entry = DE.getU32(&EntryOffset);
+        const uint32_t EncodingIndex = Entry >> 24;
+        uint32_t Encoding;
+        if (EncodingIndex < CommonEncodingsCount) {
+          Encoding = CommonEncodings[EncodingIndex];
+        } else {
+          uint32_t EncodingOffset =
+              PageOffset + EncodingsOffset +
+              (EncodingIndex - CommonEncodingsCount) * 4;
+          Encoding = DE.getU32(&EncodingOffset);
+        }
+        UnwindEntries.push_back(
+            {TextVMAddress + FunctionOffset + (Entry & 0x00FFFFFF),
+             Encoding});
+      }
+    } else {
+      errs() << "BOLT-WARNING: unsupported __unwind_info page kind " << Kind
+             << ", the unwind info will not be updated\n";
+      UnwindEntries.clear();
+      UnwindPersonalities.clear();
+      return;
+    }
+  }
+
+  Offset = IndexOffset + (IndexCount - 1) * UnwindIndexEntrySize;
+  UnwindEndAddress = TextVMAddress + DE.getU32(&Offset);
+  DE.getU32(&Offset);
+  const uint32_t LSDAEndOffset = DE.getU32(&Offset);
+  Offset = IndexOffset + 2 * 4;
+  const uint32_t LSDABeginOffset = DE.getU32(&Offset);
+  for (Offset = LSDABeginOffset; Offset < LSDAEndOffset;) {
+    const uint64_t FunctionAddress = TextVMAddress + DE.getU32(&Offset);
+    const uint64_t LSDAAddress = TextVMAddress + DE.getU32(&Offset);
+    UnwindLSDAs.emplace_back(FunctionAddress, LSDAAddress);
+  }
+}
+
+Optional<uint32_t>
+MachORewriteInstance::getUnwindEncoding(const BinaryFunction &Function) const {
+  const uint32_t DWARFMode =
+      BC->isAArch64() ? UNWIND_ARM64_MODE_DWARF : UNWIND_X86_64_MODE_DWARF;
+  auto It = std::upper_bound(UnwindEntries.begin(), UnwindEntries.end(),
+                             Function.getAddress(),
+                             [](uint64_t Address, const UnwindEntry &Entry) {
+                               return Address < Entry.Address;
+                             });
+  if (It == UnwindEntries.begin())
+    return 0;
+  --It;
+  const uint32_t Encoding = It->Encoding;
+  for (; It != UnwindEntries.end() &&
+         It->Address < Function.getAddress() + Function.getSize();
+       ++It) {
+    if (It->Encoding != Encoding || (It->Encoding & UNWIND_HAS_LSDA) ||
+        (It->Encoding & UNWIND_MODE_MASK) == DWARFMode)
+      return NoneType();
+  }
+  return Encoding;
+}
+
 void MachORewriteInstance::discoverFileObjects() {
   std::vector<SymbolRef> FunctionSymbols;
   for (const SymbolRef &S : InputFile->symbols()) {
@@ -209,6 +359,10 @@ void MachORewriteInstance::discoverFileObjects() {
 
   const std::vector<DataInCodeRegion> DataInCode = readDataInCode(*InputFile);
 
+  if (const Optional<uint64_t> TextVMAddr = readTextVMAddr(*InputFile))
+    TextVMAddress = *TextVMAddr;
+  readUnwindInfo();
+
   for (auto &BFI : BC->getBinaryFunctions()) {
     BinaryFunction &Function = BFI.second;
     Function.setMaxSize(Function.getSize());
@@ -239,6 +393,11 @@ void MachORewriteInstance::discoverFileObjects() {
         It->Offset + It->Length <=
             Function.getFileOffset() + Function.getMaxSize())
       Function.setSimple(false);
+
+    // We do not update exception tables and DWARF unwind info, so the code
+    // of functions using them cannot change.
+    if (!getUnwindEncoding(Function))
+      Function.setSimple(false);
   }
 
   BC->StartFunctionAddress = readStartAddress(*InputFile);
@@ -278,13 +437,47 @@ void MachORewriteInstance::runOptimizationPasses() {
   }
   Manager.registerPass(
       llvm::make_unique<ReorderBasicBlocks>(opts::PrintReordered));
+
+  // Without relocations, split and reordered code can only be placed in the
+  // __bolt section reserved in the input, like the instrumented code.
+  const bool HasBOLTSection =
+      static_cast<bool>(BC->getUniqueSectionByName("__bolt"));
+  if (!HasBOLTSection &&
+      (opts::SplitFunctions != SplitFunctions::ST_NONE ||
+       opts::ReorderFunctions != ReorderFunctions::RT_NONE)) {
+    errs() << "BOLT-WARNING: no __bolt section to place moved code, "
+              "functions will not be split or reordered\n";
+  }
+  Manager.registerPass(llvm::make_unique<SplitFunctions>(opts::PrintSplit),
+                       HasBOLTSection);
   Manager.registerPass(
       llvm::make_unique<FixupBranches>(opts::PrintAfterBranchFixup));
-  // This pass should always run last.*
   Manager.registerPass(
-      llvm::make_unique<FinalizeFunctions>(opts::PrintFinalized));
+      llvm::make_unique<ReorderFunctions>(opts::PrintReorderedFunctions),
+      HasBOLTSection);
 
   Manager.runPasses();
+
+  // Functions ordered by ReorderFunctions are moved to the __bolt section in
+  // that order, and their original entry points jump to the new code.
+  bool MoveFunctions = false;
+  if (!opts::Instrument) {
+    for (auto &BFI : BC->getBinaryFunctions()) {
+      BinaryFunction &Function = BFI.second;
+      if (!Function.hasValidIndex() || !BC->shouldEmit(Function))
+        continue;
+      Function.setOutputAddress(0);
+      MoveFunctions = true;
+    }
+  }
+
+  BinaryFunctionPassManager FinalManager(*BC);
+  FinalManager.registerPass(llvm::make_unique<PatchEntries>(), MoveFunctions);
+  // This pass should always run last.*
+  FinalManager.registerPass(
+      llvm::make_unique<FinalizeFunctions>(opts::PrintFinalized));
+
+  FinalManager.runPasses();
 }
 
 void MachORewriteInstance::mapInstrumentationSection(orc::VModuleKey Key, StringRef SectionName) {
@@ -323,30 +516,70 @@ void MachORewriteInstance::mapCodeSections(orc::VModuleKey Key) {
     Function->setImageSize(FuncSection->getOutputSize());
   }
 
-  if (opts::Instrument) {
-    ErrorOr<BinarySection &> BOLT = BC->getUniqueSectionByName("__bolt");
-    if (!BOLT) {
-      llvm::errs() << "Cannot find __bolt section\n";
-      exit(1);
-    }
-    uint64_t Addr = BOLT->getAddress();
-    for (BinaryFunction *Function : BC->getAllBinaryFunctions()) {
-      if (!Function->isEmitted())
-        continue;
-      if (Function->getOutputAddress() != 0)
-        continue;
-      ErrorOr<BinarySection &> FuncSection = Function->getCodeSection();
-      assert(FuncSection && "cannot find section for function");
-      Addr = llvm::alignTo(Addr, 4);
-      FuncSection->setOutputAddress(Addr);
-      OLT->mapSectionAddress(Key, FuncSection->getSectionID(), Addr);
-      Function->setFileOffset(Addr - BOLT->getAddress() +
-                              BOLT->getInputFileOffset());
-      Function->setImageAddress(FuncSection->getAllocAddress());
-      Function->setImageSize(FuncSection->getOutputSize());
-      Addr += FuncSection->getOutputSize();
-    }
+  ErrorOr<BinarySection &> BOLT = BC->getUniqueSectionByName("__bolt");
+  if (!BOLT) {
+    if (!opts::Instrument)
+      return;
+    llvm::errs() << "Cannot find __bolt section\n";
+    exit(1);
+  }
+
+  // Place moved functions in their final order followed by cold fragments.
+  uint64_t Addr = BOLT->getAddress();
+  auto mapSection = [&](BinarySection &Section) {
+    Addr = llvm::alignTo(Addr, std::max<uint64_t>(4, Section.getAlignment()));
+    Section.setOutputAddress(Addr);
+    OLT->mapSectionAddress(Key, Section.getSectionID(), Addr);
+    const uint64_t SectionAddress = Addr;
+    Addr += Section.getOutputSize();
+    return SectionAddress;
+  };
+
+  std::vector<BinaryFunction *> Functions = BC->getSortedFunctions();
+  Functions.insert(Functions.end(), BC->getInjectedBinaryFunctions().begin(),
+                   BC->getInjectedBinaryFunctions().end());
+  for (BinaryFunction *Function : Functions) {
+    if (!Function->isEmitted())
+      continue;
+    if (Function->getOutputAddress() != 0)
+      continue;
+    ErrorOr<BinarySection &> FuncSection = Function->getCodeSection();
+    assert(FuncSection && "cannot find section for function");
+    Function->setOutputAddress(mapSection(*FuncSection));
+    Function->setFileOffset(Function->getOutputAddress() - BOLT->getAddress() +
+                            BOLT->getInputFileOffset());
+    Function->setImageAddress(FuncSection->getAllocAddress());
+    Function->setImageSize(FuncSection->getOutputSize());
+  }
+
+  std::stable_sort(Functions.begin(), Functions.end(),
+                   [](const BinaryFunction *A, const BinaryFunction *B) {
+                     if (A->hasValidColdIndex() && B->hasValidColdIndex())
+                       return A->getColdIndex() < B->getColdIndex();
+                     return A->hasValidColdIndex();
+                   });
+  for (BinaryFunction *Function : Functions) {
+    if (!Function->isEmitted() || !Function->isSplit())
+      continue;
+    ErrorOr<BinarySection &> ColdSection = Function->getColdCodeSection();
+    assert(ColdSection && "cannot find section for cold part");
+    BinaryFunction::FragmentInfo &ColdPart = Function->cold();
+    ColdPart.setAddress(mapSection(*ColdSection));
+    ColdPart.setFileOffset(ColdPart.getAddress() - BOLT->getAddress() +
+                           BOLT->getInputFileOffset());
+    ColdPart.setImageAddress(ColdSection->getAllocAddress());
+    ColdPart.setImageSize(ColdSection->getOutputSize());
   }
+
+  if (Addr > BOLT->getEndAddress()) {
+    errs() << "BOLT-ERROR: __bolt section of 0x"
+           << Twine::utohexstr(BOLT->getSize()) << " bytes is too small for "
+           << "the moved code of 0x"
+           << Twine::utohexstr(Addr - BOLT->getAddress()) << " bytes\n";
+    exit(1);
+  }
+  if (Addr != BOLT->getAddress())
+    BOLTSectionEnd = Addr;
 }
 
 void MachORewriteInstance::emitAndLink() {
@@ -466,6 +699,232 @@ void MachORewriteInstance::writeInstrumentationSection(StringRef SectionName,
             Section->getOutputSize(), Section->getInputFileOffset());
 }
 
+void MachORewriteInstance::rewriteUnwindInfo(raw_pwrite_stream &OS) {
+  if (UnwindEntries.empty())
+    return;
+
+  ErrorOr<BinarySection &> BOLT = BC->getUniqueSectionByName("__bolt");
+  assert(BOLT && "moved code without __bolt section");
+
+  // Moved code and cold fragments keep the encoding of the function which
+  // is valid past its prologue. The rest of the __bolt section has none.
+  std::vector<UnwindEntry> Entries = UnwindEntries;
+  Entries.push_back({BOLT->getAddress(), 0});
+  for (auto &BFI : BC->getBinaryFunctions()) {
+    const BinaryFunction &Function = BFI.second;
+    const bool IsSplit = Function.isEmitted() && Function.isSplit();
+    if (!isMoved(Function) && !IsSplit)
+      continue;
+    const uint32_t Encoding = *getUnwindEncoding(Function);
+    if (isMoved(Function))
+      Entries.push_back({Function.getOutputAddress(), Encoding});
+    if (IsSplit)
+      Entries.push_back({Function.cold().getAddress(), Encoding});
+  }
+  Entries.push_back({BOLTSectionEnd, 0});
+
+  // Entries added later take precedence at the same address.
+  std::stable_sort(Entries.begin(), Entries.end(),
+                   [](const UnwindEntry &A, const UnwindEntry &B) {
+                     return A.Address < B.Address;
+                   });
+  const uint64_t EndAddress = std::max(UnwindEndAddress, BOLTSectionEnd);
+  std::vector<UnwindEntry> NewEntries;
+  for (const UnwindEntry &Entry : Entries) {
+    if (Entry.Address >= EndAddress)
+      break;
+    if (!NewEntries.empty() && NewEntries.back().Address == Entry.Address)
+      NewEntries.back() = Entry;
+    else
+      NewEntries.push_back(Entry);
+  }
+
+  // Write the header, the personalities, the first-level index, the LSDA
+  // array and regular second-level pages. There are no common encodings.
+  const uint32_t NumPages =
+      (NewEntries.size() + UnwindEntriesPerPage - 1) / UnwindEntriesPerPage;
+  const uint32_t PageSize = 8 + UnwindEntriesPerPage * 8;
+  const uint32_t PersonalitiesOffset = UnwindHeaderSize;
+  const uint32_t IndexOffset =
+      PersonalitiesOffset + UnwindPersonalities.size() * 4;
+  const uint32_t LSDAOffset =
+      IndexOffset + (NumPages + 1) * UnwindIndexEntrySize;
+  const uint32_t PagesOffset = LSDAOffset + UnwindLSDAs.size() * 8;
+  const uint32_t Size = PagesOffset + NumPages * 8 + NewEntries.size() * 8;
+
+  const uint64_t Address = alignTo(BOLTSectionEnd, 4);
+  if (Address + Size > BOLT->getEndAddress()) {
+    errs() << "BOLT-WARNING: no space left in __bolt section for the new "
+              "__unwind_info, moved code will not have unwind info\n";
+    return;
+  }
+  const uint64_t FileOffset =
+      Address - BOLT->getAddress() + BOLT->getInputFileOffset();
+
+  std::vector<char> Buffer(Size);
+  char *Ptr = Buffer.data();
+  auto write32 = [&](uint32_t Value) {
+    support::endian::write32le(Ptr, Value);
+    Ptr += 4;
+  };
+  write32(UNWIND_SECTION_VERSION);
+  write32(PersonalitiesOffset);
+  write32(0);
+  write32(PersonalitiesOffset);
+  write32(UnwindPersonalities.size());
+  write32(IndexOffset);
+  write32(NumPages + 1);
+
+  for (const uint32_t Personality : UnwindPersonalities)
+    write32(Personality);
+
+  size_t LSDAIndex = 0;
+  for (uint32_t Page = 0; Page <= NumPages; ++Page) {
+    const uint64_t PageAddress =
+        Page < NumPages ? NewEntries[Page * UnwindEntriesPerPage].Address
+                        : EndAddress;
+    while (LSDAIndex < UnwindLSDAs.size() &&
+           UnwindLSDAs[LSDAIndex].first < PageAddress)
+      ++LSDAIndex;
+    write32(PageAddress - TextVMAddress);
+    write32(Page < NumPages ? PagesOffset + Page * PageSize : 0);
+    write32(LSDAOffset + LSDAIndex * 8);
+  }
+
+  for (const auto &LSDA : UnwindLSDAs) {
+    write32(LSDA.first - TextVMAddress);
+    write32(LSDA.second - TextVMAddress);
+  }
+
+  for (uint32_t Page = 0; Page < NumPages; ++Page) {
+    const size_t First = Page * UnwindEntriesPerPage;
+    const size_t Count =
+        std::min<size_t>(UnwindEntriesPerPage, NewEntries.size() - First);
+    write32(UNWIND_SECOND_LEVEL_REGULAR);
+    // Offset of the entries in the page and their number.
+    write32(8 | Count << 16);
+    for (size_t I = First; I < First + Count; ++I) {
+      write32(NewEntries[I].Address - TextVMAddress);
+      write32(NewEntries[I].Encoding);
+    }
+  }
+  assert(Ptr == Buffer.data() + Size && "unexpected __unwind_info size");
+  OS.pwrite(Buffer.data(), Buffer.size(), FileOffset);
+
+  // Point the section header to the new unwind info.
+  for (const auto &LC : InputFile->load_commands()) {
+    if (LC.C.cmd != MachO::LC_SEGMENT_64)
+      continue;
+    const MachO::segment_command_64 Segment =
+        InputFile->getSegment64LoadCommand(LC);
+    for (uint32_t I = 0; I < Segment.nsects; ++I) {
+      MachO::section_64 Header = InputFile->getSection64(LC, I);
+      if (StringRef(Header.sectname,
+                    strnlen(Header.sectname, sizeof(Header.sectname))) !=
+          "__unwind_info")
+        continue;
+      Header.addr = Address;
+      Header.size = Size;
+      Header.offset = FileOffset;
+      if (sys::IsBigEndianHost)
+        MachO::swapStruct(Header);
+      const char *HeaderPtr = LC.Ptr + sizeof(MachO::segment_command_64) +
+                              I * sizeof(MachO::section_64);
+      OS.pwrite(reinterpret_cast<const char *>(&Header), sizeof(Header),
+                HeaderPtr - InputFile->getData().data());
+      return;
+    }
+  }
+}
+
+void MachORewriteInstance::rewriteFunctionStarts(raw_pwrite_stream &OS) {
+  for (const auto &LC : InputFile->load_commands()) {
+    if (LC.C.cmd != MachO::LC_FUNCTION_STARTS)
+      continue;
+    const MachO::linkedit_data_command FunctionStarts =
+        InputFile->getLinkeditDataLoadCommand(LC);
+
+    // The starts are encoded as ULEB128 deltas from the __TEXT segment and
+    // the previous start, terminated by a zero.
+    const uint8_t *Data = reinterpret_cast<const uint8_t *>(
+        InputFile->getData().data() + FunctionStarts.dataoff);
+    const uint8_t *End = Data + FunctionStarts.datasize;
+    std::vector<uint64_t> Starts;
+    uint64_t Address = TextVMAddress;
+    while (Data < End) {
+      unsigned Size;
+      const uint64_t Delta = decodeULEB128(Data, &Size, End);
+      Data += Size;
+      if (!Delta)
+        break;
+      Address += Delta;
+      Starts.push_back(Address);
+    }
+
+    for (auto &BFI : BC->getBinaryFunctions()) {
+      const BinaryFunction &Function = BFI.second;
+      if (isMoved(Function))
+        Starts.push_back(Function.getOutputAddress());
+      if (Function.isEmitted() && Function.isSplit())
+        Starts.push_back(Function.cold().getAddress());
+    }
+    std::sort(Starts.begin(), Starts.end());
+    Starts.erase(std::unique(Starts.begin(), Starts.end()), Starts.end());
+
+    SmallString<256> Buffer;
+    raw_svector_ostream BufferOS(Buffer);
+    uint64_t PrevAddress = TextVMAddress;
+    for (const uint64_t Start : Starts) {
+      encodeULEB128(Start - PrevAddress, BufferOS);
+      PrevAddress = Start;
+    }
+    if (Buffer.size() > FunctionStarts.datasize) {
+      errs() << "BOLT-WARNING: no space left in LC_FUNCTION_STARTS for the "
+                "moved code, function starts will not be updated\n";
+      return;
+    }
+    Buffer.resize(FunctionStarts.datasize, 0);
+    OS.pwrite(Buffer.data(), Buffer.size(), FunctionStarts.dataoff);
+    return;
+  }
+}
+
+void MachORewriteInstance::rewriteSymbolTable(raw_pwrite_stream &OS) {
+  if (!InputFile->is64Bit())
+    return;
+
+  uint8_t BOLTSectionIndex = 0;
+  for (const SectionRef &Section : InputFile->sections()) {
+    StringRef SectionName;
+    check_error(Section.getName(SectionName), "cannot get section name");
+    if (SectionName == "__bolt")
+      BOLTSectionIndex = Section.getIndex() + 1;
+  }
+
+  // Symbols of moved functions point to the new code. Debug symbols are left
+  // unchanged.
+  for (const SymbolRef &Symbol : InputFile->symbols()) {
+    const DataRefImpl DRI = Symbol.getRawDataRefImpl();
+    const MachO::nlist_64 Entry = InputFile->getSymbol64TableEntry(DRI);
+    if ((Entry.n_type & MachO::N_STAB) ||
+        (Entry.n_type & MachO::N_TYPE) != MachO::N_SECT)
+      continue;
+    const auto It = BC->getBinaryFunctions().find(Entry.n_value);
+    if (It == BC->getBinaryFunctions().end() || !isMoved(It->second))
+      continue;
+    const BinaryFunction *Function = &It->second;
+
+    const uint64_t Offset =
+        reinterpret_cast<const char *>(DRI.p) - InputFile->getData().data();
+    char Value[8];
+    support::endian::write64le(Value, Function->getOutputAddress());
+    OS.pwrite(Value, sizeof(Value),
+              Offset + offsetof(MachO::nlist_64, n_value));
+    OS.pwrite(reinterpret_cast<const char *>(&BOLTSectionIndex), 1,
+              Offset + offsetof(MachO::nlist_64, n_sect));
+  }
+}
+
 void MachORewriteInstance::rewriteFile() {
   std::error_code EC;
   Out = llvm::make_unique<ToolOutputFile>(
@@ -477,15 +936,20 @@ void MachORewriteInstance::rewriteFile() {
 
   for (auto &BFI : BC->getBinaryFunctions()) {
     BinaryFunction &Function = BFI.second;
-    if (!Function.isSimple())
+    if (!Function.isSimple() || !BC->shouldEmit(Function))
       continue;
     assert(Function.isEmitted() && "Simple function has not been emitted");
-    if (!opts::Instrument && (Function.getImageSize() > Function.getMaxSize()))
+    if (!isMoved(Function) &&
+        Function.getImageSize() > Function.getMaxSize())
       continue;
     if (opts::Verbosity >= 2)
       outs() << "BOLT: rewriting function \"" << Function << "\"\n";
     OS.pwrite(reinterpret_cast<char *>(Function.getImageAddress()),
               Function.getImageSize(), Function.getFileOffset());
+    if (Function.isSplit())
+      OS.pwrite(reinterpret_cast<char *>(Function.cold().getImageAddress()),
+                Function.cold().getImageSize(),
+                Function.cold().getFileOffset());
   }
 
   for (const BinaryFunction *Function : BC->getInjectedBinaryFunctions()) {
@@ -501,6 +965,12 @@ void MachORewriteInstance::rewriteFile() {
   writeInstrumentationSection("I__text", OS);
   writeInstrumentationSection("I__cstring", OS);
 
+  if (BOLTSectionEnd) {
+    rewriteUnwindInfo(OS);
+    rewriteFunctionStarts(OS);
+    rewriteSymbolTable(OS);
+  }
+
   Out->keep();
 }
 
@@ -508,7 +978,8 @@ void MachORewriteInstance::adjustCommandLineOptions() {
   opts::CheckOverlappingElements = false;
   if (!opts::AlignText.getNumOccurrences())
     opts::AlignText = BC->PageAlign;
-  if (opts::Instrument.getNumOccurrences())
+  if (opts::Instrument.getNumOccurrences() ||
+      opts::ReorderFunctions != ReorderFunctions::RT_NONE)
     opts::ForcePatch = true;
   opts::JumpTables = JTS_MOVE;
   opts::InstrumentCalls = false;
@@ -15,9 +15,11 @@
 #define LLVM_TOOLS_LLVM_BOLT_MACHO_REWRITE_INSTANCE_H
 
 #include "NameResolver.h"
+#include "llvm/ADT/Optional.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
 #include "llvm/Object/MachO.h"
 #include <memory>
+#include <vector>
 
 namespace llvm {
 
@@ -34,6 +36,7 @@ class RTDyldObjectLinkingLayer;
 namespace bolt {
 
 class BinaryContext;
+class BinaryFunction;
 
 class MachORewriteInstance {
   object::MachOObjectFile *InputFile;
@@ -48,8 +51,43 @@ class MachORewriteInstance {
 
   std::unique_ptr<ToolOutputFile> Out;
 
+  /// An entry of the compact unwind info. The encoding applies to the code
+  /// from the address up to the address of the next entry.
+  struct UnwindEntry {
+    uint64_t Address;
+    uint32_t Encoding;
+  };
+
+  /// Entries of the input __unwind_info sorted by address, with the end
+  /// address of the code they describe.
+  std::vector<UnwindEntry> UnwindEntries;
+  uint64_t UnwindEndAddress{0};
+
+  /// Personality functions and pairs of function and LSDA addresses of the
+  /// input __unwind_info, written unchanged to the output.
+  std::vector<uint32_t> UnwindPersonalities;
+  std::vector<std::pair<uint64_t, uint64_t>> UnwindLSDAs;
+
+  /// Address of the __TEXT segment which offsets in the unwind info and
+  /// function starts are relative to.
+  uint64_t TextVMAddress{0};
+
+  /// Address past the code placed in the __bolt section, or 0 if no code
+  /// was moved there.
+  uint64_t BOLTSectionEnd{0};
+
   static StringRef getOrgSecPrefix() { return ".bolt.org"; }
 
+  /// Return true if the code of \p Function was moved to the __bolt section.
+  static bool isMoved(const BinaryFunction &Function);
+
+  void readUnwindInfo();
+
+  /// Return the compact unwind encoding of \p Function, or None if it cannot
+  /// be moved with a single encoding because it has an LSDA or DWARF unwind
+  /// info that we do not update, or several distinct encodings.
+  Optional<uint32_t> getUnwindEncoding(const BinaryFunction &Function) const;
+
   void mapInstrumentationSection(orc::VModuleKey Key, StringRef SectionName);
   void mapCodeSections(orc::VModuleKey Key);
 
@@ -62,6 +100,17 @@ class MachORewriteInstance {
   void emitAndLink();
 
   void writeInstrumentationSection(StringRef SectionName, raw_pwrite_stream &OS);
+
+  /// Write a new __unwind_info after the code in the __bolt section that
+  /// also covers the moved code, and point the section header to it.
+  void rewriteUnwindInfo(raw_pwrite_stream &OS);
+
+  /// Add the new addresses of moved code to LC_FUNCTION_STARTS.
+  void rewriteFunctionStarts(raw_pwrite_stream &OS);
+
+  /// Update the symbols of moved functions with their new addresses.
+  void rewriteSymbolTable(raw_pwrite_stream &OS);
+
   void rewriteFile();
 
 public:
@@ -0,0 +1,90 @@
+//===--- NameTable.h - Table of interned profile names ----------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Table of unique names shared by profile readers.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_NAME_TABLE_H
+#define LLVM_TOOLS_LLVM_BOLT_NAME_TABLE_H
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/raw_ostream.h"
+#include <vector>
+
+namespace llvm {
+namespace bolt {
+
+/// Every distinct name is stored once and is assigned a dense integer ID.
+/// References returned by intern() for equal names point to the same storage
+/// and remain valid for the lifetime of the table, hence interned names could
+/// be compared by their data pointers.
+class NameTable {
+  StringMap<uint32_t, BumpPtrAllocator> IDs;
+  std::vector<StringRef> Names;
+
+  /// Total size of all names passed to the table, including duplicates.
+  uint64_t ReferencedBytes{0};
+
+public:
+  /// Return the ID of \p Name, adding it to the table if necessary.
+  uint32_t getID(StringRef Name) {
+    ReferencedBytes += Name.size();
+    auto Result = IDs.insert(std::make_pair(Name, Names.size()));
+    if (Result.second)
+      Names.push_back(Result.first->getKey());
+    return Result.first->getValue();
+  }
+
+  /// Return the ID of \p Name if it is in the table.
+  Optional<uint32_t> lookup(StringRef Name) const {
+    auto I = IDs.find(Name);
+    if (I == IDs.end())
+      return NoneType();
+    return I->getValue();
+  }
+
+  /// Return the canonical copy of \p Name owned by the table.
+  StringRef intern(StringRef Name) {
+    return Names[getID(Name)];
+  }
+
+  StringRef getName(uint32_t ID) const {
+    assert(ID < Names.size() && "invalid name ID");
+    return Names[ID];
+  }
+
+  size_t size() const { return Names.size(); }
+
+  /// Return the number of bytes used by unique names.
+  uint64_t getUniqueBytes() const {
+    uint64_t Size = 0;
+    for (const auto Name : Names)
+      Size += Name.size();
+    return Size;
+  }
+
+  /// Return the number of bytes that would have been used by separate copies
+  /// of all the names referenced through the table.
+  uint64_t getSavedBytes() const {
+    return ReferencedBytes - getUniqueBytes();
+  }
+
+  void printStats(raw_ostream &OS, StringRef Prefix) const {
+    OS << Prefix << "interned " << size() << " unique names ("
+       << getUniqueBytes() / 1024 << " KB), saving "
+       << getSavedBytes() / 1024 << " KB of duplicate names\n";
+  }
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
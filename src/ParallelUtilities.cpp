@@ -10,9 +10,23 @@
 //===----------------------------------------------------------------------===//
 
 #include "ParallelUtilities.h"
+#include "Progress.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/Timer.h"
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <mutex>
+#include <numeric>
 #include <shared_mutex>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #define DEBUG_TYPE "par-utils"
 
@@ -37,6 +51,29 @@ TaskCount("tasks-per-thread",
   cl::init(20),
   cl::cat(BoltCategory));
 
+cl::opt<bool>
+WorkStealing("work-stealing",
+  cl::desc("schedule parallel work on functions with work stealing, "
+           "starting from the most expensive functions"),
+  cl::init(false),
+  cl::cat(BoltCategory));
+
+static cl::opt<bool>
+NUMAThreads("numa-threads",
+  cl::desc("spread the threads over NUMA nodes and run parallel work on "
+           "functions on the node that holds their data"),
+  cl::init(false),
+  cl::cat(BoltCategory));
+
+static cl::opt<std::string>
+CostHistoryFile("schedule-cost-file",
+  cl::desc("file with per-function run times of parallel work recorded by "
+           "previous runs. The times are used in place of the scheduling "
+           "policy estimates and are updated at the end of the run"),
+  cl::value_desc("filename"),
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
 } // namespace opts
 
 namespace llvm {
@@ -47,7 +84,205 @@ namespace {
 /// A single thread pool that is used to run parallel tasks
 std::unique_ptr<ThreadPool> ThreadPoolPtr;
 
-unsigned computeCostFor(const BinaryFunction &BF,
+/// CPUs of every NUMA node of the host. Empty unless -numa-threads is used
+/// on a host with more than one node.
+std::vector<std::vector<unsigned>> NUMANodeCPUs;
+
+/// NUMA node the current thread is pinned to, or -1U.
+thread_local unsigned CurrentNUMANode = -1U;
+
+/// Return true if the threads of the pool are pinned to NUMA nodes.
+bool isNUMAEnabled() {
+  if (!opts::NUMAThreads || opts::NoThreads)
+    return false;
+  getThreadPool();
+  return NUMANodeCPUs.size() > 1;
+}
+
+/// Read the CPUs of NUMA nodes from sysfs. Nodes are numbered in the order of
+/// their sysfs indices.
+void readNUMANodes() {
+  std::map<unsigned, std::vector<unsigned>> Nodes;
+  std::error_code EC;
+  for (sys::fs::directory_iterator DI("/sys/devices/system/node", EC), DE;
+       DI != DE && !EC; DI.increment(EC)) {
+    StringRef Name = sys::path::filename(DI->path());
+    unsigned NodeId;
+    if (!Name.consume_front("node") || Name.getAsInteger(10, NodeId))
+      continue;
+    auto MB = MemoryBuffer::getFile(DI->path() + "/cpulist");
+    if (!MB)
+      continue;
+
+    // The list is formatted as "0-15,32-47".
+    SmallVector<StringRef, 8> Ranges;
+    MB.get()->getBuffer().trim().split(Ranges, ',', -1, false);
+    auto &CPUs = Nodes[NodeId];
+    for (auto Range : Ranges) {
+      StringRef FirstStr, LastStr;
+      std::tie(FirstStr, LastStr) = Range.split('-');
+      unsigned First, Last;
+      if (FirstStr.getAsInteger(10, First))
+        continue;
+      if (LastStr.empty() || LastStr.getAsInteger(10, Last))
+        Last = First;
+      for (auto CPU = First; CPU <= Last; ++CPU)
+        CPUs.push_back(CPU);
+    }
+    if (CPUs.empty())
+      Nodes.erase(NodeId);
+  }
+
+  for (auto &Node : Nodes)
+    NUMANodeCPUs.emplace_back(std::move(Node.second));
+  if (NUMANodeCPUs.size() < 2) {
+    outs() << "BOLT-INFO: -numa-threads has no effect on a host with a single "
+              "NUMA node\n";
+    NUMANodeCPUs.clear();
+  }
+}
+
+/// Pin the threads of \p Pool to NUMA nodes round-robin. Every thread runs
+/// one task, which waits for all the others to start, and allocates memory for
+/// the work it runs on its node.
+void pinThreadsToNUMANodes(ThreadPool &Pool) {
+#ifdef __linux__
+  std::mutex Lock;
+  std::condition_variable AllPinned;
+  unsigned NumPinned = 0;
+  for (unsigned I = 0; I < opts::ThreadCount; ++I) {
+    Pool.async([&](unsigned Node) {
+      cpu_set_t CPUs;
+      CPU_ZERO(&CPUs);
+      for (auto CPU : NUMANodeCPUs[Node])
+        CPU_SET(CPU, &CPUs);
+      if (sched_setaffinity(0, sizeof(CPUs), &CPUs))
+        DEBUG(dbgs() << "BOLT-DEBUG: cannot pin thread to NUMA node " << Node
+                     << '\n');
+      CurrentNUMANode = Node;
+
+      std::unique_lock<std::mutex> Guard(Lock);
+      if (++NumPinned == opts::ThreadCount)
+        AllPinned.notify_all();
+      else
+        AllPinned.wait(Guard, [&]() { return NumPinned == opts::ThreadCount; });
+    }, I % NUMANodeCPUs.size());
+  }
+  Pool.wait();
+#endif
+}
+
+/// Wall time in microseconds of running a named parallel job on functions.
+/// Functions are identified by a hash of their name and size that is stable
+/// between builds of the same binary.
+class CostHistory {
+  using FunctionCostsTy = DenseMap<uint64_t, uint64_t>;
+
+  /// Costs read from the history file. Not modified while jobs are running.
+  StringMap<FunctionCostsTy> Costs;
+
+  /// Costs measured in this run.
+  StringMap<FunctionCostsTy> NewCosts;
+  std::mutex NewCostsLock;
+
+  bool IsLoaded{false};
+
+public:
+  using MeasurementsTy = std::vector<std::pair<uint64_t, uint64_t>>;
+
+  static uint64_t getKey(const BinaryFunction &BF) {
+    return hash_combine(BF.getOneName(), BF.getSize());
+  }
+
+  void load() {
+    if (IsLoaded)
+      return;
+    IsLoaded = true;
+
+    auto MB = MemoryBuffer::getFileOrSTDIN(opts::CostHistoryFile);
+    if (!MB)
+      return;
+    for (line_iterator LI(*MB.get(), /*SkipBlanks=*/true); !LI.is_at_eof();
+         ++LI) {
+      SmallVector<StringRef, 3> Fields;
+      LI->split(Fields, ' ');
+      uint64_t Key, Cost;
+      if (Fields.size() != 3 || Fields[1].getAsInteger(16, Key) ||
+          Fields[2].getAsInteger(10, Cost)) {
+        errs() << "BOLT-WARNING: ignoring malformed line in "
+               << opts::CostHistoryFile << ": " << *LI << '\n';
+        continue;
+      }
+      Costs[Fields[0]][Key] = Cost;
+    }
+  }
+
+  const FunctionCostsTy *getCosts(StringRef LogName) const {
+    auto I = Costs.find(LogName);
+    return I == Costs.end() ? nullptr : &I->second;
+  }
+
+  void record(StringRef LogName, const MeasurementsTy &Measurements) {
+    if (Measurements.empty())
+      return;
+    std::lock_guard<std::mutex> Lock(NewCostsLock);
+    auto &FunctionCosts = NewCosts[LogName];
+    for (const auto &Measurement : Measurements)
+      FunctionCosts[Measurement.first] += Measurement.second;
+  }
+
+  /// Merge the costs measured in this run into the history and write it out.
+  void save() {
+    if (NewCosts.empty())
+      return;
+    for (auto &Job : NewCosts)
+      for (const auto &Entry : Job.second)
+        Costs[Job.getKey()][Entry.first] = Entry.second;
+    NewCosts.clear();
+
+    std::error_code EC;
+    raw_fd_ostream OS(opts::CostHistoryFile, EC, sys::fs::F_None);
+    if (EC) {
+      errs() << "BOLT-WARNING: cannot write " << opts::CostHistoryFile << ": "
+             << EC.message() << '\n';
+      return;
+    }
+    for (const auto &Job : Costs)
+      for (const auto &Entry : Job.second)
+        OS << Job.getKey() << ' ' << Twine::utohexstr(Entry.first) << ' '
+           << Entry.second << '\n';
+  }
+};
+
+CostHistory History;
+
+/// Return true if the run times of job \p LogName should be recorded.
+bool isCostHistoryEnabled(StringRef LogName) {
+  return !opts::CostHistoryFile.empty() && !LogName.empty();
+}
+
+/// Run \p Work on \p BF and append its wall time to \p Measurements unless it
+/// is null.
+template <typename WorkTy>
+void runAndMeasure(BinaryFunction &BF,
+                   CostHistory::MeasurementsTy *Measurements, WorkTy Work) {
+  // The work is going to allocate its data on the node of the thread.
+  if (CurrentNUMANode != -1U)
+    BF.setNUMANode(CurrentNUMANode);
+
+  if (!Measurements) {
+    Work();
+    return;
+  }
+  const auto Start = std::chrono::steady_clock::now();
+  Work();
+  const auto Time = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - Start).count();
+  Measurements->emplace_back(CostHistory::getKey(BF),
+                             std::max<uint64_t>(1, Time));
+}
+
+uint64_t computeCostFor(const BinaryFunction &BF,
                         const PredicateTy &SkipPredicate,
                         const SchedulingPolicy &SchedPolicy) {
   if (SchedPolicy == SchedulingPolicy::SP_TRIVIAL)
@@ -72,16 +307,20 @@ unsigned computeCostFor(const BinaryFunction &BF,
   }
 }
 
-inline unsigned estimateTotalCost(const BinaryContext &BC,
-                                  const PredicateTy &SkipPredicate,
-                                  SchedulingPolicy &SchedPolicy) {
-  if (SchedPolicy == SchedulingPolicy::SP_TRIVIAL)
-    return BC.getBinaryFunctions().size();
-
-  unsigned TotalCost = 0;
+/// Return the cost of every function in the order of
+/// BC.getBinaryFunctions(). When run times of job \p LogName were recorded
+/// earlier, they replace the estimates of \p SchedPolicy. Estimates of
+/// functions without recorded times are scaled to match the recorded ones.
+std::vector<uint64_t> computeCosts(const BinaryContext &BC,
+                                   const PredicateTy &SkipPredicate,
+                                   SchedulingPolicy &SchedPolicy,
+                                   StringRef LogName) {
+  std::vector<uint64_t> Costs;
+  Costs.reserve(BC.getBinaryFunctions().size());
+  uint64_t TotalCost = 0;
   for (auto &BFI : BC.getBinaryFunctions()) {
-    auto &BF = BFI.second;
-    TotalCost += computeCostFor(BF, SkipPredicate, SchedPolicy);
+    Costs.push_back(computeCostFor(BFI.second, SkipPredicate, SchedPolicy));
+    TotalCost += Costs.back();
   }
 
   // Switch to trivial scheduling if total estimated work is zero
@@ -90,9 +329,147 @@ inline unsigned estimateTotalCost(const BinaryContext &BC,
               "switch to  trivial scheduling.\n";
 
     SchedPolicy = SP_TRIVIAL;
-    TotalCost = BC.getBinaryFunctions().size();
+    std::fill(Costs.begin(), Costs.end(), 1);
   }
-  return TotalCost;
+
+  if (!isCostHistoryEnabled(LogName))
+    return Costs;
+
+  History.load();
+  const auto *FunctionCosts = History.getCosts(LogName);
+  if (!FunctionCosts)
+    return Costs;
+
+  std::vector<uint64_t> Measured(Costs.size(), 0);
+  uint64_t MeasuredCost = 0;
+  uint64_t EstimatedCost = 0;
+  size_t I = 0;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    if (Costs[I]) {
+      auto CI = FunctionCosts->find(CostHistory::getKey(BFI.second));
+      if (CI != FunctionCosts->end()) {
+        Measured[I] = CI->second;
+        MeasuredCost += CI->second;
+        EstimatedCost += Costs[I];
+      }
+    }
+    ++I;
+  }
+  if (!MeasuredCost)
+    return Costs;
+
+  const double Scale = (double) MeasuredCost / std::max<uint64_t>(1,
+                                                              EstimatedCost);
+  for (I = 0; I < Costs.size(); ++I) {
+    if (Measured[I])
+      Costs[I] = Measured[I];
+    else if (Costs[I])
+      Costs[I] = std::max<uint64_t>(1, Costs[I] * Scale);
+  }
+  return Costs;
+}
+
+/// Run \p WorkFunction on every function that is not accepted by
+/// \p SkipPredicate using \p NumWorkers tasks of the thread pool. Every
+/// worker owns a queue and takes functions from the front of it. Once the
+/// queue is empty, the worker steals functions from the back of the queues of
+/// other workers. Functions are distributed in the order of decreasing
+/// estimated cost, so the most expensive functions are processed first and
+/// cheap ones are left for balancing the tail of the work. With a time budget,
+/// functions are distributed in the order of decreasing execution count
+/// instead. A single worker runs on the calling thread.
+///
+/// With -numa-threads, workers of a NUMA node share one queue, and functions
+/// are queued on the node that last ran work on them.
+void runWorkStealing(
+    BinaryContext &BC, SchedulingPolicy SchedPolicy,
+    const PredicateTy &SkipPredicate, unsigned NumWorkers,
+    std::function<void(BinaryFunction &BF, unsigned WorkerId)> WorkFunction,
+    StringRef LogName) {
+  assert(NumWorkers && "expected at least one worker");
+  const auto Costs = computeCosts(BC, SkipPredicate, SchedPolicy, LogName);
+  std::vector<std::pair<uint64_t, BinaryFunction *>> Functions;
+  size_t Index = 0;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &BF = BFI.second;
+    const auto Cost = Costs[Index++];
+    if (SkipPredicate && SkipPredicate(BF))
+      continue;
+    Functions.emplace_back(
+        BC.hasTimeBudget() ? BF.getKnownExecutionCount() : Cost, &BF);
+  }
+  Progress::advance(BC.getBinaryFunctions().size() - Functions.size());
+  std::stable_sort(Functions.begin(), Functions.end(),
+                   [](const std::pair<uint64_t, BinaryFunction *> &A,
+                      const std::pair<uint64_t, BinaryFunction *> &B) {
+                     return A.first > B.first;
+                   });
+
+  struct WorkQueue {
+    std::mutex Lock;
+    std::deque<BinaryFunction *> Functions;
+  };
+  const bool UseNUMA = NumWorkers > 1 && isNUMAEnabled();
+  const unsigned NumQueues = UseNUMA ? NUMANodeCPUs.size() : NumWorkers;
+  std::unique_ptr<WorkQueue[]> Queues(new WorkQueue[NumQueues]);
+  for (size_t I = 0; I < Functions.size(); ++I) {
+    auto *BF = Functions[I].second;
+    auto QueueId = I % NumQueues;
+    if (UseNUMA && BF->getNUMANode() < NumQueues)
+      QueueId = BF->getNUMANode();
+    Queues[QueueId].Functions.push_back(BF);
+  }
+  Functions.clear();
+
+  auto getNextFunction = [&](unsigned WorkerId) -> BinaryFunction * {
+    const unsigned QueueId = UseNUMA ? CurrentNUMANode : WorkerId;
+    {
+      auto &Queue = Queues[QueueId];
+      std::lock_guard<std::mutex> Lock(Queue.Lock);
+      if (!Queue.Functions.empty()) {
+        auto *BF = Queue.Functions.front();
+        Queue.Functions.pop_front();
+        return BF;
+      }
+    }
+    for (unsigned I = 1; I < NumQueues; ++I) {
+      auto &Queue = Queues[(QueueId + I) % NumQueues];
+      std::lock_guard<std::mutex> Lock(Queue.Lock);
+      if (!Queue.Functions.empty()) {
+        auto *BF = Queue.Functions.back();
+        Queue.Functions.pop_back();
+        return BF;
+      }
+    }
+    return nullptr;
+  };
+
+  // No functions are added after the start, hence a worker that fails to find
+  // a function in any of the queues is done.
+  auto runWorker = [&](unsigned WorkerId) {
+    Timer T(LogName, LogName);
+    DEBUG(T.startTimer());
+    CostHistory::MeasurementsTy Measurements;
+    auto *MeasurementsPtr =
+        isCostHistoryEnabled(LogName) ? &Measurements : nullptr;
+    while (auto *BF = getNextFunction(WorkerId)) {
+      runAndMeasure(*BF, MeasurementsPtr,
+                    [&]() { WorkFunction(*BF, WorkerId); });
+      Progress::advance();
+    }
+    History.record(LogName, Measurements);
+    DEBUG(T.stopTimer());
+  };
+
+  if (NumWorkers == 1) {
+    runWorker(0);
+    return;
+  }
+
+  ThreadPool &Pool = getThreadPool();
+  for (unsigned I = 0; I < NumWorkers; ++I)
+    Pool.async(runWorker, I);
+  Pool.wait();
 }
 
 } // namespace
@@ -102,9 +479,27 @@ ThreadPool &getThreadPool() {
     return *ThreadPoolPtr;
 
   ThreadPoolPtr = std::make_unique<ThreadPool>(opts::ThreadCount);
+  if (opts::NUMAThreads) {
+    static bool NUMANodesRead = false;
+    if (!NUMANodesRead) {
+      NUMANodesRead = true;
+      readNUMANodes();
+    }
+    if (NUMANodeCPUs.size() > 1)
+      pinThreadsToNUMANodes(*ThreadPoolPtr);
+  }
   return *ThreadPoolPtr;
 }
 
+void resetThreadPool() {
+  ThreadPoolPtr.reset();
+}
+
+void saveCostHistory() {
+  if (!opts::CostHistoryFile.empty())
+    History.save();
+}
+
 void runOnEachFunction(BinaryContext &BC, SchedulingPolicy SchedPolicy,
                        WorkFuncTy WorkFunction, PredicateTy SkipPredicate,
                        std::string LogName, bool ForceSequential,
@@ -112,41 +507,59 @@ void runOnEachFunction(BinaryContext &BC, SchedulingPolicy SchedPolicy,
   if (BC.getBinaryFunctions().size() == 0)
     return;
 
+  ProgressTask PT(LogName, BC.getBinaryFunctions().size());
+
   auto runBlock = [&](std::map<uint64_t, BinaryFunction>::iterator BlockBegin,
                       std::map<uint64_t, BinaryFunction>::iterator BlockEnd) {
     Timer T(LogName, LogName);
     DEBUG(T.startTimer());
+    CostHistory::MeasurementsTy Measurements;
+    auto *MeasurementsPtr =
+        isCostHistoryEnabled(LogName) ? &Measurements : nullptr;
 
     for (auto It = BlockBegin; It != BlockEnd; ++It) {
       auto &BF = It->second;
+      Progress::advance();
       if (SkipPredicate && SkipPredicate(BF))
         continue;
 
-      WorkFunction(BF);
+      runAndMeasure(BF, MeasurementsPtr, [&]() { WorkFunction(BF); });
     }
+    History.record(LogName, Measurements);
     DEBUG(T.stopTimer());
   };
 
-  if (opts::NoThreads || ForceSequential) {
+  const bool Sequential = opts::NoThreads || ForceSequential;
+  if (Sequential && !BC.hasTimeBudget()) {
     runBlock(BC.getBinaryFunctions().begin(), BC.getBinaryFunctions().end());
     return;
   }
 
+  if (opts::WorkStealing || BC.hasTimeBudget() || isNUMAEnabled()) {
+    runWorkStealing(BC, SchedPolicy, SkipPredicate,
+                    Sequential ? 1 : opts::ThreadCount,
+                    [&](BinaryFunction &BF, unsigned) { WorkFunction(BF); },
+                    LogName);
+    return;
+  }
+
   // Estimate the overall runtime cost using the scheduling policy
-  const unsigned TotalCost = estimateTotalCost(BC, SkipPredicate, SchedPolicy);
+  const auto Costs = computeCosts(BC, SkipPredicate, SchedPolicy, LogName);
+  const uint64_t TotalCost =
+      std::accumulate(Costs.begin(), Costs.end(), uint64_t(0));
   const unsigned BlocksCount = TasksPerThread * opts::ThreadCount;
-  const unsigned BlockCost =
+  const uint64_t BlockCost =
       TotalCost > BlocksCount ? TotalCost / BlocksCount : 1;
 
   // Divide work into blocks of equal cost
   ThreadPool &Pool = getThreadPool();
   auto BlockBegin = BC.getBinaryFunctions().begin();
-  unsigned CurrentCost = 0;
+  uint64_t CurrentCost = 0;
+  size_t Index = 0;
 
   for (auto It = BC.getBinaryFunctions().begin();
        It != BC.getBinaryFunctions().end(); ++It) {
-    auto &BF = It->second;
-    CurrentCost += computeCostFor(BF, SkipPredicate, SchedPolicy);
+    CurrentCost += Costs[Index++];
 
     if (CurrentCost >= BlockCost) {
       Pool.async(runBlock, BlockBegin, std::next(It));
@@ -158,6 +571,22 @@ void runOnEachFunction(BinaryContext &BC, SchedulingPolicy SchedPolicy,
   Pool.wait();
 }
 
+void runOnEachFunctionLargestFirst(BinaryContext &BC,
+                                   SchedulingPolicy SchedPolicy,
+                                   WorkFuncTy WorkFunction,
+                                   PredicateTy SkipPredicate,
+                                   std::string LogName) {
+  if (BC.getBinaryFunctions().size() == 0)
+    return;
+
+  ProgressTask PT(LogName, BC.getBinaryFunctions().size());
+
+  runWorkStealing(BC, SchedPolicy, SkipPredicate,
+                  opts::NoThreads ? 1 : opts::ThreadCount,
+                  [&](BinaryFunction &BF, unsigned) { WorkFunction(BF); },
+                  LogName);
+}
+
 void runOnEachFunctionWithUniqueAllocId(
     BinaryContext &BC, SchedulingPolicy SchedPolicy,
     WorkFuncWithAllocTy WorkFunction, PredicateTy SkipPredicate,
@@ -165,45 +594,81 @@ void runOnEachFunctionWithUniqueAllocId(
   if (BC.getBinaryFunctions().size() == 0)
     return;
 
+  ProgressTask PT(LogName, BC.getBinaryFunctions().size());
+
   std::shared_timed_mutex MainLock;
   auto runBlock = [&](std::map<uint64_t, BinaryFunction>::iterator BlockBegin,
                       std::map<uint64_t, BinaryFunction>::iterator BlockEnd,
                       MCPlusBuilder::AllocatorIdTy AllocId) {
     Timer T(LogName, LogName);
     DEBUG(T.startTimer());
+    CostHistory::MeasurementsTy Measurements;
+    auto *MeasurementsPtr =
+        isCostHistoryEnabled(LogName) ? &Measurements : nullptr;
     std::shared_lock<std::shared_timed_mutex> Lock(MainLock);
     for (auto It = BlockBegin; It != BlockEnd; ++It) {
       auto &BF = It->second;
+      Progress::advance();
       if (SkipPredicate && SkipPredicate(BF))
         continue;
 
-      WorkFunction(BF, AllocId);
+      runAndMeasure(BF, MeasurementsPtr, [&]() { WorkFunction(BF, AllocId); });
     }
+    History.record(LogName, Measurements);
     DEBUG(T.stopTimer());
   };
 
-  if (opts::NoThreads || ForceSequential) {
+  const bool Sequential = opts::NoThreads || ForceSequential;
+  if (Sequential && !BC.hasTimeBudget()) {
     runBlock(BC.getBinaryFunctions().begin(), BC.getBinaryFunctions().end(), 0);
     return;
   }
+
+  if (Sequential) {
+    runWorkStealing(BC, SchedPolicy, SkipPredicate, 1,
+                    [&](BinaryFunction &BF, unsigned) {
+                      WorkFunction(BF, 0);
+                    },
+                    LogName);
+    return;
+  }
+
+  if (opts::WorkStealing || BC.hasTimeBudget() || isNUMAEnabled()) {
+    // Every worker gets its own allocator, as it runs one function at a time.
+    for (unsigned AllocId = 1; AllocId <= opts::ThreadCount; ++AllocId) {
+      if (!BC.MIB->checkAllocatorExists(AllocId)) {
+        auto Id = BC.MIB->initializeNewAnnotationAllocator();
+        assert(AllocId == Id && "unexpected allocator id created");
+      }
+    }
+    runWorkStealing(BC, SchedPolicy, SkipPredicate, opts::ThreadCount,
+                    [&](BinaryFunction &BF, unsigned WorkerId) {
+                      WorkFunction(BF, WorkerId + 1);
+                    },
+                    LogName);
+    return;
+  }
+
   // This lock is used to postpone task execution
   std::unique_lock<std::shared_timed_mutex> Lock(MainLock);
 
   // Estimate the overall runtime cost using the scheduling policy
-  const unsigned TotalCost = estimateTotalCost(BC, SkipPredicate, SchedPolicy);
+  const auto Costs = computeCosts(BC, SkipPredicate, SchedPolicy, LogName);
+  const uint64_t TotalCost =
+      std::accumulate(Costs.begin(), Costs.end(), uint64_t(0));
   const unsigned BlocksCount = TasksPerThread * opts::ThreadCount;
-  const unsigned BlockCost =
+  const uint64_t BlockCost =
       TotalCost > BlocksCount ? TotalCost / BlocksCount : 1;
 
   // Divide work into blocks of equal cost
   ThreadPool &Pool = getThreadPool();
   auto BlockBegin = BC.getBinaryFunctions().begin();
-  unsigned CurrentCost = 0;
+  uint64_t CurrentCost = 0;
+  size_t Index = 0;
   unsigned AllocId = 1;
   for (auto It = BC.getBinaryFunctions().begin();
        It != BC.getBinaryFunctions().end(); ++It) {
-    auto &BF = It->second;
-    CurrentCost += computeCostFor(BF, SkipPredicate, SchedPolicy);
+    CurrentCost += Costs[Index++];
 
     if (CurrentCost >= BlockCost) {
       if (!BC.MIB->checkAllocatorExists(AllocId)) {
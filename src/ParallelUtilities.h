@@ -50,6 +50,13 @@ enum SchedulingPolicy {
 /// Return the managed threadpool and initialize it if not intiliazed
 ThreadPool &getThreadPool();
 
+/// Stop the worker threads of the managed threadpool, which do not survive
+/// fork(). The next call to getThreadPool() starts new ones.
+void resetThreadPool();
+
+/// Write the run times of functions measured for -schedule-cost-file.
+void saveCostHistory();
+
 /// Perform the work on each BinaryFunction except those that are accepted
 /// by SkipPredicate, scheduling heuristic is based on SchedPolicy.
 /// ForceSequential will selectively disable parallel execution and perform the
@@ -60,6 +67,17 @@ void runOnEachFunction(BinaryContext &BC, SchedulingPolicy SchedPolicy,
                        std::string LogName = "", bool ForceSequential = false,
                        unsigned TasksPerThread = opts::TaskCount);
 
+/// Perform the work on each BinaryFunction except those that are accepted
+/// by SkipPredicate with work stealing, starting from the most expensive
+/// functions according to SchedPolicy regardless of -work-stealing. Meant for
+/// passes dominated by a few large functions, which would extend the critical
+/// path if they were left for the end of a block of work.
+void runOnEachFunctionLargestFirst(BinaryContext &BC,
+                                   SchedulingPolicy SchedPolicy,
+                                   WorkFuncTy WorkFunction,
+                                   PredicateTy SkipPredicate = PredicateTy(),
+                                   std::string LogName = "");
+
 /// Perform the work on each BinaryFunction except those that are rejected
 /// by SkipPredicate, and create a unique annotation allocator for each
 /// task. This should be used whenever the work function creates annotations to
@@ -11,17 +11,22 @@
 
 #include "Aligner.h"
 #include "ParallelUtilities.h"
+#include "llvm/Support/MathExtras.h"
+#include <algorithm>
 
 #define DEBUG_TYPE "bolt-aligner"
 
 using namespace llvm;
 
+extern cl::opt<uint32_t> X86AlignBranchBoundary;
+
 namespace opts {
 
 extern cl::OptionCategory BoltOptCategory;
 
 extern cl::opt<bool> AlignBlocks;
 extern cl::opt<bool> PreserveBlocksAlignment;
+extern cl::opt<bool> LoopAwareLayout;
 
 cl::opt<unsigned>
 AlignBlocksMinSize("align-blocks-min-size",
@@ -31,6 +36,32 @@ AlignBlocksMinSize("align-blocks-min-size",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+AlignBlocksBudget("align-blocks-budget",
+  cl::desc("align loop tops and hot branch targets ranked by their execution "
+           "count and the modeled fetch penalty, using at most <bytes> of "
+           "padding in total (0 = use the threshold-based alignment)"),
+  cl::init(0),
+  cl::value_desc("bytes"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+AlignBlocksFunctionBudget("align-blocks-function-budget",
+  cl::desc("maximum padding in bytes per function for -align-blocks-budget"),
+  cl::init(32),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+AlignBlocksWindow("align-blocks-window",
+  cl::desc("size of the instruction fetch window in bytes modeled by "
+           "-align-blocks-budget. Overridden by -x86-align-branch-boundary."),
+  cl::init(32),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 cl::opt<unsigned>
 AlignBlocksThreshold("align-blocks-threshold",
   cl::desc("align only blocks with frequency larger than containing function "
@@ -113,6 +144,16 @@ void alignCompact(BinaryFunction &Function, const MCCodeEmitter *Emitter) {
       std::min(size_t(opts::AlignFunctionsMaxBytes), ColdSize));
 }
 
+/// Return the expected number of extra fetch windows of size \p Window
+/// touched by \p Size bytes of code starting at a random offset compared to
+/// the code starting at the window boundary.
+double getFetchPenalty(uint64_t Size, unsigned Window) {
+  const auto Rem = Size % Window;
+  if (Rem == 0)
+    return double(Window - 1) / Window;
+  return double(Rem - 1) / Window;
+}
+
 } // end anonymous namespace
 
 void AlignerPass::alignBlocks(BinaryFunction &Function,
@@ -128,7 +169,13 @@ void AlignerPass::alignBlocks(BinaryFunction &Function,
   for (auto *BB : Function.layout()) {
     auto Count = BB->getKnownExecutionCount();
 
-    if (Count <= FuncCount * opts::AlignBlocksThreshold / 100) {
+    // First blocks of hot loops found by the loop-aware layout are aligned
+    // regardless of the frequency heuristics.
+    const bool IsLoopTop = opts::LoopAwareLayout && BB->isLoopTop();
+
+    if (!IsLoopTop &&
+        (!opts::AlignBlocks ||
+         Count <= FuncCount * opts::AlignBlocksThreshold / 100)) {
       PrevBB = BB;
       continue;
     }
@@ -139,7 +186,7 @@ void AlignerPass::alignBlocks(BinaryFunction &Function,
     }
     PrevBB = BB;
 
-    if (Count < FTCount * 2)
+    if (!IsLoopTop && Count < FTCount * 2)
       continue;
 
     const auto BlockSize = BC.computeCodeSize(BB->begin(), BB->end(), Emitter);
@@ -161,28 +208,168 @@ void AlignerPass::alignBlocks(BinaryFunction &Function,
   }
 }
 
-void AlignerPass::runOnFunctions(BinaryContext &BC) {
-  if (!BC.HasRelocations)
+void AlignerPass::collectAlignCandidates(BinaryFunction &Function,
+                                         const MCCodeEmitter *Emitter) {
+  if (!Function.hasValidProfile() || !Function.isSimple())
     return;
 
+  const auto &BC = Function.getBinaryContext();
+
+  // Branch boundary alignment of the emitter stops branches from crossing
+  // the boundary, so the same windows are used to model the fetch.
+  const unsigned Window =
+      X86AlignBranchBoundary ? unsigned(X86AlignBranchBoundary)
+                             : unsigned(opts::AlignBlocksWindow);
+
+  Function.updateLayoutIndices();
+  const auto &Layout = Function.getLayout();
+  std::vector<uint64_t> Sizes(Layout.size());
+  for (unsigned I = 0; I < Layout.size(); ++I)
+    Sizes[I] = BC.computeCodeSize(Layout[I]->begin(), Layout[I]->end(),
+                                  Emitter);
+
+  // Loop tops are the first blocks of executed loops in the layout.
+  std::vector<bool> IsLoopTop(Layout.size(), false);
+  Function.calculateLoopInfo();
+  std::vector<BinaryLoop *> Loops(Function.getLoopInfo().begin(),
+                                  Function.getLoopInfo().end());
+  while (!Loops.empty()) {
+    auto *L = Loops.back();
+    Loops.pop_back();
+    Loops.insert(Loops.end(), L->begin(), L->end());
+    if (L->TotalBackEdgeCount == BinaryBasicBlock::COUNT_NO_PROFILE ||
+        L->TotalBackEdgeCount == 0)
+      continue;
+    unsigned Top = Layout.size();
+    for (const auto *BB : L->blocks())
+      Top = std::min(Top, BB->getLayoutIndex());
+    IsLoopTop[Top] = true;
+  }
+
+  const auto FuncCount =
+      std::max<uint64_t>(1, Function.getKnownExecutionCount());
+  std::vector<AlignCandidate> Candidates;
+  for (unsigned I = 0; I < Layout.size(); ++I) {
+    auto *BB = Layout[I];
+    if (BB->isCold() || (opts::AlignBlocksMinSize &&
+                         Sizes[I] < opts::AlignBlocksMinSize))
+      continue;
+
+    const auto Count = BB->getKnownExecutionCount();
+    if (IsLoopTop[I]) {
+      if (Count <= FuncCount)
+        continue;
+    } else {
+      if (Count <= FuncCount * opts::AlignBlocksThreshold / 100)
+        continue;
+      auto *PrevBB = I ? Layout[I - 1] : nullptr;
+      if (PrevBB && PrevBB->getFallthrough() == BB &&
+          Count < PrevBB->getBranchInfo(*BB).Count * 2)
+        continue;
+    }
+
+    // The code executed after the block is approximated by the following
+    // blocks in the layout that are at least half as hot.
+    auto RegionSize = Sizes[I];
+    for (unsigned J = I + 1; J < Layout.size(); ++J) {
+      if (Layout[J]->isCold() || RegionSize >= 4 * Window ||
+          Layout[J]->getKnownExecutionCount() * 2 < Count)
+        break;
+      RegionSize += Sizes[J];
+    }
+
+    const auto Penalty = getFetchPenalty(RegionSize, Window);
+    if (Penalty == 0)
+      continue;
+
+    AlignCandidate Candidate;
+    Candidate.BB = BB;
+    Candidate.Alignment = Window;
+    Candidate.MaxBytes = std::min<uint64_t>(Window - 1, RegionSize);
+    Candidate.Score = Count * Penalty;
+    Candidates.emplace_back(Candidate);
+  }
+
+  std::lock_guard<std::mutex> Lock(AlignCandidatesMtx);
+  AlignCandidates.insert(AlignCandidates.end(), Candidates.begin(),
+                         Candidates.end());
+}
+
+void AlignerPass::applyAlignCandidates() {
+  std::sort(AlignCandidates.begin(), AlignCandidates.end(),
+            [](const AlignCandidate &A, const AlignCandidate &B) {
+              if (A.Score != B.Score)
+                return A.Score > B.Score;
+              const auto *FA = A.BB->getFunction();
+              const auto *FB = B.BB->getFunction();
+              if (FA != FB)
+                return FA->getFunctionNumber() < FB->getFunctionNumber();
+              return A.BB->getIndex() < B.BB->getIndex();
+            });
+
+  // The actual padding is only known at emission, so the maximum is charged.
+  std::unordered_map<const BinaryFunction *, uint64_t> FunctionBytes;
+  uint64_t TotalBytes = 0;
+  uint64_t NumAligned = 0;
+  for (const auto &Candidate : AlignCandidates) {
+    if (TotalBytes + Candidate.MaxBytes > opts::AlignBlocksBudget)
+      continue;
+    auto &Bytes = FunctionBytes[Candidate.BB->getFunction()];
+    if (Bytes + Candidate.MaxBytes > opts::AlignBlocksFunctionBudget)
+      continue;
+    Bytes += Candidate.MaxBytes;
+    TotalBytes += Candidate.MaxBytes;
+    ++NumAligned;
+
+    Candidate.BB->setAlignment(Candidate.Alignment);
+    Candidate.BB->setAlignmentMaxBytes(Candidate.MaxBytes);
+    AlignedBlocksCount += Candidate.BB->getKnownExecutionCount();
+  }
+
+  outs() << "BOLT-INFO: aligned " << NumAligned << " out of "
+         << AlignCandidates.size() << " candidate blocks using up to "
+         << TotalBytes << " bytes of the " << opts::AlignBlocksBudget
+         << "-byte budget\n";
+  AlignCandidates.clear();
+}
+
+void AlignerPass::setupLocalRun(BinaryContext &BC) {
   AlignHistogram.resize(opts::BlockAlignment);
 
-  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
-    // Create a separate MCCodeEmitter to allow lock free execution
-    auto Emitter = BC.createIndependentMCCodeEmitter();
+  if (opts::AlignBlocksBudget && !isPowerOf2_32(opts::AlignBlocksWindow)) {
+    errs() << "BOLT-ERROR: -align-blocks-window must be a power of 2\n";
+    exit(1);
+  }
+}
 
-    if (opts::UseCompactAligner)
-      alignCompact(BF, Emitter.MCE.get());
-    else
-      alignMaxBytes(BF);
+void AlignerPass::runOnFunction(BinaryFunction &BF) {
+  auto &BC = BF.getBinaryContext();
+  if (!BC.HasRelocations)
+    return;
+
+  // Create a separate MCCodeEmitter to allow lock free execution
+  auto Emitter = BC.createIndependentMCCodeEmitter();
 
-    if (opts::AlignBlocks && !opts::PreserveBlocksAlignment)
-      alignBlocks(BF, Emitter.MCE.get());
-  };
+  if (opts::UseCompactAligner)
+    alignCompact(BF, Emitter.MCE.get());
+  else
+    alignMaxBytes(BF);
+
+  if (opts::PreserveBlocksAlignment)
+    return;
+
+  if (opts::AlignBlocksBudget)
+    collectAlignCandidates(BF, Emitter.MCE.get());
+  else if (opts::AlignBlocks || opts::LoopAwareLayout)
+    alignBlocks(BF, Emitter.MCE.get());
+}
+
+void AlignerPass::finishLocalRun(BinaryContext &BC) {
+  if (!BC.HasRelocations)
+    return;
 
-  ParallelUtilities::runOnEachFunction(
-      BC, ParallelUtilities::SchedulingPolicy::SP_TRIVIAL, WorkFun,
-      ParallelUtilities::PredicateTy(nullptr), "AlignerPass");
+  if (opts::AlignBlocksBudget && !opts::PreserveBlocksAlignment)
+    applyAlignCandidates();
 
   DEBUG(
     dbgs() << "BOLT-DEBUG: max bytes per basic block alignment distribution:\n";
@@ -13,6 +13,7 @@
 #define LLVM_TOOLS_LLVM_BOLT_PASSES_ALIGNER_H
 
 #include "BinaryPasses.h"
+#include <mutex>
 
 namespace llvm {
 namespace bolt {
@@ -26,9 +27,31 @@ private:
   /// Stats: execution count of blocks that were aligned.
   std::atomic<uint64_t> AlignedBlocksCount{0};
 
+  /// Block that could be aligned in the budgeted mode.
+  struct AlignCandidate {
+    BinaryBasicBlock *BB;
+    /// Alignment and the maximum number of padding bytes.
+    unsigned Alignment;
+    unsigned MaxBytes;
+    /// Expected number of fetch windows saved over all executions.
+    double Score;
+  };
+
+  /// Candidates of all functions, applied in finishLocalRun().
+  std::vector<AlignCandidate> AlignCandidates;
+  std::mutex AlignCandidatesMtx;
+
   /// Assign alignment to basic blocks based on profile.
   void alignBlocks(BinaryFunction &Function, const MCCodeEmitter *Emitter);
 
+  /// Collect loop tops and hot branch targets of \p Function ranked by their
+  /// execution count times the modeled penalty of not aligning them.
+  void collectAlignCandidates(BinaryFunction &Function,
+                              const MCCodeEmitter *Emitter);
+
+  /// Align the best candidates within the per-function and global budgets.
+  void applyAlignCandidates();
+
 public:
   explicit AlignerPass() : BinaryFunctionPass(false) {}
 
@@ -36,8 +59,13 @@ public:
     return "aligner";
   }
 
+  bool isFunctionLocal() const override { return true; }
+  void setupLocalRun(BinaryContext &BC) override;
+  void runOnFunction(BinaryFunction &BF) override;
+  void finishLocalRun(BinaryContext &BC) override;
+
   /// Pass entry point
-  void runOnFunctions(BinaryContext &BC) override;
+  void runOnFunctions(BinaryContext &BC) override { runLocalPass(BC); }
 };
 
 } // namespace bolt
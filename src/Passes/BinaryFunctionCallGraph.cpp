@@ -12,8 +12,10 @@
 #include "BinaryFunctionCallGraph.h"
 #include "BinaryFunction.h"
 #include "BinaryContext.h"
+#include "ParallelUtilities.h"
 #include "llvm/Support/Options.h"
 #include "llvm/Support/Timer.h"
+#include <mutex>
 
 #define DEBUG_TYPE "callgraph"
 
@@ -96,6 +98,28 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
       : Function->estimateSize();
   };
 
+  // Call sites are collected for every function in parallel into their own
+  // lists, which are then merged into the graph in the order of functions.
+  // This creates the nodes and arcs in the same order as a serial walk.
+  struct CallSite {
+    BinaryFunction *Callee;
+    uint64_t Count;
+    uint64_t Offset;
+  };
+  struct FunctionCalls {
+    uint64_t Size{0};
+    std::vector<CallSite> Calls;
+    uint64_t TotalCallsites{0};
+    uint64_t NotProcessed{0};
+    uint64_t RecursiveCallsites{0};
+    bool UsedPerfData{false};
+  };
+  std::unordered_map<const BinaryFunction *, FunctionCalls> FunctionsCalls;
+  for (auto &It : BC.getBinaryFunctions()) {
+    if (!Filter(It.second))
+      FunctionsCalls[&It.second];
+  }
+
   // Add call graph nodes.
   auto lookupNode = [&](BinaryFunction *Function) {
     const auto Id = Cg.maybeGetNodeId(Function);
@@ -104,7 +128,10 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
       // because emitFunctions will emit the hot part first in the order that is
       // computed by ReorderFunctions.  The cold part will be emitted with the
       // rest of the cold functions and code.
-      const auto Size = functionSize(Function);
+      const auto FCIter = FunctionsCalls.find(Function);
+      const auto Size = FCIter != FunctionsCalls.end()
+                            ? FCIter->second.Size
+                            : functionSize(Function);
       // NOTE: for functions without a profile, we set the number of samples
       // to zero.  This will keep these functions from appearing in the hot
       // section.  This is a little weird because we wouldn't be trying to
@@ -119,20 +146,15 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
     }
   };
 
-  // Add call graph edges.
-  uint64_t NotProcessed = 0;
-  uint64_t TotalCallsites = 0;
-  uint64_t NoProfileCallsites = 0;
-  uint64_t NumFallbacks = 0;
-  uint64_t RecursiveCallsites = 0;
-  for (auto &It : BC.getBinaryFunctions()) {
-    auto *Function = &It.second;
-
-    if (Filter(*Function)) {
-      continue;
-    }
+  // Code emitters are expensive to create, so the workers share a pool with
+  // at most one emitter per thread.
+  std::mutex EmittersMutex;
+  std::vector<std::unique_ptr<BinaryContext::IndependentCodeEmitter>> Emitters;
 
-    const auto SrcId = lookupNode(Function);
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
+    auto *Function = &BF;
+    auto &FC = FunctionsCalls.at(Function);
+    FC.Size = functionSize(Function);
     // Offset of the current basic block from the beginning of the function
     uint64_t Offset = 0;
 
@@ -140,26 +162,11 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
       if (auto *DstFunc =
           DestSymbol ? BC.getFunctionForSymbol(DestSymbol) : nullptr) {
         if (DstFunc == Function) {
-          DEBUG(dbgs() << "BOLT-INFO: recursive call detected in "
-                       << *DstFunc << "\n");
-          ++RecursiveCallsites;
+          ++FC.RecursiveCallsites;
           if (IgnoreRecursiveCalls)
             return false;
         }
-        if (Filter(*DstFunc)) {
-          return false;
-        }
-        const auto DstId = lookupNode(DstFunc);
-        const bool IsValidCount = Count != COUNT_NO_PROFILE;
-        const auto AdjCount = UseEdgeCounts && IsValidCount ? Count : 1;
-        if (!IsValidCount)
-          ++NoProfileCallsites;
-        Cg.incArcWeight(SrcId, DstId, AdjCount, Offset);
-        DEBUG(
-          if (opts::Verbosity > 1) {
-            dbgs() << "BOLT-DEBUG: buildCallGraph: call " << *Function
-                   << " -> " << *DstFunc << " @ " << Offset << "\n";
-          });
+        FC.Calls.push_back(CallSite{DstFunc, Count, Offset});
         return true;
       }
 
@@ -174,9 +181,10 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
       const auto *DstSym = BC.MIB->getTargetSymbol(Inst);
 
       // If this is an indirect call use perf data directly.
-      if (!DstSym && BC.MIB->hasAnnotation(Inst, "CallProfile")) {
+      if (!DstSym &&
+          BC.MIB->hasAnnotation(Inst, MCPlus::CallProfileAnnotation)) {
         const auto &ICSP =
-          BC.MIB->getAnnotationAs<IndirectCallSiteProfile>(Inst, "CallProfile");
+          BC.MIB->getAnnotationAs(Inst, MCPlus::CallProfileAnnotation);
         for (const auto &CSI : ICSP) {
           if (CSI.Symbol)
             Counts.push_back(std::make_pair(CSI.Symbol, CSI.Count));
@@ -194,12 +202,9 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
     // fall back to the CFG walker which attempts to handle missing data.
     if (!Function->hasValidProfile() && CgFromPerfData &&
         !Function->getAllCallSites().empty()) {
-      DEBUG(dbgs() << "BOLT-DEBUG: buildCallGraph: Falling back to perf data"
-                   << " for " << *Function << "\n");
-      ++NumFallbacks;
-      const auto Size = functionSize(Function);
+      FC.UsedPerfData = true;
       for (const auto &CSI : Function->getAllCallSites()) {
-        ++TotalCallsites;
+        ++FC.TotalCallsites;
 
         if (!CSI.Symbol)
           continue;
@@ -207,53 +212,130 @@ BinaryFunctionCallGraph buildCallGraph(BinaryContext &BC,
         // The computed offset may exceed the hot part of the function; hence,
         // bound it by the size.
         Offset = CSI.Offset;
-        if (Offset > Size)
-          Offset = Size;
+        if (Offset > FC.Size)
+          Offset = FC.Size;
 
         if (!recordCall(CSI.Symbol, CSI.Count)) {
-          ++NotProcessed;
+          ++FC.NotProcessed;
         }
       }
-    } else {
-      for (auto *BB : Function->layout()) {
-        // Don't count calls from cold blocks unless requested.
-        if (BB->isCold() && !IncludeColdCalls)
-          continue;
+      return;
+    }
 
-        // Determine whether the block is included in Function's (hot) size
-        // See BinaryFunction::estimateHotSize
-        bool BBIncludedInFunctionSize = false;
-        if (UseFunctionHotSize && Function->isSplit()) {
-          if (UseSplitHotSize)
-            BBIncludedInFunctionSize = !BB->isCold();
-          else
-            BBIncludedInFunctionSize = BB->getKnownExecutionCount() != 0;
-        } else {
-          BBIncludedInFunctionSize = true;
-        }
+    std::unique_ptr<BinaryContext::IndependentCodeEmitter> Emitter;
+    if (!opts::NoThreads) {
+      std::lock_guard<std::mutex> Lock(EmittersMutex);
+      if (!Emitters.empty()) {
+        Emitter = std::move(Emitters.back());
+        Emitters.pop_back();
+      }
+    }
+
+    for (auto *BB : Function->layout()) {
+      // Don't count calls from cold blocks unless requested.
+      if (BB->isCold() && !IncludeColdCalls)
+        continue;
+
+      // Determine whether the block is included in Function's (hot) size
+      // See BinaryFunction::estimateHotSize
+      bool BBIncludedInFunctionSize = false;
+      if (UseFunctionHotSize && Function->isSplit()) {
+        if (UseSplitHotSize)
+          BBIncludedInFunctionSize = !BB->isCold();
+        else
+          BBIncludedInFunctionSize = BB->getKnownExecutionCount() != 0;
+      } else {
+        BBIncludedInFunctionSize = true;
+      }
+
+      for (auto &Inst : *BB) {
+        // Find call instructions and extract target symbols from each one.
+        if (BC.MIB->isCall(Inst)) {
+          const auto CallInfo = getCallInfo(BB, Inst);
 
-        for (auto &Inst : *BB) {
-          // Find call instructions and extract target symbols from each one.
-          if (BC.MIB->isCall(Inst)) {
-            const auto CallInfo = getCallInfo(BB, Inst);
-
-            if (!CallInfo.empty()) {
-              for (const auto &CI : CallInfo) {
-                ++TotalCallsites;
-                if (!recordCall(CI.first, CI.second))
-                  ++NotProcessed;
-              }
-            } else {
-              ++TotalCallsites;
-              ++NotProcessed;
+          if (!CallInfo.empty()) {
+            for (const auto &CI : CallInfo) {
+              ++FC.TotalCallsites;
+              if (!recordCall(CI.first, CI.second))
+                ++FC.NotProcessed;
             }
+          } else {
+            ++FC.TotalCallsites;
+            ++FC.NotProcessed;
           }
-          // Increase Offset if needed
-          if (BBIncludedInFunctionSize) {
-            Offset += BC.computeCodeSize(&Inst, &Inst + 1);
-          }
         }
+        // Increase Offset if needed
+        if (BBIncludedInFunctionSize) {
+          if (!opts::NoThreads && !Emitter)
+            Emitter = llvm::make_unique<BinaryContext::IndependentCodeEmitter>(
+                BC.createIndependentMCCodeEmitter());
+          Offset += BC.computeCodeSize(&Inst, &Inst + 1,
+                                       Emitter ? Emitter->MCE.get() : nullptr);
+        }
+      }
+    }
+
+    if (Emitter) {
+      std::lock_guard<std::mutex> Lock(EmittersMutex);
+      Emitters.emplace_back(std::move(Emitter));
+    }
+  };
+
+  ParallelUtilities::PredicateTy SkipFunc = [&](const BinaryFunction &BF) {
+    return !FunctionsCalls.count(&BF);
+  };
+
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+      SkipFunc, "buildCallGraph");
+
+  // Add call graph edges.
+  uint64_t NotProcessed = 0;
+  uint64_t TotalCallsites = 0;
+  uint64_t NoProfileCallsites = 0;
+  uint64_t NumFallbacks = 0;
+  uint64_t RecursiveCallsites = 0;
+  size_t NumCalls = 0;
+  for (const auto &KV : FunctionsCalls)
+    NumCalls += KV.second.Calls.size();
+  Cg.reserve(FunctionsCalls.size(), NumCalls);
+
+  for (auto &It : BC.getBinaryFunctions()) {
+    auto *Function = &It.second;
+    const auto FCIter = FunctionsCalls.find(Function);
+    if (FCIter == FunctionsCalls.end())
+      continue;
+
+    const auto &FC = FCIter->second;
+    const auto SrcId = lookupNode(Function);
+    TotalCallsites += FC.TotalCallsites;
+    NotProcessed += FC.NotProcessed;
+    RecursiveCallsites += FC.RecursiveCallsites;
+    if (FC.UsedPerfData) {
+      DEBUG(dbgs() << "BOLT-DEBUG: buildCallGraph: Falling back to perf data"
+                   << " for " << *Function << "\n");
+      ++NumFallbacks;
+    }
+
+    for (const auto &Call : FC.Calls) {
+      auto *DstFunc = Call.Callee;
+      // Callees outside of the binary functions, such as injected ones, were
+      // not filtered by the workers.
+      if (!FunctionsCalls.count(DstFunc) && Filter(*DstFunc)) {
+        ++NotProcessed;
+        continue;
       }
+      const auto DstId = lookupNode(DstFunc);
+      const bool IsValidCount = Call.Count != COUNT_NO_PROFILE;
+      const auto AdjCount = UseEdgeCounts && IsValidCount ? Call.Count : 1;
+      if (!IsValidCount)
+        ++NoProfileCallsites;
+      Cg.incArcWeight(SrcId, DstId, AdjCount, Call.Offset);
+      DEBUG(
+        if (opts::Verbosity > 1) {
+          dbgs() << "BOLT-DEBUG: buildCallGraph: call " << *Function
+                 << " -> " << *DstFunc << " @ " << Call.Offset << "\n";
+        });
     }
   }
 
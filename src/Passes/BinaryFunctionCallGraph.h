@@ -45,6 +45,11 @@ public:
     return Funcs[Id];
   }
   NodeId addNode(BinaryFunction *BF, uint32_t Size, uint64_t Samples = 0);
+  void reserve(size_t NumNodes, size_t NumArcs) {
+    CallGraph::reserve(NumNodes, NumArcs);
+    FuncToNodeId.reserve(NumNodes);
+    Funcs.reserve(NumNodes);
+  }
 
   /// Compute a DFS traversal of the call graph.
   std::deque<BinaryFunction *> buildTraversalOrder();
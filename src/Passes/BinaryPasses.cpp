@@ -14,9 +14,17 @@
 #include "ParallelUtilities.h"
 #include "Passes/ReorderAlgorithm.h"
 #include "Passes/ReorderFunctions.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/Options.h"
 
+#include <mutex>
 #include <numeric>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #define DEBUG_TYPE "bolt-opts"
@@ -62,6 +70,8 @@ extern cl::opt<unsigned> Verbosity;
 extern cl::opt<bool> EnableBAT;
 extern cl::opt<bool> UpdateDebugSections;
 extern cl::opt<bolt::ReorderFunctions::ReorderType> ReorderFunctions;
+extern cl::opt<unsigned> ExtTSPParallelThreshold;
+extern cl::opt<bool> NoThreads;
 extern bool isHotTextMover(const bolt::BinaryFunction &Function);
 
 enum DynoStatsSortOrder : char {
@@ -91,7 +101,8 @@ enum PeepholeOpts : char {
   PEEP_DOUBLE_JUMPS     = 0x2,
   PEEP_TAILCALL_TRAPS   = 0x4,
   PEEP_USELESS_BRANCHES = 0x8,
-  PEEP_ALL              = 0xf
+  PEEP_CMOV             = 0x10,
+  PEEP_ALL              = 0x1f
 };
 
 static cl::list<PeepholeOpts>
@@ -107,10 +118,29 @@ Peepholes("peepholes",
     clEnumValN(PEEP_TAILCALL_TRAPS, "tailcall-traps", "insert tail call traps"),
     clEnumValN(PEEP_USELESS_BRANCHES, "useless-branches",
                "remove useless conditional branches"),
+    clEnumValN(PEEP_CMOV, "cmov",
+               "convert frequently mispredicted short branches to cmov"),
     clEnumValN(PEEP_ALL, "all", "enable all peephole optimizations")),
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+PeepholeCMovMinCount("peephole-cmov-min-count",
+  cl::desc("minimum execution count of a branch converted to cmov"),
+  cl::init(1000),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+PeepholeCMovMinMispredRatio("peephole-cmov-min-mispred-ratio",
+  cl::desc("minimum percentage of mispredictions of a branch converted to "
+           "cmov"),
+  cl::init(15),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<unsigned>
 PrintFuncStat("print-function-statistics",
   cl::desc("print statistics about basic block ordering"),
@@ -135,6 +165,14 @@ PrintSortedBy("print-sorted-by",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<std::string>
+ProfileStatsFile("profile-stats-file",
+  cl::desc("with -print-profile-stats, write the profile quality metrics "
+           "in JSON to the given file"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 PrintUnknown("print-unknown",
   cl::desc("print names of functions with unknown control flow"),
@@ -151,7 +189,7 @@ PrintUnknownCFG("print-unknown-cfg",
   cl::cat(BoltCategory),
   cl::ReallyHidden);
 
-static cl::opt<bolt::ReorderBasicBlocks::LayoutType>
+cl::opt<bolt::ReorderBasicBlocks::LayoutType>
 ReorderBlocks("reorder-blocks",
   cl::desc("change layout of basic blocks in a function"),
   cl::init(bolt::ReorderBasicBlocks::LT_NONE),
@@ -185,6 +223,24 @@ ReorderBlocks("reorder-blocks",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+cl::opt<bool>
+LoopAwareLayout("loop-aware-layout",
+  cl::desc("after reordering basic blocks, keep hot loop bodies contiguous, "
+           "rotate loops so that the exit test falls through, and align the "
+           "first blocks of hot loops"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<std::string>
+BlockLayoutCache("block-layout-cache",
+  cl::desc("file with basic block layouts computed by previous runs. Layouts "
+           "of functions with matching code and profile are reused instead "
+           "of being recomputed, and the file is updated after reordering"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 cl::opt<unsigned>
 ExecutionCountThreshold("execution-count-threshold",
   cl::desc("perform profiling accuracy-sensitive optimizations only if "
@@ -257,6 +313,39 @@ TopCalledLimit("top-called-limit",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<unsigned>
+MemcpySizeSpecMaxSizes("memcpy-size-spec-max-sizes",
+  cl::desc("maximum number of sizes to specialize a memcpy()/memset() call "
+           "site for"),
+  cl::init(2),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+MemcpySizeSpecMaxSize("memcpy-size-spec-max-size",
+  cl::desc("largest size in bytes to create an inline copy for"),
+  cl::init(32),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+MemcpySizeSpecMinRatio("memcpy-size-spec-min-ratio",
+  cl::desc("minimum percentage of the observed calls that a size needs to "
+           "account for to be specialized"),
+  cl::init(30),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+MemcpySizeSpecMinCount("memcpy-size-spec-min-count",
+  cl::desc("minimum number of value profiled calls to specialize a site"),
+  cl::init(100),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 } // namespace opts
 
 namespace llvm {
@@ -272,6 +361,16 @@ bool BinaryFunctionPass::shouldPrint(const BinaryFunction &BF) const {
   return BF.isSimple() && !BF.isIgnored();
 }
 
+void BinaryFunctionPass::runLocalPass(BinaryContext &BC) {
+  assert(isFunctionLocal() && "expected a function-local pass");
+  setupLocalRun(BC);
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR,
+      [&](BinaryFunction &BF) { runOnFunction(BF); },
+      ParallelUtilities::PredicateTy(nullptr), getName());
+  finishLocalRun(BC);
+}
+
 void EliminateUnreachableBlocks::runOnFunction(BinaryFunction& Function) {
   if (Function.layout_size() > 0) {
     unsigned Count;
@@ -312,6 +411,119 @@ void EliminateUnreachableBlocks::runOnFunctions(BinaryContext &BC) {
          << DeletedBytes << " bytes of code.\n";
 }
 
+namespace {
+
+/// Block layouts keyed by the contents and the profile of a function. A
+/// layout is stored as the positions of blocks in the layout preceding the
+/// reordering. The cache file has a line per function:
+///
+///   <hexkey> <position>*
+///
+class BlockLayoutCache {
+  std::unordered_map<uint64_t, std::vector<uint32_t>> Layouts;
+  std::unordered_map<uint64_t, std::vector<uint32_t>> NewLayouts;
+  std::mutex Mutex;
+
+public:
+  /// Compute the key of the current layout of \p BF. Execution counts are
+  /// rounded to powers of two, hence small changes in the profile do not
+  /// invalidate the cached layout.
+  static uint64_t computeKey(const BinaryFunction &BF) {
+    auto quantize = [](uint64_t Count) -> uint64_t {
+      if (Count == BinaryBasicBlock::COUNT_NO_PROFILE)
+        return ~0ULL;
+      return Count ? Log2_64(Count) + 1 : 0;
+    };
+    std::unordered_map<const BinaryBasicBlock *, uint32_t> Position;
+    for (auto *BB : BF.layout())
+      Position.emplace(BB, Position.size());
+
+    hash_code Hash = hash_combine(BF.computeHash(),
+                                  static_cast<int>(opts::ReorderBlocks),
+                                  BF.layout_size());
+    for (auto *BB : BF.layout()) {
+      Hash = hash_combine(Hash, quantize(BB->getKnownExecutionCount()),
+                          BB->succ_size());
+      auto BI = BB->branch_info_begin();
+      for (auto *Succ : BB->successors()) {
+        Hash = hash_combine(Hash, Position[Succ], quantize(BI->Count));
+        ++BI;
+      }
+    }
+    return Hash;
+  }
+
+  void load(const std::string &FileName) {
+    auto MB = MemoryBuffer::getFileOrSTDIN(FileName);
+    if (!MB)
+      return;
+    for (line_iterator LI(*MB.get(), /*SkipBlanks=*/true); !LI.is_at_eof();
+         ++LI) {
+      SmallVector<StringRef, 16> Fields;
+      LI->split(Fields, ' ', -1, /*KeepEmpty=*/false);
+      uint64_t Key;
+      if (Fields.empty() || Fields[0].getAsInteger(16, Key))
+        continue;
+      std::vector<uint32_t> Layout;
+      for (auto Field : makeArrayRef(Fields).drop_front()) {
+        uint32_t Index;
+        if (Field.getAsInteger(10, Index)) {
+          Layout.clear();
+          break;
+        }
+        Layout.push_back(Index);
+      }
+      if (!Layout.empty())
+        Layouts[Key] = std::move(Layout);
+    }
+  }
+
+  /// Return the block order cached for \p Key in terms of the current layout
+  /// of \p BF. Return an empty order if there is no valid cached layout.
+  BinaryFunction::BasicBlockOrderType
+  lookup(uint64_t Key, const BinaryFunction &BF) const {
+    BinaryFunction::BasicBlockOrderType Order;
+    auto I = Layouts.find(Key);
+    if (I == Layouts.end() || I->second.size() != BF.layout_size() ||
+        I->second.front() != 0)
+      return Order;
+
+    std::vector<bool> Seen(BF.layout_size());
+    for (auto Index : I->second) {
+      if (Index >= Seen.size() || Seen[Index])
+        return BinaryFunction::BasicBlockOrderType();
+      Seen[Index] = true;
+      Order.push_back(BF.getLayout()[Index]);
+    }
+    return Order;
+  }
+
+  void record(uint64_t Key, std::vector<uint32_t> Layout) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    NewLayouts[Key] = std::move(Layout);
+  }
+
+  /// Write layouts recorded in this run. Layouts that were not used are
+  /// dropped to keep the cache from growing indefinitely.
+  void save(const std::string &FileName) const {
+    std::error_code EC;
+    raw_fd_ostream OS(FileName, EC, sys::fs::F_None);
+    if (EC) {
+      errs() << "BOLT-WARNING: cannot write block layout cache to "
+             << FileName << ": " << EC.message() << '\n';
+      return;
+    }
+    for (const auto &KV : NewLayouts) {
+      OS << Twine::utohexstr(KV.first);
+      for (auto Index : KV.second)
+        OS << ' ' << Index;
+      OS << '\n';
+    }
+  }
+};
+
+} // anonymous namespace
+
 bool ReorderBasicBlocks::shouldPrint(const BinaryFunction &BF) const {
   return (BinaryFunctionPass::shouldPrint(BF) &&
           opts::ReorderBlocks != ReorderBasicBlocks::LT_NONE);
@@ -330,27 +542,104 @@ void ReorderBasicBlocks::runOnFunctions(BinaryContext &BC) {
     return;
 
   std::atomic<uint64_t> ModifiedFuncCount{0};
+  std::atomic<uint64_t> CachedFuncCount{0};
+  std::atomic<uint64_t> FallbackFuncCount{0};
+
+  // Once the time budget is spent, replace cache-driven layout algorithms
+  // with the cheaper greedy one.
+  auto getLayoutType = [&](const BinaryFunction &BF) {
+    const auto Type = static_cast<LayoutType>(opts::ReorderBlocks);
+    if ((Type != LT_OPTIMIZE_CACHE && Type != LT_OPTIMIZE_EXT_TSP) ||
+        !BF.hasValidProfile() || !BC.isTimeBudgetExhausted())
+      return Type;
+    ++FallbackFuncCount;
+    return LT_OPTIMIZE;
+  };
 
-  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
-    modifyFunctionLayout(BF, opts::ReorderBlocks, opts::MinBranchClusters);
+  const bool UseCache = !opts::BlockLayoutCache.empty();
+  BlockLayoutCache Cache;
+  if (UseCache)
+    Cache.load(opts::BlockLayoutCache);
+
+  auto reorderFunction = [&](BinaryFunction &BF, bool ParallelRegions) {
+    if (!UseCache || !BF.size() ||
+        (opts::ReorderBlocks != LT_REVERSE && !BF.hasValidProfile())) {
+      modifyFunctionLayout(BF, getLayoutType(BF), opts::MinBranchClusters,
+                           ParallelRegions);
+    } else {
+      std::unordered_map<const BinaryBasicBlock *, uint32_t> Position;
+      for (auto *BB : BF.layout())
+        Position.emplace(BB, Position.size());
+
+      const auto Key = BlockLayoutCache::computeKey(BF);
+      auto CachedLayout = Cache.lookup(Key, BF);
+      auto Type = static_cast<LayoutType>(opts::ReorderBlocks);
+      if (!CachedLayout.empty()) {
+        BF.updateBasicBlockLayout(CachedLayout);
+        ++CachedFuncCount;
+      } else {
+        Type = getLayoutType(BF);
+        modifyFunctionLayout(BF, Type, opts::MinBranchClusters,
+                             ParallelRegions);
+      }
+
+      // Layouts of the fallback algorithm are not cached.
+      if (Type == opts::ReorderBlocks) {
+        std::vector<uint32_t> Layout;
+        for (auto *BB : BF.layout())
+          Layout.push_back(Position[BB]);
+        Cache.record(Key, std::move(Layout));
+      }
+    }
     if (BF.hasLayoutChanged()) {
       ++ModifiedFuncCount;
     }
   };
 
+  // Functions with many blocks dominate the run time of ExtTSP. They are laid
+  // out one at a time before other functions, with their loop nest regions
+  // running in parallel on the thread pool.
+  auto isLayoutParallel = [&](const BinaryFunction &BF) {
+    return opts::ReorderBlocks == LT_OPTIMIZE_EXT_TSP && !opts::NoThreads &&
+           opts::ExtTSPParallelThreshold &&
+           BF.layout_size() >= opts::ExtTSPParallelThreshold;
+  };
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &BF = BFI.second;
+    if (shouldOptimize(BF) && isLayoutParallel(BF))
+      reorderFunction(BF, /*ParallelRegions=*/true);
+  }
+
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
+    reorderFunction(BF, /*ParallelRegions=*/false);
+  };
+
   ParallelUtilities::PredicateTy SkipFunc = [&](const BinaryFunction &BF) {
-    return !shouldOptimize(BF);
+    return !shouldOptimize(BF) || isLayoutParallel(BF);
   };
 
-  ParallelUtilities::runOnEachFunction(
-      BC, ParallelUtilities::SchedulingPolicy::SP_BB_LINEAR, WorkFun, SkipFunc,
-      "ReorderBasicBlocks");
+  // The remaining functions start from the largest ones, so a few large
+  // functions do not extend the critical path of the pass.
+  ParallelUtilities::runOnEachFunctionLargestFirst(
+      BC, ParallelUtilities::SchedulingPolicy::SP_BB_QUADRATIC, WorkFun,
+      SkipFunc, "ReorderBasicBlocks");
 
   outs() << "BOLT-INFO: basic block reordering modified layout of "
          << format("%zu (%.2lf%%) functions\n", ModifiedFuncCount.load(),
                    100.0 * ModifiedFuncCount.load() /
                        BC.getBinaryFunctions().size());
 
+  if (FallbackFuncCount) {
+    outs() << "BOLT-INFO: time budget exhausted, used greedy block layout for "
+           << FallbackFuncCount.load() << " functions\n";
+  }
+
+  if (UseCache) {
+    outs() << "BOLT-INFO: reused cached block layout for "
+           << CachedFuncCount.load() << " functions\n";
+    Cache.save(opts::BlockLayoutCache);
+  }
+
   if (opts::PrintFuncStat > 0) {
     raw_ostream &OS = outs();
     // Copy all the values into vector in order to sort them
@@ -388,7 +677,7 @@ void ReorderBasicBlocks::runOnFunctions(BinaryContext &BC) {
 }
 
 void ReorderBasicBlocks::modifyFunctionLayout(BinaryFunction &BF,
-    LayoutType Type, bool MinBranchClusters) const {
+    LayoutType Type, bool MinBranchClusters, bool ParallelRegions) const {
   if (BF.size() == 0 || Type == LT_NONE)
     return;
 
@@ -399,6 +688,10 @@ void ReorderBasicBlocks::modifyFunctionLayout(BinaryFunction &BF,
   if (Type != LT_REVERSE && !BF.hasValidProfile())
     return;
 
+  const bool AdjustForLoops = opts::LoopAwareLayout && Type != LT_REVERSE;
+  if (AdjustForLoops || (ParallelRegions && Type == LT_OPTIMIZE_EXT_TSP))
+    BF.calculateLoopInfo();
+
   if (Type == LT_REVERSE) {
     Algo.reset(new ReverseReorderAlgorithm());
   } else if (BF.size() <= opts::TSPThreshold && Type != LT_OPTIMIZE_SHUFFLE) {
@@ -428,7 +721,11 @@ void ReorderBasicBlocks::modifyFunctionLayout(BinaryFunction &BF,
       break;
 
     case LT_OPTIMIZE_EXT_TSP:
-      Algo.reset(new ExtTSPReorderAlgorithm());
+      if (ParallelRegions) {
+        Algo.reset(new ExtTSPReorderAlgorithm(&BF.getLoopInfo()));
+      } else {
+        Algo.reset(new ExtTSPReorderAlgorithm());
+      }
       break;
 
     case LT_OPTIMIZE_SHUFFLE:
@@ -442,9 +739,81 @@ void ReorderBasicBlocks::modifyFunctionLayout(BinaryFunction &BF,
 
   Algo->reorderBasicBlocks(BF, NewLayout);
 
+  if (AdjustForLoops)
+    adjustLayoutForLoops(BF, NewLayout);
+
   BF.updateBasicBlockLayout(NewLayout);
 }
 
+void ReorderBasicBlocks::adjustLayoutForLoops(BinaryFunction &BF,
+    BinaryFunction::BasicBlockOrderType &Layout) const {
+  for (auto *BB : Layout)
+    BB->setIsLoopTop(false);
+
+  // Inner loops are processed before the loops containing them, so that
+  // nested bodies are already contiguous when the outer body is gathered.
+  const auto &BLI = BF.getLoopInfo();
+  std::vector<BinaryLoop *> Loops;
+  std::vector<BinaryLoop *> Worklist(BLI.begin(), BLI.end());
+  while (!Worklist.empty()) {
+    auto *L = Worklist.back();
+    Worklist.pop_back();
+    Loops.push_back(L);
+    Worklist.insert(Worklist.end(), L->begin(), L->end());
+  }
+
+  for (auto LI = Loops.rbegin(); LI != Loops.rend(); ++LI) {
+    auto *L = *LI;
+    if (L->TotalBackEdgeCount == BinaryBasicBlock::COUNT_NO_PROFILE ||
+        L->TotalBackEdgeCount == 0)
+      continue;
+
+    // Gather executed blocks of the loop at the position of the first one,
+    // keeping their relative order. Cold blocks of the loop stay in place.
+    size_t Start = Layout.size();
+    std::vector<BinaryBasicBlock *> Body;
+    for (size_t Pos = 0; Pos < Layout.size(); ++Pos) {
+      auto *BB = Layout[Pos];
+      if (!L->contains(BB) || !BB->getKnownExecutionCount())
+        continue;
+      Start = std::min(Start, Pos);
+      Body.push_back(BB);
+    }
+    if (Body.empty())
+      continue;
+
+    std::unordered_set<const BinaryBasicBlock *> InBody(Body.begin(),
+                                                        Body.end());
+    BinaryFunction::BasicBlockOrderType NewLayout(Layout.begin(),
+                                                  Layout.begin() + Start);
+    NewLayout.insert(NewLayout.end(), Body.begin(), Body.end());
+    for (size_t Pos = Start; Pos < Layout.size(); ++Pos) {
+      if (!InBody.count(Layout[Pos]))
+        NewLayout.push_back(Layout[Pos]);
+    }
+
+    // A loop with the exit test in the header and an unconditional latch at
+    // the end executes two branches per iteration. Moving the header after
+    // the latch leaves one, at the cost of a jump from the preheader, which
+    // pays off when the loop iterates more than once per entry.
+    auto *Header = L->getHeader();
+    auto *Latch = Body.back();
+    if (Body.size() > 1 && Body.front() == Header &&
+        !Header->isEntryPoint() && Header->succ_size() == 2 &&
+        Latch->succ_size() == 1 && Latch->getSuccessor() == Header &&
+        L->EntryCount != BinaryBasicBlock::COUNT_NO_PROFILE &&
+        L->TotalBackEdgeCount > L->EntryCount) {
+      std::rotate(NewLayout.begin() + Start, NewLayout.begin() + Start + 1,
+                  NewLayout.begin() + Start + Body.size());
+      DEBUG(dbgs() << "BOLT-DEBUG: rotated loop at " << Header->getName()
+                   << " in " << BF << '\n');
+    }
+
+    NewLayout[Start]->setIsLoopTop(true);
+    Layout.swap(NewLayout);
+  }
+}
+
 void FixupBranches::runOnFunctions(BinaryContext &BC) {
   for (auto &It : BC.getBinaryFunctions()) {
     auto &Function = It.second;
@@ -482,30 +851,18 @@ void FinalizeFunctions::runOnFunctions(BinaryContext &BC) {
       SkipPredicate, "FinalizeFunctions");
 }
 
-void CheckLargeFunctions::runOnFunctions(BinaryContext &BC) {
-  if (BC.HasRelocations)
-    return;
-
-  if (!opts::UpdateDebugSections)
+void CheckLargeFunctions::runOnFunction(BinaryFunction &BF) {
+  auto &BC = BF.getBinaryContext();
+  if (BC.HasRelocations || !opts::UpdateDebugSections || !shouldOptimize(BF))
     return;
 
   // If the function wouldn't fit, mark it as non-simple. Otherwise, we may emit
   // incorrect debug info.
-  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
-    uint64_t HotSize, ColdSize;
-    std::tie(HotSize, ColdSize) =
-        BC.calculateEmittedSize(BF, /*FixBranches=*/false);
-    if (HotSize > BF.getMaxSize())
-      BF.setSimple(false);
-  };
-
-  ParallelUtilities::PredicateTy SkipFunc = [&](const BinaryFunction &BF) {
-    return !shouldOptimize(BF);
-  };
-
-  ParallelUtilities::runOnEachFunction(
-      BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
-      SkipFunc, "CheckLargeFunctions");
+  uint64_t HotSize, ColdSize;
+  std::tie(HotSize, ColdSize) =
+      BC.calculateEmittedSize(BF, /*FixBranches=*/false);
+  if (HotSize > BF.getMaxSize())
+    BF.setSimple(false);
 }
 
 bool CheckLargeFunctions::shouldOptimize(const BinaryFunction &BF) const {
@@ -549,9 +906,9 @@ void LowerAnnotations::runOnFunctions(BinaryContext &BC) {
       // Now record preserved annotations separately and then strip annotations.
       for (auto II = BB->begin(); II != BB->end(); ++II) {
         if (BF.requiresAddressTranslation() &&
-            BC.MIB->hasAnnotation(*II, "Offset")) {
+            BC.MIB->hasAnnotation(*II, MCPlus::OffsetAnnotation)) {
           PreservedOffsetAnnotations.push_back(std::make_pair(
-              &(*II), BC.MIB->getAnnotationAs<uint32_t>(*II, "Offset")));
+              &(*II), BC.MIB->getAnnotationAs(*II, MCPlus::OffsetAnnotation)));
         }
         BC.MIB->stripAnnotations(*II);
       }
@@ -563,7 +920,7 @@ void LowerAnnotations::runOnFunctions(BinaryContext &BC) {
 
   // Reinsert preserved annotations we need during code emission.
   for (const auto &Item : PreservedOffsetAnnotations)
-    BC.MIB->addAnnotation<uint32_t>(*Item.first, "Offset", Item.second);
+    BC.MIB->addAnnotation(*Item.first, MCPlus::OffsetAnnotation, Item.second);
 }
 
 namespace {
@@ -830,8 +1187,8 @@ uint64_t SimplifyConditionalTailCalls::fixTailCalls(BinaryContext &BC,
       MIB->setConditionalTailCall(*CondBranch);
       // Add info abount the conditional tail call frequency, otherwise this
       // info will be lost when we delete the associated BranchInfo entry
-      auto &CTCAnnotation = BC.MIB->getOrCreateAnnotationAs<uint64_t>(
-          *CondBranch, "CTCTakenCount");
+      auto &CTCAnnotation = BC.MIB->getOrCreateAnnotationAs(
+          *CondBranch, MCPlus::CTCTakenCountAnnotation);
       CTCAnnotation = CTCTakenFreq;
 
       // Remove the unused successor which may be eliminated later
@@ -1010,31 +1367,190 @@ void Peepholes::removeUselessCondBranches(BinaryContext &BC,
   }
 }
 
-void Peepholes::runOnFunctions(BinaryContext &BC) {
-  const char Opts =
-    std::accumulate(opts::Peepholes.begin(),
-                    opts::Peepholes.end(),
-                    0,
-                    [](const char A, const opts::PeepholeOpts B) {
-                      return A | B;
-                    });
-  if (Opts == opts::PEEP_NONE || !BC.isX86())
-    return;
+namespace {
 
-  for (auto &It : BC.getBinaryFunctions()) {
-    auto &Function = It.second;
-    if (shouldOptimize(Function)) {
-      if (Opts & opts::PEEP_SHORTEN)
-        NumShortened += shortenInstructions(BC, Function);
-      if (Opts & opts::PEEP_DOUBLE_JUMPS)
-        NumDoubleJumps += fixDoubleJumps(BC, Function, false);
-      if (Opts & opts::PEEP_TAILCALL_TRAPS)
-        addTailcallTraps(BC, Function);
-      if (Opts & opts::PEEP_USELESS_BRANCHES)
-        removeUselessCondBranches(BC, Function);
-      assert(Function.validateCFG());
+/// Return true if \p BB consists of a 64-bit register to register move into
+/// a general purpose register, optionally followed by an unconditional
+/// branch, and set \p Move to the move.
+bool isSingleRegMoveBlock(const BinaryContext &BC, const BinaryBasicBlock &BB,
+                          const MCInst *&Move, MCPhysReg &From,
+                          MCPhysReg &To) {
+  Move = nullptr;
+  for (const auto &Inst : BB) {
+    if (BC.MIB->isUnconditionalBranch(Inst) && &Inst == &*BB.rbegin())
+      continue;
+    if (Move || BC.MIB->isPseudo(Inst) ||
+        !BC.MIB->isRegToRegMove(Inst, From, To) ||
+        From == BC.MIB->getStackPointer() || To == BC.MIB->getStackPointer())
+      return false;
+    Move = &Inst;
+  }
+  return Move != nullptr;
+}
+
+} // anonymous namespace
+
+uint64_t Peepholes::convertHardBranchesToCMov(BinaryContext &BC,
+                                              BinaryFunction &Function) {
+  uint64_t NumLocalCMovs = 0;
+
+  // A branch arm that can be folded into its predecessor.
+  auto isFoldableArm = [](const BinaryBasicBlock *BB,
+                          const BinaryBasicBlock *Arm) {
+    return Arm != BB && Arm->isValid() && Arm->pred_size() == 1 &&
+           Arm->succ_size() == 1 && !Arm->isLandingPad() &&
+           !Arm->isEntryPoint();
+  };
+
+  for (auto *BB : Function.layout()) {
+    if (!BB->isValid() || BB->succ_size() != 2)
+      continue;
+
+    const auto &TakenBI = BB->getTakenBranchInfo();
+    const auto &FallthroughBI = BB->getFallthroughBranchInfo();
+    if (TakenBI.Count == BinaryBasicBlock::COUNT_NO_PROFILE ||
+        FallthroughBI.Count == BinaryBasicBlock::COUNT_NO_PROFILE)
+      continue;
+
+    // Predictable branches are cheaper than the data dependency introduced
+    // by cmov.
+    const auto Count = TakenBI.Count + FallthroughBI.Count;
+    auto Mispreds = TakenBI.MispredictedCount;
+    if (FallthroughBI.MispredictedCount != BinaryBasicBlock::COUNT_INFERRED)
+      Mispreds += FallthroughBI.MispredictedCount;
+    if (Count < opts::PeepholeCMovMinCount ||
+        Mispreds * 100 < Count * opts::PeepholeCMovMinMispredRatio)
+      continue;
+
+    const MCSymbol *TBB = nullptr;
+    const MCSymbol *FBB = nullptr;
+    MCInst *CondBranch = nullptr;
+    MCInst *UncondBranch = nullptr;
+    auto Result = BB->analyzeBranch(TBB, FBB, CondBranch, UncondBranch);
+    if (!Result || !CondBranch)
+      continue;
+
+    auto *TakenBB = BB->getConditionalSuccessor(true);
+    auto *FallthroughBB = BB->getConditionalSuccessor(false);
+    BinaryBasicBlock *ThenBB = nullptr;
+    BinaryBasicBlock *ElseBB = nullptr;
+    BinaryBasicBlock *JoinBB = nullptr;
+    bool Invert = false;
+    if (isFoldableArm(BB, TakenBB) && isFoldableArm(BB, FallthroughBB) &&
+        TakenBB->getSuccessor() == FallthroughBB->getSuccessor()) {
+      ThenBB = TakenBB;
+      ElseBB = FallthroughBB;
+      JoinBB = TakenBB->getSuccessor();
+    } else if (isFoldableArm(BB, TakenBB) &&
+               TakenBB->getSuccessor() == FallthroughBB) {
+      ThenBB = TakenBB;
+      JoinBB = FallthroughBB;
+    } else if (isFoldableArm(BB, FallthroughBB) &&
+               FallthroughBB->getSuccessor() == TakenBB) {
+      ThenBB = FallthroughBB;
+      JoinBB = TakenBB;
+      Invert = true;
+    } else {
+      continue;
+    }
+    if (JoinBB == BB)
+      continue;
+
+    const MCInst *ThenMove;
+    MCPhysReg ThenFrom, ThenTo;
+    if (!isSingleRegMoveBlock(BC, *ThenBB, ThenMove, ThenFrom, ThenTo))
+      continue;
+
+    const MCInst *ElseMove = nullptr;
+    if (ElseBB) {
+      MCPhysReg ElseFrom, ElseTo;
+      if (!isSingleRegMoveBlock(BC, *ElseBB, ElseMove, ElseFrom, ElseTo) ||
+          ElseTo != ThenTo)
+        continue;
+      // The move from the other arm executes unconditionally first, and must
+      // not clobber the source of the conditional move.
+      if (ThenFrom == ThenTo) {
+        std::swap(ThenBB, ElseBB);
+        std::swap(ThenMove, ElseMove);
+        std::swap(ThenFrom, ElseFrom);
+        Invert = !Invert;
+      }
+      if (ThenFrom == ThenTo)
+        continue;
     }
+
+    MCInst CMov;
+    if (!BC.MIB->createCMov(CMov, *CondBranch, ThenTo, ThenFrom, Invert))
+      continue;
+
+    if (UncondBranch)
+      BB->eraseInstruction(BB->findInstruction(UncondBranch));
+    BB->eraseInstruction(BB->findInstruction(CondBranch));
+    if (ElseMove)
+      BB->addInstruction(*ElseMove);
+    BB->addInstruction(CMov);
+
+    BB->removeAllSuccessors();
+    BB->addSuccessor(JoinBB, Count, 0);
+    ThenBB->markValid(false);
+    if (ElseBB)
+      ElseBB->markValid(false);
+
+    // The blocks folded into BB are about to be deleted and cannot be its
+    // fall-through.
+    auto *NextBB = Function.getBasicBlockAfter(BB, false);
+    while (NextBB && !NextBB->isValid())
+      NextBB = Function.getBasicBlockAfter(NextBB, false);
+    if (NextBB != JoinBB) {
+      auto L = BC.scopeLock();
+      MCInst Branch;
+      BC.MIB->createUncondBranch(Branch, JoinBB->getLabel(), BC.Ctx.get());
+      BB->addInstruction(Branch);
+    }
+
+    ++NumLocalCMovs;
+  }
+
+  if (NumLocalCMovs)
+    Function.eraseInvalidBBs();
+
+  return NumLocalCMovs;
+}
+
+void Peepholes::setupLocalRun(BinaryContext &BC) {
+  Opts = std::accumulate(opts::Peepholes.begin(),
+                         opts::Peepholes.end(),
+                         0,
+                         [](const char A, const opts::PeepholeOpts B) {
+                           return A | B;
+                         });
+}
+
+void Peepholes::runOnFunction(BinaryFunction &Function) {
+  auto &BC = Function.getBinaryContext();
+  if (Opts == opts::PEEP_NONE || !BC.isX86() || !shouldOptimize(Function))
+    return;
+
+  if (Opts & opts::PEEP_SHORTEN)
+    NumShortened += shortenInstructions(BC, Function);
+  if (Opts & opts::PEEP_DOUBLE_JUMPS) {
+    // Patching of branches creates expressions in the shared MCContext.
+    auto L = BC.scopeLock();
+    NumDoubleJumps += fixDoubleJumps(BC, Function, false);
   }
+  if (Opts & opts::PEEP_TAILCALL_TRAPS)
+    addTailcallTraps(BC, Function);
+  if (Opts & opts::PEEP_USELESS_BRANCHES)
+    removeUselessCondBranches(BC, Function);
+  if (Opts & opts::PEEP_CMOV)
+    NumCMovs += convertHardBranchesToCMov(BC, Function);
+  assert(Function.validateCFG());
+}
+
+void Peepholes::finishLocalRun(BinaryContext &BC) {
+  if (Opts == opts::PEEP_NONE || !BC.isX86())
+    return;
+
   outs() << "BOLT-INFO: Peephole: " << NumShortened
          << " instructions shortened.\n"
          << "BOLT-INFO: Peephole: " << NumDoubleJumps
@@ -1042,7 +1558,9 @@ void Peepholes::runOnFunctions(BinaryContext &BC) {
          << "BOLT-INFO: Peephole: " << TailCallTraps
          << " tail call traps inserted.\n"
          << "BOLT-INFO: Peephole: " << NumUselessCondBranches
-         << " useless conditional branches removed.\n";
+         << " useless conditional branches removed.\n"
+         << "BOLT-INFO: Peephole: " << NumCMovs
+         << " mispredicted branches converted to cmov.\n";
 }
 
 bool SimplifyRODataLoads::simplifyRODataLoads(
@@ -1169,8 +1687,18 @@ void AssignSections::runOnFunctions(BinaryContext &BC) {
       Function.setCodeSectionName(BC.getColdCodeSectionName());
     }
 
-    if (Function.isSplit())
-      Function.setColdCodeSectionName(BC.getColdCodeSectionName());
+    if (!Function.isSplit())
+      continue;
+
+    // Fragments outlined with -split-warm-threshold that contain executed
+    // code are placed apart from the code that was never executed.
+    const auto IsWarm =
+        std::any_of(Function.layout_begin(), Function.layout_end(),
+                    [](const BinaryBasicBlock *BB) {
+                      return BB->isCold() && BB->getKnownExecutionCount() > 0;
+                    });
+    Function.setColdCodeSectionName(IsWarm ? BC.getWarmCodeSectionName()
+                                           : BC.getColdCodeSectionName());
   }
 }
 
@@ -1265,6 +1793,153 @@ void PrintProfileStats::runOnFunctions(BinaryContext &BC) {
            << "\n";
     DEBUG(WorstBiasFunc->dump());
   }
+
+  // Flow conservation violation of each function: the sum over its inner
+  // blocks of the absolute difference between incoming and outgoing counts,
+  // relative to the incoming counts. Basic samples from the PC of every LBR
+  // sample are compared with the instructions executed according to the
+  // LBRs: both shares of the samples should agree function by function.
+  struct FunctionQuality {
+    const BinaryFunction *Function;
+    double FlowViolation{0.0};
+    uint64_t FlowIn{0};
+    double SampleShare{0.0};
+    double InstructionShare{0.0};
+  };
+  std::vector<FunctionQuality> Functions;
+  const auto &Collection = BC.ProfileCollection;
+  uint64_t TotalFlowIn = 0;
+  double TotalFlowDiff = 0.0;
+  uint64_t TotalPCSamples = 0;
+  uint64_t TotalInstructions = 0;
+  for (const auto &BFI : BC.getBinaryFunctions()) {
+    const BinaryFunction &Function = BFI.second;
+    if (Function.empty() || !Function.isSimple() ||
+        !Function.hasValidProfile())
+      continue;
+    FunctionQuality Quality{&Function};
+    FlowMapTy &IncomingMap = TotalIncomingMaps[&Function];
+    FlowMapTy &OutgoingMap = TotalOutgoingMaps[&Function];
+    double FlowDiff = 0.0;
+    uint64_t NumInstructions = 0;
+    for (const auto &BB : Function) {
+      const auto ExecCount = BB.getKnownExecutionCount();
+      NumInstructions += ExecCount * BB.getNumNonPseudos();
+      if (BB.isEntryPoint() || OutgoingMap[&BB] == 0)
+        continue;
+      Quality.FlowIn += IncomingMap[&BB];
+      FlowDiff += fabs((double)OutgoingMap[&BB] - IncomingMap[&BB]);
+    }
+    if (Quality.FlowIn)
+      Quality.FlowViolation = FlowDiff / Quality.FlowIn;
+    TotalFlowIn += Quality.FlowIn;
+    TotalFlowDiff += FlowDiff;
+    TotalInstructions += NumInstructions;
+    Quality.InstructionShare = NumInstructions;
+    auto SI = Collection.PCSamples.find(&Function);
+    if (SI != Collection.PCSamples.end()) {
+      Quality.SampleShare = SI->second;
+      TotalPCSamples += SI->second;
+    }
+    Functions.push_back(Quality);
+  }
+
+  double SampleDistance = 0.0;
+  for (auto &Quality : Functions) {
+    if (TotalInstructions)
+      Quality.InstructionShare /= TotalInstructions;
+    if (TotalPCSamples)
+      Quality.SampleShare /= TotalPCSamples;
+    SampleDistance += fabs(Quality.SampleShare - Quality.InstructionShare);
+  }
+  SampleDistance /= 2;
+  const double FlowViolation = TotalFlowIn ? TotalFlowDiff / TotalFlowIn : 0.0;
+
+  outs() << format("BOLT-INFO: Profile flow conservation violation: %.4lf%%\n",
+                   100.0 * FlowViolation);
+  std::sort(Functions.begin(), Functions.end(),
+            [](const FunctionQuality &A, const FunctionQuality &B) {
+              return A.FlowViolation * A.FlowIn > B.FlowViolation * B.FlowIn;
+            });
+  if (opts::Verbosity >= 1) {
+    outs() << "BOLT-INFO: Functions with the largest flow violation:\n";
+    for (size_t I = 0, E = std::min<size_t>(Functions.size(), 10); I < E; ++I)
+      outs() << format("  %8.2lf%%  ", 100.0 * Functions[I].FlowViolation)
+             << Functions[I].Function->getPrintName() << " ("
+             << Functions[I].FlowIn << " incoming)\n";
+  }
+  if (BC.getNumUnusedProfiledObjects())
+    outs() << "BOLT-INFO: " << BC.getNumUnusedProfiledObjects()
+           << " objects in the profile do not match any function\n";
+
+  auto percent = [](uint64_t Part, uint64_t Total) {
+    return Total ? 100.0 * Part / Total : 0.0;
+  };
+  if (Collection.IsAvailable) {
+    const auto LBRTotal =
+        Collection.NumLBREntries + Collection.NumKernelLBREntries;
+    outs() << format("BOLT-INFO: Samples not attributed to the binary: "
+                     "%.2lf%%, LBR entries dropped in the kernel: %.2lf%%\n",
+                     percent(Collection.NumIgnoredSamples,
+                             Collection.NumSamples),
+                     percent(Collection.NumKernelLBREntries, LBRTotal))
+           << format("BOLT-INFO: Traces mismatching the binary: %.2lf%%, "
+                     "traces involving unknown addresses: %.2lf%%\n",
+                     percent(Collection.NumInvalidTraces, Collection.NumTraces),
+                     percent(Collection.NumLongRangeTraces,
+                             Collection.NumTraces));
+    if (Collection.NumIgnoredMMaps)
+      outs() << "BOLT-INFO: " << Collection.NumIgnoredMMaps
+             << " mappings of the binary were ignored\n";
+    if (TotalPCSamples)
+      outs() << format("BOLT-INFO: Distance between basic and branch sample "
+                       "distributions: %.2lf%%\n",
+                       100.0 * SampleDistance);
+  }
+
+  if (opts::ProfileStatsFile.empty())
+    return;
+
+  std::error_code EC;
+  raw_fd_ostream OS(opts::ProfileStatsFile, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-WARNING: " << EC.message() << ", unable to open "
+           << opts::ProfileStatsFile << " for output.\n";
+    return;
+  }
+  OS << "{\n  \"bias_mean\": " << format("%.6lf", FlowImbalanceMean)
+     << ",\n  \"bias_stdev\": " << format("%.6lf", FlowImbalanceVar)
+     << ",\n  \"flow_violation\": " << format("%.6lf", FlowViolation)
+     << ",\n  \"unused_profiled_objects\": "
+     << BC.getNumUnusedProfiledObjects();
+  if (Collection.IsAvailable) {
+    OS << ",\n  \"samples\": " << Collection.NumSamples
+       << ",\n  \"ignored_samples\": " << Collection.NumIgnoredSamples
+       << ",\n  \"ignored_mmaps\": " << Collection.NumIgnoredMMaps
+       << ",\n  \"lbr_entries\": " << Collection.NumLBREntries
+       << ",\n  \"kernel_lbr_entries\": " << Collection.NumKernelLBREntries
+       << ",\n  \"traces\": " << Collection.NumTraces
+       << ",\n  \"invalid_traces\": " << Collection.NumInvalidTraces
+       << ",\n  \"long_range_traces\": " << Collection.NumLongRangeTraces
+       << ",\n  \"cold_samples\": " << Collection.NumColdSamples;
+    if (TotalPCSamples)
+      OS << ",\n  \"sample_distance\": " << format("%.6lf", SampleDistance);
+  }
+  OS << ",\n  \"functions\": [";
+  bool First = true;
+  for (const auto &Quality : Functions) {
+    OS << (First ? "" : ",") << "\n    {\"name\": \"";
+    OS.write_escaped(Quality.Function->getPrintName());
+    OS << "\", \"flow_in\": " << Quality.FlowIn << ", \"flow_violation\": "
+       << format("%.6lf", Quality.FlowViolation);
+    if (TotalPCSamples)
+      OS << ", \"sample_share\": " << format("%.6lf", Quality.SampleShare)
+         << ", \"instruction_share\": "
+         << format("%.6lf", Quality.InstructionShare);
+    OS << '}';
+    First = false;
+  }
+  OS << "\n  ]\n}\n";
 }
 
 void
@@ -1551,32 +2226,30 @@ PrintProgramStats::runOnFunctions(BinaryContext &BC) {
   }
 }
 
-void InstructionLowering::runOnFunctions(BinaryContext &BC) {
-  for (auto &BFI : BC.getBinaryFunctions()) {
-    for (auto &BB : BFI.second) {
-      for (auto &Instruction : BB) {
-        BC.MIB->lowerTailCall(Instruction);
-      }
+void InstructionLowering::runOnFunction(BinaryFunction &BF) {
+  auto &BC = BF.getBinaryContext();
+  for (auto &BB : BF) {
+    for (auto &Instruction : BB) {
+      BC.MIB->lowerTailCall(Instruction);
     }
   }
 }
 
-void StripRepRet::runOnFunctions(BinaryContext &BC) {
-  uint64_t NumPrefixesRemoved = 0;
-  uint64_t NumBytesSaved = 0;
-  for (auto &BFI : BC.getBinaryFunctions()) {
-    for (auto &BB : BFI.second) {
-      auto LastInstRIter = BB.getLastNonPseudo();
-      if (LastInstRIter == BB.rend() ||
-          !BC.MIB->isReturn(*LastInstRIter) ||
-          !BC.MIB->deleteREPPrefix(*LastInstRIter))
-        continue;
+void StripRepRet::runOnFunction(BinaryFunction &BF) {
+  auto &BC = BF.getBinaryContext();
+  for (auto &BB : BF) {
+    auto LastInstRIter = BB.getLastNonPseudo();
+    if (LastInstRIter == BB.rend() ||
+        !BC.MIB->isReturn(*LastInstRIter) ||
+        !BC.MIB->deleteREPPrefix(*LastInstRIter))
+      continue;
 
-      NumPrefixesRemoved += BB.getKnownExecutionCount();
-      ++NumBytesSaved;
-    }
+    NumPrefixesRemoved += BB.getKnownExecutionCount();
+    ++NumBytesSaved;
   }
+}
 
+void StripRepRet::finishLocalRun(BinaryContext &BC) {
   if (NumBytesSaved) {
     outs() << "BOLT-INFO: removed " << NumBytesSaved << " 'repz' prefixes"
               " with estimated execution count of " << NumPrefixesRemoved
@@ -1766,5 +2439,157 @@ void SpecializeMemcpy1::runOnFunctions(BinaryContext &BC) {
   }
 }
 
+namespace {
+
+/// Return the sizes to specialize a call site with value profile \p VP for,
+/// most frequent first. Counts are scaled to per mille of all observed calls.
+std::vector<ValueProfileEntry> selectSizes(const ValueProfile &VP) {
+  uint64_t Total = 0;
+  for (const auto &Entry : VP)
+    Total += Entry.Count;
+
+  std::vector<ValueProfileEntry> Result;
+  if (Total < opts::MemcpySizeSpecMinCount)
+    return Result;
+
+  std::vector<ValueProfileEntry> Entries(VP.begin(), VP.end());
+  std::stable_sort(Entries.begin(), Entries.end(),
+                   [](const ValueProfileEntry &A, const ValueProfileEntry &B) {
+                     return A.Count > B.Count;
+                   });
+  for (const auto &Entry : Entries) {
+    if (Result.size() >= opts::MemcpySizeSpecMaxSizes ||
+        Entry.Count * 100 < Total * opts::MemcpySizeSpecMinRatio)
+      break;
+    // The size is compared against an 8-bit signed immediate.
+    if (Entry.Value > opts::MemcpySizeSpecMaxSize || Entry.Value > 127)
+      continue;
+    Result.push_back({Entry.Value, Entry.Count * 1000 / Total});
+  }
+  return Result;
+}
+
+} // anonymous namespace
+
+void SpecializeMemcpyBySize::runOnFunctions(BinaryContext &BC) {
+  if (!BC.isX86())
+    return;
+
+  uint64_t NumSites = 0;
+  uint64_t NumFastPaths = 0;
+  uint64_t NumCallsAvoided = 0;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &Function = BFI.second;
+    if (!shouldOptimize(Function) || !Function.hasValidProfile())
+      continue;
+
+    std::vector<BinaryBasicBlock *> Blocks(Function.pbegin(), Function.pend());
+    for (auto *CurBB : Blocks) {
+      for (auto II = CurBB->begin(); II != CurBB->end(); ++II) {
+        auto &Inst = *II;
+
+        if (!BC.MIB->isCall(Inst) || MCPlus::getNumPrimeOperands(Inst) != 1 ||
+            !Inst.getOperand(0).isExpr())
+          continue;
+
+        const auto *CalleeSymbol = BC.MIB->getTargetSymbol(Inst);
+        const auto CalleeName = CalleeSymbol->getName();
+        const bool IsMemset =
+            CalleeName == "memset" || CalleeName == "memset@PLT";
+        if (!IsMemset && CalleeName != "memcpy" && CalleeName != "memcpy@PLT")
+          continue;
+
+        if (BC.MIB->isTailCall(Inst) || BC.MIB->isInvoke(Inst))
+          continue;
+
+        // Calls that do not return have no block to join the fast paths at.
+        if (CurBB->succ_size() == 0 &&
+            std::none_of(std::next(II), CurBB->end(), [&](const MCInst &I) {
+              return !BC.MIB->isPseudo(I);
+            }))
+          continue;
+
+        auto VP = BC.MIB->tryGetAnnotationAs<ValueProfile>(Inst,
+                                                            "ValueProfile");
+        if (!VP)
+          continue;
+
+        const auto Sizes = selectSizes(*VP);
+        if (Sizes.empty())
+          continue;
+
+        const auto CallInstr = Inst;
+        const uint64_t ExecCount = CurBB->getKnownExecutionCount();
+
+        auto *CallBB = CurBB->splitAt(II);
+        BinaryBasicBlock *NextBB{nullptr};
+        if (CallBB->getNumNonPseudos() > 1) {
+          NextBB = CallBB->splitAt(std::next(CallBB->begin()));
+        } else {
+          NextBB = CallBB->getSuccessor();
+          assert(NextBB && "unexpected call with no return");
+        }
+
+        // Chain a compare for each size in front of the original call:
+        //   cmp $Size, %rdx ; je FastBB ; ... ; call memcpy
+        CurBB->removeAllSuccessors();
+        uint64_t Remaining = ExecCount;
+        auto *CheckBB = CurBB;
+        for (size_t I = 0, E = Sizes.size(); I != E; ++I) {
+          const uint64_t FastCount =
+              std::min(Remaining, ExecCount * Sizes[I].Count / 1000);
+
+          auto *FastBB = Function.addBasicBlock(CurBB->getInputOffset());
+          FastBB->addInstructions(
+              IsMemset ? BC.MIB->createFixedSizeMemset(Sizes[I].Value)
+                       : BC.MIB->createFixedSizeMemcpy(Sizes[I].Value));
+          FastBB->addSuccessor(NextBB, FastCount);
+          FastBB->setCFIState(NextBB->getCFIState());
+          FastBB->setExecutionCount(FastCount);
+
+          auto *FallBB = I + 1 == E
+                             ? CallBB
+                             : Function.addBasicBlock(CurBB->getInputOffset());
+          CheckBB->addInstructions(BC.MIB->createCmpJE(
+              BC.MIB->getIntArgRegister(2), Sizes[I].Value, FastBB->getLabel(),
+              BC.Ctx.get()));
+          CheckBB->addSuccessor(FastBB, FastCount);
+          CheckBB->addSuccessor(FallBB, Remaining - FastCount);
+          Remaining -= FastCount;
+          if (FallBB != CallBB) {
+            FallBB->setCFIState(CallBB->getCFIState());
+            FallBB->setExecutionCount(Remaining);
+          }
+          CheckBB = FallBB;
+          ++NumFastPaths;
+        }
+
+        // To prevent the actual call from being moved to cold, we keep its
+        // execution count non-zero.
+        CallBB->setExecutionCount(Remaining);
+        if (ExecCount > 0 && Remaining == 0)
+          CallBB->setExecutionCount(1);
+        ++NumSites;
+        NumCallsAvoided += ExecCount - Remaining;
+
+        CurBB = NextBB;
+
+        // Note: we don't expect the next instruction to be a call to memcpy.
+        II = CurBB->begin();
+      }
+    }
+  }
+
+  if (NumSites) {
+    outs() << "BOLT-INFO: specialized " << NumSites
+           << " memcpy()/memset() call sites with " << NumFastPaths
+           << " fast paths based on value profile";
+    if (NumCallsAvoided)
+      outs() << ". An estimated " << NumCallsAvoided
+             << " calls take a fast path.";
+    outs() << '\n';
+  }
+}
+
 } // namespace bolt
 } // namespace llvm
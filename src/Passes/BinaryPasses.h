@@ -18,6 +18,7 @@
 #include "BinaryFunction.h"
 #include "DynoStats.h"
 #include "HFSort.h"
+#include "SpeedupModel.h"
 #include "llvm/Support/CommandLine.h"
 #include <atomic>
 #include <map>
@@ -55,6 +56,25 @@ public:
 
   /// Execute this pass on the given functions.
   virtual void runOnFunctions(BinaryContext &BC) = 0;
+
+  /// Return true if the pass only reads and modifies the function it runs on,
+  /// and hence could run on different functions in parallel. The pass manager
+  /// fuses consecutive function-local passes into a single sweep over
+  /// functions that calls runOnFunction() of every pass in turn.
+  virtual bool isFunctionLocal() const { return false; }
+
+  /// Called for a function-local pass before it runs on any function.
+  virtual void setupLocalRun(BinaryContext &BC) {}
+
+  /// Run a function-local pass on \p BF.
+  virtual void runOnFunction(BinaryFunction &BF) {}
+
+  /// Called for a function-local pass after it has run on all functions.
+  virtual void finishLocalRun(BinaryContext &BC) {}
+
+protected:
+  /// Implementation of runOnFunctions() for function-local passes.
+  void runLocalPass(BinaryContext &BC);
 };
 
 /// A pass to print program-wide dynostats.
@@ -79,7 +99,7 @@ public:
   }
 
   void runOnFunctions(BinaryContext &BC) override {
-    const auto NewDynoStats = getDynoStats(BC.getBinaryFunctions());
+    const auto NewDynoStats = getDynoStats(BC);
     const auto Changed = (NewDynoStats != PrevDynoStats);
     outs() << "BOLT-INFO: program-wide dynostats "
            << Title << (Changed ? "" : " (no change)") << ":\n\n"
@@ -92,6 +112,25 @@ public:
   }
 };
 
+/// Record the dyno stats of optimized functions for the speedup estimate
+/// while the CFG is intact.
+class SpeedupModelStatsPass : public BinaryFunctionPass {
+public:
+  SpeedupModelStatsPass() : BinaryFunctionPass(false) {}
+
+  const char *getName() const override {
+    return "record dyno-stats for the speedup estimate";
+  }
+
+  bool shouldPrint(const BinaryFunction &BF) const override {
+    return false;
+  }
+
+  void runOnFunctions(BinaryContext &BC) override {
+    SpeedupModel::recordDynoStats(BC, /*AfterOptimizations=*/true);
+  }
+};
+
 /// Detect and eliminate unreachable basic blocks. We could have those
 /// filled with nops and they are used for alignment.
 class EliminateUnreachableBlocks : public BinaryFunctionPass {
@@ -99,7 +138,7 @@ class EliminateUnreachableBlocks : public BinaryFunctionPass {
   std::unordered_set<const BinaryFunction *> Modified;
   std::atomic<unsigned> DeletedBlocks{0};
   std::atomic<uint64_t> DeletedBytes{0};
-  void runOnFunction(BinaryFunction& Function);
+  void runOnFunction(BinaryFunction& Function) override;
  public:
   EliminateUnreachableBlocks(const cl::opt<bool> &PrintPass)
     : BinaryFunctionPass(PrintPass) { }
@@ -141,9 +180,18 @@ public:
   };
 
 private:
+  /// With \p ParallelRegions, loop nest regions of the function are laid
+  /// out in parallel if the layout algorithm supports it.
   void modifyFunctionLayout(BinaryFunction &Function,
                             LayoutType Type,
-                            bool MinBranchClusters) const;
+                            bool MinBranchClusters,
+                            bool ParallelRegions = false) const;
+
+  /// Make hot loop bodies contiguous in \p Layout, rotate loops so that the
+  /// exit test falls through from the latch, and mark the first blocks of
+  /// hot loops for alignment.
+  void adjustLayoutForLoops(BinaryFunction &BF,
+      BinaryFunction::BasicBlockOrderType &Layout) const;
 public:
   explicit ReorderBasicBlocks(const cl::opt<bool> &PrintPass)
     : BinaryFunctionPass(PrintPass) { }
@@ -193,7 +241,9 @@ public:
     return "check-large-functions";
   }
 
-  void runOnFunctions(BinaryContext &BC) override;
+  bool isFunctionLocal() const override { return true; }
+  void runOnFunction(BinaryFunction &BF) override;
+  void runOnFunctions(BinaryContext &BC) override { runLocalPass(BC); }
 
   bool shouldOptimize(const BinaryFunction &BF) const override;
 };
@@ -284,10 +334,14 @@ class SimplifyConditionalTailCalls : public BinaryFunctionPass {
 
 /// Perform simple peephole optimizations.
 class Peepholes : public BinaryFunctionPass {
-  uint64_t NumShortened{0};
-  uint64_t NumDoubleJumps{0};
-  uint64_t TailCallTraps{0};
-  uint64_t NumUselessCondBranches{0};
+  std::atomic<uint64_t> NumShortened{0};
+  std::atomic<uint64_t> NumDoubleJumps{0};
+  std::atomic<uint64_t> TailCallTraps{0};
+  std::atomic<uint64_t> NumUselessCondBranches{0};
+  std::atomic<uint64_t> NumCMovs{0};
+
+  /// Peephole optimizations selected on the command line.
+  char Opts{0};
 
   /// Attempt to use the minimum operand width for arithmetic, branch and
   /// move instructions.
@@ -302,6 +356,12 @@ class Peepholes : public BinaryFunctionPass {
   /// successor is the same as the unconditional successor, we can
   /// remove the conditional successor and branch instruction.
   void removeUselessCondBranches(BinaryContext &BC, BinaryFunction &Function);
+
+  /// Replace hard to predict conditional branches over a single register
+  /// move, or choosing between two moves into the same register, with a
+  /// conditional move. Return the number of branches replaced.
+  uint64_t convertHardBranchesToCMov(BinaryContext &BC,
+                                     BinaryFunction &Function);
 public:
   explicit Peepholes(const cl::opt<bool> &PrintPass)
     : BinaryFunctionPass(PrintPass) { }
@@ -309,7 +369,11 @@ public:
   const char *getName() const override {
     return "peepholes";
   }
-  void runOnFunctions(BinaryContext &BC) override;
+  bool isFunctionLocal() const override { return true; }
+  void setupLocalRun(BinaryContext &BC) override;
+  void runOnFunction(BinaryFunction &BF) override;
+  void finishLocalRun(BinaryContext &BC) override;
+  void runOnFunctions(BinaryContext &BC) override { runLocalPass(BC); }
 };
 
 /// An optimization to simplify loads from read-only sections.The pass converts
@@ -362,7 +426,10 @@ class AssignSections : public BinaryFunctionPass {
 /// CFGs, so we can detect bad quality profile. Prints average and standard
 /// deviation of the absolute differences of outgoing flow minus incoming flow
 /// for blocks of interest (excluding prologues, epilogues, and BB frequency
-/// lower than 100).
+/// lower than 100). Also reports the flow conservation violation of every
+/// function and, for profiles aggregated from perf data, the samples lost in
+/// the collection and the consistency of basic and branch samples, which can
+/// be written to -profile-stats-file.
 class PrintProfileStats : public BinaryFunctionPass {
  public:
   explicit PrintProfileStats(const cl::opt<bool> &PrintPass)
@@ -404,11 +471,16 @@ public:
     return "inst-lowering";
   }
 
-  void runOnFunctions(BinaryContext &BC) override;
+  bool isFunctionLocal() const override { return true; }
+  void runOnFunction(BinaryFunction &BF) override;
+  void runOnFunctions(BinaryContext &BC) override { runLocalPass(BC); }
 };
 
 /// Pass for stripping 'repz' from 'repz retq' sequence of instructions.
 class StripRepRet : public BinaryFunctionPass {
+  std::atomic<uint64_t> NumPrefixesRemoved{0};
+  std::atomic<uint64_t> NumBytesSaved{0};
+
 public:
   explicit StripRepRet(const cl::opt<bool> &PrintPass)
     : BinaryFunctionPass(PrintPass) {}
@@ -417,7 +489,10 @@ public:
     return "strip-rep-ret";
   }
 
-  void runOnFunctions(BinaryContext &BC) override;
+  bool isFunctionLocal() const override { return true; }
+  void runOnFunction(BinaryFunction &BF) override;
+  void finishLocalRun(BinaryContext &BC) override;
+  void runOnFunctions(BinaryContext &BC) override { runLocalPass(BC); }
 };
 
 /// Pass for inlining calls to memcpy using 'rep movsb' on X86.
@@ -456,6 +531,21 @@ public:
   void runOnFunctions(BinaryContext &BC) override;
 };
 
+/// Pass for specializing memcpy() and memset() call sites for the sizes that
+/// dominate their value profile. Each specialized size gets an inline fast
+/// path, while the remaining sizes fall back to the original call.
+class SpecializeMemcpyBySize : public BinaryFunctionPass {
+public:
+  explicit SpecializeMemcpyBySize(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) {}
+
+  const char *getName() const override {
+    return "specialize-memcpy-by-size";
+  }
+
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
 enum FrameOptimizationType : char {
   FOP_NONE, /// Don't perform FOP.
   FOP_HOT,  /// Perform FOP on hot functions.
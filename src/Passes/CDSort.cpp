@@ -0,0 +1,386 @@
+//===--- CDSort.cpp - Order functions by call distances -------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+//
+// cdsort - layout of hot functions with i-cache and i-TLB optimization.
+//
+// The algorithm applies the chain-merging framework of ExtTSP to the call
+// graph. Every call is modeled as two jumps: one from the call site to the
+// entry of the callee and one from the end of the callee back to the call
+// site. A jump contributes to the score of an ordering if its distance is
+// within the reach of the i-cache (-cdsort-cache-distance bytes) or within
+// the reach of the i-TLB (-itlb-page-size times -itlb-entries bytes), with
+// the contribution decreasing linearly with the distance.
+//
+// Initially every function forms its own chain. On every step, the pair of
+// chains whose concatenation yields the biggest increase of the score is
+// merged. Since concatenation preserves the distances within the chains, the
+// gain of merging two chains is the score of the calls between them. The
+// procedure stops when no merge increases the score, and the remaining chains
+// are sorted by density in decreasing order.
+
+#include "BinaryFunction.h"
+#include "HFSort.h"
+#include "llvm/Support/Options.h"
+
+#include <set>
+#include <vector>
+
+#undef DEBUG_TYPE
+#define DEBUG_TYPE "cdsort"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+extern cl::opt<unsigned> ITLBPageSize;
+extern cl::opt<unsigned> ITLBEntries;
+
+static cl::opt<unsigned>
+CDSortCacheDistance("cdsort-cache-distance",
+  cl::desc("The maximum distance (in bytes) of calls and returns rewarded as "
+           "i-cache friendly by cdsort"),
+  cl::init(4096),
+  cl::ReallyHidden,
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<double>
+CDSortITLBWeight("cdsort-itlb-weight",
+  cl::desc("The weight of calls and returns within the i-tlb reach relative "
+           "to the ones within the i-cache distance for cdsort"),
+  cl::init(0.1),
+  cl::ReallyHidden,
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+
+using NodeId = CallGraph::NodeId;
+using Arc = CallGraph::Arc;
+
+namespace {
+
+class Edge;
+using ArcList = std::vector<const Arc *>;
+
+// A chain (ordered sequence) of nodes (functions) in the call graph
+class Chain {
+public:
+  Chain(const Chain &) = delete;
+  Chain(Chain &&) = default;
+  Chain &operator=(const Chain &) = delete;
+  Chain &operator=(Chain &&) = default;
+
+  explicit Chain(size_t Id_, NodeId Node, size_t Samples_, size_t Size_)
+      : Id(Id_), Samples(Samples_), Size(Size_), Nodes(1, Node) {}
+
+  double density() const {
+    return Size ? static_cast<double>(Samples) / Size : 0.0;
+  }
+
+  Edge *getEdge(Chain *Other) const {
+    for (auto It : Edges) {
+      if (It.first == Other)
+        return It.second;
+    }
+    return nullptr;
+  }
+
+  void removeEdge(Chain *Other) {
+    for (auto It = Edges.begin(); It != Edges.end(); ++It) {
+      if (It->first == Other) {
+        Edges.erase(It);
+        return;
+      }
+    }
+  }
+
+  void addEdge(Chain *Other, Edge *Edge) {
+    Edges.push_back(std::make_pair(Other, Edge));
+  }
+
+public:
+  size_t Id;
+  uint64_t Samples;
+  uint64_t Size;
+  // Nodes in the chain
+  std::vector<NodeId> Nodes;
+  // Adjacent chains and corresponding edges (lists of arcs). There are no
+  // edges from a chain to itself, as arcs within a chain do not affect the
+  // gain of merging it with another chain
+  std::vector<std::pair<Chain *, Edge *>> Edges;
+};
+
+// An edge in the call graph representing arcs between two chains, together
+// with the best way of concatenating the chains
+class Edge {
+public:
+  Edge(const Edge &) = delete;
+  Edge(Edge &&) = default;
+  Edge &operator=(const Edge &) = delete;
+  Edge &operator=(Edge &&) = default;
+
+  explicit Edge(const Arc *A) : Arcs(1, A) {}
+
+  void moveArcs(Edge *Other) {
+    Arcs.insert(Arcs.end(), Other->Arcs.begin(), Other->Arcs.end());
+    Other->Arcs.clear();
+  }
+
+  // Original arcs in the binary with corresponding execution counts
+  ArcList Arcs;
+  // Cached gain of placing PredChain right before SuccChain
+  double Gain{-1.0};
+  Chain *PredChain{nullptr};
+  Chain *SuccChain{nullptr};
+};
+
+class CDSort {
+public:
+  explicit CDSort(const CallGraph &Cg) : Cg(Cg) { initialize(); }
+
+  /// Run the algorithm and return ordered set of function clusters.
+  std::vector<Cluster> run() {
+    mergeChainPairs();
+
+    outs() << "BOLT-INFO: cdsort reduced the number of chains from "
+           << Cg.numNodes() << " to " << HotChains.size() << "\n";
+
+    // Sorting chains by density in decreasing order
+    std::stable_sort(HotChains.begin(), HotChains.end(),
+                     [](const Chain *L, const Chain *R) {
+                       if (L->density() != R->density())
+                         return L->density() > R->density();
+                       // Making sure the comparison is deterministic
+                       return L->Id < R->Id;
+                     });
+
+    std::vector<Cluster> Clusters;
+    Clusters.reserve(HotChains.size());
+    for (auto Chain : HotChains) {
+      Clusters.emplace_back(Cluster(Chain->Nodes, Cg));
+    }
+    return Clusters;
+  }
+
+private:
+  /// Initialize the chains, function id to chain mapping and the edges.
+  void initialize() {
+    AllChains.reserve(Cg.numNodes());
+    HotChains.reserve(Cg.numNodes());
+    NodeChain.resize(Cg.numNodes(), nullptr);
+    Addr.resize(Cg.numNodes(), 0);
+
+    for (NodeId F = 0; F < Cg.numNodes(); ++F) {
+      AllChains.emplace_back(F, F, Cg.samples(F), Cg.size(F));
+      HotChains.push_back(&AllChains.back());
+      NodeChain[F] = &AllChains.back();
+    }
+
+    AllEdges.reserve(Cg.numArcs());
+    for (NodeId F = 0; F < Cg.numNodes(); ++F) {
+      for (auto Succ : Cg.successors(F)) {
+        if (F == Succ)
+          continue;
+        const auto &Arc = *Cg.findArc(F, Succ);
+        if (Arc.weight() == 0.0)
+          continue;
+
+        auto CurEdge = NodeChain[F]->getEdge(NodeChain[Succ]);
+        if (CurEdge != nullptr) {
+          // This edge is already present in the graph
+          CurEdge->Arcs.push_back(&Arc);
+        } else {
+          // This is a new edge
+          AllEdges.emplace_back(&Arc);
+          NodeChain[F]->addEdge(NodeChain[Succ], &AllEdges.back());
+          NodeChain[Succ]->addEdge(NodeChain[F], &AllEdges.back());
+        }
+      }
+    }
+  }
+
+  /// The score of a jump between two addresses with a given weight.
+  double jumpScore(uint64_t SrcAddr, uint64_t DstAddr, double Weight) const {
+    const uint64_t Dist =
+        SrcAddr >= DstAddr ? SrcAddr - DstAddr : DstAddr - SrcAddr;
+    double Score = 0.0;
+    if (Dist < opts::CDSortCacheDistance)
+      Score += 1.0 - double(Dist) / opts::CDSortCacheDistance;
+    const uint64_t ITLBReach =
+        uint64_t(opts::ITLBPageSize) * uint64_t(opts::ITLBEntries);
+    if (Dist < ITLBReach)
+      Score += opts::CDSortITLBWeight * (1.0 - double(Dist) / ITLBReach);
+    return Score * Weight;
+  }
+
+  /// The gain of placing chain ChainPred right before chain ChainSucc, which
+  /// is the score of calls and returns between the two chains.
+  double mergeGain(Chain *ChainPred, Chain *ChainSucc, Edge *Edge) const {
+    auto getAddr = [&](NodeId F) {
+      return Addr[F] + (NodeChain[F] == ChainPred ? 0 : ChainPred->Size);
+    };
+
+    double Gain = 0.0;
+    for (auto Arc : Edge->Arcs) {
+      const uint64_t CallSite =
+          getAddr(Arc->src()) + uint64_t(Arc->avgCallOffset());
+      const uint64_t Callee = getAddr(Arc->dst());
+      // The call and the return from the end of the callee
+      Gain += jumpScore(CallSite, Callee, Arc->weight());
+      Gain += jumpScore(Callee + Cg.size(Arc->dst()), CallSite, Arc->weight());
+    }
+    return Gain;
+  }
+
+  /// Compute the best way of concatenating the chains of an edge.
+  void updateMergeGain(Chain *ChainPred, Chain *ChainSucc, Edge *Edge) const {
+    const auto ForwardGain = mergeGain(ChainPred, ChainSucc, Edge);
+    const auto BackwardGain = mergeGain(ChainSucc, ChainPred, Edge);
+    // When forward and backward gains are the same, prioritize merging that
+    // preserves the original order of the functions in the binary
+    if (ForwardGain > BackwardGain + 1e-8 ||
+        (std::abs(ForwardGain - BackwardGain) <= 1e-8 &&
+         ChainPred->Id < ChainSucc->Id)) {
+      Edge->Gain = ForwardGain;
+      Edge->PredChain = ChainPred;
+      Edge->SuccChain = ChainSucc;
+    } else {
+      Edge->Gain = BackwardGain;
+      Edge->PredChain = ChainSucc;
+      Edge->SuccChain = ChainPred;
+    }
+  }
+
+  /// Merge pairs of chains while there is an improvement of the score.
+  void mergeChainPairs() {
+    // Creating a priority queue containing all edges ordered by the merge gain
+    auto GainComparator = [](Edge *L, Edge *R) {
+      if (std::abs(L->Gain - R->Gain) > 1e-8) {
+        return L->Gain > R->Gain;
+      }
+      // Making sure the comparison is deterministic
+      if (L->PredChain->Id != R->PredChain->Id) {
+        return L->PredChain->Id < R->PredChain->Id;
+      }
+      return L->SuccChain->Id < R->SuccChain->Id;
+    };
+    std::set<Edge *, decltype(GainComparator)> Queue(GainComparator);
+
+    for (auto ChainPred : HotChains) {
+      for (auto EdgeIt : ChainPred->Edges) {
+        auto ChainSucc = EdgeIt.first;
+        auto ChainEdge = EdgeIt.second;
+        // Every edge is visited from both of its chains
+        if (ChainPred->Id > ChainSucc->Id)
+          continue;
+        updateMergeGain(ChainPred, ChainSucc, ChainEdge);
+        if (ChainEdge->Gain > 0.0) {
+          Queue.insert(ChainEdge);
+        }
+      }
+    }
+
+    // Merge the chains while the gain of merging is positive
+    while (!Queue.empty()) {
+      Edge *BestEdge = *Queue.begin();
+      Queue.erase(Queue.begin());
+      Chain *BestChainPred = BestEdge->PredChain;
+      Chain *BestChainSucc = BestEdge->SuccChain;
+
+      // Remove outdated edges
+      for (auto EdgeIt : BestChainPred->Edges) {
+        Queue.erase(EdgeIt.second);
+      }
+      for (auto EdgeIt : BestChainSucc->Edges) {
+        Queue.erase(EdgeIt.second);
+      }
+
+      mergeChains(BestChainPred, BestChainSucc);
+
+      // Insert edges of the merged chain into the queue
+      for (auto EdgeIt : BestChainPred->Edges) {
+        auto ChainEdge = EdgeIt.second;
+        updateMergeGain(BestChainPred, EdgeIt.first, ChainEdge);
+        if (ChainEdge->Gain > 0.0) {
+          Queue.insert(ChainEdge);
+        }
+      }
+    }
+  }
+
+  /// Append chain From to chain Into and update the list of active chains.
+  void mergeChains(Chain *Into, Chain *From) {
+    assert(Into != From && "cannot merge a chain with itself");
+    for (auto F : From->Nodes) {
+      NodeChain[F] = Into;
+      Addr[F] += Into->Size;
+    }
+    Into->Nodes.insert(Into->Nodes.end(), From->Nodes.begin(),
+                       From->Nodes.end());
+    Into->Samples += From->Samples;
+    Into->Size += From->Size;
+
+    // Arcs between the two chains become internal to the merged chain
+    Into->removeEdge(From);
+    for (auto EdgeIt : From->Edges) {
+      auto Other = EdgeIt.first;
+      auto FromEdge = EdgeIt.second;
+      if (Other == Into)
+        continue;
+      Other->removeEdge(From);
+      if (auto CurEdge = Into->getEdge(Other)) {
+        CurEdge->moveArcs(FromEdge);
+      } else {
+        Into->addEdge(Other, FromEdge);
+        Other->addEdge(Into, FromEdge);
+      }
+    }
+    From->Nodes.clear();
+    From->Edges.clear();
+
+    auto It = std::remove(HotChains.begin(), HotChains.end(), From);
+    HotChains.erase(It, HotChains.end());
+  }
+
+private:
+  // The call graph
+  const CallGraph &Cg;
+
+  // All chains of functions
+  std::vector<Chain> AllChains;
+
+  // Active chains. The vector gets updated at runtime when chains are merged
+  std::vector<Chain *> HotChains;
+
+  // All edges between chains
+  std::vector<Edge> AllEdges;
+
+  // Node_id => chain
+  std::vector<Chain *> NodeChain;
+
+  // Current address of the function from the beginning of its chain
+  std::vector<uint64_t> Addr;
+};
+
+} // end anonymous namespace
+
+std::vector<Cluster> cdsort(const CallGraph &Cg) {
+  return CDSort(Cg).run();
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -137,6 +137,12 @@ public:
     return Nodes[Id].Preds;
   }
   NodeId addNode(uint32_t Size, uint64_t Samples = 0);
+  /// Reserve space for \p NumNodes nodes and \p NumArcs arcs before adding
+  /// them in bulk.
+  void reserve(size_t NumNodes, size_t NumArcs) {
+    Nodes.reserve(NumNodes);
+    Arcs.reserve(NumArcs);
+  }
   const Arc &incArcWeight(NodeId Src, NodeId Dst, double W = 1.0,
                           double Offset = 0.0);
   ArcIterator findArc(NodeId Src, NodeId Dst) {
@@ -1,14 +1,25 @@
 #include "CallGraphWalker.h"
+#include "ParallelUtilities.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Timer.h"
 
 namespace opts {
+extern llvm::cl::opt<bool> NoThreads;
 extern llvm::cl::opt<bool> TimeOpts;
 }
 
 namespace llvm {
 namespace bolt {
 
+bool CallGraphWalker::visit(BinaryFunction *Func) {
+  bool Changed{false};
+  for (auto &Visitor : Visitors) {
+    bool CurVisit = Visitor(Func);
+    Changed = Changed || CurVisit;
+  }
+  return Changed;
+}
+
 void CallGraphWalker::traverseCG() {
   NamedRegionTimer T1("CG Traversal", "CG Traversal", "CG breakdown",
                       "CG breakdown", opts::TimeOpts);
@@ -25,13 +36,7 @@ void CallGraphWalker::traverseCG() {
     Queue.pop();
     InQueue.erase(Func);
 
-    bool Changed{false};
-    for (auto Visitor : Visitors) {
-      bool CurVisit = Visitor(Func);
-      Changed = Changed || CurVisit;
-    }
-
-    if (Changed) {
+    if (visit(Func)) {
       for (auto CallerID : CG.predecessors(CG.getNodeId(Func))) {
         BinaryFunction *CallerFunc = CG.nodeIdToFunc(CallerID);
         if (InQueue.count(CallerFunc))
@@ -43,7 +48,131 @@ void CallGraphWalker::traverseCG() {
   }
 }
 
+void CallGraphWalker::computeSCCLevels() {
+  using NodeId = BinaryFunctionCallGraph::NodeId;
+  const auto NumNodes = CG.numNodes();
+
+  // Iterative Tarjan's algorithm. SCCs are completed in the bottom-up order,
+  // so the levels of all callees are known when an SCC is popped.
+  std::vector<unsigned> Index(NumNodes, 0);
+  std::vector<unsigned> LowLink(NumNodes, 0);
+  std::vector<bool> OnStack(NumNodes, false);
+  std::vector<NodeId> Stack;
+  std::vector<std::pair<NodeId, size_t>> DFS;
+  std::vector<unsigned> SCCLevel;
+  unsigned NextIndex = 1;
+
+  SCCOf.assign(NumNodes, 0);
+  SCCLevels.clear();
+
+  auto push = [&](NodeId Node) {
+    Index[Node] = LowLink[Node] = NextIndex++;
+    Stack.push_back(Node);
+    OnStack[Node] = true;
+    DFS.emplace_back(Node, 0);
+  };
+
+  for (NodeId Root = 0; Root < NumNodes; ++Root) {
+    if (Index[Root])
+      continue;
+    push(Root);
+    while (!DFS.empty()) {
+      const auto Node = DFS.back().first;
+      const auto &Succs = CG.successors(Node);
+      if (DFS.back().second < Succs.size()) {
+        const auto Succ = Succs[DFS.back().second++];
+        if (!Index[Succ])
+          push(Succ);
+        else if (OnStack[Succ])
+          LowLink[Node] = std::min(LowLink[Node], Index[Succ]);
+        continue;
+      }
+
+      DFS.pop_back();
+      if (!DFS.empty()) {
+        auto &Parent = LowLink[DFS.back().first];
+        Parent = std::min(Parent, LowLink[Node]);
+      }
+      if (LowLink[Node] != Index[Node])
+        continue;
+
+      const unsigned SCC = SCCLevel.size();
+      std::vector<BinaryFunction *> Members;
+      NodeId Member;
+      do {
+        Member = Stack.back();
+        Stack.pop_back();
+        OnStack[Member] = false;
+        SCCOf[Member] = SCC;
+        Members.push_back(CG.nodeIdToFunc(Member));
+      } while (Member != Node);
+
+      unsigned Level = 0;
+      for (auto *Func : Members) {
+        for (auto Succ : CG.successors(CG.getNodeId(Func))) {
+          if (SCCOf[Succ] != SCC)
+            Level = std::max(Level, SCCLevel[SCCOf[Succ]] + 1);
+        }
+      }
+      SCCLevel.push_back(Level);
+      if (SCCLevels.size() <= Level)
+        SCCLevels.resize(Level + 1);
+      SCCLevels[Level].emplace_back(std::move(Members));
+    }
+  }
+}
+
+void CallGraphWalker::traverseSCC(const std::vector<BinaryFunction *> &SCC) {
+  std::queue<BinaryFunction *> Queue;
+  std::set<BinaryFunction *> InQueue;
+  for (auto *Func : SCC) {
+    Queue.push(Func);
+    InQueue.insert(Func);
+  }
+
+  // Callees outside of the SCC have converged already, so only callers from
+  // the same SCC have to be revisited.
+  while (!Queue.empty()) {
+    auto *Func = Queue.front();
+    Queue.pop();
+    InQueue.erase(Func);
+
+    if (!visit(Func))
+      continue;
+
+    const auto NodeId = CG.getNodeId(Func);
+    for (auto CallerID : CG.predecessors(NodeId)) {
+      if (SCCOf[CallerID] != SCCOf[NodeId])
+        continue;
+      BinaryFunction *CallerFunc = CG.nodeIdToFunc(CallerID);
+      if (InQueue.insert(CallerFunc).second)
+        Queue.push(CallerFunc);
+    }
+  }
+}
+
+void CallGraphWalker::traverseSCCLevels() {
+  NamedRegionTimer T1("CG Traversal", "CG Traversal", "CG breakdown",
+                      "CG breakdown", opts::TimeOpts);
+  computeSCCLevels();
+
+  ThreadPool &Pool = ParallelUtilities::getThreadPool();
+  for (const auto &Level : SCCLevels) {
+    if (Level.size() == 1) {
+      traverseSCC(Level.front());
+      continue;
+    }
+    for (const auto &SCC : Level)
+      Pool.async([&] { traverseSCC(SCC); });
+    Pool.wait();
+  }
+}
+
 void CallGraphWalker::walk() {
+  if (ThreadSafeVisitors && !opts::NoThreads) {
+    traverseSCCLevels();
+    return;
+  }
   TopologicalCGOrder = CG.buildTraversalOrder();
   traverseCG();
 }
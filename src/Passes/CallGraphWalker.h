@@ -26,9 +26,23 @@ namespace bolt {
 /// Perform a bottom-up walk of the call graph with the intent of computing
 /// a property that depends on callees. In the event of a CG cycles, this will
 /// re-visit functions until their observed property converges.
+///
+/// If the visitors are thread-safe, strongly connected components of the call
+/// graph are grouped into levels, such that all callees of an SCC belong to
+/// the SCC itself or to lower levels, and SCCs of the same level are walked
+/// in parallel.
 class CallGraphWalker {
   BinaryFunctionCallGraph &CG;
 
+  /// True if visitors could be called concurrently for functions from
+  /// different SCCs.
+  bool ThreadSafeVisitors;
+
+  /// SCCs of the call graph grouped by levels, and the SCC index of each call
+  /// graph node.
+  std::vector<std::vector<std::vector<BinaryFunction *>>> SCCLevels;
+  std::vector<unsigned> SCCOf;
+
   /// DFS or reverse post-ordering of the call graph nodes to allow us to
   /// traverse the call graph bottom-up
   std::deque<BinaryFunction *> TopologicalCGOrder;
@@ -37,12 +51,28 @@ class CallGraphWalker {
   typedef std::function<bool(BinaryFunction*)> CallbackTy;
   std::vector<CallbackTy> Visitors;
 
+  /// Call all visitors for \p Func and return true if any of them reported
+  /// a change.
+  bool visit(BinaryFunction *Func);
+
   /// Do the bottom-up traversal
   void traverseCG();
 
+  /// Populate SCCLevels and SCCOf.
+  void computeSCCLevels();
+
+  /// Visit functions of a single \p SCC until they converge.
+  void traverseSCC(const std::vector<BinaryFunction *> &SCC);
+
+  /// Do the bottom-up traversal one level of SCCs at a time.
+  void traverseSCCLevels();
+
 public:
-  /// Initialize core context references but don't do anything yet
-  CallGraphWalker(BinaryFunctionCallGraph &CG) : CG(CG) {}
+  /// Initialize core context references but don't do anything yet. Set
+  /// \p ThreadSafeVisitors if registered visitors only update the information
+  /// of the visited function and could run concurrently.
+  CallGraphWalker(BinaryFunctionCallGraph &CG, bool ThreadSafeVisitors = false)
+    : CG(CG), ThreadSafeVisitors(ThreadSafeVisitors) {}
 
   /// Register a new callback function to be called for each function when
   /// traversing the call graph bottom-up. Function should return true iff
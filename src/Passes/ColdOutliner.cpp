@@ -0,0 +1,308 @@
+//===--- Passes/ColdOutliner.cpp - Outlining of cold code sequences -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "ColdOutliner.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/Support/Options.h"
+#include <numeric>
+
+#define DEBUG_TYPE "cold-outliner"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<unsigned>
+OutlineColdMinLength("outline-cold-min-length",
+  cl::desc("minimum number of instructions in an outlined cold sequence"),
+  cl::init(2),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+OutlineColdMaxLength("outline-cold-max-length",
+  cl::desc("maximum number of instructions in an outlined cold sequence"),
+  cl::init(16),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+
+namespace {
+
+/// Size of the call replacing each outlined sequence.
+constexpr uint64_t CallSize = 5;
+
+/// Size of the return terminating each stub.
+constexpr uint64_t ReturnSize = 1;
+
+/// Instruction properties of a cold block used for matching.
+struct ColdBlockInfo {
+  BinaryBasicBlock *BB;
+  std::vector<size_t> Hashes;
+  std::vector<uint64_t> Sizes;
+  std::vector<bool> Outlinable;
+};
+
+/// Start of a candidate sequence.
+struct Site {
+  unsigned Block;
+  unsigned Start;
+};
+
+/// Sequence to be moved into a stub and the sites it is called from.
+struct OutlinedSequence {
+  std::vector<MCInst> Body;
+  std::vector<Site> Sites;
+};
+
+/// Hash \p Inst ignoring symbolic operands, which are compared separately.
+size_t hashInstruction(const MCInst &Inst) {
+  size_t Hash = Inst.getOpcode();
+  for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E; ++I) {
+    const auto &Operand = Inst.getOperand(I);
+    if (Operand.isReg())
+      Hash = hash_combine(Hash, 1, Operand.getReg());
+    else if (Operand.isImm())
+      Hash = hash_combine(Hash, 2, Operand.getImm());
+    else
+      Hash = hash_combine(Hash, 3);
+  }
+  return Hash;
+}
+
+/// Return true if \p Inst may execute from a stub called by its function.
+bool isOutlinable(const BinaryContext &BC, const BinaryFunction &BF,
+                  const MCInst &Inst, const BitVector &SPAliases) {
+  const auto &MIB = *BC.MIB;
+  if (MIB.isPseudo(Inst) || MIB.isCFI(Inst) || MIB.isPrefix(Inst) ||
+      MIB.isBranch(Inst) || MIB.isCall(Inst) || MIB.isReturn(Inst) ||
+      MIB.isTerminator(Inst) || MIB.isInvoke(Inst))
+    return false;
+
+  // The stub call moves the stack pointer.
+  for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E; ++I) {
+    const auto &Operand = Inst.getOperand(I);
+    if (Operand.isReg() && SPAliases[Operand.getReg()])
+      return false;
+    // References to local labels only resolve inside the function.
+    if (Operand.isExpr()) {
+      const auto *Symbol = MIB.getTargetSymbol(Operand.getExpr());
+      if (Symbol && BF.getBasicBlockForLabel(Symbol))
+        return false;
+    }
+  }
+  const auto &Desc = BC.MII->get(Inst.getOpcode());
+  for (unsigned I = 0, E = Desc.getNumImplicitUses(); I != E; ++I)
+    if (SPAliases[Desc.getImplicitUses()[I]])
+      return false;
+  for (unsigned I = 0, E = Desc.getNumImplicitDefs(); I != E; ++I)
+    if (SPAliases[Desc.getImplicitDefs()[I]])
+      return false;
+
+  return true;
+}
+
+} // anonymous namespace
+
+bool ColdOutliner::canOutlineFrom(const BinaryFunction &BF) const {
+  if (!BF.isSimple() || !BF.isSplit() || !shouldOptimize(BF))
+    return false;
+
+  // Leaf functions may keep data in the red zone below the stack pointer.
+  const auto &MIB = *BF.getBinaryContext().MIB;
+  for (const auto &BB : BF) {
+    for (const auto &Inst : BB) {
+      if (MIB.isCall(Inst) && !MIB.isTailCall(Inst))
+        return true;
+    }
+  }
+  return false;
+}
+
+void ColdOutliner::runOnFunctions(BinaryContext &BC) {
+  // Stubs are new functions and need a relocated output text.
+  if (!BC.isX86() || !BC.HasRelocations)
+    return;
+
+  const auto &SPAliases = BC.MIB->getAliases(BC.MIB->getStackPointer());
+  std::vector<ColdBlockInfo> Blocks;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &BF = BFI.second;
+    if (!canOutlineFrom(BF))
+      continue;
+
+    for (auto *BB : BF.layout()) {
+      if (!BB->isCold())
+        continue;
+
+      ColdBlockInfo Info;
+      Info.BB = BB;
+      for (const auto &Inst : *BB) {
+        Info.Hashes.push_back(hashInstruction(Inst));
+        Info.Sizes.push_back(BC.computeInstructionSize(Inst));
+        Info.Outlinable.push_back(isOutlinable(BC, BF, Inst, SPAliases));
+      }
+      Blocks.emplace_back(std::move(Info));
+    }
+  }
+
+  auto isSameSequence = [&](const Site &A, const Site &B, unsigned Length) {
+    auto IA = Blocks[A.Block].BB->begin() + A.Start;
+    auto IB = Blocks[B.Block].BB->begin() + B.Start;
+    for (unsigned I = 0; I < Length; ++I, ++IA, ++IB) {
+      if (!BC.MIB->equals(*IA, *IB,
+                          [](const MCSymbol *A, const MCSymbol *B) {
+                            return A == B;
+                          }))
+        return false;
+    }
+    return true;
+  };
+
+  // Claim the most profitable sequences, longest first, so that shorter
+  // sequences only fill in what remains.
+  std::vector<OutlinedSequence> Sequences;
+  for (unsigned Length = opts::OutlineColdMaxLength;
+       Length >= std::max(opts::OutlineColdMinLength.getValue(), 1u);
+       --Length) {
+    MapVector<size_t, std::vector<Site>> Buckets;
+    for (unsigned B = 0; B < Blocks.size(); ++B) {
+      const auto &Info = Blocks[B];
+      unsigned Run = 0;
+      for (unsigned I = 0; I < Info.Outlinable.size(); ++I) {
+        Run = Info.Outlinable[I] ? Run + 1 : 0;
+        if (Run < Length)
+          continue;
+        const auto Start = I + 1 - Length;
+        size_t Hash = 0;
+        for (unsigned J = Start; J <= I; ++J)
+          Hash = hash_combine(Hash, Info.Hashes[J]);
+        Buckets[Hash].push_back(Site{B, Start});
+      }
+    }
+
+    for (auto &Bucket : Buckets) {
+      auto &Candidates = Bucket.second;
+      while (Candidates.size() > 1) {
+        const auto Leader = Candidates.front();
+        std::vector<Site> Same;
+        std::vector<Site> Rest;
+        unsigned LastBlock = Blocks.size();
+        unsigned LastEnd = 0;
+        for (const auto &Candidate : Candidates) {
+          if (!isSameSequence(Leader, Candidate, Length)) {
+            Rest.push_back(Candidate);
+            continue;
+          }
+          // Skip sequences overlapping the previous matching one.
+          if (Candidate.Block == LastBlock && Candidate.Start < LastEnd)
+            continue;
+          const auto &Outlinable = Blocks[Candidate.Block].Outlinable;
+          if (!std::all_of(Outlinable.begin() + Candidate.Start,
+                           Outlinable.begin() + Candidate.Start + Length,
+                           [](bool B) { return B; }))
+            continue;
+          Same.push_back(Candidate);
+          LastBlock = Candidate.Block;
+          LastEnd = Candidate.Start + Length;
+        }
+        Candidates = std::move(Rest);
+
+        const auto &LeaderSizes = Blocks[Leader.Block].Sizes;
+        const auto Size =
+            std::accumulate(LeaderSizes.begin() + Leader.Start,
+                            LeaderSizes.begin() + Leader.Start + Length,
+                            uint64_t(0));
+        if (Same.size() < 2 || Size <= CallSize ||
+            Same.size() * (Size - CallSize) <= Size + ReturnSize)
+          continue;
+
+        OutlinedSequence Sequence;
+        auto First = Blocks[Leader.Block].BB->begin() + Leader.Start;
+        Sequence.Body.assign(First, First + Length);
+        for (const auto &S : Same) {
+          auto &Outlinable = Blocks[S.Block].Outlinable;
+          std::fill(Outlinable.begin() + S.Start,
+                    Outlinable.begin() + S.Start + Length, false);
+        }
+        Sequence.Sites = std::move(Same);
+        BytesSaved += Sequence.Sites.size() * (Size - CallSize) -
+                      (Size + ReturnSize);
+        Sequences.emplace_back(std::move(Sequence));
+      }
+    }
+  }
+
+  // Replace the sites from the end of each block so that the starts of the
+  // remaining sites stay valid.
+  struct Replacement {
+    unsigned Start;
+    unsigned Length;
+    const MCSymbol *Stub;
+  };
+  std::vector<std::vector<Replacement>> Replacements(Blocks.size());
+  for (auto &Sequence : Sequences) {
+    auto *Stub = BC.createInjectedBinaryFunction(
+        "__bolt_cold_outlined_" + std::to_string(NumStubs++));
+    std::vector<std::unique_ptr<BinaryBasicBlock>> BBs;
+    BBs.emplace_back(
+        Stub->createBasicBlock(BinaryBasicBlock::INVALID_OFFSET, nullptr));
+    BBs.back()->addInstructions(Sequence.Body.begin(), Sequence.Body.end());
+    MCInst Return;
+    BC.MIB->createReturn(Return);
+    BBs.back()->addInstruction(Return);
+    BBs.back()->setCFIState(0);
+    Stub->insertBasicBlocks(nullptr, std::move(BBs),
+                            /*UpdateLayout=*/true,
+                            /*UpdateCFIState=*/false);
+    Stub->updateState(BinaryFunction::State::CFG_Finalized);
+
+    const unsigned Length = Sequence.Body.size();
+    for (const auto &S : Sequence.Sites)
+      Replacements[S.Block].push_back({S.Start, Length, Stub->getSymbol()});
+  }
+
+  for (unsigned B = 0; B < Blocks.size(); ++B) {
+    auto &BlockReplacements = Replacements[B];
+    if (BlockReplacements.empty())
+      continue;
+    std::sort(BlockReplacements.begin(), BlockReplacements.end(),
+              [](const Replacement &A, const Replacement &B) {
+                return A.Start > B.Start;
+              });
+    auto *BB = Blocks[B].BB;
+    for (const auto &R : BlockReplacements) {
+      std::vector<MCInst> Call(1);
+      BC.MIB->createDirectCall(Call[0], R.Stub, BC.Ctx.get());
+      for (unsigned I = 1; I < R.Length; ++I)
+        BB->eraseInstruction(BB->begin() + R.Start + 1);
+      BB->replaceInstruction(BB->begin() + R.Start, Call);
+      ++NumSitesOutlined;
+    }
+    Modified.insert(BB->getFunction());
+  }
+
+  outs() << "BOLT-INFO: cold outliner created " << NumStubs
+         << " stubs called from " << NumSitesOutlined
+         << " sites, saving " << BytesSaved << " bytes of cold code\n";
+}
+
+} // namespace bolt
+} // namespace llvm
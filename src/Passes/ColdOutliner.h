@@ -0,0 +1,60 @@
+//===--- Passes/ColdOutliner.h - Outlining of cold code sequences ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_COLD_OUTLINER_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_COLD_OUTLINER_H
+
+#include "BinaryPasses.h"
+
+namespace llvm {
+namespace bolt {
+
+/// Shrink the cold fragments of split functions by replacing instruction
+/// sequences repeated across cold blocks with calls to shared stubs:
+///
+///    movq    %rbx, %rdi                 callq   __bolt_cold_outlined_0
+///    movl    $0x1, %esi         =>      ...
+///    xorl    %edx, %edx                 callq   __bolt_cold_outlined_0
+///    ...
+///    movq    %rbx, %rdi
+///    movl    $0x1, %esi
+///    xorl    %edx, %edx
+///
+/// Only straight-line code that does not reference the stack pointer is
+/// outlined, and only from functions that make calls, since the return
+/// address pushed by the stub call would overwrite the red zone of a leaf
+/// function. Hot code is never touched.
+class ColdOutliner : public BinaryFunctionPass {
+  uint64_t NumStubs{0};
+  uint64_t NumSitesOutlined{0};
+  uint64_t BytesSaved{0};
+  DenseSet<const BinaryFunction *> Modified;
+
+  /// Return true if the cold blocks of \p BF may call outlined code.
+  bool canOutlineFrom(const BinaryFunction &BF) const;
+
+public:
+  explicit ColdOutliner(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "cold-outliner";
+  }
+  bool shouldPrint(const BinaryFunction &BF) const override {
+    return BinaryFunctionPass::shouldPrint(BF) && Modified.count(&BF) > 0;
+  }
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
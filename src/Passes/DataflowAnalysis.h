@@ -14,9 +14,12 @@
 
 #include "BinaryContext.h"
 #include "BinaryFunction.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/Timer.h"
+#include <functional>
 #include <queue>
+#include <unordered_set>
 
 namespace llvm {
 namespace bolt {
@@ -179,6 +182,11 @@ protected:
   /// Tracks the state at basic block start (end) if direction of the dataflow
   /// is forward (backward).
   std::unordered_map<const BinaryBasicBlock *, StateTy> StateAtBBEntry;
+  /// Arena holding the states of the instructions of the function. The
+  /// annotations only point to their state, so all states are destroyed at
+  /// once with the analysis instead of being kept alive by the annotation
+  /// allocator.
+  SpecificBumpPtrAllocator<StateTy> StateAllocator;
   /// Map a point to its previous (succeeding) point if the direction of the
   /// dataflow is forward (backward). This is used to support convenience
   /// methods to access the resulting state before (after) a given instruction,
@@ -190,6 +198,11 @@ protected:
     llvm_unreachable("Unimplemented method");
   }
 
+  /// Perform any bookkeeping before the dataflow is updated after an edit of
+  /// \p Changed blocks, e.g. track new instructions. By default, the tracked
+  /// domain does not depend on the instructions of the function.
+  void preflightUpdate(ArrayRef<BinaryBasicBlock *> Changed) {}
+
   /// Sets initial state for each BB
   StateTy getStartingStateAtBB(const BinaryBasicBlock &BB) {
     llvm_unreachable("Unimplemented method");
@@ -247,8 +260,14 @@ protected:
   }
 
   StateTy &getOrCreateStateAt(MCInst &Point) {
-    return BC.MIB->getOrCreateAnnotationAs<StateTy>(
-        Point, derived().getAnnotationIndex(), AllocatorId);
+    auto State = BC.MIB->tryGetAnnotationAs<StateTy *>(
+        Point, derived().getAnnotationIndex());
+    if (State)
+      return **State;
+    auto *NewState = new (StateAllocator.Allocate()) StateTy();
+    BC.MIB->addAnnotation(Point, derived().getAnnotationIndex(), NewState,
+                          AllocatorId);
+    return *NewState;
   }
 
   StateTy &getOrCreateStateAt(ProgramPoint Point) {
@@ -296,8 +315,11 @@ public:
   /// Track the state at the end (start) of each MCInst in this function if
   /// the direction of the dataflow is forward (backward).
   ErrorOr<const StateTy &> getStateAt(const MCInst &Point) const {
-    return BC.MIB->tryGetAnnotationAs<StateTy>(
+    auto State = BC.MIB->tryGetAnnotationAs<StateTy *>(
         Point, const_derived().getAnnotationIndex());
+    if (!State)
+      return make_error_code(errc::result_out_of_range);
+    return **State;
   }
 
   /// Return the out set (in set) of a given program point if the direction of
@@ -330,49 +352,128 @@ public:
     }
   }
 
-  /// Public entry point that will perform the entire analysis form start to
-  /// end.
-  void run() {
-    derived().preflight();
-
-    // Initialize state for all points of the function
-    for (auto &BB : Func) {
-      auto &St = getOrCreateStateAt(BB);
-      St = derived().getStartingStateAtBB(BB);
-      for (auto &Inst : BB) {
-        auto &St = getOrCreateStateAt(Inst);
-        St = derived().getStartingStateAtPoint(Inst);
+protected:
+  /// Solve the dataflow equations. If \p Seeds is not null, only blocks in
+  /// it are visited initially, and the states of all other blocks must be
+  /// final and independent of the seeds.
+  void solve(const std::unordered_set<const BinaryBasicBlock *> *Seeds) {
+    // Visit blocks in reverse post-order for forward problems, and in post
+    // order for backward ones, so that most blocks see the final state of
+    // their predecessors (successors) on the first visit. The worklist is a
+    // priority queue over positions in that order, holding each block once.
+    std::vector<BinaryBasicBlock *> Order;
+    DenseMap<const BinaryBasicBlock *, unsigned> OrderIndex;
+    {
+      std::vector<BinaryBasicBlock *> PostOrder;
+      std::unordered_set<const BinaryBasicBlock *> Visited;
+      std::vector<std::pair<BinaryBasicBlock *, unsigned>> Stack;
+      auto visit = [&](BinaryBasicBlock *BB) {
+        if (Visited.insert(BB).second)
+          Stack.emplace_back(BB, 0);
+        while (!Stack.empty()) {
+          auto *Cur = Stack.back().first;
+          auto Next = Stack.back().second++;
+          BinaryBasicBlock *Succ = nullptr;
+          if (Next < Cur->succ_size())
+            Succ = *(Cur->succ_begin() + Next);
+          else if (Next < Cur->succ_size() + Cur->lp_size())
+            Succ = *(Cur->lp_begin() + (Next - Cur->succ_size()));
+          else {
+            PostOrder.push_back(Cur);
+            Stack.pop_back();
+            continue;
+          }
+          if (Visited.insert(Succ).second)
+            Stack.emplace_back(Succ, 0);
+        }
+      };
+      for (auto &BB : Func) {
+        if (BB.isEntryPoint())
+          visit(&BB);
       }
+      for (auto &BB : Func)
+        visit(&BB);
+
+      if (!Backward)
+        Order.assign(PostOrder.rbegin(), PostOrder.rend());
+      else
+        Order = std::move(PostOrder);
+      for (unsigned I = 0; I < Order.size(); ++I)
+        OrderIndex[Order[I]] = I;
     }
-    assert(Func.begin() != Func.end() && "Unexpected empty function");
 
-    std::queue<BinaryBasicBlock *> Worklist;
-    // TODO: Pushing this in a DFS ordering will greatly speed up the dataflow
-    // performance.
-    if (!Backward) {
-      for (auto &BB : Func) {
-        Worklist.push(&BB);
-        MCInst *Prev = nullptr;
+    std::priority_queue<unsigned, std::vector<unsigned>,
+                        std::greater<unsigned>> Worklist;
+    std::vector<bool> InWorklist(Order.size(), false);
+    for (unsigned I = 0; I < Order.size(); ++I) {
+      if (Seeds && !Seeds->count(Order[I]))
+        continue;
+      InWorklist[I] = true;
+      Worklist.push(I);
+    }
+    auto addToWorklist = [&](const BinaryBasicBlock *BB) {
+      const auto Index = OrderIndex[BB];
+      if (InWorklist[Index])
+        return;
+      InWorklist[Index] = true;
+      Worklist.push(Index);
+    };
+
+    // Propagate the state at the start of BB through its instructions. Until
+    // the fixed point is reached, only the states read by the confluence of
+    // other blocks are stored: the last instruction and invokes. All other
+    // instruction states are stored once by the final sweep.
+    auto propagate = [&](BinaryBasicBlock &BB, bool StoreAll) {
+      bool Changed = false;
+      const MCInst *LAST = nullptr;
+      if (!BB.empty())
+        LAST = !Backward ? &*BB.rbegin() : &*BB.begin();
+      StateTy CurState = getOrCreateStateAt(BB);
+
+      auto doNext = [&] (MCInst &Inst) {
+        CurState = derived().computeNext(Inst, CurState);
+
+        const bool IsInvoke = BC.MIB->isInvoke(Inst);
+        if (Backward && IsInvoke) {
+          auto *LBB = Func.getLandingPadBBFor(BB, Inst);
+          if (LBB) {
+            auto First = LBB->begin();
+            if (First != LBB->end()) {
+              derived().doConfluenceWithLP(CurState,
+                                           getOrCreateStateAt(&*First), Inst);
+            } else {
+              derived().doConfluenceWithLP(CurState, getOrCreateStateAt(LBB),
+                                           Inst);
+            }
+          }
+        }
+
+        if (!StoreAll && !IsInvoke && &Inst != LAST)
+          return;
+        StateTy &St = getOrCreateStateAt(Inst);
+        if (St != CurState) {
+          St = CurState;
+          if (&Inst == LAST)
+            Changed = true;
+        }
+      };
+
+      if (!Backward) {
         for (auto &Inst : BB) {
-          PrevPoint[&Inst] = Prev ? ProgramPoint(Prev) : ProgramPoint(&BB);
-          Prev = &Inst;
+          doNext(Inst);
         }
-      }
-    } else {
-      for (auto I = Func.rbegin(), E = Func.rend(); I != E; ++I) {
-        Worklist.push(&*I);
-        MCInst *Prev = nullptr;
-        for (auto J = (*I).rbegin(), E2 = (*I).rend(); J != E2; ++J) {
-          auto &Inst = *J;
-          PrevPoint[&Inst] = Prev ? ProgramPoint(Prev) : ProgramPoint(&*I);
-          Prev = &Inst;
+      } else {
+        for (auto I = BB.rbegin(), E = BB.rend(); I != E; ++I) {
+          doNext(*I);
         }
       }
-    }
+      return Changed;
+    };
 
     // Main dataflow loop
     while (!Worklist.empty()) {
-      auto *BB = Worklist.front();
+      auto *BB = Order[Worklist.top()];
+      InWorklist[Worklist.top()] = false;
       Worklist.pop();
 
       // Calculate state at the entry of first instruction in BB
@@ -398,68 +499,106 @@ public:
         St = std::move(StateAtEntry);
       }
 
-      // Propagate information from first instruction down to the last one
-      StateTy *PrevState = &St;
-      const MCInst *LAST = nullptr;
-      if (!Backward)
-        LAST = &*BB->rbegin();
-      else
-        LAST = &*BB->begin();
-
-      auto doNext = [&] (MCInst &Inst, const BinaryBasicBlock &BB) {
-        StateTy CurState = derived().computeNext(Inst, *PrevState);
-
-        if (Backward && BC.MIB->isInvoke(Inst)) {
-          auto *LBB = Func.getLandingPadBBFor(BB, Inst);
-          if (LBB) {
-            auto First = LBB->begin();
-            if (First != LBB->end()) {
-              derived().doConfluenceWithLP(CurState,
-                                           getOrCreateStateAt(&*First), Inst);
-            } else {
-              derived().doConfluenceWithLP(CurState, getOrCreateStateAt(LBB),
-                                           Inst);
-            }
-          }
-        }
-
-        StateTy &St = getOrCreateStateAt(Inst);
-        if (St != CurState) {
-          St = CurState;
-          if (&Inst == LAST)
-            Changed = true;
-        }
-        PrevState = &St;
-      };
-
-      if (!Backward) {
-        for (auto &Inst : *BB) {
-          doNext(Inst, *BB);
-        }
-      } else {
-        for (auto I = BB->rbegin(), E = BB->rend(); I != E; ++I) {
-          doNext(*I, *BB);
-        }
-      }
+      Changed |= propagate(*BB, /*StoreAll=*/false);
 
       if (Changed) {
         if (!Backward) {
           for (auto Succ : BB->successors()) {
-            Worklist.push(Succ);
+            addToWorklist(Succ);
           }
           for (auto LandingPad : BB->landing_pads()) {
-            Worklist.push(LandingPad);
+            addToWorklist(LandingPad);
           }
         } else {
           for (auto Pred : BB->predecessors()) {
-            Worklist.push(Pred);
+            addToWorklist(Pred);
           }
           for (auto Thrower : BB->throwers()) {
-            Worklist.push(Thrower);
+            addToWorklist(Thrower);
           }
         }
       }
     } // end while (!Worklist.empty())
+
+    for (auto &BB : Func) {
+      if (!Seeds || Seeds->count(&BB))
+        propagate(BB, /*StoreAll=*/true);
+    }
+  }
+
+  /// Record the previous (succeeding) point of every instruction in \p BB.
+  void computePrevPoints(BinaryBasicBlock &BB) {
+    MCInst *Prev = nullptr;
+    auto record = [&](MCInst &Inst) {
+      PrevPoint[&Inst] = Prev ? ProgramPoint(Prev) : ProgramPoint(&BB);
+      Prev = &Inst;
+    };
+    if (!Backward) {
+      for (auto &Inst : BB)
+        record(Inst);
+    } else {
+      for (auto I = BB.rbegin(), E = BB.rend(); I != E; ++I)
+        record(*I);
+    }
+  }
+
+  /// Reset the states of \p BB and its instructions to the starting ones.
+  void resetStates(BinaryBasicBlock &BB) {
+    getOrCreateStateAt(BB) = derived().getStartingStateAtBB(BB);
+    for (auto &Inst : BB)
+      getOrCreateStateAt(Inst) = derived().getStartingStateAtPoint(Inst);
+  }
+
+public:
+  /// Public entry point that will perform the entire analysis form start to
+  /// end.
+  void run() {
+    derived().preflight();
+
+    // Initialize state for all points of the function
+    for (auto &BB : Func)
+      resetStates(BB);
+    assert(Func.begin() != Func.end() && "Unexpected empty function");
+
+    for (auto &BB : Func)
+      computePrevPoints(BB);
+
+    solve(/*Seeds=*/nullptr);
+  }
+
+  /// Update the result of a completed run() after an edit of the function
+  /// that changed the instructions of \p Changed blocks, added them, or
+  /// changed their predecessors (successors) if the direction of the dataflow
+  /// is forward (backward). Only the changed blocks and the blocks reachable
+  /// from them in the direction of the dataflow are solved again, since the
+  /// states of all other blocks do not depend on the edit.
+  void update(ArrayRef<BinaryBasicBlock *> Changed) {
+    derived().preflightUpdate(Changed);
+
+    std::unordered_set<const BinaryBasicBlock *> Affected;
+    std::vector<BinaryBasicBlock *> Stack(Changed.begin(), Changed.end());
+    while (!Stack.empty()) {
+      auto *BB = Stack.back();
+      Stack.pop_back();
+      if (!Affected.insert(BB).second)
+        continue;
+      if (!Backward) {
+        Stack.insert(Stack.end(), BB->succ_begin(), BB->succ_end());
+        Stack.insert(Stack.end(), BB->lp_begin(), BB->lp_end());
+      } else {
+        Stack.insert(Stack.end(), BB->pred_begin(), BB->pred_end());
+        Stack.insert(Stack.end(), BB->throw_begin(), BB->throw_end());
+      }
+    }
+
+    for (auto &BB : Func) {
+      if (Affected.count(&BB))
+        resetStates(BB);
+    }
+    for (auto *BB : Changed)
+      computePrevPoints(*BB);
+
+    solve(&Affected);
   }
 };
 
@@ -157,6 +157,24 @@ void DataflowInfoManager::invalidateInsnToBBMap() {
   InsnToBB.reset(nullptr);
 }
 
+void DataflowInfoManager::updateAfterInsertion(
+    ArrayRef<BinaryBasicBlock *> Changed) {
+  auto DomAnalysis = std::move(DA);
+  auto PostDomAnalysis = std::move(PDA);
+  auto Liveness = std::move(LA);
+  invalidateAll();
+
+  DA = std::move(DomAnalysis);
+  PDA = std::move(PostDomAnalysis);
+  LA = std::move(Liveness);
+  if (DA)
+    DA->update(Changed);
+  if (PDA)
+    PDA->update(Changed);
+  if (LA)
+    LA->update(Changed);
+}
+
 void DataflowInfoManager::invalidateAll() {
   invalidateReachingDefs();
   invalidateReachingUses();
@@ -86,6 +86,12 @@ public:
   std::unordered_map<const MCInst *, BinaryBasicBlock *> &getInsnToBBMap();
   void invalidateInsnToBBMap();
   void invalidateAll();
+
+  /// Update dominators, post-dominators and liveness in place after new
+  /// instructions were inserted into \p Changed blocks without changing the
+  /// CFG, so that only the affected blocks are solved again. All other
+  /// analyses are invalidated.
+  void updateAfterInsertion(ArrayRef<BinaryBasicBlock *> Changed);
 };
 
 } // end namespace bolt
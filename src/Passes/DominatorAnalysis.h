@@ -109,17 +109,59 @@ public:
   }
 
 private:
+  /// Indices of the instructions of each block in the Expressions vector
+  std::unordered_map<const BinaryBasicBlock *, std::vector<uint64_t>>
+      BBExprs;
+
   void preflight() {
     // Populate our universe of tracked expressions with all instructions
     // except pseudos
     for (auto &BB : this->Func) {
+      auto &Indices = BBExprs[&BB];
       for (auto &Inst : BB) {
+        Indices.push_back(this->NumInstrs);
         this->Expressions.push_back(&Inst);
         this->ExprToIdx[&Inst] = this->NumInstrs++;
       }
     }
   }
 
+  void preflightUpdate(ArrayRef<BinaryBasicBlock *> Changed) {
+    // Instructions of changed blocks could have moved, so their indices are
+    // reassigned in order and new indices are added for inserted ones. These
+    // indices are only set in the states of changed blocks and blocks
+    // dominated by them, which are solved again, and in the full states of
+    // unreachable points.
+    for (auto *BB : Changed) {
+      for (auto Idx : BBExprs[BB])
+        this->ExprToIdx.erase(this->Expressions[Idx]);
+    }
+    for (auto *BB : Changed) {
+      auto &Indices = BBExprs[BB];
+      assert(Indices.size() <= BB->size() &&
+             "instructions could not be erased by an update");
+      unsigned I = 0;
+      for (auto &Inst : *BB) {
+        if (I == Indices.size()) {
+          Indices.push_back(this->NumInstrs++);
+          this->Expressions.push_back(nullptr);
+        }
+        this->Expressions[Indices[I]] = &Inst;
+        this->ExprToIdx[&Inst] = Indices[I];
+        ++I;
+      }
+    }
+
+    auto resize = [&](BitVector &BV) {
+      BV.resize(this->NumInstrs, BV.all());
+    };
+    for (auto &BB : this->Func) {
+      resize(this->getOrCreateStateAt(BB));
+      for (auto &Inst : BB)
+        resize(this->getOrCreateStateAt(Inst));
+    }
+  }
+
   BitVector getStartingStateAtBB(const BinaryBasicBlock &BB) {
     // Entry points start with empty set
     // All others start with the full set.
@@ -31,9 +31,13 @@
 //===----------------------------------------------------------------------===//
 #include "BinaryBasicBlock.h"
 #include "BinaryFunction.h"
+#include "BinaryLoop.h"
 #include "CacheMetrics.h"
+#include "ParallelUtilities.h"
 #include "ReorderAlgorithm.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/Support/Options.h"
+#include <queue>
 
 using namespace llvm;
 using namespace bolt;
@@ -49,6 +53,34 @@ ChainSplitThreshold("chain-split-threshold",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+ChainQueueThreshold("chain-queue-threshold",
+  cl::desc("The minimum number of hot chains in a function to select pairs of "
+           "chains for merging with a priority queue"),
+  cl::init(1024),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+cl::opt<unsigned>
+ExtTSPParallelThreshold("ext-tsp-parallel-threshold",
+  cl::desc("The minimum number of basic blocks in a function to lay out its "
+           "loop nest regions in parallel before merging the whole function "
+           "(0 = never)"),
+  cl::init(4096),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+ExtTSPRegionSize("ext-tsp-region-size",
+  cl::desc("The maximum number of basic blocks in a loop nest that forms a "
+           "region of the parallel layout"),
+  cl::init(1024),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 cl::opt<double>
 FallthroughWeight("fallthrough-weight",
   cl::desc("The weight of forward jumps for ExtTSP value"),
@@ -70,6 +102,14 @@ BackwardWeight("backward-weight",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<double>
+BranchRangePenalty("branch-range-penalty",
+  cl::desc("The weight of jumps placed beyond the reach of their conditional "
+           "branch for ExtTSP value on AArch64, which need a stub"),
+  cl::init(1),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 cl::opt<unsigned>
 ForwardDistance("forward-distance",
   cl::desc("The maximum distance (in bytes) of forward jumps for ExtTSP value"),
@@ -99,7 +139,8 @@ const double EPS = 1e-8;
 
 // Calculate Ext-TSP value, which quantifies the expected number of i-cache
 // misses for a given ordering of basic blocks
-double extTSPScore(uint64_t SrcAddr,
+double extTSPScore(const ExtTSPParams &Params,
+                   uint64_t SrcAddr,
                    uint64_t SrcSize,
                    uint64_t DstAddr,
                    uint64_t Count) {
@@ -107,22 +148,22 @@ double extTSPScore(uint64_t SrcAddr,
 
   // Fallthrough
   if (SrcAddr + SrcSize == DstAddr) {
-    return opts::FallthroughWeight * Count;
+    return Params.FallthroughWeight * Count;
   }
   // Forward
   if (SrcAddr + SrcSize < DstAddr) {
     const auto Dist = DstAddr - (SrcAddr + SrcSize);
-    if (Dist <= opts::ForwardDistance) {
-      double Prob = 1.0 - static_cast<double>(Dist) / opts::ForwardDistance;
-      return opts::ForwardWeight * Prob * Count;
+    if (Dist <= Params.ForwardDistance) {
+      double Prob = 1.0 - static_cast<double>(Dist) / Params.ForwardDistance;
+      return Params.ForwardWeight * Prob * Count;
     }
     return 0;
   }
   // Backward
   const auto Dist = SrcAddr + SrcSize - DstAddr;
-  if (Dist <= opts::BackwardDistance) {
-    double Prob = 1.0 - static_cast<double>(Dist) / opts::BackwardDistance;
-    return opts::BackwardWeight * Prob * Count;
+  if (Dist <= Params.BackwardDistance) {
+    double Prob = 1.0 - static_cast<double>(Dist) / Params.BackwardDistance;
+    return Params.BackwardWeight * Prob * Count;
   }
   return 0;
 }
@@ -165,6 +206,9 @@ public:
   uint64_t InWeight{0};
   // Total execution count of outgoing jumps
   uint64_t OutWeight{0};
+  // Reach (in bytes) of the conditional branch of the block, or 0 if it
+  // does not limit the jumps from the block
+  uint64_t BranchReach{0};
 
   explicit Block(BinaryBasicBlock *BB_, uint64_t Size_)
     : BB(BB_),
@@ -456,8 +500,41 @@ bool compareChainPairs(const Chain *A1, const Chain *B1,
 
 class ExtTSP {
 public:
-  ExtTSP(const BinaryFunction &BF) : BF(BF) {
-    initialize();
+  /// With \p LoopInfo, the chains of loop nest regions are merged in parallel
+  /// before merging chains of the whole function.
+  ExtTSP(const BinaryFunction &BF, const ExtTSPParams &Params,
+         const BinaryLoopInfo *LoopInfo = nullptr)
+    : BF(BF), Params(Params), LoopInfo(LoopInfo) {
+    // Create a separate MCCodeEmitter to allow lock-free execution
+    BinaryContext::IndependentCodeEmitter Emitter;
+    if (!opts::NoThreads) {
+      Emitter = BF.getBinaryContext().createIndependentMCCodeEmitter();
+    }
+
+    std::vector<BinaryBasicBlock *> Blocks;
+    std::vector<uint64_t> Sizes;
+    Blocks.reserve(BF.layout_size());
+    Sizes.reserve(BF.layout_size());
+    size_t LayoutIndex = 0;
+    for (auto BB : BF.layout()) {
+      BB->setLayoutIndex(LayoutIndex++);
+      Blocks.push_back(BB);
+      Sizes.push_back(
+          std::max<uint64_t>(BB->estimateSize(Emitter.MCE.get()), 1));
+    }
+    initialize(Blocks, Sizes);
+  }
+
+  /// Create an instance for the subset \p Blocks of the function with
+  /// \p Sizes. Only jumps between the blocks of the subset are considered.
+  /// Layout indices of the blocks are assigned by the instance for the whole
+  /// function and are not modified, so instances for disjoint subsets could
+  /// run concurrently.
+  ExtTSP(const BinaryFunction &BF, const ExtTSPParams &Params,
+         const std::vector<BinaryBasicBlock *> &Blocks,
+         const std::vector<uint64_t> &Sizes)
+    : BF(BF), Params(Params) {
+    initialize(Blocks, Sizes);
   }
 
   /// Run the algorithm and return an ordering of basic block
@@ -465,7 +542,10 @@ public:
     // Pass 1: Merge blocks with their fallthrough successors
     mergeFallthroughs();
 
-    // Pass 2: Merge pairs of chains while improving the ExtTSP metric
+    // Pass 2: Merge pairs of chains while improving the ExtTSP metric,
+    // starting from the chains of loop nest regions if they are used
+    if (LoopInfo)
+      mergeRegions();
     mergeChainPairs();
 
     // Pass 3: Merge cold blocks to reduce code size
@@ -477,20 +557,25 @@ public:
 
 private:
   /// Initialize algorithm's data structures
-  void initialize() {
-    // Create a separate MCCodeEmitter to allow lock-free execution
-    BinaryContext::IndependentCodeEmitter Emitter;
-    if (!opts::NoThreads) {
-      Emitter = BF.getBinaryContext().createIndependentMCCodeEmitter();
-    }
-
+  void initialize(const std::vector<BinaryBasicBlock *> &Blocks,
+                  const std::vector<uint64_t> &Sizes) {
     // Initialize CFG nodes
-    AllBlocks.reserve(BF.layout_size());
-    size_t LayoutIndex = 0;
-    for (auto BB : BF.layout()) {
-      BB->setLayoutIndex(LayoutIndex++);
-      auto Size = std::max<uint64_t>(BB->estimateSize(Emitter.MCE.get()), 1);
-      AllBlocks.emplace_back(BB, Size);
+    AllBlocks.reserve(Blocks.size());
+    for (size_t I = 0; I < Blocks.size(); ++I)
+      AllBlocks.emplace_back(Blocks[I], Sizes[I]);
+    for (auto &Block : AllBlocks)
+      BlockOf[Block.BB] = &Block;
+
+    // On AArch64, conditional branches have a limited reach, and jumps
+    // placed beyond it take a stub inserted by LongJmpPass
+    const auto &BC = BF.getBinaryContext();
+    if (BC.isAArch64()) {
+      for (auto &Block : AllBlocks) {
+        for (const auto &Inst : *Block.BB) {
+          if (BC.MIB->isConditionalBranch(Inst))
+            Block.BranchReach = BC.MIB->getBranchReach(Inst);
+        }
+      }
     }
 
     // Initialize edges for the blocks and compute their total in/out weights
@@ -500,11 +585,11 @@ private:
       for (auto SuccBB : Block.BB->successors()) {
         assert(BI->Count != BinaryBasicBlock::COUNT_NO_PROFILE &&
                "missing profile for a jump");
-        if (SuccBB != Block.BB && BI->Count > 0) {
-          auto &SuccBlock = AllBlocks[SuccBB->getLayoutIndex()];
-          SuccBlock.InWeight += BI->Count;
+        auto SuccBlock = getBlock(SuccBB);
+        if (SuccBB != Block.BB && BI->Count > 0 && SuccBlock) {
+          SuccBlock->InWeight += BI->Count;
           Block.OutWeight += BI->Count;
-          Block.OutJumps.push_back(std::make_pair(&SuccBlock, BI->Count));
+          Block.OutJumps.push_back(std::make_pair(SuccBlock, BI->Count));
           NumEdges++;
         }
         ++BI;
@@ -523,10 +608,10 @@ private:
     }
 
     // Initialize chains
-    AllChains.reserve(BF.layout_size());
-    HotChains.reserve(BF.layout_size());
+    AllChains.reserve(AllBlocks.size());
+    HotChains.reserve(AllBlocks.size());
     for (auto &Block : AllBlocks) {
-      AllChains.emplace_back(Block.Index, &Block);
+      AllChains.emplace_back(AllChains.size(), &Block);
       Block.CurChain = &AllChains.back();
       if (Block.ExecutionCount > 0) {
         HotChains.push_back(&AllChains.back());
@@ -568,9 +653,10 @@ private:
       if (Block.BB->succ_size() == 1 &&
           Block.BB->getSuccessor()->pred_size() == 1 &&
           Block.BB->getSuccessor()->getLayoutIndex() != 0) {
-        size_t SuccIndex = Block.BB->getSuccessor()->getLayoutIndex();
-        Block.FallthroughSucc = &AllBlocks[SuccIndex];
-        AllBlocks[SuccIndex].FallthroughPred = &Block;
+        if (auto SuccBlock = getBlock(Block.BB->getSuccessor())) {
+          Block.FallthroughSucc = SuccBlock;
+          SuccBlock->FallthroughPred = &Block;
+        }
         continue;
       }
 
@@ -603,7 +689,7 @@ private:
       if (SuccBlock == nullptr)
         continue;
       // break the cycle
-      AllBlocks[Block.FallthroughPred->Index].FallthroughSucc = nullptr;
+      Block.FallthroughPred->FallthroughSucc = nullptr;
       Block.FallthroughPred = nullptr;
     }
   }
@@ -625,6 +711,11 @@ private:
 
   /// Merge pairs of chains while improving the ExtTSP metric
   void mergeChainPairs() {
+    if (HotChains.size() >= opts::ChainQueueThreshold) {
+      mergeChainPairsWithQueue();
+      return;
+    }
+
     while (HotChains.size() > 1) {
       Chain *BestChainPred = nullptr;
       Chain *BestChainSucc = nullptr;
@@ -666,6 +757,172 @@ private:
     }
   }
 
+  /// A candidate pair of chains for merging with the gain computed for the
+  /// versions of the chains at the time the candidate was created
+  struct MergeCandidate {
+    MergeGainTy Gain;
+    Chain *ChainPred;
+    Chain *ChainSucc;
+    uint64_t PredVersion;
+    uint64_t SuccVersion;
+
+    /// The order of selection, which matches the one of mergeChainPairs()
+    /// except that gains within EPS of each other are not considered equal
+    bool operator<(const MergeCandidate &Other) const {
+      if (Gain.first != Other.Gain.first)
+        return Gain.first < Other.Gain.first;
+      return compareChainPairs(Other.ChainPred, Other.ChainSucc,
+                               ChainPred, ChainSucc);
+    }
+  };
+
+  /// Merge pairs of chains while improving the ExtTSP metric, keeping the
+  /// candidate pairs in a priority queue instead of rescanning all pairs on
+  /// every iteration. Merging two chains only changes the gains of pairs
+  /// involving the merged chains. Candidates for such pairs are invalidated
+  /// lazily by bumping the versions of the chains and are skipped once they
+  /// reach the top of the queue.
+  void mergeChainPairsWithQueue() {
+    std::vector<uint64_t> Versions(AllChains.size(), 0);
+    std::vector<bool> IsHot(AllChains.size(), false);
+    for (auto ChainPred : HotChains)
+      IsHot[ChainPred->id()] = true;
+
+    std::priority_queue<MergeCandidate> Queue;
+    auto addCandidate = [&](Chain *ChainPred, Chain *ChainSucc, Edge *Edge) {
+      if (!IsHot[ChainPred->id()])
+        return;
+      auto Gain = mergeGain(ChainPred, ChainSucc, Edge);
+      if (Gain.first <= 0.0)
+        return;
+      Queue.push(MergeCandidate{Gain, ChainPred, ChainSucc,
+                                Versions[ChainPred->id()],
+                                Versions[ChainSucc->id()]});
+    };
+
+    for (auto ChainPred : HotChains) {
+      for (auto EdgeIter : ChainPred->edges()) {
+        if (EdgeIter.first != ChainPred)
+          addCandidate(ChainPred, EdgeIter.first, EdgeIter.second);
+      }
+    }
+
+    while (!Queue.empty()) {
+      const auto Candidate = Queue.top();
+      Queue.pop();
+      auto ChainPred = Candidate.ChainPred;
+      auto ChainSucc = Candidate.ChainSucc;
+      if (Candidate.PredVersion != Versions[ChainPred->id()] ||
+          Candidate.SuccVersion != Versions[ChainSucc->id()])
+        continue;
+
+      mergeChains(ChainPred, ChainSucc, Candidate.Gain.second);
+      ++Versions[ChainPred->id()];
+      ++Versions[ChainSucc->id()];
+      IsHot[ChainSucc->id()] = false;
+
+      // Add pairs with the merged chain in both directions
+      for (auto EdgeIter : ChainPred->edges()) {
+        auto Other = EdgeIter.first;
+        if (Other == ChainPred)
+          continue;
+        addCandidate(ChainPred, Other, EdgeIter.second);
+        addCandidate(Other, ChainPred, EdgeIter.second);
+      }
+    }
+  }
+
+  /// Merge chains within regions of the CFG formed by loop nests. Regions are
+  /// laid out in parallel by separate instances that only see jumps inside of
+  /// the region, and the chains they produce are concatenated here, so that
+  /// merging chains of the whole function starts with far fewer chains.
+  void mergeRegions() {
+    // A block belongs to the outermost loop that contains it and has at most
+    // -ext-tsp-region-size blocks. Blocks of a larger loop outside of such
+    // nests form a region of that loop, and blocks outside of loops form
+    // another region.
+    DenseMap<const BinaryLoop *, size_t> RegionIds;
+    std::vector<std::vector<BinaryBasicBlock *>> RegionBlocks;
+    std::vector<std::vector<uint64_t>> RegionSizes;
+    for (auto &Block : AllBlocks) {
+      const BinaryLoop *Region = nullptr;
+      for (auto L = LoopInfo->getLoopFor(Block.BB); L;
+           L = L->getParentLoop()) {
+        if (L->getNumBlocks() > opts::ExtTSPRegionSize) {
+          if (!Region)
+            Region = L;
+          break;
+        }
+        Region = L;
+      }
+      auto It = RegionIds.insert(std::make_pair(Region, RegionBlocks.size()));
+      if (It.second) {
+        RegionBlocks.emplace_back();
+        RegionSizes.emplace_back();
+      }
+      RegionBlocks[It.first->second].push_back(Block.BB);
+      RegionSizes[It.first->second].push_back(Block.Size);
+    }
+    if (RegionBlocks.size() < 2)
+      return;
+
+    std::vector<std::vector<std::vector<BinaryBasicBlock *>>> RegionChains(
+        RegionBlocks.size());
+    auto layoutRegion = [&](size_t RegionId) {
+      ExtTSP Region(BF, Params, RegionBlocks[RegionId],
+                    RegionSizes[RegionId]);
+      Region.mergeFallthroughs();
+      Region.mergeChainPairs();
+      for (auto &Chain : Region.AllChains) {
+        if (Chain.blocks().size() < 2)
+          continue;
+        RegionChains[RegionId].emplace_back();
+        for (auto Block : Chain.blocks())
+          RegionChains[RegionId].back().push_back(Block->BB);
+      }
+    };
+    ThreadPool &Pool = ParallelUtilities::getThreadPool();
+    for (size_t RegionId = 0; RegionId < RegionBlocks.size(); ++RegionId) {
+      if (RegionBlocks[RegionId].size() > 1)
+        Pool.async(layoutRegion, RegionId);
+    }
+    Pool.wait();
+
+    // Chains of this instance could already join blocks of different regions
+    // with fallthroughs, in which case region chains are only applied where
+    // they extend the existing chains. Cached values are updated once all
+    // region chains are applied.
+    for (const auto &Chains : RegionChains) {
+      for (const auto &Blocks : Chains) {
+        for (size_t I = 1; I < Blocks.size(); ++I) {
+          auto SrcChain = getBlock(Blocks[I - 1])->CurChain;
+          auto DstChain = getBlock(Blocks[I])->CurChain;
+          if (SrcChain != DstChain && !DstChain->isEntryPoint() &&
+              SrcChain->blocks().back()->BB == Blocks[I - 1] &&
+              DstChain->blocks().front()->BB == Blocks[I]) {
+            mergeChains(SrcChain, DstChain, 0, /*UpdateCaches=*/false);
+          }
+        }
+      }
+    }
+
+    HotChains.erase(std::remove_if(HotChains.begin(), HotChains.end(),
+                                   [](const Chain *Chain) {
+                                     return Chain->blocks().empty();
+                                   }),
+                    HotChains.end());
+    for (auto &Chain : AllChains) {
+      if (Chain.blocks().empty())
+        continue;
+      if (auto SelfEdge = Chain.getEdge(&Chain)) {
+        MergedChain MergedBlocks(Chain.blocks().begin(), Chain.blocks().end());
+        Chain.setScore(score(MergedBlocks, SelfEdge->jumps()));
+      }
+      for (auto EdgeIter : Chain.edges())
+        EdgeIter.second->invalidateCache();
+    }
+  }
+
   /// Merge cold blocks to reduce code size
   void mergeColdChains() {
     for (auto SrcBB : BF.layout()) {
@@ -675,8 +932,8 @@ private:
         BinaryBasicBlock *DstBB = *Itr;
         size_t SrcIndex = SrcBB->getLayoutIndex();
         size_t DstIndex = DstBB->getLayoutIndex();
-        auto SrcChain = AllBlocks[SrcIndex].CurChain;
-        auto DstChain = AllBlocks[DstIndex].CurChain;
+        auto SrcChain = getBlock(SrcBB)->CurChain;
+        auto DstChain = getBlock(DstBB)->CurChain;
         if (SrcChain != DstChain && !DstChain->isEntryPoint() &&
             SrcChain->blocks().back()->Index == SrcIndex &&
             DstChain->blocks().front()->Index == DstIndex) {
@@ -702,10 +959,19 @@ private:
     for (auto &Jump : Jumps) {
       const auto SrcBlock = Jump.first.first;
       const auto DstBlock = Jump.first.second;
-      Score += extTSPScore(SrcBlock->EstimatedAddr,
+      Score += extTSPScore(Params,
+                           SrcBlock->EstimatedAddr,
                            SrcBlock->Size,
                            DstBlock->EstimatedAddr,
                            Jump.second);
+      if (SrcBlock->BranchReach) {
+        const auto SrcEnd = SrcBlock->EstimatedAddr + SrcBlock->Size;
+        const auto Dist = SrcEnd > DstBlock->EstimatedAddr
+                              ? SrcEnd - DstBlock->EstimatedAddr
+                              : DstBlock->EstimatedAddr - SrcEnd;
+        if (Dist > SrcBlock->BranchReach)
+          Score -= opts::BranchRangePenalty * Jump.second;
+      }
     }
     return Score;
   }
@@ -782,7 +1048,7 @@ private:
     Gain = computeMergeGain(Gain, ChainPred, ChainSucc, 0);
 
     // Do not split large chains to reduce computation time
-    if (ChainPred->blocks().size() <= opts::ChainSplitThreshold) {
+    if (ChainPred->blocks().size() <= Params.ChainSplitThreshold) {
       // Try to split ChainPred into two sub-chains in various ways and then
       // merge it with ChainSucc
       for (size_t Offset = 1; Offset < ChainPred->blocks().size(); Offset++) {
@@ -833,8 +1099,11 @@ private:
   }
 
   /// Merge chain From into chain Into, update the list of active chains,
-  /// adjacency information, and the corresponding cached values
-  void mergeChains(Chain *Into, Chain *From, size_t MergeType = 0) {
+  /// adjacency information, and the corresponding cached values. Without
+  /// \p UpdateCaches, the caller is responsible for removing the chain From
+  /// from the active chains and updating the cached values afterwards.
+  void mergeChains(Chain *Into, Chain *From, size_t MergeType = 0,
+                   bool UpdateCaches = true) {
     assert(Into != From && "chain cannot be merged with itself");
 
     // Merge the blocks
@@ -842,6 +1111,9 @@ private:
     Into->merge(From, MergedBlocks.getBlocks());
     From->clear();
 
+    if (!UpdateCaches)
+      return;
+
     // Update cached ext-tsp score for the new chain
     auto SelfEdge = Into->getEdge(Into);
     if (SelfEdge != nullptr) {
@@ -898,10 +1170,26 @@ private:
     }
   }
 
+  /// Return the CFG node of \p BB, or nullptr if the block is not laid out by
+  /// this instance
+  Block *getBlock(const BinaryBasicBlock *BB) const {
+    auto It = BlockOf.find(BB);
+    return It != BlockOf.end() ? It->second : nullptr;
+  }
+
 private:
   // The binary function
   const BinaryFunction &BF;
 
+  // Parameters of the ExtTSP metric
+  const ExtTSPParams &Params;
+
+  // Loops of the function, if loop nest regions are laid out in parallel
+  const BinaryLoopInfo *LoopInfo{nullptr};
+
+  // CFG nodes of the basic blocks
+  DenseMap<const BinaryBasicBlock *, Block *> BlockOf;
+
   // All CFG nodes (basic blocks)
   std::vector<Block> AllBlocks;
 
@@ -915,6 +1203,17 @@ private:
   std::vector<Edge> AllEdges;
 };
 
+ExtTSPParams ExtTSPParams::fromOptions() {
+  ExtTSPParams Params;
+  Params.FallthroughWeight = opts::FallthroughWeight;
+  Params.ForwardWeight = opts::ForwardWeight;
+  Params.BackwardWeight = opts::BackwardWeight;
+  Params.ForwardDistance = opts::ForwardDistance;
+  Params.BackwardDistance = opts::BackwardDistance;
+  Params.ChainSplitThreshold = opts::ChainSplitThreshold;
+  return Params;
+}
+
 void ExtTSPReorderAlgorithm::reorderBasicBlocks(
       const BinaryFunction &BF, BasicBlockOrder &Order) const {
   if (BF.layout_empty())
@@ -929,7 +1228,7 @@ void ExtTSPReorderAlgorithm::reorderBasicBlocks(
   }
 
   // Apply the algorithm
-  ExtTSP(BF).run(Order);
+  ExtTSP(BF, Params, LoopInfo).run(Order);
 
   // Verify correctness
   assert(Order[0]->isEntryPoint() && "Original entry point is not preserved");
@@ -87,6 +87,10 @@ raw_ostream &operator<<(raw_ostream &OS, const FrameIndexEntry &FIE) {
 
 namespace {
 
+/// Indices into ArgAccessesVector and FIEVector attached to instructions.
+const MCPlus::AnnotationKey<unsigned> ArgAccessEntry("ArgAccessEntry");
+const MCPlus::AnnotationKey<unsigned> FrameAccessEntry("FrameAccessEntry");
+
 /// This class should be used to iterate through basic blocks in layout order
 /// to analyze instructions for frame accesses. The user should call
 /// enterNewBB() whenever starting analyzing a new BB and doNext() for each
@@ -235,10 +239,10 @@ void FrameAnalysis::addArgAccessesFor(MCInst &Inst, ArgAccesses &&AA) {
   }
   if (AA.AssumeEverything) {
     // Index 0 in ArgAccessesVector represents an "assumeeverything" entry
-    BC.MIB->addAnnotation(Inst, "ArgAccessEntry", 0U);
+    BC.MIB->addAnnotation(Inst, ArgAccessEntry, 0U);
     return;
   }
-  BC.MIB->addAnnotation(Inst, "ArgAccessEntry",
+  BC.MIB->addAnnotation(Inst, ArgAccessEntry,
                         (unsigned)ArgAccessesVector.size());
   ArgAccessesVector.emplace_back(std::move(AA));
 }
@@ -257,13 +261,12 @@ void FrameAnalysis::addArgInStackAccessFor(MCInst &Inst,
 }
 
 void FrameAnalysis::addFIEFor(MCInst &Inst, const FrameIndexEntry &FIE) {
-  BC.MIB->addAnnotation(Inst, "FrameAccessEntry",
-                        (unsigned)FIEVector.size());
+  BC.MIB->addAnnotation(Inst, FrameAccessEntry, (unsigned)FIEVector.size());
   FIEVector.emplace_back(FIE);
 }
 
 ErrorOr<ArgAccesses &> FrameAnalysis::getArgAccessesFor(const MCInst &Inst) {
-  if (auto Idx = BC.MIB->tryGetAnnotationAs<unsigned>(Inst, "ArgAccessEntry")) {
+  if (auto Idx = BC.MIB->tryGetAnnotationAs(Inst, ArgAccessEntry)) {
     assert(ArgAccessesVector.size() > *Idx && "Out of bounds");
     return ArgAccessesVector[*Idx];
   }
@@ -272,7 +275,7 @@ ErrorOr<ArgAccesses &> FrameAnalysis::getArgAccessesFor(const MCInst &Inst) {
 
 ErrorOr<const ArgAccesses &>
 FrameAnalysis::getArgAccessesFor(const MCInst &Inst) const {
-  if (auto Idx = BC.MIB->tryGetAnnotationAs<unsigned>(Inst, "ArgAccessEntry")) {
+  if (auto Idx = BC.MIB->tryGetAnnotationAs(Inst, ArgAccessEntry)) {
     assert(ArgAccessesVector.size() > *Idx && "Out of bounds");
     return ArgAccessesVector[*Idx];
   }
@@ -281,8 +284,7 @@ FrameAnalysis::getArgAccessesFor(const MCInst &Inst) const {
 
 ErrorOr<const FrameIndexEntry &>
 FrameAnalysis::getFIEFor(const MCInst &Inst) const {
-  if (auto Idx =
-          BC.MIB->tryGetAnnotationAs<unsigned>(Inst, "FrameAccessEntry")) {
+  if (auto Idx = BC.MIB->tryGetAnnotationAs(Inst, FrameAccessEntry)) {
     assert(FIEVector.size() > *Idx && "Out of bounds");
     return FIEVector[*Idx];
   }
@@ -498,8 +500,8 @@ void FrameAnalysis::cleanAnnotations() {
   ParallelUtilities::WorkFuncTy CleanFunction = [&](BinaryFunction &BF) {
     for (auto &BB : BF) {
       for (auto &Inst : BB) {
-        BC.MIB->removeAnnotation(Inst, "ArgAccessEntry");
-        BC.MIB->removeAnnotation(Inst, "FrameAccessEntry");
+        BC.MIB->removeAnnotation(Inst, ArgAccessEntry);
+        BC.MIB->removeAnnotation(Inst, FrameAccessEntry);
       }
     }
   };
@@ -143,7 +143,6 @@ class FrameAnalysis {
   /// our specific data
   void addArgAccessesFor(MCInst &Inst, ArgAccesses &&AA);
   void addArgInStackAccessFor(MCInst &Inst, const ArgInStackAccess &Arg);
-  void addFIEFor(MCInst &Inst, const FrameIndexEntry &FIE);
 
   /// Perform the step of building the set of registers clobbered by each
   /// function execution, populating RegsKilledMap and RegsGenMap.
@@ -197,6 +196,10 @@ public:
 
   ErrorOr<const FrameIndexEntry &> getFIEFor(const MCInst &Inst) const;
 
+  /// Attach \p FIE to \p Inst, e.g. to a frame access created by an
+  /// optimization that is followed by other users of this analysis.
+  void addFIEFor(MCInst &Inst, const FrameIndexEntry &FIE);
+
   /// Remove all MCAnnotations attached by this pass
   void cleanAnnotations();
 
@@ -10,12 +10,14 @@
 //===----------------------------------------------------------------------===//
 
 #include "FrameOptimizer.h"
+#include "DataflowInfoManager.h"
 #include "ParallelUtilities.h"
 #include "ShrinkWrapping.h"
 #include "StackAvailableExpressions.h"
 #include "StackReachingUses.h"
 #include "llvm/Support/Timer.h"
 #include <queue>
+#include <set>
 #include <unordered_map>
 
 #define DEBUG_TYPE "fop"
@@ -48,6 +50,14 @@ RemoveStores("frame-opt-rm-stores",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+PromoteStackSlots("frame-opt-promote-slots",
+  cl::desc("promote stack slots accessed in hot loops to free registers "
+           "(experimental)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 } // namespace opts
 
 namespace llvm {
@@ -221,6 +231,334 @@ void FrameOptimizerPass::removeUnusedStores(const FrameAnalysis &FA,
   }
 }
 
+namespace {
+
+/// Address of a stack slot relative to the stack or frame pointer.
+struct SlotAddress {
+  MCPhysReg BaseReg;
+  int64_t Offset;
+};
+
+/// Return the address of the slot at CFA offset \p StackOffset at a point
+/// where the stack and frame pointer values are \p SPFP.
+Optional<SlotAddress> getSlotAddress(const BinaryContext &BC,
+                                     std::pair<int, int> SPFP,
+                                     int64_t StackOffset) {
+  if (SPFP.first != StackPointerTracking::SUPERPOSITION &&
+      SPFP.first != StackPointerTracking::EMPTY)
+    return SlotAddress{BC.MIB->getStackPointer(), StackOffset - SPFP.first};
+  if (SPFP.second != StackPointerTracking::SUPERPOSITION &&
+      SPFP.second != StackPointerTracking::EMPTY)
+    return SlotAddress{BC.MIB->getFramePointer(), StackOffset - SPFP.second};
+  return NoneType();
+}
+
+/// Stack slot promoted to a register across a loop.
+struct SlotPromotion {
+  int64_t StackOffset;
+  MCPhysReg Reg;
+  std::vector<BinaryBasicBlock *> LoopBlocks;
+  BinaryBasicBlock *Preheader;
+  SlotAddress PreheaderAddress;
+  /// Exit blocks and slot addresses at their entry. Empty if the slot is not
+  /// written in the loop.
+  std::vector<std::pair<BinaryBasicBlock *, SlotAddress>> Exits;
+};
+
+/// Return the position of the first terminator of \p BB.
+BinaryBasicBlock::iterator getFirstTerminator(const BinaryContext &BC,
+                                              BinaryBasicBlock &BB) {
+  for (auto II = BB.begin(), E = BB.end(); II != E; ++II) {
+    if (BC.MIB->isTerminator(*II))
+      return II;
+  }
+  return BB.end();
+}
+
+} // anonymous namespace
+
+void FrameOptimizerPass::promoteStackSlots(const RegAnalysis &RA,
+                                           FrameAnalysis &FA,
+                                           const BinaryContext &BC,
+                                           BinaryFunction &BF) {
+  constexpr uint8_t SlotSize = 8;
+
+  BF.calculateLoopInfo();
+  const auto &LI = BF.getLoopInfo();
+  if (LI.empty())
+    return;
+
+  // Find slots that are only accessed by simple loads to and stores from
+  // registers that could be turned into register moves, and do not overlap
+  // with any other access, including accesses of callees to arguments.
+  struct Access {
+    int64_t StackOffset;
+    int64_t Size;
+    bool Promotable;
+    bool operator<(const Access &Other) const {
+      return StackOffset < Other.StackOffset;
+    }
+  };
+  std::vector<Access> Accesses;
+  for (auto &BB : BF) {
+    for (auto &Inst : BB) {
+      if (auto Args = FA.getArgAccessesFor(Inst)) {
+        for (const auto &Arg : Args->Set)
+          Accesses.push_back({Arg.StackOffset, Arg.Size, false});
+      }
+      auto FIE = FA.getFIEFor(Inst);
+      if (!FIE)
+        continue;
+      bool Promotable = FIE->IsSimple && FIE->Size == SlotSize &&
+                        FIE->StackOffset < 0 && !BC.MIB->isPush(Inst) &&
+                        !BC.MIB->isPop(Inst) && FIE->IsLoad != FIE->IsStore;
+      if (Promotable && FIE->IsLoad) {
+        MCInst Copy = Inst;
+        Promotable = BC.MIB->replaceMemOperandWithReg(Copy, FIE->RegOrImm);
+      } else if (Promotable) {
+        Promotable = FIE->IsStoreFromReg;
+      }
+      Accesses.push_back({FIE->StackOffset, FIE->Size, Promotable});
+    }
+  }
+  std::sort(Accesses.begin(), Accesses.end());
+
+  std::set<int64_t> PromotableSlots;
+  for (size_t I = 0, E = Accesses.size(); I != E;) {
+    auto End = Accesses[I].StackOffset + Accesses[I].Size;
+    bool Promotable = true;
+    size_t J = I;
+    for (; J != E && Accesses[J].StackOffset < End; ++J) {
+      End = std::max(End, Accesses[J].StackOffset + Accesses[J].Size);
+      Promotable &= Accesses[J].Promotable &&
+                    Accesses[J].StackOffset == Accesses[I].StackOffset &&
+                    Accesses[J].Size == Accesses[I].Size;
+    }
+    if (Promotable)
+      PromotableSlots.insert(Accesses[I].StackOffset);
+    I = J;
+  }
+  if (PromotableSlots.empty())
+    return;
+
+  BitVector CandidateRegs(BC.MRI->getNumRegs(), false);
+  BC.MIB->getGPRegs(CandidateRegs, /*IncludeAlias=*/false);
+  BitVector CalleeSaved(BC.MRI->getNumRegs(), false);
+  BC.MIB->getCalleeSavedRegs(CalleeSaved);
+  CandidateRegs.reset(CalleeSaved);
+  CandidateRegs.reset(BC.MIB->getStackPointer());
+  CandidateRegs.reset(BC.MIB->getFramePointer());
+
+  std::vector<SlotPromotion> Promotions;
+  {
+    DataflowInfoManager Info(BC, BF, &RA, &FA);
+    auto &LA = Info.getLivenessAnalysis();
+    auto &SPT = Info.getStackPointerTracking();
+
+    // Evaluate outer loops first, and inner loops of the ones without
+    // promoted slots.
+    std::vector<BinaryLoop *> Loops(LI.begin(), LI.end());
+    while (!Loops.empty()) {
+      auto *Loop = Loops.back();
+      Loops.pop_back();
+      auto *Header = Loop->getHeader();
+      if (!Header->getKnownExecutionCount())
+        continue;
+      auto visitSubLoops = [&] {
+        Loops.insert(Loops.end(), Loop->begin(), Loop->end());
+      };
+
+      BinaryBasicBlock *Preheader = nullptr;
+      bool HasSinglePreheader = true;
+      for (auto *Pred : Header->predecessors()) {
+        if (Loop->contains(Pred))
+          continue;
+        HasSinglePreheader &= !Preheader && Pred->succ_size() == 1;
+        Preheader = Pred;
+      }
+      if (!Preheader || !HasSinglePreheader) {
+        visitSubLoops();
+        continue;
+      }
+
+      // Exits have to be dedicated, and values in promoted registers are lost
+      // if the loop is left by an exception.
+      bool IsSimpleLoop = true;
+      std::vector<BinaryBasicBlock *> Exits;
+      for (auto *BB : Loop->blocks()) {
+        IsSimpleLoop &= !BB->isLandingPad() && !BB->lp_size();
+        for (auto *Succ : BB->successors()) {
+          if (Loop->contains(Succ) ||
+              std::find(Exits.begin(), Exits.end(), Succ) != Exits.end())
+            continue;
+          IsSimpleLoop &= !Succ->isLandingPad();
+          for (auto *Pred : Succ->predecessors())
+            IsSimpleLoop &= Loop->contains(Pred);
+          Exits.push_back(Succ);
+        }
+      }
+      if (!IsSimpleLoop) {
+        visitSubLoops();
+        continue;
+      }
+
+      // Collect registers used or live in the loop, and the execution count
+      // of accesses to promotable slots.
+      struct SlotUse {
+        uint64_t Count{0};
+        bool IsStored{false};
+      };
+      std::map<int64_t, SlotUse> SlotUses;
+      BitVector UsedRegs(BC.MRI->getNumRegs(), false);
+      for (auto *BB : Loop->blocks()) {
+        UsedRegs |= *LA.getStateAt(*BB);
+        for (auto &Inst : *BB) {
+          UsedRegs |= *LA.getStateAt(Inst);
+          RA.getInstUsedRegsList(Inst, UsedRegs, /*GetClobbers=*/false);
+          RA.getInstClobberList(Inst, UsedRegs);
+          if (auto Args = FA.getArgAccessesFor(Inst))
+            IsSimpleLoop &= !Args->AssumeEverything;
+          auto FIE = FA.getFIEFor(Inst);
+          if (!FIE || !PromotableSlots.count(FIE->StackOffset))
+            continue;
+          auto &Use = SlotUses[FIE->StackOffset];
+          Use.Count += BB->getKnownExecutionCount();
+          Use.IsStored |= FIE->IsStore;
+        }
+      }
+      if (!IsSimpleLoop || SlotUses.empty()) {
+        visitSubLoops();
+        continue;
+      }
+
+      std::vector<MCPhysReg> FreeRegs;
+      for (int Reg = CandidateRegs.find_first(); Reg != -1;
+           Reg = CandidateRegs.find_next(Reg)) {
+        if (!BC.MIB->getAliases(Reg).anyCommon(UsedRegs))
+          FreeRegs.push_back(Reg);
+      }
+
+      std::vector<std::pair<int64_t, SlotUse>> Candidates(SlotUses.begin(),
+                                                          SlotUses.end());
+      std::stable_sort(Candidates.begin(), Candidates.end(),
+                       [](const std::pair<int64_t, SlotUse> &A,
+                          const std::pair<int64_t, SlotUse> &B) {
+                         return A.second.Count > B.second.Count;
+                       });
+
+      const auto Term = getFirstTerminator(BC, *Preheader);
+      const auto PreheaderSPFP = Term == Preheader->begin()
+                                     ? *SPT.getStateAt(*Preheader)
+                                     : *SPT.getStateAt(*std::prev(Term));
+      uint64_t ExitCount = 0;
+      for (auto *Exit : Exits)
+        ExitCount += Exit->getKnownExecutionCount();
+
+      bool Promoted = false;
+      for (const auto &Candidate : Candidates) {
+        if (FreeRegs.empty())
+          break;
+        const auto StackOffset = Candidate.first;
+        const auto &Use = Candidate.second;
+        const auto Cost = Preheader->getKnownExecutionCount() +
+                          (Use.IsStored ? ExitCount : 0);
+        if (Use.Count <= Cost)
+          continue;
+
+        auto PreheaderAddress = getSlotAddress(BC, PreheaderSPFP, StackOffset);
+        if (!PreheaderAddress)
+          continue;
+        SlotPromotion Promotion{StackOffset, FreeRegs.back(),
+                                std::vector<BinaryBasicBlock *>(
+                                    Loop->block_begin(), Loop->block_end()),
+                                Preheader, *PreheaderAddress, {}};
+        bool HasExitAddresses = true;
+        for (auto *Exit : Exits) {
+          if (!Use.IsStored)
+            break;
+          auto Address =
+              getSlotAddress(BC, *SPT.getStateAt(*Exit), StackOffset);
+          if (!Address) {
+            HasExitAddresses = false;
+            break;
+          }
+          Promotion.Exits.emplace_back(Exit, *Address);
+        }
+        if (!HasExitAddresses)
+          continue;
+
+        DEBUG(dbgs() << "BOLT-DEBUG: promoting stack slot " << StackOffset
+                     << " to " << BC.MRI->getName(Promotion.Reg)
+                     << " in loop at " << Header->getName() << " of "
+                     << BF << '\n');
+        FreeRegs.pop_back();
+        Promotions.emplace_back(std::move(Promotion));
+        Promoted = true;
+      }
+      if (!Promoted)
+        visitSubLoops();
+    }
+  }
+
+  for (const auto &Promotion : Promotions) {
+    ++NumSlotsPromoted;
+    for (auto *BB : Promotion.LoopBlocks) {
+      for (auto &Inst : *BB) {
+        auto FIEX = FA.getFIEFor(Inst);
+        if (!FIEX || FIEX->StackOffset != Promotion.StackOffset)
+          continue;
+        const auto FIE = *FIEX;
+        if (FIE.IsLoad) {
+          BC.MIB->replaceMemOperandWithReg(Inst, Promotion.Reg);
+          BC.MIB->removeAnnotation(Inst, "FrameAccessEntry");
+          ++NumPromotedLoads;
+          continue;
+        }
+        MCInst Move;
+        BC.MIB->createRestoreFromStack(Move, BC.MIB->getStackPointer(), 0,
+                                       Promotion.Reg, SlotSize);
+        BC.MIB->replaceMemOperandWithReg(Move, FIE.RegOrImm);
+        Inst = std::move(Move);
+        ++NumPromotedStores;
+      }
+    }
+
+    FrameIndexEntry FIE;
+    FIE.IsLoad = true;
+    FIE.IsStore = false;
+    FIE.IsStoreFromReg = false;
+    FIE.RegOrImm = Promotion.Reg;
+    FIE.StackOffset = Promotion.StackOffset;
+    FIE.Size = SlotSize;
+    FIE.IsSimple = true;
+    FIE.StackPtrReg = Promotion.PreheaderAddress.BaseReg;
+    MCInst Load;
+    BC.MIB->createRestoreFromStack(Load, FIE.StackPtrReg,
+                                   Promotion.PreheaderAddress.Offset,
+                                   Promotion.Reg, SlotSize);
+    FA.addFIEFor(Load, FIE);
+    auto *Preheader = Promotion.Preheader;
+    Preheader->insertInstruction(getFirstTerminator(BC, *Preheader),
+                                 std::move(Load));
+
+    FIE.IsLoad = false;
+    FIE.IsStore = true;
+    FIE.IsStoreFromReg = true;
+    for (const auto &Exit : Promotion.Exits) {
+      FIE.StackPtrReg = Exit.second.BaseReg;
+      MCInst Store;
+      BC.MIB->createSaveToStack(Store, FIE.StackPtrReg, Exit.second.Offset,
+                                Promotion.Reg, SlotSize);
+      FA.addFIEFor(Store, FIE);
+      Exit.first->insertInstruction(Exit.first->begin(), std::move(Store));
+    }
+  }
+
+  if (!Promotions.empty()) {
+    DEBUG(dbgs() << "FOP modified \"" << BF.getPrintName() << "\"\n");
+  }
+}
+
 void FrameOptimizerPass::runOnFunctions(BinaryContext &BC) {
   if (opts::FrameOptimization == FOP_NONE)
     return;
@@ -278,6 +616,11 @@ void FrameOptimizerPass::runOnFunctions(BinaryContext &BC) {
     if (I.second.getKnownExecutionCount() == 0)
       continue;
 
+    if (opts::PromoteStackSlots) {
+      NamedRegionTimer T1("promoteslots", "promote stack slots", "FOP",
+                          "FOP breakdown", opts::TimeOpts);
+      promoteStackSlots(*RA, *FA, BC, I.second);
+    }
   }
 
   {
@@ -294,6 +637,16 @@ void FrameOptimizerPass::runOnFunctions(BinaryContext &BC) {
          << NumLoadsChangedToImm << " to use an immediate.\n"
          << "BOLT-INFO: FOP deleted " << NumLoadsDeleted << " load(s) and "
          << NumRedundantStores << " store(s).\n";
+  if (opts::PromoteStackSlots) {
+    outs() << "BOLT-INFO: FOP promoted " << NumSlotsPromoted
+           << " stack slot(s) to registers in hot loops, replacing "
+           << NumPromotedLoads << " load(s) and " << NumPromotedStores
+           << " store(s) with register moves.\n";
+  }
+  if (NumFunctionsOverBudget) {
+    outs() << "BOLT-INFO: time budget exhausted, skipped shrink wrapping in "
+           << NumFunctionsOverBudget.load() << " function(s)\n";
+  }
   FA->printStats();
   ShrinkWrapping::printStats();
 }
@@ -342,6 +695,13 @@ void FrameOptimizerPass::performShrinkWrapping(const RegAnalysis &RA,
 
   ParallelUtilities::WorkFuncWithAllocTy WorkFunction =
       [&](BinaryFunction &BF, MCPlusBuilder::AllocatorIdTy AllocatorId) {
+        // Functions are processed from the hottest with a time budget, so
+        // the ones left are the least important.
+        if (BC.isTimeBudgetExhausted()) {
+          ++NumFunctionsOverBudget;
+          return;
+        }
+
         DataflowInfoManager Info(BC, BF, &RA, &FA, AllocatorId);
         ShrinkWrapping SW(FA, BC, BF, Info, AllocatorId);
 
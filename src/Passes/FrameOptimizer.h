@@ -76,6 +76,21 @@ namespace bolt {
 /// are using (loading from) a stack position -- see StackReachingUses. If a
 /// store sees no use of the value it is storing, it is eliminated.
 ///
+/// Optionally, stack slots accessed in hot loops are promoted to caller-saved
+/// registers that are neither live nor touched anywhere in the loop, as shown
+/// by LivenessAnalysis and RegAnalysis. The slot is loaded into the register
+/// in the loop preheader, loads and stores of the slot in the loop become
+/// register moves, and the register is stored back at the loop exits:
+///
+///     preheader:  R11 <= MEM[FRAME - 0x5c]
+///     loop:       RAX <= R11                 // was RAX <= MEM[FRAME - 0x5c]
+///                 R11 <= RDX                 // was MEM[FRAME - 0x5c] <= RDX
+///     exit:       MEM[FRAME - 0x5c] <= R11
+///
+/// A slot is promoted only if all its accesses in the function are simple
+/// loads and stores that do not overlap with other accesses, and the profile
+/// shows that the loop executes more of its accesses than the added ones.
+///
 class FrameOptimizerPass : public BinaryFunctionPass {
   /// Stats aggregating variables
   uint64_t NumRedundantLoads{0};
@@ -83,6 +98,13 @@ class FrameOptimizerPass : public BinaryFunctionPass {
   uint64_t NumLoadsChangedToReg{0};
   uint64_t NumLoadsChangedToImm{0};
   uint64_t NumLoadsDeleted{0};
+  uint64_t NumSlotsPromoted{0};
+  uint64_t NumPromotedLoads{0};
+  uint64_t NumPromotedStores{0};
+
+  /// Number of functions left without shrink wrapping once the time budget
+  /// was spent.
+  std::atomic<uint64_t> NumFunctionsOverBudget{0};
 
   DenseSet<const BinaryFunction *> FuncsChanged;
 
@@ -101,6 +123,11 @@ class FrameOptimizerPass : public BinaryFunctionPass {
                           const BinaryContext &BC,
                           BinaryFunction &BF);
 
+  /// Promote stack slots accessed in hot loops of \p BF to free registers.
+  /// Frame accesses added to preheaders and exits are recorded in \p FA.
+  void promoteStackSlots(const RegAnalysis &RA, FrameAnalysis &FA,
+                         const BinaryContext &BC, BinaryFunction &BF);
+
   /// Perform shrinkwrapping step
   void performShrinkWrapping(const RegAnalysis &RA, const FrameAnalysis &FA,
                              BinaryContext &BC);
@@ -7,11 +7,12 @@
 //
 //===----------------------------------------------------------------------===//
 //
-// Cluster functions by hotness.  There are four clustering algorithms:
+// Cluster functions by hotness.  There are five clustering algorithms:
 // 1. clusterize
 // 2. HFsort+
-// 3. pettisAndHansen
-// 4. randomClusters
+// 3. cdsort
+// 4. pettisAndHansen
+// 5. randomClusters
 //
 // See original code in hphp/utils/hfsort.[h,cpp]
 //===----------------------------------------------------------------------===//
@@ -102,10 +103,32 @@ inline bool compareClustersDensity(const Cluster &C1, const Cluster &C2) {
  */
 std::vector<Cluster> clusterize(const CallGraph &Cg);
 
+/*
+ * Parameters of the i-TLB model and of the merging of hfsort+, which default
+ * to the values of the command-line options.
+ */
+struct HFSortPlusParams {
+  unsigned ITLBPageSize;
+  unsigned ITLBEntries;
+  double MergeProbability;
+  double ArcThreshold;
+
+  static HFSortPlusParams fromOptions();
+};
+
 /*
  * Optimize function placement prioritizing i-TLB and i-cache performance.
  */
-std::vector<Cluster> hfsortPlus(CallGraph &Cg);
+std::vector<Cluster>
+hfsortPlus(CallGraph &Cg,
+           const HFSortPlusParams &Params = HFSortPlusParams::fromOptions(),
+           bool PrintStats = true);
+
+/*
+ * Optimize function placement for distances of calls and returns with respect
+ * to i-cache and i-TLB, using the chain merging of ExtTSP.
+ */
+std::vector<Cluster> cdsort(const CallGraph &Cg);
 
 /*
  * Pettis-Hansen code layout algorithm
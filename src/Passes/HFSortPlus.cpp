@@ -25,6 +25,8 @@
 
 #include "BinaryFunction.h"
 #include "HFSort.h"
+#include "ParallelUtilities.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/Support/Options.h"
 
 #include <set>
@@ -39,6 +41,9 @@ using namespace bolt;
 namespace opts {
 
 extern cl::OptionCategory BoltOptCategory;
+extern cl::opt<bool> NoThreads;
+extern cl::opt<unsigned> ThreadCount;
+extern cl::opt<unsigned> TaskCount;
 
 cl::opt<unsigned>
 ITLBPageSize("itlb-page-size",
@@ -64,7 +69,7 @@ ITLBDensity("itlb-density",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
-static cl::opt<double>
+cl::opt<double>
 MergeProbability("merge-probability",
   cl::desc("The minimum probability of a call for merging two clusters"),
   cl::init(0.9),
@@ -72,7 +77,7 @@ MergeProbability("merge-probability",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
-static cl::opt<double>
+cl::opt<double>
 ArcThreshold("arc-threshold",
   cl::desc("The threshold for ignoring arcs with a small relative weight"),
   cl::init(0.00000001),
@@ -107,25 +112,27 @@ public:
   double density() const { return static_cast<double>(Samples) / Size; }
 
   Edge *getEdge(Chain *Other) const {
-    for (auto It : Edges) {
-      if (It.first == Other)
-        return It.second;
-    }
-    return nullptr;
+    auto It = EdgeIndex.find(Other);
+    return It != EdgeIndex.end() ? Edges[It->second].second : nullptr;
   }
 
+  /// Remove the edge to Other by moving the last edge to its place, which
+  /// keeps the order of edges deterministic.
   void removeEdge(Chain *Other) {
-    auto It = Edges.begin();
-    while (It != Edges.end()) {
-      if (It->first == Other) {
-        Edges.erase(It);
-        return;
-      }
-      It++;
+    auto It = EdgeIndex.find(Other);
+    if (It == EdgeIndex.end())
+      return;
+    const auto Index = It->second;
+    EdgeIndex.erase(It);
+    if (Index + 1 != Edges.size()) {
+      Edges[Index] = Edges.back();
+      EdgeIndex[Edges[Index].first] = Index;
     }
+    Edges.pop_back();
   }
 
   void addEdge(Chain *Other, Edge *Edge) {
+    EdgeIndex[Other] = Edges.size();
     Edges.push_back(std::make_pair(Other, Edge));
   }
 
@@ -140,6 +147,7 @@ public:
   void clear() {
     Nodes.clear();
     Edges.clear();
+    EdgeIndex.clear();
   }
 
 public:
@@ -154,6 +162,9 @@ public:
   std::vector<NodeId> Nodes;
   // Adjacent chains and corresponding edges (lists of arcs)
   std::vector<std::pair<Chain *, Edge *>> Edges;
+  // Positions of adjacent chains in Edges. Hub functions are adjacent to a
+  // large part of the call graph, so lookups must not scan the edges
+  DenseMap<Chain *, size_t> EdgeIndex;
 };
 
 // An edge in the call graph representing Arcs between two Chains.
@@ -169,6 +180,10 @@ public:
   explicit Edge(Chain *SrcChain_, Chain *DstChain_, const Arc *A)
       : SrcChain(SrcChain_), DstChain(DstChain_), Arcs(1, A) {}
 
+  Chain *srcChain() const { return SrcChain; }
+
+  Chain *dstChain() const { return DstChain; }
+
   void changeEndpoint(Chain *From, Chain *To) {
     if (From == SrcChain)
       SrcChain = To;
@@ -248,18 +263,25 @@ void Chain::mergeEdges(Chain *Other) {
 
 class HFSortPlus {
 public:
-  explicit HFSortPlus(const CallGraph &Cg) : Cg(Cg) { initialize(); }
+  HFSortPlus(const CallGraph &Cg, const HFSortPlusParams &Params,
+             bool PrintStats)
+    : Cg(Cg), Params(Params), PrintStats(PrintStats) {
+    initialize();
+  }
 
   /// Run the algorithm and return ordered set of function clusters.
   std::vector<Cluster> run() {
     // Pass 1
     runPassOne();
+    removeMergedChains();
 
     // Pass 2
     runPassTwo();
+    removeMergedChains();
 
-    outs() << "BOLT-INFO: hfsort+ reduced the number of chains from "
-           << Cg.numNodes() << " to " << HotChains.size() << "\n";
+    if (PrintStats)
+      outs() << "BOLT-INFO: hfsort+ reduced the number of chains from "
+             << Cg.numNodes() << " to " << HotChains.size() << "\n";
 
     // Sorting chains by density in decreasing order
     auto DensityComparator = [](const Chain *L, const Chain *R) {
@@ -314,7 +336,7 @@ private:
           continue;
         const auto &Arc = *Cg.findArc(F, Succ);
         if (Arc.weight() == 0.0 ||
-            Arc.weight() / TotalSamples < opts::ArcThreshold) {
+            Arc.weight() / TotalSamples < Params.ArcThreshold) {
           continue;
         }
 
@@ -354,7 +376,7 @@ private:
     }
 
     double P = PageSamples / TotalSamples;
-    return pow(1.0 - P, double(opts::ITLBEntries));
+    return pow(1.0 - P, double(Params.ITLBEntries));
   }
 
   /// The expected number of calls on different i-TLB pages for an arc of the
@@ -362,11 +384,11 @@ private:
   double expectedCalls(uint64_t SrcAddr, uint64_t DstAddr,
                        double Weight) const {
     uint64_t Dist = SrcAddr >= DstAddr ? SrcAddr - DstAddr : DstAddr - SrcAddr;
-    if (Dist >= opts::ITLBPageSize) {
+    if (Dist >= Params.ITLBPageSize) {
       return 0;
     }
 
-    double D = double(Dist) / double(opts::ITLBPageSize);
+    double D = double(Dist) / double(Params.ITLBPageSize);
     // Increasing the importance of shorter calls
     return (1.0 - D * D) * Weight;
   }
@@ -458,7 +480,7 @@ private:
 
         const auto &Arc = *Cg.findArc(F, Succ);
         if (Arc.weight() == 0.0 ||
-            Arc.weight() / TotalSamples < opts::ArcThreshold) {
+            Arc.weight() / TotalSamples < Params.ArcThreshold) {
           continue;
         }
 
@@ -475,7 +497,7 @@ private:
         const double ProbIn = CallsToSucc > 0 ? CallsPredSucc / CallsToSucc : 0;
         assert(0.0 <= ProbIn && ProbIn <= 1.0 && "incorrect in-probability");
 
-        if (std::min(ProbOut, ProbIn) >= opts::MergeProbability) {
+        if (std::min(ProbOut, ProbIn) >= Params.MergeProbability) {
           ArcsToMerge.push_back(&Arc);
         }
       }
@@ -516,25 +538,44 @@ private:
     };
     std::set<Edge *, decltype(GainComparator)> Queue(GainComparator);
 
-    // Inserting the edges Into the queue
+    // Computing the initial gains of all edges, which is independent for
+    // every edge and is done in parallel
+    std::vector<Edge *> Edges;
     for (auto ChainPred : HotChains) {
       for (auto EdgeIt : ChainPred->Edges) {
-        auto ChainSucc = EdgeIt.first;
-        auto ChainEdge = EdgeIt.second;
-        // Ignore loop edges
-        if (ChainPred == ChainSucc)
-          continue;
-        // Ignore already processed edges
-        if (ChainEdge->gain() != -1.0)
-          continue;
+        // Ignore loop edges and visit every edge from one of its chains
+        if (ChainPred->Id < EdgeIt.first->Id)
+          Edges.push_back(EdgeIt.second);
+      }
+    }
 
-        // Compute the gain of merging the two chains
+    auto computeGains = [&](size_t Begin, size_t End) {
+      for (size_t I = Begin; I < End; ++I) {
+        auto ChainEdge = Edges[I];
+        auto ChainPred = ChainEdge->srcChain();
+        auto ChainSucc = ChainEdge->dstChain();
         auto ForwardGain = mergeGain(ChainPred, ChainSucc, ChainEdge);
         auto BackwardGain = mergeGain(ChainSucc, ChainPred, ChainEdge);
         ChainEdge->setMergeGain(ChainPred, ForwardGain, BackwardGain);
-        if (ChainEdge->gain() > 0.0) {
-          Queue.insert(ChainEdge);
-        }
+      }
+    };
+    if (opts::NoThreads) {
+      computeGains(0, Edges.size());
+    } else {
+      auto &Pool = ParallelUtilities::getThreadPool();
+      const size_t BlockSize = std::max<size_t>(
+          1, Edges.size() / (opts::ThreadCount * opts::TaskCount));
+      for (size_t Begin = 0; Begin < Edges.size(); Begin += BlockSize) {
+        Pool.async(computeGains, Begin,
+                   std::min(Begin + BlockSize, Edges.size()));
+      }
+      Pool.wait();
+    }
+
+    // Inserting the edges Into the queue
+    for (auto ChainEdge : Edges) {
+      if (ChainEdge->gain() > 0.0) {
+        Queue.insert(ChainEdge);
       }
     }
 
@@ -579,36 +620,51 @@ private:
     }
   }
 
-  /// Merge chain From into chain Into and update the list of active chains.
+  /// Merge chain From into chain Into. Merged chains are removed from the
+  /// list of active chains by removeMergedChains().
   void mergeChains(Chain *Into, Chain *From) {
     assert(Into != From && "cannot merge a chain with itself");
-    Into->merge(From);
 
-    // Update the chains and addresses for functions merged from From
-    size_t CurAddr = 0;
-    for (auto F : Into->Nodes) {
+    // Short calls of the merged chain are the ones of the two chains and the
+    // short calls between them, as concatenation preserves the distances
+    // within the chains
+    auto *ChainEdge = Into->getEdge(From);
+    Into->ShortCalls = ChainEdge ? shortCalls(Into, From, ChainEdge)
+                                 : Into->ShortCalls + From->ShortCalls;
+
+    // Update the chains and addresses for functions merged from From, which
+    // are placed after the functions of Into
+    for (auto F : From->Nodes) {
       NodeChain[F] = Into;
-      Addr[F] = CurAddr;
-      CurAddr += Cg.size(F);
+      Addr[F] += Into->Size;
     }
+    Into->merge(From);
 
     // Merge edges
     Into->mergeEdges(From);
     From->clear();
 
-    // Update cached scores for the new chain
-    Into->ShortCalls = shortCalls(Into);
+    // Update cached score for the new chain
     Into->Score = score(Into);
+  }
 
-    // Remove chain From From the list of active chains
-    auto it = std::remove(HotChains.begin(), HotChains.end(), From);
-    HotChains.erase(it, HotChains.end());
+  /// Remove chains merged into other chains from the list of active chains.
+  void removeMergedChains() {
+    auto It = std::remove_if(HotChains.begin(), HotChains.end(),
+                             [](const Chain *C) { return C->Nodes.empty(); });
+    HotChains.erase(It, HotChains.end());
   }
 
 private:
   // The call graph
   const CallGraph &Cg;
 
+  // Parameters of the algorithm
+  const HFSortPlusParams Params;
+
+  // Whether to report the number of chains
+  const bool PrintStats;
+
   // All chains of functions
   std::vector<Chain> AllChains;
 
@@ -635,12 +691,22 @@ private:
 
 } // end anonymous namespace
 
-std::vector<Cluster> hfsortPlus(CallGraph &Cg) {
+HFSortPlusParams HFSortPlusParams::fromOptions() {
+  HFSortPlusParams Params;
+  Params.ITLBPageSize = opts::ITLBPageSize;
+  Params.ITLBEntries = opts::ITLBEntries;
+  Params.MergeProbability = opts::MergeProbability;
+  Params.ArcThreshold = opts::ArcThreshold;
+  return Params;
+}
+
+std::vector<Cluster> hfsortPlus(CallGraph &Cg, const HFSortPlusParams &Params,
+                                bool PrintStats) {
   // It is required that the sum of incoming arc weights is not greater
   // than the number of samples for every function.
   // Ensuring the call graph obeys the property before running the algorithm.
   Cg.adjustArcWeights();
-  return HFSortPlus(Cg).run();
+  return HFSortPlus(Cg, Params, PrintStats).run();
 }
 
 } // namespace bolt
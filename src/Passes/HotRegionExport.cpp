@@ -0,0 +1,336 @@
+//===--- Passes/HotRegionExport.cpp - Hot code for external optimizers ----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes/HotRegionExport.h"
+#include "Passes/BinaryFunctionCallGraph.h"
+#include "Passes/DataflowInfoManager.h"
+#include "Passes/RegAnalysis.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/MC/MCDisassembler/MCDisassembler.h"
+#include "llvm/MC/MCInstPrinter.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Options.h"
+#include "llvm/Support/Path.h"
+#include <algorithm>
+
+#define DEBUG_TYPE "hot-region-export"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory StokeOptCategory;
+
+static cl::opt<std::string>
+ExportHotRegions("export-hot-regions",
+  cl::desc("write the hottest straight-line regions of code as standalone "
+           "assembly with their live-in and live-out registers to the given "
+           "directory, for a superoptimizer"),
+  cl::value_desc("dir"),
+  cl::ZeroOrMore,
+  cl::cat(StokeOptCategory));
+
+static cl::opt<unsigned>
+ExportHotRegionsCount("export-hot-regions-count",
+  cl::desc("number of regions written by -export-hot-regions"),
+  cl::init(50),
+  cl::ZeroOrMore,
+  cl::cat(StokeOptCategory));
+
+static cl::opt<unsigned>
+HotRegionMinSize("hot-region-min-size",
+  cl::desc("minimum number of instructions in a region exported by "
+           "-export-hot-regions"),
+  cl::init(3),
+  cl::ZeroOrMore,
+  cl::cat(StokeOptCategory));
+
+static cl::opt<std::string>
+ImportHotRegions("import-hot-regions",
+  cl::desc("replace regions exported by -export-hot-regions with the "
+           "optimized code from the given file"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(StokeOptCategory));
+
+} // namespace opts
+
+namespace {
+
+/// Print the registers set in \p Regs, omitting the ones covered by a super
+/// register in the set.
+void printRegisters(raw_ostream &OS, const BinaryContext &BC,
+                    const BitVector &Regs) {
+  const char *Sep = "";
+  for (int Reg = Regs.find_first(); Reg != -1; Reg = Regs.find_next(Reg)) {
+    bool HasSuperReg = false;
+    for (MCSuperRegIterator SR(Reg, BC.MRI.get()); SR.isValid(); ++SR) {
+      if (Regs[*SR]) {
+        HasSuperReg = true;
+        break;
+      }
+    }
+    if (HasSuperReg)
+      continue;
+    OS << Sep << '%' << StringRef(BC.MRI->getName(Reg)).lower();
+    Sep = " ";
+  }
+}
+
+} // end anonymous namespace
+
+bool HotRegionExport::isEnabled() {
+  return !opts::ExportHotRegions.empty() || !opts::ImportHotRegions.empty();
+}
+
+bool HotRegionExport::isRegionInstruction(const BinaryContext &BC,
+                                          const BinaryFunction &BF,
+                                          const MCInst &Inst) const {
+  const auto &MIB = *BC.MIB;
+  if (MIB.isPseudo(Inst) || MIB.isCFI(Inst) || MIB.isPrefix(Inst) ||
+      MIB.isBranch(Inst) || MIB.isCall(Inst) || MIB.isReturn(Inst) ||
+      MIB.isTerminator(Inst) || MIB.isInvoke(Inst) ||
+      MIB.hasPCRelOperand(Inst))
+    return false;
+
+  // Symbolic operands would need relocations in the standalone code.
+  for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E; ++I)
+    if (Inst.getOperand(I).isExpr())
+      return false;
+  return true;
+}
+
+size_t HotRegionExport::computeRegionHash(const BinaryBasicBlock &BB,
+                                          unsigned Index,
+                                          unsigned Size) const {
+  size_t Hash = hash_combine(Size);
+  for (auto I = BB.begin() + Index, E = I + Size; I != E; ++I)
+    Hash = hash_combine(Hash, I->getOpcode());
+  return Hash;
+}
+
+void HotRegionExport::exportRegions(BinaryContext &BC) {
+  // Collect the longest runs of region instructions in every block with
+  // profile.
+  std::vector<Region> Regions;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &BF = BFI.second;
+    if (!BF.isSimple() || !BF.hasValidProfile() || !shouldOptimize(BF))
+      continue;
+    for (auto *BB : BF.layout()) {
+      const auto ExecCount = BB->getKnownExecutionCount();
+      if (!ExecCount)
+        continue;
+      unsigned Start = 0;
+      for (unsigned I = 0, E = BB->size(); I <= E; ++I) {
+        if (I < E && isRegionInstruction(BC, BF, *(BB->begin() + I)))
+          continue;
+        if (I - Start >= opts::HotRegionMinSize)
+          Regions.push_back(
+              Region{&BF, BB, Start, I - Start, ExecCount * (I - Start), 0});
+        Start = I + 1;
+      }
+    }
+  }
+
+  std::stable_sort(Regions.begin(), Regions.end(),
+                   [](const Region &A, const Region &B) {
+                     return A.Weight > B.Weight;
+                   });
+  if (Regions.size() > opts::ExportHotRegionsCount)
+    Regions.resize(opts::ExportHotRegionsCount);
+  for (unsigned I = 0; I < Regions.size(); ++I)
+    Regions[I].Id = I;
+
+  if (auto EC = sys::fs::create_directories(opts::ExportHotRegions)) {
+    errs() << "BOLT-ERROR: cannot create directory " << opts::ExportHotRegions
+           << ": " << EC.message() << '\n';
+    exit(1);
+  }
+  auto openFile = [&](const Twine &Name) {
+    SmallString<128> Path(opts::ExportHotRegions);
+    sys::path::append(Path, Name);
+    std::error_code EC;
+    auto OS = llvm::make_unique<raw_fd_ostream>(Path, EC, sys::fs::F_None);
+    if (EC) {
+      errs() << "BOLT-ERROR: cannot open " << Path << ": " << EC.message()
+             << '\n';
+      exit(1);
+    }
+    return OS;
+  };
+
+  // Liveness is computed once for every function with an exported region.
+  auto CG = buildCallGraph(BC);
+  RegAnalysis RA(BC, &BC.getBinaryFunctions(), &CG);
+  std::stable_sort(Regions.begin(), Regions.end(),
+                   [](const Region &A, const Region &B) {
+                     return A.Function->getAddress() <
+                            B.Function->getAddress();
+                   });
+  std::vector<std::pair<unsigned, std::string>> Lines;
+  for (auto I = Regions.begin(), E = Regions.end(); I != E;) {
+    auto &BF = *I->Function;
+    DataflowInfoManager DInfo(BC, BF, &RA, nullptr);
+    auto &LA = DInfo.getLivenessAnalysis();
+    for (; I != E && I->Function == &BF; ++I) {
+      const auto &R = *I;
+      const auto Id = R.Id;
+      const auto First = R.BB->begin() + R.Index;
+      const auto Last = First + R.Size;
+      BitVector LiveIn = *LA.getStateAt(*First);
+      BitVector LiveOut =
+          Last == R.BB->end() ? *LA.getStateAt(*R.BB) : *LA.getStateAt(*Last);
+
+      auto OS = openFile("region-" + Twine(Id) + ".s");
+      *OS << "  # " << BF.getPrintName() << ", block " << R.BB->getName()
+          << ", executed " << R.BB->getKnownExecutionCount() << " times\n"
+          << "  .text\n"
+          << "  .globl region_" << Id << '\n'
+          << "  .type region_" << Id << ", @function\n"
+          << "region_" << Id << ":\n";
+      for (auto II = First; II != Last; ++II) {
+        BC.InstPrinter->printInst(&*II, *OS, "", *BC.STI);
+        *OS << '\n';
+      }
+      *OS << "  retq\n"
+          << "  .size region_" << Id << ", .-region_" << Id << '\n';
+
+      std::string Line;
+      raw_string_ostream LineOS(Line);
+      LineOS << "0x" << Twine::utohexstr(BF.getAddress()) << ','
+             << R.BB->getIndex() << ',' << R.Index << ',' << R.Size << ",0x"
+             << Twine::utohexstr(computeRegionHash(*R.BB, R.Index, R.Size))
+             << ',' << Id << ',' << R.Weight << ',';
+      printRegisters(LineOS, BC, LiveIn);
+      LineOS << ',';
+      printRegisters(LineOS, BC, LiveOut);
+      LineOS << ",\"";
+      LineOS.write_escaped(BF.getPrintName());
+      LineOS << '"';
+      Lines.emplace_back(Id, LineOS.str());
+    }
+  }
+
+  std::sort(Lines.begin(), Lines.end());
+  auto OS = openFile("regions.csv");
+  *OS << "address,block,index,size,hash,region,weight,live_in,live_out,"
+         "function\n";
+  for (const auto &Line : Lines)
+    *OS << Line.second << '\n';
+
+  outs() << "BOLT-INFO: exported " << Regions.size() << " hot regions to "
+         << opts::ExportHotRegions << '\n';
+}
+
+void HotRegionExport::importRegions(BinaryContext &BC) {
+  auto MB = MemoryBuffer::getFileOrSTDIN(opts::ImportHotRegions);
+  if (auto EC = MB.getError()) {
+    errs() << "BOLT-ERROR: cannot read " << opts::ImportHotRegions << ": "
+           << EC.message() << '\n';
+    exit(1);
+  }
+
+  uint64_t NumImported = 0;
+  uint64_t NumRejected = 0;
+  auto reject = [&](const line_iterator &LI, const Twine &Reason) {
+    errs() << "BOLT-WARNING: " << opts::ImportHotRegions << ':'
+           << LI.line_number() << ": " << Reason
+           << ", region is left intact\n";
+    ++NumRejected;
+  };
+  for (line_iterator LI(*MB.get(), /*SkipBlanks=*/true, '#'); !LI.is_at_eof();
+       ++LI) {
+    SmallVector<StringRef, 6> Fields;
+    LI->split(Fields, ',');
+    uint64_t Address, BBIndex, Index, Size, Hash;
+    if (Fields.size() < 6 || Fields[0].getAsInteger(0, Address) ||
+        Fields[1].getAsInteger(10, BBIndex) ||
+        Fields[2].getAsInteger(10, Index) ||
+        Fields[3].getAsInteger(10, Size) ||
+        Fields[4].getAsInteger(0, Hash)) {
+      if (LI.line_number() != 1 || !LI->startswith("address,"))
+        reject(LI, "expected <address>,<block>,<index>,<size>,<hash>,"
+                   "<bytes>");
+      continue;
+    }
+
+    auto *BF = BC.getBinaryFunctionAtAddress(Address);
+    BinaryBasicBlock *BB = nullptr;
+    if (BF && BF->isSimple())
+      for (auto &Block : *BF)
+        if (Block.getIndex() == BBIndex)
+          BB = &Block;
+    if (!BB || !Size || Index + Size > BB->size() ||
+        computeRegionHash(*BB, Index, Size) != Hash) {
+      reject(LI, "region does not match the code");
+      continue;
+    }
+
+    std::string Bytes;
+    StringRef Hex = Fields.back().trim();
+    if (Hex.size() % 2 || Hex.find_first_not_of("0123456789abcdefABCDEF") !=
+                              StringRef::npos) {
+      reject(LI, "expected replacement code in hex");
+      continue;
+    }
+    for (size_t I = 0; I < Hex.size(); I += 2)
+      Bytes.push_back(static_cast<char>(hexFromNibbles(Hex[I], Hex[I + 1])));
+
+    // The replacement has to stay straight-line code.
+    std::vector<MCInst> Replacement;
+    const ArrayRef<uint8_t> Code(
+        reinterpret_cast<const uint8_t *>(Bytes.data()), Bytes.size());
+    bool IsValid = true;
+    for (uint64_t Offset = 0; Offset < Code.size() && IsValid;) {
+      MCInst Inst;
+      uint64_t InstSize;
+      IsValid = BC.DisAsm->getInstruction(Inst, InstSize, Code.slice(Offset),
+                                          Offset, nulls(), nulls()) &&
+                InstSize && isRegionInstruction(BC, *BF, Inst);
+      Replacement.push_back(Inst);
+      Offset += InstSize;
+    }
+    if (!IsValid) {
+      reject(LI, "replacement is not straight-line code");
+      continue;
+    }
+
+    DEBUG(dbgs() << "BOLT-DEBUG: replacing " << Size << " instructions in "
+                 << BB->getName() << " of " << BF->getPrintName() << " with "
+                 << Replacement.size() << '\n');
+    for (unsigned I = 1; I < Size; ++I)
+      BB->eraseInstruction(BB->begin() + Index + 1);
+    BB->replaceInstruction(BB->begin() + Index, Replacement);
+    ++NumImported;
+  }
+
+  outs() << "BOLT-INFO: imported " << NumImported << " optimized regions";
+  if (NumRejected)
+    outs() << ", rejected " << NumRejected;
+  outs() << '\n';
+}
+
+void HotRegionExport::runOnFunctions(BinaryContext &BC) {
+  if (!BC.isX86()) {
+    errs() << "BOLT-WARNING: hot regions can only be exported and imported on "
+              "X86\n";
+    return;
+  }
+  if (!opts::ImportHotRegions.empty())
+    importRegions(BC);
+  if (!opts::ExportHotRegions.empty())
+    exportRegions(BC);
+}
@@ -0,0 +1,77 @@
+//===--- Passes/HotRegionExport.h - Hot code for external optimizers ------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_HOT_REGION_EXPORT_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_HOT_REGION_EXPORT_H
+
+#include "BinaryPasses.h"
+
+namespace llvm {
+namespace bolt {
+
+/// Generalization of StokeInfo to regions of code smaller than a function.
+/// With -export-hot-regions=<dir>, the hottest straight-line sequences of
+/// instructions within basic blocks, ranked by the number of instructions
+/// they executed in the profile, are written to <dir>/region-<N>.s as
+/// standalone functions for a superoptimizer such as STOKE. The registers
+/// live on entry and on exit of every region are listed in <dir>/regions.csv.
+///
+/// With -import-hot-regions=<file>, the regions are replaced by optimized
+/// code. Every line of the file starts with the location of a region, copied
+/// from the first columns of regions.csv, and ends with the machine code of
+/// the replacement in hex:
+///
+///   <address>,<block>,<index>,<size>,<hash>,<hex bytes>
+///
+/// Both options need to be used with the same input and the same options
+/// otherwise. Regions that do not match the exported code are left intact.
+class HotRegionExport : public BinaryFunctionPass {
+  /// Location of a region of code in a basic block.
+  struct Region {
+    BinaryFunction *Function;
+    BinaryBasicBlock *BB;
+    unsigned Index;
+    unsigned Size;
+    uint64_t Weight;
+    unsigned Id;
+  };
+
+  /// Return true if \p Inst can be part of a region.
+  bool isRegionInstruction(const BinaryContext &BC, const BinaryFunction &BF,
+                           const MCInst &Inst) const;
+
+  /// Return a hash of the opcodes of \p Size instructions of \p BB starting
+  /// at \p Index, to check that an imported region matches its export.
+  size_t computeRegionHash(const BinaryBasicBlock &BB, unsigned Index,
+                           unsigned Size) const;
+
+  void exportRegions(BinaryContext &BC);
+
+  void importRegions(BinaryContext &BC);
+
+public:
+  explicit HotRegionExport(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "hot-region-export";
+  }
+
+  /// Return true if regions are exported or imported.
+  static bool isEnabled();
+
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
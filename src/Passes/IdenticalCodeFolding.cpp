@@ -11,11 +11,14 @@
 
 #include "Passes/IdenticalCodeFolding.h"
 #include "ParallelUtilities.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/Support/Options.h"
 #include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/Timer.h"
 #include <atomic>
 #include <map>
+#include <mutex>
 #include <set>
 #include <unordered_map>
 
@@ -329,76 +332,97 @@ typedef std::unordered_map<BinaryFunction *, std::set<BinaryFunction *>,
                            KeyHash, KeyCongruent>
     CongruentBucketsMap;
 
+typedef std::vector<std::set<BinaryFunction *>> CongruentBucketsList;
+
 typedef std::unordered_map<BinaryFunction *, std::vector<BinaryFunction *>,
                            KeyHash, KeyEqual>
     IdenticalBucketsMap;
 
-std::string hashInteger(uint64_t Value) {
-  std::string HashString;
-  if (Value == 0) {
-    HashString.push_back(0);
-  }
-  while (Value) {
-    uint8_t LSB = Value & 0xff;
-    HashString.push_back(LSB);
-    Value >>= 8;
-  }
-
-  return HashString;
-}
-
-std::string hashSymbol(BinaryContext &BC, const MCSymbol &Symbol) {
-  std::string HashString;
-
+size_t hashSymbol(BinaryContext &BC, const MCSymbol &Symbol) {
   // Ignore function references.
   if (BC.getFunctionForSymbol(&Symbol))
-    return HashString;
+    return 0;
 
   auto ErrorOrValue = BC.getSymbolValue(Symbol);
   if (!ErrorOrValue)
-    return HashString;
+    return 0;
 
   // Ignore jump table references.
   if (BC.getJumpTableContainingAddress(*ErrorOrValue))
-    return HashString;
+    return 0;
 
-  return HashString.append(hashInteger(*ErrorOrValue));
+  return hash_value(*ErrorOrValue);
 }
 
-std::string hashExpr(BinaryContext &BC, const MCExpr &Expr) {
+size_t hashExpr(BinaryContext &BC, const MCExpr &Expr) {
   switch (Expr.getKind()) {
   case MCExpr::Constant:
-    return hashInteger(cast<MCConstantExpr>(Expr).getValue());
+    return hash_value(cast<MCConstantExpr>(Expr).getValue());
   case MCExpr::SymbolRef:
     return hashSymbol(BC, cast<MCSymbolRefExpr>(Expr).getSymbol());
   case MCExpr::Unary: {
     const auto &UnaryExpr = cast<MCUnaryExpr>(Expr);
-    return hashInteger(UnaryExpr.getOpcode())
-        .append(hashExpr(BC, *UnaryExpr.getSubExpr()));
+    return hash_combine(UnaryExpr.getOpcode(),
+                        hashExpr(BC, *UnaryExpr.getSubExpr()));
   }
   case MCExpr::Binary: {
     const auto &BinaryExpr = cast<MCBinaryExpr>(Expr);
-    return hashExpr(BC, *BinaryExpr.getLHS())
-        .append(hashInteger(BinaryExpr.getOpcode()))
-        .append(hashExpr(BC, *BinaryExpr.getRHS()));
+    return hash_combine(hashExpr(BC, *BinaryExpr.getLHS()),
+                        BinaryExpr.getOpcode(),
+                        hashExpr(BC, *BinaryExpr.getRHS()));
   }
   case MCExpr::Target:
-    return std::string();
+    return 0;
   }
 
   llvm_unreachable("invalid expression kind");
 }
 
-std::string hashInstOperand(BinaryContext &BC, const MCOperand &Operand) {
+/// Add functions referenced from \p Expr to \p Functions.
+void collectFunctionRefs(BinaryContext &BC, const MCExpr &Expr,
+                         SmallPtrSetImpl<const BinaryFunction *> &Functions) {
+  switch (Expr.getKind()) {
+  case MCExpr::SymbolRef:
+    if (auto *BF = BC.getFunctionForSymbol(
+            &cast<MCSymbolRefExpr>(Expr).getSymbol()))
+      Functions.insert(BF);
+    break;
+  case MCExpr::Unary:
+    collectFunctionRefs(BC, *cast<MCUnaryExpr>(Expr).getSubExpr(), Functions);
+    break;
+  case MCExpr::Binary:
+    collectFunctionRefs(BC, *cast<MCBinaryExpr>(Expr).getLHS(), Functions);
+    collectFunctionRefs(BC, *cast<MCBinaryExpr>(Expr).getRHS(), Functions);
+    break;
+  default:
+    break;
+  }
+}
+
+/// Run \p Task for every index below \p NumTasks, on the thread pool unless
+/// threads are disabled.
+void runTasks(size_t NumTasks, std::function<void(size_t)> Task) {
+  if (opts::NoThreads) {
+    for (size_t I = 0; I < NumTasks; ++I)
+      Task(I);
+    return;
+  }
+  ThreadPool &Pool = ParallelUtilities::getThreadPool();
+  for (size_t I = 0; I < NumTasks; ++I)
+    Pool.async(Task, I);
+  Pool.wait();
+}
+
+size_t hashInstOperand(BinaryContext &BC, const MCOperand &Operand) {
   if (Operand.isImm()) {
-    return hashInteger(Operand.getImm());
+    return hash_value(Operand.getImm());
   } else if (Operand.isReg()) {
-    return hashInteger(Operand.getReg());
+    return hash_value(Operand.getReg());
   } else if (Operand.isExpr()) {
     return hashExpr(BC, *Operand.getExpr());
   }
 
-  return std::string();
+  return 0;
 }
 
 } // namespace
@@ -407,13 +431,18 @@ namespace llvm {
 namespace bolt {
 
 void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC) {
+  if (BC.isTimeBudgetExhausted()) {
+    outs() << "BOLT-INFO: time budget exhausted, skipping ICF\n";
+    return;
+  }
+
   const auto OriginalFunctionCount = BC.getBinaryFunctions().size();
   uint64_t NumFunctionsFolded{0};
   std::atomic<uint64_t> NumJTFunctionsFolded{0};
   std::atomic<uint64_t> BytesSavedEstimate{0};
   std::atomic<uint64_t> CallsSavedEstimate{0};
   std::atomic<uint64_t> NumFoldedLastIteration{0};
-  CongruentBucketsMap CongruentBuckets;
+  CongruentBucketsList CongruentBuckets;
 
   // Hash all the functions
   auto hashFunctions = [&]() {
@@ -441,19 +470,106 @@ void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC) {
   };
 
   // Creates buckets with congruent functions - functions that potentially
-  // could  be folded.
+  // could  be folded. Only functions with the same hash are compared, so
+  // groups of functions with the same hash are split into buckets in parallel.
   auto createCongruentBuckets = [&]() {
     NamedRegionTimer CongruentBucketsTimer("congruent buckets",
                                            "congruent buckets", "ICF breakdown",
                                            "ICF breakdown", opts::TimeICF);
+    std::unordered_map<size_t, std::vector<BinaryFunction *>> HashGroups;
     for (auto &BFI : BC.getBinaryFunctions()) {
       auto &BF = BFI.second;
       if (!this->shouldOptimize(BF))
         continue;
-      CongruentBuckets[&BF].emplace(&BF);
+      HashGroups[BF.getHash()].push_back(&BF);
+    }
+
+    // Functions alone in their group cannot be folded.
+    std::vector<std::vector<BinaryFunction *> *> Groups;
+    for (auto &HashGroup : HashGroups) {
+      if (HashGroup.second.size() > 1)
+        Groups.push_back(&HashGroup.second);
+    }
+
+    std::vector<CongruentBucketsList> GroupBuckets(Groups.size());
+    auto splitGroup = [&](size_t GroupId) {
+      CongruentBucketsMap Buckets;
+      for (auto *BF : *Groups[GroupId])
+        Buckets[BF].emplace(BF);
+      for (auto &Bucket : Buckets) {
+        if (Bucket.second.size() > 1)
+          GroupBuckets[GroupId].emplace_back(std::move(Bucket.second));
+      }
+    };
+
+    runTasks(Groups.size(), splitGroup);
+
+    for (auto &Buckets : GroupBuckets) {
+      for (auto &Bucket : Buckets)
+        CongruentBuckets.emplace_back(std::move(Bucket));
+    }
+  };
+
+  // A bucket could only get new identical functions after a function
+  // referenced from the bucket is folded. For every referenced function,
+  // record the buckets that have to be examined again once it is folded.
+  std::unordered_map<const BinaryFunction *, std::vector<size_t>>
+      ReferencingBuckets;
+  auto collectReferences = [&]() {
+    std::vector<std::vector<const BinaryFunction *>> BucketRefs(
+        CongruentBuckets.size());
+    runTasks(CongruentBuckets.size(), [&](size_t BucketId) {
+      SmallPtrSet<const BinaryFunction *, 16> Refs;
+      for (auto *BF : CongruentBuckets[BucketId]) {
+        for (auto *BB : BF->layout()) {
+          for (auto &Inst : *BB) {
+            for (int I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E;
+                 ++I) {
+              if (Inst.getOperand(I).isExpr())
+                collectFunctionRefs(BC, *Inst.getOperand(I).getExpr(), Refs);
+            }
+          }
+        }
+      }
+      BucketRefs[BucketId].assign(Refs.begin(), Refs.end());
+    });
+
+    for (size_t BucketId = 0; BucketId < BucketRefs.size(); ++BucketId) {
+      for (auto *BF : BucketRefs[BucketId])
+        ReferencingBuckets[BF].push_back(BucketId);
     }
   };
 
+  // Buckets to examine in the next folding pass, and functions folded by the
+  // last pass.
+  std::vector<bool> IsBucketDirty;
+  std::vector<const BinaryFunction *> FoldedFunctions;
+  std::mutex FoldedFunctionsLock;
+
+  // Mark buckets referencing functions folded by the last pass. References
+  // to a folded function now resolve to the function it was folded into,
+  // which inherits the buckets.
+  auto markDirtyBuckets = [&]() {
+    IsBucketDirty.assign(CongruentBuckets.size(), false);
+    for (auto *BF : FoldedFunctions) {
+      auto RBI = ReferencingBuckets.find(BF);
+      if (RBI == ReferencingBuckets.end())
+        continue;
+      auto Buckets = std::move(RBI->second);
+      ReferencingBuckets.erase(RBI);
+      for (auto BucketId : Buckets)
+        IsBucketDirty[BucketId] = true;
+
+      const auto *Parent = BF->getFoldedIntoFunction();
+      while (Parent->isFolded())
+        Parent = Parent->getFoldedIntoFunction();
+      auto &ParentBuckets = ReferencingBuckets[Parent];
+      ParentBuckets.insert(ParentBuckets.end(), Buckets.begin(),
+                           Buckets.end());
+    }
+    FoldedFunctions.clear();
+  };
+
   // Partition each set of congruent functions into sets of identical functions
   // and fold them
   auto performFoldingPass = [&]() {
@@ -511,6 +627,10 @@ void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC) {
           BC.foldFunction(*ChildBF, *ParentBF);
 
           ++NumFoldedLastIteration;
+          {
+            std::lock_guard<std::mutex> Lock(FoldedFunctionsLock);
+            FoldedFunctions.push_back(ChildBF);
+          }
 
           if (ParentBF->hasJumpTables())
             ++NumJTFunctionsFolded;
@@ -521,10 +641,12 @@ void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC) {
     };
 
     // Create a task for each congruent bucket
-    for (auto &Entry : CongruentBuckets) {
-      auto &Bucket = Entry.second;
-      if (Bucket.size() < 2)
+    uint64_t NumBucketsExamined = 0;
+    for (size_t BucketId = 0; BucketId < CongruentBuckets.size(); ++BucketId) {
+      auto &Bucket = CongruentBuckets[BucketId];
+      if (Bucket.size() < 2 || !IsBucketDirty[BucketId])
         continue;
+      ++NumBucketsExamined;
 
       if (opts::NoThreads)
         processSingleBucket(Bucket);
@@ -535,29 +657,41 @@ void IdenticalCodeFolding::runOnFunctions(BinaryContext &BC) {
     if (!opts::NoThreads)
       ThPool->wait();
 
+    DEBUG(dbgs() << "BOLT-DEBUG: examined " << NumBucketsExamined << " of "
+                 << CongruentBuckets.size() << " congruent buckets\n");
     DEBUG(SinglePass.stopTimer());
   };
 
   hashFunctions();
   createCongruentBuckets();
+  collectReferences();
+  IsBucketDirty.assign(CongruentBuckets.size(), true);
 
   unsigned Iteration = 1;
-  // We repeat the pass until no new modifications happen.
+  bool IsOverBudget = false;
+  // We repeat the pass until no new modifications happen or the time budget
+  // is spent.
   do {
     NumFoldedLastIteration = 0;
     DEBUG(dbgs() << "BOLT-DEBUG: ICF iteration " << Iteration << "...\n");
 
     performFoldingPass();
+    markDirtyBuckets();
 
     NumFunctionsFolded += NumFoldedLastIteration;
     ++Iteration;
 
-  } while (NumFoldedLastIteration > 0);
+    IsOverBudget = NumFoldedLastIteration > 0 && BC.isTimeBudgetExhausted();
+  } while (NumFoldedLastIteration > 0 && !IsOverBudget);
+
+  if (IsOverBudget) {
+    outs() << "BOLT-INFO: time budget exhausted, stopped ICF after "
+           << (Iteration - 1) << " passes\n";
+  }
 
    DEBUG(
     // Print functions that are congruent but not identical.
-    for (auto &CBI : CongruentBuckets) {
-      auto &Candidates = CBI.second;
+    for (auto &Candidates : CongruentBuckets) {
       if (Candidates.size() < 2)
         continue;
       dbgs() << "BOLT-DEBUG: the following " << Candidates.size()
@@ -11,6 +11,7 @@
 
 #include "IndirectCallPromotion.h"
 #include "DataflowInfoManager.h"
+#include "llvm/ADT/DenseSet.h"
 #include "llvm/Support/Options.h"
 #include <numeric>
 
@@ -26,6 +27,7 @@ extern cl::OptionCategory BoltOptCategory;
 
 extern cl::opt<unsigned> Verbosity;
 extern cl::opt<unsigned> ExecutionCountThreshold;
+extern cl::opt<bool> InsertRetpolines;
 
 cl::opt<IndirectCallPromotionType>
 IndirectCallPromotion("indirect-call-promotion",
@@ -59,6 +61,27 @@ ICPJTTotalPercentThreshold(
     cl::Hidden,
     cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+ICPJTCoverage(
+    "icp-jump-tables-coverage",
+    cl::desc("promote the hottest jump table targets until they cover this "
+             "percentage of the jumps, instead of checking every target "
+             "against the per-target thresholds. 0 = off"),
+    cl::init(0),
+    cl::ZeroOrMore,
+    cl::Hidden,
+    cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+ICPJTMaxCompares(
+    "icp-jump-tables-max-compares",
+    cl::desc("maximum number of compares emitted for a jump table with "
+             "-icp-jump-tables-coverage"),
+    cl::init(8),
+    cl::ZeroOrMore,
+    cl::Hidden,
+    cl::cat(BoltOptCategory));
+
 static cl::opt<unsigned>
 ICPCallsRemainingPercentThreshold(
     "icp-calls-remaining-percent-threshold",
@@ -79,6 +102,26 @@ ICPCallsTotalPercentThreshold(
     cl::Hidden,
     cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+ICPRetpolineRemainingPercentThreshold(
+    "icp-retpoline-remaining-percent-threshold",
+    cl::desc("The percentage threshold against remaining unpromoted indirect "
+             "call count for the promotion for calls that will be retpolined"),
+    cl::init(10),
+    cl::ZeroOrMore,
+    cl::Hidden,
+    cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+ICPRetpolineTotalPercentThreshold(
+    "icp-retpoline-total-percent-threshold",
+    cl::desc("The percentage threshold against total count for the promotion "
+             "for calls that will be retpolined"),
+    cl::init(5),
+    cl::ZeroOrMore,
+    cl::Hidden,
+    cl::cat(BoltOptCategory));
+
 static cl::opt<unsigned>
 IndirectCallPromotionMispredictThreshold(
     "indirect-call-promotion-mispredict-threshold",
@@ -152,6 +195,17 @@ ICPFuncsList("icp-funcs",
              cl::Hidden,
              cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+ICPVtableRelocs(
+    "icp-vtable-relocs",
+    cl::desc("find vtables of promoted methods from data relocations, so "
+             "method loads are eliminated even without memory samples for the "
+             "vtables at the callsite (requires -relocs)"),
+    cl::init(false),
+    cl::ZeroOrMore,
+    cl::Hidden,
+    cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 ICPOldCodeSequence(
     "icp-old-code-sequence",
@@ -329,7 +383,7 @@ IndirectCallPromotion::getCallTargets(
       return Targets;
     }
     auto ICSP =
-      BC.MIB->tryGetAnnotationAs<IndirectCallSiteProfile>(Inst, "CallProfile");
+      BC.MIB->tryGetAnnotationAs(Inst, MCPlus::CallProfileAnnotation);
     if (ICSP) {
       for (const auto &CSP : ICSP.get()) {
         Callsite Site(BF, CSP);
@@ -540,7 +594,8 @@ IndirectCallPromotion::maybeGetHotJumpTableTargets(
       }
     });
 
-  BC.MIB->getOrCreateAnnotationAs<uint16_t>(CallInst, "JTIndexReg") = IndexReg;
+  BC.MIB->getOrCreateAnnotationAs(CallInst, MCPlus::JTIndexRegAnnotation) =
+      IndexReg;
 
   TargetFetchInst = MemLocInstr;
 
@@ -608,14 +663,22 @@ IndirectCallPromotion::findCallTargetSymbols(
       size_t I{0};
       for (; I < HotTargets.size(); ++I) {
         const auto MemAccesses = HotTargets[I].first;
-        if (100 * MemAccesses <
-            TotalMemAccesses * opts::ICPJTTotalPercentThreshold)
-          break;
-        if (100 * MemAccesses <
-            RemainingMemAccesses * opts::ICPJTRemainingPercentThreshold)
-          break;
-        if (TopN && I >= TopN)
-          break;
+        if (opts::ICPJTCoverage) {
+          if (100 * (TotalMemAccesses - RemainingMemAccesses) >=
+              TotalMemAccesses * opts::ICPJTCoverage)
+            break;
+          if (I >= opts::ICPJTMaxCompares)
+            break;
+        } else {
+          if (100 * MemAccesses <
+              TotalMemAccesses * opts::ICPJTTotalPercentThreshold)
+            break;
+          if (100 * MemAccesses <
+              RemainingMemAccesses * opts::ICPJTRemainingPercentThreshold)
+            break;
+          if (TopN && I >= TopN)
+            break;
+        }
         RemainingMemAccesses -= MemAccesses;
 
         const auto JTIndex = HotTargets[I].second;
@@ -689,7 +752,8 @@ IndirectCallPromotion::maybeGetVtableSyms(
   assert(!Function.getJumpTable(Inst) &&
          "Can't get vtable addrs for jump tables.");
 
-  if (!Function.hasMemoryProfile() || !opts::EliminateLoads)
+  if (!opts::EliminateLoads ||
+      (!Function.hasMemoryProfile() && !opts::ICPVtableRelocs))
     return MethodInfoType();
 
   MutableArrayRef<MCInst> Insts(&BB->front(), &Inst + 1);
@@ -724,12 +788,15 @@ IndirectCallPromotion::maybeGetVtableSyms(
   auto ErrorOrMemAccesssProfile =
     BC.MIB->tryGetAnnotationAs<MemoryAccessProfile>(*MethodFetchInsns.back(),
                                                     "MemoryAccessProfile");
-  if (!ErrorOrMemAccesssProfile) {
+  if (!ErrorOrMemAccesssProfile && !opts::ICPVtableRelocs) {
     DEBUG_VERBOSE(1,
                   dbgs() << "BOLT-INFO: ICP no memory profiling data found\n");
     return MethodInfoType();
   }
-  auto &MemAccessProfile = ErrorOrMemAccesssProfile.get();
+  static const MemoryAccessProfile NoMemAccessProfile{};
+  const auto &MemAccessProfile = ErrorOrMemAccesssProfile
+                                     ? ErrorOrMemAccesssProfile.get()
+                                     : NoMemAccessProfile;
 
   // Find the vtable that each method belongs to.
   std::map<const MCSymbol *, uint64_t> MethodToVtable;
@@ -776,6 +843,16 @@ IndirectCallPromotion::maybeGetVtableSyms(
         continue;
       }
     }
+    if (opts::ICPVtableRelocs) {
+      if (const auto VtableBase =
+              findVtableForMethod(BC, SymTargets[I].first, MethodOffset)) {
+        auto *BD = BC.getBinaryDataContainingAddress(VtableBase);
+        VtableSyms.push_back(
+            std::make_pair(BD->getSymbol(), VtableBase - BD->getAddress()));
+        ++TotalVtablesFromRelocs;
+        continue;
+      }
+    }
     // Give up if we can't find the vtable for a method.
     DEBUG_VERBOSE(1, dbgs() << "BOLT-INFO: ICP can't find vtable for "
                             << SymTargets[I].first->getName() << "\n");
@@ -795,6 +872,88 @@ IndirectCallPromotion::maybeGetVtableSyms(
   return MethodInfoType(VtableSyms, MethodFetchInsns);
 }
 
+void IndirectCallPromotion::collectVtableSlots(BinaryContext &BC) {
+  DenseSet<uint64_t> Slots;
+  for (auto &Section : BC.allocatableSections()) {
+    if (Section.isText() || !Section.hasRelocations())
+      continue;
+    for (const auto &Rel : Section.relocations()) {
+      if (!Rel.Symbol || Rel.Addend ||
+          Rel.getSize() != BC.AsmInfo->getCodePointerSize())
+        continue;
+      const auto *BF = BC.getFunctionForSymbol(Rel.Symbol);
+      if (!BF)
+        continue;
+      const auto Slot = Section.getAddress() + Rel.Offset;
+      MethodSlots[BF].push_back(Slot);
+      Slots.insert(Slot);
+    }
+  }
+
+  // The same vtable is usually loaded from at many callsites. Samples from
+  // all of them are used to pick the vtable when a method is shared by
+  // several classes.
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &Function = BFI.second;
+    if (!Function.hasMemoryProfile())
+      continue;
+    for (auto &BB : Function) {
+      for (auto &Inst : BB) {
+        auto ErrorOrMemAccesssProfile =
+          BC.MIB->tryGetAnnotationAs<MemoryAccessProfile>(
+              Inst, "MemoryAccessProfile");
+        if (!ErrorOrMemAccesssProfile)
+          continue;
+        for (const auto &AccessInfo :
+             ErrorOrMemAccesssProfile.get().AddressAccessInfo) {
+          uint64_t Address = AccessInfo.Offset;
+          if (AccessInfo.MemoryObject)
+            Address += AccessInfo.MemoryObject->getAddress();
+          if (!Slots.count(Address))
+            continue;
+          if (auto *BD = BC.getBinaryDataContainingAddress(Address))
+            VtableSamples[BD] += AccessInfo.Count;
+        }
+      }
+    }
+  }
+
+  outs() << "BOLT-INFO: ICP found " << Slots.size() << " vtable slots for "
+         << MethodSlots.size() << " functions, " << VtableSamples.size()
+         << " vtables are sampled\n";
+}
+
+uint64_t
+IndirectCallPromotion::findVtableForMethod(BinaryContext &BC,
+                                           const MCSymbol *Method,
+                                           uint64_t MethodOffset) const {
+  const auto *BF = BC.getFunctionForSymbol(Method);
+  if (!BF)
+    return 0;
+  auto SI = MethodSlots.find(BF);
+  if (SI == MethodSlots.end())
+    return 0;
+
+  uint64_t BestVtable = 0;
+  uint64_t BestSamples = 0;
+  for (const auto Slot : SI->second) {
+    if (Slot < MethodOffset)
+      continue;
+    const auto VtableBase = Slot - MethodOffset;
+    const auto *BD = BC.getBinaryDataContainingAddress(Slot);
+    if (!BD || VtableBase < BD->getAddress())
+      continue;
+    const auto VSI = VtableSamples.find(BD);
+    const auto Samples = VSI != VtableSamples.end() ? VSI->second : 0;
+    if (!BestVtable || Samples > BestSamples) {
+      BestVtable = VtableBase;
+      BestSamples = Samples;
+    }
+  }
+
+  return BestVtable;
+}
+
 std::vector<std::unique_ptr<BinaryBasicBlock>>
 IndirectCallPromotion::rewriteCall(
    BinaryContext &BC,
@@ -848,7 +1007,7 @@ IndirectCallPromotion::rewriteCall(
     auto TBB = Function.createBasicBlock(OrigOffset, Sym);
     for (auto &Inst : Insts) { // sanitize new instructions.
       if (BC.MIB->isCall(Inst))
-        BC.MIB->removeAnnotation(Inst, "CallProfile");
+        BC.MIB->removeAnnotation(Inst, MCPlus::CallProfileAnnotation);
     }
     TBB->addInstructions(Insts.begin(), Insts.end());
     NewBBs.emplace_back(std::move(TBB));
@@ -1050,8 +1209,45 @@ IndirectCallPromotion::canPromoteCallsite(const BinaryBasicBlock *BB,
   uint64_t TotalMispredictsTopN = 0;
   size_t N = 0;
 
-  if (opts::IndirectCallPromotionUseMispredicts &&
-      (!IsJumpTable || opts::ICPJumpTablesByTarget)) {
+  if (IsJumpTable && opts::ICPJTCoverage) {
+    // Compare against the hottest targets first, and stop once they cover
+    // enough of the jumps. The rest goes through the original table.
+    size_t MaxTargets = 0;
+    for (size_t I = 0; I < Targets.size(); ++I, ++MaxTargets) {
+      if (100 * TotalCallsTopN >= NumCalls * opts::ICPJTCoverage)
+        break;
+      if (!Targets[I].Branches)
+        break;
+      const auto NumIndices =
+          std::max<size_t>(Targets[I].JTIndices.size(), 1);
+      if (N + NumIndices > opts::ICPJTMaxCompares)
+        break;
+      TotalCallsTopN += Targets[I].Branches;
+      N += NumIndices;
+    }
+    computeStats(MaxTargets);
+
+    // Compares only pay off if the indirect jump is poorly predicted.
+    if (opts::IndirectCallPromotionUseMispredicts) {
+      uint64_t NumMispreds = 0;
+      for (const auto &Target : Targets)
+        NumMispreds += Target.Mispreds;
+      const double MispredictFrequency = (100.0 * NumMispreds) / NumCalls;
+      if (MispredictFrequency <
+          opts::IndirectCallPromotionMispredictThreshold) {
+        if (opts::Verbosity >= 1) {
+          const auto InstIdx = &Inst - &(*BB->begin());
+          outs() << "BOLT-INFO: ICP failed in " << *BB->getFunction() << " @ "
+                 << InstIdx << " in " << BB->getName() << ", calls = "
+                 << NumCalls << ", jump mispredict frequency "
+                 << format("%.1f", MispredictFrequency) << "% < "
+                 << opts::IndirectCallPromotionMispredictThreshold << "%\n";
+        }
+        return 0;
+      }
+    }
+  } else if (opts::IndirectCallPromotionUseMispredicts &&
+             (!IsJumpTable || opts::ICPJumpTablesByTarget)) {
     // Count total number of mispredictions for (at most) the top N targets.
     // We may choose a smaller N (TrialN vs. N) if the frequency threshold
     // is exceeded by fewer targets.
@@ -1084,12 +1280,20 @@ IndirectCallPromotion::canPromoteCallsite(const BinaryBasicBlock *BB,
     // Count total number of calls for (at most) the top N targets.
     // We may choose a smaller N (TrialN vs. N) if the frequency threshold
     // is exceeded by fewer targets.
-    const unsigned TotalThreshold = IsJumpTable
-                                        ? opts::ICPJTTotalPercentThreshold
-                                        : opts::ICPCallsTotalPercentThreshold;
-    const unsigned RemainingThreshold =
+    unsigned TotalThreshold = IsJumpTable
+                                  ? opts::ICPJTTotalPercentThreshold
+                                  : opts::ICPCallsTotalPercentThreshold;
+    unsigned RemainingThreshold =
         IsJumpTable ? opts::ICPJTRemainingPercentThreshold
                     : opts::ICPCallsRemainingPercentThreshold;
+    // Every execution of a retpolined call stalls, so even lukewarm targets
+    // are worth a compare and a direct call.
+    if (!IsJumpTable && opts::InsertRetpolines) {
+      TotalThreshold = std::min<unsigned>(
+          TotalThreshold, opts::ICPRetpolineTotalPercentThreshold);
+      RemainingThreshold = std::min<unsigned>(
+          RemainingThreshold, opts::ICPRetpolineRemainingPercentThreshold);
+    }
     uint64_t NumRemainingCalls = NumCalls;
     for (size_t I = 0; I < TrialN; ++I, ++MaxTargets) {
       if (100 * Targets[I].Branches < NumCalls * TotalThreshold)
@@ -1115,7 +1319,10 @@ IndirectCallPromotion::canPromoteCallsite(const BinaryBasicBlock *BB,
       const double TopNMispredictFrequency =
         (100.0 * TotalMispredictsTopN) / NumCalls;
 
-      if (TopNMispredictFrequency <
+      // A retpoline never predicts, so hardware mispredictions of the
+      // original call say nothing about the cost left after retpolining.
+      if (!(opts::InsertRetpolines && !IsJumpTable) &&
+          TopNMispredictFrequency <
           opts::IndirectCallPromotionMispredictThreshold) {
         if (opts::Verbosity >= 1) {
           const auto InstIdx = &Inst - &(*BB->begin());
@@ -1186,17 +1393,24 @@ IndirectCallPromotion::printCallsiteInfo(const BinaryBasicBlock *BB,
 }
 
 void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
-  if (opts::IndirectCallPromotion == ICP_NONE)
+  // Hot indirect calls are promoted before retpolines make them expensive,
+  // unless ICP was explicitly configured.
+  auto ICPType = opts::IndirectCallPromotion.getValue();
+  if (ICPType == ICP_NONE && opts::InsertRetpolines &&
+      !opts::IndirectCallPromotion.getNumOccurrences()) {
+    outs() << "BOLT-INFO: enabling indirect call promotion of calls for "
+              "-insert-retpolines\n";
+    ICPType = ICP_CALLS;
+  }
+
+  if (ICPType == ICP_NONE)
     return;
 
   auto &BFs = BC.getBinaryFunctions();
 
-  const bool OptimizeCalls =
-    (opts::IndirectCallPromotion == ICP_CALLS ||
-     opts::IndirectCallPromotion == ICP_ALL);
+  const bool OptimizeCalls = (ICPType == ICP_CALLS || ICPType == ICP_ALL);
   const bool OptimizeJumpTables =
-    (opts::IndirectCallPromotion == ICP_JUMP_TABLES ||
-     opts::IndirectCallPromotion == ICP_ALL);
+    (ICPType == ICP_JUMP_TABLES || ICPType == ICP_ALL);
 
   std::unique_ptr<RegAnalysis> RA;
   std::unique_ptr<BinaryFunctionCallGraph> CG;
@@ -1205,6 +1419,9 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
     RA.reset(new RegAnalysis(BC, &BFs, &*CG));
   }
 
+  if (OptimizeCalls && opts::EliminateLoads && opts::ICPVtableRelocs)
+    collectVtableSlots(BC);
+
   // If icp-top-callsites is enabled, compute the total number of indirect
   // calls and then optimize the hottest callsites that contribute to that
   // total.
@@ -1235,7 +1452,7 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
         for (auto &Inst : BB) {
           const bool IsJumpTable = Function.getJumpTable(Inst);
           const bool HasIndirectCallProfile =
-            BC.MIB->hasAnnotation(Inst, "CallProfile");
+            BC.MIB->hasAnnotation(Inst, MCPlus::CallProfileAnnotation);
           const bool IsDirectCall = (BC.MIB->isCall(Inst) &&
                                      BC.MIB->getTargetSymbol(Inst, 0));
 
@@ -1314,7 +1531,7 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
         const auto InstIdx = &Inst - &(*BB->begin());
         const bool IsTailCall = BC.MIB->isTailCall(Inst);
         const bool HasIndirectCallProfile =
-          BC.MIB->hasAnnotation(Inst, "CallProfile");
+          BC.MIB->hasAnnotation(Inst, MCPlus::CallProfileAnnotation);
         const bool IsJumpTable = Function.getJumpTable(Inst);
 
         if (BC.MIB->isCall(Inst)) {
@@ -1534,6 +1751,9 @@ void IndirectCallPromotion::runOnFunctions(BinaryContext &BC) {
          << format("%.1f", (100.0 * TotalMethodLoadsEliminated) /
                    std::max<uint64_t>(TotalMethodLoadEliminationCandidates, 1))
          << "%\n"
+         << "BOLT-INFO: ICP number of vtables found from relocations = "
+         << TotalVtablesFromRelocs
+         << "\n"
          << "BOLT-INFO: ICP percentage of indirect branches that are "
             "optimized = "
          << format("%.1f", (100.0 * TotalNumFrequentJmps) /
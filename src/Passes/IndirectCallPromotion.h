@@ -177,6 +177,27 @@ class IndirectCallPromotion : public BinaryFunctionPass {
   // Total number of jump table sites that use hot indices.
   uint64_t TotalIndexBasedJumps{0};
 
+  // Total number of vtables of promoted methods found from relocations.
+  mutable uint64_t TotalVtablesFromRelocs{0};
+
+  // Addresses of data words pointing at each function, i.e. the candidate
+  // vtable slots of the function. Collected with -icp-vtable-relocs.
+  std::unordered_map<const BinaryFunction *, std::vector<uint64_t>>
+      MethodSlots;
+
+  // Number of sampled loads from the slots of each vtable over all
+  // callsites.
+  std::unordered_map<const BinaryData *, uint64_t> VtableSamples;
+
+  /// Collect MethodSlots from data relocations and VtableSamples from the
+  /// memory profile of all functions.
+  void collectVtableSlots(BinaryContext &BC);
+
+  /// Return the address of a vtable that has \p Method at \p MethodOffset,
+  /// preferring the most sampled one, or 0 if there is none.
+  uint64_t findVtableForMethod(BinaryContext &BC, const MCSymbol *Method,
+                               uint64_t MethodOffset) const;
+
   void printDecision(llvm::raw_ostream &OS,
                      std::vector<IndirectCallPromotion::Callsite> &Targets,
                      unsigned N) const;
@@ -21,11 +21,19 @@
 //  * Tail Call Sites:
 //    - since the stack is unmodified, the regular call limitations are lifted
 //
+// With -inline-hot-functions, call sites are also inlined based on the
+// profile. Call sites are ranked by the number of calls eliminated per byte
+// of code growth, and the best ones are inlined until the growth reaches a
+// share of the binary size. Every inlined copy of a callee is charged in
+// full, so callees that are hot from many call sites only get inlined at the
+// hottest of them.
+//
 //===----------------------------------------------------------------------===//
 
 #include "Inliner.h"
 #include "MCPlus.h"
 #include "llvm/Support/Options.h"
+#include <limits>
 #include <map>
 
 #define DEBUG_TYPE "bolt-inliner"
@@ -57,6 +65,31 @@ InlineAll("inline-all",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+InlineHotFunctions("inline-hot-functions",
+  cl::desc("inline functions at hot call sites based on the call frequency "
+           "and the code growth"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+InlineHotFunctionsBytes("inline-hot-functions-bytes",
+  cl::desc("max increase in size for inlining at a hot call site"),
+  cl::init(256),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<double>
+InlineHotGrowth("inline-hot-growth",
+  cl::desc("max increase in size of all functions from inlining at hot call "
+           "sites, in percents"),
+  cl::init(1.0),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 InlineIgnoreLeafCFI("inline-ignore-leaf-cfi",
   cl::desc("inline leaf functions with CFI programs (can break unwinding)"),
@@ -120,6 +153,7 @@ bool inliningEnabled() {
   return !NoInline &&
     (InlineAll ||
      InlineSmallFunctions ||
+     InlineHotFunctions ||
      !ForceInlineFunctions.empty());
 }
 
@@ -260,6 +294,92 @@ Inliner::findInliningCandidates(BinaryContext &BC) {
   }
 }
 
+BinaryFunction *Inliner::getCallee(BinaryFunction &Function,
+                                  const MCInst &Inst, InliningInfo *&Info) {
+  auto &BC = Function.getBinaryContext();
+  if (!BC.MIB->isCall(Inst) || MCPlus::getNumPrimeOperands(Inst) != 1 ||
+      !Inst.getOperand(0).isExpr())
+    return nullptr;
+
+  const auto *TargetSymbol = BC.MIB->getTargetSymbol(Inst);
+  assert(TargetSymbol && "target symbol expected for direct call");
+
+  // Don't inline calls to a secondary entry point in a target function.
+  uint64_t EntryID{0};
+  auto *TargetFunction = BC.getFunctionForSymbol(TargetSymbol, &EntryID);
+  if (!TargetFunction || EntryID != 0)
+    return nullptr;
+
+  // Don't do recursive inlining.
+  if (TargetFunction == &Function)
+    return nullptr;
+
+  auto IInfo = InliningCandidates.find(TargetFunction);
+  if (IInfo == InliningCandidates.end())
+    return nullptr;
+
+  if (!BC.MIB->isTailCall(Inst) && IInfo->second.Type == INL_TAILCALL)
+    return nullptr;
+
+  Info = &IInfo->second;
+  return TargetFunction;
+}
+
+int64_t Inliner::getSizeAfterInlining(const BinaryContext &BC,
+                                      const InliningInfo &Info,
+                                      bool IsTailCall) {
+  if (IsTailCall)
+    return Info.SizeAfterTailCallInlining - getSizeOfTailCallInst(BC);
+  return Info.SizeAfterInlining - getSizeOfCallInst(BC);
+}
+
+void Inliner::computeHotInliningThreshold(BinaryContext &BC) {
+  HotInliningMinDensity = 0;
+  if (HotInliningBudget <= 0) {
+    HotInliningMinDensity = std::numeric_limits<double>::max();
+    return;
+  }
+
+  // Calls eliminated per byte of growth, and the growth, for every hot call
+  // site that grows the code. Call sites that do not grow the code are
+  // always inlined.
+  std::vector<std::pair<double, int64_t>> CallSites;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &Function = BFI.second;
+    if (!shouldOptimize(Function) || !Function.hasValidProfile())
+      continue;
+    for (const auto *BB : Function.layout()) {
+      const auto Count = BB->getKnownExecutionCount();
+      if (!Count)
+        continue;
+      for (const auto &Inst : *BB) {
+        InliningInfo *Info;
+        if (!getCallee(Function, Inst, Info))
+          continue;
+        const auto Growth =
+            getSizeAfterInlining(BC, *Info, BC.MIB->isTailCall(Inst));
+        if (Growth > 0 && Growth <= opts::InlineHotFunctionsBytes)
+          CallSites.emplace_back(double(Count) / Growth, Growth);
+      }
+    }
+  }
+
+  std::sort(CallSites.rbegin(), CallSites.rend());
+  auto Budget = HotInliningBudget;
+  for (const auto &CallSite : CallSites) {
+    if (CallSite.second > Budget)
+      break;
+    Budget -= CallSite.second;
+    HotInliningMinDensity = CallSite.first;
+  }
+  if (CallSites.empty() || !HotInliningMinDensity)
+    HotInliningMinDensity = std::numeric_limits<double>::max();
+
+  DEBUG(dbgs() << "BOLT-DEBUG: " << CallSites.size()
+               << " hot call sites, minimum calls per byte of growth is "
+               << HotInliningMinDensity << '\n');
+}
+
 std::pair<BinaryBasicBlock *, BinaryBasicBlock::iterator>
 Inliner::inlineCall(BinaryBasicBlock &CallerBB,
                     BinaryBasicBlock::iterator CallInst,
@@ -302,6 +422,14 @@ Inliner::inlineCall(BinaryBasicBlock &CallerBB,
   if (NextBB)
     FirstInlinedBB->removeSuccessor(NextBB);
 
+  // Blocks executed by the callee from this call site, if recorded with
+  // -context-profile.
+  std::unordered_map<uint32_t, uint64_t> ContextCounts;
+  if (auto CP =
+          MIB.tryGetAnnotationAs<ContextProfile>(*CallInst, "ContextProfile"))
+    for (const auto &Entry : *CP)
+      ContextCounts[Entry.Offset] = Entry.Count;
+
   // Remove the call instruction.
   auto InsertII = FirstInlinedBB->eraseInstruction(CallInst);
 
@@ -315,6 +443,23 @@ Inliner::inlineCall(BinaryBasicBlock &CallerBB,
   // later due to profile adjustment rounding errors.
   const auto FirstInlinedBBCount = FirstInlinedBB->getKnownExecutionCount();
 
+  // With a context-sensitive profile, every block of the callee is scaled by
+  // its own ratio, so that the inlined code gets the block counts observed
+  // from this call site rather than a share of the counts from all callers.
+  double ContextScale = 0;
+  auto CEI = ContextCounts.find(Callee.front().getInputOffset());
+  if (CEI != ContextCounts.end() && CEI->second)
+    ContextScale = (double) FirstInlinedBBCount / CEI->second;
+  auto getProfileRatio = [&](const BinaryBasicBlock &BB) {
+    const auto BBCount = BB.getKnownExecutionCount();
+    if (!ContextScale || !BBCount ||
+        BB.getInputOffset() == BinaryBasicBlock::INVALID_OFFSET)
+      return ProfileRatio;
+    auto CI = ContextCounts.find(BB.getInputOffset());
+    const auto Count = CI == ContextCounts.end() ? 0 : CI->second;
+    return Count * ContextScale / BBCount;
+  };
+
   // Copy basic blocks and maintain a map from their origin.
   std::unordered_map<const BinaryBasicBlock *, BinaryBasicBlock *> InlinedBBMap;
   InlinedBBMap[&Callee.front()] = FirstInlinedBB;
@@ -411,11 +556,12 @@ Inliner::inlineCall(BinaryBasicBlock &CallerBB,
 
     // Scale profiling info for blocks and edges after inlining.
     if (CallerFunction.hasValidProfile() && Callee.size() > 1) {
+      const auto Ratio = getProfileRatio(BB);
       if (opts::AdjustProfile) {
-        InlinedBB->adjustExecutionCount(ProfileRatio);
+        InlinedBB->adjustExecutionCount(Ratio);
       } else {
         InlinedBB->setExecutionCount(
-            InlinedBB->getKnownExecutionCount() * ProfileRatio);
+            InlinedBB->getKnownExecutionCount() * Ratio);
       }
     }
   }
@@ -447,53 +593,30 @@ bool Inliner::inlineCallsInFunction(BinaryFunction &Function) {
   for (auto *BB : Blocks) {
     for (auto InstIt = BB->begin(); InstIt != BB->end(); ) {
       auto &Inst = *InstIt;
-      if (!BC.MIB->isCall(Inst) || MCPlus::getNumPrimeOperands(Inst) != 1 ||
-          !Inst.getOperand(0).isExpr()) {
+      InliningInfo *IInfo;
+      auto *TargetFunction = getCallee(Function, Inst, IInfo);
+      if (!TargetFunction) {
         ++InstIt;
         continue;
       }
 
-      const auto *TargetSymbol = BC.MIB->getTargetSymbol(Inst);
-      assert(TargetSymbol && "target symbol expected for direct call");
-
-      // Don't inline calls to a secondary entry point in a target function.
-      uint64_t EntryID{0};
-      auto *TargetFunction = BC.getFunctionForSymbol(TargetSymbol, &EntryID);
-      if (!TargetFunction || EntryID != 0) {
-        ++InstIt;
-        continue;
-      }
-
-      // Don't do recursive inlining.
-      if (TargetFunction == &Function) {
-        ++InstIt;
-        continue;
-      }
-
-      auto IInfo = InliningCandidates.find(TargetFunction);
-      if (IInfo == InliningCandidates.end()) {
-        ++InstIt;
-        continue;
-      }
-
-      const auto IsTailCall = BC.MIB->isTailCall(Inst);
-      if (!IsTailCall && IInfo->second.Type == INL_TAILCALL) {
-        ++InstIt;
-        continue;
-      }
-
-      int64_t SizeAfterInlining;
-      if (IsTailCall) {
-        SizeAfterInlining = IInfo->second.SizeAfterTailCallInlining -
-                            getSizeOfTailCallInst(BC);
-      } else {
-        SizeAfterInlining = IInfo->second.SizeAfterInlining -
-                            getSizeOfCallInst(BC);
-      }
+      const auto SizeAfterInlining =
+          getSizeAfterInlining(BC, *IInfo, BC.MIB->isTailCall(Inst));
 
+      bool IsHotCallSite = false;
       if (!opts::InlineAll && !opts::mustConsider(*TargetFunction)) {
-        if (!opts::InlineSmallFunctions ||
-            SizeAfterInlining > opts::InlineSmallFunctionsBytes) {
+        const auto IsSmall =
+            opts::InlineSmallFunctions &&
+            SizeAfterInlining <= opts::InlineSmallFunctionsBytes;
+        const auto Count = BB->getKnownExecutionCount();
+        IsHotCallSite =
+            !IsSmall && opts::InlineHotFunctions && Count &&
+            Function.hasValidProfile() &&
+            SizeAfterInlining <= opts::InlineHotFunctionsBytes &&
+            SizeAfterInlining <= HotInliningBudget &&
+            (SizeAfterInlining <= 0 ||
+             double(Count) / SizeAfterInlining >= HotInliningMinDensity);
+        if (!IsSmall && !IsHotCallSite) {
           ++InstIt;
           continue;
         }
@@ -508,6 +631,8 @@ bool Inliner::inlineCallsInFunction(BinaryFunction &Function) {
 
       DidInlining = true;
       TotalInlinedBytes += SizeAfterInlining;
+      if (IsHotCallSite)
+        HotInliningBudget -= std::max<int64_t>(SizeAfterInlining, 0);
 
       ++NumInlinedCallSites;
       NumInlinedDynamicCalls += BB->getExecutionCount();
@@ -518,7 +643,7 @@ bool Inliner::inlineCallsInFunction(BinaryFunction &Function) {
       }
 
       // Check if the caller inlining status has to be adjusted.
-      if (IInfo->second.Type == INL_TAILCALL) {
+      if (IInfo->Type == INL_TAILCALL) {
         auto CallerIInfo = InliningCandidates.find(&Function);
         if (CallerIInfo != InliningCandidates.end() &&
             CallerIInfo->second.Type == INL_ANY) {
@@ -546,6 +671,7 @@ void Inliner::runOnFunctions(BinaryContext &BC) {
   uint64_t TotalSize = 0;
   for (auto &BFI : BC.getBinaryFunctions())
     TotalSize += BFI.second.getSize();
+  HotInliningBudget = TotalSize * opts::InlineHotGrowth / 100;
 
   bool InlinedOnce;
   unsigned NumIters = 0;
@@ -557,6 +683,8 @@ void Inliner::runOnFunctions(BinaryContext &BC) {
 
     InliningCandidates.clear();
     findInliningCandidates(BC);
+    if (opts::InlineHotFunctions)
+      computeHotInliningThreshold(BC);
 
     std::vector<BinaryFunction *> ConsideredFunctions;
     for (auto &BFI : BC.getBinaryFunctions()) {
@@ -590,6 +718,10 @@ void Inliner::runOnFunctions(BinaryContext &BC) {
            << " iteration(s). Change in binary size: " << TotalInlinedBytes
            << " bytes.\n";
   }
+  if (opts::InlineHotFunctions) {
+    outs() << "BOLT-INFO: hot call-site inlining budget left: "
+           << HotInliningBudget << " bytes\n";
+  }
 }
 
 } // namespace bolt
@@ -53,6 +53,13 @@ private:
   /// Number of call sites that were inlined.
   uint64_t NumInlinedCallSites{0};
 
+  /// Number of bytes hot call-site inlining could still add to the binary.
+  int64_t HotInliningBudget{0};
+
+  /// Minimum number of calls eliminated per byte of code growth for a hot
+  /// call site to be inlined in the current iteration.
+  double HotInliningMinDensity{0};
+
   /// Size in bytes of a regular call instruction.
   static uint64_t SizeOfCallInst;
 
@@ -70,6 +77,21 @@ private:
 
   void findInliningCandidates(BinaryContext &BC);
 
+  /// Return the inlining candidate called by \p Inst in \p Function and set
+  /// \p Info to its inlining info. Return nullptr if the call cannot be
+  /// inlined.
+  BinaryFunction *getCallee(BinaryFunction &Function, const MCInst &Inst,
+                            InliningInfo *&Info);
+
+  /// Return the change in the code size from inlining a callee with \p Info
+  /// at a call site, which is a tail call if \p IsTailCall is set.
+  int64_t getSizeAfterInlining(const BinaryContext &BC,
+                               const InliningInfo &Info, bool IsTailCall);
+
+  /// Set HotInliningMinDensity so that inlining the hot call sites with the
+  /// most eliminated calls per byte of growth fits into HotInliningBudget.
+  void computeHotInliningThreshold(BinaryContext &BC);
+
   bool inlineCallsInFunction(BinaryFunction &Function);
 
   /// Inline a function call \p CallInst to function \p Callee.
@@ -12,7 +12,9 @@
 #include "Instrumentation.h"
 #include "ParallelUtilities.h"
 #include "Passes/DataflowInfoManager.h"
+#include "Passes/LivenessAnalysis.h"
 #include "llvm/Support/Options.h"
+#include <numeric>
 
 #define DEBUG_TYPE "bolt-instrumentation"
 
@@ -34,6 +36,21 @@ cl::opt<bool> InstrumentationFileAppendPID(
     cl::Optional,
     cl::cat(BoltInstrCategory));
 
+cl::opt<bool> InstrumentationBinaryProfile(
+    "instrumentation-binary-profile",
+    cl::desc("write the raw counters and a build-id instead of an fdata file, "
+             "making profile writes cheap. Use merge-fdata "
+             "-instrumented-binary=<binary> to turn them into fdata "
+             "(default: false)"),
+    cl::init(false), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<bool> InstrumentationMergeProcesses(
+    "instrumentation-merge-processes",
+    cl::desc("collect a single profile for the instrumented process and the "
+             "processes it forks, written when the first one exits and "
+             "rewritten by the ones exiting later (default: false)"),
+    cl::init(false), cl::Optional, cl::cat(BoltInstrCategory));
+
 cl::opt<bool> ConservativeInstrumentation(
     "conservative-instrumentation",
     cl::desc(
@@ -49,6 +66,14 @@ cl::opt<uint32_t> InstrumentationSleepTime(
              "program and the profile is not being dumped at the end."),
     cl::init(0), cl::Optional, cl::cat(BoltInstrCategory));
 
+cl::opt<std::string> InstrumentationSharedMemory(
+    "instrumentation-shm",
+    cl::desc("keep counters in the named file, relative to /dev/shm unless "
+             "absolute, and describe them in <name>.desc, so that an external "
+             "collector can read them at any time without the program "
+             "writing a profile"),
+    cl::init(""), cl::Optional, cl::cat(BoltInstrCategory));
+
 cl::opt<bool>
     InstrumentHotOnly("instrument-hot-only",
                       cl::desc("only insert instrumentation on hot functions "
@@ -61,6 +86,90 @@ cl::opt<bool> InstrumentCalls("instrument-calls",
                                        "control flow activity (default: true)"),
                               cl::init(true), cl::Optional,
                               cl::cat(BoltInstrCategory));
+
+cl::opt<bool> InstrumentCallsOnly(
+    "instrument-calls-only",
+    cl::desc("only count function entries and direct calls, leaving basic "
+             "blocks and branches without counters. The profile is enough for "
+             "function reordering at a fraction of the overhead "
+             "(default: false)"),
+    cl::init(false), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<bool> InstrumentationSortCounters(
+    "instrumentation-sort-counters",
+    cl::desc("allocate counters by decreasing execution count of their block "
+             "or edge in the input profile, so the counters of hot code are "
+             "packed together and the cold ones stay out of the working set "
+             "(default: false)"),
+    cl::init(false), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<bool> InstrumentationNoAtomic(
+    "instrumentation-no-atomic",
+    cl::desc("increment counters without a lock prefix. Faster, but counts "
+             "are lost when threads update the same counter concurrently "
+             "(default: false)"),
+    cl::init(false), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<bool> InstrumentationSkipDeadFlags(
+    "instrumentation-skip-dead-flags",
+    cl::desc("do not save flags around counter increments where liveness "
+             "analysis proves them dead (default: false)"),
+    cl::init(false), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<unsigned> InstrumentationCounterShards(
+    "instrumentation-counter-shards",
+    cl::desc("keep this many copies of the counter array and have every CPU "
+             "increment the copy selected by its number, so threads running "
+             "on different CPUs do not contend for the same cache lines. "
+             "Copies are summed when the profile is written. Must be a power "
+             "of two (default: 1)"),
+    cl::init(1), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<uint32_t> InstrumentationSamplingPeriod(
+    "instrumentation-sampling-period",
+    cl::desc("only update counters during bursts starting every <n> "
+             "milliseconds, lowering the overhead of the instrumented binary. "
+             "0 disables sampling (default: 0)"),
+    cl::init(0), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<uint32_t> InstrumentationSamplingBurst(
+    "instrumentation-sampling-burst",
+    cl::desc("length of a counting burst in milliseconds when "
+             "-instrumentation-sampling-period is set (default: 10)"),
+    cl::init(10), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<bool> InstrumentationWeightedTree(
+    "instrumentation-weighted-tree",
+    cl::desc("for functions with a profile, leave the hottest edges without "
+             "counters and infer their counts instead (default: false)"),
+    cl::init(false), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::list<std::string> InstrumentMemoryAccesses(
+    "instrument-memory-accesses", cl::CommaSeparated,
+    cl::desc("record the global data objects accessed by loads and stores in "
+             "these functions, to get a data layout profile without "
+             "perf mem sampling"),
+    cl::value_desc("func1,func2,func3,..."), cl::ZeroOrMore,
+    cl::cat(BoltInstrCategory));
+
+cl::opt<uint32_t> InstrumentationMemorySampleRate(
+    "instrumentation-memory-sample-rate",
+    cl::desc("record one in this many accesses with "
+             "-instrument-memory-accesses (default: 100)"),
+    cl::init(100), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<bool> InstrumentationFirstCallOrder(
+    "instrumentation-first-call-order",
+    cl::desc("record the order in which functions are first executed and "
+             "write it to <profile>.temporal for -reorder-functions=temporal "
+             "(default: false)"),
+    cl::init(false), cl::Optional, cl::cat(BoltInstrCategory));
+
+cl::opt<bool> InstrumentMemcpySizes(
+    "instrument-memcpy-sizes",
+    cl::desc("record the distribution of size arguments passed to memcpy() "
+             "and memset() (default: false)"),
+    cl::init(false), cl::Optional, cl::cat(BoltInstrCategory));
 }
 
 namespace llvm {
@@ -86,8 +195,9 @@ bool Instrumentation::createCallDescription(FunctionDescription &FuncDesc,
   // Ordinarily, we don't augment direct calls with an explicit counter, except
   // when forced to do so or when we know this callee could be throwing
   // exceptions, in which case there is no other way to accurately record its
-  // frequency.
-  bool ForceInstrumentation = opts::ConservativeInstrumentation || IsInvoke;
+  // frequency. Without block counters, every call needs its own.
+  bool ForceInstrumentation = opts::ConservativeInstrumentation ||
+                              opts::InstrumentCallsOnly || IsInvoke;
   CD.FromLoc.FuncString = getFunctionNameIndex(FromFunction);
   CD.FromLoc.Offset = From;
   CD.FromNode = FromNodeID;
@@ -118,6 +228,14 @@ void Instrumentation::createIndCallTargetDescription(
   Summary->IndCallTargetDescriptions.emplace_back(ICD);
 }
 
+void Instrumentation::createValueSiteDescription(
+    const BinaryFunction &FromFunction, uint32_t From) {
+  ValueSiteDescription VSD;
+  VSD.FromLoc.FuncString = getFunctionNameIndex(FromFunction);
+  VSD.FromLoc.Offset = From;
+  Summary->ValueSiteDescriptions.emplace_back(VSD);
+}
+
 bool Instrumentation::createEdgeDescription(
     FunctionDescription &FuncDesc,
     const BinaryFunction &FromFunction, uint32_t From,
@@ -153,22 +271,62 @@ void Instrumentation::createLeafNodeDescription(FunctionDescription &FuncDesc,
 }
 
 std::vector<MCInst>
-Instrumentation::createInstrumentationSnippet(BinaryContext &BC, bool IsLeaf) {
+Instrumentation::createInstrumentationSnippet(BinaryContext &BC, bool IsLeaf,
+                                              bool SaveFlags, uint64_t Weight) {
   auto L = BC.scopeLock();
   MCSymbol *Label;
   Label = BC.Ctx->createTempSymbol("InstrEntry", true);
   Summary->Counters.emplace_back(Label);
-  std::vector<MCInst> CounterInstrs(5);
+  Summary->CounterWeights.emplace_back(Weight);
+  const bool IsAtomic = !opts::InstrumentationNoAtomic;
+  const bool IsSharded = opts::InstrumentationCounterShards > 1;
+
+  // The instructions updating the counter proper.
+  std::vector<MCInst> IncInstrs;
+  if (IsSharded) {
+    IncInstrs = BC.MIB->createShardedIncMemory(
+        Label, Summary->CounterShardStride, opts::InstrumentationCounterShards,
+        &*BC.Ctx, IsAtomic);
+  } else {
+    IncInstrs = BC.MIB->createInstrIncMemory(Label, &*BC.Ctx, IsAtomic);
+  }
+  // Sampled counters are skipped outside of bursts with a branch inserted by
+  // gateSampledCounters(). Mark where they start and how long they are.
+  if (opts::InstrumentationSamplingPeriod)
+    BC.MIB->addAnnotation(IncInstrs.front(), "SampledCounter",
+                          static_cast<uint32_t>(IncInstrs.size()));
+
+  // Without a flags save the stack is not used, hence there is no need to
+  // skip the red zone either. The sharded sequence saves its scratch registers
+  // on the stack though.
+  if (!SaveFlags && !IsSharded)
+    return IncInstrs;
+  // AArch64 has no red zone and its sequence leaves the flags alone.
+  if (BC.isAArch64())
+    return IncInstrs;
+
+  std::vector<MCInst> CounterInstrs;
   // Don't clobber application red zone (ABI dependent)
-  if (IsLeaf)
-    BC.MIB->createStackPointerIncrement(CounterInstrs[0], 128,
+  if (IsLeaf) {
+    CounterInstrs.emplace_back();
+    BC.MIB->createStackPointerIncrement(CounterInstrs.back(), 128,
                                         /*NoFlagsClobber=*/true);
-  BC.MIB->createPushFlags(CounterInstrs[1], 2);
-  BC.MIB->createIncMemory(CounterInstrs[2], Label, &*BC.Ctx);
-  BC.MIB->createPopFlags(CounterInstrs[3], 2);
-  if (IsLeaf)
-    BC.MIB->createStackPointerDecrement(CounterInstrs[4], 128,
+  }
+  if (SaveFlags) {
+    CounterInstrs.emplace_back();
+    BC.MIB->createPushFlags(CounterInstrs.back(), 2);
+  }
+  CounterInstrs.insert(CounterInstrs.end(), IncInstrs.begin(),
+                       IncInstrs.end());
+  if (SaveFlags) {
+    CounterInstrs.emplace_back();
+    BC.MIB->createPopFlags(CounterInstrs.back(), 2);
+  }
+  if (IsLeaf) {
+    CounterInstrs.emplace_back();
+    BC.MIB->createStackPointerDecrement(CounterInstrs.back(), 128,
                                         /*NoFlagsClobber=*/true);
+  }
   return CounterInstrs;
 }
 
@@ -186,6 +344,175 @@ insertInstructions(std::vector<MCInst>& Instrs,
   return Iter;
 }
 
+// Return true if flags were found to be dead before \p Iter in \p BB by
+// markDeadFlags().
+bool areFlagsDeadAt(const BinaryContext &BC, BinaryBasicBlock &BB,
+                    BinaryBasicBlock::iterator Iter) {
+  return Iter != BB.end() && BC.MIB->hasAnnotation(*Iter, "DeadFlags");
+}
+
+// Annotate instructions of \p Function before which flags are dead, so that
+// counters inserted there don't have to preserve them.
+void markDeadFlags(BinaryContext &BC, BinaryFunction &Function,
+                   MCPlusBuilder::AllocatorIdTy AllocId) {
+  // Calls are assumed to read all registers.
+  RegAnalysis RA(BC, nullptr, nullptr);
+  LivenessAnalysis LA(RA, BC, Function, AllocId);
+  LA.run();
+  const auto FlagsReg = BC.MIB->getFlagsReg();
+  for (auto &BB : Function) {
+    for (auto &Inst : BB) {
+      if (!LA.isAlive(&Inst, FlagsReg))
+        BC.MIB->addAnnotation(Inst, "DeadFlags", true, AllocId);
+    }
+  }
+}
+
+// Move every counter update marked by createInstrumentationSnippet() into
+// its own block that is branched around when \p Flag is zero, i.e. outside
+// of a sampling burst. Code saving flags and registers around the update
+// stays on both paths.
+void gateSampledCounters(BinaryContext &BC, BinaryFunction &Function,
+                         const MCSymbol *Flag) {
+  std::vector<BinaryBasicBlock *> Blocks;
+  for (auto &BB : Function)
+    Blocks.push_back(&BB);
+
+  for (auto *BB : Blocks) {
+    auto *CurBB = BB;
+    while (CurBB) {
+      auto II = CurBB->begin();
+      while (II != CurBB->end() &&
+             !BC.MIB->hasAnnotation(*II, "SampledCounter"))
+        ++II;
+      if (II == CurBB->end())
+        break;
+
+      const auto Size =
+          BC.MIB->getAnnotationAs<uint32_t>(*II, "SampledCounter");
+      BC.MIB->removeAnnotation(*II, "SampledCounter");
+      auto TailStart = std::next(II, Size);
+      BinaryBasicBlock *TailBB{nullptr};
+      BinaryBasicBlock *NextBB{nullptr};
+      if (TailStart != CurBB->end()) {
+        TailBB = CurBB->splitAt(TailStart);
+        NextBB = TailBB;
+      } else {
+        // Counters on split critical edges end their block. Anything else
+        // ending a block without a unique successor is counted all the time.
+        if (CurBB->succ_size() != 1)
+          break;
+        TailBB = CurBB->getSuccessor();
+      }
+
+      auto *CounterBB = Function.addBasicBlock(CurBB->getInputOffset());
+      std::vector<MCInst> CounterInstrs(II, CurBB->end());
+      while (II != CurBB->end())
+        II = CurBB->eraseInstruction(II);
+      CounterBB->addInstructions(CounterInstrs.begin(), CounterInstrs.end());
+      CounterBB->addSuccessor(TailBB, CurBB->getKnownExecutionCount());
+      CounterBB->setCFIState(TailBB->getCFIState());
+      CounterBB->setExecutionCount(CurBB->getKnownExecutionCount());
+
+      auto CmpJCC =
+          BC.MIB->createCmpMemZeroJE(Flag, TailBB->getLabel(), BC.Ctx.get());
+      CurBB->addInstructions(CmpJCC.begin(), CmpJCC.end());
+      CurBB->addSuccessor(CounterBB, CurBB->getKnownExecutionCount());
+
+      CurBB = NextBB;
+    }
+  }
+}
+
+// Prepend to the entry block of \p Function a check of \p Slot that stores
+// the next value of \p Sequence there the first time the function executes.
+// Flags are not preserved across calls, hence they are dead at the entry.
+void recordFirstCall(BinaryContext &BC, BinaryFunction &Function,
+                     const MCSymbol *Slot, const MCSymbol *Sequence) {
+  auto &EntryBB = Function.front();
+  auto *TailBB = EntryBB.splitAt(EntryBB.begin());
+
+  auto *RecordBB = Function.addBasicBlock(EntryBB.getInputOffset());
+  auto RecordInstrs =
+      BC.MIB->createStoreNextSequenceNumber(Slot, Sequence, BC.Ctx.get());
+  RecordBB->addInstructions(RecordInstrs.begin(), RecordInstrs.end());
+  RecordBB->addSuccessor(TailBB, 0);
+  RecordBB->setCFIState(TailBB->getCFIState());
+  RecordBB->setExecutionCount(0);
+
+  auto CmpJCC =
+      BC.MIB->createCmpMem32ZeroJNE(Slot, TailBB->getLabel(), BC.Ctx.get());
+  EntryBB.addInstructions(CmpJCC.begin(), CmpJCC.end());
+  EntryBB.addSuccessor(RecordBB, 0);
+}
+
+using SpanningTreeTy =
+    std::unordered_map<const BinaryBasicBlock *,
+                       std::set<const BinaryBasicBlock *>>;
+
+// Greedily build a spanning forest of \p Function over its hottest edges
+// according to the profile, so that counters go on colder edges. Every block
+// has at most one incoming tree edge and entry points stay roots, which is
+// what the runtime needs to infer the counts of tree edges.
+void buildWeightedSpanningTree(BinaryFunction &Function,
+                               SpanningTreeTy &STOutSet) {
+  struct EdgeTy {
+    uint64_t Count;
+    BinaryBasicBlock *From;
+    BinaryBasicBlock *To;
+  };
+  std::vector<EdgeTy> Edges;
+  for (auto *BB : Function.layout()) {
+    auto BI = BB->branch_info_begin();
+    for (auto *SuccBB : BB->successors()) {
+      const uint64_t Count =
+          BI->Count == BinaryBasicBlock::COUNT_NO_PROFILE ? 0 : BI->Count;
+      ++BI;
+      if (SuccBB != BB && !SuccBB->isEntryPoint())
+        Edges.push_back(EdgeTy{Count, BB, SuccBB});
+    }
+  }
+  std::stable_sort(Edges.begin(), Edges.end(),
+                   [](const EdgeTy &A, const EdgeTy &B) {
+                     return A.Count > B.Count;
+                   });
+
+  // Union-find over block indices detects edges that would close a cycle.
+  std::vector<unsigned> Leader(Function.size());
+  for (unsigned I = 0; I < Leader.size(); ++I)
+    Leader[I] = I;
+  auto findLeader = [&](unsigned I) {
+    while (Leader[I] != I)
+      I = Leader[I] = Leader[Leader[I]];
+    return I;
+  };
+  std::vector<bool> HasParent(Function.size(), false);
+  for (const auto &E : Edges) {
+    if (HasParent[E.To->getIndex()])
+      continue;
+    const auto FromLeader = findLeader(E.From->getIndex());
+    const auto ToLeader = findLeader(E.To->getIndex());
+    if (FromLeader == ToLeader)
+      continue;
+    Leader[ToLeader] = FromLeader;
+    HasParent[E.To->getIndex()] = true;
+    STOutSet[E.From].insert(E.To);
+  }
+}
+
+// Return true if \p Inst is a direct non-tail call to memcpy() or memset().
+bool isMemcpyOrMemsetCall(const BinaryContext &BC, const MCInst &Inst) {
+  if (!BC.MIB->isCall(Inst) || BC.MIB->isTailCall(Inst) ||
+      MCPlus::getNumPrimeOperands(Inst) != 1 || !Inst.getOperand(0).isExpr())
+    return false;
+  const auto *CalleeSymbol = BC.MIB->getTargetSymbol(Inst);
+  if (!CalleeSymbol)
+    return false;
+  const auto Name = CalleeSymbol->getName();
+  return Name == "memcpy" || Name == "memcpy@PLT" || Name == "memset" ||
+         Name == "memset@PLT";
+}
+
 }
 
 void Instrumentation::instrumentLeafNode(BinaryContext &BC,
@@ -195,7 +522,9 @@ void Instrumentation::instrumentLeafNode(BinaryContext &BC,
                                          FunctionDescription &FuncDesc,
                                          uint32_t Node) {
   createLeafNodeDescription(FuncDesc, Node);
-  std::vector<MCInst> CounterInstrs = createInstrumentationSnippet(BC, IsLeaf);
+  std::vector<MCInst> CounterInstrs =
+    createInstrumentationSnippet(BC, IsLeaf, !areFlagsDeadAt(BC, BB, Iter),
+                                 BB.getKnownExecutionCount());
   insertInstructions(CounterInstrs, BB, Iter);
 }
 
@@ -220,6 +549,54 @@ void Instrumentation::instrumentIndirectTarget(BinaryBasicBlock &BB,
   --Iter;
 }
 
+void Instrumentation::instrumentValueSite(BinaryBasicBlock &BB,
+                                          BinaryBasicBlock::iterator &Iter,
+                                          BinaryFunction &FromFunction,
+                                          uint32_t From) {
+  auto L = FromFunction.getBinaryContext().scopeLock();
+  const auto ValueSiteID = Summary->ValueSiteDescriptions.size();
+  createValueSiteDescription(FromFunction, From);
+
+  BinaryContext &BC = FromFunction.getBinaryContext();
+  std::vector<MCInst> ValueInstrs = BC.MIB->createInstrumentedValueProfile(
+      BC.MIB->getIntArgRegister(2), Summary->ValueProfHandlerFunc, ValueSiteID,
+      &*BC.Ctx);
+  Iter = insertInstructions(ValueInstrs, BB, Iter);
+}
+
+void Instrumentation::instrumentMemoryAccess(BinaryBasicBlock &BB,
+                                             BinaryBasicBlock::iterator &Iter,
+                                             BinaryFunction &FromFunction,
+                                             uint32_t From) {
+  BinaryContext &BC = FromFunction.getBinaryContext();
+  auto L = BC.scopeLock();
+  const auto SiteID = Summary->MemAccessSiteDescriptions.size();
+  std::vector<MCInst> AccessInstrs = BC.MIB->createInstrumentedMemoryAccess(
+      *Iter, Summary->MemAccessHandlerFunc, SiteID, &*BC.Ctx);
+  if (AccessInstrs.empty())
+    return;
+
+  ValueSiteDescription MSD;
+  MSD.FromLoc.FuncString = getFunctionNameIndex(FromFunction);
+  MSD.FromLoc.Offset = From;
+  Summary->MemAccessSiteDescriptions.emplace_back(MSD);
+  Iter = insertInstructions(AccessInstrs, BB, Iter);
+}
+
+void Instrumentation::collectDataObjects(BinaryContext &BC) {
+  for (const auto &Entry : BC.getBinaryData()) {
+    const BinaryData *BD = Entry.second;
+    // Accesses are attributed to top level objects like perf2bolt does
+    if (BD->getParent() || !BD->getSize() || BD->isAbsolute() ||
+        !BD->getSection().isAllocatable() || BD->getSection().isText())
+      continue;
+    if (!Summary->DataObjects.empty() &&
+        Summary->DataObjects.back()->getEndAddress() > BD->getAddress())
+      continue;
+    Summary->DataObjects.push_back(BD);
+  }
+}
+
 bool Instrumentation::instrumentOneTarget(
     SplitWorklistTy &SplitWorklist, SplitInstrsTy &SplitInstrs,
     BinaryBasicBlock::iterator &Iter, BinaryFunction &FromFunction,
@@ -240,10 +617,21 @@ bool Instrumentation::instrumentOneTarget(
       return false;
   }
 
+  BinaryContext &BC = FromFunction.getBinaryContext();
+
+  // The counter goes before Iter or at the start of TargetBB, or on the edge
+  // to it, hence flags have to be dead at both points to skip saving them.
+  const bool FlagsAreDead =
+    areFlagsDeadAt(BC, FromBB, Iter) &&
+    (!TargetBB || areFlagsDeadAt(BC, *TargetBB, TargetBB->begin()));
+  uint64_t Weight = FromBB.getKnownExecutionCount();
+  if (TargetBB && FromBB.isSuccessor(TargetBB)) {
+    const auto &BI = FromBB.getBranchInfo(*TargetBB);
+    Weight = BI.Count != BinaryBasicBlock::COUNT_NO_PROFILE ? BI.Count : 0;
+  }
   std::vector<MCInst> CounterInstrs =
-    createInstrumentationSnippet(FromFunction.getBinaryContext(), IsLeaf);
+    createInstrumentationSnippet(BC, IsLeaf, !FlagsAreDead, Weight);
 
-  BinaryContext &BC = FromFunction.getBinaryContext();
   const MCInst &Inst = *Iter;
   if (BC.MIB->isCall(Inst)) {
     // This code handles both
@@ -300,6 +688,9 @@ void Instrumentation::instrumentFunction(BinaryContext &BC,
   Function.disambiguateJumpTables(AllocId);
   Function.deleteConservativeEdges();
 
+  if (opts::InstrumentationSkipDeadFlags && BC.isX86())
+    markDeadFlags(BC, Function, AllocId);
+
   std::unordered_map<const BinaryBasicBlock *, uint32_t> BBToID;
   uint32_t Id = 0;
   for (auto BBI = Function.begin(); BBI != Function.end(); ++BBI) {
@@ -312,9 +703,7 @@ void Instrumentation::instrumentFunction(BinaryContext &BC,
   // Exit basic blocks are always instrumented so we start the traversal with
   // a minimum number of defined variables to make the equation solvable.
   std::stack<std::pair<const BinaryBasicBlock *, BinaryBasicBlock *>> Stack;
-  std::unordered_map<const BinaryBasicBlock *,
-                     std::set<const BinaryBasicBlock *>>
-      STOutSet;
+  SpanningTreeTy STOutSet;
   for (auto BBI = Function.layout_rbegin(); BBI != Function.layout_rend();
        ++BBI) {
     if ((*BBI)->isEntryPoint() || (*BBI)->isLandingPad()) {
@@ -329,8 +718,13 @@ void Instrumentation::instrumentFunction(BinaryContext &BC,
     }
   }
 
-  // Modified version of BinaryFunction::dfs() to build a spanning tree
-  if (!opts::ConservativeInstrumentation) {
+  if (opts::InstrumentCallsOnly) {
+    // Branches are not profiled, there is no flow to solve.
+  } else if (!opts::ConservativeInstrumentation &&
+             opts::InstrumentationWeightedTree && Function.hasValidProfile()) {
+    buildWeightedSpanningTree(Function, STOutSet);
+  } else if (!opts::ConservativeInstrumentation) {
+    // Modified version of BinaryFunction::dfs() to build a spanning tree
     while (!Stack.empty()) {
       BinaryBasicBlock *BB;
       const BinaryBasicBlock *Pred;
@@ -363,6 +757,12 @@ void Instrumentation::instrumentFunction(BinaryContext &BC,
     }
   }
 
+  const bool InstrumentMemory =
+      llvm::any_of(opts::InstrumentMemoryAccesses,
+                   [&](const std::string &Name) {
+                     return Function.hasName(Name);
+                   });
+
   for (auto BBI = Function.begin(), BBE = Function.end(); BBI != BBE; ++BBI) {
     auto &BB{*BBI};
     bool HasUnconditionalBranch{false};
@@ -370,8 +770,19 @@ void Instrumentation::instrumentFunction(BinaryContext &BC,
     bool IsInvokeBlock = InvokeBlocks.count(&BB) > 0;
 
     for (auto I = BB.begin(); I != BB.end(); ++I) {
+      if (opts::InstrumentMemcpySizes && isMemcpyOrMemsetCall(BC, *I) &&
+          BC.MIB->hasAnnotation(*I, MCPlus::OffsetAnnotation))
+        instrumentValueSite(
+            BB, I, Function,
+            BC.MIB->getAnnotationAs(*I, MCPlus::OffsetAnnotation));
+      if (InstrumentMemory &&
+          BC.MIB->hasAnnotation(*I, MCPlus::OffsetAnnotation))
+        instrumentMemoryAccess(
+            BB, I, Function,
+            BC.MIB->getAnnotationAs(*I, MCPlus::OffsetAnnotation));
+
       const auto &Inst = *I;
-      if (!BC.MIB->hasAnnotation(Inst, "Offset"))
+      if (!BC.MIB->hasAnnotation(Inst, MCPlus::OffsetAnnotation))
         continue;
 
       const bool IsJumpTable = Function.getJumpTable(Inst);
@@ -383,7 +794,8 @@ void Instrumentation::instrumentFunction(BinaryContext &BC,
                BC.MIB->isUnsupportedBranch(Inst.getOpcode()))
         continue;
 
-      uint32_t FromOffset = BC.MIB->getAnnotationAs<uint32_t>(Inst, "Offset");
+      uint32_t FromOffset =
+          BC.MIB->getAnnotationAs(Inst, MCPlus::OffsetAnnotation);
       const MCSymbol *Target = BC.MIB->getTargetSymbol(Inst);
       BinaryBasicBlock *TargetBB = Function.getBasicBlockForLabel(Target);
       uint32_t ToOffset = TargetBB ? TargetBB->getInputOffset() : 0;
@@ -401,6 +813,8 @@ void Instrumentation::instrumentFunction(BinaryContext &BC,
         }
         continue;
       }
+      if (opts::InstrumentCallsOnly)
+        continue;
       if (TargetFunc) {
         // Do not instrument edges in the spanning tree
         if (STOutSet[&BB].find(TargetBB) != STOutSet[&BB].end()) {
@@ -443,6 +857,9 @@ void Instrumentation::instrumentFunction(BinaryContext &BC,
 
     } // End of instructions loop
 
+    if (opts::InstrumentCallsOnly)
+      continue;
+
     // Instrument fallthroughs (when the direct jump instruction is missing)
     if (!HasUnconditionalBranch && !HasJumpTable && BB.succ_size() > 0 &&
         BB.size() > 0) {
@@ -458,9 +875,10 @@ void Instrumentation::instrumentFunction(BinaryContext &BC,
       // if it was branching to the end of the function as a result of
       // __builtin_unreachable(), in which case it was deleted by fixBranches.
       // Ignore this case. FIXME: force fixBranches() to preserve the offset.
-      if (!BC.MIB->hasAnnotation(*LastInstr, "Offset"))
+      if (!BC.MIB->hasAnnotation(*LastInstr, MCPlus::OffsetAnnotation))
         continue;
-      FromOffset = BC.MIB->getAnnotationAs<uint32_t>(*LastInstr, "Offset");
+      FromOffset =
+          BC.MIB->getAnnotationAs(*LastInstr, MCPlus::OffsetAnnotation);
 
       // Do not instrument edges in the spanning tree
       if (STOutSet[&BB].find(FTBB) != STOutSet[&BB].end()) {
@@ -477,8 +895,17 @@ void Instrumentation::instrumentFunction(BinaryContext &BC,
     }
   } // End of BBs loop
 
-  // Instrument spanning tree leaves
-  if (!opts::ConservativeInstrumentation) {
+  if (opts::InstrumentCallsOnly) {
+    // The entry blocks count the calls into the function. Skip those that are
+    // also reached from inside the function, they would count more.
+    for (auto BBI = Function.begin(), BBE = Function.end(); BBI != BBE; ++BBI) {
+      auto &BB{*BBI};
+      if (BB.isEntryPoint() && BB.pred_size() == 0)
+        instrumentLeafNode(BC, BB, BB.begin(), IsLeafFunction, *FuncDesc,
+                           BBToID[&BB]);
+    }
+  } else if (!opts::ConservativeInstrumentation) {
+    // Instrument spanning tree leaves
     for (auto BBI = Function.begin(), BBE = Function.end(); BBI != BBE; ++BBI) {
       auto &BB{*BBI};
       if (STOutSet[&BB].size() == 0)
@@ -496,14 +923,60 @@ void Instrumentation::instrumentFunction(BinaryContext &BC,
     ++Iter;
   }
 
+  if (opts::InstrumentationSamplingPeriod)
+    gateSampledCounters(BC, Function, Summary->SamplingFlag);
+
+  if (opts::InstrumentationFirstCallOrder) {
+    MCSymbol *Slot;
+    {
+      auto L = BC.scopeLock();
+      Slot = BC.Ctx->createTempSymbol("InstrFirstCall", true);
+      Summary->FirstCallSlots.emplace_back(Slot);
+      Summary->FirstCallNames.emplace_back(getFunctionNameIndex(Function));
+    }
+    recordFirstCall(BC, Function, Slot, Summary->FirstCallSequence);
+  }
+
   // Unused now
   FuncDesc->EdgesSet.clear();
 }
 
 void Instrumentation::runOnFunctions(BinaryContext &BC) {
-  if (!BC.isX86())
+  if (!BC.isX86() && !BC.isAArch64())
     return;
 
+  if (BC.isAArch64() && (opts::InstrumentationCounterShards > 1 ||
+                         opts::InstrumentationSamplingPeriod ||
+                         opts::InstrumentationFirstCallOrder ||
+                         !opts::InstrumentMemoryAccesses.empty())) {
+    errs() << "BOLT-ERROR: sharded and sampled counters, first call order and "
+              "memory access instrumentation are not supported on AArch64\n";
+    exit(1);
+  }
+  if (!isPowerOf2_32(opts::InstrumentationCounterShards)) {
+    errs() << "BOLT-ERROR: -instrumentation-counter-shards must be a power of "
+              "two\n";
+    exit(1);
+  }
+  if (opts::InstrumentationSamplingPeriod &&
+      opts::InstrumentationSamplingBurst >=
+          opts::InstrumentationSamplingPeriod) {
+    errs() << "BOLT-ERROR: -instrumentation-sampling-burst must be shorter "
+              "than -instrumentation-sampling-period\n";
+    exit(1);
+  }
+  if (opts::InstrumentCallsOnly && !opts::InstrumentCalls) {
+    errs() << "BOLT-ERROR: -instrument-calls-only requires -instrument-calls\n";
+    exit(1);
+  }
+  if ((opts::InstrumentationCounterShards > 1 ||
+       opts::InstrumentationSamplingPeriod) &&
+      !BC.isELF()) {
+    errs() << "BOLT-ERROR: sharded and sampled instrumentation counters are "
+              "only supported for ELF binaries\n";
+    exit(1);
+  }
+
   const auto Flags = BinarySection::getFlags(/*IsReadOnly=*/false,
                                              /*IsText=*/false,
                                              /*IsAllocatable=*/true);
@@ -519,6 +992,25 @@ void Instrumentation::runOnFunctions(BinaryContext &BC) {
       BC.Ctx->getOrCreateSymbol("__bolt_trampoline_ind_call");
   Summary->IndTailCallHandlerFunc =
       BC.Ctx->getOrCreateSymbol("__bolt_trampoline_ind_tailcall");
+  Summary->ValueProfHandlerFunc =
+      BC.Ctx->getOrCreateSymbol("__bolt_trampoline_value_prof");
+  Summary->MemAccessHandlerFunc =
+      BC.Ctx->getOrCreateSymbol("__bolt_trampoline_mem_access");
+
+  if (!opts::InstrumentMemoryAccesses.empty()) {
+    if (!opts::InstrumentationMemorySampleRate) {
+      errs() << "BOLT-ERROR: -instrumentation-memory-sample-rate must be "
+                "positive\n";
+      exit(1);
+    }
+    collectDataObjects(BC);
+  }
+  Summary->CounterShardStride =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_shard_stride");
+  Summary->SamplingFlag =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_sampling_on");
+  Summary->FirstCallSequence =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_first_call_seq");
 
   ParallelUtilities::PredicateTy SkipPredicate = [&](const BinaryFunction &BF) {
     return (!BF.isSimple() || BF.isIgnored() ||
@@ -607,15 +1099,64 @@ void Instrumentation::createAuxiliaryFunctions(BinaryContext &BC) {
   Summary->InitialIndTailCallHandlerFunction =
       createSimpleFunction("__bolt_instr_default_ind_tailcall_handler",
                            BC.MIB->createInstrumentedNoopIndTailCallHandler());
+
+  std::vector<MCInst> Return(1);
+  BC.MIB->createReturn(Return[0]);
+  Summary->InitialValueProfHandlerFunction = createSimpleFunction(
+      "__bolt_instr_default_value_prof_handler", std::move(Return));
+}
+
+void Instrumentation::sortCounters() {
+  const uint32_t NumCounters = Summary->Counters.size();
+  std::vector<uint32_t> Order(NumCounters);
+  std::iota(Order.begin(), Order.end(), 0);
+  std::stable_sort(Order.begin(), Order.end(), [&](uint32_t A, uint32_t B) {
+    return Summary->CounterWeights[A] > Summary->CounterWeights[B];
+  });
+
+  std::vector<uint32_t> NewIndex(NumCounters);
+  std::vector<MCSymbol *> Counters(NumCounters);
+  std::vector<uint64_t> Weights(NumCounters);
+  for (uint32_t I = 0; I < NumCounters; ++I) {
+    NewIndex[Order[I]] = I;
+    Counters[I] = Summary->Counters[Order[I]];
+    Weights[I] = Summary->CounterWeights[Order[I]];
+    if (Weights[I])
+      ++HotCounters;
+  }
+  Summary->Counters = std::move(Counters);
+  Summary->CounterWeights = std::move(Weights);
+
+  auto remap = [&](uint32_t &Counter) {
+    if (Counter != 0xffffffff)
+      Counter = NewIndex[Counter];
+  };
+  for (auto &FuncDesc : Summary->FunctionDescriptions) {
+    for (auto &LeafNode : FuncDesc.LeafNodes)
+      remap(LeafNode.Counter);
+    for (auto &Edge : FuncDesc.Edges)
+      remap(Edge.Counter);
+    for (auto &Call : FuncDesc.Calls)
+      remap(Call.Counter);
+  }
 }
 
 void Instrumentation::setupRuntimeLibrary(BinaryContext &BC) {
+  if (opts::InstrumentationSortCounters)
+    sortCounters();
+
   auto FuncDescSize = Summary->getFDSize();
 
   outs() << "BOLT-INSTRUMENTER: Number of indirect call site descriptors: "
          << Summary->IndCallDescriptions.size() << "\n";
   outs() << "BOLT-INSTRUMENTER: Number of indirect call target descriptors: "
          << Summary->IndCallTargetDescriptions.size() << "\n";
+  outs() << "BOLT-INSTRUMENTER: Number of value profiled call sites: "
+         << Summary->ValueSiteDescriptions.size() << "\n";
+  if (!opts::InstrumentMemoryAccesses.empty())
+    outs() << "BOLT-INSTRUMENTER: Number of profiled memory accesses: "
+           << Summary->MemAccessSiteDescriptions.size() << " to "
+           << Summary->DataObjects.size() << " data objects\n";
   outs() << "BOLT-INSTRUMENTER: Number of function descriptors: "
          << Summary->FunctionDescriptions.size() << "\n";
   outs() << "BOLT-INSTRUMENTER: Number of branch counters: " << BranchCounters
@@ -628,13 +1169,19 @@ void Instrumentation::setupRuntimeLibrary(BinaryContext &BC) {
          << Summary->Counters.size() << "\n";
   outs() << "BOLT-INSTRUMENTER: Total size of counters: "
          << (Summary->Counters.size() * 8) << " bytes (static alloc memory)\n";
+  if (opts::InstrumentationSortCounters)
+    outs() << "BOLT-INSTRUMENTER: " << HotCounters
+           << " counters of profiled code packed in the first "
+           << (HotCounters * 8) << " bytes\n";
   outs() << "BOLT-INSTRUMENTER: Total size of string table emitted: "
          << Summary->StringTable.size() << " bytes in file\n";
   outs() << "BOLT-INSTRUMENTER: Total size of descriptors: "
          << (FuncDescSize +
              Summary->IndCallDescriptions.size() * sizeof(IndCallDescription) +
              Summary->IndCallTargetDescriptions.size() *
-                 sizeof(IndCallTargetDescription))
+                 sizeof(IndCallTargetDescription) +
+             Summary->ValueSiteDescriptions.size() *
+                 sizeof(ValueSiteDescription))
          << " bytes in file\n";
   outs() << "BOLT-INSTRUMENTER: Profile will be saved to file "
          << opts::InstrumentationFilename << "\n";
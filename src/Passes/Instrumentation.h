@@ -54,6 +54,8 @@ private:
                                 uint32_t From);
   void createIndCallTargetDescription(const BinaryFunction &ToFunction,
                                       uint32_t To);
+  void createValueSiteDescription(const BinaryFunction &FromFunction,
+                                  uint32_t From);
   bool createCallDescription(FunctionDescription &FuncDesc,
                              const BinaryFunction &FromFunction, uint32_t From,
                              uint32_t FromNodeID,
@@ -66,9 +68,17 @@ private:
                              uint32_t ToNodeID, bool Instrumented);
   void createLeafNodeDescription(FunctionDescription &FuncDesc, uint32_t Node);
 
-  /// Create the sequence of instructions to increment a counter
+  /// Create the sequence of instructions to increment a counter. Flags are
+  /// preserved unless \p SaveFlags is false. \p Weight is the count of the
+  /// instrumented block or edge in the input profile.
   std::vector<MCInst> createInstrumentationSnippet(BinaryContext &BC,
-                                                   bool IsLeaf);
+                                                   bool IsLeaf,
+                                                   bool SaveFlags = true,
+                                                   uint64_t Weight = 0);
+
+  /// Renumber counters by decreasing weight, so the hot ones share cache
+  /// lines and pages.
+  void sortCounters();
 
   // Critical edges worklist
   // This worklist keeps track of CFG edges <From-To> that needs to be split.
@@ -102,6 +112,22 @@ private:
                                 BinaryBasicBlock::iterator &Iter,
                                 BinaryFunction &FromFunction, uint32_t From);
 
+  /// Record the size argument of the memcpy/memset call in \p Iter. On
+  /// return, \p Iter points to the call again.
+  void instrumentValueSite(BinaryBasicBlock &BB,
+                           BinaryBasicBlock::iterator &Iter,
+                           BinaryFunction &FromFunction, uint32_t From);
+
+  /// Record the address accessed by the load or store in \p Iter if it may
+  /// hit a global object. On return, \p Iter points to the access again.
+  void instrumentMemoryAccess(BinaryBasicBlock &BB,
+                              BinaryBasicBlock::iterator &Iter,
+                              BinaryFunction &FromFunction, uint32_t From);
+
+  /// Collect the data objects that profiled memory accesses are attributed
+  /// to.
+  void collectDataObjects(BinaryContext &BC);
+
   void createAuxiliaryFunctions(BinaryContext &BC);
 
   uint32_t getFDSize() const;
@@ -123,6 +149,7 @@ private:
   uint32_t DirectCallCounters{0};
   uint32_t BranchCounters{0};
   uint32_t LeafNodeCounters{0};
+  uint32_t HotCounters{0};
 };
 }
 }
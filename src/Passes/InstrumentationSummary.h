@@ -22,6 +22,7 @@ class MCSymbol;
 
 namespace bolt {
 
+class BinaryData;
 class BinaryFunction;
 
 // All structs here are part of the program metadata serialization format and
@@ -61,6 +62,12 @@ struct IndCallTargetDescription {
   const BinaryFunction *Target;
 };
 
+// A call site whose size argument is value profiled (memcpy/memset). Spans
+// multiple counters during runtime, one for each distinct value observed.
+struct ValueSiteDescription {
+  LocDescription FromLoc;
+};
+
 // Intra-function control flow transfer instrumentation
 struct EdgeDescription {
   LocDescription FromLoc;
@@ -101,6 +108,10 @@ struct InstrumentationSummary {
   /// Identify all counters used in runtime while instrumentation is running
   std::vector<MCSymbol *> Counters;
 
+  /// Execution count of the block or edge of each counter in the input
+  /// profile, used to place hot counters next to each other
+  std::vector<uint64_t> CounterWeights;
+
   /// Stores function names, to be emitted to the runtime
   std::string StringTable;
 
@@ -108,6 +119,26 @@ struct InstrumentationSummary {
   MCSymbol *IndCallHandlerFunc;
   MCSymbol *IndTailCallHandlerFunc;
 
+  /// Our runtime value profiling handler
+  MCSymbol *ValueProfHandlerFunc;
+
+  /// Our runtime memory access profiling handler
+  MCSymbol *MemAccessHandlerFunc;
+
+  /// Distance in bytes between copies of the counter array when counters
+  /// are sharded per CPU
+  MCSymbol *CounterShardStride;
+
+  /// Byte that is non-zero while sampled counters are being updated
+  MCSymbol *SamplingFlag;
+
+  /// One slot per function receiving its position in the order of first
+  /// execution, the string table index of the function name, and the last
+  /// position handed out
+  std::vector<MCSymbol *> FirstCallSlots;
+  std::vector<uint32_t> FirstCallNames;
+  MCSymbol *FirstCallSequence;
+
   /// Intra-function control flow and direct calls
   std::vector<FunctionDescription> FunctionDescriptions;
 
@@ -115,6 +146,14 @@ struct InstrumentationSummary {
   std::vector<IndCallDescription> IndCallDescriptions;
   std::vector<IndCallTargetDescription> IndCallTargetDescriptions;
 
+  /// Call sites with value profiled arguments
+  std::vector<ValueSiteDescription> ValueSiteDescriptions;
+
+  /// Loads and stores with profiled addresses, and the objects, sorted by
+  /// address, that the runtime attributes the addresses to
+  std::vector<ValueSiteDescription> MemAccessSiteDescriptions;
+  std::vector<const BinaryData *> DataObjects;
+
   /// Our generated initial indirect call handler function that does nothing
   /// except calling the indirect call target. The target program starts
   /// using this no-op instrumentation function until our runtime library
@@ -124,6 +163,10 @@ struct InstrumentationSummary {
   BinaryFunction *InitialIndCallHandlerFunction;
   BinaryFunction *InitialIndTailCallHandlerFunction;
 
+  /// Same as above, but for the value and memory access profiling handlers,
+  /// which are just a return until the runtime installs the real ones.
+  BinaryFunction *InitialValueProfHandlerFunction;
+
   static constexpr uint64_t NUM_SERIALIZED_CONTAINERS = 4;
   static constexpr uint64_t SERIALIZED_CONTAINER_SIZE =
       sizeof(uint32_t) * NUM_SERIALIZED_CONTAINERS;
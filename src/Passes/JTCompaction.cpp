@@ -0,0 +1,282 @@
+//===--- Passes/JTCompaction.cpp - Jump table compaction ------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "JTCompaction.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Options.h"
+
+#define DEBUG_TYPE "JT"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+extern cl::opt<JumpTableSupportLevel> JumpTables;
+
+static cl::opt<bool>
+JTAlignHotEntries("jt-align-hot-entries",
+  cl::desc("with jt-compaction, align hot jump tables so that their most "
+           "frequently used entries share a cache line"),
+  cl::init(true),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+
+namespace {
+
+constexpr uint64_t CacheLineSize = 64;
+
+/// Instructions of a matched PIC jump table dispatch sequence.
+struct DispatchSite {
+  BinaryBasicBlock *BB;
+  MCInst *Load;
+  MCInst *Add;
+  MCPhysReg BaseReg;
+  MCPhysReg IndexReg;
+  MCPhysReg SegmentReg;
+};
+
+/// Match the PIC dispatch sequence terminating \p BB and return false if it
+/// does not match or its base register is alive after the jump.
+bool matchDispatch(const BinaryContext &BC, BinaryBasicBlock &BB,
+                   DataflowInfoManager &Info, DispatchSite &Site) {
+  auto IndJmp = std::prev(BB.getLastNonPseudo().base());
+
+  MCPhysReg AddReg;
+  MCPhysReg BaseReg;
+  MCPhysReg IndexReg;
+  uint64_t Scale;
+  uint64_t Offset;
+  auto PICIndJmpMatcher = BC.MIB->matchIndJmp(BC.MIB->matchAdd(
+      BC.MIB->matchReg(AddReg),
+      BC.MIB->matchLoad(BC.MIB->matchReg(BaseReg), BC.MIB->matchImm(Scale),
+                        BC.MIB->matchReg(IndexReg), BC.MIB->matchImm(Offset))));
+  auto PICBaseAddrMatcher = BC.MIB->matchIndJmp(
+      BC.MIB->matchAdd(BC.MIB->matchLoadAddr(BC.MIB->matchSymbol()),
+                       BC.MIB->matchAnyOperand()));
+  auto Window = MutableArrayRef<MCInst>(&*BB.begin(), &*IndJmp + 1);
+  if (!PICIndJmpMatcher->match(*BC.MRI, *BC.MIB, Window, -1) ||
+      Scale != 4 || AddReg != BaseReg || Offset != 0 ||
+      !PICBaseAddrMatcher->match(*BC.MRI, *BC.MIB, Window, -1))
+    return false;
+
+  // Find the load and the addition among the matched instructions.
+  PICIndJmpMatcher->annotate(*BC.MIB, "JTCompaction");
+  Site = DispatchSite{&BB, nullptr, nullptr, BaseReg, IndexReg, 0};
+  for (auto &Inst : BB) {
+    if (!BC.MIB->hasAnnotation(Inst, "JTCompaction"))
+      continue;
+    BC.MIB->removeAnnotation(Inst, "JTCompaction");
+    if (&Inst == &*IndJmp)
+      continue;
+    if (BC.MIB->isLoad(Inst))
+      Site.Load = &Inst;
+    else
+      Site.Add = &Inst;
+  }
+  if (!Site.Load || !Site.Add || !BC.MIB->isMOVSX64rm32(*Site.Load))
+    return false;
+
+  unsigned MemBaseReg;
+  int64_t MemScale;
+  unsigned MemIndexReg;
+  int64_t MemDisp;
+  unsigned MemSegmentReg;
+  const MCExpr *MemDispExpr{nullptr};
+  if (!BC.MIB->evaluateX86MemoryOperand(*Site.Load, &MemBaseReg, &MemScale,
+                                        &MemIndexReg, &MemDisp, &MemSegmentReg,
+                                        &MemDispExpr) ||
+      MemDispExpr)
+    return false;
+  Site.SegmentReg = MemSegmentReg;
+
+  // The base register will hold the function address after the addition.
+  return !Info.getLivenessAnalysis().isAlive(ProgramPoint(Site.Add), BaseReg);
+}
+
+} // anonymous namespace
+
+unsigned JTCompaction::getCompactEntrySize(const BinaryFunction &Function,
+                                           const MCCodeEmitter *Emitter) const {
+  // The code is not laid out yet, so its size is bounded by the estimated
+  // size with a margin for branch relaxation, branch boundary alignment and
+  // block alignment.
+  uint64_t MaxSize = 2;
+  for (const auto *BB : Function.layout()) {
+    if (BB->isCold())
+      continue;
+    MaxSize += BB->estimateSize(Emitter) * 5 / 4 + 72;
+  }
+
+  if (isInt<8>(MaxSize))
+    return 1;
+  if (isInt<16>(MaxSize))
+    return 2;
+  return 0;
+}
+
+bool JTCompaction::compactJumpTable(BinaryFunction &Function, JumpTable &JT,
+                                    ArrayRef<BinaryBasicBlock *> Sites,
+                                    unsigned EntrySize,
+                                    DataflowInfoManager &Info) {
+  auto &BC = Function.getBinaryContext();
+  if (JT.Type != JumpTable::JTT_PIC || JT.EntrySize != 4 ||
+      JT.OutputEntrySize != 4 || JT.Labels.size() != 1 ||
+      JT.Parent != &Function)
+    return false;
+
+  // All targets should be in the hot part, as they are relative to its start.
+  for (const auto *Entry : JT.Entries) {
+    const auto *BB = Function.getBasicBlockForLabel(Entry);
+    if (!BB || BB->isCold())
+      return false;
+  }
+
+  std::vector<DispatchSite> Matched(Sites.size());
+  for (unsigned I = 0; I < Sites.size(); ++I) {
+    if (Sites[I]->isCold() || !matchDispatch(BC, *Sites[I], Info, Matched[I]))
+      return false;
+  }
+
+  for (const auto &Site : Matched) {
+    auto &BB = *Site.BB;
+    MCInst NewLoad;
+    BC.MIB->createSignExtLoad(NewLoad, Site.BaseReg, EntrySize, Site.IndexReg,
+                              0, nullptr, Site.SegmentReg,
+                              Site.Load->getOperand(0).getReg(), EntrySize);
+    MCInst LoadAddress;
+    BC.MIB->createLoadAddress(LoadAddress, Function.getSymbol(), Site.BaseReg,
+                              BC.Ctx.get());
+    for (auto II = BB.begin(); II != BB.end(); ++II) {
+      if (&*II == Site.Load) {
+        *II = NewLoad;
+      } else if (&*II == Site.Add) {
+        BB.insertInstruction(II, std::move(LoadAddress));
+        break;
+      }
+    }
+    CompactedScore += BB.getKnownExecutionCount();
+  }
+
+  BytesSaved += JT.Entries.size() * (JT.OutputEntrySize - EntrySize);
+  JT.OutputEntrySize = EntrySize;
+  JT.OutputEntryBase = Function.getSymbol();
+  return true;
+}
+
+void JTCompaction::alignHotEntries(JumpTable &JT) {
+  if (JT.Labels.size() != 1 || !JT.Count || JT.Counts.empty())
+    return;
+
+  // Identical entries share the count, so it is only accounted once.
+  auto getCount = [&](size_t Begin, size_t End) {
+    SmallPtrSet<const MCSymbol *, 16> Targets;
+    uint64_t Count = 0;
+    for (auto I = Begin; I < End; ++I) {
+      if (Targets.insert(JT.Entries[I]).second)
+        Count += JT.Counts[I].Count;
+    }
+    return Count;
+  };
+
+  const auto EntrySize = JT.OutputEntrySize;
+  const auto Size = JT.Entries.size() * EntrySize;
+  if (Size <= CacheLineSize) {
+    const auto Alignment = PowerOf2Ceil(Size);
+    if (Alignment <= EntrySize)
+      return;
+    JT.OutputAlignment = Alignment;
+    JT.OutputPadding = 0;
+    ++NumJTsAligned;
+    return;
+  }
+
+  // Find the cache line worth of entries with the most executions.
+  const auto LineEntries = CacheLineSize / EntrySize;
+  size_t BestBegin = 0;
+  uint64_t BestCount = 0;
+  for (size_t Begin = 0; Begin + LineEntries <= JT.Entries.size(); ++Begin) {
+    const auto Count = getCount(Begin, Begin + LineEntries);
+    if (Count > BestCount) {
+      BestBegin = Begin;
+      BestCount = Count;
+    }
+  }
+  if (BestCount * 2 <= getCount(0, JT.Entries.size()))
+    return;
+
+  JT.OutputAlignment = CacheLineSize;
+  JT.OutputPadding =
+      (CacheLineSize - BestBegin * EntrySize % CacheLineSize) % CacheLineSize;
+  ++NumJTsAligned;
+}
+
+void JTCompaction::runOnFunctions(BinaryContext &BC) {
+  if (opts::JumpTables == JTS_BASIC && BC.HasRelocations)
+    return;
+
+  auto CG = buildCallGraph(BC);
+  RegAnalysis RA(BC, &BC.getBinaryFunctions(), &CG);
+  auto Emitter = BC.createIndependentMCCodeEmitter();
+  for (auto &BFIt : BC.getBinaryFunctions()) {
+    auto &Function = BFIt.second;
+
+    if (!shouldOptimize(Function) || !Function.hasJumpTables() ||
+        Function.getKnownExecutionCount() == 0)
+      continue;
+
+    // Collect indirect jumps of every jump table.
+    std::map<JumpTable *, std::vector<BinaryBasicBlock *>> JTSites;
+    for (auto *BB : Function.layout()) {
+      if (!BB->getNumNonPseudos())
+        continue;
+      auto *JT = Function.getJumpTable(*BB->getLastNonPseudo());
+      if (JT)
+        JTSites[JT].push_back(BB);
+      for (const auto &Inst : *BB) {
+        if (Function.getJumpTable(Inst))
+          TotalScore += BB->getKnownExecutionCount();
+      }
+    }
+
+    const auto EntrySize = getCompactEntrySize(Function, Emitter.MCE.get());
+    DataflowInfoManager Info(BC, Function, &RA, nullptr);
+    for (auto &JTI : JTSites) {
+      auto &JT = *JTI.first;
+      if (EntrySize && compactJumpTable(Function, JT, JTI.second, EntrySize,
+                                        Info)) {
+        ++NumJTsCompacted;
+        Modified.insert(&Function);
+      }
+      if (opts::JTAlignHotEntries && opts::JumpTables > JTS_BASIC)
+        alignHotEntries(JT);
+    }
+  }
+
+  outs() << "BOLT-INFO: JT compaction: " << NumJTsCompacted
+         << " jump tables compacted, " << BytesSaved << " bytes saved, "
+         << NumJTsAligned << " hot jump tables aligned";
+  if (TotalScore)
+    outs() << format(", %.2lf%%", CompactedScore * 100.0 / TotalScore)
+           << " of dynamic jump table uses compacted";
+  outs() << '\n';
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,82 @@
+//===--- Passes/JTCompaction.h - Jump table compaction --------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_JT_COMPACTION_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_JT_COMPACTION_H
+
+#include "BinaryPasses.h"
+#include "DataflowInfoManager.h"
+
+namespace llvm {
+namespace bolt {
+
+/// Reduce the data cache footprint of jump tables used by hot code.
+///
+/// PIC jump tables with all targets in the hot part of a function that is
+/// small enough are re-encoded with 8- or 16-bit entries relative to the
+/// function start. The dispatch sequence
+///
+///    leaq    JT(%rip), %r11
+///    movslq  (%r11,%rdx,4), %rcx
+///    addq    %r11, %rcx
+///    jmpq    *%rcx
+///
+/// is changed to load the narrow entry and to add the function address
+///
+///    leaq    JT(%rip), %r11
+///    movswq  (%r11,%rdx,2), %rcx
+///    leaq    func(%rip), %r11
+///    addq    %r11, %rcx
+///    jmpq    *%rcx
+///
+/// which requires the base register to be dead after the addition.
+///
+/// Independently, hot jump tables are aligned so that the cache line worth of
+/// consecutive entries with the most executions lands in one cache line.
+class JTCompaction : public BinaryFunctionPass {
+  uint64_t NumJTsCompacted{0};
+  uint64_t NumJTsAligned{0};
+  uint64_t BytesSaved{0};
+  uint64_t CompactedScore{0};
+  uint64_t TotalScore{0};
+  DenseSet<const BinaryFunction *> Modified;
+
+  /// Return the smallest entry size that fits the distance between any two
+  /// points of the hot part of \p Function, or 0 if there is none.
+  unsigned getCompactEntrySize(const BinaryFunction &Function,
+                               const MCCodeEmitter *Emitter) const;
+
+  /// Re-encode \p JT used by indirect jumps terminating \p Sites.
+  /// Return true if all the sites were updated.
+  bool compactJumpTable(BinaryFunction &Function, JumpTable &JT,
+                        ArrayRef<BinaryBasicBlock *> Sites,
+                        unsigned EntrySize, DataflowInfoManager &Info);
+
+  /// Align \p JT so that its hottest entries share a cache line.
+  void alignHotEntries(JumpTable &JT);
+
+public:
+  explicit JTCompaction(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "jt-compaction";
+  }
+  bool shouldPrint(const BinaryFunction &BF) const override {
+    return BinaryFunctionPass::shouldPrint(BF) && Modified.count(&BF) > 0;
+  }
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -0,0 +1,326 @@
+//===--- Passes/LayoutPlan.cpp - Serialized layout decisions --------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "Passes/LayoutPlan.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Options.h"
+
+#define DEBUG_TYPE "layout-plan"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+extern cl::opt<unsigned> Verbosity;
+
+static cl::opt<std::string>
+WriteLayoutPlan("write-layout-plan",
+  cl::desc("write the order of functions and basic blocks, the split points "
+           "and the alignment chosen from the profile to the given file"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::list<std::string>
+LayoutPlanFiles("layout-plan",
+  cl::CommaSeparated,
+  cl::desc("apply the layout written by -write-layout-plan for the same "
+           "binary, without a profile. Plans of shards of the binary are "
+           "merged"),
+  cl::value_desc("filename1,filename2,..."),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+namespace {
+
+/// Directive recording the number of functions in the hot text.
+const char *HotTextDirective = ".hot-text-functions";
+
+/// Parse "<align>/<max bytes>". Return true on error.
+bool parseAlignment(StringRef Str, uint32_t &Alignment, uint32_t &MaxBytes) {
+  StringRef AlignStr, MaxBytesStr;
+  std::tie(AlignStr, MaxBytesStr) = Str.split('/');
+  return AlignStr.getAsInteger(10, Alignment) ||
+         MaxBytesStr.getAsInteger(10, MaxBytes);
+}
+
+} // anonymous namespace
+
+namespace llvm {
+namespace bolt {
+
+bool LayoutPlan::isEnabled() {
+  return isWritten() || isApplied();
+}
+
+bool LayoutPlan::isWritten() {
+  return !opts::WriteLayoutPlan.empty();
+}
+
+bool LayoutPlan::isApplied() {
+  return !opts::LayoutPlanFiles.empty();
+}
+
+void LayoutPlan::readPlan() {
+  for (const auto &Filename : opts::LayoutPlanFiles)
+    readPlanFile(Filename);
+}
+
+void LayoutPlan::readPlanFile(StringRef Filename) {
+  auto MB = MemoryBuffer::getFileOrSTDIN(Filename);
+  if (auto EC = MB.getError()) {
+    errs() << "BOLT-ERROR: cannot read " << Filename << ": " << EC.message()
+           << '\n';
+    exit(1);
+  }
+
+  for (line_iterator LI(*MB.get(), /*SkipBlanks=*/true, '#'); !LI.is_at_eof();
+       ++LI) {
+    auto error = [&](const Twine &Message) {
+      errs() << "BOLT-ERROR: " << Filename << ':'
+             << LI.line_number() << ": " << Message << '\n';
+      exit(1);
+    };
+
+    SmallVector<StringRef, 16> Tokens;
+    SplitString(*LI, Tokens);
+    if (Tokens.empty())
+      continue;
+    if (Tokens[0] == HotTextDirective) {
+      if (Tokens.size() != 2 || Tokens[1].getAsInteger(10, NumHotTextFunctions))
+        error(Twine("expected ") + HotTextDirective + " <count>");
+      continue;
+    }
+
+    FunctionPlan FP;
+    uint32_t Alignment, MaxAlignmentBytes;
+    if (Tokens.size() < 3 ||
+        (Tokens[1] != "-" && Tokens[1].getAsInteger(10, FP.Index)) ||
+        parseAlignment(Tokens[2], Alignment, MaxAlignmentBytes))
+      error("expected <name> <index>|- <align>/<max bytes> [<blocks>]");
+    if (Tokens[1] == "-")
+      FP.Index = -1U;
+    else
+      HasFunctionOrder = true;
+    FP.Alignment = Alignment;
+    FP.MaxAlignmentBytes = MaxAlignmentBytes;
+
+    bool IsCold = false;
+    for (auto Token : makeArrayRef(Tokens).drop_front(3)) {
+      if (Token == "|") {
+        if (IsCold || FP.Blocks.empty())
+          error("unexpected '|'");
+        IsCold = true;
+        continue;
+      }
+      StringRef OffsetStr, AlignmentStr;
+      std::tie(OffsetStr, AlignmentStr) = Token.split(':');
+      BlockPlan BP{0, 1, 0, IsCold};
+      if (OffsetStr.getAsInteger(16, BP.Offset) ||
+          (!AlignmentStr.empty() &&
+           parseAlignment(AlignmentStr, BP.Alignment, BP.AlignmentMaxBytes)))
+        error("expected <offset>[:<align>/<max bytes>], got " + Token);
+      FP.Blocks.emplace_back(BP);
+    }
+
+    Plan[Tokens[0]] = std::move(FP);
+  }
+}
+
+const LayoutPlan::FunctionPlan *
+LayoutPlan::getPlan(const BinaryFunction &BF) const {
+  for (const auto Name : BF.getNames()) {
+    auto I = Plan.find(Name);
+    if (I != Plan.end())
+      return &I->second;
+  }
+  return nullptr;
+}
+
+bool LayoutPlan::applyLayout(BinaryFunction &BF,
+                             const FunctionPlan &FP) const {
+  if (BF.size() != FP.Blocks.size())
+    return false;
+
+  DenseMap<uint32_t, BinaryBasicBlock *> Blocks;
+  for (auto &BB : BF) {
+    const auto Offset = BB.getInputOffset();
+    if (Offset == BinaryBasicBlock::INVALID_OFFSET ||
+        !Blocks.insert(std::make_pair(Offset, &BB)).second)
+      return false;
+  }
+
+  BinaryFunction::BasicBlockOrderType NewLayout;
+  for (const auto &BP : FP.Blocks) {
+    auto I = Blocks.find(BP.Offset);
+    if (I == Blocks.end())
+      return false;
+    NewLayout.push_back(I->second);
+    Blocks.erase(I);
+  }
+  if (NewLayout.front() != &BF.front() || FP.Blocks.front().IsCold)
+    return false;
+
+  BF.updateBasicBlockLayout(NewLayout);
+  auto BP = FP.Blocks.begin();
+  for (auto *BB : BF.layout())
+    BB->setIsCold((BP++)->IsCold);
+  BF.updateLayoutIndices();
+  return true;
+}
+
+void LayoutPlan::applyAlignmentAndOrder(BinaryContext &BC) const {
+  // Without an order in the plan, e.g. in plans of shards, functions keep the
+  // order chosen in this run.
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &BF = BFI.second;
+    if (HasFunctionOrder)
+      BF.resetIndex();
+    const auto *FP = getPlan(BF);
+    if (!FP)
+      continue;
+
+    if (FP->Index != -1U)
+      BF.setIndex(FP->Index);
+    BF.setAlignment(FP->Alignment);
+    BF.setMaxAlignmentBytes(FP->MaxAlignmentBytes);
+
+    // Block alignment is only meaningful in the planned layout.
+    if (!BF.isSimple() || BF.layout_size() != FP->Blocks.size() ||
+        !std::equal(BF.layout_begin(), BF.layout_end(), FP->Blocks.begin(),
+                    [](const BinaryBasicBlock *BB, const BlockPlan &BP) {
+                      return BB->getInputOffset() == BP.Offset;
+                    }))
+      continue;
+    auto BP = FP->Blocks.begin();
+    for (auto *BB : BF.layout()) {
+      BB->setAlignment(BP->Alignment);
+      BB->setAlignmentMaxBytes(BP->AlignmentMaxBytes);
+      ++BP;
+    }
+  }
+  if (HasFunctionOrder)
+    BC.NumHotTextFunctions = NumHotTextFunctions;
+}
+
+void LayoutPlan::writePlan(BinaryContext &BC) const {
+  std::error_code EC;
+  raw_fd_ostream OS(opts::WriteLayoutPlan, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-ERROR: cannot open " << opts::WriteLayoutPlan << ": "
+           << EC.message() << '\n';
+    exit(1);
+  }
+
+  OS << "# BOLT layout plan for use with -layout-plan\n";
+  if (BC.NumHotTextFunctions)
+    OS << HotTextDirective << ' ' << BC.NumHotTextFunctions << '\n';
+
+  uint64_t NumFunctions = 0;
+  uint64_t NumWithoutBlocks = 0;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &BF = BFI.second;
+    if (BF.isPLTFunction())
+      continue;
+    const bool HasLayout =
+        shouldOptimize(BF) && (BF.hasValidProfile() || BF.isSplit());
+    if (!BF.hasValidIndex() && !HasLayout)
+      continue;
+
+    OS << BF.getOneName() << ' ';
+    if (BF.hasValidIndex())
+      OS << BF.getIndex();
+    else
+      OS << '-';
+    OS << ' ' << BF.getAlignment() << '/' << BF.getMaxAlignmentBytes();
+    ++NumFunctions;
+
+    // Blocks created by the optimizations cannot be identified in the input.
+    if (HasLayout &&
+        llvm::any_of(BF, [](const BinaryBasicBlock &BB) {
+          return BB.getInputOffset() == BinaryBasicBlock::INVALID_OFFSET;
+        })) {
+      ++NumWithoutBlocks;
+    } else if (HasLayout) {
+      bool IsCold = false;
+      for (const auto *BB : BF.layout()) {
+        if (BB->isCold() && !IsCold) {
+          OS << " |";
+          IsCold = true;
+        }
+        OS << ' ' << Twine::utohexstr(BB->getInputOffset());
+        if (BB->getAlignment() > 1)
+          OS << ':' << BB->getAlignment() << '/' << BB->getAlignmentMaxBytes();
+      }
+    }
+    OS << '\n';
+  }
+
+  outs() << "BOLT-INFO: wrote layout plan of " << NumFunctions
+         << " functions to " << opts::WriteLayoutPlan << '\n';
+  if (NumWithoutBlocks)
+    outs() << "BOLT-INFO: the plan omits the block layout of "
+           << NumWithoutBlocks
+           << " functions with basic blocks not present in the input\n";
+}
+
+void LayoutPlan::runOnFunctions(BinaryContext &BC) {
+  if (AfterAlignment) {
+    if (isApplied()) {
+      readPlan();
+      applyAlignmentAndOrder(BC);
+    }
+    if (isWritten())
+      writePlan(BC);
+    return;
+  }
+
+  if (!isApplied())
+    return;
+
+  readPlan();
+  uint64_t NumApplied = 0;
+  uint64_t NumMismatched = 0;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &BF = BFI.second;
+    if (!shouldOptimize(BF))
+      continue;
+    const auto *FP = getPlan(BF);
+    if (!FP || FP->Blocks.empty())
+      continue;
+    if (applyLayout(BF, *FP)) {
+      ++NumApplied;
+      continue;
+    }
+    ++NumMismatched;
+    if (opts::Verbosity >= 1)
+      outs() << "BOLT-INFO: basic blocks of " << BF
+             << " do not match the layout plan\n";
+  }
+
+  outs() << "BOLT-INFO: applied layout plan to " << NumApplied
+         << " functions\n";
+  if (NumMismatched)
+    errs() << "BOLT-WARNING: " << NumMismatched << " functions do not match "
+           << "the layout plan and keep the input layout\n";
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,111 @@
+//===--- Passes/LayoutPlan.h - Serialized layout decisions ------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_LAYOUT_PLAN_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_LAYOUT_PLAN_H
+
+#include "BinaryPasses.h"
+#include "llvm/ADT/StringMap.h"
+
+namespace llvm {
+namespace bolt {
+
+/// Generalization of -generate-function-order/-function-order to all the
+/// layout decisions made from the profile. With -write-layout-plan=<file>,
+/// the order of functions, the order of basic blocks, the split points and
+/// the alignment of functions and basic blocks chosen by the optimization
+/// passes are written to <file>. With -layout-plan=<file>, the decisions are
+/// applied to the same input binary without a profile.
+///
+/// Every function is described by one line, so that plans can be compared
+/// with diff:
+///
+///   <name> <index>|- <align>/<max bytes> [<block>[:<align>/<max bytes>]...
+///                                         [| <cold block>...]]
+///
+/// where blocks are identified by their offsets in the input function, in
+/// the order of the output layout. Blocks after '|' go to the cold fragment.
+/// A function is laid out as planned only if its basic blocks are exactly
+/// the planned ones, otherwise it keeps the input layout.
+///
+/// Plans written by the shards of a binary (see -num-shards) are merged by
+/// passing them all to -layout-plan. Since the shards do not order
+/// functions, the order is then chosen while applying the plans.
+class LayoutPlan : public BinaryFunctionPass {
+  /// Layout and alignment of a basic block.
+  struct BlockPlan {
+    uint32_t Offset;
+    uint32_t Alignment;
+    uint32_t AlignmentMaxBytes;
+    bool IsCold;
+  };
+
+  /// Decisions made for a function.
+  struct FunctionPlan {
+    uint32_t Index;
+    uint16_t Alignment;
+    uint16_t MaxAlignmentBytes;
+    std::vector<BlockPlan> Blocks;
+  };
+
+  /// True for the instance running after alignment.
+  const bool AfterAlignment;
+
+  /// Decisions read from -layout-plan, indexed by function name.
+  StringMap<FunctionPlan> Plan;
+
+  /// Number of functions the plan places in the hot text.
+  uint32_t NumHotTextFunctions{0};
+
+  /// True if the plan orders functions.
+  bool HasFunctionOrder{false};
+
+  /// Read all the plans given with -layout-plan.
+  void readPlan();
+
+  void readPlanFile(StringRef Filename);
+
+  /// Return the plan of \p BF, or nullptr if it has none.
+  const FunctionPlan *getPlan(const BinaryFunction &BF) const;
+
+  /// Apply the order of basic blocks and the split point of \p BF. Return
+  /// false if the function does not match the plan.
+  bool applyLayout(BinaryFunction &BF, const FunctionPlan &FP) const;
+
+  /// Apply the order of functions and the alignment.
+  void applyAlignmentAndOrder(BinaryContext &BC) const;
+
+  void writePlan(BinaryContext &BC) const;
+
+public:
+  explicit LayoutPlan(const cl::opt<bool> &PrintPass, bool AfterAlignment)
+    : BinaryFunctionPass(PrintPass), AfterAlignment(AfterAlignment) { }
+
+  const char *getName() const override {
+    return "layout-plan";
+  }
+
+  /// Return true if a plan is written or applied.
+  static bool isEnabled();
+
+  /// Return true if a plan is written.
+  static bool isWritten();
+
+  /// Return true if a plan is applied.
+  static bool isApplied();
+
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -0,0 +1,313 @@
+//===--- Passes/LayoutTuning.cpp - Tuning of code layout parameters -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "LayoutTuning.h"
+#include "BinaryFunctionCallGraph.h"
+#include "CacheMetrics.h"
+#include "HFSort.h"
+#include "ParallelUtilities.h"
+#include "ReorderAlgorithm.h"
+#include "ReorderFunctions.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Options.h"
+#include "llvm/Support/ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+#include <random>
+
+#define DEBUG_TYPE "layout-tuning"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+extern cl::opt<bool> NoThreads;
+extern cl::opt<bolt::ReorderBasicBlocks::LayoutType> ReorderBlocks;
+extern cl::opt<bolt::ReorderFunctions::ReorderType> ReorderFunctions;
+extern cl::opt<double> ForwardWeight;
+extern cl::opt<double> BackwardWeight;
+extern cl::opt<unsigned> ForwardDistance;
+extern cl::opt<unsigned> BackwardDistance;
+extern cl::opt<unsigned> ChainSplitThreshold;
+extern cl::opt<unsigned> ITLBEntries;
+extern cl::opt<double> MergeProbability;
+extern cl::opt<double> ArcThreshold;
+
+static cl::opt<unsigned>
+TuneLayoutCandidates("tune-layout-candidates",
+  cl::desc("number of parameter sets of every layout algorithm evaluated by "
+           "-tune-layout"),
+  cl::init(32),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+TuneLayoutFunctions("tune-layout-functions",
+  cl::desc("number of the hottest functions whose block layout is simulated "
+           "by -tune-layout"),
+  cl::init(500),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<std::string>
+TuneLayoutOutput("tune-layout-output",
+  cl::desc("write the layout parameters picked by -tune-layout to a file, as "
+           "options that could be passed back with @<file>"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+
+namespace {
+
+/// Objective of the search: the simulated misses that are the most sensitive
+/// to the code layout.
+double getCost(const SpeedupModel::FetchMisses &Misses) {
+  return Misses.L1I + Misses.ITLB;
+}
+
+/// Run \p Task for every index below \p Size on the thread pool.
+void runInParallel(size_t Size, std::function<void(size_t)> Task) {
+  if (opts::NoThreads) {
+    for (size_t I = 0; I < Size; ++I)
+      Task(I);
+    return;
+  }
+  ThreadPool &Pool = ParallelUtilities::getThreadPool();
+  for (size_t I = 0; I < Size; ++I)
+    Pool.async(Task, I);
+  Pool.wait();
+}
+
+/// Return \p Value scaled by a random factor between 1/4 and 4.
+double perturb(double Value, std::mt19937_64 &RNG) {
+  return Value * std::exp2(std::uniform_real_distribution<double>(-2, 2)(RNG));
+}
+
+/// Return the index of the candidate with the lowest cost, preferring the
+/// first one, which holds the current parameters, on ties.
+size_t getBestCandidate(const std::vector<double> &Costs) {
+  return std::min_element(Costs.begin(), Costs.end()) - Costs.begin();
+}
+
+void printResult(const char *Algorithm, const std::vector<double> &Costs,
+                 size_t Best) {
+  outs() << "BOLT-INFO: layout tuning evaluated " << Costs.size() << ' '
+         << Algorithm << " parameter sets, the best one has "
+         << format("%.0lf", Costs[Best]) << " simulated misses";
+  if (Costs[0] > 0)
+    outs() << format(" (%.2lf%% fewer than the current parameters)",
+                     100.0 * (Costs[0] - Costs[Best]) / Costs[0]);
+  outs() << '\n';
+}
+
+} // end anonymous namespace
+
+double LayoutTuning::getLayoutCost(
+    const std::vector<BinaryFunction *> &Functions,
+    const std::vector<BinaryFunction::BasicBlockOrderType> &Orders) const {
+  // Functions are placed one after another at cache line boundaries. Blocks
+  // keep their input sizes, which ignores the branches changed by the layout.
+  BlockAddressMap BBAddr;
+  BlockAddressMap BBSize;
+  uint64_t Address = 0;
+  for (const auto &Order : Orders) {
+    Address = alignTo(Address, 64);
+    for (auto *BB : Order) {
+      BBAddr[BB] = Address;
+      BBSize[BB] = BB->getOriginalSize();
+      Address += BB->getOriginalSize();
+    }
+  }
+  return getCost(CacheMetrics::simulateFetchMisses(Functions, BBAddr, BBSize));
+}
+
+void LayoutTuning::tuneBlockLayout(BinaryContext &BC) {
+  std::vector<BinaryFunction *> Functions;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &BF = BFI.second;
+    if (shouldOptimize(BF) && BF.hasValidProfile() && BF.layout_size() > 1)
+      Functions.push_back(&BF);
+  }
+  if (Functions.empty())
+    return;
+  std::stable_sort(Functions.begin(), Functions.end(),
+                   [](const BinaryFunction *A, const BinaryFunction *B) {
+                     return A->getKnownExecutionCount() >
+                            B->getKnownExecutionCount();
+                   });
+  if (Functions.size() > opts::TuneLayoutFunctions)
+    Functions.resize(opts::TuneLayoutFunctions);
+  std::sort(Functions.begin(), Functions.end(),
+            [](const BinaryFunction *A, const BinaryFunction *B) {
+              return A->getAddress() < B->getAddress();
+            });
+
+  // The metric is invariant to the scale of the weights, so the fall-through
+  // weight is kept.
+  const size_t NumCandidates =
+      std::max(1u, unsigned(opts::TuneLayoutCandidates));
+  std::mt19937_64 RNG(0);
+  const auto Current = ExtTSPParams::fromOptions();
+  std::vector<ExtTSPParams> Candidates(1, Current);
+  const unsigned SplitThresholds[] = {32, 64, 128, 256, 512};
+  while (Candidates.size() < NumCandidates) {
+    auto Params = Current;
+    Params.ForwardWeight = perturb(Current.ForwardWeight, RNG);
+    Params.BackwardWeight = perturb(Current.BackwardWeight, RNG);
+    Params.ForwardDistance =
+        std::max(1.0, perturb(Current.ForwardDistance, RNG));
+    Params.BackwardDistance =
+        std::max(1.0, perturb(Current.BackwardDistance, RNG));
+    Params.ChainSplitThreshold =
+        SplitThresholds[std::uniform_int_distribution<size_t>(0, 4)(RNG)];
+    Candidates.push_back(Params);
+  }
+
+  // Every function is laid out with all candidates by a single task, since
+  // the layout algorithm updates the layout indices of its blocks.
+  std::vector<std::vector<BinaryFunction::BasicBlockOrderType>> Orders(
+      Candidates.size(),
+      std::vector<BinaryFunction::BasicBlockOrderType>(Functions.size()));
+  runInParallel(Functions.size(), [&](size_t FuncId) {
+    for (size_t I = 0; I < Candidates.size(); ++I)
+      ExtTSPReorderAlgorithm(nullptr, Candidates[I])
+          .reorderBasicBlocks(*Functions[FuncId], Orders[I][FuncId]);
+  });
+
+  std::vector<double> Costs(Candidates.size());
+  runInParallel(Candidates.size(), [&](size_t I) {
+    Costs[I] = getLayoutCost(Functions, Orders[I]);
+  });
+
+  const auto Best = getBestCandidate(Costs);
+  printResult("ext-tsp", Costs, Best);
+  const auto &Params = Candidates[Best];
+  opts::ForwardWeight = Params.ForwardWeight;
+  opts::BackwardWeight = Params.BackwardWeight;
+  opts::ForwardDistance = Params.ForwardDistance;
+  opts::BackwardDistance = Params.BackwardDistance;
+  opts::ChainSplitThreshold = Params.ChainSplitThreshold;
+}
+
+void LayoutTuning::tuneFunctionLayout(BinaryContext &BC) {
+  // The call graph is built with the default options of function reordering.
+  auto Cg = buildCallGraph(BC,
+                           [](const BinaryFunction &BF) {
+                             return !BF.hasProfile() ||
+                                    BF.getState() != BinaryFunction::State::CFG;
+                           },
+                           /*CgFromPerfData=*/true,
+                           /*IncludeColdCalls=*/false,
+                           /*UseFunctionHotSize=*/true,
+                           /*UseSplitHotSize=*/false,
+                           /*UseEdgeCounts=*/true,
+                           /*IgnoreRecursiveCalls=*/true);
+  Cg.normalizeArcWeights();
+  if (!Cg.numNodes())
+    return;
+
+  const size_t NumCandidates =
+      std::max(1u, unsigned(opts::TuneLayoutCandidates));
+  std::mt19937_64 RNG(0);
+  const auto Current = HFSortPlusParams::fromOptions();
+  std::vector<HFSortPlusParams> Candidates(1, Current);
+  while (Candidates.size() < NumCandidates) {
+    auto Params = Current;
+    Params.ITLBEntries = std::max(1.0, perturb(Current.ITLBEntries, RNG));
+    Params.MergeProbability =
+        std::uniform_real_distribution<double>(0.05, 1.0)(RNG);
+    Params.ArcThreshold = std::pow(
+        10.0, std::uniform_real_distribution<double>(-10, -4)(RNG));
+    Candidates.push_back(Params);
+  }
+
+  // Function orders are computed one at a time, since hfsort+ uses the thread
+  // pool itself.
+  std::vector<std::vector<BinaryFunction *>> Functions(Candidates.size());
+  std::vector<std::vector<BinaryFunction::BasicBlockOrderType>> Orders(
+      Candidates.size());
+  for (size_t I = 0; I < Candidates.size(); ++I) {
+    for (const auto &Cluster : hfsortPlus(Cg, Candidates[I], false)) {
+      for (auto FuncId : Cluster.targets()) {
+        auto *BF = Cg.nodeIdToFunc(FuncId);
+        Functions[I].push_back(BF);
+        Orders[I].emplace_back(BF->layout_begin(), BF->layout_end());
+      }
+    }
+  }
+
+  std::vector<double> Costs(Candidates.size());
+  runInParallel(Candidates.size(), [&](size_t I) {
+    Costs[I] = getLayoutCost(Functions[I], Orders[I]);
+  });
+
+  const auto Best = getBestCandidate(Costs);
+  printResult("hfsort+", Costs, Best);
+  const auto &Params = Candidates[Best];
+  opts::ITLBEntries = Params.ITLBEntries;
+  opts::MergeProbability = Params.MergeProbability;
+  opts::ArcThreshold = Params.ArcThreshold;
+}
+
+void LayoutTuning::runOnFunctions(BinaryContext &BC) {
+  const bool TuneBlocks =
+      opts::ReorderBlocks == ReorderBasicBlocks::LT_OPTIMIZE_EXT_TSP;
+  const bool TuneFunctions =
+      opts::ReorderFunctions == ReorderFunctions::RT_HFSORT_PLUS;
+  if (!TuneBlocks && !TuneFunctions) {
+    errs() << "BOLT-WARNING: -tune-layout needs -reorder-blocks=ext-tsp or "
+              "-reorder-functions=hfsort+\n";
+    return;
+  }
+
+  if (TuneBlocks)
+    tuneBlockLayout(BC);
+  if (TuneFunctions)
+    tuneFunctionLayout(BC);
+
+  if (opts::TuneLayoutOutput.empty())
+    return;
+
+  std::error_code EC;
+  raw_fd_ostream OS(opts::TuneLayoutOutput, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-WARNING: " << EC.message() << ", unable to open "
+           << opts::TuneLayoutOutput << " for output.\n";
+    return;
+  }
+  if (TuneBlocks) {
+    OS << "-forward-weight=" << format("%g\n", double(opts::ForwardWeight))
+       << "-backward-weight=" << format("%g\n", double(opts::BackwardWeight))
+       << "-forward-distance=" << opts::ForwardDistance << '\n'
+       << "-backward-distance=" << opts::BackwardDistance << '\n'
+       << "-chain-split-threshold=" << opts::ChainSplitThreshold << '\n';
+  }
+  if (TuneFunctions) {
+    OS << "-itlb-entries=" << opts::ITLBEntries << '\n'
+       << "-merge-probability="
+       << format("%g\n", double(opts::MergeProbability))
+       << "-arc-threshold=" << format("%g\n", double(opts::ArcThreshold));
+  }
+  outs() << "BOLT-INFO: layout parameters written to "
+         << opts::TuneLayoutOutput << '\n';
+}
+
+} // namespace bolt
+} // namespace llvm
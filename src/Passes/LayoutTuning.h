@@ -0,0 +1,65 @@
+//===--- Passes/LayoutTuning.h - Tuning of code layout parameters ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_LAYOUT_TUNING_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_LAYOUT_TUNING_H
+
+#include "BinaryPasses.h"
+#include <unordered_map>
+#include <vector>
+
+namespace llvm {
+namespace bolt {
+
+/// Search the parameters of the ext-tsp block layout and of the hfsort+
+/// function layout for the values that minimize the instruction fetch misses
+/// of the profile, before the layout passes run with them.
+///
+/// Candidate parameters are drawn around the values of the command-line
+/// options with a fixed seed. Every candidate lays out the code, and the
+/// layout is scored by replaying the profile in the cache simulator of
+/// CacheMetrics, which counts the L1i and i-TLB misses independently of the
+/// parameters being tuned. Block layouts are computed and scored on the
+/// hottest functions only. The candidates are evaluated in parallel on the
+/// thread pool, the best ones replace the values of the options, and they
+/// are optionally written to -tune-layout-output as options that could be
+/// passed back to BOLT with @<file>.
+class LayoutTuning : public BinaryFunctionPass {
+  using BlockAddressMap = std::unordered_map<BinaryBasicBlock *, uint64_t>;
+
+  /// Return the number of simulated misses of \p Functions, with their
+  /// blocks laid out in \p Orders starting from address zero.
+  double
+  getLayoutCost(const std::vector<BinaryFunction *> &Functions,
+                const std::vector<BinaryFunction::BasicBlockOrderType> &Orders)
+      const;
+
+  void tuneBlockLayout(BinaryContext &BC);
+
+  void tuneFunctionLayout(BinaryContext &BC);
+
+public:
+  explicit LayoutTuning(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "layout-tuning";
+  }
+  bool shouldPrint(const BinaryFunction &) const override {
+    return false;
+  }
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
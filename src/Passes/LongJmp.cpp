@@ -10,6 +10,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "LongJmp.h"
+#include <limits>
 
 #define DEBUG_TYPE "longjmp"
 
@@ -29,6 +30,16 @@ GroupStubs("group-stubs",
   cl::init(true),
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+StubIslandSpacing("stub-island-spacing",
+  cl::desc("in relocation mode, place stubs for calls from hot code in "
+           "islands shared by all callers in range, one after every given "
+           "number of bytes of hot code (0 to keep stubs in the callers)"),
+  cl::init(16 << 20),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
 }
 
 namespace llvm {
@@ -74,11 +85,12 @@ bool shouldInsertStub(const BinaryContext &BC, const MCInst &Inst) {
 } // end anonymous namespace
 
 std::pair<std::unique_ptr<BinaryBasicBlock>, MCSymbol *>
-LongJmpPass::createNewStub(BinaryBasicBlock &SourceBB, const MCSymbol *TgtSym,
-                           bool TgtIsFunc, uint64_t AtAddress) {
-  BinaryFunction &Func = *SourceBB.getFunction();
+LongJmpPass::createNewStub(BinaryBasicBlock &InsertionPoint,
+                           const MCSymbol *TgtSym, bool TgtIsFunc,
+                           uint64_t AtAddress) {
+  BinaryFunction &Func = *InsertionPoint.getFunction();
   const BinaryContext &BC = Func.getBinaryContext();
-  const bool IsCold = SourceBB.isCold();
+  const bool IsCold = InsertionPoint.isCold();
   auto *StubSym = BC.Ctx->createTempSymbol("Stub", true);
   auto StubBB = Func.createBasicBlock(0, StubSym);
   MCInst Inst;
@@ -184,6 +196,7 @@ BinaryBasicBlock *LongJmpPass::lookupLocalStub(const BinaryBasicBlock &SourceBB,
 std::unique_ptr<BinaryBasicBlock>
 LongJmpPass::replaceTargetWithStub(BinaryBasicBlock &BB, MCInst &Inst,
                                    uint64_t DotAddress,
+                                   BinaryBasicBlock &InsertionPoint,
                                    uint64_t StubCreationAddress) {
   const BinaryFunction &Func = *BB.getFunction();
   const BinaryContext &BC = Func.getBinaryContext();
@@ -225,7 +238,8 @@ LongJmpPass::replaceTargetWithStub(BinaryBasicBlock &BB, MCInst &Inst,
 
   if (!StubBB) {
     std::tie(NewBB, StubSymbol) =
-        createNewStub(BB, TgtSym, /*is func?*/ !TgtBB, StubCreationAddress);
+        createNewStub(InsertionPoint, TgtSym, /*is func?*/ !TgtBB,
+                      StubCreationAddress);
     StubBB = NewBB.get();
   }
 
@@ -237,7 +251,7 @@ LongJmpPass::replaceTargetWithStub(BinaryBasicBlock &BB, MCInst &Inst,
     StubBB->setExecutionCount(StubBB->getExecutionCount() + OrigCount);
     if (NewBB) {
       StubBB->addSuccessor(TgtBB, OrigCount, OrigMispreds);
-      StubBB->setIsCold(BB.isCold());
+      StubBB->setIsCold(InsertionPoint.isCold());
     }
   // Call / tail call
   } else {
@@ -245,7 +259,7 @@ LongJmpPass::replaceTargetWithStub(BinaryBasicBlock &BB, MCInst &Inst,
                               BB.getExecutionCount());
     if (NewBB) {
       assert(TgtBB == nullptr);
-      StubBB->setIsCold(BB.isCold());
+      StubBB->setIsCold(InsertionPoint.isCold());
       // Set as entry point because this block is valid but we have no preds
       StubBB->getFunction()->addEntryPoint(*StubBB);
     }
@@ -286,14 +300,35 @@ void LongJmpPass::tentativeBBLayout(const BinaryFunction &Func) {
     if (Cold || BB->isCold()) {
       Cold = true;
       BBAddresses[BB] = ColdDot;
-      ColdDot += BC.computeCodeSize(BB->begin(), BB->end());
+      ColdDot += getBBSize(BC, *BB);
     } else {
       BBAddresses[BB] = HotDot;
-      HotDot += BC.computeCodeSize(BB->begin(), BB->end());
+      HotDot += getBBSize(BC, *BB);
     }
   }
 }
 
+uint64_t LongJmpPass::getBBSize(const BinaryContext &BC,
+                                const BinaryBasicBlock &BB) {
+  auto Iter = BBSizes.find(&BB);
+  if (Iter != BBSizes.end())
+    return Iter->second;
+  const auto Size = BC.computeCodeSize(BB.begin(), BB.end());
+  BBSizes[&BB] = Size;
+  return Size;
+}
+
+uint64_t LongJmpPass::getFunctionSize(const BinaryFunction &Func, bool Cold) {
+  const BinaryContext &BC = Func.getBinaryContext();
+  uint64_t Size = 0;
+  for (const auto *BB : Func.layout()) {
+    if (Func.isSplit() && BB->isCold() != Cold)
+      continue;
+    Size += getBBSize(BC, *BB);
+  }
+  return Size;
+}
+
 uint64_t LongJmpPass::tentativeLayoutRelocColdPart(
   const BinaryContext &BC, std::vector<BinaryFunction *> &SortedFunctions,
   uint64_t DotAddress) {
@@ -307,7 +342,7 @@ uint64_t LongJmpPass::tentativeLayoutRelocColdPart(
     ColdAddresses[Func] = DotAddress;
     DEBUG(dbgs() << Func->getPrintName() << " cold tentative: "
                  << Twine::utohexstr(DotAddress) << "\n");
-    DotAddress += Func->estimateColdSize();
+    DotAddress += getFunctionSize(*Func, /*Cold=*/true);
     DotAddress += Func->estimateConstantIslandSize();
   }
   return DotAddress;
@@ -355,10 +390,7 @@ uint64_t LongJmpPass::tentativeLayoutRelocMode(
     HotAddresses[Func] = DotAddress;
     DEBUG(dbgs() << Func->getPrintName()
                  << " tentative: " << Twine::utohexstr(DotAddress) << "\n");
-    if (!Func->isSplit())
-      DotAddress += Func->estimateSize();
-    else
-      DotAddress += Func->estimateHotSize();
+    DotAddress += getFunctionSize(*Func, /*Cold=*/false);
     DotAddress += Func->estimateConstantIslandSize();
     ++CurrentIndex;
   }
@@ -380,7 +412,7 @@ void LongJmpPass::tentativeLayout(
       DotAddress = alignTo(DotAddress, ColdFragAlign);
       ColdAddresses[Func] = DotAddress;
       if (Func->isSplit())
-        DotAddress += Func->estimateColdSize();
+        DotAddress += getFunctionSize(*Func, /*Cold=*/true);
       tentativeBBLayout(*Func);
     }
 
@@ -484,8 +516,38 @@ bool LongJmpPass::relaxStub(BinaryBasicBlock &StubBB) {
   return true;
 }
 
-bool LongJmpPass::needsStub(const BinaryBasicBlock &BB, const MCInst &Inst,
-                            uint64_t DotAddress) const {
+uint64_t LongJmpPass::getStubSlack(const BinaryBasicBlock &StubBB) const {
+  const BinaryFunction &Func = *StubBB.getFunction();
+  const BinaryContext &BC = Func.getBinaryContext();
+  const auto BitsIter = StubBits.find(&StubBB);
+  assert(BitsIter != StubBits.end() && "unknown stub");
+  const auto Bits = BitsIter->second;
+  if (Bits == static_cast<int>(BC.AsmInfo->getCodePointerSize() * 8))
+    return std::numeric_limits<uint64_t>::max();
+
+  // Stubs are never shrunk, so a stub covers at least the range of a single
+  // instruction.
+  const auto RangeShortJmp = BC.MIB->getShortJmpEncodingSize();
+  const uint64_t Range =
+      Bits >= RangeShortJmp
+          ? 1ULL << RangeShortJmp
+          : 1ULL << (BC.MIB->getUncondBranchEncodingSize() - 1);
+
+  auto *RealTargetSym = BC.MIB->getTargetSymbol(*StubBB.begin());
+  auto *TgtBB = Func.getBasicBlockForLabel(RealTargetSym);
+  const uint64_t TgtAddress = getSymbolAddress(BC, RealTargetSym, TgtBB);
+  const auto AddrIter = BBAddresses.find(&StubBB);
+  const uint64_t DotAddress =
+      AddrIter != BBAddresses.end() ? AddrIter->second : 0;
+  const uint64_t PCRelTgtAddress = DotAddress > TgtAddress
+                                       ? DotAddress - TgtAddress
+                                       : TgtAddress - DotAddress;
+  return PCRelTgtAddress < Range ? Range - PCRelTgtAddress : 0;
+}
+
+uint64_t LongJmpPass::getBranchSlack(const BinaryBasicBlock &BB,
+                                     const MCInst &Inst,
+                                     uint64_t DotAddress) const {
   const BinaryFunction &Func = *BB.getFunction();
   const BinaryContext &BC = Func.getBinaryContext();
   auto TgtSym = BC.MIB->getTargetSymbol(Inst);
@@ -501,13 +563,72 @@ bool LongJmpPass::needsStub(const BinaryBasicBlock &BB, const MCInst &Inst,
   }
 
   auto BitsAvail = BC.MIB->getPCRelEncodingSize(Inst) - 1;
-  uint64_t Mask = ~((1ULL << BitsAvail) - 1);
+  const uint64_t Range = 1ULL << BitsAvail;
 
   uint64_t PCRelTgtAddress = getSymbolAddress(BC, TgtSym, TgtBB);
   PCRelTgtAddress = DotAddress > PCRelTgtAddress ? DotAddress - PCRelTgtAddress
                                                  : PCRelTgtAddress - DotAddress;
 
-  return PCRelTgtAddress & Mask;
+  return PCRelTgtAddress < Range ? Range - PCRelTgtAddress : 0;
+}
+
+void LongJmpPass::selectStubIslands(
+    std::vector<BinaryFunction *> &SortedFunctions) {
+  if (!opts::StubIslandSpacing || !opts::GroupStubs)
+    return;
+
+  const BinaryContext *BC = nullptr;
+  uint64_t NextIsland = 0;
+  for (auto *Func : SortedFunctions) {
+    if (!Func->hasValidIndex() || Func->empty())
+      continue;
+    if (!BC) {
+      BC = &Func->getBinaryContext();
+      if (!BC->HasRelocations)
+        return;
+      NextIsland = HotAddresses[Func] + opts::StubIslandSpacing;
+    }
+    // Islands are appended to the hot part of the function, which is only
+    // possible if we control its layout.
+    const auto End = HotAddresses[Func] + getFunctionSize(*Func, false);
+    if (End < NextIsland || !Func->isSimple())
+      continue;
+    StubIslands.push_back(Func);
+    NextIsland = End + opts::StubIslandSpacing;
+  }
+  DEBUG(dbgs() << "BOLT-DEBUG: selected " << StubIslands.size()
+               << " stub islands\n");
+}
+
+BinaryBasicBlock *
+LongJmpPass::getIslandInsertionPoint(BinaryFunction &Func) const {
+  if (auto *BB = getBBAtHotColdSplitPoint(Func))
+    return BB;
+  return *std::prev(Func.layout_end());
+}
+
+BinaryBasicBlock *LongJmpPass::getStubIsland(const BinaryContext &BC,
+                                             const MCInst &Inst,
+                                             uint64_t DotAddress,
+                                             uint64_t &IslandAddress) {
+  const uint64_t Range = 1ULL << (BC.MIB->getPCRelEncodingSize(Inst) - 1);
+  BinaryBasicBlock *Island = nullptr;
+  uint64_t MinDistance = Range;
+  for (auto *Func : StubIslands) {
+    auto *BB = getIslandInsertionPoint(*Func);
+    const auto BBIter = BBAddresses.find(BB);
+    if (BBIter == BBAddresses.end())
+      continue;
+    const auto Address = BBIter->second + getBBSize(BC, *BB);
+    const auto Distance =
+        DotAddress > Address ? DotAddress - Address : Address - DotAddress;
+    if (Distance < MinDistance) {
+      MinDistance = Distance;
+      Island = BB;
+      IslandAddress = Address;
+    }
+  }
+  return Island;
 }
 
 bool LongJmpPass::relax(BinaryFunction &Func) {
@@ -519,6 +640,8 @@ bool LongJmpPass::relax(BinaryFunction &Func) {
   std::vector<std::pair<BinaryBasicBlock *, std::unique_ptr<BinaryBasicBlock>>>
       Insertions;
 
+  uint64_t Slack = std::numeric_limits<uint64_t>::max();
+
   BinaryBasicBlock *Frontier = getBBAtHotColdSplitPoint(Func);
   uint64_t FrontierAddress = Frontier ? BBAddresses[Frontier] : 0;
   if (FrontierAddress) {
@@ -542,7 +665,9 @@ bool LongJmpPass::relax(BinaryFunction &Func) {
       }
 
       // Check and relax direct branch or call
-      if (!needsStub(BB, Inst, DotAddress)) {
+      const auto BranchSlack = getBranchSlack(BB, Inst, DotAddress);
+      if (BranchSlack) {
+        Slack = std::min(Slack, BranchSlack);
         DotAddress += InsnSize;
         continue;
       }
@@ -567,13 +692,26 @@ bool LongJmpPass::relax(BinaryFunction &Func) {
       // that we do not control.
       if (!Func.isSimple())
         InsertionPoint = &*std::prev(Func.end());
+      uint64_t StubCreationAddress =
+          InsertionPoint == Frontier ? FrontierAddress : DotAddress;
+
+      // Calls from hot code get their new stubs in the closest island, where
+      // they are shared with other callers instead of growing this function.
+      bool InIsland = false;
+      if (BC.MIB->isCall(Inst) && !BB.isCold()) {
+        if (auto *IslandBB =
+                getStubIsland(BC, Inst, DotAddress, StubCreationAddress)) {
+          InsertionPoint = IslandBB;
+          InIsland = true;
+        }
+      }
 
       // Create a stub to handle a far-away target
-      Insertions.emplace_back(std::make_pair(
-          InsertionPoint,
-          replaceTargetWithStub(BB, Inst, DotAddress,
-                                InsertionPoint == Frontier ? FrontierAddress
-                                                           : DotAddress)));
+      auto NewBB = replaceTargetWithStub(BB, Inst, DotAddress, *InsertionPoint,
+                                         StubCreationAddress);
+      if (NewBB && InIsland)
+        ++NumIslandStubs;
+      Insertions.emplace_back(std::make_pair(InsertionPoint, std::move(NewBB)));
     }
   }
 
@@ -583,14 +721,19 @@ bool LongJmpPass::relax(BinaryFunction &Func) {
       continue;
 
     Modified |= relaxStub(BB);
+    Slack = std::min(Slack, getStubSlack(BB));
   }
+  FuncSlack[&Func] = Slack;
 
   for (auto &Elmt : Insertions) {
     if (!Elmt.second)
       continue;
     std::vector<std::unique_ptr<BinaryBasicBlock>> NewBBs;
     NewBBs.emplace_back(std::move(Elmt.second));
-    Func.insertBasicBlocks(Elmt.first, std::move(NewBBs), true);
+    auto &InsertionFunc = *Elmt.first->getFunction();
+    InsertionFunc.insertBasicBlocks(Elmt.first, std::move(NewBBs), true);
+    if (&InsertionFunc != &Func)
+      ModifiedIslands.insert(&InsertionFunc);
   }
 
   return Modified;
@@ -601,25 +744,77 @@ void LongJmpPass::runOnFunctions(BinaryContext &BC) {
   auto Sorted = BC.getSortedFunctions();
   bool Modified;
   uint32_t Iterations{0};
+  DenseSet<const BinaryFunction *> ModifiedFuncs;
   do {
     ++Iterations;
     Modified = false;
+    const auto OldHotAddresses = HotAddresses;
+    const auto OldColdAddresses = ColdAddresses;
     tentativeLayout(BC, Sorted);
     updateStubGroups();
+    if (Iterations == 1)
+      selectStubIslands(Sorted);
+
+    // A function that was not modified keeps its internal layout, so the
+    // distance from any of its branches to a target changes by at most twice
+    // the largest shift of a function start address. Functions with more
+    // slack than that need no relaxation.
+    uint64_t MaxShift = 0;
+    auto updateMaxShift = [&](const FuncAddressesMapTy &Old,
+                              const FuncAddressesMapTy &New) {
+      for (const auto &KV : New) {
+        const auto OldIter = Old.find(KV.first);
+        if (OldIter == Old.end()) {
+          MaxShift = std::numeric_limits<uint64_t>::max() / 2;
+          return;
+        }
+        MaxShift = std::max(MaxShift, KV.second > OldIter->second
+                                          ? KV.second - OldIter->second
+                                          : OldIter->second - KV.second);
+      }
+    };
+    updateMaxShift(OldHotAddresses, HotAddresses);
+    updateMaxShift(OldColdAddresses, ColdAddresses);
+
+    DenseSet<const BinaryFunction *> NewModifiedFuncs;
     for (auto Func : Sorted) {
+      if (Iterations > 1 && !ModifiedFuncs.count(Func)) {
+        const auto SlackIter = FuncSlack.find(Func);
+        if (SlackIter != FuncSlack.end() && SlackIter->second > 2 * MaxShift) {
+          ++NumSkippedRelaxations;
+          continue;
+        }
+      }
       if (relax(*Func)) {
         // Don't ruin non-simple functions, they can't afford to have the layout
         // changed.
         if (Func->isSimple())
           Func->fixBranches();
+        for (const auto &BB : *Func)
+          BBSizes.erase(&BB);
+        NewModifiedFuncs.insert(Func);
         Modified = true;
       }
     }
+    for (auto *Func : ModifiedIslands) {
+      Func->fixBranches();
+      for (const auto &BB : *Func)
+        BBSizes.erase(&BB);
+      NewModifiedFuncs.insert(Func);
+    }
+    ModifiedIslands.clear();
+    ModifiedFuncs = std::move(NewModifiedFuncs);
   } while (Modified);
   outs() << "BOLT-INFO: Inserted " << NumHotStubs
          << " stubs in the hot area and " << NumColdStubs
          << " stubs in the cold area. Shared " << NumSharedStubs
          << " times, iterated " << Iterations << " times.\n";
+  if (NumIslandStubs)
+    outs() << "BOLT-INFO: placed " << NumIslandStubs << " stubs in "
+           << StubIslands.size() << " stub islands between hot functions\n";
+  if (NumSkippedRelaxations)
+    outs() << "BOLT-INFO: skipped " << NumSkippedRelaxations
+           << " function relaxations with branches far from range limits\n";
 }
 }
 }
@@ -60,10 +60,28 @@ class LongJmpPass : public BinaryFunctionPass {
   /// Used to identify the stub size
   DenseMap<const BinaryBasicBlock *, int> StubBits;
 
+  /// Code size estimates of basic blocks. Entries of a function are dropped
+  /// whenever it is relaxed, all others are valid across iterations.
+  DenseMap<const BinaryBasicBlock *, uint64_t> BBSizes;
+
+  /// Distance in bytes that the closest to out-of-range branch or stub of a
+  /// function can still move by, as computed the last time it was relaxed.
+  DenseMap<const BinaryFunction *, uint64_t> FuncSlack;
+
+  /// Hot functions, in layout order, at the end of which stubs for calls
+  /// from hot code are grouped. Every stub placed in such an island can be
+  /// shared by all callers within range, and sits in the middle of hot code.
+  std::vector<BinaryFunction *> StubIslands;
+
+  /// Island functions that received new stubs while relaxing other functions.
+  DenseSet<BinaryFunction *> ModifiedIslands;
+
   /// Stats about number of stubs inserted
   uint32_t NumHotStubs{0};
   uint32_t NumColdStubs{0};
   uint32_t NumSharedStubs{0};
+  uint32_t NumIslandStubs{0};
+  uint64_t NumSkippedRelaxations{0};
 
   ///                 -- Layout estimation methods --
   /// Try to do layout before running the emitter, by looking at BinaryFunctions
@@ -82,24 +100,48 @@ class LongJmpPass : public BinaryFunctionPass {
                               uint64_t DotAddress);
   void tentativeBBLayout(const BinaryFunction &Func);
 
+  /// Return the cached code size estimate of \p BB.
+  uint64_t getBBSize(const BinaryContext &BC, const BinaryBasicBlock &BB);
+
+  /// Return the estimated size of the hot or cold part of \p Func using the
+  /// cached basic block sizes.
+  uint64_t getFunctionSize(const BinaryFunction &Func, bool Cold);
+
   /// Update stubs addresses with their exact address after a round of stub
   /// insertion and layout estimation is done.
   void updateStubGroups();
 
+  /// Select the functions hosting stub islands, one after every
+  /// -stub-island-spacing bytes of hot code in the tentative layout.
+  void selectStubIslands(std::vector<BinaryFunction *> &SortedFunctions);
+
+  /// Return the block after which new stubs are inserted in island \p Func.
+  BinaryBasicBlock *getIslandInsertionPoint(BinaryFunction &Func) const;
+
+  /// Return the insertion point of the closest stub island that call \p Inst
+  /// at \p DotAddress can reach, or nullptr. Set \p IslandAddress to the
+  /// tentative address of a stub placed in the island.
+  BinaryBasicBlock *getStubIsland(const BinaryContext &BC, const MCInst &Inst,
+                                  uint64_t DotAddress,
+                                  uint64_t &IslandAddress);
+
   ///              -- Relaxation/stub insertion methods --
   /// Creates a  new stub jumping to \p TgtSym and updates bookkeeping about
   /// this stub using \p AtAddress as its initial location. This location is
   /// an approximation and will be later resolved to the exact location in
-  /// a next iteration, in updateStubGroups.
+  /// a next iteration, in updateStubGroups. The stub belongs to the function
+  /// of \p InsertionPoint, after which it will be inserted.
   std::pair<std::unique_ptr<BinaryBasicBlock>, MCSymbol *>
-  createNewStub(BinaryBasicBlock &SourceBB, const MCSymbol *TgtSym,
+  createNewStub(BinaryBasicBlock &InsertionPoint, const MCSymbol *TgtSym,
                 bool TgtIsFunc, uint64_t AtAddress);
 
   /// Replace the target of call or conditional branch in \p Inst with a
   /// a stub that in turn will branch to the target (perform stub insertion).
-  /// If a new stub was created, return it.
+  /// If a new stub was created for insertion after \p InsertionPoint, return
+  /// it.
   std::unique_ptr<BinaryBasicBlock>
   replaceTargetWithStub(BinaryBasicBlock &BB, MCInst &Inst, uint64_t DotAddress,
+                        BinaryBasicBlock &InsertionPoint,
                         uint64_t StubCreationAddress);
 
   /// Helper used to fetch the closest stub to \p Inst at \p DotAddress that
@@ -128,9 +170,20 @@ class LongJmpPass : public BinaryFunctionPass {
   /// Helper to identify whether \p Inst is branching to a stub
   bool usesStub(const BinaryFunction &Func, const MCInst &Inst) const;
 
+  /// Return by how many bytes the distance between branch \p Inst at
+  /// \p DotAddress and its target can grow before going out of range. Zero
+  /// means it is out of range already.
+  uint64_t getBranchSlack(const BinaryBasicBlock &BB, const MCInst &Inst,
+                          uint64_t DotAddress) const;
+
   /// True if Inst is a branch that is out of range
   bool needsStub(const BinaryBasicBlock &BB, const MCInst &Inst,
-                 uint64_t DotAddress) const;
+                 uint64_t DotAddress) const {
+    return getBranchSlack(BB, Inst, DotAddress) == 0;
+  }
+
+  /// Same as getBranchSlack(), but for the current encoding of \p StubBB.
+  uint64_t getStubSlack(const BinaryBasicBlock &StubBB) const;
 
   /// Expand the range of the stub in StubBB if necessary
   bool relaxStub(BinaryBasicBlock &StubBB);
@@ -2339,6 +2339,142 @@ void equalizeBBCounts(BinaryFunction &BF) {
   }
 }
 
+/// Costs of the profile inference flow network per unit of flow.
+enum : int64_t {
+  /// Increasing the count of a sampled block.
+  InferCostBlockInc = 10,
+  /// Increasing the count of a block without samples.
+  InferCostBlockZeroInc = 11,
+  /// Decreasing the count of a block, i.e. the reward for flow below the
+  /// sampled count.
+  InferCostBlockDec = 20,
+  /// Increasing or decreasing the count of an edge with a known count.
+  InferCostEdgeInc = 10,
+  InferCostEdgeDec = 20,
+  /// Flow over an edge without a known count.
+  InferCostEdge = 1,
+};
+
+/// Infer the counts of all blocks and edges of \p BF as a min-cost
+/// circulation. Every block is split into an in-node and an out-node linked
+/// by a bounded arc with a negative cost up to the sampled count and an
+/// unbounded arc with a positive cost, so that the solver deviates from the
+/// profile as little as possible. Edges with profile counts are modeled the
+/// same way, and the other edges carry a small uniform cost. Entry blocks are
+/// fed from a source and exit blocks drain to a sink, which closes the
+/// circulation.
+void inferProfileFlow(BinaryFunction &BF) {
+  using SimplexTy = NetworkSimplex<Digraph, int64_t, int64_t>;
+  using ArcMapTy = std::map<Digraph::ArcIt, int64_t>;
+  using Node = Digraph::Node;
+  using ArcIt = Digraph::ArcIt;
+
+  const bool HasEdgeCounts = BF.getProfileFlags() & BinaryFunction::PF_LBR;
+
+  Digraph Graph;
+  SimplexTy NS(Graph);
+  ArcMapTy CostMap;
+  ArcMapTy UpperCapacityMap;
+
+  Graph.reserveNode(2 * BF.size() + 2);
+  Graph.reserveArc(5 * BF.size() + 1);
+
+  const Node Src = Graph.addNode();
+  const Node Sink = Graph.addNode();
+  auto addArc = [&](Node From, Node To, int64_t Cost, int64_t Capacity) {
+    ArcIt A(Graph, Graph.addArc(From, To));
+    CostMap[A] = Cost;
+    UpperCapacityMap[A] = Capacity;
+    return A;
+  };
+
+  std::unordered_map<const BinaryBasicBlock *, std::pair<Node, Node>> BBNodes;
+  uint64_t TotalCount = 0;
+  for (auto &BB : BF) {
+    BBNodes[&BB] = std::make_pair(Graph.addNode(), Graph.addNode());
+    TotalCount += BB.getKnownExecutionCount();
+  }
+  if (!TotalCount)
+    return;
+
+  // Arcs carrying the count of each block, followed by the source arc for an
+  // entry block.
+  std::unordered_map<const BinaryBasicBlock *, std::vector<ArcIt>> BlockArcs;
+  // Arcs carrying the count of each successor edge, in the order of
+  // successors.
+  std::unordered_map<const BinaryBasicBlock *,
+                     std::vector<std::pair<ArcIt, ArcIt>>> EdgeArcs;
+  std::vector<ArcIt> EntryArcs;
+  for (auto &BB : BF) {
+    const auto In = BBNodes[&BB].first;
+    const auto Out = BBNodes[&BB].second;
+    const int64_t Count = BB.getKnownExecutionCount();
+    auto &Arcs = BlockArcs[&BB];
+    if (Count)
+      Arcs.push_back(addArc(In, Out, -InferCostBlockDec, Count));
+    Arcs.push_back(addArc(In, Out,
+                          Count ? InferCostBlockInc : InferCostBlockZeroInc,
+                          NS.INF));
+
+    if (BB.isEntryPoint())
+      EntryArcs.push_back(addArc(Src, In, 0, NS.INF));
+    if (BB.succ_size() == 0)
+      addArc(Out, Sink, 0, NS.INF);
+
+    auto BI = BB.branch_info_begin();
+    for (auto *Succ : BB.successors()) {
+      const auto SuccIn = BBNodes[Succ].first;
+      const auto EdgeCount = HasEdgeCounts ? int64_t(BI->Count) : 0;
+      if (EdgeCount) {
+        EdgeArcs[&BB].emplace_back(
+            addArc(Out, SuccIn, -InferCostEdgeDec, EdgeCount),
+            addArc(Out, SuccIn, InferCostEdgeInc, NS.INF));
+      } else {
+        const auto A = addArc(Out, SuccIn, InferCostEdge, NS.INF);
+        EdgeArcs[&BB].emplace_back(A, A);
+      }
+      ++BI;
+    }
+    for (auto *LP : BB.landing_pads())
+      addArc(Out, BBNodes[LP].first, InferCostEdge, NS.INF);
+  }
+  addArc(Sink, Src, 0, NS.INF);
+
+  NS.reset();
+  NS.costMap(CostMap).upperMap(UpperCapacityMap);
+  const auto Result = NS.run();
+  if (Result != SimplexTy::OPTIMAL) {
+    DEBUG(dbgs() << "BOLT-DEBUG: profile inference failed for " << BF << '\n');
+    return;
+  }
+
+  DEBUG(BF.print(dbgs(), "before profile inference", true));
+
+  for (auto &BB : BF) {
+    uint64_t Count = 0;
+    for (const auto &A : BlockArcs[&BB])
+      Count += NS.flow(A);
+    BB.setExecutionCount(Count);
+
+    auto EAI = EdgeArcs[&BB].begin();
+    for (auto &BI : BB.branch_info()) {
+      BI.Count = NS.flow(EAI->first);
+      if (EAI->second != EAI->first)
+        BI.Count += NS.flow(EAI->second);
+      if (!HasEdgeCounts)
+        BI.MispredictedCount = 0;
+      ++EAI;
+    }
+  }
+
+  uint64_t FuncCount = 0;
+  for (const auto &A : EntryArcs)
+    FuncCount += NS.flow(A);
+  BF.setExecutionCount(FuncCount);
+
+  DEBUG(BF.print(dbgs(), "after profile inference", true));
+}
+
 } // end anonymous namespace
 
 void estimateEdgeCounts(BinaryFunction &BF) {
@@ -2362,6 +2498,11 @@ void estimateEdgeCounts(BinaryFunction &BF) {
 }
 
 void solveMCF(BinaryFunction &BF, MCFCostFunction CostFunction) {
+  if (CostFunction == MCF_INFER) {
+    inferProfileFlow(BF);
+    return;
+  }
+
   Digraph Graph;
   using ArcMapTy = std::map<Digraph::ArcIt, int64_t>;
   using NodeMapTy = std::map<Digraph::Node, int64_t>;
@@ -2441,6 +2582,8 @@ void solveMCF(BinaryFunction &BF, MCFCostFunction CostFunction) {
         case MCF_BLAMEFTS:
           CostMap[A] = 10000 / (IsFT * 9999 + 1);
           break;
+        case MCF_INFER:
+          llvm_unreachable("profile inference uses its own network");
       }
       assert (CostMap[A] >= 0 && "Overflow - cost must be non-negative");
       LowerCapacityMap[A] = 0;
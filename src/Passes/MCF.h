@@ -22,7 +22,8 @@ enum MCFCostFunction : char {
   MCF_LINEAR,
   MCF_QUADRATIC,
   MCF_LOG,
-  MCF_BLAMEFTS
+  MCF_BLAMEFTS,
+  MCF_INFER
 };
 
 /// Fill edge counts based on the basic block count. Used in nonLBR mode when
@@ -43,6 +44,13 @@ void estimateEdgeCounts(BinaryFunction &BF);
 /// If cost function BlameFTs is used, assign all remaining flow to
 /// fall-throughs. This is used when the sampling is based on taken branches
 /// that do not account for them.
+///
+/// With MCF_INFER, block and edge counts are instead inferred from scratch as
+/// the min-cost circulation that deviates the least from the sampled counts,
+/// in the style of "Profile Inference Revisited" by Wenlei He et al. Every
+/// block count is a pair of arcs, one rewarding flow up to the sampled count
+/// and one penalizing flow above it, so the result is consistent even when
+/// the block samples are not, e.g. for stale or sampled-only profiles.
 void solveMCF(BinaryFunction &BF, MCFCostFunction CostFunction);
 
 }
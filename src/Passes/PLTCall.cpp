@@ -13,6 +13,7 @@
 
 #include "PLTCall.h"
 #include "llvm/Support/Options.h"
+#include <unordered_map>
 
 #define DEBUG_TYPE "bolt-plt"
 
@@ -38,6 +39,14 @@ PLT("plt",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+cl::opt<bool>
+PLTAlignCalls("plt-align-calls",
+  cl::desc("align hot indirect calls through GOT so that they do not cross a "
+           "16-byte fetch boundary"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 }
 
 namespace llvm {
@@ -48,6 +57,8 @@ void PLTCall::runOnFunctions(BinaryContext &BC) {
     return;
 
   uint64_t NumCallsOptimized = 0;
+  // Number of calls redirected from each PLT entry based on profile.
+  std::unordered_map<const BinaryFunction *, uint64_t> CallsRedirected;
   for (auto &It : BC.getBinaryFunctions()) {
     auto &Function = It.second;
     if (!shouldOptimize(Function))
@@ -75,6 +86,7 @@ void PLTCall::runOnFunctions(BinaryContext &BC) {
                                           BC.Ctx.get());
         BC.MIB->addAnnotation(Instr, "PLTCall", true);
         ++NumCallsOptimized;
+        CallsRedirected[CalleeBF] += BB->getKnownExecutionCount();
       }
     }
   }
@@ -84,6 +96,25 @@ void PLTCall::runOnFunctions(BinaryContext &BC) {
     outs() << "BOLT-INFO: " << NumCallsOptimized
            << " PLT calls in the binary were optimized.\n";
   }
+
+  // Report PLT entries that keep receiving calls we could not redirect, e.g.
+  // from functions that are not simple.
+  uint64_t NumHotStubs = 0;
+  uint64_t NumStubCalls = 0;
+  for (auto &It : BC.getBinaryFunctions()) {
+    const auto &Function = It.second;
+    if (!Function.isPLTFunction() || !Function.getKnownExecutionCount())
+      continue;
+    const auto Redirected = CallsRedirected[&Function];
+    if (Function.getKnownExecutionCount() <= Redirected)
+      continue;
+    ++NumHotStubs;
+    NumStubCalls += Function.getKnownExecutionCount() - Redirected;
+  }
+  if (NumHotStubs) {
+    outs() << "BOLT-INFO: " << NumHotStubs << " PLT entries remain on hot "
+           << "paths with " << NumStubCalls << " calls not redirected.\n";
+  }
 }
 
 
@@ -71,6 +71,10 @@ void PatchEntries::runOnFunctions(BinaryContext &BC) {
     if (!BC.shouldEmit(Function))
       continue;
 
+    // Functions emitted at their original address need no patching.
+    if (Function.getOutputAddress() == Function.getAddress())
+      continue;
+
     // Check if we can skip patching the function.
     if (!opts::ForcePatch && !Function.hasEHRanges() &&
         Function.getSize() < PatchThreshold) {
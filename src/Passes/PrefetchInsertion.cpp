@@ -0,0 +1,230 @@
+//===--- Passes/PrefetchInsertion.cpp - Software prefetch insertion -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "PrefetchInsertion.h"
+#include "BinaryLoop.h"
+#include "llvm/Support/Options.h"
+#include <set>
+#include <tuple>
+
+#define DEBUG_TYPE "bolt-prefetch"
+
+using namespace llvm;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+cl::opt<bool>
+InsertPrefetches("insert-prefetches",
+  cl::desc("insert software prefetches for hot strided loads in loops using "
+           "memory profile"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+PrefetchMinSamples("prefetch-min-samples",
+  cl::desc("minimum number of memory samples of a load to prefetch it"),
+  cl::init(10),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+PrefetchLatency("prefetch-latency",
+  cl::desc("memory latency in instructions to be covered by prefetches"),
+  cl::init(200),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+PrefetchMaxDistance("prefetch-max-distance",
+  cl::desc("maximum distance in bytes between prefetched and loaded address"),
+  cl::init(2048),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+
+namespace {
+
+constexpr int64_t CacheLineSize = 64;
+
+/// Return the constant change of \p Reg per iteration of loop \p L. The
+/// register should be written by a single instruction that is executed on
+/// every iteration.
+Optional<int64_t> getInductionStep(const BinaryContext &BC,
+                                  const BinaryLoop &L, MCPhysReg Reg) {
+  const auto HeaderCount = L.getHeader()->getKnownExecutionCount();
+  const MCInst *Def{nullptr};
+  const BinaryBasicBlock *DefBB{nullptr};
+  BitVector Written(BC.MRI->getNumRegs());
+  for (const auto *BB : L.blocks()) {
+    for (const auto &Inst : *BB) {
+      Written.reset();
+      BC.MIB->getWrittenRegs(Inst, Written);
+      if (!Written[Reg])
+        continue;
+      if (Def)
+        return NoneType();
+      Def = &Inst;
+      DefBB = BB;
+    }
+  }
+
+  if (!Def || DefBB->getKnownExecutionCount() < HeaderCount)
+    return NoneType();
+
+  int64_t Step;
+  if (!BC.MIB->evaluateSimple(*Def, Step, std::make_pair(Reg, 0),
+                              std::make_pair(0, 0)) || Step == 0)
+    return NoneType();
+  return Step;
+}
+
+/// Return true if most of the addresses sampled for \p Profile are spaced by
+/// multiples of \p Stride.
+bool isStrided(const MemoryAccessProfile &Profile, int64_t Stride) {
+  std::set<uint64_t> Addresses;
+  for (const auto &AccessInfo : Profile.AddressAccessInfo) {
+    auto Address = AccessInfo.Offset;
+    if (AccessInfo.MemoryObject)
+      Address += AccessInfo.MemoryObject->getAddress();
+    Addresses.insert(Address);
+  }
+  if (Addresses.size() < 2)
+    return false;
+
+  const auto AbsStride = static_cast<uint64_t>(std::abs(Stride));
+  uint64_t NumMultiples = 0;
+  for (auto I = Addresses.begin(), J = std::next(I); J != Addresses.end();
+       ++I, ++J) {
+    if ((*J - *I) % AbsStride == 0)
+      ++NumMultiples;
+  }
+  return NumMultiples * 2 >= Addresses.size() - 1;
+}
+
+/// Return the number of instructions executed per iteration of \p L.
+uint64_t getIterationSize(const BinaryLoop &L) {
+  const auto HeaderCount =
+      std::max<uint64_t>(1, L.getHeader()->getKnownExecutionCount());
+  uint64_t NumInstrs = 0;
+  for (const auto *BB : L.blocks())
+    NumInstrs += BB->getNumNonPseudos() * BB->getKnownExecutionCount();
+  return std::max<uint64_t>(1, NumInstrs / HeaderCount);
+}
+
+} // anonymous namespace
+
+void PrefetchInsertion::runOnFunction(BinaryFunction &BF) {
+  if (!shouldOptimize(BF) || !BF.hasValidProfile() || !BF.hasMemoryProfile())
+    return;
+
+  auto &BC = BF.getBinaryContext();
+  BF.calculateLoopInfo();
+  const auto &BLI = BF.getLoopInfo();
+  if (BLI.empty())
+    return;
+
+  // Loads of the same loop with the same address registers share prefetches
+  // of a cache line.
+  std::set<std::tuple<const BinaryLoop *, unsigned, int64_t, unsigned,
+                      int64_t>> Prefetched;
+  for (auto *BB : BF.layout()) {
+    const auto *L = BLI.getLoopFor(BB);
+    if (!L || BB->isCold())
+      continue;
+
+    for (auto II = BB->begin(); II != BB->end(); ++II) {
+      if (!BC.MIB->isLoad(*II))
+        continue;
+      auto ErrorOrMemAccessProfile =
+        BC.MIB->tryGetAnnotationAs<MemoryAccessProfile>(
+            *II, "MemoryAccessProfile");
+      if (!ErrorOrMemAccessProfile)
+        continue;
+      const auto &MemAccessProfile = ErrorOrMemAccessProfile.get();
+      uint64_t NumSamples = 0;
+      for (const auto &AccessInfo : MemAccessProfile.AddressAccessInfo)
+        NumSamples += AccessInfo.Count;
+      if (NumSamples < opts::PrefetchMinSamples)
+        continue;
+      ++NumLoadsSampled;
+
+      unsigned BaseReg;
+      int64_t Scale;
+      unsigned IndexReg;
+      int64_t Disp;
+      unsigned SegmentReg;
+      const MCExpr *DispExpr{nullptr};
+      if (!BC.MIB->evaluateX86MemoryOperand(*II, &BaseReg, &Scale, &IndexReg,
+                                            &Disp, &SegmentReg, &DispExpr) ||
+          DispExpr || BC.MIB->hasPCRelOperand(*II) ||
+          BaseReg == BC.MIB->getStackPointer() ||
+          BaseReg == BC.MIB->getFramePointer())
+        continue;
+
+      // Exactly one of the address registers should be an induction variable.
+      auto BaseStep = BaseReg ? getInductionStep(BC, *L, BaseReg) : NoneType();
+      auto IndexStep =
+          IndexReg ? getInductionStep(BC, *L, IndexReg) : NoneType();
+      if (BaseStep.hasValue() == IndexStep.hasValue())
+        continue;
+      const auto Stride = BaseStep ? *BaseStep : *IndexStep * Scale;
+      if (!isStrided(MemAccessProfile, Stride))
+        continue;
+
+      // Prefetch at least the next cache line.
+      const auto AbsStride = std::abs(Stride);
+      auto Iterations =
+          (opts::PrefetchLatency + getIterationSize(*L) - 1) /
+          getIterationSize(*L);
+      Iterations = std::max<uint64_t>(
+          Iterations, (CacheLineSize + AbsStride - 1) / AbsStride);
+      Iterations = std::min<uint64_t>(Iterations,
+                                      opts::PrefetchMaxDistance / AbsStride);
+      if (!Iterations)
+        continue;
+
+      const auto Offset = Disp + static_cast<int64_t>(Iterations) * Stride;
+      if (!Prefetched.emplace(L, BaseReg, Scale, IndexReg,
+                              Offset / CacheLineSize).second)
+        continue;
+
+      MCInst Prefetch;
+      if (!BC.MIB->createPrefetch(Prefetch, BaseReg, Scale, IndexReg, Offset,
+                                  SegmentReg))
+        continue;
+
+      DEBUG(dbgs() << "BOLT-DEBUG: prefetching " << Iterations
+                   << " iterations ahead with stride " << Stride << " in "
+                   << BB->getName() << " of " << BF << '\n');
+      II = BB->insertInstruction(II, std::move(Prefetch));
+      ++II;
+      ++NumPrefetches;
+      NumPrefetchedSamples += NumSamples;
+    }
+  }
+}
+
+void PrefetchInsertion::finishLocalRun(BinaryContext &BC) {
+  outs() << "BOLT-INFO: inserted " << NumPrefetches << " prefetches for "
+         << NumPrefetchedSamples << " memory samples of "
+         << NumLoadsSampled << " sampled loads in loops\n";
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,53 @@
+//===--- Passes/PrefetchInsertion.h - Software prefetch insertion ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_PREFETCH_INSERTION_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_PREFETCH_INSERTION_H
+
+#include "BinaryPasses.h"
+
+namespace llvm {
+namespace bolt {
+
+/// Insert software prefetches ahead of hot strided loads in loops.
+///
+/// Loads are selected by the number of memory samples attributed to them
+/// (e.g. by perf mem with a load latency threshold). The stride is the step
+/// of the induction register used in the address, and is accepted if the
+/// sampled addresses are spaced by multiples of it. The prefetch distance
+/// covers the modeled memory latency with the estimated number of
+/// instructions executed per iteration of the loop.
+class PrefetchInsertion : public BinaryFunctionPass {
+  /// Stats.
+  std::atomic<uint64_t> NumLoadsSampled{0};
+  std::atomic<uint64_t> NumPrefetches{0};
+  std::atomic<uint64_t> NumPrefetchedSamples{0};
+
+public:
+  explicit PrefetchInsertion(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "prefetch-insertion";
+  }
+
+  bool isFunctionLocal() const override { return true; }
+  void runOnFunction(BinaryFunction &BF) override;
+  void finishLocalRun(BinaryContext &BC) override;
+
+  /// Pass entry point
+  void runOnFunctions(BinaryContext &BC) override { runLocalPass(BC); }
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
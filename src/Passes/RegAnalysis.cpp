@@ -29,23 +29,31 @@ RegAnalysis::RegAnalysis(BinaryContext &BC,
   if (!CG)
     return;
 
-  CallGraphWalker CGWalker(*CG);
+  // Create map entries to allow lock-free parallel traversal. An empty set
+  // stands for a function that was not visited yet, and is ignored at calls.
+  for (CallGraph::NodeId Id = 0; Id < CG->numNodes(); ++Id) {
+    const auto *Func = CG->nodeIdToFunc(Id);
+    RegsKilledMap.emplace(Func, BitVector());
+    RegsGenMap.emplace(Func, BitVector());
+  }
+
+  CallGraphWalker CGWalker(*CG, /*ThreadSafeVisitors=*/true);
 
   CGWalker.registerVisitor([&](BinaryFunction *Func) -> bool {
     BitVector RegsKilled = getFunctionClobberList(Func);
-    bool Updated = RegsKilledMap.find(Func) == RegsKilledMap.end() ||
-                   RegsKilledMap[Func] != RegsKilled;
+    auto &Entry = RegsKilledMap.find(Func)->second;
+    bool Updated = Entry != RegsKilled;
     if (Updated)
-      RegsKilledMap[Func] = std::move(RegsKilled);
+      Entry = std::move(RegsKilled);
     return Updated;
   });
 
   CGWalker.registerVisitor([&](BinaryFunction *Func) -> bool {
     BitVector RegsGen = getFunctionUsedRegsList(Func);
-    bool Updated = RegsGenMap.find(Func) == RegsGenMap.end() ||
-                   RegsGenMap[Func] != RegsGen;
+    auto &Entry = RegsGenMap.find(Func)->second;
+    bool Updated = Entry != RegsGen;
     if (Updated)
-      RegsGenMap[Func] = std::move(RegsGen);
+      Entry = std::move(RegsGen);
     return Updated;
   });
 
@@ -71,7 +71,8 @@ private:
   BinaryContext &BC;
 
   /// Map functions to the set of registers they may overwrite starting at when
-  /// it is called until it returns to the caller.
+  /// it is called until it returns to the caller. Has an entry for every call
+  /// graph node, which is empty until the node is visited.
   std::map<const BinaryFunction *, BitVector> RegsKilledMap;
 
   /// Similar concept above but for registers that are read in that function.
@@ -243,9 +243,33 @@ public:
       const BinaryFunction &BF, BasicBlockOrder &Order) const override;
 };
 
+/// Parameters of the ExtTSP metric and of the search for a layout, which
+/// default to the values of the command-line options.
+struct ExtTSPParams {
+  double FallthroughWeight;
+  double ForwardWeight;
+  double BackwardWeight;
+  unsigned ForwardDistance;
+  unsigned BackwardDistance;
+  unsigned ChainSplitThreshold;
+
+  static ExtTSPParams fromOptions();
+};
+
 /// A new reordering algorithm for basic blocks, ext-tsp
 class ExtTSPReorderAlgorithm : public ReorderAlgorithm {
+  const BinaryLoopInfo *LoopInfo;
+  const ExtTSPParams Params;
+
 public:
+  /// With \p LoopInfo, regions of the function formed by loop nests are laid
+  /// out in parallel on the thread pool first, which should only be used for
+  /// large functions outside of parallel work.
+  explicit ExtTSPReorderAlgorithm(
+      const BinaryLoopInfo *LoopInfo = nullptr,
+      const ExtTSPParams &Params = ExtTSPParams::fromOptions())
+    : LoopInfo(LoopInfo), Params(Params) { }
+
   void reorderBasicBlocks(
       const BinaryFunction &BF, BasicBlockOrder &Order) const override;
 };
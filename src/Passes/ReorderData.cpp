@@ -14,8 +14,11 @@
 // - estimate temporal locality by looking at CFG?
 
 #include "ReorderData.h"
+#include "llvm/ADT/Hashing.h"
 #include <numeric>
 #include <algorithm>
+#include <functional>
+#include <unordered_set>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "reorder-data"
@@ -44,7 +47,8 @@ ReorderData("reorder-data",
 
 enum ReorderAlgo : char {
   REORDER_COUNT         = 0,
-  REORDER_FUNCS         = 1
+  REORDER_FUNCS         = 1,
+  REORDER_AFFINITY      = 2
 };
 
 static cl::opt<ReorderAlgo>
@@ -57,7 +61,10 @@ ReorderAlgorithm("reorder-data-algo",
       "sort hot data by read counts"),
     clEnumValN(REORDER_FUNCS,
       "funcs",
-      "sort hot data by hot function usage and count")),
+      "sort hot data by hot function usage and count"),
+    clEnumValN(REORDER_AFFINITY,
+      "affinity",
+      "cluster hot data accessed by the same hot functions")),
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
@@ -75,6 +82,24 @@ ReorderDataMaxBytes("reorder-data-max-bytes",
   cl::init(std::numeric_limits<unsigned>::max()),
   cl::cat(BoltOptCategory));
 
+static cl::opt<unsigned>
+ReorderDataClusterSize("reorder-data-cluster-size",
+  cl::desc("maximum size in bytes of a cluster of data accessed together "
+           "when using -reorder-data-algo=affinity"),
+  cl::ZeroOrMore,
+  cl::init(4096),
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+ReorderDataMaxFuncObjects("reorder-data-max-func-objects",
+  cl::desc("maximum number of the most accessed data objects per function "
+           "considered for affinity"),
+  cl::ZeroOrMore,
+  cl::init(64),
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::list<std::string>
 ReorderSymbols("reorder-symbols",
   cl::CommaSeparated,
@@ -98,6 +123,14 @@ ReorderInplace("reorder-data-inplace",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<bool>
+FoldReadOnlyData("fold-rodata",
+  cl::desc("fold identical objects in read-only sections reordered with "
+           "-reorder-data if their address is never taken"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 }
 
 namespace llvm {
@@ -142,6 +175,112 @@ bool filterSymbol(const BinaryData *BD) {
   return IsValid;
 }
 
+/// Return the data objects whose address could be observed by the program:
+/// the ones referenced from code other than through the displacement of a
+/// memory access, and the ones referenced from data.
+std::unordered_set<const BinaryData *>
+getAddressTakenData(BinaryContext &BC) {
+  std::unordered_set<const BinaryData *> AddressTaken;
+  auto markSymbol = [&](const MCSymbol *Symbol) {
+    if (const auto *BD = BC.getBinaryDataByName(Symbol->getName()))
+      AddressTaken.insert(BD->getAtomicRoot());
+  };
+  std::function<void(const MCExpr *)> markExpr = [&](const MCExpr *Expr) {
+    if (const auto *SymExpr = dyn_cast<MCSymbolRefExpr>(Expr)) {
+      markSymbol(&SymExpr->getSymbol());
+    } else if (const auto *BinExpr = dyn_cast<MCBinaryExpr>(Expr)) {
+      markExpr(BinExpr->getLHS());
+      markExpr(BinExpr->getRHS());
+    } else if (const auto *UnExpr = dyn_cast<MCUnaryExpr>(Expr)) {
+      markExpr(UnExpr->getSubExpr());
+    }
+  };
+
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    for (auto &BB : BFI.second) {
+      for (auto &Inst : BB) {
+        const auto DispOp = BC.MIB->getMemOperandDisp(Inst);
+        const bool IsAccess =
+            DispOp != Inst.end() && !BC.MIB->isLEA64r(Inst);
+        for (unsigned I = 0, E = MCPlus::getNumPrimeOperands(Inst); I != E;
+             ++I) {
+          const auto &Op = Inst.getOperand(I);
+          if (Op.isExpr() && !(IsAccess && Inst.begin() + I == DispOp))
+            markExpr(Op.getExpr());
+        }
+      }
+    }
+  }
+
+  auto markRelocation = [&](const Relocation &Rel) {
+    if (Rel.Symbol) {
+      markSymbol(Rel.Symbol);
+    } else if (const auto *BD =
+                   BC.getBinaryDataContainingAddress(Rel.Addend)) {
+      AddressTaken.insert(BD->getAtomicRoot());
+    }
+  };
+  for (const auto &Section : BC.sections()) {
+    for (const auto &Rel : Section.relocations())
+      markRelocation(Rel);
+    for (const auto &Rel : Section.dynamicRelocations())
+      markRelocation(Rel);
+  }
+
+  return AddressTaken;
+}
+
+}
+
+void ReorderData::findIdenticalData(BinaryContext &BC,
+                                    const BinarySection &Section,
+                                    DataOrder::const_iterator Begin,
+                                    DataOrder::const_iterator End) {
+  // Memory operands are only analyzed on x86-64.
+  if (!BC.isX86() || !Section.isReadOnly())
+    return;
+
+  if (AddressTakenData.empty())
+    AddressTakenData = getAddressTakenData(BC);
+
+  // Objects with relocations in their contents are not compared.
+  std::unordered_set<const BinaryData *> HasRelocations;
+  for (const auto &Rel : Section.relocations()) {
+    if (const auto *BD =
+            BC.getBinaryDataContainingAddress(Section.getAddress() +
+                                              Rel.Offset))
+      HasRelocations.insert(BD->getAtomicRoot());
+  }
+
+  // Candidate canonical objects by hash of their contents, in the new order
+  // of the section, so duplicates are folded into the hottest copy.
+  std::unordered_map<size_t, std::vector<BinaryData *>> Canonical;
+  for (; Begin != End; ++Begin) {
+    auto *BD = Begin->first;
+    if (!filterSymbol(BD) || !BD->getSize() || HasRelocations.count(BD))
+      continue;
+
+    const auto Contents = Section.getContents().substr(
+        BD->getAddress() - Section.getAddress(), BD->getSize());
+    auto &Bucket = Canonical[hash_value(Contents)];
+    BinaryData *Match = nullptr;
+    if (!AddressTakenData.count(BD)) {
+      for (auto *Candidate : Bucket) {
+        if (Candidate->getSize() == BD->getSize() &&
+            Candidate->getAlignment() >= BD->getAlignment() &&
+            Section.getContents().substr(
+                Candidate->getAddress() - Section.getAddress(),
+                Candidate->getSize()) == Contents) {
+          Match = Candidate;
+          break;
+        }
+      }
+    }
+    if (Match)
+      FoldedData[BD] = Match;
+    else
+      Bucket.push_back(BD);
+  }
 }
 
 using DataOrder = ReorderData::DataOrder;
@@ -310,6 +449,132 @@ std::pair<DataOrder, unsigned> ReorderData::sortedByFunc(
   return std::make_pair(Order, SplitPoint);
 }
 
+std::pair<DataOrder, unsigned>
+ReorderData::sortedByAffinity(BinaryContext &BC,
+                              const BinarySection &Section) const {
+  DataOrder Order = baseOrder(BC, Section);
+  std::unordered_map<const BinaryData *, size_t> Index;
+  for (size_t I = 0; I < Order.size(); ++I)
+    Index[Order[I].first] = I;
+
+  // Objects accessed by the same hot function are related by the number of
+  // accesses they have in common.
+  std::map<std::pair<size_t, size_t>, uint64_t> Affinity;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    const auto &BF = BFI.second;
+    if (!BF.hasValidProfile() || !BF.hasMemoryProfile())
+      continue;
+
+    std::map<size_t, uint64_t> Uses;
+    for (const auto &BB : BF) {
+      if (BB.isCold())
+        continue;
+      for (const auto &Inst : BB) {
+        auto ErrorOrMemAccesssProfile =
+          BC.MIB->tryGetAnnotationAs<MemoryAccessProfile>(
+              Inst, "MemoryAccessProfile");
+        if (!ErrorOrMemAccesssProfile)
+          continue;
+
+        const auto &MemAccessProfile = ErrorOrMemAccesssProfile.get();
+        for (const auto &AccessInfo : MemAccessProfile.AddressAccessInfo) {
+          if (!AccessInfo.MemoryObject)
+            continue;
+          auto Iter = Index.find(AccessInfo.MemoryObject->getAtomicRoot());
+          if (Iter != Index.end())
+            Uses[Iter->second] += AccessInfo.Count;
+        }
+      }
+    }
+    if (Uses.size() < 2)
+      continue;
+
+    std::vector<std::pair<size_t, uint64_t>> HotUses(Uses.begin(), Uses.end());
+    std::stable_sort(HotUses.begin(), HotUses.end(),
+                     [](const std::pair<size_t, uint64_t> &A,
+                        const std::pair<size_t, uint64_t> &B) {
+                       return A.second > B.second;
+                     });
+    if (HotUses.size() > opts::ReorderDataMaxFuncObjects)
+      HotUses.resize(opts::ReorderDataMaxFuncObjects);
+
+    for (size_t I = 0; I < HotUses.size(); ++I) {
+      for (size_t J = I + 1; J < HotUses.size(); ++J) {
+        const auto Key = std::make_pair(std::min(HotUses[I].first,
+                                                 HotUses[J].first),
+                                        std::max(HotUses[I].first,
+                                                 HotUses[J].first));
+        Affinity[Key] += std::min(HotUses[I].second, HotUses[J].second);
+      }
+    }
+  }
+
+  using EdgeTy = std::pair<std::pair<size_t, size_t>, uint64_t>;
+  std::vector<EdgeTy> Edges(Affinity.begin(), Affinity.end());
+  std::stable_sort(Edges.begin(), Edges.end(),
+                   [](const EdgeTy &A, const EdgeTy &B) {
+                     return A.second > B.second;
+                   });
+
+  // Greedily merge the clusters of the most related objects as long as the
+  // result fits in a page, so that data used together shares cache lines and
+  // TLB entries.
+  std::vector<std::vector<size_t>> Clusters(Order.size());
+  std::vector<size_t> ClusterOf(Order.size());
+  std::vector<uint64_t> ClusterSize(Order.size());
+  for (size_t I = 0; I < Order.size(); ++I) {
+    Clusters[I].push_back(I);
+    ClusterOf[I] = I;
+    ClusterSize[I] = alignTo(Order[I].first->getSize(), MinAlignment);
+  }
+  for (const auto &Edge : Edges) {
+    const auto Into = ClusterOf[Edge.first.first];
+    const auto From = ClusterOf[Edge.first.second];
+    if (Into == From ||
+        ClusterSize[Into] + ClusterSize[From] > opts::ReorderDataClusterSize)
+      continue;
+    for (auto Member : Clusters[From]) {
+      ClusterOf[Member] = Into;
+      Clusters[Into].push_back(Member);
+    }
+    ClusterSize[Into] += ClusterSize[From];
+    Clusters[From].clear();
+  }
+
+  // Hot clusters go first, densest first.
+  std::vector<size_t> HotClusters;
+  std::vector<uint64_t> ClusterCount(Order.size(), 0);
+  for (size_t I = 0; I < Clusters.size(); ++I) {
+    for (auto Member : Clusters[I])
+      ClusterCount[I] += Order[Member].second;
+    if (ClusterCount[I])
+      HotClusters.push_back(I);
+  }
+  std::stable_sort(HotClusters.begin(), HotClusters.end(),
+                   [&](size_t A, size_t B) {
+                     return double(ClusterCount[A]) /
+                                std::max<uint64_t>(ClusterSize[A], 1) >
+                            double(ClusterCount[B]) /
+                                std::max<uint64_t>(ClusterSize[B], 1);
+                   });
+
+  DataOrder NewOrder;
+  std::vector<bool> Placed(Order.size(), false);
+  for (auto Cluster : HotClusters) {
+    for (auto Member : Clusters[Cluster]) {
+      NewOrder.push_back(Order[Member]);
+      Placed[Member] = true;
+    }
+  }
+  const unsigned SplitPoint = NewOrder.size();
+  for (size_t I = 0; I < Order.size(); ++I) {
+    if (!Placed[I])
+      NewOrder.push_back(Order[I]);
+  }
+
+  return std::make_pair(NewOrder, SplitPoint);
+}
+
 std::pair<DataOrder, unsigned> ReorderData::sortedByCount(
   BinaryContext &BC,
   const BinarySection &Section
@@ -348,7 +613,10 @@ void ReorderData::setSectionOrder(BinaryContext &BC,
                                   DataOrder::iterator Begin,
                                   DataOrder::iterator End) {
   std::vector<BinaryData *> NewOrder;
+  std::unordered_set<const BinaryData *> Placed;
   unsigned NumReordered = 0;
+  unsigned NumFolded = 0;
+  uint64_t FoldedBytes = 0;
   uint64_t Offset = 0;
   uint64_t Count = 0;
 
@@ -368,6 +636,24 @@ void ReorderData::setSectionOrder(BinaryContext &BC,
     if (!filterSymbol(BD))
       continue;
 
+    // A duplicate of a placed object shares its output location.
+    auto FoldedItr = FoldedData.find(BD);
+    if (FoldedItr != FoldedData.end() && Placed.count(FoldedItr->second)) {
+      const auto *Canonical = FoldedItr->second;
+      DEBUG(dbgs() << "BOLT-DEBUG: folding " << BD->getName() << " into "
+                   << Canonical->getName() << "\n");
+      BD->setOutputLocation(OutputSection, Canonical->getOutputOffset());
+      for (auto &SubBD : BC.getSubBinaryData(BD)) {
+        SubBD.second->setOutputLocation(
+            OutputSection, Canonical->getOutputOffset() +
+                               SubBD.second->getAddress() - BD->getAddress());
+      }
+      ++NumFolded;
+      FoldedBytes += BD->getSize();
+      Count += Begin->second;
+      continue;
+    }
+
     ++NumReordered;
     if (NumReordered > opts::ReorderDataMaxSymbols) {
       if (!NewOrder.empty()) {
@@ -406,6 +692,7 @@ void ReorderData::setSectionOrder(BinaryContext &BC,
     Offset += BD->getSize();
     Count += Begin->second;
     NewOrder.push_back(BD);
+    Placed.insert(BD);
   }
 
   OutputSection.reorderContents(NewOrder, opts::ReorderInplace);
@@ -413,6 +700,10 @@ void ReorderData::setSectionOrder(BinaryContext &BC,
   outs() << "BOLT-INFO: reorder-data: " << Count << "/" << TotalCount
          << format(" (%.1f%%)", 100.0*Count/TotalCount) << " events, "
          << Offset << " hot bytes\n";
+  if (NumFolded)
+    outs() << "BOLT-INFO: reorder-data: folded " << NumFolded
+           << " identical objects (" << FoldedBytes << " bytes) in "
+           << OutputSection.getName() << "\n";
 }
 
 bool ReorderData::markUnmoveableSymbols(BinaryContext &BC,
@@ -505,6 +796,9 @@ void ReorderData::runOnFunctions(BinaryContext &BC) {
     if (opts::ReorderAlgorithm == opts::ReorderAlgo::REORDER_COUNT) {
       outs() << "BOLT-INFO: reorder-sections: ordering data by count\n";
       std::tie(Order, SplitPointIdx) = sortedByCount(BC, *Section);
+    } else if (opts::ReorderAlgorithm == opts::ReorderAlgo::REORDER_AFFINITY) {
+      outs() << "BOLT-INFO: reorder-sections: ordering data by affinity\n";
+      std::tie(Order, SplitPointIdx) = sortedByAffinity(BC, *Section);
     } else {
       outs() << "BOLT-INFO: reorder-sections: ordering data by funcs\n";
       std::tie(Order, SplitPointIdx) =
@@ -512,6 +806,9 @@ void ReorderData::runOnFunctions(BinaryContext &BC) {
     }
     auto SplitPoint = Order.begin() + SplitPointIdx;
 
+    if (opts::FoldReadOnlyData)
+      findIdenticalData(BC, *Section, Order.begin(), Order.end());
+
     if (opts::PrintReorderedData) {
       printOrder(*Section, Order.begin(), SplitPoint);
     }
@@ -15,6 +15,7 @@
 #include "BinaryPasses.h"
 #include "BinarySection.h"
 #include <unordered_map>
+#include <unordered_set>
 
 namespace llvm {
 namespace bolt {
@@ -41,6 +42,11 @@ private:
                const BinarySection &Section,
                std::map<uint64_t, BinaryFunction> &BFs) const;
 
+  /// Cluster symbols accessed together by the same hot functions, keeping
+  /// each cluster within a page, and order clusters by access density.
+  std::pair<DataOrder, unsigned>
+  sortedByAffinity(BinaryContext &BC, const BinarySection &Section) const;
+
   void printOrder(const BinarySection &Section,
                   DataOrder::const_iterator Begin,
                   DataOrder::const_iterator End) const;
@@ -55,6 +61,20 @@ private:
 
   bool markUnmoveableSymbols(BinaryContext &BC,
                              BinarySection &Section) const;
+
+  /// Objects that are duplicates of other objects, mapped to the object they
+  /// are folded into when the section is laid out.
+  std::unordered_map<const BinaryData *, BinaryData *> FoldedData;
+
+  /// Objects whose address is visible to the program, which are never
+  /// folded into another object.
+  std::unordered_set<const BinaryData *> AddressTakenData;
+
+  /// Find the objects of read-only \p Section in the range that duplicate
+  /// the contents of an earlier object and are only read by the code.
+  void findIdenticalData(BinaryContext &BC, const BinarySection &Section,
+                         DataOrder::const_iterator Begin,
+                         DataOrder::const_iterator End);
 public:
   explicit ReorderData() : BinaryFunctionPass(false) {}
 
@@ -13,6 +13,9 @@
 #include "HFSort.h"
 #include "llvm/Support/Options.h"
 #include <fstream>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 
 #define DEBUG_TYPE "hfsort"
 
@@ -23,6 +26,7 @@ namespace opts {
 extern cl::OptionCategory BoltOptCategory;
 extern cl::opt<unsigned> Verbosity;
 extern cl::opt<uint32_t> RandomSeed;
+extern cl::opt<bool> HotText;
 
 extern size_t padFunction(const bolt::BinaryFunction &Function);
 
@@ -42,6 +46,10 @@ ReorderFunctions("reorder-functions",
     clEnumValN(bolt::ReorderFunctions::RT_HFSORT_PLUS,
       "hfsort+",
       "use hfsort+ algorithm"),
+    clEnumValN(bolt::ReorderFunctions::RT_CDSORT,
+      "cdsort",
+      "use cache-directed sort, which optimizes distances of calls and "
+      "returns"),
     clEnumValN(bolt::ReorderFunctions::RT_PETTIS_HANSEN,
       "pettis-hansen",
       "use Pettis-Hansen algorithm"),
@@ -50,7 +58,12 @@ ReorderFunctions("reorder-functions",
       "reorder functions randomly"),
     clEnumValN(bolt::ReorderFunctions::RT_USER,
       "user",
-      "use function order specified by -function-order")),
+      "use function order specified by -function-order"),
+    clEnumValN(bolt::ReorderFunctions::RT_TEMPORAL,
+      "temporal",
+      "use hfsort+ algorithm for functions of the profile, followed by "
+      "functions executed at startup in the order of their first execution "
+      "from -temporal-profile")),
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
@@ -67,6 +80,14 @@ FunctionOrderFile("function-order",
            "reordering"),
   cl::cat(BoltOptCategory));
 
+static cl::opt<std::string>
+TemporalProfileFile("temporal-profile",
+  cl::desc("file with first execution times of functions for "
+           "-reorder-functions=temporal, one \"<function> <time>\" per line, "
+           "e.g. from instrumentation or the time order of samples"),
+  cl::value_desc("filename"),
+  cl::cat(BoltOptCategory));
+
 static cl::opt<std::string>
 GenerateFunctionOrderFile("generate-function-order",
   cl::desc("file to dump the ordered list of functions to use for function "
@@ -79,6 +100,75 @@ LinkSectionsFile("generate-link-sections",
            "inclusion in a linker script"),
   cl::cat(BoltOptCategory));
 
+static cl::opt<std::string>
+BBSectionsFile("generate-bb-sections",
+  cl::desc("generate the order of basic blocks and the split points of "
+           "functions as a list for -fbasic-block-sections=list, with blocks "
+           "numbered in the order of their input addresses"),
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+HotTextHugePages("hot-text-hugepages",
+  cl::desc("limit the hot text to <n> 2MB pages filled with the functions of "
+           "the highest sample density, and align its end to a huge page "
+           "(0 = no limit)"),
+  cl::init(0),
+  cl::value_desc("n"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+GroupExternalEntries("group-external-entries",
+  cl::desc("place functions entered mostly from other DSOs together at the "
+           "start of the hot text (requires a profile collected with "
+           "perf2bolt -cross-dso-profile)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+ReorderColdFragments("reorder-cold-fragments",
+  cl::desc("lay out cold fragments of split functions by their execution "
+           "count and calls between them instead of the function order"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<bool>
+CloneHotCallees("clone-hot-callees",
+  cl::desc("clone small hot functions called from several clusters of the "
+           "function order and place every clone next to the callers it "
+           "serves (requires relocations)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CloneHotCalleesMaxSize("clone-hot-callees-max-size",
+  cl::desc("maximum size in bytes of a function cloned by -clone-hot-callees"),
+  cl::init(256),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CloneHotCalleesMinPercent("clone-hot-callees-min-percent",
+  cl::desc("minimum percentage of the calls to a function made from another "
+           "cluster for -clone-hot-callees to clone the function for it"),
+  cl::init(20),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+CloneHotCalleesMaxClones("clone-hot-callees-max-clones",
+  cl::desc("maximum number of clones of a function created by "
+           "-clone-hot-callees"),
+  cl::init(2),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<bool>
 UseEdgeCounts("use-edge-counts",
   cl::desc("use edge count data when doing clustering"),
@@ -266,6 +356,520 @@ std::vector<std::string> readFunctionOrderFile() {
   return FunctionNames;
 }
 
+/// Return functions with the symbol name \p Name, including local functions
+/// with the name followed by "/<n>". An empty list is returned if there are
+/// no such functions.
+std::vector<BinaryFunction *> getFunctionsForName(BinaryContext &BC,
+                                                  const std::string &Name) {
+  std::vector<uint64_t> FuncAddrs;
+
+  auto *BD = BC.getBinaryDataByName(Name);
+  if (!BD) {
+    uint32_t LocalID = 1;
+    while(1) {
+      // If we can't find the main symbol name, look for alternates.
+      const auto FuncName = Name + "/" + std::to_string(LocalID);
+      BD = BC.getBinaryDataByName(FuncName);
+      if (BD)
+        FuncAddrs.push_back(BD->getAddress());
+      else
+        break;
+      LocalID++;
+    }
+  } else {
+    FuncAddrs.push_back(BD->getAddress());
+  }
+
+  std::vector<BinaryFunction *> Functions;
+  for (const auto FuncAddr : FuncAddrs) {
+    const auto *FuncBD = BC.getBinaryDataAtAddress(FuncAddr);
+    assert(FuncBD);
+
+    auto *BF = BC.getFunctionForSymbol(FuncBD->getSymbol());
+    if (!BF)
+      break;
+    Functions.push_back(BF);
+  }
+  return Functions;
+}
+
+/// Return true if \p BF can be copied into a new function. The copy has no
+/// input address, so anything tied to the input code, such as exception
+/// ranges or jump tables, rules the function out. The copy inherits the CFI
+/// program of the CIE only, and thus the function cannot change its frame.
+bool canClone(const BinaryFunction &BF) {
+  if (!BF.isSimple() || BF.getState() != BinaryFunction::State::CFG ||
+      BF.isSplit() || BF.isMultiEntry() || BF.hasEHRanges() ||
+      BF.getPersonalityFunction() || BF.hasJumpTables() ||
+      BF.isPLTFunction())
+    return false;
+
+  const auto &MIB = *BF.getBinaryContext().MIB;
+  for (const auto *BB : BF.layout()) {
+    for (const auto &Inst : *BB) {
+      if (MIB.isCFI(Inst) || MIB.isIndirectBranch(Inst) ||
+          MIB.getConditionalTailCall(Inst))
+        return false;
+    }
+  }
+  return true;
+}
+
+/// Create a copy of \p BF with its layout and a \p Ratio share of its
+/// profile.
+BinaryFunction *cloneFunction(BinaryContext &BC, BinaryFunction &BF,
+                              unsigned CloneId, double Ratio) {
+  auto *Clone = BC.createInjectedBinaryFunction(
+      BF.getOneName().str() + ".bolt.clone." + std::to_string(CloneId));
+  Clone->copyCIEFrameInstructions(BF);
+  Clone->setAlignment(BF.getAlignment());
+
+  std::vector<std::unique_ptr<BinaryBasicBlock>> BBs;
+  std::unordered_map<const BinaryBasicBlock *, BinaryBasicBlock *> BBMap;
+  for (const auto *BB : BF.layout()) {
+    BBs.emplace_back(
+        Clone->createBasicBlock(BinaryBasicBlock::INVALID_OFFSET, nullptr));
+    BBMap[BB] = BBs.back().get();
+  }
+
+  for (auto *BB : BF.layout()) {
+    auto *NewBB = BBMap[BB];
+    for (auto Inst : *BB) {
+      BC.MIB->stripAnnotations(Inst);
+      if (BC.MIB->isBranch(Inst) && !BC.MIB->isTailCall(Inst)) {
+        const auto *TargetBB =
+            BF.getBasicBlockForLabel(BC.MIB->getTargetSymbol(Inst));
+        assert(TargetBB && "cannot find target block");
+        BC.MIB->replaceBranchTarget(Inst, BBMap[TargetBB]->getLabel(),
+                                    BC.Ctx.get());
+      }
+      NewBB->addInstruction(Inst);
+    }
+    auto BI = BB->branch_info_begin();
+    for (auto *Succ : BB->successors()) {
+      NewBB->addSuccessor(BBMap[Succ], *BI);
+      ++BI;
+    }
+    NewBB->setExecutionCount(BB->getExecutionCount());
+    NewBB->adjustExecutionCount(Ratio);
+    NewBB->setCFIState(BB->getCFIState());
+  }
+
+  Clone->insertBasicBlocks(nullptr, std::move(BBs),
+                           /*UpdateLayout=*/true,
+                           /*UpdateCFIState=*/false);
+  Clone->setExecutionCount(BF.getKnownExecutionCount() * Ratio);
+  Clone->updateState(BinaryFunction::State::CFG_Finalized);
+  return Clone;
+}
+
+/// Write the layout of functions changed by BOLT as a basic block sections
+/// list. The hot blocks form one cluster in the output order, and the
+/// compiler moves the blocks left out of the cluster to the cold section.
+void writeBBSectionsFile(std::map<uint64_t, BinaryFunction> &BFs) {
+  std::ofstream BBSectionsFile(opts::BBSectionsFile, std::ios::out);
+  if (!BBSectionsFile) {
+    errs() << "BOLT-ERROR: basic block sections file "
+           << opts::BBSectionsFile << " cannot be opened\n";
+    exit(1);
+  }
+
+  uint64_t NumWritten = 0;
+  uint64_t NumSkipped = 0;
+  for (auto &BFI : BFs) {
+    auto &BF = BFI.second;
+    if (!BF.isSimple() || BF.isPLTFunction() ||
+        (!BF.hasLayoutChanged() && !BF.isSplit()))
+      continue;
+
+    // Blocks added by BOLT have no counterpart in the compiler.
+    std::vector<const BinaryBasicBlock *> InputOrder;
+    for (const auto &BB : BF)
+      InputOrder.push_back(&BB);
+    if (llvm::any_of(InputOrder, [](const BinaryBasicBlock *BB) {
+          return BB->getInputOffset() == BinaryBasicBlock::INVALID_OFFSET;
+        })) {
+      ++NumSkipped;
+      continue;
+    }
+    std::stable_sort(InputOrder.begin(), InputOrder.end(),
+                     [](const BinaryBasicBlock *A, const BinaryBasicBlock *B) {
+                       return A->getInputOffset() < B->getInputOffset();
+                     });
+    std::unordered_map<const BinaryBasicBlock *, unsigned> BBIds;
+    for (unsigned I = 0; I < InputOrder.size(); ++I)
+      BBIds[InputOrder[I]] = I;
+
+    auto Name = BF.getOneName();
+    Name = Name.substr(0, Name.find('/'));
+    BBSectionsFile << '!' << Name.str() << "\n!!";
+    for (const auto *BB : BF.layout()) {
+      if (BB->isCold())
+        break;
+      BBSectionsFile << ' ' << BBIds[BB];
+    }
+    BBSectionsFile << '\n';
+    ++NumWritten;
+  }
+
+  outs() << "BOLT-INFO: dumped basic block sections of " << NumWritten
+         << " functions to " << opts::BBSectionsFile << '\n';
+  if (NumSkipped)
+    outs() << "BOLT-INFO: " << NumSkipped << " functions with basic blocks "
+           << "created by BOLT are not in the basic block sections list\n";
+}
+
+}
+
+void ReorderFunctions::cloneHotCallees(BinaryContext &BC,
+                                       std::vector<Cluster> &Clusters) {
+  if (!BC.isX86() || !BC.HasRelocations) {
+    errs() << "BOLT-WARNING: -clone-hot-callees requires relocations on "
+              "x86-64\n";
+    return;
+  }
+
+  const unsigned NoCluster = -1u;
+  std::vector<unsigned> ClusterOf(Cg.numNodes(), NoCluster);
+  for (unsigned I = 0; I < Clusters.size(); ++I) {
+    for (const auto FuncId : Clusters[I].targets())
+      ClusterOf[FuncId] = I;
+  }
+
+  // Calls made to a function from one cluster of callers.
+  struct CallerCluster {
+    double Weight{0.0};
+    NodeId HeaviestCaller{CallGraph::InvalidId};
+    double HeaviestWeight{0.0};
+  };
+
+  uint64_t NumClones = 0;
+  uint64_t NumCallSites = 0;
+  const auto NumNodes = Cg.numNodes();
+  for (NodeId Callee = 0; Callee < NumNodes; ++Callee) {
+    const auto Home = ClusterOf[Callee];
+    if (Home == NoCluster || !Cg.samples(Callee) ||
+        Cg.size(Callee) > opts::CloneHotCalleesMaxSize)
+      continue;
+
+    double TotalWeight = 0.0;
+    std::map<unsigned, CallerCluster> Callers;
+    for (const auto Caller : Cg.predecessors(Callee)) {
+      const auto Weight = Cg.findArc(Caller, Callee)->weight();
+      TotalWeight += Weight;
+      const auto CallerClusterId = ClusterOf[Caller];
+      if (Caller == Callee || CallerClusterId == NoCluster ||
+          CallerClusterId == Home)
+        continue;
+      auto &CC = Callers[CallerClusterId];
+      CC.Weight += Weight;
+      if (Weight > CC.HeaviestWeight) {
+        CC.HeaviestWeight = Weight;
+        CC.HeaviestCaller = Caller;
+      }
+    }
+
+    std::vector<std::pair<unsigned, CallerCluster>> Candidates;
+    for (const auto &CC : Callers) {
+      if (100 * CC.second.Weight >=
+          opts::CloneHotCalleesMinPercent * TotalWeight)
+        Candidates.push_back(CC);
+    }
+    if (Candidates.empty())
+      continue;
+
+    auto &BF = *Cg.nodeIdToFunc(Callee);
+    if (!canClone(BF))
+      continue;
+
+    std::stable_sort(Candidates.begin(), Candidates.end(),
+                     [](const std::pair<unsigned, CallerCluster> &A,
+                        const std::pair<unsigned, CallerCluster> &B) {
+                       return A.second.Weight > B.second.Weight;
+                     });
+    if (Candidates.size() > opts::CloneHotCalleesMaxClones)
+      Candidates.resize(opts::CloneHotCalleesMaxClones);
+
+    double OriginalShare = 1.0;
+    for (const auto &Candidate : Candidates) {
+      const auto Ratio = Candidate.second.Weight / TotalWeight;
+      OriginalShare -= Ratio;
+      auto *Clone = cloneFunction(BC, BF, NumClones++, Ratio);
+      const auto CloneId =
+          Cg.addNode(Clone, Cg.size(Callee), Cg.samples(Callee) * Ratio);
+
+      // Place the clone right after its heaviest caller in the cluster.
+      auto &ClusterRef = Clusters[Candidate.first];
+      auto Targets = ClusterRef.targets();
+      Targets.insert(std::next(std::find(Targets.begin(), Targets.end(),
+                                         Candidate.second.HeaviestCaller)),
+                     CloneId);
+      ClusterRef.merge(Cluster(CloneId, Cg.getNode(CloneId)), Targets);
+
+      // Redirect the calls made from the cluster.
+      for (const auto Caller : Cg.predecessors(Callee)) {
+        if (ClusterOf[Caller] != Candidate.first)
+          continue;
+        for (auto &BB : *Cg.nodeIdToFunc(Caller)) {
+          for (auto &Inst : BB) {
+            if (!BC.MIB->isCall(Inst) ||
+                BC.MIB->getTargetSymbol(Inst) != BF.getSymbol())
+              continue;
+            BC.MIB->replaceBranchTarget(Inst, Clone->getSymbol(),
+                                        BC.Ctx.get());
+            ++NumCallSites;
+          }
+        }
+      }
+      DEBUG(dbgs() << "BOLT-DEBUG: cloned " << BF << " as " << *Clone
+                   << " for cluster " << Candidate.first << '\n');
+    }
+
+    for (auto &BB : BF)
+      BB.adjustExecutionCount(std::max(OriginalShare, 0.0));
+    BF.setExecutionCount(BF.getKnownExecutionCount() *
+                         std::max(OriginalShare, 0.0));
+  }
+
+  outs() << "BOLT-INFO: created " << NumClones << " clones of hot functions, "
+         << "redirecting " << NumCallSites << " call sites\n";
+}
+
+void ReorderFunctions::orderStartupFunctions(BinaryContext &BC) {
+  if (opts::TemporalProfileFile.empty()) {
+    errs() << "BOLT-WARNING: -reorder-functions=temporal requires "
+              "-temporal-profile\n";
+    return;
+  }
+  std::ifstream ProfileFile(opts::TemporalProfileFile, std::ios::in);
+  if (!ProfileFile) {
+    errs() << "BOLT-ERROR: temporal profile " << opts::TemporalProfileFile
+           << " cannot be opened\n";
+    exit(1);
+  }
+
+  std::vector<std::pair<uint64_t, BinaryFunction *>> StartupFunctions;
+  std::string Line;
+  while (std::getline(ProfileFile, Line)) {
+    StringRef Name, Time;
+    std::tie(Name, Time) = StringRef(Line).trim().rsplit(' ');
+    uint64_t FirstExecution;
+    if (Name.empty() || Time.trim().getAsInteger(10, FirstExecution)) {
+      if (!StringRef(Line).trim().empty())
+        errs() << "BOLT-WARNING: ignoring malformed line in "
+               << opts::TemporalProfileFile << ": " << Line << '\n';
+      continue;
+    }
+    for (auto *BF : getFunctionsForName(BC, Name.trim().str()))
+      StartupFunctions.emplace_back(FirstExecution, BF);
+  }
+  std::stable_sort(StartupFunctions.begin(), StartupFunctions.end(),
+                   [](const std::pair<uint64_t, BinaryFunction *> &A,
+                      const std::pair<uint64_t, BinaryFunction *> &B) {
+                     return A.first < B.first;
+                   });
+
+  uint32_t Index = 0;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    if (BFI.second.hasValidIndex())
+      Index = std::max(Index, BFI.second.getIndex() + 1);
+  }
+  const auto NumHotFunctions = Index;
+
+  // Functions in the profile keep their place, so the ones hot in the steady
+  // state are not moved into the startup code.
+  uint64_t NumStartupFunctions = 0;
+  for (auto &TimeFunction : StartupFunctions) {
+    auto *BF = TimeFunction.second;
+    if (BF->hasValidIndex())
+      continue;
+    BF->setIndex(Index++);
+    ++NumStartupFunctions;
+  }
+
+  outs() << "BOLT-INFO: placed " << NumStartupFunctions
+         << " startup functions in the order of first execution after "
+         << NumHotFunctions << " ordered functions\n";
+}
+
+void ReorderFunctions::limitHotText(BinaryContext &BC) {
+  if (!opts::HotText) {
+    errs() << "BOLT-WARNING: -hot-text-hugepages requires -hot-text\n";
+    return;
+  }
+
+  std::vector<BinaryFunction *> Functions;
+  for (auto *BF : BC.getSortedFunctions()) {
+    if (!BF->hasValidIndex())
+      break;
+    Functions.push_back(BF);
+  }
+
+  // Padding and alignment are accounted for at their maximum, since the hot
+  // size estimate is optimistic and the region should not spill into one
+  // more page.
+  auto getSize = [](const BinaryFunction &BF) -> uint64_t {
+    return BF.estimateHotSize() + opts::padFunction(BF) +
+           BinaryFunction::MinAlign - 1 + BF.getMaxAlignmentBytes();
+  };
+
+  std::vector<BinaryFunction *> ByDensity;
+  for (auto *BF : Functions) {
+    if (BF->getFunctionScore())
+      ByDensity.push_back(BF);
+  }
+  std::stable_sort(ByDensity.begin(), ByDensity.end(),
+                   [&](const BinaryFunction *A, const BinaryFunction *B) {
+                     return A->getFunctionScore() * getSize(*B) >
+                            B->getFunctionScore() * getSize(*A);
+                   });
+
+  const uint64_t Budget = opts::HotTextHugePages * BC.HugePageSize;
+  uint64_t HotSize = 0;
+  uint64_t HotScore = 0;
+  std::unordered_set<const BinaryFunction *> Selected;
+  for (auto *BF : ByDensity) {
+    const auto Size = getSize(*BF);
+    if (HotSize + Size > Budget)
+      continue;
+    HotSize += Size;
+    HotScore += BF->getFunctionScore();
+    Selected.insert(BF);
+  }
+
+  // Selected functions keep their relative order from the clustering, and
+  // the rest follows them in the same order.
+  std::stable_partition(Functions.begin(), Functions.end(),
+                        [&](const BinaryFunction *BF) {
+                          return Selected.count(BF);
+                        });
+  uint32_t Index = 0;
+  for (auto *BF : Functions) {
+    BF->resetIndex();
+    BF->setIndex(Index++);
+  }
+  BC.NumHotTextFunctions = Selected.size();
+
+  uint64_t TotalScore = 0;
+  for (auto &BFI : BC.getBinaryFunctions())
+    TotalScore += BFI.second.getFunctionScore();
+
+  outs() << "BOLT-INFO: hot text of " << opts::HotTextHugePages
+         << " huge pages holds " << Selected.size() << " functions out of "
+         << Functions.size() << " ordered, " << HotSize
+         << " bytes estimated, "
+         << format("%.1lf%%", TotalScore ? 100.0 * HotScore / TotalScore : 0.0)
+         << " of the sampled execution\n";
+}
+
+void ReorderFunctions::groupExternalEntries(BinaryContext &BC) {
+  std::vector<BinaryFunction *> Functions;
+  for (auto *BF : BC.getSortedFunctions()) {
+    if (!BF->hasValidIndex())
+      break;
+    Functions.push_back(BF);
+  }
+
+  // The call graph has no nodes for callers in other DSOs, so functions they
+  // call are clustered only with their local callers and callees.
+  auto isExternalEntry = [](const BinaryFunction *BF) {
+    const auto Count = BF->getExternalEntryCount();
+    return Count && 2 * Count >= BF->getKnownExecutionCount();
+  };
+  const auto NumExternal =
+      std::stable_partition(Functions.begin(), Functions.end(),
+                            isExternalEntry) -
+      Functions.begin();
+  uint32_t Index = 0;
+  for (auto *BF : Functions) {
+    BF->resetIndex();
+    BF->setIndex(Index++);
+  }
+
+  outs() << "BOLT-INFO: placed " << NumExternal
+         << " functions entered mostly from other DSOs at the start of the "
+            "hot text\n";
+}
+
+void ReorderFunctions::reorderColdFragments(BinaryContext &BC) {
+  // Executed cold code, such as error handling that does run, is kept on a
+  // few pages at the start of the cold section instead of being spread over
+  // the whole section in the order of functions.
+  std::vector<BinaryFunction *> Fragments;
+  DenseMap<const BinaryFunction *, uint64_t> ColdCounts;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &BF = BFI.second;
+    if (!BC.shouldEmit(BF) || !BF.isSplit())
+      continue;
+    uint64_t Count = 0;
+    for (const auto *BB : BF.layout()) {
+      if (BB->isCold())
+        Count += BB->getKnownExecutionCount();
+    }
+    ColdCounts[&BF] = Count;
+    Fragments.push_back(&BF);
+  }
+
+  std::stable_sort(Fragments.begin(), Fragments.end(),
+                   [&](const BinaryFunction *A, const BinaryFunction *B) {
+                     return ColdCounts.lookup(A) > ColdCounts.lookup(B);
+                   });
+
+  // Return the executed fragment, not placed yet, of the function called most
+  // frequently from the cold code of \p BF.
+  auto getHottestColdCallee = [&](const BinaryFunction &BF) {
+    DenseMap<BinaryFunction *, uint64_t> CallCounts;
+    for (const auto *BB : BF.layout()) {
+      if (!BB->isCold() || !BB->getKnownExecutionCount())
+        continue;
+      for (const auto &Inst : *BB) {
+        if (!BC.MIB->isCall(Inst))
+          continue;
+        const auto *Symbol = BC.MIB->getTargetSymbol(Inst);
+        auto *Callee = Symbol ? BC.getFunctionForSymbol(Symbol) : nullptr;
+        if (!Callee || Callee == &BF || Callee->hasValidColdIndex() ||
+            !ColdCounts.lookup(Callee))
+          continue;
+        CallCounts[Callee] += BB->getKnownExecutionCount();
+      }
+    }
+    BinaryFunction *Hottest = nullptr;
+    uint64_t HottestCount = 0;
+    for (const auto &CCI : CallCounts) {
+      if (CCI.second > HottestCount ||
+          (CCI.second == HottestCount && Hottest &&
+           CCI.first->getAddress() < Hottest->getAddress())) {
+        Hottest = CCI.first;
+        HottestCount = CCI.second;
+      }
+    }
+    return Hottest;
+  };
+
+  // Each executed fragment is followed by the chain of its hottest callees
+  // with executed cold code. Fragments that were never executed keep the
+  // function order at the end.
+  uint32_t Index = 0;
+  uint64_t NumExecuted = 0;
+  uint64_t NumPlacedByCalls = 0;
+  for (auto *BF : Fragments) {
+    if (BF->hasValidColdIndex())
+      continue;
+    BF->setColdIndex(Index++);
+    if (!ColdCounts.lookup(BF))
+      continue;
+    ++NumExecuted;
+    for (auto *Callee = getHottestColdCallee(*BF); Callee;
+         Callee = getHottestColdCallee(*Callee)) {
+      Callee->setColdIndex(Index++);
+      ++NumExecuted;
+      ++NumPlacedByCalls;
+    }
+  }
+
+  outs() << "BOLT-INFO: reordered " << Fragments.size()
+         << " cold fragments, " << NumExecuted << " of them executed ("
+         << NumPlacedByCalls << " placed after their callers)\n";
 }
 
 void ReorderFunctions::runOnFunctions(BinaryContext &BC) {
@@ -331,8 +935,12 @@ void ReorderFunctions::runOnFunctions(BinaryContext &BC) {
     Clusters = clusterize(Cg);
     break;
   case RT_HFSORT_PLUS:
+  case RT_TEMPORAL:
     Clusters = hfsortPlus(Cg);
     break;
+  case RT_CDSORT:
+    Clusters = cdsort(Cg);
+    break;
   case RT_PETTIS_HANSEN:
     Clusters = pettisAndHansen(Cg);
     break;
@@ -344,41 +952,14 @@ void ReorderFunctions::runOnFunctions(BinaryContext &BC) {
     {
       uint32_t Index = 0;
       for (const auto &Function : readFunctionOrderFile()) {
-        std::vector<uint64_t> FuncAddrs;
-
-        auto *BD = BC.getBinaryDataByName(Function);
-        if (!BD) {
-          uint32_t LocalID = 1;
-          while(1) {
-            // If we can't find the main symbol name, look for alternates.
-            const auto FuncName = Function + "/" + std::to_string(LocalID);
-            BD = BC.getBinaryDataByName(FuncName);
-            if (BD)
-              FuncAddrs.push_back(BD->getAddress());
-            else
-              break;
-            LocalID++;
-          }
-        } else {
-          FuncAddrs.push_back(BD->getAddress());
-        }
-
-        if (FuncAddrs.empty()) {
+        const auto Functions = getFunctionsForName(BC, Function);
+        if (Functions.empty()) {
           errs() << "BOLT-WARNING: Reorder functions: can't find function for "
                  << Function << ".\n";
           continue;
         }
 
-        for (const auto FuncAddr : FuncAddrs) {
-          const auto *FuncBD = BC.getBinaryDataAtAddress(FuncAddr);
-          assert(FuncBD);
-
-          auto *BF = BC.getFunctionForSymbol(FuncBD->getSymbol());
-          if (!BF) {
-            errs() << "BOLT-WARNING: Reorder functions: can't find function for "
-                   << Function << ".\n";
-            break;
-          }
+        for (auto *BF : Functions) {
           if (!BF->hasValidIndex()) {
             BF->setIndex(Index++);
           } else if (opts::Verbosity > 0) {
@@ -391,8 +972,23 @@ void ReorderFunctions::runOnFunctions(BinaryContext &BC) {
     break;
   }
 
+  if (opts::CloneHotCallees && !Clusters.empty())
+    cloneHotCallees(BC, Clusters);
+
   reorder(std::move(Clusters), BFs);
 
+  if (opts::ReorderFunctions == RT_TEMPORAL)
+    orderStartupFunctions(BC);
+
+  if (opts::GroupExternalEntries)
+    groupExternalEntries(BC);
+
+  if (opts::HotTextHugePages)
+    limitHotText(BC);
+
+  if (opts::ReorderColdFragments)
+    reorderColdFragments(BC);
+
   std::unique_ptr<std::ofstream> FuncsFile;
   if (!opts::GenerateFunctionOrderFile.empty()) {
     FuncsFile =
@@ -481,6 +1077,9 @@ void ReorderFunctions::runOnFunctions(BinaryContext &BC) {
              << opts::LinkSectionsFile << '\n';
     }
   }
+
+  if (!opts::BBSectionsFile.empty())
+    writeBBSectionsFile(BFs);
 }
 
 } // namespace bolt
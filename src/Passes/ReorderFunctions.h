@@ -24,15 +24,37 @@ class ReorderFunctions : public BinaryFunctionPass {
 
   void reorder(std::vector<Cluster> &&Clusters,
                std::map<uint64_t, BinaryFunction> &BFs);
+
+  /// Clone small hot functions called from several clusters and add every
+  /// clone to a cluster of its callers, redirecting their calls to it.
+  void cloneHotCallees(BinaryContext &BC, std::vector<Cluster> &Clusters);
+
+  /// Place functions from the temporal profile that do not have an order
+  /// yet after the ordered ones, in the order of their first execution.
+  void orderStartupFunctions(BinaryContext &BC);
+
+  /// Fill the hot text limited to a number of huge pages with the functions
+  /// of the highest density and move the rest after the hot text.
+  void limitHotText(BinaryContext &BC);
+
+  /// Move the ordered functions entered mostly from other DSOs to the start
+  /// of the hot text, keeping their relative order.
+  void groupExternalEntries(BinaryContext &BC);
+
+  /// Assign the order of cold fragments in the cold section.
+  void reorderColdFragments(BinaryContext &BC);
+
 public:
   enum ReorderType : char {
     RT_NONE = 0,
     RT_EXEC_COUNT,
     RT_HFSORT,
     RT_HFSORT_PLUS,
+    RT_CDSORT,
     RT_PETTIS_HANSEN,
     RT_RANDOM,
-    RT_USER
+    RT_USER,
+    RT_TEMPORAL
   };
 
   explicit ReorderFunctions(const cl::opt<bool> &PrintPass)
@@ -61,6 +61,14 @@ R11Availability("r11-availability",
   cl::ZeroOrMore,
   cl::cat(BoltCategory));
 
+static cl::opt<unsigned>
+ReportRetpolines("report-retpolines",
+  cl::desc("print top <uint> retpolined branches by profiled execution count"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
 } // namespace opts
 
 namespace llvm {
@@ -284,6 +292,9 @@ void RetpolineInsertion::runOnFunctions(BinaryContext &BC) {
 
   auto &MIB = *BC.MIB;
   uint32_t RetpolinedBranches = 0;
+  uint64_t RetpolinedExecCount = 0;
+  using HotSiteTy = std::pair<uint64_t, const BinaryBasicBlock *>;
+  std::vector<HotSiteTy> HotSites;
   for (auto &It : BC.getBinaryFunctions()) {
     auto &Function = It.second;
     for (auto &BB : Function) {
@@ -293,6 +304,13 @@ void RetpolineInsertion::runOnFunctions(BinaryContext &BC) {
         if (!MIB.isIndirectCall(Inst) && !MIB.isIndirectBranch(Inst))
           continue;
 
+        // Whatever indirect call promotion left behind pays for the
+        // retpoline on every execution.
+        const auto ExecCount = BB.getKnownExecutionCount();
+        RetpolinedExecCount += ExecCount;
+        if (opts::ReportRetpolines && ExecCount)
+          HotSites.emplace_back(ExecCount, &BB);
+
         IndirectBranchInfo BrInfo(Inst, MIB);
         bool R11Available = false;
         BinaryFunction *TargetRetpoline;
@@ -334,6 +352,25 @@ void RetpolineInsertion::runOnFunctions(BinaryContext &BC) {
          << CreatedRetpolines.size()
          << "\nBOLT-INFO: The number of retpolined branches is : " << RetpolinedBranches
          << "\n";
+  if (RetpolinedExecCount)
+    outs() << "BOLT-INFO: retpolined branches have a total profiled execution "
+           << "count of " << RetpolinedExecCount << "\n";
+
+  if (!HotSites.empty()) {
+    std::stable_sort(HotSites.begin(), HotSites.end(),
+                     [](const HotSiteTy &A, const HotSiteTy &B) {
+                       return A.first > B.first;
+                     });
+    if (HotSites.size() > opts::ReportRetpolines)
+      HotSites.resize(opts::ReportRetpolines);
+    outs() << "BOLT-INFO: top retpolined branches by execution count:\n";
+    for (const auto &Site : HotSites) {
+      outs() << "  " << *Site.second->getFunction() << " : "
+             << Site.second->getName() << " : " << Site.first << " ("
+             << format("%.1f", 100.0 * Site.first / RetpolinedExecCount)
+             << "%)\n";
+    }
+  }
 }
 
 } // namespace bolt
@@ -33,6 +33,15 @@ static cl::opt<unsigned> ShrinkWrappingThreshold(
 namespace llvm {
 namespace bolt {
 
+namespace {
+
+/// Marks of the stack accesses and of the instructions to be deleted once
+/// the frame has been rewritten.
+const MCPlus::AnnotationKey<unsigned> AccessesDeletedPos("AccessesDeletedPos");
+const MCPlus::AnnotationKey<unsigned> DeleteMe("DeleteMe");
+
+} // end anonymous namespace
+
 void CalleeSavedAnalysis::analyzeSaves() {
   ReachingDefOrUse</*Def=*/true> &RD = Info.getReachingDefs();
   StackReachingUses &SRU = Info.getStackReachingUses();
@@ -513,7 +522,7 @@ bool StackLayoutModifier::collapseRegion(MCInst *Alloc, int64_t RegionAddr,
       }
 
       if (Slot == RegionAddr) {
-        BC.MIB->addAnnotation(Inst, "AccessesDeletedPos", 0U, AllocatorId);
+        BC.MIB->addAnnotation(Inst, AccessesDeletedPos, 0U, AllocatorId);
         continue;
       }
       if (BC.MIB->isPush(Inst) || BC.MIB->isPop(Inst)) {
@@ -539,9 +548,9 @@ bool StackLayoutModifier::collapseRegion(MCInst *Alloc, int64_t RegionAddr,
 void StackLayoutModifier::setOffsetForCollapsedAccesses(int64_t NewOffset) {
   for (auto &BB : BF) {
     for (auto &Inst : BB) {
-      if (!BC.MIB->hasAnnotation(Inst, "AccessesDeletedPos"))
+      if (!BC.MIB->hasAnnotation(Inst, AccessesDeletedPos))
         continue;
-      BC.MIB->removeAnnotation(Inst, "AccessesDeletedPos");
+      BC.MIB->removeAnnotation(Inst, AccessesDeletedPos);
       scheduleChange(
           Inst, WorklistItem(WorklistItem::AdjustLoadStoreOffset, NewOffset));
     }
@@ -632,9 +641,9 @@ void StackLayoutModifier::performChanges() {
   for (auto &BB : BF) {
     for (auto I = BB.rbegin(), E = BB.rend(); I != E; ++I) {
       auto &Inst = *I;
-      if (BC.MIB->hasAnnotation(Inst, "AccessesDeletedPos")) {
+      if (BC.MIB->hasAnnotation(Inst, AccessesDeletedPos)) {
         assert(BC.MIB->isPop(Inst) || BC.MIB->isPush(Inst));
-        BC.MIB->removeAnnotation(Inst, "AccessesDeletedPos");
+        BC.MIB->removeAnnotation(Inst, AccessesDeletedPos);
       }
       if (!BC.MIB->hasAnnotation(Inst, getTodoTag()))
         continue;
@@ -1518,8 +1527,9 @@ public:
 
 } // end anonymous namespace
 
-void ShrinkWrapping::insertUpdatedCFI(unsigned CSR, int SPValPush,
-                                      int SPValPop) {
+SmallSetVector<BinaryBasicBlock *, 8>
+ShrinkWrapping::insertUpdatedCFI(unsigned CSR, int SPValPush, int SPValPop) {
+  SmallSetVector<BinaryBasicBlock *, 8> Changed;
   MCInst *SavePoint{nullptr};
   for (auto &BB : BF) {
     for (auto InstIter = BB.rbegin(), EndIter = BB.rend(); InstIter != EndIter;
@@ -1567,6 +1577,7 @@ void ShrinkWrapping::insertUpdatedCFI(unsigned CSR, int SPValPush,
         auto InsertionIter = InstIter;
         ++InsertionIter;
         InAffectedZone = CurZone;
+        Changed.insert(BB);
         if (InAffectedZone) {
           InstIter = --insertCFIsForPushOrPop(*BB, InsertionIter, CSR, true, 0,
                                               SPValPop);
@@ -1580,9 +1591,11 @@ void ShrinkWrapping::insertUpdatedCFI(unsigned CSR, int SPValPush,
     if (!PrevBB || (BF.isSplit() && BB->isCold() != PrevBB->isCold())) {
       if (InAffectedZoneAtBegin) {
         insertCFIsForPushOrPop(*BB, BB->begin(), CSR, true, 0, SPValPush);
+        Changed.insert(BB);
       }
     } else {
       if (InAffectedZoneAtBegin != PrevAffectedZone) {
+        Changed.insert(PrevBB);
         if (InAffectedZoneAtBegin) {
           insertCFIsForPushOrPop(*PrevBB, PrevBB->end(), CSR, true, 0,
                                  SPValPush);
@@ -1595,6 +1608,7 @@ void ShrinkWrapping::insertUpdatedCFI(unsigned CSR, int SPValPush,
     PrevAffectedZone = InAffectedZoneAtEnd;
     PrevBB = BB;
   }
+  return Changed;
 }
 
 void ShrinkWrapping::rebuildCFIForSP() {
@@ -1604,7 +1618,7 @@ void ShrinkWrapping::rebuildCFIForSP() {
         continue;
       auto *CFI = BF.getCFIFor(Inst);
       if (CFI->getOperation() == MCCFIInstruction::OpDefCfaOffset)
-        BC.MIB->addAnnotation(Inst, "DeleteMe", 0U, AllocatorId);
+        BC.MIB->addAnnotation(Inst, DeleteMe, 0U, AllocatorId);
     }
   }
 
@@ -1645,7 +1659,7 @@ void ShrinkWrapping::rebuildCFIForSP() {
 
   for (auto &BB : BF) {
     for (auto I = BB.begin(); I != BB.end(); ) {
-      if (BC.MIB->hasAnnotation(*I, "DeleteMe"))
+      if (BC.MIB->hasAnnotation(*I, DeleteMe))
         I = BB.eraseInstruction(I);
       else
         ++I;
@@ -1950,8 +1964,10 @@ void ShrinkWrapping::rebuildCFI() {
       continue;
     const int64_t SPValPush = PushOffsetByReg[I];
     const int64_t SPValPop = PopOffsetByReg[I];
-    insertUpdatedCFI(I, SPValPush, SPValPop);
-    Info.invalidateAll();
+    // Only dominators are used to place the CFI of the next register, so they
+    // are updated for the blocks with new CFI instead of being recomputed.
+    Info.updateAfterInsertion(
+        insertUpdatedCFI(I, SPValPush, SPValPop).getArrayRef());
   }
 }
 
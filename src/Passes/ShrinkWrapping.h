@@ -464,8 +464,9 @@ private:
 
   /// After the spill locations for reg \p CSR has been moved and all affected
   /// CFI has been removed, insert new updated CFI information for these
-  /// locations.
-  void insertUpdatedCFI(unsigned CSR, int SPValPush, int SPValPop);
+  /// locations. Return the blocks where CFI was inserted.
+  SmallSetVector<BinaryBasicBlock *, 8>
+  insertUpdatedCFI(unsigned CSR, int SPValPush, int SPValPop);
 
   /// In case the function anchors the CFA reg as SP and we inserted pushes/pops
   /// insert def_cfa_offsets at appropriate places (and delete old
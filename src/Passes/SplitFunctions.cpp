@@ -10,6 +10,7 @@
 //===----------------------------------------------------------------------===//
 
 #include "BinaryFunction.h"
+#include "CacheMetrics.h"
 #include "ParallelUtilities.h"
 #include "SplitFunctions.h"
 #include "llvm/Support/Options.h"
@@ -26,8 +27,14 @@ namespace opts {
 
 extern cl::OptionCategory BoltOptCategory;
 
+extern cl::opt<bool> NoThreads;
+extern cl::opt<bool> CompactLSDA;
 extern cl::opt<bool> SplitEH;
 extern cl::opt<unsigned> ExecutionCountThreshold;
+extern cl::opt<double> FallthroughWeight;
+extern cl::opt<double> ForwardWeight;
+extern cl::opt<unsigned> ForwardDistance;
+extern cl::opt<unsigned> ITLBPageSize;
 
 static cl::opt<bool>
 AggressiveSplitting("split-all-cold",
@@ -45,7 +52,7 @@ SplitAlignThreshold("split-align-threshold",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
-static cl::opt<SplitFunctions::SplittingType>
+cl::opt<SplitFunctions::SplittingType>
 SplitFunctions("split-functions",
   cl::desc("split functions into hot and cold regions"),
   cl::init(SplitFunctions::ST_NONE),
@@ -61,6 +68,29 @@ SplitFunctions("split-functions",
   cl::ZeroOrMore,
   cl::cat(BoltOptCategory));
 
+static cl::opt<SplitFunctions::SplitStrategy>
+SplitStrategy("split-strategy",
+  cl::desc("strategy for choosing the basic blocks to outline"),
+  cl::init(SplitFunctions::SS_PROFILE),
+  cl::values(clEnumValN(SplitFunctions::SS_PROFILE, "profile",
+                        "outline all blocks that are cold by profile"),
+             clEnumValN(SplitFunctions::SS_EXTTSP, "exttsp",
+                        "outline cold blocks only if the ExtTSP model of "
+                        "i-cache and i-TLB benefit outweighs the cost of "
+                        "jumps between the fragments")),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<uint64_t>
+SplitWarmThreshold("split-warm-threshold",
+  cl::desc("also outline basic blocks executed fewer than the given number of "
+           "times. Split fragments with such blocks are placed into "
+           ".text.warm, apart from the code that was never executed. Default "
+           "value: 0, i.e. only outline blocks that were never executed."),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<unsigned>
 SplitThreshold("split-threshold",
   cl::desc("split function only if its main size is reduced by more than "
@@ -114,6 +144,10 @@ void SplitFunctions::runOnFunctions(BinaryContext &BC) {
            << format("(%.2lf%% of split functions is hot).\n",
                      100.0 * SplitBytesHot / (SplitBytesHot + SplitBytesCold));
   }
+  if (NumWarmFragments) {
+    outs() << "BOLT-INFO: " << NumWarmFragments << " split functions have "
+           << "warm fragments with executed code\n";
+  }
 }
 
 void SplitFunctions::splitFunction(BinaryFunction &BF) {
@@ -159,7 +193,20 @@ void SplitFunctions::splitFunction(BinaryFunction &BF) {
   for (auto *BB : BF.layout()) {
     if (!BB->canOutline())
       continue;
-    if (BB->getExecutionCount() != 0) {
+    const auto ExecCount = BB->getExecutionCount();
+    if (ExecCount != 0 && ExecCount >= opts::SplitWarmThreshold) {
+      BB->setCanOutline(false);
+      continue;
+    }
+    // The Linux kernel patches the code at static key and alternative
+    // instruction sites, and expects the sites to be mapped with the rest of
+    // the hot text.
+    if (!BC.LKPatchSites.empty() &&
+        llvm::any_of(*BB, [&](const MCInst &Inst) {
+          auto Offset =
+              BC.MIB->tryGetAnnotationAs(Inst, MCPlus::OffsetAnnotation);
+          return Offset && BC.LKPatchSites.count(BF.getAddress() + *Offset);
+        })) {
       BB->setCanOutline(false);
       continue;
     }
@@ -210,15 +257,35 @@ void SplitFunctions::splitFunction(BinaryFunction &BF) {
         [&] (BinaryBasicBlock *A, BinaryBasicBlock *B) {
           return A->canOutline() < B->canOutline();
         });
+  } else if (BF.hasEHRanges() && opts::SplitEH && opts::CompactLSDA) {
+    // Group landing pads that can be moved at the end of the function. They
+    // are placed together at the end of the cold fragment and their call site
+    // entries can be encoded relative to it.
+    auto isOutlinableLP = [](const BinaryBasicBlock *BB) {
+      return BB->canOutline() && BB->isLandingPad();
+    };
+    std::stable_sort(BF.layout_begin(), BF.layout_end(),
+        [&] (BinaryBasicBlock *A, BinaryBasicBlock *B) {
+          return isOutlinableLP(A) < isOutlinableLP(B);
+        });
   }
 
   // Separate hot from cold starting from the bottom.
+  size_t FirstColdIndex = BF.layout_size();
   for (auto I = BF.layout_rbegin(), E = BF.layout_rend();
        I != E; ++I) {
     BinaryBasicBlock *BB = *I;
     if (!BB->canOutline())
       break;
-    BB->setIsCold(true);
+    --FirstColdIndex;
+  }
+  if (opts::SplitStrategy == SplitFunctions::SS_EXTTSP)
+    FirstColdIndex = findExtTSPSplitPoint(BF, FirstColdIndex);
+  if (BC.isAArch64())
+    FirstColdIndex = adjustSplitPointForStubs(BF, FirstColdIndex);
+  for (auto I = BF.layout_begin() + FirstColdIndex, E = BF.layout_end();
+       I != E; ++I) {
+    (*I)->setIsCold(true);
   }
 
   // Check the new size to see if it's worth splitting the function.
@@ -243,6 +310,126 @@ void SplitFunctions::splitFunction(BinaryFunction &BF) {
       SplitBytesCold += ColdSize;
     }
   }
+
+  if (BF.isSplit() &&
+      std::any_of(BF.layout_begin(), BF.layout_end(),
+                  [](const BinaryBasicBlock *BB) {
+                    return BB->isCold() && BB->getExecutionCount() > 0;
+                  }))
+    ++NumWarmFragments;
+}
+
+size_t SplitFunctions::adjustSplitPointForStubs(const BinaryFunction &BF,
+                                                size_t FirstCold) const {
+  // Create a separate MCCodeEmitter to allow lock-free execution
+  BinaryContext::IndependentCodeEmitter Emitter;
+  if (!opts::NoThreads)
+    Emitter = BF.getBinaryContext().createIndependentMCCodeEmitter();
+
+  const auto &BC = BF.getBinaryContext();
+  MCInst Stub;
+  {
+    auto L = BC.scopeLock();
+    BC.MIB->createUncondBranch(Stub, BF.getSymbol(), BC.Ctx.get());
+  }
+  const auto StubSize = BC.computeInstructionSize(Stub, Emitter.MCE.get());
+
+  // Conditional branches from the hot fragment cannot reach the cold one and
+  // take a stub in the hot fragment. A cold block at the split point that is
+  // not larger than its stubs is kept hot.
+  BF.updateLayoutIndices();
+  const auto NumBlocks = BF.layout_size();
+  while (FirstCold < NumBlocks) {
+    const auto *BB = *(BF.layout_begin() + FirstCold);
+    uint64_t NumStubs = 0;
+    for (const auto *Pred : BB->predecessors()) {
+      if (Pred->getLayoutIndex() < FirstCold && Pred->succ_size() == 2 &&
+          Pred->getLayoutIndex() + 1 != BB->getLayoutIndex())
+        ++NumStubs;
+    }
+    if (!NumStubs || BB->estimateSize(Emitter.MCE.get()) > NumStubs * StubSize)
+      break;
+    ++FirstCold;
+  }
+  return FirstCold;
+}
+
+size_t SplitFunctions::findExtTSPSplitPoint(const BinaryFunction &BF,
+                                            size_t FirstCandidate) const {
+  const auto NumBlocks = BF.layout_size();
+  if (FirstCandidate >= NumBlocks)
+    return NumBlocks;
+
+  // Create a separate MCCodeEmitter to allow lock-free execution
+  BinaryContext::IndependentCodeEmitter Emitter;
+  if (!opts::NoThreads)
+    Emitter = BF.getBinaryContext().createIndependentMCCodeEmitter();
+
+  // Addresses of the blocks in the layout without splitting.
+  BF.updateLayoutIndices();
+  std::vector<uint64_t> Addr(NumBlocks + 1, 0);
+  for (auto *BB : BF.layout()) {
+    const auto Index = BB->getLayoutIndex();
+    const auto Size = BB->estimateSize(Emitter.MCE.get());
+    Addr[Index + 1] = Addr[Index] + std::max<uint64_t>(Size, 1);
+  }
+
+  // The cold fragment is placed far from the hot one. Hence, splitting before
+  // block K loses the ExtTSP score of the jumps crossing K, which are the
+  // jumps between blocks I and J with min(I, J) < K <= max(I, J). Jumps within
+  // a fragment keep their distances. In addition, a fall-through into the cold
+  // fragment takes an extra jump inserted by branch fixup. Loss is computed as
+  // a difference array over the split points.
+  std::vector<double> Loss(NumBlocks + 1, 0.0);
+  for (auto *BB : BF.layout()) {
+    const size_t I = BB->getLayoutIndex();
+    auto BI = BB->branch_info_begin();
+    for (auto *SuccBB : BB->successors()) {
+      const auto Count = BI->Count;
+      ++BI;
+      if (Count == BinaryBasicBlock::COUNT_NO_PROFILE || Count == 0)
+        continue;
+      const size_t J = SuccBB->getLayoutIndex();
+      if (I == J)
+        continue;
+      const auto Size = Addr[I + 1] - Addr[I];
+      double Cost = CacheMetrics::extTSPScore(Addr[I], Size, Addr[J], Count);
+      if (J == I + 1)
+        Cost += opts::FallthroughWeight * Count;
+      Loss[std::min(I, J) + 1] += Cost;
+      Loss[std::max(I, J) + 1] -= Cost;
+    }
+  }
+  for (size_t K = 1; K <= NumBlocks; ++K)
+    Loss[K] += Loss[K - 1];
+
+  // Outlining brings the code placed after the function closer by the size of
+  // the cold fragment, which is scored as forward jumps from the function
+  // within the i-cache distance of ExtTSP and within an i-TLB page.
+  const double EntryCount = BF.getKnownExecutionCount();
+  auto getBenefit = [&](uint64_t ColdSize) {
+    const double CacheGain =
+        std::min<uint64_t>(ColdSize, opts::ForwardDistance);
+    const double PageGain = std::min<uint64_t>(ColdSize, opts::ITLBPageSize);
+    return opts::ForwardWeight * EntryCount *
+           (CacheGain / opts::ForwardDistance + PageGain / opts::ITLBPageSize);
+  };
+
+  // Never outline the first basic block.
+  size_t BestSplit = NumBlocks;
+  double BestGain = 0.0;
+  for (size_t K = std::max<size_t>(FirstCandidate, 1); K < NumBlocks; ++K) {
+    const double Gain = getBenefit(Addr[NumBlocks] - Addr[K]) - Loss[K];
+    if (Gain > BestGain) {
+      BestGain = Gain;
+      BestSplit = K;
+    }
+  }
+
+  DEBUG(dbgs() << "BOLT-DEBUG: ExtTSP split point of " << BF << " is "
+               << BestSplit << " out of " << NumBlocks << " blocks with gain "
+               << BestGain << '\n');
+  return BestSplit;
 }
 
 } // namespace bolt
@@ -32,12 +32,33 @@ public:
     ST_ALL,           /// Split all functions.
   };
 
+  /// Strategies for choosing the blocks to outline.
+  enum SplitStrategy : char {
+    SS_PROFILE = 0,   /// Outline all blocks that are not hot by profile.
+    SS_EXTTSP,        /// Outline the part of such blocks that maximizes the
+                      /// modeled gain, if any.
+  };
+
 private:
   /// Split function body into fragments.
   void splitFunction(BinaryFunction &Function);
 
+  /// On AArch64, return the layout index of the first block of the cold
+  /// fragment after keeping in the hot fragment the blocks at \p FirstCold
+  /// that are not larger than the stubs needed to reach them.
+  size_t adjustSplitPointForStubs(const BinaryFunction &Function,
+                                  size_t FirstCold) const;
+
+  /// Return the layout index of the first block of the cold fragment with
+  /// the maximum modeled gain of splitting, where blocks starting from
+  /// \p FirstCandidate could be outlined. Return the layout size if no split
+  /// is profitable.
+  size_t findExtTSPSplitPoint(const BinaryFunction &Function,
+                              size_t FirstCandidate) const;
+
   std::atomic<uint64_t> SplitBytesHot{0ull};
   std::atomic<uint64_t> SplitBytesCold{0ull};
+  std::atomic<uint64_t> NumWarmFragments{0ull};
 
 public:
   explicit SplitFunctions(const cl::opt<bool> &PrintPass)
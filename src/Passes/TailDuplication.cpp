@@ -0,0 +1,177 @@
+//===--- Passes/TailDuplication.cpp - Profile-guided tail duplication -----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "TailDuplication.h"
+#include "llvm/Support/Options.h"
+
+#define DEBUG_TYPE "tail-duplication"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<unsigned>
+TailDuplicationMaxSize("tail-duplication-max-size",
+  cl::desc("maximum size in bytes of a block copied into its predecessors"),
+  cl::init(24),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+TailDuplicationMaxGrowth("tail-duplication-max-growth",
+  cl::desc("maximum growth of a function caused by tail duplication, in "
+           "percent of its size"),
+  cl::init(10),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+
+bool TailDuplication::canDuplicate(const BinaryBasicBlock &BB) const {
+  if (BB.pred_size() < 2 || BB.isEntryPoint() || BB.isLandingPad() ||
+      !BB.hasProfile() || !BB.getExecutionCount() || BB.succ_size() > 2)
+    return false;
+
+  const auto &MIB = *BB.getFunction()->getBinaryContext().MIB;
+  for (const auto &Inst : BB) {
+    if (MIB.isCFI(Inst) || MIB.isCall(Inst) || MIB.isIndirectBranch(Inst))
+      return false;
+  }
+  return true;
+}
+
+void TailDuplication::duplicateInto(BinaryBasicBlock &Pred,
+                                    BinaryBasicBlock &Succ) {
+  auto &MIB = *Pred.getFunction()->getBinaryContext().MIB;
+  const auto EdgeCount = Pred.getBranchInfo(Succ).Count;
+
+  if (auto *LastInst = Pred.getLastNonPseudoInstr()) {
+    if (MIB.isUnconditionalBranch(*LastInst))
+      Pred.eraseInstruction(Pred.findInstruction(LastInst));
+  }
+  for (auto Inst : Succ) {
+    if (MIB.isPseudo(Inst))
+      continue;
+    MIB.stripAnnotations(Inst);
+    Pred.addInstruction(Inst);
+  }
+
+  // Split the outgoing counts of Succ between the copy and the original.
+  const auto Ratio = std::min(1.0, double(EdgeCount) /
+                                   Succ.getExecutionCount());
+  auto splitCount = [&](uint64_t &Count, uint64_t Unknown) -> uint64_t {
+    if (Count == Unknown)
+      return Unknown;
+    const uint64_t Moved = Count * Ratio;
+    Count -= Moved;
+    return Moved;
+  };
+
+  Pred.removeSuccessor(&Succ);
+  std::vector<std::pair<BinaryBasicBlock *, BinaryBasicBlock::BinaryBranchInfo>>
+      NewSuccessors;
+  auto BI = Succ.branch_info_begin();
+  for (auto *SuccSucc : Succ.successors()) {
+    BinaryBasicBlock::BinaryBranchInfo NewBI;
+    NewBI.Count = splitCount(BI->Count, BinaryBasicBlock::COUNT_NO_PROFILE);
+    NewBI.MispredictedCount =
+        splitCount(BI->MispredictedCount, BinaryBasicBlock::COUNT_INFERRED);
+    NewSuccessors.emplace_back(SuccSucc, NewBI);
+    ++BI;
+  }
+  for (const auto &NewSucc : NewSuccessors)
+    Pred.addSuccessor(NewSucc.first, NewSucc.second);
+
+  Succ.setExecutionCount(Succ.getExecutionCount() -
+                         std::min(EdgeCount, Succ.getExecutionCount()));
+}
+
+void TailDuplication::runOnFunction(BinaryFunction &BF) {
+  struct Candidate {
+    BinaryBasicBlock *Pred;
+    BinaryBasicBlock *Succ;
+    uint64_t Count;
+  };
+  std::vector<Candidate> Candidates;
+  uint64_t FunctionSize = 0;
+  for (auto *BB : BF.layout()) {
+    FunctionSize += BB->estimateSize();
+    if (BB->succ_size() != 1)
+      continue;
+    auto *Succ = BB->getSuccessor();
+    const auto Count = BB->getBranchInfo(*Succ).Count;
+    if (Succ == BB || Count == BinaryBasicBlock::COUNT_NO_PROFILE || !Count)
+      continue;
+    Candidates.push_back({BB, Succ, Count});
+  }
+
+  std::stable_sort(Candidates.begin(), Candidates.end(),
+                   [](const Candidate &A, const Candidate &B) {
+                     return A.Count > B.Count;
+                   });
+
+  const auto &MIB = *BF.getBinaryContext().MIB;
+  uint64_t Budget = FunctionSize * opts::TailDuplicationMaxGrowth / 100;
+  for (const auto &C : Candidates) {
+    auto &Pred = *C.Pred;
+    auto &Succ = *C.Succ;
+    // Earlier copies may have changed the edge.
+    if (Pred.succ_size() != 1 || Pred.getSuccessor() != &Succ ||
+        !canDuplicate(Succ))
+      continue;
+
+    // The predecessor has to jump to the copied block or fall through to it.
+    const auto *LastInst = Pred.getLastNonPseudoInstr();
+    if (LastInst && MIB.isTerminator(*LastInst) &&
+        !MIB.isUnconditionalBranch(*LastInst))
+      continue;
+
+    if (Pred.getCFIStateAtExit() != Succ.getCFIState())
+      continue;
+
+    const auto Size = Succ.estimateSize();
+    if (Size > opts::TailDuplicationMaxSize || Size > Budget)
+      continue;
+
+    DEBUG(dbgs() << "BOLT-DEBUG: duplicating " << Succ.getName() << " into "
+                 << Pred.getName() << " in " << BF << '\n');
+    duplicateInto(Pred, Succ);
+    Budget -= Size;
+    ++NumDuplicatedBlocks;
+    DuplicatedBytes += Size;
+    DuplicatedCount += C.Count;
+    Modified.insert(&BF);
+  }
+}
+
+void TailDuplication::runOnFunctions(BinaryContext &BC) {
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &BF = BFI.second;
+    if (!shouldOptimize(BF) || !BF.hasValidProfile())
+      continue;
+    runOnFunction(BF);
+  }
+
+  outs() << "BOLT-INFO: tail duplication copied " << NumDuplicatedBlocks
+         << " blocks (" << DuplicatedBytes << " bytes) into predecessors "
+         << "reaching them " << DuplicatedCount << " times\n";
+}
+
+} // namespace bolt
+} // namespace llvm
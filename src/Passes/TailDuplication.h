@@ -0,0 +1,71 @@
+//===--- Passes/TailDuplication.h - Profile-guided tail duplication -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PASSES_TAIL_DUPLICATION_H
+#define LLVM_TOOLS_LLVM_BOLT_PASSES_TAIL_DUPLICATION_H
+
+#include "BinaryPasses.h"
+
+namespace llvm {
+namespace bolt {
+
+/// Copy small successor blocks shared by several predecessors, such as merge
+/// points and loop latches, into their hot predecessors that reach them with
+/// an unconditional edge:
+///
+///    B1: ...                        B1: ...
+///        jmp  S                         addl $0x1, %eax
+///    B2: ...                 =>         ret
+///        jmp  S                     B2: ...
+///    S:  addl $0x1, %eax                jmp  S
+///        ret                        S:  addl $0x1, %eax
+///                                       ret
+///
+/// The pass runs before block reordering, which can then use the successors
+/// of the duplicated code as new fall-throughs. Edges are processed from the
+/// hottest one until the code growth budget of the function is exhausted.
+/// The profile of the copied block is split between the copy and the
+/// original in proportion to the count of the duplicated edge. Blocks with
+/// CFI, calls or indirect branches are never copied, and the predecessor
+/// must end in the same CFI state as the copied block, so the unwind info of
+/// the copy stays valid.
+class TailDuplication : public BinaryFunctionPass {
+  uint64_t NumDuplicatedBlocks{0};
+  uint64_t DuplicatedBytes{0};
+  uint64_t DuplicatedCount{0};
+  DenseSet<const BinaryFunction *> Modified;
+
+  /// Return true if \p BB can be copied into one of its predecessors.
+  bool canDuplicate(const BinaryBasicBlock &BB) const;
+
+  /// Append a copy of \p Succ to \p Pred, which must have \p Succ as its only
+  /// successor, and move the profile of the edge to the copy.
+  void duplicateInto(BinaryBasicBlock &Pred, BinaryBasicBlock &Succ);
+
+  void runOnFunction(BinaryFunction &BF);
+
+public:
+  explicit TailDuplication(const cl::opt<bool> &PrintPass)
+    : BinaryFunctionPass(PrintPass) { }
+
+  const char *getName() const override {
+    return "tail-duplication";
+  }
+  bool shouldPrint(const BinaryFunction &BF) const override {
+    return BinaryFunctionPass::shouldPrint(BF) && Modified.count(&BF) > 0;
+  }
+  void runOnFunctions(BinaryContext &BC) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
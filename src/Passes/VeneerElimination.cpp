@@ -55,10 +55,11 @@ void VeneerElimination::runOnFunctions(BinaryContext &BC) {
       for (auto Name : VeneerFunction.getNames()) {
         auto *Symbol = BC.Ctx->lookupSymbol(Name);
         VeneerDestinations[Symbol] = VeneerTargetSymbol;
-        BC.SymbolToFunctionMap.erase(Symbol);
+        BC.eraseSymbolToFunctionMap(Symbol);
       }
 
       BC.BinaryDataMap.erase(VeneerFunction.getAddress());
+      BC.removeFromFunctionIndex(VeneerFunction.getAddress());
       BFs.erase(CurrentIt);
     }
   }
@@ -0,0 +1,561 @@
+//===--- PerfDataReader.cpp - Native perf.data reader ---------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "PerfDataReader.h"
+#include "llvm/Support/Debug.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+#define DEBUG_TYPE "aggregator"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace {
+
+/// "PERFILE2" read as a little-endian 64-bit integer.
+constexpr uint64_t PerfMagic = 0x32454c4946524550ULL;
+
+/// Size of struct perf_file_header.
+constexpr uint64_t FileHeaderSize = 104;
+
+/// Size of struct perf_event_header.
+constexpr uint64_t RecordHeaderSize = 8;
+
+/// Record types from include/uapi/linux/perf_event.h.
+enum : uint32_t {
+  PERF_RECORD_COMM = 3,
+  PERF_RECORD_FORK = 7,
+  PERF_RECORD_SAMPLE = 9,
+  PERF_RECORD_MMAP2 = 10,
+  PERF_RECORD_COMPRESSED = 81,
+};
+
+enum : uint16_t {
+  PERF_RECORD_MISC_COMM_EXEC = 1 << 13,
+  PERF_RECORD_MISC_BUILD_ID_SIZE = 1 << 15,
+};
+
+/// Bits of perf_event_attr::sample_type.
+enum : uint64_t {
+  PERF_SAMPLE_IP = 1U << 0,
+  PERF_SAMPLE_TID = 1U << 1,
+  PERF_SAMPLE_TIME = 1U << 2,
+  PERF_SAMPLE_ADDR = 1U << 3,
+  PERF_SAMPLE_READ = 1U << 4,
+  PERF_SAMPLE_CALLCHAIN = 1U << 5,
+  PERF_SAMPLE_ID = 1U << 6,
+  PERF_SAMPLE_CPU = 1U << 7,
+  PERF_SAMPLE_PERIOD = 1U << 8,
+  PERF_SAMPLE_STREAM_ID = 1U << 9,
+  PERF_SAMPLE_RAW = 1U << 10,
+  PERF_SAMPLE_BRANCH_STACK = 1U << 11,
+  PERF_SAMPLE_IDENTIFIER = 1U << 16,
+};
+
+/// Bits of perf_event_attr::read_format.
+enum : uint64_t {
+  PERF_FORMAT_TOTAL_TIME_ENABLED = 1U << 0,
+  PERF_FORMAT_TOTAL_TIME_RUNNING = 1U << 1,
+  PERF_FORMAT_ID = 1U << 2,
+  PERF_FORMAT_GROUP = 1U << 3,
+  PERF_FORMAT_LOST = 1U << 4,
+};
+
+/// perf_event_attr::branch_sample_type flag adding hw_idx to branch stacks.
+constexpr uint64_t PERF_SAMPLE_BRANCH_HW_INDEX = 1U << 17;
+
+/// perf_event_attr::sample_id_all bit in the flags bit-field.
+constexpr uint64_t AttrFlagSampleIDAll = 1ULL << 18;
+
+/// Feature bits from tools/perf/util/header.h.
+enum : unsigned {
+  HEADER_BUILD_ID = 2,
+  HEADER_EVENT_DESC = 12,
+  HEADER_FEAT_BITS = 256,
+};
+
+/// Fields that can be present in the sample id trailer of non-sample records.
+constexpr uint64_t SampleIDAllMask =
+    PERF_SAMPLE_TID | PERF_SAMPLE_TIME | PERF_SAMPLE_ID |
+    PERF_SAMPLE_STREAM_ID | PERF_SAMPLE_CPU | PERF_SAMPLE_IDENTIFIER;
+
+uint64_t read64(StringRef Data, uint64_t Offset) {
+  return support::endian::read64le(Data.data() + Offset);
+}
+
+uint32_t read32(StringRef Data, uint64_t Offset) {
+  return support::endian::read32le(Data.data() + Offset);
+}
+
+uint16_t read16(StringRef Data, uint64_t Offset) {
+  return support::endian::read16le(Data.data() + Offset);
+}
+
+/// Read a NUL-terminated string starting at \p Offset of \p Data.
+StringRef readCString(StringRef Data, uint64_t Offset) {
+  if (Offset >= Data.size())
+    return StringRef();
+  Data = Data.drop_front(Offset);
+  return Data.substr(0, Data.find('\0'));
+}
+
+} // namespace
+
+ErrorOr<std::unique_ptr<PerfDataReader>>
+PerfDataReader::create(StringRef FileName) {
+  auto MB = MemoryBuffer::getFile(FileName, /*FileSize=*/-1,
+                                  /*RequiresNullTerminator=*/false);
+  if (std::error_code EC = MB.getError())
+    return EC;
+
+  std::unique_ptr<PerfDataReader> Reader(new PerfDataReader());
+  Reader->Buffer = std::move(*MB);
+  if (std::error_code EC = Reader->parseHeader())
+    return EC;
+
+  return std::move(Reader);
+}
+
+std::error_code PerfDataReader::parseHeader() {
+  StringRef Data = Buffer->getBuffer();
+  if (Data.size() < FileHeaderSize)
+    return make_error_code(llvm::errc::invalid_argument);
+
+  if (read64(Data, 0) != PerfMagic) {
+    errs() << "PERF2BOLT-ERROR: unsupported perf.data format. Only files "
+              "written in file mode on a little-endian host are supported.\n";
+    return make_error_code(llvm::errc::invalid_argument);
+  }
+
+  const uint64_t HeaderSize = read64(Data, 8);
+  if (HeaderSize != FileHeaderSize) {
+    errs() << "PERF2BOLT-ERROR: perf.data in pipe mode is not supported\n";
+    return make_error_code(llvm::errc::invalid_argument);
+  }
+
+  const uint64_t AttrSize = read64(Data, 16);
+  const uint64_t AttrsOffset = read64(Data, 24);
+  const uint64_t AttrsSize = read64(Data, 32);
+  DataOffset = read64(Data, 40);
+  DataSize = read64(Data, 48);
+  if (DataOffset > Data.size() || DataSize > Data.size() - DataOffset)
+    return make_error_code(llvm::errc::invalid_argument);
+
+  if (std::error_code EC = parseAttrs(AttrsOffset, AttrsSize, AttrSize))
+    return EC;
+
+  uint64_t FeatureBits[HEADER_FEAT_BITS / 64];
+  for (unsigned I = 0; I < HEADER_FEAT_BITS / 64; ++I)
+    FeatureBits[I] = read64(Data, 72 + I * 8);
+
+  return parseFeatures(FeatureBits);
+}
+
+std::error_code PerfDataReader::parseAttrs(uint64_t Offset, uint64_t Size,
+                                           uint64_t AttrSize) {
+  StringRef Data = Buffer->getBuffer();
+  // Each entry is a perf_event_attr followed by a perf_file_section
+  // describing the sample ids that belong to the attribute.
+  if (AttrSize < 16 + 48 || Offset > Data.size() ||
+      Size > Data.size() - Offset)
+    return make_error_code(llvm::errc::invalid_argument);
+
+  for (uint64_t Entry = Offset; Entry + AttrSize <= Offset + Size;
+       Entry += AttrSize) {
+    const uint64_t EventAttrSize = AttrSize - 16;
+    EventAttr Attr;
+    Attr.SampleType = read64(Data, Entry + 24);
+    Attr.ReadFormat = read64(Data, Entry + 32);
+    Attr.SampleIDAll = read64(Data, Entry + 40) & AttrFlagSampleIDAll;
+    if (EventAttrSize >= 80)
+      Attr.BranchSampleType = read64(Data, Entry + 72);
+
+    const uint64_t IDsOffset = read64(Data, Entry + EventAttrSize);
+    const uint64_t IDsSize = read64(Data, Entry + EventAttrSize + 8);
+    if (IDsOffset > Data.size() || IDsSize > Data.size() - IDsOffset)
+      return make_error_code(llvm::errc::invalid_argument);
+    for (uint64_t ID = 0; ID + 8 <= IDsSize; ID += 8)
+      IDToAttr[read64(Data, IDsOffset + ID)] = Attrs.size();
+
+    Attrs.emplace_back(Attr);
+  }
+
+  if (Attrs.empty())
+    return make_error_code(llvm::errc::invalid_argument);
+
+  // Without sample ids we cannot tell which attribute describes a record
+  // unless all attributes share the same layout.
+  const uint64_t FirstSampleType = Attrs.front().SampleType;
+  for (const auto &Attr : Attrs) {
+    if (Attr.SampleType != FirstSampleType &&
+        !(FirstSampleType & (PERF_SAMPLE_ID | PERF_SAMPLE_IDENTIFIER))) {
+      errs() << "PERF2BOLT-ERROR: perf.data contains events with different "
+                "sample layouts and no sample ids\n";
+      return make_error_code(llvm::errc::invalid_argument);
+    }
+  }
+
+  return std::error_code();
+}
+
+std::error_code PerfDataReader::parseFeatures(const uint64_t *FeatureBits) {
+  StringRef Data = Buffer->getBuffer();
+  // An array of perf_file_section, one for each feature bit set, follows the
+  // data section.
+  uint64_t SectionOffset = DataOffset + DataSize;
+  for (unsigned Feature = 0; Feature < HEADER_FEAT_BITS; ++Feature) {
+    if (!(FeatureBits[Feature / 64] & (1ULL << (Feature % 64))))
+      continue;
+
+    if (SectionOffset + 16 > Data.size())
+      return make_error_code(llvm::errc::invalid_argument);
+    const uint64_t Offset = read64(Data, SectionOffset);
+    const uint64_t Size = read64(Data, SectionOffset + 8);
+    SectionOffset += 16;
+    if (Offset > Data.size() || Size > Data.size() - Offset)
+      return make_error_code(llvm::errc::invalid_argument);
+
+    if (Feature == HEADER_BUILD_ID)
+      parseBuildIDFeature(Data.substr(Offset, Size));
+    else if (Feature == HEADER_EVENT_DESC)
+      parseEventDescFeature(Data.substr(Offset, Size));
+  }
+
+  return std::error_code();
+}
+
+void PerfDataReader::parseBuildIDFeature(StringRef Data) {
+  // struct build_id_event {
+  //   struct perf_event_header header;
+  //   pid_t pid;
+  //   u8 build_id[24];
+  //   char filename[];
+  // };
+  for (uint64_t Offset = 0; Offset + RecordHeaderSize <= Data.size();) {
+    const uint16_t Misc = read16(Data, Offset + 4);
+    const uint16_t Size = read16(Data, Offset + 6);
+    if (Size < 36 || Offset + Size > Data.size())
+      return;
+
+    StringRef Record = Data.substr(Offset, Size);
+    unsigned BuildIDSize = 20;
+    if (Misc & PERF_RECORD_MISC_BUILD_ID_SIZE)
+      BuildIDSize = std::min<unsigned>(Record[12 + 20], 20);
+
+    std::string BuildID;
+    raw_string_ostream OS(BuildID);
+    for (unsigned I = 0; I < BuildIDSize; ++I)
+      OS << format_hex_no_prefix(static_cast<uint8_t>(Record[12 + I]), 2);
+    OS.flush();
+
+    BuildIDs.emplace_back(readCString(Record, 36), std::move(BuildID));
+    Offset += Size;
+  }
+}
+
+void PerfDataReader::parseEventDescFeature(StringRef Data) {
+  if (Data.size() < 8)
+    return;
+
+  const uint32_t NumEvents = read32(Data, 0);
+  const uint32_t AttrSize = read32(Data, 4);
+  uint64_t Offset = 8;
+  for (uint32_t Event = 0; Event < NumEvents; ++Event) {
+    // perf_event_attr, u32 nr_ids, u32 string length, string, u64 ids[nr_ids]
+    if (Offset + AttrSize + 8 > Data.size())
+      return;
+    Offset += AttrSize;
+    const uint32_t NumIDs = read32(Data, Offset);
+    const uint32_t NameLength = read32(Data, Offset + 4);
+    Offset += 8;
+    if (Offset + NameLength + NumIDs * 8ULL > Data.size())
+      return;
+    StringRef Name = readCString(Data.substr(0, Offset + NameLength), Offset);
+    Offset += NameLength;
+
+    if (NumIDs == 0 && Event < Attrs.size())
+      Attrs[Event].Name = Name;
+    for (uint32_t I = 0; I < NumIDs; ++I) {
+      auto It = IDToAttr.find(read64(Data, Offset + I * 8));
+      if (It != IDToAttr.end())
+        Attrs[It->second].Name = Name;
+    }
+    Offset += NumIDs * 8ULL;
+  }
+}
+
+const PerfDataReader::EventAttr *
+PerfDataReader::getAttrForID(uint64_t ID) const {
+  auto It = IDToAttr.find(ID);
+  if (It == IDToAttr.end())
+    return nullptr;
+  return &Attrs[It->second];
+}
+
+const PerfDataReader::EventAttr *
+PerfDataReader::getAttrForRecord(StringRef Record, uint32_t Type) const {
+  if (Attrs.size() == 1)
+    return &Attrs.front();
+
+  // The position of the sample id is the same for all attributes.
+  const uint64_t SampleType = Attrs.front().SampleType;
+  if (Type == PERF_RECORD_SAMPLE) {
+    if (SampleType & PERF_SAMPLE_IDENTIFIER) {
+      if (Record.size() < RecordHeaderSize + 8)
+        return nullptr;
+      return getAttrForID(read64(Record, RecordHeaderSize));
+    }
+    if (SampleType & PERF_SAMPLE_ID) {
+      uint64_t Offset = RecordHeaderSize;
+      Offset += 8 * countPopulation(SampleType &
+                                    (PERF_SAMPLE_IP | PERF_SAMPLE_TID |
+                                     PERF_SAMPLE_TIME | PERF_SAMPLE_ADDR));
+      if (Record.size() < Offset + 8)
+        return nullptr;
+      return getAttrForID(read64(Record, Offset));
+    }
+    return &Attrs.front();
+  }
+
+  if (!Attrs.front().SampleIDAll)
+    return &Attrs.front();
+
+  // Sample id trailer: TID, TIME, ID, STREAM_ID, CPU, IDENTIFIER.
+  uint64_t FromEnd = 0;
+  if (SampleType & PERF_SAMPLE_IDENTIFIER) {
+    FromEnd = 8;
+  } else if (SampleType & PERF_SAMPLE_ID) {
+    FromEnd = 8 * (1 + countPopulation(SampleType & (PERF_SAMPLE_STREAM_ID |
+                                                     PERF_SAMPLE_CPU)));
+  } else {
+    return &Attrs.front();
+  }
+  if (Record.size() < RecordHeaderSize + FromEnd)
+    return nullptr;
+  return getAttrForID(read64(Record, Record.size() - FromEnd));
+}
+
+uint64_t PerfDataReader::getRecordTime(StringRef Record,
+                                       const EventAttr &Attr) const {
+  if (!Attr.SampleIDAll || !(Attr.SampleType & PERF_SAMPLE_TIME))
+    return 0;
+
+  const uint64_t TrailerSize =
+      8 * countPopulation(Attr.SampleType & SampleIDAllMask);
+  if (Record.size() < RecordHeaderSize + TrailerSize)
+    return 0;
+
+  uint64_t Offset = Record.size() - TrailerSize;
+  if (Attr.SampleType & PERF_SAMPLE_TID)
+    Offset += 8;
+  // Convert nanoseconds to microseconds used by the aggregator.
+  return read64(Record, Offset) / 1000;
+}
+
+bool PerfDataReader::decodeSample(StringRef Record,
+                                  SampleEvent &Sample) const {
+  const EventAttr *Attr = getAttrForRecord(Record, PERF_RECORD_SAMPLE);
+  if (!Attr)
+    return false;
+
+  const uint64_t SampleType = Attr->SampleType;
+  uint64_t Offset = RecordHeaderSize;
+  auto has = [&](uint64_t Bits) { return SampleType & Bits; };
+  auto skip = [&](uint64_t Size) {
+    Offset += Size;
+    return Offset <= Record.size();
+  };
+  auto readU64 = [&](uint64_t &Value) {
+    if (Offset + 8 > Record.size())
+      return false;
+    Value = read64(Record, Offset);
+    Offset += 8;
+    return true;
+  };
+
+  Sample.EventName = Attr->Name;
+  Sample.HasAddr = has(PERF_SAMPLE_ADDR);
+  Sample.HasBranchStack = has(PERF_SAMPLE_BRANCH_STACK);
+  Sample.LBR.clear();
+
+  uint64_t Value;
+  if (has(PERF_SAMPLE_IDENTIFIER) && !skip(8))
+    return false;
+  if (has(PERF_SAMPLE_IP) && !readU64(Sample.PC))
+    return false;
+  if (has(PERF_SAMPLE_TID)) {
+    if (!readU64(Value))
+      return false;
+    Sample.PID = static_cast<int32_t>(Value & 0xffffffff);
+  }
+  if (has(PERF_SAMPLE_TIME) && !skip(8))
+    return false;
+  if (has(PERF_SAMPLE_ADDR) && !readU64(Sample.Addr))
+    return false;
+  if (has(PERF_SAMPLE_ID) && !skip(8))
+    return false;
+  if (has(PERF_SAMPLE_STREAM_ID) && !skip(8))
+    return false;
+  if (has(PERF_SAMPLE_CPU) && !skip(8))
+    return false;
+  if (has(PERF_SAMPLE_PERIOD) && !skip(8))
+    return false;
+  if (has(PERF_SAMPLE_READ)) {
+    const uint64_t ReadFormat = Attr->ReadFormat;
+    const uint64_t ValueSize =
+        8 * (1 + ((ReadFormat & PERF_FORMAT_ID) ? 1 : 0) +
+             ((ReadFormat & PERF_FORMAT_LOST) ? 1 : 0));
+    const uint64_t TimesSize =
+        8 * countPopulation(ReadFormat & (PERF_FORMAT_TOTAL_TIME_ENABLED |
+                                          PERF_FORMAT_TOTAL_TIME_RUNNING));
+    if (ReadFormat & PERF_FORMAT_GROUP) {
+      uint64_t NumValues;
+      if (!readU64(NumValues) || !skip(TimesSize + NumValues * ValueSize))
+        return false;
+    } else if (!skip(ValueSize + TimesSize)) {
+      return false;
+    }
+  }
+  if (has(PERF_SAMPLE_CALLCHAIN)) {
+    uint64_t NumIPs;
+    if (!readU64(NumIPs) || !skip(NumIPs * 8))
+      return false;
+  }
+  if (has(PERF_SAMPLE_RAW)) {
+    if (Offset + 4 > Record.size())
+      return false;
+    // The raw data size field is u32 and the data is padded to keep the
+    // record aligned to 8 bytes.
+    const uint32_t RawSize = read32(Record, Offset);
+    if (!skip(4 + RawSize))
+      return false;
+  }
+  if (has(PERF_SAMPLE_BRANCH_STACK)) {
+    uint64_t NumEntries;
+    if (!readU64(NumEntries))
+      return false;
+    if ((Attr->BranchSampleType & PERF_SAMPLE_BRANCH_HW_INDEX) && !skip(8))
+      return false;
+    if (Offset + NumEntries * 24 > Record.size())
+      return false;
+    for (uint64_t I = 0; I < NumEntries; ++I) {
+      LBREntry LBR;
+      LBR.From = read64(Record, Offset);
+      LBR.To = read64(Record, Offset + 8);
+      // The first bit of perf_branch_entry flags is the misprediction bit.
+      LBR.Mispred = read64(Record, Offset + 16) & 1;
+      Sample.LBR.push_back(LBR);
+      Offset += 24;
+    }
+  }
+
+  return true;
+}
+
+std::error_code
+PerfDataReader::readRecords(const RecordHandlers &Handlers) const {
+  StringRef Data = Buffer->getBuffer().substr(DataOffset, DataSize);
+  SampleEvent Sample;
+  uint64_t NumMalformed = 0;
+  for (uint64_t Offset = 0; Offset + RecordHeaderSize <= Data.size();) {
+    const uint32_t Type = read32(Data, Offset);
+    const uint16_t Misc = read16(Data, Offset + 4);
+    const uint16_t Size = read16(Data, Offset + 6);
+    if (Size < RecordHeaderSize || Offset + Size > Data.size()) {
+      errs() << "PERF2BOLT-ERROR: malformed record at offset 0x"
+             << Twine::utohexstr(DataOffset + Offset) << " in perf.data\n";
+      return make_error_code(llvm::errc::io_error);
+    }
+
+    StringRef Record = Data.substr(Offset, Size);
+    Offset += Size;
+
+    switch (Type) {
+    default:
+      break;
+    case PERF_RECORD_COMPRESSED:
+      errs() << "PERF2BOLT-ERROR: compressed perf.data is not supported\n";
+      return make_error_code(llvm::errc::not_supported);
+    case PERF_RECORD_SAMPLE:
+      if (!Handlers.Sample)
+        break;
+      if (!decodeSample(Record, Sample)) {
+        ++NumMalformed;
+        break;
+      }
+      if (!Handlers.Sample(Sample))
+        return std::error_code();
+      break;
+    case PERF_RECORD_MMAP2: {
+      // pid, tid, addr, len, pgoff, maj, min, ino, ino_generation, prot,
+      // flags, filename
+      if (!Handlers.MMap)
+        break;
+      const uint64_t FileNameOffset = RecordHeaderSize + 64;
+      if (Record.size() <= FileNameOffset) {
+        ++NumMalformed;
+        break;
+      }
+      const auto *Attr = getAttrForRecord(Record, Type);
+      MMapEvent Event;
+      Event.PID = static_cast<int32_t>(read32(Record, RecordHeaderSize));
+      Event.Address = read64(Record, RecordHeaderSize + 8);
+      Event.Size = read64(Record, RecordHeaderSize + 16);
+      Event.Offset = read64(Record, RecordHeaderSize + 24);
+      Event.Time = Attr ? getRecordTime(Record, *Attr) : 0;
+      Event.FileName = readCString(Record, FileNameOffset);
+      Handlers.MMap(Event);
+      break;
+    }
+    case PERF_RECORD_COMM: {
+      if (!Handlers.CommExec || !(Misc & PERF_RECORD_MISC_COMM_EXEC))
+        break;
+      if (Record.size() < RecordHeaderSize + 8) {
+        ++NumMalformed;
+        break;
+      }
+      CommExecEvent Event;
+      Event.PID = static_cast<int32_t>(read32(Record, RecordHeaderSize));
+      Handlers.CommExec(Event);
+      break;
+    }
+    case PERF_RECORD_FORK: {
+      // pid, ppid, tid, ptid, time
+      if (!Handlers.Fork)
+        break;
+      if (Record.size() < RecordHeaderSize + 24) {
+        ++NumMalformed;
+        break;
+      }
+      const auto *Attr = getAttrForRecord(Record, Type);
+      ForkEvent Event;
+      Event.ChildPID = static_cast<int32_t>(read32(Record, RecordHeaderSize));
+      Event.ParentPID =
+          static_cast<int32_t>(read32(Record, RecordHeaderSize + 4));
+      Event.Time = Attr && Attr->SampleIDAll
+                       ? getRecordTime(Record, *Attr)
+                       : read64(Record, RecordHeaderSize + 16) / 1000;
+      Handlers.Fork(Event);
+      break;
+    }
+    }
+  }
+
+  if (NumMalformed)
+    errs() << "PERF2BOLT-WARNING: ignored " << NumMalformed
+           << " malformed records in perf.data\n";
+
+  return std::error_code();
+}
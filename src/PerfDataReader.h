@@ -0,0 +1,165 @@
+//===--- PerfDataReader.h - Native perf.data reader -------------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// A reader for the perf.data file format written by `perf record`. It decodes
+// the records needed for profile aggregation directly from the file, without
+// spawning `perf script` and parsing its textual output.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PERF_DATA_READER_H
+#define LLVM_TOOLS_LLVM_BOLT_PERF_DATA_READER_H
+
+#include "DataReader.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/ErrorOr.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace llvm {
+namespace bolt {
+
+/// PerfDataReader maps a perf.data file in memory and iterates over the
+/// records of its data section. Only the subset of the format used by
+/// perf2bolt is supported: PERF_RECORD_SAMPLE (with IP, TID, ADDR and branch
+/// stack fields), PERF_RECORD_MMAP2, PERF_RECORD_COMM and PERF_RECORD_FORK.
+/// Build-ids and event names are read from the feature sections of the file
+/// header.
+///
+/// Records are delivered in file order. Unlike `perf script`, the reader does
+/// not sort events by time. This is fine for aggregation since samples are
+/// processed only after all memory maps and task events were collected.
+///
+/// Pipe-mode files and files recorded on a host with a different endianness
+/// are not supported.
+class PerfDataReader {
+public:
+  /// A single mapping of a file into a process address space.
+  struct MMapEvent {
+    int32_t PID;
+    uint64_t Address;
+    uint64_t Size;
+    uint64_t Offset;
+    uint64_t Time; // time in micro seconds
+    StringRef FileName;
+  };
+
+  /// PERF_RECORD_COMM event. Only events with the exec flag set are reported.
+  struct CommExecEvent {
+    int32_t PID;
+  };
+
+  /// PERF_RECORD_FORK event.
+  struct ForkEvent {
+    int32_t ParentPID;
+    int32_t ChildPID;
+    uint64_t Time; // time in micro seconds
+  };
+
+  /// PERF_RECORD_SAMPLE event. LBR entries are stored in the same order as
+  /// recorded by the hardware, i.e. in reverse execution order. Addresses are
+  /// not adjusted for the load address of the binary.
+  struct SampleEvent {
+    int32_t PID{-1};
+    uint64_t PC{0};
+    uint64_t Addr{0};
+    bool HasAddr{false};
+    bool HasBranchStack{false};
+    StringRef EventName;
+    SmallVector<LBREntry, 32> LBR;
+  };
+
+  /// Callbacks invoked for decoded records. Records for which no callback is
+  /// set are skipped without being decoded.
+  struct RecordHandlers {
+    std::function<void(const MMapEvent &)> MMap;
+    std::function<void(const CommExecEvent &)> CommExec;
+    std::function<void(const ForkEvent &)> Fork;
+    /// Return false to stop reading.
+    std::function<bool(const SampleEvent &)> Sample;
+  };
+
+  /// Open \p FileName and parse the file header, the attributes and the
+  /// feature sections.
+  static ErrorOr<std::unique_ptr<PerfDataReader>> create(StringRef FileName);
+
+  /// Read all records of the data section, invoking \p Handlers for each
+  /// supported record.
+  std::error_code readRecords(const RecordHandlers &Handlers) const;
+
+  /// Return a list of <file name, build-id> pairs recorded in the
+  /// HEADER_BUILD_ID feature section. The build-id is a lower case hex string.
+  const std::vector<std::pair<StringRef, std::string>> &getBuildIDs() const {
+    return BuildIDs;
+  }
+
+private:
+  PerfDataReader() = default;
+
+  /// Parsed perf_event_attr fields relevant to decoding samples.
+  struct EventAttr {
+    uint64_t SampleType{0};
+    uint64_t ReadFormat{0};
+    uint64_t BranchSampleType{0};
+    bool SampleIDAll{false};
+    StringRef Name;
+  };
+
+  /// Parse file header and attributes. Return an error if the file is not
+  /// a supported perf.data file.
+  std::error_code parseHeader();
+
+  /// Parse the attribute section.
+  std::error_code parseAttrs(uint64_t Offset, uint64_t Size, uint64_t AttrSize);
+
+  /// Parse the feature sections following the data section.
+  std::error_code parseFeatures(const uint64_t *FeatureBits);
+
+  /// Parse HEADER_BUILD_ID feature section contents.
+  void parseBuildIDFeature(StringRef Data);
+
+  /// Parse HEADER_EVENT_DESC feature section contents.
+  void parseEventDescFeature(StringRef Data);
+
+  /// Return the attribute describing a record with the sample id \p ID.
+  const EventAttr *getAttrForID(uint64_t ID) const;
+
+  /// Return the attribute used to decode a record \p Record of type \p Type.
+  const EventAttr *getAttrForRecord(StringRef Record, uint32_t Type) const;
+
+  /// Return the time (in micro seconds) stored in the sample id trailer of a
+  /// non-sample record \p Record.
+  uint64_t getRecordTime(StringRef Record, const EventAttr &Attr) const;
+
+  /// Decode PERF_RECORD_SAMPLE \p Record into \p Sample.
+  bool decodeSample(StringRef Record, SampleEvent &Sample) const;
+
+  std::unique_ptr<MemoryBuffer> Buffer;
+
+  /// Location of the data section in Buffer.
+  uint64_t DataOffset{0};
+  uint64_t DataSize{0};
+
+  std::vector<EventAttr> Attrs;
+
+  /// Map sample ids to indices in Attrs.
+  std::unordered_map<uint64_t, size_t> IDToAttr;
+
+  std::vector<std::pair<StringRef, std::string>> BuildIDs;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
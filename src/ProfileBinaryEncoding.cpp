@@ -0,0 +1,200 @@
+//===-- ProfileBinaryEncoding.cpp - Binary encoding of BOLT profile -------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "ProfileBinaryEncoding.h"
+#include "llvm/Support/Errc.h"
+#include "llvm/Support/LEB128.h"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace {
+
+const char BinaryProfileMagic[] = "BOLTYAM2";
+constexpr size_t BinaryProfileMagicSize = sizeof(BinaryProfileMagic) - 1;
+
+/// Magic of the first version of the encoding, without block hashes.
+const char BinaryProfileMagicV1[] = "BOLTYAMB";
+static_assert(sizeof(BinaryProfileMagicV1) == sizeof(BinaryProfileMagic),
+              "magics of all versions must have the same size");
+
+void writeString(raw_ostream &OS, StringRef Str) {
+  encodeULEB128(Str.size(), OS);
+  OS << Str;
+}
+
+/// Sequential decoder of a binary-encoded profile. Once an error is
+/// encountered, all subsequent reads return zero values.
+class Decoder {
+  const uint8_t *Cur;
+  const uint8_t *End;
+  bool HasError{false};
+
+public:
+  explicit Decoder(StringRef Buffer)
+    : Cur(Buffer.bytes_begin()), End(Buffer.bytes_end()) {}
+
+  bool hasError() const { return HasError; }
+
+  bool atEnd() const { return HasError || Cur == End; }
+
+  uint64_t readULEB() {
+    if (HasError)
+      return 0;
+    unsigned Size;
+    const char *Error = nullptr;
+    const auto Value = decodeULEB128(Cur, &Size, End, &Error);
+    if (Error) {
+      HasError = true;
+      return 0;
+    }
+    Cur += Size;
+    return Value;
+  }
+
+  std::string readString() {
+    const auto Size = readULEB();
+    if (HasError || Size > static_cast<uint64_t>(End - Cur)) {
+      HasError = true;
+      return std::string();
+    }
+    std::string Str(reinterpret_cast<const char *>(Cur), Size);
+    Cur += Size;
+    return Str;
+  }
+
+  /// Read the number of elements in a sequence. Every element takes at least
+  /// one byte, which bounds the allocation for a corrupted count.
+  size_t readCount() {
+    const auto Count = readULEB();
+    if (Count > static_cast<uint64_t>(End - Cur)) {
+      HasError = true;
+      return 0;
+    }
+    return Count;
+  }
+};
+
+} // anonymous namespace
+
+namespace llvm {
+namespace bolt {
+
+bool isBinaryEncodedProfile(StringRef Buffer) {
+  return Buffer.startswith(StringRef(BinaryProfileMagic,
+                                     BinaryProfileMagicSize)) ||
+         Buffer.startswith(StringRef(BinaryProfileMagicV1,
+                                     BinaryProfileMagicSize));
+}
+
+void writeBinaryEncodedProfile(raw_ostream &OS,
+                               const yaml::bolt::BinaryProfile &BP) {
+  OS.write(BinaryProfileMagic, BinaryProfileMagicSize);
+
+  const auto &Header = BP.Header;
+  encodeULEB128(Header.Version, OS);
+  writeString(OS, Header.FileName);
+  writeString(OS, Header.Id);
+  encodeULEB128(Header.Flags, OS);
+  writeString(OS, Header.Origin);
+  writeString(OS, Header.EventNames);
+
+  encodeULEB128(BP.Functions.size(), OS);
+  for (const auto &YamlBF : BP.Functions) {
+    writeString(OS, YamlBF.Name);
+    encodeULEB128(YamlBF.Id, OS);
+    encodeULEB128(YamlBF.Hash, OS);
+    encodeULEB128(YamlBF.ExecCount, OS);
+    encodeULEB128(YamlBF.NumBasicBlocks, OS);
+    encodeULEB128(YamlBF.Blocks.size(), OS);
+    for (const auto &YamlBB : YamlBF.Blocks) {
+      encodeULEB128(YamlBB.Index, OS);
+      encodeULEB128(YamlBB.NumInstructions, OS);
+      encodeULEB128(YamlBB.Hash, OS);
+      encodeULEB128(YamlBB.ExecCount, OS);
+      encodeULEB128(YamlBB.EventCount, OS);
+      encodeULEB128(YamlBB.CallSites.size(), OS);
+      for (const auto &CSI : YamlBB.CallSites) {
+        encodeULEB128(CSI.Offset, OS);
+        encodeULEB128(CSI.DestId, OS);
+        encodeULEB128(CSI.EntryDiscriminator, OS);
+        encodeULEB128(CSI.Count, OS);
+        encodeULEB128(CSI.Mispreds, OS);
+      }
+      encodeULEB128(YamlBB.Successors.size(), OS);
+      for (const auto &SI : YamlBB.Successors) {
+        encodeULEB128(SI.Index, OS);
+        encodeULEB128(SI.Count, OS);
+        encodeULEB128(SI.Mispreds, OS);
+      }
+    }
+  }
+}
+
+std::error_code readBinaryEncodedProfile(StringRef Buffer,
+                                         yaml::bolt::BinaryProfile &BP) {
+  if (!isBinaryEncodedProfile(Buffer))
+    return make_error_code(llvm::errc::invalid_argument);
+
+  const bool HasBlockHashes =
+      Buffer.startswith(StringRef(BinaryProfileMagic, BinaryProfileMagicSize));
+  Decoder D(Buffer.drop_front(BinaryProfileMagicSize));
+
+  auto &Header = BP.Header;
+  Header.Version = D.readULEB();
+  Header.FileName = D.readString();
+  Header.Id = D.readString();
+  Header.Flags = D.readULEB();
+  Header.Origin = D.readString();
+  Header.EventNames = D.readString();
+
+  BP.Functions.resize(D.readCount());
+  for (auto &YamlBF : BP.Functions) {
+    YamlBF.Name = D.readString();
+    YamlBF.Id = D.readULEB();
+    YamlBF.Hash = D.readULEB();
+    YamlBF.ExecCount = D.readULEB();
+    YamlBF.NumBasicBlocks = D.readULEB();
+    YamlBF.Blocks.resize(D.readCount());
+    for (auto &YamlBB : YamlBF.Blocks) {
+      YamlBB.Index = D.readULEB();
+      YamlBB.NumInstructions = D.readULEB();
+      if (HasBlockHashes)
+        YamlBB.Hash = D.readULEB();
+      YamlBB.ExecCount = D.readULEB();
+      YamlBB.EventCount = D.readULEB();
+      YamlBB.CallSites.resize(D.readCount());
+      for (auto &CSI : YamlBB.CallSites) {
+        CSI.Offset = D.readULEB();
+        CSI.DestId = D.readULEB();
+        CSI.EntryDiscriminator = D.readULEB();
+        CSI.Count = D.readULEB();
+        CSI.Mispreds = D.readULEB();
+      }
+      YamlBB.Successors.resize(D.readCount());
+      for (auto &SI : YamlBB.Successors) {
+        SI.Index = D.readULEB();
+        SI.Count = D.readULEB();
+        SI.Mispreds = D.readULEB();
+      }
+    }
+    if (D.hasError())
+      break;
+  }
+
+  if (D.hasError() || !D.atEnd())
+    return make_error_code(llvm::errc::illegal_byte_sequence);
+
+  return std::error_code();
+}
+
+} // namespace bolt
+} // namespace llvm
@@ -0,0 +1,56 @@
+//===-- ProfileBinaryEncoding.h - Binary encoding of BOLT profile -*- C++ -*-=//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Compact binary encoding of the profile described in ProfileYAMLMapping.h.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PROFILE_BINARY_ENCODING_H
+#define LLVM_TOOLS_LLVM_BOLT_PROFILE_BINARY_ENCODING_H
+
+#include "ProfileYAMLMapping.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+#include <system_error>
+
+namespace llvm {
+namespace bolt {
+
+/// The binary encoding holds exactly the fields written to a YAML profile and
+/// is meant for large profiles where YAML parsing is too slow. The file starts
+/// with an 8-byte magic followed by the header strings and the functions. All
+/// integers are ULEB128-encoded, and strings are prefixed with their length.
+/// Each function is:
+///
+///   <name> <fid> <hash> <exec> <nblocks> <number of blocks> <blocks>
+///
+/// and each block:
+///
+///   <bid> <insns> <hash> <exec> <events>
+///   <number of calls> {<off> <fid> <disc> <cnt> <mis>}*
+///   <number of successors> {<bid> <cnt> <mis>}*
+///
+/// Profiles written before block hashes were added start with a different
+/// magic and are read without the <hash> of blocks.
+///
+/// Return true if \p Buffer contains a profile in the binary encoding.
+bool isBinaryEncodedProfile(StringRef Buffer);
+
+/// Write \p BP to \p OS using the binary encoding.
+void writeBinaryEncodedProfile(raw_ostream &OS,
+                               const yaml::bolt::BinaryProfile &BP);
+
+/// Decode a binary-encoded profile from \p Buffer into \p BP.
+std::error_code readBinaryEncodedProfile(StringRef Buffer,
+                                         yaml::bolt::BinaryProfile &BP);
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
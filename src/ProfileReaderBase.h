@@ -14,6 +14,7 @@
 #ifndef LLVM_TOOLS_LLVM_BOLT_PROFILE_READER_BASE_H
 #define LLVM_TOOLS_LLVM_BOLT_PROFILE_READER_BASE_H
 
+#include "NameTable.h"
 #include "llvm/ADT/StringSet.h"
 #include "llvm/Support/Error.h"
 
@@ -55,6 +56,9 @@ protected:
   /// Name of the file with profile.
   std::string Filename;
 
+  /// Function and object names referenced by the profile.
+  NameTable Names;
+
 public:
   ProfileReaderBase() = delete;
   ProfileReaderBase(const ProfileReaderBase &) = delete;
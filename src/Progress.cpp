@@ -0,0 +1,182 @@
+//===--- Progress.cpp - Periodic progress report of long phases -----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "Progress.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltCategory;
+
+static cl::opt<unsigned>
+ProgressInterval("progress-interval",
+  cl::desc("print the current phase, pass and processed functions with "
+           "throughput and estimated time left every <seconds> (0 = off)"),
+  cl::init(0),
+  cl::value_desc("seconds"),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
+} // namespace opts
+
+namespace llvm {
+namespace bolt {
+
+/// Owner of the reporting thread. The thread is started with the first phase
+/// and sleeps between reports, so the work itself only pays for relaxed
+/// atomic increments.
+class ProgressReporter {
+  std::mutex Lock;
+  std::condition_variable Wakeup;
+  std::thread Thread;
+  bool Stop{false};
+  std::chrono::steady_clock::time_point StartTime;
+
+  /// Names of nested phases. Protected by Lock.
+  std::vector<std::string> Phases;
+
+  /// Innermost task. Written under Lock, but read by workers without it.
+  std::atomic<ProgressTask *> CurrentTask{nullptr};
+
+  void report() {
+    using namespace std::chrono;
+    const auto Now = steady_clock::now();
+    std::string Line;
+    raw_string_ostream OS(Line);
+    OS << "BOLT-PROGRESS: "
+       << format("%.0f", duration<double>(Now - StartTime).count()) << "s ";
+    for (size_t I = 0; I < Phases.size(); ++I)
+      OS << (I ? " > " : "") << Phases[I];
+
+    if (auto *Task = CurrentTask.load()) {
+      const auto Done = Task->Done.load(std::memory_order_relaxed);
+      const auto Time = duration<double>(Now - Task->StartTime).count();
+      const auto Rate = Time > 0 ? Done / Time : 0.0;
+      OS << ": " << Task->Name << (Task->Name.empty() ? "" : " ") << Done
+         << '/' << Task->Total << " functions, " << format("%.0f", Rate)
+         << " functions/s";
+      if (Rate > 0 && Done <= Task->Total)
+        OS << ", ETA " << format("%.0f", (Task->Total - Done) / Rate) << 's';
+    }
+    OS << '\n';
+    errs() << OS.str();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> Guard(Lock);
+    const auto Interval = std::chrono::seconds(opts::ProgressInterval);
+    while (!Wakeup.wait_for(Guard, Interval, [this] { return Stop; }))
+      report();
+  }
+
+public:
+  ~ProgressReporter() {
+    if (!Thread.joinable())
+      return;
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Stop = true;
+    }
+    Wakeup.notify_one();
+    Thread.join();
+  }
+
+  void enterPhase(StringRef Name) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (!Thread.joinable()) {
+      StartTime = std::chrono::steady_clock::now();
+      Thread = std::thread([this] { run(); });
+    }
+    Phases.emplace_back(Name.str());
+  }
+
+  void exitPhase() {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (!Phases.empty())
+      Phases.pop_back();
+  }
+
+  void enterTask(ProgressTask *Task) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Task->Parent = CurrentTask.load();
+    CurrentTask.store(Task);
+  }
+
+  void exitTask(ProgressTask *Task) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    assert(CurrentTask.load() == Task && "progress tasks are not nested");
+    CurrentTask.store(Task->Parent);
+  }
+
+  void advance(uint64_t Count) {
+    if (auto *Task = CurrentTask.load(std::memory_order_relaxed))
+      Task->advance(Count);
+  }
+};
+
+} // namespace bolt
+} // namespace llvm
+
+namespace {
+
+ProgressReporter Reporter;
+
+} // anonymous namespace
+
+ProgressTask::ProgressTask(StringRef Name, uint64_t Total)
+  : Enabled(Progress::isEnabled()) {
+  if (!Enabled)
+    return;
+  this->Name = Name.str();
+  this->Total = Total;
+  StartTime = std::chrono::steady_clock::now();
+  Reporter.enterTask(this);
+}
+
+ProgressTask::~ProgressTask() {
+  if (Enabled)
+    Reporter.exitTask(this);
+}
+
+namespace llvm {
+namespace bolt {
+namespace Progress {
+
+bool isEnabled() {
+  return opts::ProgressInterval != 0;
+}
+
+void enterPhase(StringRef Name) {
+  if (isEnabled())
+    Reporter.enterPhase(Name);
+}
+
+void exitPhase() {
+  if (isEnabled())
+    Reporter.exitPhase();
+}
+
+void advance(uint64_t Count) {
+  Reporter.advance(Count);
+}
+
+} // namespace Progress
+} // namespace bolt
+} // namespace llvm
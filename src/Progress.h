@@ -0,0 +1,71 @@
+//===--- Progress.h - Periodic progress report of long phases ---*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Live progress report for long runs. With -progress-interval, a background
+// thread periodically prints the current rewriting phase and optimization
+// pass, and the number of functions processed by the current task with the
+// throughput and the estimated time left.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PROGRESS_H
+#define LLVM_TOOLS_LLVM_BOLT_PROGRESS_H
+
+#include "llvm/ADT/StringRef.h"
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace llvm {
+namespace bolt {
+
+/// Count functions processed in the enclosing scope as a task named \p Name
+/// that is expected to process \p Total functions. Tasks are only created on
+/// the main thread and could be nested, in which case the innermost one is
+/// reported. Workers update the counter with Progress::advance().
+class ProgressTask {
+  friend class ProgressReporter;
+
+  bool Enabled;
+  std::string Name;
+  uint64_t Total{0};
+  std::atomic<uint64_t> Done{0};
+  std::chrono::steady_clock::time_point StartTime;
+  ProgressTask *Parent{nullptr};
+
+public:
+  ProgressTask(StringRef Name, uint64_t Total);
+  ~ProgressTask();
+
+  void advance(uint64_t Count) {
+    Done.fetch_add(Count, std::memory_order_relaxed);
+  }
+};
+
+namespace Progress {
+
+/// Return true if progress is reported.
+bool isEnabled();
+
+/// Enter and exit a named phase. Phases are nested, e.g. an optimization pass
+/// inside of the rewriting phase that runs passes. Called from
+/// TelemetryScope, which marks all phases and passes.
+void enterPhase(StringRef Name);
+void exitPhase();
+
+/// Account for \p Count functions processed by the current task. Safe to call
+/// from any thread, and cheap when progress is not reported.
+void advance(uint64_t Count = 1);
+
+} // namespace Progress
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -20,13 +20,22 @@
 #include "DWARFRewriter.h"
 #include "DataAggregator.h"
 #include "DataReader.h"
+#include "DisassemblyCache.h"
 #include "Exceptions.h"
 #include "ExecutableFileMemoryManager.h"
 #include "MCPlusBuilder.h"
 #include "ParallelUtilities.h"
+#include "Progress.h"
+#include "Passes/LayoutPlan.h"
 #include "Passes/ReorderFunctions.h"
 #include "Relocation.h"
 #include "RuntimeLibs/HugifyRuntimeLibrary.h"
+#include "RuntimeLibs/PageOutRuntimeLibrary.h"
+#include "RuntimeLibs/SamplingRuntimeLibrary.h"
+#include "RuntimeLibs/StartupPrefetchRuntimeLibrary.h"
+#include "SpeedupModel.h"
+#include "SymbolizationMap.h"
+#include "Telemetry.h"
 #include "Utils.h"
 #include "YAMLProfileReader.h"
 #include "YAMLProfileWriter.h"
@@ -57,6 +66,7 @@
 #include "llvm/Support/Casting.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/DataExtractor.h"
+#include "llvm/Support/Endian.h"
 #include "llvm/Support/Errc.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/TargetRegistry.h"
@@ -67,9 +77,16 @@
 #include "llvm/Target/TargetMachine.h"
 #include <algorithm>
 #include <fstream>
+#if defined(__linux__)
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include <mutex>
 #include <stack>
 #include <system_error>
 #include <thread>
+#include <unordered_set>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt"
@@ -93,9 +110,16 @@ extern cl::OptionCategory BoltOutputCategory;
 extern cl::OptionCategory AggregatorCategory;
 
 extern cl::opt<MacroFusionType> AlignMacroOpFusion;
+extern cl::opt<bool> HeatmapUseBAT;
 extern cl::opt<bool> Hugify;
+extern cl::opt<bool> ColdSegmentPageOut;
+extern cl::opt<bool> PrefetchStartupText;
+extern cl::opt<bool> RuntimeSampling;
 extern cl::opt<bool> Instrument;
 extern cl::opt<JumpTableSupportLevel> JumpTables;
+extern cl::opt<bool> NeverPrint;
+extern cl::opt<bool> NoScan;
+extern cl::opt<bool> PrintProfileStats;
 extern cl::list<std::string> ReorderData;
 extern cl::opt<bolt::ReorderFunctions::ReorderType> ReorderFunctions;
 extern cl::opt<bool> TimeBuild;
@@ -107,6 +131,15 @@ AlignText("align-text",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<bool>
+CopyFileRange("copy-file-range",
+  cl::desc("copy unmodified ranges of the input file to the output in the "
+           "kernel, sharing extents where the filesystem supports reflinks"),
+  cl::init(true),
+  cl::Hidden,
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 static cl::opt<bool>
 ForceToDataRelocations("force-data-relocations",
   cl::desc("force relocations to data sections to always be processed"),
@@ -141,6 +174,15 @@ AllowStripped("allow-stripped",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<std::string>
+DisassemblyCacheFile("disassembly-cache",
+  cl::desc("file to load decoded instructions of the input binary from and "
+           "to save them to for later runs on the same binary"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltCategory));
+
 cl::opt<bool>
 DumpDotAll("dump-dot-all",
   cl::desc("dump function CFGs to graphviz format after each stage"),
@@ -225,6 +267,17 @@ LiteThresholdPct("lite-threshold-pct",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static cl::opt<double>
+LiteCoveragePct("lite-coverage-pct",
+  cl::desc("in lite mode, limit processing to the hottest functions that "
+           "together account for the specified percentage of the execution "
+           "count of all functions with profile. The rest of functions are "
+           "left in place."),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 static cl::opt<unsigned>
 LiteThresholdCount("lite-threshold-count",
   cl::desc("similar to '-lite-threshold-pct' but specify threshold using "
@@ -242,6 +295,22 @@ MaxFunctions("max-funcs",
   cl::Hidden,
   cl::cat(BoltCategory));
 
+static cl::opt<unsigned>
+NumShards("num-shards",
+  cl::desc("split the functions of the binary into the given number of "
+           "shards optimized by separate runs. Every run writes the layout "
+           "plan of its shard with -write-layout-plan and no output binary"),
+  cl::init(1),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
+static cl::opt<unsigned>
+Shard("shard",
+  cl::desc("index of the shard processed with -num-shards"),
+  cl::init(0),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
 static cl::opt<unsigned>
 MaxDataRelocations("max-data-relocations",
   cl::desc("maximum number of data relocations to process"),
@@ -343,6 +412,23 @@ UpdateDebugSections("update-debug-sections",
   cl::ZeroOrMore,
   cl::cat(BoltCategory));
 
+cl::opt<bool>
+SymbolizationDebugInfo("symbolization-debug-info",
+  cl::desc("only keep debug info needed for symbolization, i.e. line tables "
+           "and address ranges of compilation units, and strip types, "
+           "variables, and other debug sections (implies "
+           "-update-debug-sections)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
+cl::opt<std::string>
+SymbolizationMap("symbolization-map",
+  cl::desc("write a map of output addresses to input addresses, function "
+           "names and source lines to the given file"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOutputCategory));
+
 cl::opt<bool>
 EnableBAT("enable-bat",
   cl::desc("write BOLT Address Translation tables"),
@@ -357,6 +443,30 @@ UseGnuStack("use-gnu-stack",
   cl::ZeroOrMore,
   cl::cat(BoltCategory));
 
+cl::opt<bool>
+ColdSegment("cold-segment",
+  cl::desc("place cold code and cold data in a program segment of their own "
+           "after the new code and data (relocation mode only)"),
+  cl::ZeroOrMore,
+  cl::cat(BoltCategory));
+
+static cl::opt<bool>
+LKHotText("lk-hot-text",
+  cl::desc("lay out a Linux kernel with the hot text at the start of the "
+           "original .text, within the 2MB pages the kernel maps with PMDs "
+           "(implies -hot-text and -use-old-text, requires relocations)"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+LKAltInstrEntrySize("lk-altinstr-entry-size",
+  cl::desc("size of struct alt_instr entries in the .altinstructions section "
+           "of a Linux kernel. Default value: 12, i.e. v5.12 to v6.2 kernels"),
+  cl::init(12),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 cl::opt<bool>
 UseOldText("use-old-text",
   cl::desc("re-use space in old .text if possible (relocation mode)"),
@@ -440,6 +550,7 @@ bool processAllFunctions() {
 
 constexpr const char *RewriteInstance::SectionsToOverwrite[];
 constexpr const char *RewriteInstance::DebugSectionsToOverwrite[];
+constexpr const char *RewriteInstance::SymbolizationDebugSections[];
 
 const char RewriteInstance::TimerGroupName[] = "rewrite";
 const char RewriteInstance::TimerGroupDesc[] = "Rewrite passes";
@@ -490,11 +601,28 @@ RewriteInstance::RewriteInstance(ELFObjectFileBase *File, const int Argc,
 
   BAT = llvm::make_unique<BoltAddressTranslation>(*BC);
 
+  if (opts::SymbolizationDebugInfo)
+    opts::UpdateDebugSections = true;
+
   if (opts::UpdateDebugSections)
     DebugInfoRewriter = llvm::make_unique<DWARFRewriter>(*BC, SectionPatchers);
 
+  // Only one runtime library can be linked into the output binary.
+  if (opts::Instrument + opts::Hugify + opts::PrefetchStartupText +
+          opts::RuntimeSampling + opts::ColdSegmentPageOut > 1) {
+    errs() << "BOLT-ERROR: at most one of -instrument, -hugify, "
+              "-prefetch-startup-text, -runtime-sampling and "
+              "-cold-segment-pageout can be used\n";
+    exit(1);
+  }
   if (opts::Hugify)
     BC->setRuntimeLibrary(llvm::make_unique<HugifyRuntimeLibrary>());
+  else if (opts::PrefetchStartupText)
+    BC->setRuntimeLibrary(llvm::make_unique<StartupPrefetchRuntimeLibrary>());
+  else if (opts::RuntimeSampling)
+    BC->setRuntimeLibrary(llvm::make_unique<SamplingRuntimeLibrary>());
+  else if (opts::ColdSegmentPageOut)
+    BC->setRuntimeLibrary(llvm::make_unique<PageOutRuntimeLibrary>());
 }
 
 RewriteInstance::~RewriteInstance() {}
@@ -536,6 +664,7 @@ static bool shouldDisassemble(const BinaryFunction &BF) {
 void RewriteInstance::discoverStorage() {
   NamedRegionTimer T("discoverStorage", "discover storage", TimerGroupName,
                      TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "discoverStorage");
 
   // Stubs are harmful because RuntimeDyld may try to increase the size of
   // sections accounting for stubs when we need those sections to match the
@@ -587,6 +716,10 @@ void RewriteInstance::discoverStorage() {
          SectionName == getBOLTTextSectionName())) {
       errs() << "BOLT-ERROR: input file was processed by BOLT. "
                 "Cannot re-optimize.\n";
+      if (BAT->enabledFor(InputFile))
+        errs() << "BOLT-ERROR: to re-optimize, run perf2bolt on this binary "
+                  "and optimize the original input binary with the "
+                  "resulting profile\n";
       exit(1);
     }
   }
@@ -785,9 +918,16 @@ void RewriteInstance::patchBuildID() {
 }
 
 void RewriteInstance::run() {
+  if (!loadBinary())
+    return;
+
+  optimizeBinary();
+}
+
+bool RewriteInstance::loadBinary() {
   if (!BC) {
     errs() << "BOLT-ERROR: failed to create a binary context\n";
-    return;
+    return false;
   }
 
   outs() << "BOLT-INFO: Target architecture: "
@@ -801,6 +941,19 @@ void RewriteInstance::run() {
   adjustCommandLineOptions();
   discoverFileObjects();
 
+  readDebugInfo();
+
+  return true;
+}
+
+void RewriteInstance::serveRequest() {
+  // The options of the request were reset and parsed again.
+  adjustCommandLineOptions();
+
+  optimizeBinary();
+}
+
+void RewriteInstance::optimizeBinary() {
   preprocessProfileData();
 
   // Skip disassembling if we have a translation table and we are running an
@@ -812,7 +965,7 @@ void RewriteInstance::run() {
 
   selectFunctionsToProcess();
 
-  readDebugInfo();
+  readLineTables();
 
   disassembleFunctions();
 
@@ -829,6 +982,13 @@ void RewriteInstance::run() {
 
   runOptimizationPasses();
 
+  // The layout plan is the only output of a shard.
+  if (opts::NumShards > 1) {
+    outs() << "BOLT-INFO: not writing the output file for shard "
+           << opts::Shard << " of " << opts::NumShards << '\n';
+    return;
+  }
+
   emitAndLink();
 
   updateMetadata();
@@ -845,6 +1005,7 @@ void RewriteInstance::run() {
 void RewriteInstance::discoverFileObjects() {
   NamedRegionTimer T("discoverFileObjects", "discover file objects",
                      TimerGroupName, TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "discoverFileObjects");
   FileSymRefs.clear();
   BC->getBinaryFunctions().clear();
   BC->clearBinaryData();
@@ -859,25 +1020,100 @@ void RewriteInstance::discoverFileObjects() {
     }
   };
   std::unordered_map<SymbolRef, StringRef, SymbolRefHash> SymbolToFileName;
+
+  // Reading symbol properties goes through the ELF symbol and section tables
+  // and dominates symbol discovery in large binaries. The properties are read
+  // in parallel over chunks of symbols. Everything that registers names or
+  // functions below runs sequentially in the symbol table order, and the
+  // result does not depend on the number of threads.
+  struct SymbolInfo {
+    SymbolRef Symbol;
+    StringRef Name;
+    bool HasName{false};
+    SymbolRef::Type Type{SymbolRef::ST_Unknown};
+    uint32_t Flags{0};
+    uint64_t Address{0};
+    uint64_t Size{0};
+    SectionRef Section;
+    bool HasSection{false};
+    bool InMemory{false};
+  };
+  std::vector<SymbolInfo> FileSymbols;
   for (const auto &Symbol : InputFile->symbols()) {
-    auto NameOrError = Symbol.getName();
-    if (NameOrError && NameOrError->startswith("__asan_init")) {
+    FileSymbols.emplace_back();
+    FileSymbols.back().Symbol = Symbol;
+  }
+
+  // Symbols from non-allocatable sections are ignored.
+  struct SectionRefHash {
+    size_t operator()(SectionRef const &S) const {
+      return std::hash<decltype(DataRefImpl::p)>{}(S.getRawDataRefImpl().p);
+    }
+  };
+  std::unordered_map<SectionRef, bool, SectionRefHash> IsAllocatableSection;
+  for (const auto &Section : InputFile->sections())
+    IsAllocatableSection[Section] = BinarySection(*BC, Section).isAllocatable();
+
+  auto readSymbols = [&](size_t Begin, size_t End) {
+    for (size_t I = Begin; I < End; ++I) {
+      auto &Info = FileSymbols[I];
+      const auto &Symbol = Info.Symbol;
+      if (auto NameOrError = Symbol.getName()) {
+        Info.Name = *NameOrError;
+        Info.HasName = true;
+      } else {
+        consumeError(NameOrError.takeError());
+      }
+      Info.Flags = Symbol.getFlags();
+      Info.Type = cantFail(Symbol.getType());
+      if (Info.Type == SymbolRef::ST_File ||
+          (Info.Flags & SymbolRef::SF_Undefined))
+        continue;
+
+      Info.Address = cantFail(Symbol.getAddress());
+      Info.Size = ELFSymbolRef(Symbol).getSize();
+      auto Section = cantFail(Symbol.getSection());
+      if (Section != InputFile->section_end()) {
+        Info.Section = *Section;
+        Info.HasSection = true;
+      }
+      Info.InMemory = (Info.Flags & SymbolRef::SF_Absolute) ||
+                      (Info.HasSection &&
+                       IsAllocatableSection.find(Info.Section)->second);
+    }
+  };
+  constexpr size_t SymbolChunkSize = 16384;
+  const size_t NumFileSymbols = FileSymbols.size();
+  if (opts::NoThreads || NumFileSymbols <= SymbolChunkSize) {
+    readSymbols(0, NumFileSymbols);
+  } else {
+    auto &Pool = ParallelUtilities::getThreadPool();
+    for (size_t Begin = 0; Begin < NumFileSymbols; Begin += SymbolChunkSize)
+      Pool.async(readSymbols, Begin,
+                 std::min(Begin + SymbolChunkSize, NumFileSymbols));
+    Pool.wait();
+  }
+
+  for (const auto &Info : FileSymbols) {
+    const auto &Symbol = Info.Symbol;
+    if (Info.HasName && Info.Name.startswith("__asan_init")) {
       errs() << "BOLT-ERROR: input file was compiled or linked with sanitizer "
                 "support. Cannot optimize.\n";
       exit(1);
     }
-    if (NameOrError && NameOrError->startswith("__llvm_coverage_mapping")) {
+    if (Info.HasName && Info.Name.startswith("__llvm_coverage_mapping")) {
       errs() << "BOLT-ERROR: input file was compiled or linked with coverage "
                 "support. Cannot optimize.\n";
       exit(1);
     }
 
-    if (Symbol.getFlags() & SymbolRef::SF_Undefined)
+    if (Info.Flags & SymbolRef::SF_Undefined)
       continue;
 
-    if (cantFail(Symbol.getType()) == SymbolRef::ST_File) {
-      auto Name =
-          cantFail(std::move(NameOrError), "cannot get symbol name for file");
+    if (Info.Type == SymbolRef::ST_File) {
+      auto Name = Info.HasName ? Info.Name
+                               : cantFail(Symbol.getName(),
+                                          "cannot get symbol name for file");
       // Ignore Clang LTO artificial FILE symbol as it is not always generated,
       // and this uncertainty is causing havoc in function name matching.
       if (Name == "ld-temp.o")
@@ -887,48 +1123,59 @@ void RewriteInstance::discoverFileObjects() {
       continue;
     }
     if (!FileSymbolName.empty() &&
-        !(Symbol.getFlags() & SymbolRef::SF_Global)) {
+        !(Info.Flags & SymbolRef::SF_Global)) {
       SymbolToFileName[Symbol] = FileSymbolName;
     }
   }
 
   // Sort symbols in the file by value. Ignore symbols from non-allocatable
   // sections.
-  auto isSymbolInMemory = [this](const SymbolRef &Sym) {
-    if (cantFail(Sym.getType()) == SymbolRef::ST_File)
-      return false;
-    if (Sym.getFlags() & SymbolRef::SF_Absolute)
+  std::vector<const SymbolInfo *> SortedFileSymbols;
+  for (const auto &Info : FileSymbols)
+    if (Info.InMemory)
+      SortedFileSymbols.push_back(&Info);
+
+  auto compareSymbols = [](const SymbolInfo *A, const SymbolInfo *B) {
+    // FUNC symbols have the highest precedence, while SECTIONs have the
+    // lowest.
+    if (A->Address != B->Address)
+      return A->Address < B->Address;
+
+    if (A->Type == SymbolRef::ST_Function && B->Type != SymbolRef::ST_Function)
+      return true;
+    if (B->Type == SymbolRef::ST_Debug && A->Type != SymbolRef::ST_Debug)
       return true;
-    if (Sym.getFlags() & SymbolRef::SF_Undefined)
-      return false;
-    BinarySection Section(*BC, *cantFail(Sym.getSection()));
-    return Section.isAllocatable();
-  };
-  std::vector<SymbolRef> SortedFileSymbols;
-  std::copy_if(InputFile->symbol_begin(), InputFile->symbol_end(),
-               std::back_inserter(SortedFileSymbols),
-               isSymbolInMemory);
-
-  std::stable_sort(SortedFileSymbols.begin(), SortedFileSymbols.end(),
-                   [](const SymbolRef &A, const SymbolRef &B) {
-                     // FUNC symbols have the highest precedence, while SECTIONs
-                     // have the lowest.
-                     auto AddressA = cantFail(A.getAddress());
-                     auto AddressB = cantFail(B.getAddress());
-                     if (AddressA != AddressB)
-                      return AddressA < AddressB;
-
-                     auto AType = cantFail(A.getType());
-                     auto BType = cantFail(B.getType());
-                     if (AType == SymbolRef::ST_Function &&
-                         BType != SymbolRef::ST_Function)
-                       return true;
-                     if (BType == SymbolRef::ST_Debug &&
-                         AType != SymbolRef::ST_Debug)
-                       return true;
 
-                     return false;
-                   });
+    return false;
+  };
+  const size_t NumSortedSymbols = SortedFileSymbols.size();
+  if (opts::NoThreads || NumSortedSymbols <= SymbolChunkSize) {
+    std::stable_sort(SortedFileSymbols.begin(), SortedFileSymbols.end(),
+                     compareSymbols);
+  } else {
+    // Sort chunks in parallel and merge them pairwise. Both steps are stable,
+    // so the order is the same as with a single stable sort.
+    auto &Pool = ParallelUtilities::getThreadPool();
+    auto chunkBegin = [&](size_t Offset) {
+      return SortedFileSymbols.begin() + std::min(Offset, NumSortedSymbols);
+    };
+    for (size_t Begin = 0; Begin < NumSortedSymbols; Begin += SymbolChunkSize)
+      Pool.async([&, Begin] {
+        std::stable_sort(chunkBegin(Begin), chunkBegin(Begin + SymbolChunkSize),
+                         compareSymbols);
+      });
+    Pool.wait();
+    for (size_t Width = SymbolChunkSize; Width < NumSortedSymbols;
+         Width *= 2) {
+      for (size_t Begin = 0; Begin + Width < NumSortedSymbols;
+           Begin += 2 * Width)
+        Pool.async([&, Begin, Width] {
+          std::inplace_merge(chunkBegin(Begin), chunkBegin(Begin + Width),
+                             chunkBegin(Begin + 2 * Width), compareSymbols);
+        });
+      Pool.wait();
+    }
+  }
 
   // For aarch64, the ABI defines mapping symbols so we identify data in the
   // code section (see IHI0056B). $d identifies data contents.
@@ -936,36 +1183,40 @@ void RewriteInstance::discoverFileObjects() {
   if (BC->isAArch64()) {
     LastSymbol = std::stable_partition(
         SortedFileSymbols.begin(), SortedFileSymbols.end(),
-        [](const SymbolRef &Symbol) {
-          StringRef Name = cantFail(Symbol.getName());
-          return !(cantFail(Symbol.getType()) == SymbolRef::ST_Unknown &&
+        [](const SymbolInfo *Info) {
+          StringRef Name = Info->HasName ? Info->Name
+                                         : cantFail(Info->Symbol.getName());
+          return !(Info->Type == SymbolRef::ST_Unknown &&
                    (Name == "$d" || Name == "$x"));
         });
     --LastSymbol;
   }
 
-  auto getNextAddress = [&](std::vector<SymbolRef>::const_iterator Itr) {
-    const auto SymbolSection = cantFail(Itr->getSection());
-    const auto SymbolAddress = cantFail(Itr->getAddress());
-    const auto SymbolEndAddress = SymbolAddress + ELFSymbolRef(*Itr).getSize();
+  auto getNextAddress = [&](std::vector<const SymbolInfo *>::const_iterator
+                                Itr) {
+    const auto &SymbolSection = (*Itr)->Section;
+    const auto SymbolAddress = (*Itr)->Address;
+    const auto SymbolEndAddress = SymbolAddress + (*Itr)->Size;
 
     // absolute sym
-    if (SymbolSection == InputFile->section_end())
+    if (!(*Itr)->HasSection)
       return SymbolEndAddress;
 
+    auto isInSymbolSection = [&](const SymbolInfo *Info) {
+      return Info->HasSection && Info->Section == SymbolSection;
+    };
     while (Itr != LastSymbol &&
-           cantFail(std::next(Itr)->getSection()) == SymbolSection &&
-           cantFail(std::next(Itr)->getAddress()) == SymbolAddress) {
+           isInSymbolSection(*std::next(Itr)) &&
+           (*std::next(Itr))->Address == SymbolAddress) {
       ++Itr;
     }
 
-    if (Itr != LastSymbol &&
-        cantFail(std::next(Itr)->getSection()) == SymbolSection)
-      return cantFail(std::next(Itr)->getAddress());
+    if (Itr != LastSymbol && isInSymbolSection(*std::next(Itr)))
+      return (*std::next(Itr))->Address;
 
     const auto SymbolSectionEndAddress =
-      SymbolSection->getAddress() + SymbolSection->getSize();
-    if ((ELFSectionRef(*SymbolSection).getFlags() & ELF::SHF_TLS) ||
+      SymbolSection.getAddress() + SymbolSection.getSize();
+    if ((ELFSectionRef(SymbolSection).getFlags() & ELF::SHF_TLS) ||
         SymbolEndAddress > SymbolSectionEndAddress)
       return SymbolEndAddress;
 
@@ -977,19 +1228,21 @@ void RewriteInstance::discoverFileObjects() {
 
   const auto MarkersBegin = std::next(LastSymbol);
   for (auto ISym = SortedFileSymbols.begin(); ISym != MarkersBegin; ++ISym) {
-    const auto &Symbol = *ISym;
+    const auto &Info = **ISym;
+    const auto &Symbol = Info.Symbol;
     // Keep undefined symbols for pretty printing?
-    if (Symbol.getFlags() & SymbolRef::SF_Undefined)
+    if (Info.Flags & SymbolRef::SF_Undefined)
       continue;
 
-    const auto SymbolType = cantFail(Symbol.getType());
+    const auto SymbolType = Info.Type;
 
     if (SymbolType == SymbolRef::ST_File)
       continue;
 
-    StringRef SymName = cantFail(Symbol.getName(), "cannot get symbol name");
-    uint64_t Address =
-        cantFail(Symbol.getAddress(), "cannot get symbol address");
+    StringRef SymName = Info.HasName ? Info.Name
+                                     : cantFail(Symbol.getName(),
+                                                "cannot get symbol name");
+    uint64_t Address = Info.Address;
     if (Address == 0) {
       if (opts::Verbosity >= 1 && SymbolType == SymbolRef::ST_Function)
         errs() << "BOLT-WARNING: function with 0 address seen\n";
@@ -1025,7 +1278,7 @@ void RewriteInstance::discoverFileObjects() {
         continue;
       }
       UniqueName = "ANONYMOUS." + std::to_string(AnonymousId++);
-    } else if (Symbol.getFlags() & SymbolRef::SF_Global) {
+    } else if (Info.Flags & SymbolRef::SF_Global) {
       assert(!BC->getBinaryDataByName(Name) && "global name not unique");
       UniqueName = Name;
     } else {
@@ -1052,11 +1305,11 @@ void RewriteInstance::discoverFileObjects() {
         AlternativeName = NR.uniquify(AltPrefix);
     }
 
-    uint64_t SymbolSize = ELFSymbolRef(Symbol).getSize();
+    uint64_t SymbolSize = Info.Size;
     uint64_t TentativeSize = SymbolSize ? SymbolSize
                                         : getNextAddress(ISym) - Address;
     uint64_t SymbolAlignment = Symbol.getAlignment();
-    unsigned SymbolFlags = Symbol.getFlags();
+    unsigned SymbolFlags = Info.Flags;
 
     auto registerName = [&](uint64_t FinalSize) {
       // Register names even if it's not a function, e.g. for an entry point.
@@ -1067,9 +1320,7 @@ void RewriteInstance::discoverFileObjects() {
                                   SymbolAlignment, SymbolFlags);
     };
 
-    section_iterator Section =
-        cantFail(Symbol.getSection(), "cannot get symbol section");
-    if (Section == InputFile->section_end()) {
+    if (!Info.HasSection) {
       // Could be an absolute symbol. Could record for pretty printing.
       DEBUG(if (opts::Verbosity > 1) {
           dbgs() << "BOLT-INFO: absolute sym " << UniqueName << "\n";
@@ -1081,7 +1332,7 @@ void RewriteInstance::discoverFileObjects() {
     DEBUG(dbgs() << "BOLT-DEBUG: considering symbol " << UniqueName
                  << " for function\n");
 
-    if (!Section->isText()) {
+    if (!Info.Section.isText()) {
       assert(SymbolType != SymbolRef::ST_Function &&
              "unexpected function inside non-code section");
       DEBUG(dbgs() << "BOLT-DEBUG: rejecting as symbol is not in code\n");
@@ -1270,12 +1521,14 @@ void RewriteInstance::discoverFileObjects() {
   // Now that all the functions were created - adjust their boundaries.
   adjustFunctionBoundaries();
 
+  // The set of functions is final, index them for address lookups.
+  BC->buildFunctionIndex();
+
   // Annotate functions with code/data markers in AArch64
   for (auto ISym = MarkersBegin; ISym != SortedFileSymbols.end(); ++ISym) {
-    const auto &Symbol = *ISym;
-    uint64_t Address =
-        cantFail(Symbol.getAddress(), "cannot get symbol address");
-    auto SymbolSize = ELFSymbolRef(Symbol).getSize();
+    const auto &Symbol = (*ISym)->Symbol;
+    uint64_t Address = (*ISym)->Address;
+    auto SymbolSize = (*ISym)->Size;
     auto *BF = BC->getBinaryFunctionContainingAddress(Address, true, true);
     if (!BF) {
       // Stray marker
@@ -1303,6 +1556,21 @@ void RewriteInstance::discoverFileObjects() {
   }
 }
 
+namespace {
+
+/// Return the GOT slot address of the "jmp *disp32(%rip)" that starts a
+/// regular x86-64 PLT entry at \p Address, optionally with a BND prefix.
+Optional<uint64_t> decodeX86PLTJump(ArrayRef<uint8_t> Data, uint64_t Address) {
+  const size_t Prefix = !Data.empty() && Data[0] == 0xf2 ? 1 : 0;
+  if (Data.size() < Prefix + 6 || Data[Prefix] != 0xff ||
+      Data[Prefix + 1] != 0x25)
+    return NoneType();
+  const int32_t Disp = support::endian::read32le(Data.data() + Prefix + 2);
+  return Address + Prefix + 6 + Disp;
+}
+
+} // anonymous namespace
+
 void RewriteInstance::disassemblePLT() {
   // Used to analyze both the .plt section (most common) and the less common
   // .plt.got created by the BFD linker.
@@ -1318,7 +1586,10 @@ void RewriteInstance::disassemblePLT() {
 
     // Runtime linker will put a value of an external symbol at the location
     // referenced by the relocation. Map the address to the name of the symbol.
+    // The map is built once for all entries, sized for one Elf64_Rela per
+    // entry.
     std::unordered_map<uint64_t, StringRef> RelAddrToNameMap;
+    RelAddrToNameMap.reserve(RelocsSection.getSize() / (3 * PtrSize));
     for (const auto &Rel : RelocsSection.getSectionRef().relocations()) {
       if (Rel.getType() != RelocType)
         continue;
@@ -1328,42 +1599,56 @@ void RewriteInstance::disassemblePLT() {
       RelAddrToNameMap[Rel.getOffset()] = cantFail((*SymbolIter).getName());
     }
 
+    // PLT entries form a table with a fixed stride. Regular x86-64 entries
+    // start with an indirect jump through their GOT slot that is decoded
+    // directly, and anything else goes through the disassembler.
+    std::string Name;
     for (uint64_t Offset = 0; Offset < Section.getSize(); Offset += EntrySize) {
-      uint64_t InstrSize;
-      MCInst Instruction;
       const uint64_t InstrAddr = PLTAddress + Offset;
-      if (!BC->DisAsm->getInstruction(Instruction, InstrSize,
-                                      PLTData.slice(Offset), InstrAddr, nulls(),
-                                      nulls())) {
-        errs() << "BOLT-ERROR: unable to disassemble instruction in PLT "
-                  "section "
-               << Section.getName() << " at offset 0x"
-               << Twine::utohexstr(Offset) << '\n';
-        exit(1);
-      }
+      uint64_t TargetAddress;
+      auto DirectTarget =
+          BC->isX86() ? decodeX86PLTJump(PLTData.slice(Offset), InstrAddr)
+                      : Optional<uint64_t>();
+      if (DirectTarget) {
+        TargetAddress = *DirectTarget;
+      } else {
+        uint64_t InstrSize;
+        MCInst Instruction;
+        if (!BC->DisAsm->getInstruction(Instruction, InstrSize,
+                                        PLTData.slice(Offset), InstrAddr,
+                                        nulls(), nulls())) {
+          errs() << "BOLT-ERROR: unable to disassemble instruction in PLT "
+                    "section "
+                 << Section.getName() << " at offset 0x"
+                 << Twine::utohexstr(Offset) << '\n';
+          exit(1);
+        }
 
-      if (!BC->MIB->isIndirectBranch(Instruction))
-        continue;
+        if (!BC->MIB->isIndirectBranch(Instruction))
+          continue;
 
-      uint64_t TargetAddress;
-      if (!BC->MIB->evaluateMemOperandTarget(Instruction, TargetAddress,
-                                             InstrAddr, InstrSize)) {
-        errs() << "BOLT-ERROR: error evaluating PLT instruction at offset 0x"
-               << Twine::utohexstr(InstrAddr) << '\n';
-        exit(1);
+        if (!BC->MIB->evaluateMemOperandTarget(Instruction, TargetAddress,
+                                               InstrAddr, InstrSize)) {
+          errs() << "BOLT-ERROR: error evaluating PLT instruction at offset 0x"
+                 << Twine::utohexstr(InstrAddr) << '\n';
+          exit(1);
+        }
       }
 
       auto NI = RelAddrToNameMap.find(TargetAddress);
       if (NI == RelAddrToNameMap.end())
         continue;
 
-      StringRef SymbolName = NI->second;
-      auto *BF = BC->createBinaryFunction(SymbolName.str() + "@PLT", Section,
-                                          InstrAddr, 0, EntrySize,
-                                          PLTAlignment);
+      // Reuse one buffer for the names of all entries.
+      Name.assign(NI->second.data(), NI->second.size());
+      const auto NameSize = Name.size();
+      Name += "@PLT";
+      auto *BF = BC->createBinaryFunction(Name, Section, InstrAddr, 0,
+                                          EntrySize, PLTAlignment);
+      Name.resize(NameSize);
+      Name += "@GOT";
       MCSymbol *TargetSymbol =
-          BC->registerNameAtAddress(SymbolName.str() + "@GOT",
-                                    TargetAddress, PtrSize, PLTAlignment);
+          BC->registerNameAtAddress(Name, TargetAddress, PtrSize, PLTAlignment);
       BF->setPLTSymbol(TargetSymbol);
     }
   };
@@ -1540,6 +1825,7 @@ uint64_t RewriteInstance::getLSDAAddress() {
 void RewriteInstance::readSpecialSections() {
   NamedRegionTimer T("readSpecialSections", "read special sections",
                      TimerGroupName, TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "readSpecialSections");
 
   bool HasTextRelocations = false;
   bool HasDebugInfo = false;
@@ -1581,8 +1867,9 @@ void RewriteInstance::readSpecialSections() {
 
   if (auto BATSec =
           BC->getUniqueSectionByName(BoltAddressTranslation::SECTION_NAME)) {
-    // Do not read BAT when plotting a heatmap
-    if (!opts::HeatmapMode) {
+    // Do not read BAT when plotting a heatmap, unless samples are translated
+    // to input addresses.
+    if (!opts::HeatmapMode || opts::HeatmapUseBAT) {
       if (std::error_code EC = BAT->parse(BATSec->getContents())) {
         errs() << "BOLT-ERROR: failed to parse BOLT address translation "
           "table.\n";
@@ -1719,6 +2006,21 @@ void RewriteInstance::adjustCommandLineOptions() {
     opts::HotTextMoveSections.addValue(".never_hugify");
   }
 
+  if (opts::LKHotText) {
+    if (!opts::LinuxKernelMode) {
+      errs() << "BOLT-WARNING: -lk-hot-text ignored for a non-kernel binary\n";
+      opts::LKHotText = false;
+    } else if (!BC->HasRelocations) {
+      errs() << "BOLT-ERROR: -lk-hot-text requires relocations, link vmlinux "
+                "with --emit-relocs\n";
+      exit(1);
+    } else {
+      // The kernel only maps the original text, starting at a 2MB boundary.
+      opts::HotText = true;
+      opts::UseOldText = true;
+    }
+  }
+
   if (opts::UseOldText && !BC->OldTextSectionAddress) {
     errs() << "BOLT-WARNING: cannot use old .text as the section was not found"
               "\n";
@@ -1729,6 +2031,28 @@ void RewriteInstance::adjustCommandLineOptions() {
     opts::UseOldText = false;
   }
 
+  if (opts::ColdSegment && !BC->HasRelocations) {
+    errs() << "BOLT-WARNING: -cold-segment is disabled in non-relocation "
+              "mode\n";
+    opts::ColdSegment = false;
+  }
+  if (opts::ColdSegment && opts::UseGnuStack) {
+    errs() << "BOLT-ERROR: -cold-segment needs new program headers and cannot "
+              "be used with -use-gnu-stack\n";
+    exit(1);
+  }
+
+  if (opts::NumShards > 1) {
+    if (opts::Shard >= opts::NumShards) {
+      errs() << "BOLT-ERROR: -shard=" << opts::Shard << " is out of range for "
+             << "-num-shards=" << opts::NumShards << '\n';
+      exit(1);
+    }
+    if (!LayoutPlan::isWritten()) {
+      errs() << "BOLT-ERROR: -num-shards requires -write-layout-plan\n";
+      exit(1);
+    }
+  }
 
   if (!opts::AlignText.getNumOccurrences()) {
     opts::AlignText = BC->PageAlign;
@@ -1932,14 +2256,70 @@ void RewriteInstance::processRelocations() {
       readRelocations(Section);
     }
   }
+
+  for (auto &BFI : BC->getBinaryFunctions())
+    BFI.second.sortRelocations();
 }
 
-void RewriteInstance::insertLKMarker(uint64_t PC, uint64_t SectionOffset,
-                                     int32_t PCRelativeOffset,
-                                     bool IsPCRelative, StringRef SectionName) {
-  BC->LKMarkers[PC].emplace_back(
-      LKInstructionMarkerInfo{SectionOffset, PCRelativeOffset, IsPCRelative,
-                              SectionName});
+void RewriteInstance::insertLKMarkers(StringRef SectionName,
+                                      uint64_t EntrySize, uint64_t FieldOffset,
+                                      bool MustBeInFunction,
+                                      std::unordered_set<uint64_t> *Sites) {
+  auto SectionOrError = BC->getUniqueSectionByName(SectionName);
+  if (!SectionOrError)
+    return;
+
+  const uint64_t SectionSize = SectionOrError->getSize();
+  const uint64_t SectionAddress = SectionOrError->getAddress();
+  const uint64_t NumEntries = SectionSize / EntrySize;
+
+  // Tables of large kernels have hundreds of thousands of entries. They are
+  // decoded in parallel into markers of contiguous chunks, which are merged
+  // in the section order.
+  using MarkerVectorTy =
+      std::vector<std::pair<uint64_t, LKInstructionMarkerInfo>>;
+  constexpr uint64_t EntryChunkSize = 16384;
+  std::vector<MarkerVectorTy> ChunkMarkers(
+      std::max<uint64_t>(1, (NumEntries + EntryChunkSize - 1) /
+                                EntryChunkSize));
+  auto decodeChunk = [&](uint64_t Chunk) {
+    auto &Markers = ChunkMarkers[Chunk];
+    const uint64_t End = std::min(NumEntries, (Chunk + 1) * EntryChunkSize);
+    for (uint64_t Entry = Chunk * EntryChunkSize; Entry < End; ++Entry) {
+      const uint64_t I = Entry * EntrySize + FieldOffset;
+      const uint64_t EntryAddress = SectionAddress + I;
+      auto Offset = BC->getSignedValueAtAddress(EntryAddress, 4);
+      assert(Offset && "failed reading PC-relative offset for LKMarker");
+      const int32_t SignedOffset = *Offset;
+      const uint64_t RefAddress = EntryAddress + SignedOffset;
+
+      if (!BC->getBinaryFunctionContainingAddress(RefAddress)) {
+        assert(!MustBeInFunction && "entries should point to a function");
+        continue;
+      }
+
+      Markers.emplace_back(RefAddress,
+                           LKInstructionMarkerInfo{I, SignedOffset, true,
+                                                   SectionName});
+    }
+  };
+  if (opts::NoThreads || ChunkMarkers.size() == 1) {
+    for (uint64_t Chunk = 0; Chunk < ChunkMarkers.size(); ++Chunk)
+      decodeChunk(Chunk);
+  } else {
+    auto &Pool = ParallelUtilities::getThreadPool();
+    for (uint64_t Chunk = 0; Chunk < ChunkMarkers.size(); ++Chunk)
+      Pool.async(decodeChunk, Chunk);
+    Pool.wait();
+  }
+
+  for (auto &Markers : ChunkMarkers) {
+    for (auto &Marker : Markers) {
+      if (Sites)
+        Sites->insert(Marker.first);
+      BC->LKMarkers[Marker.first].emplace_back(std::move(Marker.second));
+    }
+  }
 }
 
 void RewriteInstance::processLKSections() {
@@ -1953,6 +2333,8 @@ void RewriteInstance::processLKSections() {
   processLKKSymtab(true);
   processLKBugTable();
   processLKSMPLocks();
+  processLKStaticKeys();
+  processLKAltInstructions();
 }
 
 /// Process __ex_table section of Linux Kernel.
@@ -1977,6 +2359,7 @@ void RewriteInstance::processLKExTable() {
   const uint64_t SectionAddress = SectionOrError->getAddress();
   assert((SectionSize % 12) == 0 &&
          "The size of the __ex_table section should be a multiple of 12");
+  insertLKMarkers("__ex_table", 12, 0);
   for (uint64_t I = 0; I < SectionSize; I += 4) {
     const uint64_t EntryAddress = SectionAddress + I;
     auto Offset = BC->getSignedValueAtAddress(EntryAddress, 4);
@@ -1995,8 +2378,7 @@ void RewriteInstance::processLKExTable() {
       llvm_unreachable("bad alignment of __ex_table");
       break;
     case 0:
-      // insn
-      insertLKMarker(RefAddress, I, SignedOffset, true, "__ex_table");
+      // insn, marked by insertLKMarkers() above
       break;
     case 4:
       // fixup
@@ -2088,22 +2470,9 @@ void RewriteInstance::processLKBugTable() {
   if (!SectionOrError)
     return;
 
-  const uint64_t SectionSize = SectionOrError->getSize();
-  const uint64_t SectionAddress = SectionOrError->getAddress();
-  assert((SectionSize % 12) == 0 &&
+  assert((SectionOrError->getSize() % 12) == 0 &&
          "The size of the __bug_table section should be a multiple of 12");
-  for (uint64_t I = 0; I < SectionSize; I += 12) {
-    const uint64_t EntryAddress = SectionAddress + I;
-    auto Offset = BC->getSignedValueAtAddress(EntryAddress, 4);
-    assert(Offset &&
-           "Reading valid PC-relative offset for a __bug_table entry");
-    const int32_t SignedOffset = *Offset;
-    const uint64_t RefAddress = EntryAddress + SignedOffset;
-    auto *ContainingBF = BC->getBinaryFunctionContainingAddress(RefAddress);
-    assert(ContainingBF && "__bug_table entries should point to a function");
-
-    insertLKMarker(RefAddress, I, SignedOffset, true, "__bug_table");
-  }
+  insertLKMarkers("__bug_table", 12, 0, /*MustBeInFunction=*/true);
 }
 
 
@@ -2114,24 +2483,60 @@ void RewriteInstance::processLKSMPLocks() {
   if (!SectionOrError)
     return;
 
-  uint64_t SectionSize = SectionOrError->getSize();
-  const uint64_t SectionAddress = SectionOrError->getAddress();
-  assert((SectionSize % 4) == 0 &&
+  assert((SectionOrError->getSize() % 4) == 0 &&
          "The size of the .smp_locks section should be a multiple of 4");
+  insertLKMarkers(".smp_locks", 4, 0);
+}
 
-  for (uint64_t I = 0; I < SectionSize; I += 4) {
-    const uint64_t EntryAddress = SectionAddress + I;
-    auto Offset = BC->getSignedValueAtAddress(EntryAddress, 4);
-    assert(Offset && "Reading valid PC-relative offset for a .smp_locks entry");
-    int32_t SignedOffset = *Offset;
-    uint64_t RefAddress = EntryAddress + SignedOffset;
+/// __jump_table section contains static key entries. The kernel patches the
+/// instruction at every code location between a NOP and a jump to the target
+/// when the key changes. Since v4.15 the entries are defined in
+/// arch/x86/include/asm/jump_label.h as:
+///
+///   struct jump_entry {
+///     s32 code;
+///     s32 target;
+///     long key;
+///   };
+///
+void RewriteInstance::processLKStaticKeys() {
+  auto SectionOrError = BC->getUniqueSectionByName("__jump_table");
+  if (!SectionOrError)
+    return;
 
-    auto *ContainingBF = BC->getBinaryFunctionContainingAddress(RefAddress);
-    if (!ContainingBF)
-      continue;
+  if (SectionOrError->getSize() % 16) {
+    errs() << "BOLT-WARNING: unexpected size of __jump_table section, static "
+              "keys are not supported\n";
+    return;
+  }
+  insertLKMarkers("__jump_table", 16, 0, false, &BC->LKPatchSites);
+  insertLKMarkers("__jump_table", 16, 4);
+}
+
+/// .altinstructions section lists instructions that are replaced at boot
+/// time depending on the CPU features. The entries start with
+///
+///   struct alt_instr {
+///     s32 instr_offset;
+///     s32 repl_offset;
+///     ...
+///   };
+///
+/// and their size depends on the kernel version. Replacements are located in
+/// .altinstr_replacement.
+void RewriteInstance::processLKAltInstructions() {
+  auto SectionOrError = BC->getUniqueSectionByName(".altinstructions");
+  if (!SectionOrError)
+    return;
 
-    insertLKMarker(RefAddress, I, SignedOffset, true, ".smp_locks");
+  if (SectionOrError->getSize() % opts::LKAltInstrEntrySize) {
+    errs() << "BOLT-WARNING: size of .altinstructions section is not a "
+              "multiple of " << opts::LKAltInstrEntrySize
+           << ", use -lk-altinstr-entry-size to match the kernel version\n";
+    return;
   }
+  insertLKMarkers(".altinstructions", opts::LKAltInstrEntrySize, 0, false,
+                  &BC->LKPatchSites);
 }
 
 void RewriteInstance::readDynamicRelocations(const SectionRef &Section) {
@@ -2393,8 +2798,7 @@ void RewriteInstance::readRelocations(const SectionRef &Section) {
         // Do an extra check that the function was referenced previously.
         // It's a linear search, but it should rarely happen.
         bool Found{false};
-        for (const auto &RelKV : ContainingBF->Relocations) {
-          const auto &Rel = RelKV.second;
+        for (const auto &Rel : ContainingBF->Relocations) {
           if (Rel.Symbol == RogueBF->getSymbol() &&
               !Relocation::isPCRelative(Rel.Type)) {
             Found = true;
@@ -2620,6 +3024,43 @@ void RewriteInstance::selectFunctionsToProcess() {
     outs() << "BOLT-INFO: limiting processing to functions with at least "
            << LiteThresholdExecCount << " invocations\n";
   }
+  if (ProfileReader && opts::LiteCoveragePct > 0 &&
+      opts::LiteCoveragePct < 100) {
+    std::vector<uint64_t> ExecCounts;
+    uint64_t TotalExecCount = 0;
+    for (auto &BFI : BC->getBinaryFunctions()) {
+      const BinaryFunction &Function = BFI.second;
+      if (!ProfileReader->mayHaveProfileData(Function))
+        continue;
+      const auto ExecCount = Function.getKnownExecutionCount();
+      if (!ExecCount)
+        continue;
+      ExecCounts.push_back(ExecCount);
+      TotalExecCount += ExecCount;
+    }
+    std::sort(ExecCounts.begin(), ExecCounts.end(),
+              std::greater<uint64_t>());
+
+    // Find the execution count of the coldest function required to reach the
+    // coverage. Functions with the same count are all processed.
+    const auto TargetExecCount =
+        static_cast<uint64_t>(TotalExecCount * opts::LiteCoveragePct / 100);
+    uint64_t CoveredExecCount = 0;
+    uint64_t CoverageExecCount = 0;
+    for (const auto ExecCount : ExecCounts) {
+      CoveredExecCount += ExecCount;
+      CoverageExecCount = ExecCount;
+      if (CoveredExecCount >= TargetExecCount)
+        break;
+    }
+    if (CoverageExecCount) {
+      outs() << "BOLT-INFO: limiting processing to functions with at least "
+             << CoverageExecCount << " invocations to cover "
+             << opts::LiteCoveragePct << "% of the profile\n";
+    }
+    LiteThresholdExecCount = std::max(LiteThresholdExecCount,
+                                      CoverageExecCount);
+  }
   LiteThresholdExecCount =
       std::max(LiteThresholdExecCount,
                static_cast<uint64_t>(opts::LiteThresholdCount));
@@ -2657,6 +3098,7 @@ void RewriteInstance::selectFunctionsToProcess() {
     return true;
   };
 
+  uint64_t ShardOrdinal = 0;
   for (auto &BFI : BC->getBinaryFunctions()) {
     auto &Function = BFI.second;
 
@@ -2667,6 +3109,14 @@ void RewriteInstance::selectFunctionsToProcess() {
       continue;
     }
 
+    // Functions are assigned to shards round-robin in the order of their
+    // addresses, which spreads the hot functions of a module over shards.
+    if (opts::NumShards > 1 &&
+        ShardOrdinal++ % opts::NumShards != opts::Shard) {
+      Function.setIgnored();
+      continue;
+    }
+
     if (!shouldProcess(Function)) {
       DEBUG(dbgs() << "BOLT-INFO: skipping processing of function " << Function
                    << " per user request\n");
@@ -2683,18 +3133,30 @@ void RewriteInstance::selectFunctionsToProcess() {
 void RewriteInstance::readDebugInfo() {
   NamedRegionTimer T("readDebugInfo", "read debug info", TimerGroupName,
                      TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "readDebugInfo");
   if (!opts::UpdateDebugSections)
     return;
 
   BC->preprocessDebugInfo();
 }
 
+void RewriteInstance::readLineTables() {
+  NamedRegionTimer T("readLineTables", "read line tables", TimerGroupName,
+                     TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "readLineTables");
+  if (!opts::UpdateDebugSections)
+    return;
+
+  BC->parseLineTables();
+}
+
 void RewriteInstance::preprocessProfileData() {
   if (!ProfileReader)
     return;
 
   NamedRegionTimer T("preprocessprofile", "pre-process profile data",
                      TimerGroupName, TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "preprocessProfileData");
 
   outs() << "BOLT-INFO: pre-processing profile using "
          << ProfileReader->getReaderName() << '\n';
@@ -2726,6 +3188,7 @@ void RewriteInstance::processProfileDataPreCFG() {
 
   NamedRegionTimer T("processprofile-precfg", "process profile data pre-CFG",
                      TimerGroupName, TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "processProfileDataPreCFG");
 
   if (auto E = ProfileReader->readProfilePreCFG(*BC.get()))
     report_error("cannot read profile pre-CFG", std::move(E));
@@ -2737,6 +3200,7 @@ void RewriteInstance::processProfileData() {
 
   NamedRegionTimer T("processprofile", "process profile data", TimerGroupName,
                      TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "processProfileData");
 
   if (auto E = ProfileReader->readProfile(*BC.get()))
     report_error("cannot read profile", std::move(E));
@@ -2750,6 +3214,12 @@ void RewriteInstance::processProfileData() {
   ProfileReader.reset();
 
   if (opts::AggregateOnly) {
+    // Passes are not run by perf2bolt, report the quality of the profile
+    // attached to the CFGs here.
+    if (opts::PrintProfileStats) {
+      PrintProfileStats PPS(opts::NeverPrint);
+      PPS.runOnFunctions(*BC);
+    }
     exit(0);
   }
 }
@@ -2757,8 +3227,99 @@ void RewriteInstance::processProfileData() {
 void RewriteInstance::disassembleFunctions() {
   NamedRegionTimer T("disassembleFunctions", "disassemble functions",
                      TimerGroupName, TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "disassembleFunctions");
+
+  // Decoding of instructions is the expensive part of disassembly and of
+  // reference scanning that does not depend on other functions. Functions
+  // are decoded in parallel batches one batch ahead of the serial loop below,
+  // which keeps the memory taken by decoded instructions bounded while
+  // disassembly results remain deterministic.
+  // Function contents are captured upfront, since disassembly of a function
+  // may adjust the maximum size of another one.
+  // With -disassembly-cache, decoded instructions are reused from earlier
+  // runs on the binary with the same build-id.
+  DisassemblyCache Cache;
+  const auto BuildID = BC->getFileBuildID();
+  const bool UseCache = !opts::DisassemblyCacheFile.empty() && BuildID;
+  if (!opts::DisassemblyCacheFile.empty() && !BuildID) {
+    errs() << "BOLT-WARNING: cannot use disassembly cache for a binary "
+              "without build-id\n";
+  }
+  if (UseCache)
+    Cache.load(opts::DisassemblyCacheFile, *BuildID);
+  std::atomic<uint64_t> NumCachedFunctions{0};
+
+  std::vector<std::pair<BinaryFunction *, ArrayRef<uint8_t>>>
+      FunctionsToDecode;
+  if (!opts::NoThreads || UseCache) {
+    for (auto &BFI : BC->getBinaryFunctions()) {
+      BinaryFunction &Function = BFI.second;
+      // Unprocessed functions are only scanned for references, but the scan
+      // takes the same decoding effort.
+      if (!Function.getSize() || Function.isPseudo() ||
+          (!shouldDisassemble(Function) && opts::NoScan))
+        continue;
+      if (auto FunctionData = Function.getData())
+        FunctionsToDecode.emplace_back(&Function, *FunctionData);
+    }
+  }
+  const unsigned NumDecoders =
+      opts::NoThreads ? 1 : std::max(1u, (unsigned)opts::ThreadCount);
+  std::vector<std::unique_ptr<MCDisassembler>> Decoders;
+  if (!FunctionsToDecode.empty()) {
+    for (unsigned I = 0; I < NumDecoders; ++I)
+      Decoders.emplace_back(
+          BC->TheTarget->createMCDisassembler(*BC->STI, *BC->Ctx));
+  }
+  // Functions before DecodedEnd are decoded, and those in
+  // [DecodedEnd, DecodingEnd) are being decoded.
+  size_t DecodedEnd = 0;
+  size_t DecodingEnd = 0;
+  size_t NextFunctionToDecode = 0;
+  auto decodeNextBatch = [&]() {
+    constexpr uint64_t BatchSize = 2 * 1024 * 1024;
+    const auto Begin = DecodingEnd;
+    uint64_t Size = 0;
+    while (DecodingEnd < FunctionsToDecode.size() && Size < BatchSize)
+      Size += FunctionsToDecode[DecodingEnd++].first->getSize();
+    auto decode = [&, Begin](unsigned I) {
+      for (auto J = Begin + I; J < DecodingEnd; J += NumDecoders) {
+        auto &Function = *FunctionsToDecode[J].first;
+        const auto FunctionData = FunctionsToDecode[J].second;
+        if (UseCache && Cache.lookup(Function, FunctionData)) {
+          ++NumCachedFunctions;
+          continue;
+        }
+        Function.predecodeInstructions(*Decoders[I], FunctionData);
+        if (UseCache)
+          Cache.record(Function, FunctionData);
+      }
+    };
+    if (opts::NoThreads) {
+      decode(0);
+      return;
+    }
+    ThreadPool &Pool = ParallelUtilities::getThreadPool();
+    for (unsigned I = 0; I < NumDecoders; ++I)
+      Pool.async(decode, I);
+  };
+  if (!FunctionsToDecode.empty())
+    decodeNextBatch();
+
+  ProgressTask PT("disassemble", BC->getBinaryFunctions().size());
   for (auto &BFI : BC->getBinaryFunctions()) {
     BinaryFunction &Function = BFI.second;
+    Progress::advance();
+
+    if (NextFunctionToDecode < FunctionsToDecode.size() &&
+        FunctionsToDecode[NextFunctionToDecode].first == &Function) {
+      if (NextFunctionToDecode++ == DecodedEnd) {
+        if (!opts::NoThreads)
+          ParallelUtilities::getThreadPool().wait();
+        DecodedEnd = DecodingEnd;
+        decodeNextBatch();
+      }
+    }
 
     auto FunctionData = Function.getData();
     if (!FunctionData) {
@@ -2806,6 +3367,15 @@ void RewriteInstance::disassembleFunctions() {
 
     BC->processInterproceduralReferences(Function);
   }
+  if (!FunctionsToDecode.empty() && !opts::NoThreads)
+    ParallelUtilities::getThreadPool().wait();
+
+  if (UseCache) {
+    outs() << "BOLT-INFO: reused cached instructions of "
+           << NumCachedFunctions.load() << " out of "
+           << FunctionsToDecode.size() << " functions\n";
+    Cache.save(opts::DisassemblyCacheFile, *BuildID);
+  }
 
   BC->populateJumpTables();
 
@@ -2821,6 +3391,25 @@ void RewriteInstance::disassembleFunctions() {
 
   BC->adjustCodePadding();
 
+  // Decoding FDEs only touches the function being filled, hence CFI for all
+  // functions is filled in parallel. Failures are handled in the function
+  // order below.
+  std::mutex CFIFailuresMutex;
+  std::unordered_set<const BinaryFunction *> CFIFailures;
+  ParallelUtilities::WorkFuncTy FillCFI = [&](BinaryFunction &Function) {
+    if (CFIRdWrt->fillCFIInfoFor(Function))
+      return;
+    std::lock_guard<std::mutex> Lock(CFIFailuresMutex);
+    CFIFailures.insert(&Function);
+  };
+  ParallelUtilities::PredicateTy SkipCFI = [](const BinaryFunction &BF) {
+    return !shouldDisassemble(BF) || !BF.isSimple() || BF.trapsOnEntry();
+  };
+  ParallelUtilities::runOnEachFunction(
+      *BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, FillCFI,
+      SkipCFI, "fillCFIInfo",
+      /*ForceSequential*/ opts::SequentialDisassembly);
+
   for (auto &BFI : BC->getBinaryFunctions()) {
     BinaryFunction &Function = BFI.second;
 
@@ -2833,9 +3422,9 @@ void RewriteInstance::disassembleFunctions() {
       continue;
     }
 
-    // Fill in CFI information for this function
+    // Check CFI information filled for this function.
     if (!Function.trapsOnEntry()) {
-      if (!CFIRdWrt->fillCFIInfoFor(Function)) {
+      if (CFIFailures.count(&Function)) {
         if (BC->HasRelocations) {
           BC->exitWithBugReport("unable to fill CFI.", Function);
         } else {
@@ -2856,10 +3445,7 @@ void RewriteInstance::disassembleFunctions() {
 void RewriteInstance::buildFunctionsCFG() {
   NamedRegionTimer T("buildCFG", "buildCFG", "buildfuncs",
                      "Build Binary Functions", opts::TimeBuild);
-
-  // Create annotation indices to allow lock-free execution
-  BC->MIB->getOrCreateAnnotationIndex("Offset");
-  BC->MIB->getOrCreateAnnotationIndex("JTIndexReg");
+  TelemetryScope TS("rewrite", "buildFunctionsCFG");
 
   ParallelUtilities::WorkFuncWithAllocTy WorkFun =
       [&](BinaryFunction &BF, MCPlusBuilder::AllocatorIdTy AllocId) {
@@ -2884,16 +3470,29 @@ void RewriteInstance::buildFunctionsCFG() {
 }
 
 void RewriteInstance::postProcessFunctions() {
+  TelemetryScope TS("rewrite", "postProcessFunctions");
   BC->TotalScore = 0;
   BC->SumExecutionCount = 0;
+
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
+    BF.postProcessCFG();
+  };
+
+  ParallelUtilities::PredicateTy SkipPredicate =
+      [&](const BinaryFunction &BF) { return BF.empty(); };
+
+  ParallelUtilities::runOnEachFunction(
+      *BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR, WorkFun,
+      SkipPredicate, "postProcessFunctions",
+      /*ForceSequential*/ opts::SequentialDisassembly);
+
+  // Printing and statistics follow the order of functions.
   for (auto &BFI : BC->getBinaryFunctions()) {
     BinaryFunction &Function = BFI.second;
 
     if (Function.empty())
       continue;
 
-    Function.postProcessCFG();
-
     if (opts::PrintAll || opts::PrintCFG)
       Function.print(outs(), "after building cfg", true);
 
@@ -2918,6 +3517,7 @@ void RewriteInstance::postProcessFunctions() {
 void RewriteInstance::runOptimizationPasses() {
   NamedRegionTimer T("runOptimizationPasses", "run optimization passes",
                      TimerGroupName, TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "runOptimizationPasses");
   BinaryFunctionPassManager::runAllPasses(*BC);
 }
 
@@ -2935,18 +3535,27 @@ std::vector<T> singletonSet(T t) {
 void RewriteInstance::emitAndLink() {
   NamedRegionTimer T("emitAndLink", "emit and link", TimerGroupName,
                      TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "emitAndLink");
   std::error_code EC;
 
-  // This is an object file, which we keep for debugging purposes.
-  // Once we decide it's useless, we should create it in memory.
-  std::unique_ptr<ToolOutputFile> TempOut =
-    llvm::make_unique<ToolOutputFile>(opts::OutputFilename + ".bolt.o",
-                                      EC, sys::fs::F_None);
-  check_error(EC, "cannot create output object file");
-
-  std::unique_ptr<buffer_ostream> BOS =
-      make_unique<buffer_ostream>(TempOut->os());
-  raw_pwrite_stream *OS = BOS.get();
+  // The object file is only written to disk for debugging purposes with
+  // -keep-tmp. Otherwise it is encoded straight into memory, saving a copy of
+  // the whole object and the file I/O.
+  std::unique_ptr<ToolOutputFile> TempOut;
+  std::unique_ptr<buffer_ostream> BOS;
+  SmallVector<char, 0> ObjectBuffer;
+  std::unique_ptr<raw_svector_ostream> VecOS;
+  raw_pwrite_stream *OS;
+  if (opts::KeepTmp) {
+    TempOut = llvm::make_unique<ToolOutputFile>(
+        opts::OutputFilename + ".bolt.o", EC, sys::fs::F_None);
+    check_error(EC, "cannot create output object file");
+    BOS = make_unique<buffer_ostream>(TempOut->os());
+    OS = BOS.get();
+  } else {
+    VecOS = make_unique<raw_svector_ostream>(ObjectBuffer);
+    OS = VecOS.get();
+  }
 
   // Implicitly MCObjectStreamer takes ownership of MCAsmBackend (MAB)
   // and MCCodeEmitter (MCE). ~MCObjectStreamer() will delete these
@@ -2987,7 +3596,8 @@ void RewriteInstance::emitAndLink() {
 
   // Get output object as ObjectFile.
   std::unique_ptr<MemoryBuffer> ObjectMemBuffer =
-      MemoryBuffer::getMemBuffer(BOS->str(), "in-memory object file", false);
+      MemoryBuffer::getMemBuffer(BOS ? BOS->str() : VecOS->str(),
+                                 "in-memory object file", false);
   std::unique_ptr<object::ObjectFile> Obj = cantFail(
       object::ObjectFile::createObjectFile(ObjectMemBuffer->getMemBufferRef()),
       "error creating in-memory object");
@@ -3009,6 +3619,12 @@ void RewriteInstance::emitAndLink() {
           }
           return Result;
         }
+        // Bounds of the cold segment for the page-out runtime library.
+        if (Name == "__bolt_cold_segment_start")
+          return JITSymbol(ColdSegmentAddress, JITSymbolFlags());
+        if (Name == "__bolt_cold_segment_end")
+          return JITSymbol(ColdSegmentAddress + ColdSegmentSize,
+                           JITSymbolFlags());
         if (auto *I = BC->getBinaryDataByName(Name)) {
           const uint64_t Address = I->isMoved() && !I->isJumpTable()
                                  ? I->getOutputAddress()
@@ -3090,9 +3706,10 @@ void RewriteInstance::emitAndLink() {
     }
   }
 
-  if (opts::PrintCacheMetrics) {
+  if (opts::PrintCacheMetrics || SpeedupModel::isEnabled()) {
     outs() << "BOLT-INFO: cache metrics after emitting functions:\n";
     CacheMetrics::printAll(BC->getSortedFunctions());
+    SpeedupModel::printEstimate();
   }
 
   if (opts::KeepTmp)
@@ -3100,12 +3717,16 @@ void RewriteInstance::emitAndLink() {
 }
 
 void RewriteInstance::updateMetadata() {
+  TelemetryScope TS("rewrite", "updateMetadata");
   updateSDTMarkers();
   updateLKMarkers();
+  if (opts::LinuxKernelMode)
+    reportLKTextPageCoverage();
 
   if (opts::UpdateDebugSections) {
     NamedRegionTimer T("updateDebugInfo", "update debug info", TimerGroupName,
                        TimerGroupDesc, opts::TimeRewrite);
+    TelemetryScope TS("rewrite", "updateDebugInfo");
     DebugInfoRewriter->updateDebugInfo();
   }
 
@@ -3117,6 +3738,7 @@ void RewriteInstance::updateMetadata() {
 void RewriteInstance::updateSDTMarkers() {
   NamedRegionTimer T("updateSDTMarkers", "update SDT markers", TimerGroupName,
                      TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "updateSDTMarkers");
 
   SectionPatchers[".note.stapsdt"] = llvm::make_unique<SimpleBinaryPatcher>();
   auto *SDTNotePatcher = static_cast<SimpleBinaryPatcher *>(
@@ -3139,27 +3761,55 @@ void RewriteInstance::updateLKMarkers() {
 
   NamedRegionTimer T("updateLKMarkers", "update LK markers", TimerGroupName,
                      TimerGroupDesc, opts::TimeRewrite);
+  TelemetryScope TS("rewrite", "updateLKMarkers");
+
+  // Translate the marked addresses in parallel chunks. Patches are then
+  // applied sequentially.
+  using LKMarkerTy = std::pair<const uint64_t,
+                               std::vector<LKInstructionMarkerInfo>>;
+  std::vector<const LKMarkerTy *> Markers;
+  Markers.reserve(BC->LKMarkers.size());
+  for (const auto &LKMarkerInfoKV : BC->LKMarkers)
+    Markers.push_back(&LKMarkerInfoKV);
+  std::vector<uint64_t> NewAddresses(Markers.size());
+  auto translateChunk = [&](size_t Begin, size_t End) {
+    for (size_t I = Begin; I < End; ++I) {
+      const uint64_t OriginalAddress = Markers[I]->first;
+      const auto *BF =
+          BC->getBinaryFunctionContainingAddress(OriginalAddress, false, true);
+      if (!BF)
+        continue;
 
-  std::unordered_map<std::string, uint64_t> PatchCounts;
-  for (auto &LKMarkerInfoKV : BC->LKMarkers) {
-    const uint64_t OriginalAddress = LKMarkerInfoKV.first;
-    const auto *BF =
-        BC->getBinaryFunctionContainingAddress(OriginalAddress, false, true);
-    if (!BF)
-      continue;
+      uint64_t NewAddress = BF->translateInputToOutputAddress(OriginalAddress);
+      if (NewAddress == 0)
+        continue;
 
-    uint64_t NewAddress = BF->translateInputToOutputAddress(OriginalAddress);
-    if (NewAddress == 0)
-      continue;
+      // Apply base address.
+      if (OriginalAddress >= 0xffffffff00000000 && NewAddress < 0xffffffff)
+        NewAddress = NewAddress + 0xffffffff00000000;
 
-    // Apply base address.
-    if (OriginalAddress >= 0xffffffff00000000 && NewAddress < 0xffffffff)
-      NewAddress = NewAddress + 0xffffffff00000000;
+      NewAddresses[I] = NewAddress;
+    }
+  };
+  constexpr size_t MarkerChunkSize = 16384;
+  if (opts::NoThreads || Markers.size() <= MarkerChunkSize) {
+    translateChunk(0, Markers.size());
+  } else {
+    auto &Pool = ParallelUtilities::getThreadPool();
+    for (size_t Begin = 0; Begin < Markers.size(); Begin += MarkerChunkSize)
+      Pool.async(translateChunk, Begin,
+                 std::min(Begin + MarkerChunkSize, Markers.size()));
+    Pool.wait();
+  }
 
-    if (OriginalAddress == NewAddress)
+  std::unordered_map<std::string, uint64_t> PatchCounts;
+  for (size_t I = 0; I < Markers.size(); ++I) {
+    const uint64_t OriginalAddress = Markers[I]->first;
+    const uint64_t NewAddress = NewAddresses[I];
+    if (NewAddress == 0 || OriginalAddress == NewAddress)
       continue;
 
-    for (auto &LKMarkerInfo : LKMarkerInfoKV.second) {
+    for (auto &LKMarkerInfo : Markers[I]->second) {
       StringRef SectionName = LKMarkerInfo.SectionName;
       SimpleBinaryPatcher *LKPatcher;
       if (SectionPatchers.find(SectionName) != SectionPatchers.end()) {
@@ -3188,32 +3838,96 @@ void RewriteInstance::updateLKMarkers() {
   }
 }
 
+void RewriteInstance::reportLKTextPageCoverage() {
+  // The kernel maps the 2MB pages fully covered by the original text with
+  // PMDs, and the rest with 4KB pages.
+  const uint64_t PageSize = BC->HugePageSize;
+  const uint64_t MappedStart = alignTo(BC->OldTextSectionAddress, PageSize);
+  const uint64_t MappedEnd =
+      alignDown(BC->OldTextSectionAddress + BC->OldTextSectionSize, PageSize);
+
+  struct PageCoverage {
+    std::set<uint64_t> Pages;
+    uint64_t MappedCount{0};
+  } Input, Output;
+  auto addRange = [&](PageCoverage &Coverage, uint64_t Address, uint64_t Size,
+                      uint64_t Count) {
+    for (auto Page = alignDown(Address, PageSize); Page < Address + Size;
+         Page += PageSize)
+      Coverage.Pages.insert(Page);
+    if (Address >= MappedStart && Address + Size <= MappedEnd)
+      Coverage.MappedCount += Count;
+  };
+
+  uint64_t TotalCount{0};
+  for (auto &BFI : BC->getBinaryFunctions()) {
+    const auto &Function = BFI.second;
+    const auto Count = Function.getKnownExecutionCount();
+    if (!Count || Function.isFolded())
+      continue;
+    TotalCount += Count;
+    addRange(Input, Function.getAddress(), Function.getSize(), Count);
+    if (Function.isEmitted())
+      addRange(Output, Function.getOutputAddress(), Function.getOutputSize(),
+               Count);
+    else
+      addRange(Output, Function.getAddress(), Function.getSize(), Count);
+  }
+  if (!TotalCount)
+    return;
+
+  outs() << "BOLT-INFO: kernel text mapped with 2MB pages: 0x"
+         << Twine::utohexstr(MappedStart) << "-0x"
+         << Twine::utohexstr(MappedEnd) << '\n'
+         << "BOLT-INFO: executed kernel functions span "
+         << Input.Pages.size() << " 2MB pages in the input and "
+         << Output.Pages.size() << " in the output\n"
+         << format("BOLT-INFO: executions of kernel functions in 2MB-mapped "
+                   "text: %.2lf%% in the input, %.2lf%% in the output\n",
+                   100.0 * Input.MappedCount / TotalCount,
+                   100.0 * Output.MappedCount / TotalCount);
+  if (!BC->LKPatchSites.empty())
+    outs() << "BOLT-INFO: " << BC->LKPatchSites.size()
+           << " static key and alternative instruction sites are never "
+              "outlined by function splitting\n";
+}
+
 void RewriteInstance::mapFileSections(orc::VModuleKey Key) {
   mapCodeSections(Key);
   mapDataSections(Key);
+  if (opts::ColdSegment)
+    mapColdSections(Key);
+}
+
+bool RewriteInstance::isColdSegmentSection(const BinarySection &Section) const {
+  return Section.getName() == BC->getColdCodeSectionName() ||
+         Section.getName() == ".rodata.cold";
 }
 
 std::vector<BinarySection *>
 RewriteInstance::getCodeSections() {
   std::vector<BinarySection *> CodeSections;
   for (auto &Section : BC->textSections()) {
-    if (Section.hasValidSectionID())
-      CodeSections.emplace_back(&Section);
+    if (!Section.hasValidSectionID())
+      continue;
+    if (opts::ColdSegment && isColdSegmentSection(Section))
+      continue;
+    CodeSections.emplace_back(&Section);
   };
 
+  // Place movers before anything else. Depending on the option, put main
+  // text at the beginning or at the end, with warm text next to it.
+  auto getRank = [&](const BinarySection *Section) {
+    if (Section->getName() == BC->getHotTextMoverSectionName())
+      return 0;
+    if (Section->getName() == BC->getMainCodeSectionName())
+      return opts::HotFunctionsAtEnd ? 3 : 1;
+    if (Section->getName() == BC->getWarmCodeSectionName())
+      return 2;
+    return opts::HotFunctionsAtEnd ? 1 : 3;
+  };
   auto compareSections = [&](const BinarySection *A, const BinarySection *B) {
-    // Place movers before anything else.
-    if (A->getName() == BC->getHotTextMoverSectionName())
-      return true;
-    if (B->getName() == BC->getHotTextMoverSectionName())
-      return false;
-
-    // Depending on the option, put main text at the beginning or at the end.
-    if (opts::HotFunctionsAtEnd) {
-      return B->getName() == BC->getMainCodeSectionName();
-    } else {
-      return A->getName() == BC->getMainCodeSectionName();
-    }
+    return getRank(A) < getRank(B);
   };
 
   // Determine the order of sections.
@@ -3453,24 +4167,47 @@ void RewriteInstance::mapDataSections(orc::VModuleKey Key) {
   if (auto *RtLibrary = BC->getRuntimeLibrary()) {
     RtLibrary->addRuntimeLibSections(Sections);
   }
-  for (auto &SectionName : Sections) {
-    auto Section = BC->getUniqueSectionByName(SectionName);
-    if (!Section || !Section->isAllocatable() || !Section->isFinalized())
-      continue;
+  auto mapSection = [&](BinarySection &Section) {
+    // The hugify runtime remaps the hot data to huge pages, which it should
+    // not share with other sections.
+    const bool IsHotData =
+        opts::Hugify && opts::HotData && Section.isReordered();
     NextAvailableAddress = alignTo(NextAvailableAddress,
-                                   Section->getAlignment());
-    DEBUG(dbgs() << "BOLT: mapping section " << SectionName << " (0x"
-                 << Twine::utohexstr(Section->getAllocAddress())
+                                   IsHotData ? BC->HugePageSize
+                                             : Section.getAlignment());
+    DEBUG(dbgs() << "BOLT: mapping section " << Section.getName() << " (0x"
+                 << Twine::utohexstr(Section.getAllocAddress())
                  << ") to 0x" << Twine::utohexstr(NextAvailableAddress)
                  << ":0x" << Twine::utohexstr(NextAvailableAddress +
-                                              Section->getOutputSize())
+                                              Section.getOutputSize())
                  << '\n');
 
-    OLT->mapSectionAddress(Key, Section->getSectionID(), NextAvailableAddress);
-    Section->setOutputAddress(NextAvailableAddress);
-    Section->setOutputFileOffset(getFileOffsetForAddress(NextAvailableAddress));
+    OLT->mapSectionAddress(Key, Section.getSectionID(), NextAvailableAddress);
+    Section.setOutputAddress(NextAvailableAddress);
+    Section.setOutputFileOffset(getFileOffsetForAddress(NextAvailableAddress));
 
-    NextAvailableAddress += Section->getOutputSize();
+    NextAvailableAddress += Section.getOutputSize();
+    if (IsHotData)
+      NextAvailableAddress = alignTo(NextAvailableAddress, BC->HugePageSize);
+  };
+
+  for (auto &SectionName : Sections) {
+    auto Section = BC->getUniqueSectionByName(SectionName);
+    if (!Section || !Section->isAllocatable() || !Section->isFinalized())
+      continue;
+    if (opts::ColdSegment && isColdSegmentSection(*Section))
+      continue;
+    mapSection(*Section);
+  }
+
+  // Reordered sections other than the ones above would be mapped with the
+  // extra sections, without the alignment for huge pages.
+  if (opts::Hugify && opts::HotData) {
+    for (auto &Section : BC->allocatableSections()) {
+      if (Section.isReordered() && !Section.getOutputAddress() &&
+          Section.hasValidSectionID())
+        mapSection(Section);
+    }
   }
 
   // Handling for sections with relocations.
@@ -3507,6 +4244,41 @@ void RewriteInstance::mapDataSections(orc::VModuleKey Key) {
   }
 }
 
+void RewriteInstance::mapColdSections(orc::VModuleKey Key) {
+  std::vector<BinarySection *> ColdSections;
+  for (const char *Name : {BC->getColdCodeSectionName(), ".rodata.cold"}) {
+    auto Section = BC->getUniqueSectionByName(Name);
+    if (!Section || !Section->isAllocatable() ||
+        !Section->hasValidSectionID() || Section->getOutputAddress())
+      continue;
+    ColdSections.emplace_back(&*Section);
+  }
+  if (ColdSections.empty())
+    return;
+
+  // Start and end on page boundaries, so that the pages of the segment only
+  // hold cold code and data.
+  NextAvailableAddress = alignTo(NextAvailableAddress, BC->PageAlign);
+  ColdSegmentAddress = NextAvailableAddress;
+  for (auto *Section : ColdSections) {
+    NextAvailableAddress =
+        alignTo(NextAvailableAddress, Section->getAlignment());
+    DEBUG(dbgs() << "BOLT: mapping cold section " << Section->getName()
+                 << " at 0x" << Twine::utohexstr(Section->getAllocAddress())
+                 << " to 0x" << Twine::utohexstr(NextAvailableAddress)
+                 << '\n');
+    OLT->mapSectionAddress(Key, Section->getSectionID(), NextAvailableAddress);
+    Section->setOutputAddress(NextAvailableAddress);
+    Section->setOutputFileOffset(getFileOffsetForAddress(NextAvailableAddress));
+    NextAvailableAddress += Section->getOutputSize();
+  }
+  NextAvailableAddress = alignTo(NextAvailableAddress, BC->PageAlign);
+  ColdSegmentSize = NextAvailableAddress - ColdSegmentAddress;
+
+  outs() << "BOLT-INFO: cold segment of " << ColdSegmentSize
+         << " bytes at 0x" << Twine::utohexstr(ColdSegmentAddress) << '\n';
+}
+
 void RewriteInstance::mapExtraSections(orc::VModuleKey Key) {
   for (auto &Section : BC->allocatableSections()) {
     if (Section.getOutputAddress() || !Section.hasValidSectionID())
@@ -3545,13 +4317,24 @@ void RewriteInstance::patchELFPHDRTable() {
 
   // Write/re-write program headers.
   Phnum = Obj->getHeader()->e_phnum;
+  // With -cold-segment, the new segment stops at the cold code and data,
+  // which get a segment of their own. The sections written after them, i.e.
+  // runtime libraries and .eh_frame_hdr, go to a third segment.
+  const uint64_t NewTextSegmentEnd =
+      ColdSegmentSize ? ColdSegmentAddress : NextAvailableAddress;
+  const uint64_t ColdSegmentEnd = ColdSegmentAddress + ColdSegmentSize;
+  const bool HasTailSegment =
+      ColdSegmentSize && NextAvailableAddress > ColdSegmentEnd;
   if (PHDRTableOffset) {
     // Writing new pheader table.
     Phnum += 1; // only adding one new segment
+    if (ColdSegmentSize)
+      Phnum += HasTailSegment ? 2 : 1;
     // Segment size includes the size of the PHDR area.
-    NewTextSegmentSize = NextAvailableAddress - PHDRTableAddress;
+    NewTextSegmentSize = NewTextSegmentEnd - PHDRTableAddress;
   } else {
     assert(!PHDRTableAddress && "unexpected address for program header table");
+    assert(!ColdSegmentSize && "cold segment needs a new header table");
     // Update existing table.
     PHDRTableOffset = Obj->getHeader()->e_phoff;
     NewTextSegmentSize = NextAvailableAddress - NewTextSegmentAddress;
@@ -3587,6 +4370,31 @@ void RewriteInstance::patchELFPHDRTable() {
     return NewPhdr;
   };
 
+  // Write the new segment, followed by the cold and the tail segments if any.
+  auto writeNewPhdrs = [&]() {
+    auto NewTextPhdr = createNewTextPhdr();
+    OS.write(reinterpret_cast<const char *>(&NewTextPhdr),
+             sizeof(NewTextPhdr));
+    if (!ColdSegmentSize)
+      return;
+
+    auto writeLoadPhdr = [&](uint64_t Address, uint64_t Size, uint32_t Flags) {
+      auto Phdr = NewTextPhdr;
+      Phdr.p_offset = getFileOffsetForAddress(Address);
+      Phdr.p_vaddr = Address;
+      Phdr.p_paddr = Address;
+      Phdr.p_filesz = Size;
+      Phdr.p_memsz = Size;
+      Phdr.p_flags = Flags;
+      OS.write(reinterpret_cast<const char *>(&Phdr), sizeof(Phdr));
+    };
+    writeLoadPhdr(ColdSegmentAddress, ColdSegmentSize,
+                  ELF::PF_X | ELF::PF_R);
+    if (HasTailSegment)
+      writeLoadPhdr(ColdSegmentEnd, NextAvailableAddress - ColdSegmentEnd,
+                    NewTextPhdr.p_flags);
+  };
+
   // Copy existing program headers with modifications.
   for (auto &Phdr : cantFail(Obj->program_headers())) {
     auto NewPhdr = Phdr;
@@ -3611,20 +4419,16 @@ void RewriteInstance::patchELFPHDRTable() {
       NewPhdr = createNewTextPhdr();
       ModdedGnuStack = true;
     } else if (!opts::UseGnuStack && Phdr.p_type == ELF::PT_DYNAMIC) {
-      // Insert the new header before DYNAMIC.
-      auto NewTextPhdr = createNewTextPhdr();
-      OS.write(reinterpret_cast<const char *>(&NewTextPhdr),
-               sizeof(NewTextPhdr));
+      // Insert the new headers before DYNAMIC.
+      writeNewPhdrs();
       AddedSegment = true;
     }
     OS.write(reinterpret_cast<const char *>(&NewPhdr), sizeof(NewPhdr));
   }
 
   if (!opts::UseGnuStack && !AddedSegment) {
-    // Append the new header to the end of the table.
-    auto NewTextPhdr = createNewTextPhdr();
-    OS.write(reinterpret_cast<const char *>(&NewTextPhdr),
-             sizeof(NewTextPhdr));
+    // Append the new headers to the end of the table.
+    writeNewPhdrs();
   }
 
   assert((!opts::UseGnuStack || ModdedGnuStack) &&
@@ -3647,6 +4451,47 @@ uint64_t appendPadding(raw_pwrite_stream &OS,
   return Offset + PaddingSize;
 }
 
+/// Write \p Contents, which are the bytes at \p InputOffset of the file
+/// \p InputName, at the current position of \p OS writing the file
+/// \p OutputName. Large ranges are copied by the kernel when possible,
+/// without passing through user space buffers.
+void writeInputRange(raw_pwrite_stream &OS, StringRef Contents,
+                     StringRef InputName, uint64_t InputOffset,
+                     StringRef OutputName) {
+#if defined(__linux__) && defined(SYS_copy_file_range)
+  constexpr uint64_t MinCopySize = 64 * 1024;
+  if (opts::CopyFileRange && Contents.size() >= MinCopySize) {
+    const uint64_t OutputOffset = OS.tell();
+    OS.flush();
+
+    uint64_t Copied = 0;
+    const int InFD = ::open(InputName.str().c_str(), O_RDONLY);
+    const int OutFD = ::open(OutputName.str().c_str(), O_WRONLY);
+    if (InFD >= 0 && OutFD >= 0) {
+      loff_t InOffset = InputOffset;
+      loff_t OutOffset = OutputOffset;
+      while (Copied < Contents.size()) {
+        const auto Result =
+            ::syscall(SYS_copy_file_range, InFD, &InOffset, OutFD, &OutOffset,
+                      Contents.size() - Copied, 0u);
+        if (Result <= 0)
+          break;
+        Copied += Result;
+      }
+    }
+    if (InFD >= 0)
+      ::close(InFD);
+    if (OutFD >= 0)
+      ::close(OutFD);
+
+    // Whatever the kernel could not copy is written the usual way.
+    OS.seek(OutputOffset + Copied);
+    Contents = Contents.drop_front(Copied);
+  }
+#endif
+  OS << Contents;
+}
+
 }
 
 void RewriteInstance::rewriteNoteSections() {
@@ -3686,12 +4531,17 @@ void RewriteInstance::rewriteNoteSections() {
     // Copy over section contents unless it's one of the sections we overwrite.
     if (!willOverwriteSection(SectionName)) {
       Size = Section.sh_size;
-      std::string Data = InputFile->getData().substr(Section.sh_offset, Size);
+      const auto Contents =
+          InputFile->getData().substr(Section.sh_offset, Size);
+      // Sections are written straight from the mapped input file, e.g. large
+      // debug sections, with the patches applied on the way.
       auto SectionPatchersIt = SectionPatchers.find(SectionName);
       if (SectionPatchersIt != SectionPatchers.end()) {
-        (*SectionPatchersIt->second).patchBinary(Data);
+        SectionPatchersIt->second->writePatched(OS, Contents);
+      } else {
+        writeInputRange(OS, Contents, InputFile->getFileName(),
+                        Section.sh_offset, opts::OutputFilename);
       }
-      OS << Data;
 
       // Add padding as the section extension might rely on the alignment.
       Size = appendPadding(OS, Size, Section.sh_addralign);
@@ -3733,6 +4583,9 @@ void RewriteInstance::rewriteNoteSections() {
     NewSection.setOutputAddress(0);
     NewSection.setOutputFileOffset(NextAvailableOffset);
 
+    // Only the size of the section is needed from now on.
+    NewSection.releaseOutputContents();
+
     NextAvailableOffset += Size;
   }
 
@@ -3754,6 +4607,7 @@ void RewriteInstance::rewriteNoteSections() {
 
     OS.write(Section.getOutputContents().data(), Section.getOutputSize());
     NextAvailableOffset += Section.getOutputSize();
+    Section.releaseOutputContents();
   }
 }
 
@@ -3824,7 +4678,7 @@ void RewriteInstance::encodeBATSection() {
   DescOS.flush();
 
   const auto BoltInfo =
-      BinarySection::encodeELFNote("BOLT", DescStr, BinarySection::NT_BOLT_BAT);
+      BinarySection::encodeELFNote("BOLT", DescStr, BAT->getNoteType());
   BC->registerOrUpdateNoteSection(BoltAddressTranslation::SECTION_NAME,
                                   copyByteArray(BoltInfo), BoltInfo.size(),
                                   /*Alignment=*/1,
@@ -3857,6 +4711,13 @@ bool RewriteInstance::shouldStrip(const ELFShdrTy &Section,
   if (isDebugSection(SectionName) && !opts::UpdateDebugSections)
     return true;
 
+  // Strip debug sections that are not used for symbolization.
+  if (opts::SymbolizationDebugInfo && isDebugSection(SectionName) &&
+      std::none_of(std::begin(SymbolizationDebugSections),
+                   std::end(SymbolizationDebugSections),
+                   [&](const char *Name) { return SectionName == Name; }))
+    return true;
+
   return false;
 }
 
@@ -4228,12 +5089,49 @@ void RewriteInstance::updateELFSymbolTable(
     return false;
   };
 
-  for (const ELFSymTy &Symbol : cantFail(Obj->symbols(&SymTabSection))) {
+  // Searching for the functions and data objects matching the symbols
+  // dominates the update of large symbol tables, and is done in parallel over
+  // chunks of symbols. The rest of the update appends to the string table and
+  // stays sequential to keep the output order.
+  struct SymbolLookup {
+    const BinaryFunction *AtAddress{nullptr};
+    const BinaryFunction *Containing{nullptr};
+    BinaryData *Data{nullptr};
+  };
+  const auto InputSymbols = cantFail(Obj->symbols(&SymTabSection));
+  const size_t NumInputSymbols = InputSymbols.end() - InputSymbols.begin();
+  std::vector<SymbolLookup> Lookups(NumInputSymbols);
+  auto lookupSymbols = [&](size_t Begin, size_t End) {
+    for (size_t I = Begin; I < End; ++I) {
+      const auto &Symbol = *(InputSymbols.begin() + I);
+      auto &Lookup = Lookups[I];
+      Lookup.AtAddress = BC->getBinaryFunctionAtAddress(Symbol.st_value);
+      Lookup.Containing =
+          BC->getBinaryFunctionContainingAddress(Symbol.st_value,
+                                                 /*CheckPastEnd=*/false,
+                                                 /*UseMaxSize=*/true);
+      if (!opts::ReorderData.empty())
+        Lookup.Data = BC->getBinaryDataAtAddress(Symbol.st_value);
+    }
+  };
+  constexpr size_t LookupChunkSize = 16384;
+  if (opts::NoThreads || NumInputSymbols <= LookupChunkSize) {
+    lookupSymbols(0, NumInputSymbols);
+  } else {
+    auto &Pool = ParallelUtilities::getThreadPool();
+    for (size_t Begin = 0; Begin < NumInputSymbols; Begin += LookupChunkSize)
+      Pool.async(lookupSymbols, Begin,
+                 std::min(Begin + LookupChunkSize, NumInputSymbols));
+    Pool.wait();
+  }
+
+  for (const ELFSymTy &Symbol : InputSymbols) {
     // For regular (non-dynamic) symbol table strip unneeded symbols.
     if (!IsDynSym && shouldStrip(Symbol))
       continue;
 
-    const auto *Function = BC->getBinaryFunctionAtAddress(Symbol.st_value);
+    const auto &Lookup = Lookups[&Symbol - InputSymbols.begin()];
+    const auto *Function = Lookup.AtAddress;
     // Ignore false function references, e.g. when the section address matches
     // the address of the function.
     if (Function && Symbol.getType() == ELF::STT_SECTION)
@@ -4270,11 +5168,8 @@ void RewriteInstance::updateELFSymbolTable(
     } else {
       // Check if the function symbol matches address inside a function, i.e.
       // it marks a secondary entry point.
-      Function = (Symbol.getType() == ELF::STT_FUNC)
-        ? BC->getBinaryFunctionContainingAddress(Symbol.st_value,
-                                                 /*CheckPastEnd=*/false,
-                                                 /*UseMaxSize=*/true)
-        : nullptr;
+      Function = (Symbol.getType() == ELF::STT_FUNC) ? Lookup.Containing
+                                                     : nullptr;
 
       if (Function && Function->isEmitted()) {
         const auto OutputAddress =
@@ -4289,9 +5184,7 @@ void RewriteInstance::updateELFSymbolTable(
                                  : Function->getCodeSection()->getIndex();
       } else {
         // Check if the symbol belongs to moved data object and update it.
-        BinaryData *BD = opts::ReorderData.empty()
-          ? nullptr
-          : BC->getBinaryDataAtAddress(Symbol.st_value);
+        BinaryData *BD = Lookup.Data;
         if (BD && BD->isMoved() && !BD->isJumpTable()) {
           assert((!BD->getSize() || !Symbol.st_size ||
                   Symbol.st_size == BD->getSize()) &&
@@ -4319,9 +5212,7 @@ void RewriteInstance::updateELFSymbolTable(
         if (Symbol.getType() == ELF::STT_NOTYPE &&
             Symbol.getBinding() == ELF::STB_LOCAL &&
             Symbol.st_size == 0) {
-          if (BC->getBinaryFunctionContainingAddress(Symbol.st_value,
-                                                     /*CheckPastEnd=*/false,
-                                                     /*UseMaxSize=*/true)) {
+          if (Lookup.Containing) {
             // Can only delete the symbol if not patching. Such symbols should
             // not exist in the dynamic symbol table.
             assert(!IsDynSym && "cannot delete symbol");
@@ -4357,9 +5248,7 @@ void RewriteInstance::updateELFSymbolTable(
     }
 
     if (IsDynSym) {
-      Write((&Symbol - cantFail(Obj->symbols(&SymTabSection)).begin()) *
-                sizeof(ELFSymTy),
-            NewSymbol);
+      Write((&Symbol - InputSymbols.begin()) * sizeof(ELFSymTy), NewSymbol);
     } else {
       Symbols.emplace_back(NewSymbol);
     }
@@ -4499,6 +5388,7 @@ void RewriteInstance::patchELFSymTabs(ELFObjectFile<ELFT> *File) {
   const ELFShdrTy *StrTabSection =
       cantFail(Obj->getSection(SymTabSection->sh_link));
   std::string NewContents;
+  NewContents.reserve(SymTabSection->sh_size);
   std::string NewStrTab =
       File->getData().substr(StrTabSection->sh_offset, StrTabSection->sh_size);
   auto SecName = cantFail(Obj->getSectionName(SymTabSection));
@@ -4743,6 +5633,7 @@ uint64_t RewriteInstance::getNewFunctionAddress(uint64_t OldAddress) {
 }
 
 void RewriteInstance::rewriteFile() {
+  TelemetryScope TS("rewrite", "rewriteFile");
   std::error_code EC;
   Out = llvm::make_unique<ToolOutputFile>(opts::OutputFilename, EC,
                                           sys::fs::F_None, 0777);
@@ -4751,7 +5642,8 @@ void RewriteInstance::rewriteFile() {
   auto &OS = Out->os();
 
   // Copy allocatable part of the input.
-  OS << InputFile->getData().substr(0, FirstNonAllocatableOffset);
+  writeInputRange(OS, InputFile->getData().substr(0, FirstNonAllocatableOffset),
+                  InputFile->getFileName(), 0, opts::OutputFilename);
 
   // We obtain an asm-specific writer so that we can emit nops in an
   // architecture-specific way at the end of the function.
@@ -4779,7 +5671,10 @@ void RewriteInstance::rewriteFile() {
   // Overwrite functions with fixed output address.
   uint64_t CountOverwrittenFunctions = 0;
   uint64_t OverwrittenScore = 0;
-  for (BinaryFunction *Function : BC->getAllBinaryFunctions()) {
+  const auto AllFunctions = BC->getAllBinaryFunctions();
+  ProgressTask PT("write", AllFunctions.size());
+  for (BinaryFunction *Function : AllFunctions) {
+    Progress::advance();
 
     if (Function->getImageAddress() == 0 || Function->getImageSize() == 0)
       continue;
@@ -4934,6 +5829,9 @@ void RewriteInstance::rewriteFile() {
   if (opts::EnableBAT)
     encodeBATSection();
 
+  if (!opts::SymbolizationMap.empty())
+    SymbolizationMapWriter(*BC).write(opts::SymbolizationMap);
+
   // Copy non-allocatable sections once allocatable part is finished.
   rewriteNoteSections();
 
@@ -5084,6 +5982,9 @@ bool RewriteInstance::willOverwriteSection(StringRef SectionName) {
     if (SectionName == OverwriteName)
       return true;
   }
+  if (opts::SymbolizationDebugInfo &&
+      (SectionName == ".debug_info" || SectionName == ".debug_abbrev"))
+    return true;
 
   auto Section = BC->getUniqueSectionByName(SectionName);
   return Section && Section->isAllocatable() && Section->isFinalized();
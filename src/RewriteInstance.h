@@ -59,6 +59,19 @@ public:
   /// Run all the necessary steps to read, optimize and rewrite the binary.
   void run();
 
+  /// Run the steps of run() that only depend on the input binary and on the
+  /// options: reading its storage, symbols, relocations and debug info.
+  /// Return false if the binary cannot be processed.
+  bool loadBinary();
+
+  /// Run the remaining steps of run(), from reading the profile to writing
+  /// the output binary.
+  void optimizeBinary();
+
+  /// Process a request of the server mode in a process forked after
+  /// loadBinary(), once the options of the request are parsed.
+  void serveRequest();
+
   /// Diff this instance against another one. Non-const since we may run passes
   /// to fold identical functions.
   void compare(RewriteInstance &RI2);
@@ -107,11 +120,13 @@ private:
   /// Process input relocations.
   void processRelocations();
 
-  /// Insert an LKMarker for a given code pointer \p PC from a non-code section
-  /// \p SectionName.
-  void insertLKMarker(uint64_t PC, uint64_t SectionOffset,
-                      int32_t PCRelativeOffset, bool IsPCRelative,
-                      StringRef SectionName);
+  /// Insert LKMarkers for the PC-relative code pointers at \p FieldOffset in
+  /// every \p EntrySize-byte entry of the non-code section \p SectionName.
+  /// Pointers outside of functions are ignored, unless \p MustBeInFunction
+  /// is set. The referenced code locations are added to \p Sites if given.
+  void insertLKMarkers(StringRef SectionName, uint64_t EntrySize,
+                       uint64_t FieldOffset, bool MustBeInFunction = false,
+                       std::unordered_set<uint64_t> *Sites = nullptr);
 
   /// Process linux kernel special sections and their relocations.
   void processLKSections();
@@ -131,6 +146,12 @@ private:
   /// Process special linux kernel section, .smp_locks.
   void processLKSMPLocks();
 
+  /// Process special linux kernel section, __jump_table.
+  void processLKStaticKeys();
+
+  /// Process special linux kernel section, .altinstructions.
+  void processLKAltInstructions();
+
   /// Read relocations from a given section.
   void readDynamicRelocations(const object::SectionRef &Section);
 
@@ -143,6 +164,9 @@ private:
   /// Read information from debug sections.
   void readDebugInfo();
 
+  /// Read the line tables of the functions selected for processing.
+  void readLineTables();
+
   /// Read profile data without having disassembled functions available.
   void preprocessProfileData();
 
@@ -180,6 +204,10 @@ private:
   /// Update LKMarkers' locations for the output binary.
   void updateLKMarkers();
 
+  /// Report how much of the executed kernel code is mapped with 2MB pages in
+  /// the input and in the output layouts.
+  void reportLKTextPageCoverage();
+
   /// Return the list of code sections in the output order.
   std::vector<BinarySection *> getCodeSections();
 
@@ -189,6 +217,13 @@ private:
   void mapFileSections(orc::VModuleKey ObjectsHandle);
   void mapExtraSections(orc::VModuleKey ObjectsHandle);
 
+  /// Return true if \p Section goes to the cold segment with -cold-segment.
+  bool isColdSegmentSection(const BinarySection &Section) const;
+
+  /// Map the cold code and data after all other sections of the output
+  /// object, on pages of their own.
+  void mapColdSections(orc::VModuleKey ObjectsHandle);
+
   /// Update output object's values based on the final \p Layout.
   void updateOutputValues(const MCAsmLayout &Layout);
 
@@ -363,6 +398,17 @@ public:
     ".gdb_index",
   };
 
+  /// Debug sections kept with -symbolization-debug-info.
+  static constexpr const char *SymbolizationDebugSections[] = {
+    ".debug_abbrev",
+    ".debug_aranges",
+    ".debug_frame",
+    ".debug_info",
+    ".debug_line",
+    ".debug_line_str",
+    ".debug_ranges",
+  };
+
   /// Return true if the section holds debug information.
   static bool isDebugSection(StringRef SectionName);
 
@@ -436,6 +482,11 @@ private:
   uint64_t NewTextSegmentOffset{0};
   uint64_t NewTextSegmentSize{0};
 
+  /// Segment for the cold code and data with -cold-segment. Its size is zero
+  /// if there is none.
+  uint64_t ColdSegmentAddress{0};
+  uint64_t ColdSegmentSize{0};
+
   /// Track next available address for new allocatable sections.
   uint64_t NextAvailableAddress{0};
 
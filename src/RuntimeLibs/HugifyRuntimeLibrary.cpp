@@ -18,6 +18,7 @@ namespace opts {
 
 extern cl::OptionCategory BoltOptCategory;
 
+extern cl::opt<bool> HotData;
 extern cl::opt<bool> HotText;
 
 cl::opt<bool>
@@ -27,6 +28,19 @@ cl::opt<bool>
                     "(which is what --hot-text relies on)."),
            cl::ZeroOrMore, cl::cat(BoltOptCategory));
 
+static cl::opt<bool> HugifySharedMemfd(
+    "hugify-shared-memfd",
+    cl::desc("on kernels without huge pages for the page cache of "
+             "executables, move hot code to a shared memfd instead of private "
+             "anonymous memory"),
+    cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<bool> HugifyAsync(
+    "hugify-async",
+    cl::desc("promote hot code to huge pages from a background thread instead "
+             "of delaying the program start"),
+    cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
 static cl::opt<std::string> RuntimeHugifyLib(
     "runtime-hugify-lib",
     cl::desc("specify file name of the runtime hugify library"), cl::ZeroOrMore,
@@ -81,6 +95,58 @@ void HugifyRuntimeLibrary::emitBinary(BinaryContext &BC, MCStreamer &Streamer) {
   Streamer.EmitValue(
       MCSymbolRefExpr::create(StartFunction->getSymbol(), *(BC.Ctx)),
       /*Size=*/8);
+
+  MCSymbol *UseMemfd = BC.Ctx->getOrCreateSymbol("__bolt_hugify_use_memfd");
+  Streamer.EmitLabel(UseMemfd);
+  Streamer.EmitSymbolAttribute(UseMemfd, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(opts::HugifySharedMemfd ? 1 : 0, /*Size=*/1);
+
+  MCSymbol *Async = BC.Ctx->getOrCreateSymbol("__bolt_hugify_async");
+  Streamer.EmitLabel(Async);
+  Streamer.EmitSymbolAttribute(Async, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(opts::HugifyAsync ? 1 : 0, /*Size=*/1);
+
+  // The range of data reordered with -hot-data, which is mapped to huge pages
+  // of its own, or null if there is none.
+  const BinarySection *HotDataSection = nullptr;
+  if (BC.HasRelocations && opts::HotData) {
+    for (auto &Section : BC.sections()) {
+      if (Section.isReordered()) {
+        HotDataSection = &Section;
+        break;
+      }
+    }
+  }
+  Streamer.EmitValueToAlignment(8);
+  for (StringRef Name : {"__hot_data_start", "__hot_data_end"}) {
+    MCSymbol *Ptr = BC.Ctx->getOrCreateSymbol("__bolt_hugify" + Name.substr(1));
+    Streamer.EmitLabel(Ptr);
+    Streamer.EmitSymbolAttribute(Ptr, MCSymbolAttr::MCSA_Global);
+    if (HotDataSection)
+      Streamer.EmitValue(
+          MCSymbolRefExpr::create(BC.Ctx->getOrCreateSymbol(Name), *(BC.Ctx)),
+          /*Size=*/8);
+    else
+      Streamer.EmitIntValue(0, /*Size=*/8);
+  }
+  MCSymbol *Writable =
+      BC.Ctx->getOrCreateSymbol("__bolt_hugify_hot_data_writable");
+  Streamer.EmitLabel(Writable);
+  Streamer.EmitSymbolAttribute(Writable, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(HotDataSection && !HotDataSection->isReadOnly(),
+                        /*Size=*/1);
+
+  // The runtime publishes its telemetry through __bolt_hugify_stats if the
+  // application defines it.
+  Streamer.EmitValueToAlignment(8);
+  MCSymbol *StatsSlot = BC.Ctx->getOrCreateSymbol("__bolt_hugify_stats_slot");
+  Streamer.EmitLabel(StatsSlot);
+  Streamer.EmitSymbolAttribute(StatsSlot, MCSymbolAttr::MCSA_Global);
+  if (const auto *Stats = BC.getBinaryDataByName("__bolt_hugify_stats"))
+    Streamer.EmitValue(MCSymbolRefExpr::create(Stats->getSymbol(), *(BC.Ctx)),
+                       /*Size=*/8);
+  else
+    Streamer.EmitIntValue(0, /*Size=*/8);
 }
 
 void HugifyRuntimeLibrary::link(BinaryContext &BC, StringRef ToolPath,
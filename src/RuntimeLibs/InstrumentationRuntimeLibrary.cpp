@@ -20,8 +20,15 @@ namespace opts {
 
 extern cl::OptionCategory BoltOptCategory;
 
+extern cl::opt<bool> InstrumentationBinaryProfile;
+extern cl::opt<unsigned> InstrumentationCounterShards;
 extern cl::opt<bool> InstrumentationFileAppendPID;
 extern cl::opt<std::string> InstrumentationFilename;
+extern cl::opt<bool> InstrumentationMergeProcesses;
+extern cl::opt<uint32_t> InstrumentationMemorySampleRate;
+extern cl::opt<uint32_t> InstrumentationSamplingBurst;
+extern cl::opt<uint32_t> InstrumentationSamplingPeriod;
+extern cl::opt<std::string> InstrumentationSharedMemory;
 extern cl::opt<uint32_t> InstrumentationSleepTime;
 
 cl::opt<bool>
@@ -98,18 +105,49 @@ void InstrumentationRuntimeLibrary::emitBinary(BinaryContext &BC,
   // counters, total vector size is Counters.size() 8-byte counters
   MCSymbol *Locs = BC.Ctx->getOrCreateSymbol("__bolt_instr_locations");
   MCSymbol *NumLocs = BC.Ctx->getOrCreateSymbol("__bolt_num_counters");
+  MCSymbol *NumShards =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_num_shards");
   MCSymbol *NumIndCalls =
       BC.Ctx->getOrCreateSymbol("__bolt_instr_num_ind_calls");
   MCSymbol *NumIndCallTargets =
       BC.Ctx->getOrCreateSymbol("__bolt_instr_num_ind_targets");
+  MCSymbol *NumValueSites =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_num_value_sites");
   MCSymbol *NumFuncs = BC.Ctx->getOrCreateSymbol("__bolt_instr_num_funcs");
+  MCSymbol *NumMemSites =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_num_mem_sites");
+  MCSymbol *MemSampleRate =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_mem_sample_rate");
+  MCSymbol *NumDataObjects =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_num_data_objects");
+  MCSymbol *MemSites = BC.Ctx->getOrCreateSymbol("__bolt_instr_mem_sites");
+  MCSymbol *NumFirstCalls =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_num_first_calls");
+  MCSymbol *FirstCallOrder =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_first_call_order");
+  MCSymbol *FirstCallNames =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_first_call_names");
+  MCSymbol *DataObjects =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_data_objects");
+  MCSymbol *DataObjectNames =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_data_object_names");
   /// File name where profile is going to written to after target binary
   /// finishes a run
   MCSymbol *FilenameSym = BC.Ctx->getOrCreateSymbol("__bolt_instr_filename");
   MCSymbol *UsePIDSym = BC.Ctx->getOrCreateSymbol("__bolt_instr_use_pid");
+  MCSymbol *BinaryProfileSym =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_binary_profile");
+  MCSymbol *MergeProcessesSym =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_merge_processes");
+  MCSymbol *SharedMemorySym =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_shm_name");
   MCSymbol *InitPtr = BC.Ctx->getOrCreateSymbol("__bolt_instr_init_ptr");
   MCSymbol *FiniPtr = BC.Ctx->getOrCreateSymbol("__bolt_instr_fini_ptr");
   MCSymbol *SleepSym = BC.Ctx->getOrCreateSymbol("__bolt_instr_sleep_time");
+  MCSymbol *SamplingPeriod =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_sampling_period");
+  MCSymbol *SamplingBurst =
+      BC.Ctx->getOrCreateSymbol("__bolt_instr_sampling_burst");
 
   Section->setAlignment(BC.RegularPageSize);
   Streamer.SwitchSection(Section);
@@ -119,17 +157,54 @@ void InstrumentationRuntimeLibrary::emitBinary(BinaryContext &BC,
     Streamer.EmitLabel(Label);
     Streamer.emitFill(8, 0);
   }
-  const uint64_t Padding =
-      alignTo(8 * Summary->Counters.size(), BC.RegularPageSize) -
-      8 * Summary->Counters.size();
+  // The sampling flag is toggled by a child process of the runtime, hence it
+  // lives in the counters memory that is shared with it.
+  Streamer.EmitLabel(Summary->SamplingFlag);
+  Streamer.EmitSymbolAttribute(Summary->SamplingFlag,
+                               MCSymbolAttr::MCSA_Global);
+  Streamer.emitFill(8, 0);
+  // So is the order of first execution, which the child may write to disk.
+  Streamer.EmitLabel(FirstCallOrder);
+  Streamer.EmitSymbolAttribute(FirstCallOrder, MCSymbolAttr::MCSA_Global);
+  for (const auto &Label : Summary->FirstCallSlots) {
+    Streamer.EmitLabel(Label);
+    Streamer.emitFill(4, 0);
+  }
+  Streamer.EmitLabel(Summary->FirstCallSequence);
+  Streamer.EmitSymbolAttribute(Summary->FirstCallSequence,
+                               MCSymbolAttr::MCSA_Global);
+  Streamer.emitFill(4, 0);
+  // Each shard is a page-aligned copy of the counter array, so copies used by
+  // different CPUs never share a cache line.
+  const uint64_t FirstShardSize = 8 * Summary->Counters.size() + 8 +
+                                  4 * Summary->FirstCallSlots.size() + 4;
+  const uint64_t ShardStride = alignTo(FirstShardSize, BC.RegularPageSize);
+  const uint64_t Padding = ShardStride - FirstShardSize;
   if (Padding)
     Streamer.emitFill(Padding, 0);
+  if (opts::InstrumentationCounterShards > 1)
+    Streamer.emitFill(ShardStride * (opts::InstrumentationCounterShards - 1),
+                      0);
   Streamer.EmitLabel(SleepSym);
   Streamer.EmitSymbolAttribute(SleepSym, MCSymbolAttr::MCSA_Global);
   Streamer.EmitIntValue(opts::InstrumentationSleepTime, /*Size=*/4);
+  Streamer.EmitLabel(SamplingPeriod);
+  Streamer.EmitSymbolAttribute(SamplingPeriod, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(opts::InstrumentationSamplingPeriod, /*Size=*/4);
+  Streamer.EmitLabel(SamplingBurst);
+  Streamer.EmitSymbolAttribute(SamplingBurst, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(opts::InstrumentationSamplingBurst, /*Size=*/4);
   Streamer.EmitLabel(NumLocs);
   Streamer.EmitSymbolAttribute(NumLocs, MCSymbolAttr::MCSA_Global);
   Streamer.EmitIntValue(Summary->Counters.size(), /*Size=*/4);
+  Streamer.EmitLabel(NumShards);
+  Streamer.EmitSymbolAttribute(NumShards, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(opts::InstrumentationCounterShards, /*Size=*/4);
+  Streamer.EmitValueToAlignment(8);
+  Streamer.EmitLabel(Summary->CounterShardStride);
+  Streamer.EmitSymbolAttribute(Summary->CounterShardStride,
+                               MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(ShardStride, /*Size=*/8);
   Streamer.EmitLabel(Summary->IndCallHandlerFunc);
   Streamer.EmitSymbolAttribute(Summary->IndCallHandlerFunc,
                                MCSymbolAttr::MCSA_Global);
@@ -144,20 +219,87 @@ void InstrumentationRuntimeLibrary::emitBinary(BinaryContext &BC,
       MCSymbolRefExpr::create(
           Summary->InitialIndTailCallHandlerFunction->getSymbol(), *BC.Ctx),
       /*Size=*/8);
+  Streamer.EmitLabel(Summary->ValueProfHandlerFunc);
+  Streamer.EmitSymbolAttribute(Summary->ValueProfHandlerFunc,
+                               MCSymbolAttr::MCSA_Global);
+  Streamer.EmitValue(
+      MCSymbolRefExpr::create(
+          Summary->InitialValueProfHandlerFunction->getSymbol(), *BC.Ctx),
+      /*Size=*/8);
+  Streamer.EmitLabel(Summary->MemAccessHandlerFunc);
+  Streamer.EmitSymbolAttribute(Summary->MemAccessHandlerFunc,
+                               MCSymbolAttr::MCSA_Global);
+  Streamer.EmitValue(
+      MCSymbolRefExpr::create(
+          Summary->InitialValueProfHandlerFunction->getSymbol(), *BC.Ctx),
+      /*Size=*/8);
   Streamer.EmitLabel(NumIndCalls);
   Streamer.EmitSymbolAttribute(NumIndCalls, MCSymbolAttr::MCSA_Global);
   Streamer.EmitIntValue(Summary->IndCallDescriptions.size(), /*Size=*/4);
   Streamer.EmitLabel(NumIndCallTargets);
   Streamer.EmitSymbolAttribute(NumIndCallTargets, MCSymbolAttr::MCSA_Global);
   Streamer.EmitIntValue(Summary->IndCallTargetDescriptions.size(), /*Size=*/4);
+  Streamer.EmitLabel(NumValueSites);
+  Streamer.EmitSymbolAttribute(NumValueSites, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(Summary->ValueSiteDescriptions.size(), /*Size=*/4);
   Streamer.EmitLabel(NumFuncs);
   Streamer.EmitSymbolAttribute(NumFuncs, MCSymbolAttr::MCSA_Global);
   Streamer.EmitIntValue(Summary->FunctionDescriptions.size(), /*Size=*/4);
+  Streamer.EmitLabel(NumMemSites);
+  Streamer.EmitSymbolAttribute(NumMemSites, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(Summary->MemAccessSiteDescriptions.size(), /*Size=*/4);
+  Streamer.EmitLabel(MemSampleRate);
+  Streamer.EmitSymbolAttribute(MemSampleRate, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(opts::InstrumentationMemorySampleRate, /*Size=*/4);
+  Streamer.EmitLabel(NumDataObjects);
+  Streamer.EmitSymbolAttribute(NumDataObjects, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(Summary->DataObjects.size(), /*Size=*/4);
+  Streamer.EmitLabel(NumFirstCalls);
+  Streamer.EmitSymbolAttribute(NumFirstCalls, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(Summary->FirstCallSlots.size(), /*Size=*/4);
+  // Names of the functions in the order of __bolt_instr_first_call_order
+  Streamer.EmitLabel(FirstCallNames);
+  Streamer.EmitSymbolAttribute(FirstCallNames, MCSymbolAttr::MCSA_Global);
+  for (const auto NameIdx : Summary->FirstCallNames)
+    Streamer.EmitIntValue(NameIdx, /*Size=*/4);
+  // Memory access sites have the layout of a Location, and data objects are
+  // described by their address, size, and an offset into their own string
+  // table. The runtime looks the objects up on each sampled access, so these
+  // live in memory rather than in the notes section.
+  Streamer.EmitLabel(MemSites);
+  Streamer.EmitSymbolAttribute(MemSites, MCSymbolAttr::MCSA_Global);
+  for (const auto &Desc : Summary->MemAccessSiteDescriptions) {
+    Streamer.EmitIntValue(Desc.FromLoc.FuncString, /*Size=*/4);
+    Streamer.EmitIntValue(Desc.FromLoc.Offset, /*Size=*/4);
+  }
+  std::string DataObjectNameTable;
+  Streamer.EmitValueToAlignment(8);
+  Streamer.EmitLabel(DataObjects);
+  Streamer.EmitSymbolAttribute(DataObjects, MCSymbolAttr::MCSA_Global);
+  for (const auto *BD : Summary->DataObjects) {
+    Streamer.EmitIntValue(BD->getAddress(), /*Size=*/8);
+    Streamer.EmitIntValue(std::min<uint64_t>(BD->getSize(), UINT32_MAX),
+                          /*Size=*/4);
+    Streamer.EmitIntValue(DataObjectNameTable.size(), /*Size=*/4);
+    DataObjectNameTable.append(BD->getName().str());
+    DataObjectNameTable.append(1, '\0');
+  }
+  Streamer.EmitLabel(DataObjectNames);
+  Streamer.EmitSymbolAttribute(DataObjectNames, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitBytes(DataObjectNameTable);
   Streamer.EmitLabel(FilenameSym);
   Streamer.EmitBytes(opts::InstrumentationFilename);
   Streamer.emitFill(1, 0);
+  Streamer.EmitLabel(SharedMemorySym);
+  Streamer.EmitBytes(opts::InstrumentationSharedMemory);
+  Streamer.emitFill(1, 0);
   Streamer.EmitLabel(UsePIDSym);
   Streamer.EmitIntValue(opts::InstrumentationFileAppendPID ? 1 : 0, /*Size=*/1);
+  Streamer.EmitLabel(BinaryProfileSym);
+  Streamer.EmitIntValue(opts::InstrumentationBinaryProfile ? 1 : 0, /*Size=*/1);
+  Streamer.EmitLabel(MergeProcessesSym);
+  Streamer.EmitIntValue(opts::InstrumentationMergeProcesses ? 1 : 0,
+                        /*Size=*/1);
 
   Streamer.EmitLabel(InitPtr);
   Streamer.EmitSymbolAttribute(InitPtr, MCSymbolAttr::MCSA_Global);
@@ -248,6 +390,13 @@ void InstrumentationRuntimeLibrary::emitTablesAsELFNote(BinaryContext &BC) {
         getOutputAddress(*Desc.Target, Desc.ToLoc.Offset);
     OS.write(reinterpret_cast<const char *>(&TargetFuncAddress), 8);
   }
+  const auto VSDSize =
+      Summary->ValueSiteDescriptions.size() * sizeof(ValueSiteDescription);
+  OS.write(reinterpret_cast<const char *>(&VSDSize), 4);
+  for (const auto &Desc : Summary->ValueSiteDescriptions) {
+    OS.write(reinterpret_cast<const char *>(&Desc.FromLoc.FuncString), 4);
+    OS.write(reinterpret_cast<const char *>(&Desc.FromLoc.Offset), 4);
+  }
   auto FuncDescSize = Summary->getFDSize();
   OS.write(reinterpret_cast<const char *>(&FuncDescSize), 4);
   for (const auto &Desc : Summary->FunctionDescriptions) {
@@ -0,0 +1,140 @@
+//===-- PageOutRuntimeLibrary.cpp - Cold Segment Page-Out Library ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "PageOutRuntimeLibrary.h"
+#include "BinaryFunction.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+extern cl::opt<bool> ColdSegment;
+
+enum PageOutAdvice : unsigned {
+  PO_COLD = 20,    // MADV_COLD
+  PO_PAGEOUT = 21, // MADV_PAGEOUT
+};
+
+cl::opt<bool> ColdSegmentPageOut(
+    "cold-segment-pageout",
+    cl::desc("advise the kernel to reclaim the cold segment once the program "
+             "has started (implies -cold-segment, Linux 5.4 and later)"),
+    cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<PageOutAdvice> ColdSegmentPageOutAdvice(
+    "cold-segment-pageout-advice",
+    cl::desc("advice given for the cold segment with -cold-segment-pageout"),
+    cl::init(PO_COLD),
+    cl::values(clEnumValN(PO_COLD, "cold",
+                          "deactivate the pages, to be reclaimed first under "
+                          "memory pressure"),
+               clEnumValN(PO_PAGEOUT, "pageout",
+                          "reclaim the pages right away")),
+    cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned> ColdSegmentPageOutDelay(
+    "cold-segment-pageout-delay",
+    cl::desc("time in milliseconds from the program entry after which the "
+             "cold segment is advised"),
+    cl::init(10000), cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<std::string> RuntimePageOutLib(
+    "runtime-pageout-lib",
+    cl::desc("specify file name of the runtime cold segment page-out library"),
+    cl::ZeroOrMore, cl::init("libbolt_rt_pageout.a"),
+    cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+void PageOutRuntimeLibrary::adjustCommandLineOptions(
+    const BinaryContext &BC) const {
+  if (!BC.HasRelocations) {
+    errs() << "BOLT-ERROR: -cold-segment-pageout requires relocations\n";
+    exit(1);
+  }
+  opts::ColdSegment = true;
+  if (!BC.StartFunctionAddress) {
+    errs() << "BOLT-ERROR: page-out runtime library requires a known entry "
+              "point of the input binary\n";
+    exit(1);
+  }
+}
+
+void PageOutRuntimeLibrary::emitBinary(BinaryContext &BC,
+                                       MCStreamer &Streamer) {
+  const auto *StartFunction =
+      BC.getBinaryFunctionAtAddress(*(BC.StartFunctionAddress));
+  if (!StartFunction) {
+    errs() << "BOLT-ERROR: failed to locate function at binary start address\n";
+    exit(1);
+  }
+
+  const auto Flags = BinarySection::getFlags(/*IsReadOnly=*/false,
+                                             /*IsText=*/false,
+                                             /*IsAllocatable=*/true);
+  auto *Section =
+      BC.Ctx->getELFSection(".bolt.pageout.entries", ELF::SHT_PROGBITS, Flags);
+
+  // __bolt_pageout_init_ptr stores the pointer the library jumps to after
+  // starting the page-out thread.
+  MCSymbol *InitPtr = BC.Ctx->getOrCreateSymbol("__bolt_pageout_init_ptr");
+
+  Section->setAlignment(BC.RegularPageSize);
+  Streamer.SwitchSection(Section);
+
+  Streamer.EmitLabel(InitPtr);
+  Streamer.EmitSymbolAttribute(InitPtr, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitValue(
+      MCSymbolRefExpr::create(StartFunction->getSymbol(), *(BC.Ctx)),
+      /*Size=*/8);
+
+  // The bounds of the cold segment are resolved once it is laid out.
+  for (StringRef Name :
+       {"__bolt_cold_segment_start", "__bolt_cold_segment_end"}) {
+    MCSymbol *Ptr =
+        BC.Ctx->getOrCreateSymbol("__bolt_pageout" + Name.substr(6));
+    Streamer.EmitLabel(Ptr);
+    Streamer.EmitSymbolAttribute(Ptr, MCSymbolAttr::MCSA_Global);
+    Streamer.EmitValue(
+        MCSymbolRefExpr::create(BC.Ctx->getOrCreateSymbol(Name), *(BC.Ctx)),
+        /*Size=*/8);
+  }
+
+  MCSymbol *Delay = BC.Ctx->getOrCreateSymbol("__bolt_pageout_delay_ms");
+  Streamer.EmitLabel(Delay);
+  Streamer.EmitSymbolAttribute(Delay, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(opts::ColdSegmentPageOutDelay, /*Size=*/4);
+
+  MCSymbol *Advice = BC.Ctx->getOrCreateSymbol("__bolt_pageout_advice");
+  Streamer.EmitLabel(Advice);
+  Streamer.EmitSymbolAttribute(Advice, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(opts::ColdSegmentPageOutAdvice, /*Size=*/4);
+}
+
+void PageOutRuntimeLibrary::link(BinaryContext &BC, StringRef ToolPath,
+                                 orc::ExecutionSession &ES,
+                                 orc::RTDyldObjectLinkingLayer &OLT) {
+  auto LibPath = getLibPath(ToolPath, opts::RuntimePageOutLib);
+  loadLibraryToOLT(LibPath, ES, OLT);
+
+  assert(!RuntimeStartAddress &&
+         "We don't currently support linking multiple runtime libraries");
+  RuntimeStartAddress =
+      cantFail(OLT.findSymbol("__bolt_pageout_self", false).getAddress());
+  if (!RuntimeStartAddress) {
+    errs() << "BOLT-ERROR: page-out library does not define "
+              "__bolt_pageout_self: "
+           << LibPath << "\n";
+    exit(1);
+  }
+}
@@ -0,0 +1,41 @@
+//===-- PageOutRuntimeLibrary.h - Cold Segment Page-Out Library -----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_PAGE_OUT_RUNTIME_LIBRARY_H
+#define LLVM_TOOLS_LLVM_BOLT_PAGE_OUT_RUNTIME_LIBRARY_H
+
+#include "RuntimeLibs/RuntimeLibrary.h"
+
+namespace llvm {
+namespace bolt {
+
+/// Runtime library that advises the kernel to reclaim the pages of the cold
+/// segment laid out with -cold-segment, from a background thread started at
+/// program entry, once the startup is expected to be over.
+class PageOutRuntimeLibrary : public RuntimeLibrary {
+public:
+  /// Add custom section names generated by the runtime libraries to \p
+  /// SecNames.
+  void
+  addRuntimeLibSections(std::vector<std::string> &SecNames) const override {
+    SecNames.push_back(".bolt.pageout.entries");
+  }
+
+  void adjustCommandLineOptions(const BinaryContext &BC) const override;
+
+  void emitBinary(BinaryContext &BC, MCStreamer &Streamer) override;
+
+  void link(BinaryContext &BC, StringRef ToolPath, orc::ExecutionSession &ES,
+            orc::RTDyldObjectLinkingLayer &OLT) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -0,0 +1,170 @@
+//===-- SamplingRuntimeLibrary.cpp - The Sampling Runtime Library ---------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "SamplingRuntimeLibrary.h"
+#include "BinaryFunction.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+cl::opt<bool> RuntimeSampling(
+    "runtime-sampling",
+    cl::desc("link a runtime library that samples the program with a "
+             "profiling timer, following frame pointers to record call edges, "
+             "and writes a pre-aggregated profile for perf2bolt -pa at exit"),
+    cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<uint32_t> RuntimeSamplingInterval(
+    "runtime-sampling-interval",
+    cl::desc("CPU time between samples in microseconds (default: 1000)"),
+    cl::init(1000), cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<uint32_t> RuntimeSamplingDepth(
+    "runtime-sampling-depth",
+    cl::desc("maximum number of frames walked per sample (default: 16)"),
+    cl::init(16), cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<std::string> RuntimeSamplingFile(
+    "runtime-sampling-file",
+    cl::desc("file name where the runtime writes the pre-aggregated profile "
+             "(default: /tmp/prof.preagg)"),
+    cl::init("/tmp/prof.preagg"), cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<std::string> RuntimeSamplingLib(
+    "runtime-sampling-lib",
+    cl::desc("specify file name of the runtime sampling library"),
+    cl::ZeroOrMore, cl::init("libbolt_rt_sampling.a"),
+    cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+void SamplingRuntimeLibrary::adjustCommandLineOptions(
+    const BinaryContext &BC) const {
+  if (!BC.HasFixedLoadAddress) {
+    errs() << "BOLT-ERROR: sampling runtime library does not support "
+              "position-independent executables\n";
+    exit(1);
+  }
+  if (!BC.StartFunctionAddress) {
+    errs() << "BOLT-ERROR: sampling runtime library requires a known entry "
+              "point of the input binary\n";
+    exit(1);
+  }
+  if (!BC.FiniFunctionAddress) {
+    errs() << "BOLT-ERROR: input binary lacks DT_FINI entry in the dynamic "
+              "section but the sampling runtime relies on patching DT_FINI to "
+              "write the profile\n";
+    exit(1);
+  }
+}
+
+void SamplingRuntimeLibrary::emitBinary(BinaryContext &BC,
+                                        MCStreamer &Streamer) {
+  const auto *StartFunction =
+      BC.getBinaryFunctionAtAddress(*BC.StartFunctionAddress);
+  const auto *FiniFunction =
+      BC.getBinaryFunctionAtAddress(*BC.FiniFunctionAddress);
+  if (!StartFunction || !FiniFunction) {
+    errs() << "BOLT-ERROR: failed to locate functions at binary start and "
+              "fini addresses\n";
+    exit(1);
+  }
+
+  const auto Flags = BinarySection::getFlags(/*IsReadOnly=*/false,
+                                             /*IsText=*/false,
+                                             /*IsAllocatable=*/true);
+  auto *Section =
+      BC.Ctx->getELFSection(".bolt.sampling.entries", ELF::SHT_PROGBITS, Flags);
+  Section->setAlignment(BC.RegularPageSize);
+  Streamer.SwitchSection(Section);
+
+  auto emitGlobal = [&](StringRef Name) {
+    MCSymbol *Symbol = BC.Ctx->getOrCreateSymbol(Name);
+    Streamer.EmitLabel(Symbol);
+    Streamer.EmitSymbolAttribute(Symbol, MCSymbolAttr::MCSA_Global);
+  };
+  auto emitSymbolValue = [&](const MCSymbol *Symbol) {
+    Streamer.EmitValue(MCSymbolRefExpr::create(Symbol, *BC.Ctx), /*Size=*/8);
+  };
+
+  emitGlobal("__bolt_sampling_init_ptr");
+  emitSymbolValue(StartFunction->getSymbol());
+  emitGlobal("__bolt_sampling_fini_ptr");
+  emitSymbolValue(FiniFunction->getSymbol());
+
+  // Address ranges of functions in the output and where they start in the
+  // input, so that the profile refers to the input binary. Fragments are
+  // attributed to the start of their function. The runtime sorts them.
+  uint32_t NumRanges = 0;
+  Streamer.EmitValueToAlignment(8);
+  emitGlobal("__bolt_sampling_funcs");
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    BinaryFunction *Function = &BFI.second;
+    if (Function->isPLTFunction() || !Function->getSize())
+      continue;
+    const uint64_t InputAddress = Function->getAddress();
+    const uint64_t InputSize = Function->getSize();
+    if (!BC.shouldEmit(*Function)) {
+      for (uint64_t Value : {InputAddress, InputAddress + InputSize,
+                             InputAddress, InputSize})
+        Streamer.EmitIntValue(Value, /*Size=*/8);
+      ++NumRanges;
+      continue;
+    }
+    emitSymbolValue(Function->getSymbol());
+    emitSymbolValue(Function->getFunctionEndLabel());
+    Streamer.EmitIntValue(InputAddress, /*Size=*/8);
+    Streamer.EmitIntValue(InputSize, /*Size=*/8);
+    ++NumRanges;
+    if (Function->isSplit()) {
+      emitSymbolValue(Function->getColdSymbol());
+      emitSymbolValue(Function->getFunctionColdEndLabel());
+      Streamer.EmitIntValue(InputAddress, /*Size=*/8);
+      Streamer.EmitIntValue(1, /*Size=*/8);
+      ++NumRanges;
+    }
+  }
+
+  emitGlobal("__bolt_sampling_num_funcs");
+  Streamer.EmitIntValue(NumRanges, /*Size=*/4);
+  emitGlobal("__bolt_sampling_interval");
+  Streamer.EmitIntValue(opts::RuntimeSamplingInterval, /*Size=*/4);
+  emitGlobal("__bolt_sampling_depth");
+  Streamer.EmitIntValue(opts::RuntimeSamplingDepth, /*Size=*/4);
+  emitGlobal("__bolt_sampling_filename");
+  Streamer.EmitBytes(opts::RuntimeSamplingFile);
+  Streamer.emitFill(1, 0);
+
+  outs() << "BOLT-INFO: the sampling runtime will write a pre-aggregated "
+            "profile to "
+         << opts::RuntimeSamplingFile << "\n";
+}
+
+void SamplingRuntimeLibrary::link(BinaryContext &BC, StringRef ToolPath,
+                                  orc::ExecutionSession &ES,
+                                  orc::RTDyldObjectLinkingLayer &OLT) {
+  auto LibPath = getLibPath(ToolPath, opts::RuntimeSamplingLib);
+  loadLibraryToOLT(LibPath, ES, OLT);
+
+  RuntimeFiniAddress =
+      cantFail(OLT.findSymbol("__bolt_sampling_fini", false).getAddress());
+  RuntimeStartAddress =
+      cantFail(OLT.findSymbol("__bolt_sampling_start", false).getAddress());
+  if (!RuntimeFiniAddress || !RuntimeStartAddress) {
+    errs() << "BOLT-ERROR: sampling library does not define "
+              "__bolt_sampling_start and __bolt_sampling_fini: "
+           << LibPath << "\n";
+    exit(1);
+  }
+}
@@ -0,0 +1,40 @@
+//===-- SamplingRuntimeLibrary.h - The Sampling Runtime Library -----------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_SAMPLING_RUNTIME_LIBRARY_H
+#define LLVM_TOOLS_LLVM_BOLT_SAMPLING_RUNTIME_LIBRARY_H
+
+#include "RuntimeLibs/RuntimeLibrary.h"
+
+namespace llvm {
+namespace bolt {
+
+/// Runtime library that samples the program with a profiling timer and writes
+/// the sampled addresses and the call edges found by walking frame pointers
+/// in the pre-aggregated format read by perf2bolt -pa. Meant for hardware
+/// without LBR, where instrumentation would be too slow.
+class SamplingRuntimeLibrary : public RuntimeLibrary {
+public:
+  void
+  addRuntimeLibSections(std::vector<std::string> &SecNames) const override {
+    SecNames.push_back(".bolt.sampling.entries");
+  }
+
+  void adjustCommandLineOptions(const BinaryContext &BC) const override;
+
+  void emitBinary(BinaryContext &BC, MCStreamer &Streamer) override;
+
+  void link(BinaryContext &BC, StringRef ToolPath, orc::ExecutionSession &ES,
+            orc::RTDyldObjectLinkingLayer &OLT) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
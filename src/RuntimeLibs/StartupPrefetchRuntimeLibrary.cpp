@@ -0,0 +1,105 @@
+//===-- StartupPrefetchRuntimeLibrary.cpp - Startup Prefetch Library ------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#include "StartupPrefetchRuntimeLibrary.h"
+#include "BinaryFunction.h"
+#include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+extern cl::opt<bool> HotText;
+
+cl::opt<bool> PrefetchStartupText(
+    "prefetch-startup-text",
+    cl::desc("read the hot text into memory at program entry in one "
+             "sequential request. With -reorder-functions=temporal it also "
+             "covers the startup functions"),
+    cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<bool> PrefetchPopulate(
+    "prefetch-startup-text-populate",
+    cl::desc("also map the prefetched pages, waiting for them to be read "
+             "(Linux 5.14 and later)"),
+    cl::ZeroOrMore, cl::cat(BoltOptCategory));
+
+static cl::opt<std::string> RuntimePrefetchLib(
+    "runtime-prefetch-lib",
+    cl::desc("specify file name of the runtime startup prefetch library"),
+    cl::ZeroOrMore, cl::init("libbolt_rt_prefetch.a"),
+    cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+void StartupPrefetchRuntimeLibrary::adjustCommandLineOptions(
+    const BinaryContext &BC) const {
+  // The hot text symbols delimit the range to prefetch.
+  opts::HotText = true;
+  if (!BC.StartFunctionAddress) {
+    errs() << "BOLT-ERROR: startup prefetch runtime library requires a known "
+              "entry point of the input binary\n";
+    exit(1);
+  }
+}
+
+void StartupPrefetchRuntimeLibrary::emitBinary(BinaryContext &BC,
+                                               MCStreamer &Streamer) {
+  const auto *StartFunction =
+      BC.getBinaryFunctionAtAddress(*(BC.StartFunctionAddress));
+  if (!StartFunction) {
+    errs() << "BOLT-ERROR: failed to locate function at binary start address\n";
+    exit(1);
+  }
+
+  const auto Flags = BinarySection::getFlags(/*IsReadOnly=*/false,
+                                             /*IsText=*/false,
+                                             /*IsAllocatable=*/true);
+  auto *Section =
+      BC.Ctx->getELFSection(".bolt.prefetch.entries", ELF::SHT_PROGBITS, Flags);
+
+  // __bolt_prefetch_init_ptr stores the pointer the library jumps to after
+  // issuing the prefetch.
+  MCSymbol *InitPtr = BC.Ctx->getOrCreateSymbol("__bolt_prefetch_init_ptr");
+
+  Section->setAlignment(BC.RegularPageSize);
+  Streamer.SwitchSection(Section);
+
+  Streamer.EmitLabel(InitPtr);
+  Streamer.EmitSymbolAttribute(InitPtr, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitValue(
+      MCSymbolRefExpr::create(StartFunction->getSymbol(), *(BC.Ctx)),
+      /*Size=*/8);
+
+  MCSymbol *Populate = BC.Ctx->getOrCreateSymbol("__bolt_prefetch_populate");
+  Streamer.EmitLabel(Populate);
+  Streamer.EmitSymbolAttribute(Populate, MCSymbolAttr::MCSA_Global);
+  Streamer.EmitIntValue(opts::PrefetchPopulate ? 1 : 0, /*Size=*/1);
+}
+
+void StartupPrefetchRuntimeLibrary::link(BinaryContext &BC, StringRef ToolPath,
+                                         orc::ExecutionSession &ES,
+                                         orc::RTDyldObjectLinkingLayer &OLT) {
+  auto LibPath = getLibPath(ToolPath, opts::RuntimePrefetchLib);
+  loadLibraryToOLT(LibPath, ES, OLT);
+
+  assert(!RuntimeStartAddress &&
+         "We don't currently support linking multiple runtime libraries");
+  RuntimeStartAddress =
+      cantFail(OLT.findSymbol("__bolt_prefetch_self", false).getAddress());
+  if (!RuntimeStartAddress) {
+    errs() << "BOLT-ERROR: startup prefetch library does not define "
+              "__bolt_prefetch_self: "
+           << LibPath << "\n";
+    exit(1);
+  }
+}
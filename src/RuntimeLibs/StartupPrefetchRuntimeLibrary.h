@@ -0,0 +1,40 @@
+//===-- StartupPrefetchRuntimeLibrary.h - Startup Prefetch Library --------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_STARTUP_PREFETCH_RUNTIME_LIBRARY_H
+#define LLVM_TOOLS_LLVM_BOLT_STARTUP_PREFETCH_RUNTIME_LIBRARY_H
+
+#include "RuntimeLibs/RuntimeLibrary.h"
+
+namespace llvm {
+namespace bolt {
+
+/// Runtime library that reads the hot and startup code into memory at program
+/// entry, instead of letting it fault in one page at a time.
+class StartupPrefetchRuntimeLibrary : public RuntimeLibrary {
+public:
+  /// Add custom section names generated by the runtime libraries to \p
+  /// SecNames.
+  void
+  addRuntimeLibSections(std::vector<std::string> &SecNames) const override {
+    SecNames.push_back(".bolt.prefetch.entries");
+  }
+
+  void adjustCommandLineOptions(const BinaryContext &BC) const override;
+
+  void emitBinary(BinaryContext &BC, MCStreamer &Streamer) override;
+
+  void link(BinaryContext &BC, StringRef ToolPath, orc::ExecutionSession &ES,
+            orc::RTDyldObjectLinkingLayer &OLT) override;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
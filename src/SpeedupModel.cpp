@@ -0,0 +1,307 @@
+//===--- SpeedupModel.cpp - Estimate of cycles saved by optimizations -----===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "SpeedupModel.h"
+#include "BinaryContext.h"
+#include "BinaryFunction.h"
+#include "DynoStats.h"
+#include "ParallelUtilities.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltOptCategory;
+
+static cl::opt<bool>
+EstimateSpeedup("estimate-speedup",
+  cl::desc("estimate the cycles saved in every function from the change in "
+           "dyno stats, branch mispredictions and simulated instruction "
+           "cache and TLB misses (implies -print-cache-metrics -cache-sim)"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::list<std::string>
+SpeedupModelWeights("speedup-model-weights",
+  cl::CommaSeparated,
+  cl::desc("cycles per event used by -estimate-speedup, as a list of "
+           "<event>=<cycles> with events instructions, taken-branches, "
+           "mispredicts, calls, l1i-misses, l2-misses, itlb-misses and "
+           "stlb-misses"),
+  cl::value_desc("event=cycles,..."),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<double>
+SpeedupModelCPI("speedup-model-cpi",
+  cl::desc("cycles per instruction measured for the input binary, used by "
+           "-estimate-speedup to turn cycles saved into a speedup"),
+  cl::init(1.0),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<unsigned>
+SpeedupModelTop("speedup-model-top",
+  cl::desc("number of functions with the largest estimated gains and losses "
+           "printed by -estimate-speedup"),
+  cl::init(10),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static cl::opt<std::string>
+SpeedupModelFile("speedup-model-file",
+  cl::desc("with -estimate-speedup, write the events of every function "
+           "before and after optimizations to a JSON file, to fit the "
+           "weights against measured results"),
+  cl::value_desc("filename"),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+} // namespace opts
+
+namespace {
+
+enum Event : unsigned {
+  INSTRUCTIONS,
+  TAKEN_BRANCHES,
+  MISPREDICTS,
+  CALLS,
+  L1I_MISSES,
+  L2_MISSES,
+  ITLB_MISSES,
+  STLB_MISSES,
+  NUM_EVENTS
+};
+
+const char *const EventNames[NUM_EVENTS] = {
+  "instructions", "taken-branches", "mispredicts", "calls",
+  "l1i-misses",   "l2-misses",      "itlb-misses", "stlb-misses",
+};
+
+/// Default cycles per event for a recent out-of-order x86 core: four
+/// instructions retired per cycle, a fetch bubble for every taken branch, a
+/// pipeline flush for a misprediction, a call and a return, L2 and L3 hit
+/// latencies, and STLB hit and page walk latencies.
+const double DefaultWeights[NUM_EVENTS] = {
+  0.25, 1.0, 15.0, 2.0, 12.0, 40.0, 8.0, 30.0,
+};
+
+struct Events {
+  double Count[NUM_EVENTS] = {};
+};
+
+/// Events of a function in the input and in the optimized code
+struct FunctionRecord {
+  Events Before;
+  Events After;
+};
+
+std::map<std::string, FunctionRecord> Records;
+
+std::vector<double> getWeights() {
+  std::vector<double> Weights(DefaultWeights, DefaultWeights + NUM_EVENTS);
+  for (const auto &Entry : opts::SpeedupModelWeights) {
+    const auto Pair = StringRef(Entry).split('=');
+    auto Name = std::find_if(EventNames, EventNames + NUM_EVENTS,
+                             [&](const char *N) { return Pair.first == N; });
+    double Cycles;
+    if (Name == EventNames + NUM_EVENTS ||
+        Pair.second.getAsDouble(Cycles)) {
+      errs() << "BOLT-ERROR: invalid -speedup-model-weights entry '" << Entry
+             << "', expected <event>=<cycles>\n";
+      exit(1);
+    }
+    Weights[Name - EventNames] = Cycles;
+  }
+  return Weights;
+}
+
+double getCycles(const Events &E, const std::vector<double> &Weights) {
+  double Cycles = 0.0;
+  for (unsigned I = 0; I < NUM_EVENTS; ++I)
+    Cycles += E.Count[I] * Weights[I];
+  return Cycles;
+}
+
+uint64_t getMispredicts(const BinaryFunction &BF) {
+  uint64_t Mispredicts = 0;
+  for (const auto *BB : BF.layout())
+    for (const auto &BI : BB->branch_info())
+      if (BI.MispredictedCount != BinaryBasicBlock::COUNT_NO_PROFILE)
+        Mispredicts += BI.MispredictedCount;
+  return Mispredicts;
+}
+
+void writeModelFile(const std::vector<double> &Weights) {
+  std::error_code EC;
+  raw_fd_ostream OS(opts::SpeedupModelFile, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-WARNING: " << EC.message() << ", unable to open "
+           << opts::SpeedupModelFile << " for output.\n";
+    return;
+  }
+
+  auto writeEvents = [&](const Events &E) {
+    OS << '{';
+    for (unsigned I = 0; I < NUM_EVENTS; ++I)
+      OS << (I ? ", " : "") << '"' << EventNames[I] << "\": "
+         << format("%.1lf", E.Count[I]);
+    OS << '}';
+  };
+
+  OS << "{\n  \"weights\": {";
+  for (unsigned I = 0; I < NUM_EVENTS; ++I)
+    OS << (I ? ", " : "") << '"' << EventNames[I] << "\": " << Weights[I];
+  OS << "},\n  \"cpi\": " << opts::SpeedupModelCPI
+     << ",\n  \"functions\": [";
+  bool First = true;
+  for (const auto &Entry : Records) {
+    OS << (First ? "" : ",") << "\n    {\"name\": \"";
+    OS.write_escaped(Entry.first);
+    OS << "\", \"before\": ";
+    writeEvents(Entry.second.Before);
+    OS << ", \"after\": ";
+    writeEvents(Entry.second.After);
+    OS << format(", \"cycles_saved\": %.1lf}",
+                 getCycles(Entry.second.Before, Weights) -
+                     getCycles(Entry.second.After, Weights));
+    First = false;
+  }
+  OS << "\n  ]\n}\n";
+}
+
+} // end anonymous namespace
+
+bool SpeedupModel::isEnabled() {
+  return opts::EstimateSpeedup;
+}
+
+void SpeedupModel::recordDynoStats(BinaryContext &BC,
+                                   bool AfterOptimizations) {
+  if (!isEnabled())
+    return;
+
+  // The workers fill their own entries, which are then merged by name since
+  // functions could be folded in between.
+  struct Entry {
+    DynoStats Stats{false};
+    uint64_t Mispredicts{0};
+  };
+  std::unordered_map<const BinaryFunction *, Entry> Entries;
+  for (auto &BFI : BC.getBinaryFunctions())
+    Entries[&BFI.second];
+
+  ParallelUtilities::WorkFuncTy WorkFun = [&](BinaryFunction &BF) {
+    auto &E = Entries.at(&BF);
+    E.Stats = getDynoStats(BF);
+    E.Mispredicts = getMispredicts(BF);
+  };
+  ParallelUtilities::PredicateTy SkipFunc = [&](const BinaryFunction &BF) {
+    return !BF.isSimple() || !BF.hasValidProfile();
+  };
+  ParallelUtilities::runOnEachFunction(
+      BC, ParallelUtilities::SchedulingPolicy::SP_BB_LINEAR, WorkFun, SkipFunc,
+      "SpeedupModel::recordDynoStats");
+
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    const auto &BF = BFI.second;
+    if (SkipFunc(BF))
+      continue;
+    const auto &E = Entries.at(&BF);
+    auto &Record = Records[BF.getPrintName()];
+    auto &Counts = AfterOptimizations ? Record.After : Record.Before;
+    Counts.Count[INSTRUCTIONS] = E.Stats[DynoStats::INSTRUCTIONS];
+    Counts.Count[TAKEN_BRANCHES] = E.Stats[DynoStats::ALL_TAKEN];
+    Counts.Count[MISPREDICTS] = E.Mispredicts;
+    Counts.Count[CALLS] = E.Stats[DynoStats::FUNCTION_CALLS];
+  }
+}
+
+void SpeedupModel::recordFetchMisses(const BinaryFunction &BF,
+                                     const FetchMisses &Input,
+                                     const FetchMisses &Output) {
+  auto &Record = Records[BF.getPrintName()];
+  auto setMisses = [](Events &E, const FetchMisses &Misses) {
+    E.Count[L1I_MISSES] = Misses.L1I;
+    E.Count[L2_MISSES] = Misses.L2;
+    E.Count[ITLB_MISSES] = Misses.ITLB;
+    E.Count[STLB_MISSES] = Misses.STLB;
+  };
+  setMisses(Record.Before, Input);
+  setMisses(Record.After, Output);
+}
+
+void SpeedupModel::printEstimate() {
+  if (!isEnabled() || Records.empty())
+    return;
+
+  const auto Weights = getWeights();
+  Events TotalBefore;
+  Events TotalAfter;
+  std::vector<std::pair<double, StringRef>> Saved;
+  for (const auto &Entry : Records) {
+    const auto &Record = Entry.second;
+    for (unsigned I = 0; I < NUM_EVENTS; ++I) {
+      TotalBefore.Count[I] += Record.Before.Count[I];
+      TotalAfter.Count[I] += Record.After.Count[I];
+    }
+    Saved.emplace_back(getCycles(Record.Before, Weights) -
+                           getCycles(Record.After, Weights),
+                       Entry.first);
+  }
+
+  const double CyclesSaved =
+      getCycles(TotalBefore, Weights) - getCycles(TotalAfter, Weights);
+  const double BaselineCycles =
+      TotalBefore.Count[INSTRUCTIONS] * opts::SpeedupModelCPI;
+
+  outs() << "BOLT-INFO: estimated cycles saved by the optimizations: "
+         << format("%.0lf", CyclesSaved);
+  if (BaselineCycles > CyclesSaved)
+    outs() << format(" (%.2lf%% of %.0lf baseline cycles, %.3lfx speedup)",
+                     100.0 * CyclesSaved / BaselineCycles, BaselineCycles,
+                     BaselineCycles / (BaselineCycles - CyclesSaved));
+  outs() << '\n';
+  for (unsigned I = 0; I < NUM_EVENTS; ++I)
+    outs() << format("  %-16s %18.0lf -> %18.0lf (%.0lf cycles saved)\n",
+                     EventNames[I], TotalBefore.Count[I], TotalAfter.Count[I],
+                     (TotalBefore.Count[I] - TotalAfter.Count[I]) * Weights[I]);
+
+  std::stable_sort(Saved.begin(), Saved.end(),
+                   [](const std::pair<double, StringRef> &A,
+                      const std::pair<double, StringRef> &B) {
+                     return A.first > B.first;
+                   });
+  const size_t Top = std::min<size_t>(opts::SpeedupModelTop, Saved.size());
+  auto printFunction = [&](const std::pair<double, StringRef> &F) {
+    outs() << format("    %16.0lf  ", F.first) << F.second << '\n';
+  };
+  outs() << "  Functions with the most estimated cycles saved:\n";
+  for (size_t I = 0; I < Top && Saved[I].first > 0; ++I)
+    printFunction(Saved[I]);
+  outs() << "  Functions with the most estimated cycles lost:\n";
+  for (size_t I = 0; I < Top && Saved[Saved.size() - 1 - I].first < 0; ++I)
+    printFunction(Saved[Saved.size() - 1 - I]);
+
+  if (!opts::SpeedupModelFile.empty())
+    writeModelFile(Weights);
+}
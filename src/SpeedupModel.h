@@ -0,0 +1,59 @@
+//===--- SpeedupModel.h - Estimate of cycles saved by BOLT ------*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Linear model of the cycles saved by BOLT in every function. The model
+// combines the change in dyno stats and branch mispredictions between the
+// input and the optimized code with the change in instruction cache and TLB
+// misses simulated for the input and the output code layouts. Every event is
+// weighted with a number of cycles that could be calibrated against measured
+// results with -speedup-model-weights and -speedup-model-cpi.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_SPEEDUP_MODEL_H
+#define LLVM_TOOLS_LLVM_BOLT_SPEEDUP_MODEL_H
+
+namespace llvm {
+namespace bolt {
+
+class BinaryContext;
+class BinaryFunction;
+
+namespace SpeedupModel {
+
+/// Instruction fetch misses of a function, scaled to the profiled execution.
+struct FetchMisses {
+  double L1I{0.0};
+  double L2{0.0};
+  double ITLB{0.0};
+  double STLB{0.0};
+};
+
+/// Return true if the speedup estimate was requested with -estimate-speedup.
+bool isEnabled();
+
+/// Record the dyno stats and mispredictions of every function with profile,
+/// before or after running the optimization passes.
+void recordDynoStats(BinaryContext &BC, bool AfterOptimizations);
+
+/// Record the simulated fetch misses of \p BF in the input and in the output
+/// code layouts.
+void recordFetchMisses(const BinaryFunction &BF, const FetchMisses &Input,
+                       const FetchMisses &Output);
+
+/// Print the estimate of cycles saved overall and in the functions that
+/// changed the most, and write the model inputs to -speedup-model-file.
+void printEstimate();
+
+} // namespace SpeedupModel
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
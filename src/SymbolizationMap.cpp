@@ -0,0 +1,193 @@
+//===--- SymbolizationMap.cpp ---------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "SymbolizationMap.h"
+#include "BinaryFunction.h"
+#include "llvm/DebugInfo/DWARF/DWARFDebugLine.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+
+#undef  DEBUG_TYPE
+#define DEBUG_TYPE "bolt"
+
+using namespace llvm;
+using namespace llvm::support::endian;
+
+namespace llvm {
+namespace bolt {
+
+constexpr uint32_t SymbolizationMapWriter::VERSION;
+
+uint32_t SymbolizationMapWriter::addString(StringRef Str) {
+  auto Result = StringOffsets.try_emplace(Str, StringTable.size());
+  if (Result.second) {
+    StringTable.append(Str.begin(), Str.end());
+    StringTable.push_back('\0');
+  }
+  return Result.first->second;
+}
+
+void SymbolizationMapWriter::addLine(uint64_t OutputAddress,
+                                     DebugLineTableRowRef RowRef,
+                                     const BinaryFunction &Function) {
+  auto *Unit = BC.DwCtx->getCompileUnitForOffset(RowRef.DwCompileUnitIndex);
+  if (!Unit)
+    return;
+  const auto *LineTable = BC.getLineTableForUnit(Unit);
+  if (!LineTable || !RowRef.RowIndex ||
+      RowRef.RowIndex > LineTable->Rows.size())
+    return;
+  const auto &Row = LineTable->Rows[RowRef.RowIndex - 1];
+
+  const auto FileKey = std::make_pair(RowRef.DwCompileUnitIndex,
+                                      static_cast<uint64_t>(Row.File));
+  auto FI = FileOffsets.find(FileKey);
+  if (FI == FileOffsets.end()) {
+    std::string FileName;
+    LineTable->getFileNameByIndex(
+        Row.File, Unit->getCompilationDir(),
+        DILineInfoSpecifier::FileLineInfoKind::AbsoluteFilePath, FileName);
+    FI = FileOffsets.try_emplace(FileKey, addString(FileName)).first;
+  }
+
+  uint32_t Flags = 0;
+  if (Function.getDWARFUnit() &&
+      Function.getDWARFUnit()->getOffset() != RowRef.DwCompileUnitIndex)
+    Flags |= LF_INLINED;
+
+  Lines.push_back({OutputAddress, FI->second, Row.Line, Row.Column, Flags});
+}
+
+void SymbolizationMapWriter::addFunction(const BinaryFunction &Function,
+                                         bool IsCold) {
+  const auto NameOffset = addString(Function.getOneName());
+  const auto *LineTable = Function.getDWARFLineTable();
+  for (const auto *BB : Function.layout()) {
+    if (BB->isCold() != IsCold)
+      continue;
+    const auto OutputRange = BB->getOutputAddressRange();
+    if (OutputRange.first >= OutputRange.second ||
+        BB->getInputOffset() == BinaryBasicBlock::INVALID_OFFSET)
+      continue;
+
+    // Offsets of instructions tracked for address translation split the
+    // block into ranges with exact input addresses.
+    std::vector<std::pair<uint32_t, uint32_t>> Points;
+    Points.emplace_back(0, BB->getInputOffset());
+    for (const auto &IOPair : BB->getOffsetTranslationTable()) {
+      if (IOPair.first)
+        Points.emplace_back(IOPair);
+    }
+    std::sort(Points.begin(), Points.end());
+
+    for (size_t I = 0; I < Points.size(); ++I) {
+      const auto Start = OutputRange.first + Points[I].first;
+      const auto End = I + 1 < Points.size()
+        ? OutputRange.first + Points[I + 1].first
+        : OutputRange.second;
+      if (Start >= End)
+        continue;
+      const auto InputAddress = Function.getAddress() + Points[I].second;
+      Ranges.push_back({Start, InputAddress,
+                        static_cast<uint32_t>(End - Start), NameOffset});
+
+      if (I == 0 || !LineTable)
+        continue;
+      const auto RowIndex = LineTable->lookupAddress(InputAddress);
+      if (RowIndex != LineTable->UnknownRowIndex) {
+        addLine(Start, DebugLineTableRowRef{
+                  Function.getDWARFUnit()->getOffset(), RowIndex + 1},
+                Function);
+      }
+    }
+
+    // Rows of instructions could come from other units, e.g. after inlining.
+    for (const auto &Inst : *BB) {
+      const auto RowRef = DebugLineTableRowRef::fromSMLoc(Inst.getLoc());
+      if (RowRef != DebugLineTableRowRef::NULL_ROW) {
+        addLine(OutputRange.first, RowRef, Function);
+        break;
+      }
+    }
+  }
+}
+
+void SymbolizationMapWriter::write(StringRef FileName) {
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    const auto &Function = BFI.second;
+    if (!Function.isEmitted())
+      continue;
+    addFunction(Function, /*IsCold=*/false);
+    if (Function.isSplit())
+      addFunction(Function, /*IsCold=*/true);
+  }
+
+  std::stable_sort(Ranges.begin(), Ranges.end(),
+                   [](const RangeRecord &A, const RangeRecord &B) {
+                     return A.OutputAddress < B.OutputAddress;
+                   });
+  std::stable_sort(Lines.begin(), Lines.end(),
+                   [](const LineRecord &A, const LineRecord &B) {
+                     return A.OutputAddress < B.OutputAddress;
+                   });
+
+  std::error_code EC;
+  raw_fd_ostream OS(FileName, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-ERROR: cannot open " << FileName << ": " << EC.message()
+           << '\n';
+    exit(1);
+  }
+
+  auto emit32 = [&OS](uint32_t Value) {
+    char Buffer[4];
+    write32le(Buffer, Value);
+    OS.write(Buffer, sizeof(Buffer));
+  };
+  auto emit64 = [&OS](uint64_t Value) {
+    char Buffer[8];
+    write64le(Buffer, Value);
+    OS.write(Buffer, sizeof(Buffer));
+  };
+
+  OS << "BSYM";
+  emit32(VERSION);
+  emit32(Ranges.size());
+  emit32(Lines.size());
+  emit32(StringTable.size());
+  emit32(0);
+
+  for (const auto &Range : Ranges) {
+    emit64(Range.OutputAddress);
+    emit64(Range.InputAddress);
+    emit32(Range.Size);
+    emit32(Range.NameOffset);
+  }
+
+  for (const auto &Line : Lines) {
+    emit64(Line.OutputAddress);
+    emit32(Line.FileOffset);
+    emit32(Line.Line);
+    emit32(Line.Column);
+    emit32(Line.Flags);
+  }
+
+  OS << StringTable;
+
+  outs() << "BOLT-INFO: wrote " << Ranges.size() << " address ranges and "
+         << Lines.size() << " line records to symbolization map "
+         << FileName << '\n';
+}
+
+} // namespace bolt
+} // namespace llvm
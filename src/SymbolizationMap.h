@@ -0,0 +1,110 @@
+//===--- SymbolizationMap.h -----------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_SYMBOLIZATION_MAP_H
+#define LLVM_TOOLS_LLVM_BOLT_SYMBOLIZATION_MAP_H
+
+#include "BinaryContext.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace llvm {
+namespace bolt {
+
+/// Writes a side file mapping addresses of the output binary to input
+/// addresses, function names and source lines, for symbolizers that cannot
+/// afford to parse DWARF or BAT tables. All records have a fixed size and are
+/// sorted by output address, so the file can be mapped in memory and searched
+/// with a binary search. All values are little-endian.
+///
+///   Header:
+///     char     Magic[4] = "BSYM"
+///     uint32_t Version = 1
+///     uint32_t NumRanges
+///     uint32_t NumLines
+///     uint32_t StringTableSize
+///     uint32_t Reserved
+///   RangeRecord Ranges[NumRanges]:
+///     uint64_t OutputAddress
+///     uint64_t InputAddress
+///     uint32_t Size
+///     uint32_t NameOffset      - function name in the string table
+///   LineRecord Lines[NumLines]:
+///     uint64_t OutputAddress
+///     uint32_t FileOffset      - file name in the string table
+///     uint32_t Line
+///     uint32_t Column
+///     uint32_t Flags           - LF_* values
+///   char StringTable[StringTableSize] - NUL-terminated strings
+///
+/// A range maps [OutputAddress, OutputAddress + Size) to input addresses that
+/// start at InputAddress. A line record applies to output addresses up to the
+/// next record.
+class SymbolizationMapWriter {
+public:
+  static constexpr uint32_t VERSION = 1;
+
+  enum LineFlags : uint32_t {
+    /// The line belongs to code inlined from another compilation unit.
+    LF_INLINED = 0x1,
+  };
+
+  explicit SymbolizationMapWriter(BinaryContext &BC) : BC(BC) {}
+
+  /// Collect records of all emitted functions and write them to \p FileName.
+  void write(StringRef FileName);
+
+private:
+  struct RangeRecord {
+    uint64_t OutputAddress;
+    uint64_t InputAddress;
+    uint32_t Size;
+    uint32_t NameOffset;
+  };
+
+  struct LineRecord {
+    uint64_t OutputAddress;
+    uint32_t FileOffset;
+    uint32_t Line;
+    uint32_t Column;
+    uint32_t Flags;
+  };
+
+  /// Add records of the cold fragment of \p Function if \p IsCold is set,
+  /// or of its main fragment otherwise.
+  void addFunction(const BinaryFunction &Function, bool IsCold);
+
+  /// Add a line record at \p OutputAddress for row \p RowRef.
+  void addLine(uint64_t OutputAddress, DebugLineTableRowRef RowRef,
+               const BinaryFunction &Function);
+
+  /// Return the offset of \p Str in the string table.
+  uint32_t addString(StringRef Str);
+
+  BinaryContext &BC;
+
+  std::vector<RangeRecord> Ranges;
+  std::vector<LineRecord> Lines;
+
+  std::string StringTable;
+  StringMap<uint32_t> StringOffsets;
+
+  /// Offsets of file names by unit offset and file index.
+  DenseMap<std::pair<uint32_t, uint64_t>, uint32_t> FileOffsets;
+};
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -15,6 +15,7 @@
 #include "MCPlusBuilder.h"
 #include "llvm/MC/MCAsmBackend.h"
 #include "llvm/MC/MCCodeEmitter.h"
+#include "llvm/MC/MCInstBuilder.h"
 #include "llvm/MC/MCInstrAnalysis.h"
 #include "llvm/MC/MCInstrInfo.h"
 #include "llvm/MC/MCRegisterInfo.h"
@@ -736,6 +737,11 @@ public:
     }
   }
 
+  uint64_t getBranchReach(const MCInst &Inst) const override {
+    // The immediate is signed and scaled by the instruction size.
+    return 1ULL << (getPCRelEncodingSize(Inst) - 1);
+  }
+
   int getShortJmpEncodingSize() const override {
     return 32;
   }
@@ -1049,6 +1055,207 @@ public:
     Inst.addOperand(MCOperand::createReg(AArch64::LR));
     return true;
   }
+
+  MCPhysReg getIntArgRegister(unsigned ArgNo) const override {
+    switch (ArgNo) {
+    case 0:   return AArch64::X0;
+    case 1:   return AArch64::X1;
+    case 2:   return AArch64::X2;
+    case 3:   return AArch64::X3;
+    case 4:   return AArch64::X4;
+    case 5:   return AArch64::X5;
+    case 6:   return AArch64::X6;
+    case 7:   return AArch64::X7;
+    default:  return getNoRegister();
+    }
+  }
+
+  /// Load the address of \p Target to \p Reg with an adrp/add pair.
+  void createLoadAddressPair(std::vector<MCInst> &Seq, const MCSymbol *Target,
+                             MCPhysReg Reg, MCContext *Ctx) const {
+    MCInst Inst;
+    Inst.setOpcode(AArch64::ADRP);
+    Inst.addOperand(MCOperand::createReg(Reg));
+    Inst.addOperand(MCOperand::createExpr(AArch64MCExpr::create(
+        MCSymbolRefExpr::create(Target, MCSymbolRefExpr::VK_None, *Ctx),
+        AArch64MCExpr::VK_ABS_PAGE, *Ctx)));
+    Seq.emplace_back(Inst);
+
+    Inst.clear();
+    Inst.setOpcode(AArch64::ADDXri);
+    Inst.addOperand(MCOperand::createReg(Reg));
+    Inst.addOperand(MCOperand::createReg(Reg));
+    Inst.addOperand(MCOperand::createExpr(AArch64MCExpr::create(
+        MCSymbolRefExpr::create(Target, MCSymbolRefExpr::VK_None, *Ctx),
+        AArch64MCExpr::VK_LO12, *Ctx)));
+    Inst.addOperand(MCOperand::createImm(0));
+    Seq.emplace_back(Inst);
+  }
+
+  /// Save the pair \p Reg1, \p Reg2 below the stack pointer.
+  void createPushPair(std::vector<MCInst> &Seq, MCPhysReg Reg1,
+                      MCPhysReg Reg2) const {
+    Seq.emplace_back(MCInstBuilder(AArch64::STPXpre)
+                         .addReg(AArch64::SP)
+                         .addReg(Reg1)
+                         .addReg(Reg2)
+                         .addReg(AArch64::SP)
+                         .addImm(-2));
+  }
+
+  /// Mirror of createPushPair().
+  void createPopPair(std::vector<MCInst> &Seq, MCPhysReg Reg1,
+                     MCPhysReg Reg2) const {
+    Seq.emplace_back(MCInstBuilder(AArch64::LDPXpost)
+                         .addReg(AArch64::SP)
+                         .addReg(Reg1)
+                         .addReg(Reg2)
+                         .addReg(AArch64::SP)
+                         .addImm(2));
+  }
+
+  std::vector<MCInst>
+  createInstrIncMemory(const MCSymbol *Target, MCContext *Ctx,
+                       bool IsAtomic) const override {
+    // There is no red zone and the sequence leaves NZCV alone, so only the
+    // scratch registers need to be saved:
+    //   stp x0, x1, [sp, #-16]!
+    //   adrp x0, Target
+    //   add x0, x0, :lo12:Target
+    //   mov x1, #1
+    //   stadd x1, [x0]       ;; or ldr/add/str if not atomic
+    //   ldp x0, x1, [sp], #16
+    // The atomic update needs LSE (ARMv8.1), which avoids the exclusive
+    // load/store loop and hence a branch in the middle of the counter.
+    std::vector<MCInst> Seq;
+    createPushPair(Seq, AArch64::X0, AArch64::X1);
+    createLoadAddressPair(Seq, Target, AArch64::X0, Ctx);
+    if (IsAtomic) {
+      Seq.emplace_back(MCInstBuilder(AArch64::MOVZXi)
+                           .addReg(AArch64::X1)
+                           .addImm(1)
+                           .addImm(0));
+      Seq.emplace_back(MCInstBuilder(AArch64::LDADDX)
+                           .addReg(AArch64::XZR)
+                           .addReg(AArch64::X1)
+                           .addReg(AArch64::X0));
+    } else {
+      Seq.emplace_back(MCInstBuilder(AArch64::LDRXui)
+                           .addReg(AArch64::X1)
+                           .addReg(AArch64::X0)
+                           .addImm(0));
+      Seq.emplace_back(MCInstBuilder(AArch64::ADDXri)
+                           .addReg(AArch64::X1)
+                           .addReg(AArch64::X1)
+                           .addImm(1)
+                           .addImm(0));
+      Seq.emplace_back(MCInstBuilder(AArch64::STRXui)
+                           .addReg(AArch64::X1)
+                           .addReg(AArch64::X0)
+                           .addImm(0));
+    }
+    createPopPair(Seq, AArch64::X0, AArch64::X1);
+    return Seq;
+  }
+
+  /// Create a call to the handler stored at \p HandlerFuncAddr with the value
+  /// of \p ValueReg and \p SiteID as arguments. The runtime handlers
+  /// preserve all registers but x0, x1 and the link register, which are saved
+  /// here:
+  ///   stp x0, x1, [sp, #-16]!
+  ///   str x30, [sp, #-16]!
+  ///   mov x0, ValueReg
+  ///   movz x1, #SiteID_lo
+  ///   movk x1, #SiteID_hi, lsl #16
+  ///   adrp x30, HandlerFuncAddr
+  ///   ldr x30, [x30, :lo12:HandlerFuncAddr]
+  ///   blr x30
+  ///   ldr x30, [sp], #16
+  ///   ldp x0, x1, [sp], #16
+  std::vector<MCInst> createHandlerCall(MCPhysReg ValueReg,
+                                        MCSymbol *HandlerFuncAddr, int SiteID,
+                                        MCContext *Ctx) const {
+    std::vector<MCInst> Seq;
+    createPushPair(Seq, AArch64::X0, AArch64::X1);
+    Seq.emplace_back(MCInstBuilder(AArch64::STRXpre)
+                         .addReg(AArch64::SP)
+                         .addReg(AArch64::LR)
+                         .addReg(AArch64::SP)
+                         .addImm(-16));
+    if (ValueReg != AArch64::X0)
+      Seq.emplace_back(MCInstBuilder(AArch64::ORRXrs)
+                           .addReg(AArch64::X0)
+                           .addReg(AArch64::XZR)
+                           .addReg(ValueReg)
+                           .addImm(0));
+    Seq.emplace_back(MCInstBuilder(AArch64::MOVZXi)
+                         .addReg(AArch64::X1)
+                         .addImm(SiteID & 0xffff)
+                         .addImm(0));
+    Seq.emplace_back(MCInstBuilder(AArch64::MOVKXi)
+                         .addReg(AArch64::X1)
+                         .addReg(AArch64::X1)
+                         .addImm((SiteID >> 16) & 0xffff)
+                         .addImm(16));
+    MCInst Inst;
+    Inst.setOpcode(AArch64::ADRP);
+    Inst.addOperand(MCOperand::createReg(AArch64::LR));
+    Inst.addOperand(MCOperand::createExpr(AArch64MCExpr::create(
+        MCSymbolRefExpr::create(HandlerFuncAddr, MCSymbolRefExpr::VK_None,
+                                *Ctx),
+        AArch64MCExpr::VK_ABS_PAGE, *Ctx)));
+    Seq.emplace_back(Inst);
+
+    Inst.clear();
+    Inst.setOpcode(AArch64::LDRXui);
+    Inst.addOperand(MCOperand::createReg(AArch64::LR));
+    Inst.addOperand(MCOperand::createReg(AArch64::LR));
+    Inst.addOperand(MCOperand::createExpr(AArch64MCExpr::create(
+        MCSymbolRefExpr::create(HandlerFuncAddr, MCSymbolRefExpr::VK_None,
+                                *Ctx),
+        AArch64MCExpr::VK_LO12, *Ctx)));
+    Seq.emplace_back(Inst);
+
+    Seq.emplace_back(MCInstBuilder(AArch64::BLR).addReg(AArch64::LR));
+    Seq.emplace_back(MCInstBuilder(AArch64::LDRXpost)
+                         .addReg(AArch64::SP)
+                         .addReg(AArch64::LR)
+                         .addReg(AArch64::SP)
+                         .addImm(16));
+    createPopPair(Seq, AArch64::X0, AArch64::X1);
+    return Seq;
+  }
+
+  std::vector<MCInst>
+  createInstrumentedIndirectCall(const MCInst &CallInst, bool TailCall,
+                                 MCSymbol *HandlerFuncAddr, int CallSiteID,
+                                 MCContext *Ctx) const override {
+    // Unlike on x86, the handler only records the target and returns, and the
+    // original call follows. This keeps the link register intact for tail
+    // calls, hence both kinds of calls use the same sequence.
+    assert(CallInst.getOperand(0).isReg() && "expected a register call");
+    std::vector<MCInst> Seq = createHandlerCall(
+        CallInst.getOperand(0).getReg(), HandlerFuncAddr, CallSiteID, Ctx);
+    Seq.emplace_back(CallInst);
+    return Seq;
+  }
+
+  std::vector<MCInst>
+  createInstrumentedValueProfile(MCPhysReg ValueReg, MCSymbol *HandlerFuncAddr,
+                                 int SiteID, MCContext *Ctx) const override {
+    return createHandlerCall(ValueReg, HandlerFuncAddr, SiteID, Ctx);
+  }
+
+  std::vector<MCInst> createInstrumentedNoopIndCallHandler() const override {
+    std::vector<MCInst> Insts(1);
+    createReturn(Insts[0]);
+    return Insts;
+  }
+
+  std::vector<MCInst>
+  createInstrumentedNoopIndTailCallHandler() const override {
+    return createInstrumentedNoopIndCallHandler();
+  }
 };
 
 } // end anonymous namespace
@@ -152,6 +152,29 @@ unsigned getShortArithOpcode(unsigned Opcode) {
   }
 }
 
+unsigned getCMovForBranchOpcode(unsigned Opcode) {
+  switch (Opcode) {
+  default:
+    return 0;
+  case X86::JE_1:  case X86::JE_2:  case X86::JE_4:  return X86::CMOVE64rr;
+  case X86::JNE_1: case X86::JNE_2: case X86::JNE_4: return X86::CMOVNE64rr;
+  case X86::JL_1:  case X86::JL_2:  case X86::JL_4:  return X86::CMOVL64rr;
+  case X86::JLE_1: case X86::JLE_2: case X86::JLE_4: return X86::CMOVLE64rr;
+  case X86::JG_1:  case X86::JG_2:  case X86::JG_4:  return X86::CMOVG64rr;
+  case X86::JGE_1: case X86::JGE_2: case X86::JGE_4: return X86::CMOVGE64rr;
+  case X86::JB_1:  case X86::JB_2:  case X86::JB_4:  return X86::CMOVB64rr;
+  case X86::JBE_1: case X86::JBE_2: case X86::JBE_4: return X86::CMOVBE64rr;
+  case X86::JA_1:  case X86::JA_2:  case X86::JA_4:  return X86::CMOVA64rr;
+  case X86::JAE_1: case X86::JAE_2: case X86::JAE_4: return X86::CMOVAE64rr;
+  case X86::JS_1:  case X86::JS_2:  case X86::JS_4:  return X86::CMOVS64rr;
+  case X86::JNS_1: case X86::JNS_2: case X86::JNS_4: return X86::CMOVNS64rr;
+  case X86::JP_1:  case X86::JP_2:  case X86::JP_4:  return X86::CMOVP64rr;
+  case X86::JNP_1: case X86::JNP_2: case X86::JNP_4: return X86::CMOVNP64rr;
+  case X86::JO_1:  case X86::JO_2:  case X86::JO_4:  return X86::CMOVO64rr;
+  case X86::JNO_1: case X86::JNO_2: case X86::JNO_4: return X86::CMOVNO64rr;
+  }
+}
+
 unsigned getInvertedBranchOpcode(unsigned Opcode) {
   switch (Opcode) {
   default:
@@ -2755,6 +2778,64 @@ public:
     return true;
   }
 
+  bool createSignExtLoad(MCInst &Inst, const MCPhysReg &BaseReg,
+                         int64_t Scale, const MCPhysReg &IndexReg,
+                         int64_t Offset, const MCExpr *OffsetExpr,
+                         const MCPhysReg &AddrSegmentReg,
+                         const MCPhysReg &DstReg, int Size) const override {
+    unsigned NewOpcode;
+    switch (Size) {
+      default:
+        return false;
+      case 1:      NewOpcode = X86::MOVSX64rm8; break;
+      case 2:      NewOpcode = X86::MOVSX64rm16; break;
+      case 4:      NewOpcode = X86::MOVSX64rm32; break;
+    }
+    Inst.setOpcode(NewOpcode);
+    Inst.clear();
+    Inst.addOperand(MCOperand::createReg(DstReg));
+    Inst.addOperand(MCOperand::createReg(BaseReg));
+    Inst.addOperand(MCOperand::createImm(Scale));
+    Inst.addOperand(MCOperand::createReg(IndexReg));
+    if (OffsetExpr)
+      Inst.addOperand(MCOperand::createExpr(OffsetExpr)); // Displacement
+    else
+      Inst.addOperand(MCOperand::createImm(Offset)); // Displacement
+    Inst.addOperand(MCOperand::createReg(AddrSegmentReg)); // AddrSegmentReg
+    return true;
+  }
+
+  bool createLoadAddress(MCInst &Inst, const MCSymbol *Target,
+                         const MCPhysReg &Reg,
+                         MCContext *Ctx) const override {
+    Inst.setOpcode(X86::LEA64r);
+    Inst.clear();
+    Inst.addOperand(MCOperand::createReg(Reg));
+    Inst.addOperand(MCOperand::createReg(X86::RIP));        // BaseReg
+    Inst.addOperand(MCOperand::createImm(1));               // ScaleAmt
+    Inst.addOperand(MCOperand::createReg(X86::NoRegister)); // IndexReg
+    Inst.addOperand(MCOperand::createExpr(
+        MCSymbolRefExpr::create(Target, MCSymbolRefExpr::VK_None,
+                                *Ctx)));                    // Displacement
+    Inst.addOperand(MCOperand::createReg(X86::NoRegister)); // AddrSegmentReg
+    return true;
+  }
+
+  bool createPrefetch(MCInst &Inst, const MCPhysReg &BaseReg, int64_t Scale,
+                      const MCPhysReg &IndexReg, int64_t Offset,
+                      const MCPhysReg &AddrSegmentReg) const override {
+    if (!isInt<32>(Offset))
+      return false;
+    Inst.setOpcode(X86::PREFETCHT0);
+    Inst.clear();
+    Inst.addOperand(MCOperand::createReg(BaseReg));
+    Inst.addOperand(MCOperand::createImm(Scale));
+    Inst.addOperand(MCOperand::createReg(IndexReg));
+    Inst.addOperand(MCOperand::createImm(Offset)); // Displacement
+    Inst.addOperand(MCOperand::createReg(AddrSegmentReg)); // AddrSegmentReg
+    return true;
+  }
+
   void createLoadImmediate(MCInst &Inst, const MCPhysReg Dest,
                            uint32_t Imm) const override {
     Inst.setOpcode(X86::MOV64ri32);
@@ -2764,9 +2845,9 @@ public:
   }
 
   bool createIncMemory(MCInst &Inst, const MCSymbol *Target,
-                       MCContext *Ctx) const override {
+                       MCContext *Ctx, bool IsAtomic) const override {
 
-    Inst.setOpcode(X86::LOCK_INC64m);
+    Inst.setOpcode(IsAtomic ? X86::LOCK_INC64m : X86::INC64m);
     Inst.clear();
     Inst.addOperand(MCOperand::createReg(X86::RIP));        // BaseReg
     Inst.addOperand(MCOperand::createImm(1));               // ScaleAmt
@@ -2779,6 +2860,66 @@ public:
     return true;
   }
 
+  std::vector<MCInst>
+  createShardedIncMemory(const MCSymbol *Target, const MCSymbol *ShardStride,
+                         unsigned NumShards, MCContext *Ctx,
+                         bool IsAtomic) const override {
+    assert(isPowerOf2_32(NumShards) && "number of shards must be power of 2");
+    // The CPU number is read the same way vDSO getcpu() does it on Linux,
+    // from the limit of the per-CPU segment descriptor. If LSL fails, %eax
+    // keeps the selector and we simply use a fixed shard:
+    //   push %rax
+    //   push %rcx
+    //   mov $0x7b, %eax
+    //   lsl %eax, %eax
+    //   and $(NumShards - 1), %eax
+    //   imul ShardStride(%rip), %rax
+    //   lea Target(%rip), %rcx
+    //   lock incq (%rcx,%rax)
+    //   pop %rcx
+    //   pop %rax
+    std::vector<MCInst> Insts(10);
+    createPushRegister(Insts[0], X86::RAX, 8);
+    createPushRegister(Insts[1], X86::RCX, 8);
+
+    Insts[2].setOpcode(X86::MOV32ri);
+    Insts[2].addOperand(MCOperand::createReg(X86::EAX));
+    Insts[2].addOperand(MCOperand::createImm(0x7b));
+
+    Insts[3].setOpcode(X86::LSL32rr);
+    Insts[3].addOperand(MCOperand::createReg(X86::EAX));
+    Insts[3].addOperand(MCOperand::createReg(X86::EAX));
+
+    Insts[4].setOpcode(X86::AND32ri);
+    Insts[4].addOperand(MCOperand::createReg(X86::EAX));
+    Insts[4].addOperand(MCOperand::createReg(X86::EAX));
+    Insts[4].addOperand(MCOperand::createImm(NumShards - 1));
+
+    Insts[5].setOpcode(X86::IMUL64rm);
+    Insts[5].addOperand(MCOperand::createReg(X86::RAX));
+    Insts[5].addOperand(MCOperand::createReg(X86::RAX));
+    Insts[5].addOperand(MCOperand::createReg(X86::RIP));        // BaseReg
+    Insts[5].addOperand(MCOperand::createImm(1));               // ScaleAmt
+    Insts[5].addOperand(MCOperand::createReg(X86::NoRegister)); // IndexReg
+    Insts[5].addOperand(MCOperand::createExpr(
+        MCSymbolRefExpr::create(ShardStride, MCSymbolRefExpr::VK_None,
+                                *Ctx)));                        // Displacement
+    Insts[5].addOperand(MCOperand::createReg(X86::NoRegister));//AddrSegmentReg
+
+    createLoadAddress(Insts[6], Target, X86::RCX, Ctx);
+
+    Insts[7].setOpcode(IsAtomic ? X86::LOCK_INC64m : X86::INC64m);
+    Insts[7].addOperand(MCOperand::createReg(X86::RCX));        // BaseReg
+    Insts[7].addOperand(MCOperand::createImm(1));               // ScaleAmt
+    Insts[7].addOperand(MCOperand::createReg(X86::RAX));        // IndexReg
+    Insts[7].addOperand(MCOperand::createImm(0));               // Displacement
+    Insts[7].addOperand(MCOperand::createReg(X86::NoRegister));//AddrSegmentReg
+
+    createPopRegister(Insts[8], X86::RCX, 8);
+    createPopRegister(Insts[9], X86::RAX, 8);
+    return Insts;
+  }
+
   bool createIJmp32Frag(SmallVectorImpl<MCInst> &Insts,
                         const MCOperand &BaseReg, const MCOperand &Scale,
                         const MCOperand &IndexReg, const MCOperand &Offset,
@@ -2861,6 +3002,92 @@ public:
     return Code;
   }
 
+  std::vector<MCInst> createFixedSizeMemcpy(uint64_t Size) const override {
+    std::vector<MCInst> Code;
+    uint64_t Offset = 0;
+    while (Offset < Size) {
+      unsigned LoadOpcode, StoreOpcode;
+      MCPhysReg TempReg;
+      uint64_t Chunk;
+      if (Size - Offset >= 8) {
+        LoadOpcode = X86::MOV64rm; StoreOpcode = X86::MOV64mr;
+        TempReg = X86::RCX; Chunk = 8;
+      } else if (Size - Offset >= 4) {
+        LoadOpcode = X86::MOV32rm; StoreOpcode = X86::MOV32mr;
+        TempReg = X86::ECX; Chunk = 4;
+      } else if (Size - Offset >= 2) {
+        LoadOpcode = X86::MOV16rm; StoreOpcode = X86::MOV16mr;
+        TempReg = X86::CX; Chunk = 2;
+      } else {
+        LoadOpcode = X86::MOV8rm; StoreOpcode = X86::MOV8mr;
+        TempReg = X86::CL; Chunk = 1;
+      }
+      Code.emplace_back(MCInstBuilder(LoadOpcode)
+                            .addReg(TempReg)
+                            .addReg(X86::RSI)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addImm(Offset)
+                            .addReg(X86::NoRegister));
+      Code.emplace_back(MCInstBuilder(StoreOpcode)
+                            .addReg(X86::RDI)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addImm(Offset)
+                            .addReg(X86::NoRegister)
+                            .addReg(TempReg));
+      Offset += Chunk;
+    }
+    Code.emplace_back(MCInstBuilder(X86::MOV64rr)
+                          .addReg(X86::RAX)
+                          .addReg(X86::RDI));
+    return Code;
+  }
+
+  std::vector<MCInst> createFixedSizeMemset(uint64_t Size) const override {
+    std::vector<MCInst> Code;
+    if (Size) {
+      // Replicate the low byte of the fill value across %rcx.
+      Code.emplace_back(MCInstBuilder(X86::MOVZX32rr8)
+                            .addReg(X86::ECX)
+                            .addReg(X86::SIL));
+      Code.emplace_back(MCInstBuilder(X86::MOV64ri)
+                            .addReg(X86::RAX)
+                            .addImm(0x0101010101010101ULL));
+      Code.emplace_back(MCInstBuilder(X86::IMUL64rr)
+                            .addReg(X86::RCX)
+                            .addReg(X86::RCX)
+                            .addReg(X86::RAX));
+    }
+    uint64_t Offset = 0;
+    while (Offset < Size) {
+      unsigned StoreOpcode;
+      MCPhysReg TempReg;
+      uint64_t Chunk;
+      if (Size - Offset >= 8) {
+        StoreOpcode = X86::MOV64mr; TempReg = X86::RCX; Chunk = 8;
+      } else if (Size - Offset >= 4) {
+        StoreOpcode = X86::MOV32mr; TempReg = X86::ECX; Chunk = 4;
+      } else if (Size - Offset >= 2) {
+        StoreOpcode = X86::MOV16mr; TempReg = X86::CX; Chunk = 2;
+      } else {
+        StoreOpcode = X86::MOV8mr; TempReg = X86::CL; Chunk = 1;
+      }
+      Code.emplace_back(MCInstBuilder(StoreOpcode)
+                            .addReg(X86::RDI)
+                            .addImm(1)
+                            .addReg(X86::NoRegister)
+                            .addImm(Offset)
+                            .addReg(X86::NoRegister)
+                            .addReg(TempReg));
+      Offset += Chunk;
+    }
+    Code.emplace_back(MCInstBuilder(X86::MOV64rr)
+                          .addReg(X86::RAX)
+                          .addReg(X86::RDI));
+    return Code;
+  }
+
   std::vector<MCInst>
   createCmpJE(MCPhysReg RegNo, int64_t Imm, const MCSymbol *Target,
               MCContext *Ctx) const override {
@@ -2876,6 +3103,95 @@ public:
     return Code;
   }
 
+  std::vector<MCInst>
+  createCmpMemZeroJE(const MCSymbol *Flag, const MCSymbol *Target,
+                     MCContext *Ctx) const override {
+    std::vector<MCInst> Code;
+    Code.emplace_back(MCInstBuilder(X86::CMP8mi)
+                          .addReg(X86::RIP)          // BaseReg
+                          .addImm(1)                 // ScaleAmt
+                          .addReg(X86::NoRegister)   // IndexReg
+                          .addExpr(MCSymbolRefExpr::create(
+                            Flag,
+                            MCSymbolRefExpr::VK_None,
+                            *Ctx))                   // Displacement
+                          .addReg(X86::NoRegister)   // AddrSegmentReg
+                          .addImm(0));
+    Code.emplace_back(MCInstBuilder(X86::JE_1)
+                          .addExpr(MCSymbolRefExpr::create(
+                            Target,
+                            MCSymbolRefExpr::VK_None,
+                            *Ctx)));
+    return Code;
+  }
+
+  std::vector<MCInst>
+  createCmpMem32ZeroJNE(const MCSymbol *Slot, const MCSymbol *Target,
+                        MCContext *Ctx) const override {
+    std::vector<MCInst> Code;
+    Code.emplace_back(MCInstBuilder(X86::CMP32mi8)
+                          .addReg(X86::RIP)          // BaseReg
+                          .addImm(1)                 // ScaleAmt
+                          .addReg(X86::NoRegister)   // IndexReg
+                          .addExpr(MCSymbolRefExpr::create(
+                            Slot,
+                            MCSymbolRefExpr::VK_None,
+                            *Ctx))                   // Displacement
+                          .addReg(X86::NoRegister)   // AddrSegmentReg
+                          .addImm(0));
+    Code.emplace_back(MCInstBuilder(X86::JNE_1)
+                          .addExpr(MCSymbolRefExpr::create(
+                            Target,
+                            MCSymbolRefExpr::VK_None,
+                            *Ctx)));
+    return Code;
+  }
+
+  std::vector<MCInst>
+  createStoreNextSequenceNumber(const MCSymbol *Slot, const MCSymbol *Sequence,
+                                MCContext *Ctx) const override {
+    // The code fragment we emit here is:
+    //
+    //   push %rax
+    //   mov $1, %eax
+    //   lock xadd %eax, Sequence(%rip)
+    //   inc %eax
+    //   mov %eax, Slot(%rip)
+    //   pop %rax
+    std::vector<MCInst> Code(2);
+    createPushRegister(Code[0], X86::RAX, 8);
+    Code[1].setOpcode(X86::MOV32ri);
+    Code[1].addOperand(MCOperand::createReg(X86::EAX));
+    Code[1].addOperand(MCOperand::createImm(1));
+    Code.emplace_back(MCInstBuilder(X86::LXADD32)
+                          .addReg(X86::EAX)
+                          .addReg(X86::EAX)
+                          .addReg(X86::RIP)          // BaseReg
+                          .addImm(1)                 // ScaleAmt
+                          .addReg(X86::NoRegister)   // IndexReg
+                          .addExpr(MCSymbolRefExpr::create(
+                            Sequence,
+                            MCSymbolRefExpr::VK_None,
+                            *Ctx))                   // Displacement
+                          .addReg(X86::NoRegister)); // AddrSegmentReg
+    Code.emplace_back(MCInstBuilder(X86::INC32r)
+                          .addReg(X86::EAX)
+                          .addReg(X86::EAX));
+    Code.emplace_back(MCInstBuilder(X86::MOV32mr)
+                          .addReg(X86::RIP)          // BaseReg
+                          .addImm(1)                 // ScaleAmt
+                          .addReg(X86::NoRegister)   // IndexReg
+                          .addExpr(MCSymbolRefExpr::create(
+                            Slot,
+                            MCSymbolRefExpr::VK_None,
+                            *Ctx))                   // Displacement
+                          .addReg(X86::NoRegister)   // AddrSegmentReg
+                          .addReg(X86::EAX));
+    Code.emplace_back();
+    createPopRegister(Code.back(), X86::RAX, 8);
+    return Code;
+  }
+
   Optional<Relocation>
   createRelocation(const MCFixup &Fixup,
                    const MCAsmBackend &MAB) const override {
@@ -3012,6 +3328,31 @@ public:
     return true;
   }
 
+  bool createCMov(MCInst &Inst, const MCInst &CondBranch, MCPhysReg Dst,
+                  MCPhysReg Src, bool Invert) const override {
+    auto BranchOpcode = CondBranch.getOpcode();
+    switch (BranchOpcode) {
+    case X86::LOOP:
+    case X86::LOOPE:
+    case X86::LOOPNE:
+    case X86::JECXZ:
+    case X86::JRCXZ:
+      return false;
+    }
+    if (Invert)
+      BranchOpcode = getInvertedBranchOpcode(BranchOpcode);
+    const auto Opcode = getCMovForBranchOpcode(BranchOpcode);
+    if (!Opcode)
+      return false;
+
+    Inst.clear();
+    Inst.setOpcode(Opcode);
+    Inst.addOperand(MCOperand::createReg(Dst));
+    Inst.addOperand(MCOperand::createReg(Dst));
+    Inst.addOperand(MCOperand::createReg(Src));
+    return true;
+  }
+
   unsigned getCanonicalBranchOpcode(unsigned Opcode) const override {
     switch (Opcode) {
     default:
@@ -3293,6 +3634,108 @@ public:
     return Insts;
   }
 
+  std::vector<MCInst>
+  createInstrumentedValueProfile(MCPhysReg ValueReg, MCSymbol *HandlerFuncAddr,
+                                 int SiteID, MCContext *Ctx) const override {
+    std::vector<MCInst> Insts;
+    MCPhysReg TempReg = getIntArgRegister(0);
+    // Code sequence used to enter value profiling helper. The red zone is
+    // already dead at a call site, so we are free to push:
+    //   push %rdi
+    //   push ValueReg
+    //   movq $SiteID, %rdi
+    //   push %rdi
+    //   callq *HandlerFuncAddr
+    //   lea 16(%rsp), %rsp
+    //   pop %rdi
+    Insts.emplace_back();
+    createPushRegister(Insts.back(), TempReg, 8);
+    Insts.emplace_back();
+    createPushRegister(Insts.back(), ValueReg, 8);
+    Insts.emplace_back();
+    createLoadImmediate(Insts.back(), TempReg, SiteID);
+    Insts.emplace_back();
+    createPushRegister(Insts.back(), TempReg, 8);
+    Insts.emplace_back();
+    createIndirectCall(Insts.back(), HandlerFuncAddr, Ctx,
+                       /*TailCall=*/false);
+    Insts.emplace_back();
+    createStackPointerDecrement(Insts.back(), 16, /*NoFlagsClobber=*/true);
+    Insts.emplace_back();
+    createPopRegister(Insts.back(), TempReg, 8);
+    return Insts;
+  }
+
+  std::vector<MCInst>
+  createInstrumentedMemoryAccess(const MCInst &Inst, MCSymbol *HandlerFuncAddr,
+                                 int SiteID, MCContext *Ctx) const override {
+    if (isPush(Inst) || isPop(Inst) || isCall(Inst) || isBranch(Inst) ||
+        (!isLoad(Inst) && !isStore(Inst)))
+      return {};
+    unsigned BaseReg, IndexReg, SegmentReg;
+    int64_t ScaleImm, DispImm;
+    const MCExpr *DispExpr;
+    if (!evaluateX86MemoryOperand(Inst, &BaseReg, &ScaleImm, &IndexReg,
+                                  &DispImm, &SegmentReg, &DispExpr))
+      return {};
+    // Only plain 64-bit addressing can be recomputed with a lea. RIP-relative
+    // operands must be symbolic, since the lea is at a different address.
+    const auto &GR64 = RegInfo->getRegClass(X86::GR64RegClassID);
+    if (SegmentReg != X86::NoRegister || BaseReg == X86::RSP ||
+        (BaseReg == X86::RIP && !DispExpr) ||
+        (BaseReg != X86::NoRegister && BaseReg != X86::RIP &&
+         !GR64.contains(BaseReg)) ||
+        (IndexReg != X86::NoRegister && !GR64.contains(IndexReg)))
+      return {};
+
+    std::vector<MCInst> Insts;
+    MCPhysReg TempReg = getIntArgRegister(0);
+    // Same as the value profiling sequence, with the address as the value and
+    // the red zone skipped since this can be anywhere in a leaf function:
+    //   lea -128(%rsp), %rsp
+    //   push %rdi
+    //   lea Mem, %rdi
+    //   push %rdi
+    //   movq $SiteID, %rdi
+    //   push %rdi
+    //   callq *HandlerFuncAddr
+    //   lea 16(%rsp), %rsp
+    //   pop %rdi
+    //   lea 128(%rsp), %rsp
+    Insts.emplace_back();
+    createStackPointerIncrement(Insts.back(), 128, /*NoFlagsClobber=*/true);
+    Insts.emplace_back();
+    createPushRegister(Insts.back(), TempReg, 8);
+    MCInst Lea;
+    Lea.setOpcode(X86::LEA64r);
+    Lea.addOperand(MCOperand::createReg(TempReg));
+    Lea.addOperand(MCOperand::createReg(BaseReg));
+    Lea.addOperand(MCOperand::createImm(ScaleImm));
+    Lea.addOperand(MCOperand::createReg(IndexReg));
+    if (DispExpr)
+      Lea.addOperand(MCOperand::createExpr(DispExpr));
+    else
+      Lea.addOperand(MCOperand::createImm(DispImm));
+    Lea.addOperand(MCOperand::createReg(X86::NoRegister));
+    Insts.emplace_back(Lea);
+    Insts.emplace_back();
+    createPushRegister(Insts.back(), TempReg, 8);
+    Insts.emplace_back();
+    createLoadImmediate(Insts.back(), TempReg, SiteID);
+    Insts.emplace_back();
+    createPushRegister(Insts.back(), TempReg, 8);
+    Insts.emplace_back();
+    createIndirectCall(Insts.back(), HandlerFuncAddr, Ctx,
+                       /*TailCall=*/false);
+    Insts.emplace_back();
+    createStackPointerDecrement(Insts.back(), 16, /*NoFlagsClobber=*/true);
+    Insts.emplace_back();
+    createPopRegister(Insts.back(), TempReg, 8);
+    Insts.emplace_back();
+    createStackPointerDecrement(Insts.back(), 128, /*NoFlagsClobber=*/true);
+    return Insts;
+  }
+
   std::vector<MCInst>
   createInstrumentedNoopIndCallHandler() const override {
     const MCPhysReg TempReg = getIntArgRegister(0);
@@ -3574,7 +4017,7 @@ public:
     MCContext *Ctx
   ) const override {
     assert(getJumpTable(IJmpInst) != 0);
-    uint16_t IndexReg = getAnnotationAs<uint16_t>(IJmpInst, "JTIndexReg");
+    uint16_t IndexReg = getAnnotationAs(IJmpInst, MCPlus::JTIndexRegAnnotation);
     if (IndexReg == 0)
       return BlocksVectorTy();
 
@@ -0,0 +1,186 @@
+//===--- Telemetry.cpp - Resource usage report of BOLT phases -------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+//===----------------------------------------------------------------------===//
+
+#include "Telemetry.h"
+#include "ParallelUtilities.h"
+#include "Progress.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/raw_ostream.h"
+#include <mutex>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+using namespace llvm;
+using namespace bolt;
+
+namespace opts {
+
+extern cl::OptionCategory BoltCategory;
+
+static cl::opt<std::string>
+TelemetryFile("telemetry-file",
+  cl::desc("write wall time, CPU time and memory usage of every rewriting "
+           "phase and optimization pass to a JSON file"),
+  cl::value_desc("filename"),
+  cl::cat(BoltCategory));
+
+} // namespace opts
+
+namespace {
+
+struct TelemetryRecord {
+  std::string Group;
+  std::string Name;
+  double WallTime;
+  double CPUTime;
+  uint64_t MaxRSS;
+  int64_t MaxRSSDelta;
+  int64_t MallocDelta;
+};
+
+struct SectionRecord {
+  std::string Name;
+  std::string Kind;
+  uint64_t Size;
+};
+
+std::mutex RecordsMutex;
+std::vector<TelemetryRecord> Records;
+std::vector<SectionRecord> SectionRecords;
+
+/// Return user and system time of the process in seconds.
+double getCPUTime() {
+  sys::TimePoint<> Now;
+  std::chrono::nanoseconds UserTime;
+  std::chrono::nanoseconds SystemTime;
+  sys::Process::GetTimeUsage(Now, UserTime, SystemTime);
+  return std::chrono::duration<double>(UserTime + SystemTime).count();
+}
+
+/// Return the peak resident set size of the process in bytes, or 0 if it is
+/// not available on the host.
+uint64_t getMaxRSS() {
+#if defined(__unix__) || defined(__APPLE__)
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage))
+    return 0;
+#if defined(__APPLE__)
+  return Usage.ru_maxrss;
+#else
+  return static_cast<uint64_t>(Usage.ru_maxrss) * 1024;
+#endif
+#else
+  return 0;
+#endif
+}
+
+} // anonymous namespace
+
+TelemetryScope::TelemetryScope(StringRef Group, StringRef Name)
+  : Enabled(Telemetry::isEnabled()) {
+  Progress::enterPhase(Name);
+  if (!Enabled)
+    return;
+  this->Group = Group.str();
+  this->Name = Name.str();
+  StartTime = std::chrono::steady_clock::now();
+  StartCPUTime = getCPUTime();
+  StartMaxRSS = getMaxRSS();
+  StartMallocUsage = sys::Process::GetMallocUsage();
+}
+
+TelemetryScope::~TelemetryScope() {
+  Progress::exitPhase();
+  if (!Enabled)
+    return;
+  TelemetryRecord Record;
+  Record.Group = std::move(Group);
+  Record.Name = std::move(Name);
+  Record.WallTime = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - StartTime).count();
+  Record.CPUTime = getCPUTime() - StartCPUTime;
+  Record.MaxRSS = getMaxRSS();
+  Record.MaxRSSDelta = Record.MaxRSS - StartMaxRSS;
+  Record.MallocDelta = sys::Process::GetMallocUsage() - StartMallocUsage;
+
+  std::lock_guard<std::mutex> Lock(RecordsMutex);
+  Records.emplace_back(std::move(Record));
+}
+
+namespace llvm {
+namespace bolt {
+namespace Telemetry {
+
+bool isEnabled() {
+  return !opts::TelemetryFile.empty();
+}
+
+void recordSectionAllocation(StringRef Name, StringRef Kind, uint64_t Size) {
+  if (!isEnabled())
+    return;
+  std::lock_guard<std::mutex> Lock(RecordsMutex);
+  SectionRecords.emplace_back(SectionRecord{Name.str(), Kind.str(), Size});
+}
+
+void writeReport() {
+  if (!isEnabled())
+    return;
+
+  std::error_code EC;
+  raw_fd_ostream OS(opts::TelemetryFile, EC, sys::fs::F_None);
+  if (EC) {
+    errs() << "BOLT-WARNING: cannot write telemetry to " << opts::TelemetryFile
+           << ": " << EC.message() << '\n';
+    return;
+  }
+
+  const unsigned NumThreads = opts::NoThreads ? 1 : opts::ThreadCount;
+
+  std::lock_guard<std::mutex> Lock(RecordsMutex);
+  OS << "{\n  \"threads\": " << NumThreads << ",\n  \"records\": [";
+  const char *Separator = "\n";
+  for (const auto &Record : Records) {
+    // Share of the available thread time spent on the CPU.
+    const double Efficiency =
+      Record.WallTime > 0 ? Record.CPUTime / (Record.WallTime * NumThreads)
+                          : 0.0;
+    OS << Separator << "    {\"group\": \"";
+    OS.write_escaped(Record.Group);
+    OS << "\", \"name\": \"";
+    OS.write_escaped(Record.Name);
+    OS << "\", \"wall_time\": " << format("%.6f", Record.WallTime)
+       << ", \"cpu_time\": " << format("%.6f", Record.CPUTime)
+       << ", \"parallel_efficiency\": " << format("%.3f", Efficiency)
+       << ", \"max_rss\": " << Record.MaxRSS
+       << ", \"max_rss_delta\": " << Record.MaxRSSDelta
+       << ", \"malloc_delta\": " << Record.MallocDelta << "}";
+    Separator = ",\n";
+  }
+  OS << "\n  ],\n  \"sections\": [";
+  Separator = "\n";
+  for (const auto &Record : SectionRecords) {
+    OS << Separator << "    {\"name\": \"";
+    OS.write_escaped(Record.Name);
+    OS << "\", \"kind\": \"" << Record.Kind
+       << "\", \"size\": " << Record.Size << "}";
+    Separator = ",\n";
+  }
+  OS << "\n  ]\n}\n";
+}
+
+} // namespace Telemetry
+} // namespace bolt
+} // namespace llvm
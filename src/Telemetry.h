@@ -0,0 +1,60 @@
+//===--- Telemetry.h - Resource usage report of BOLT phases -----*- C++ -*-===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Collection of wall time, CPU time and memory usage of rewriting phases and
+// optimization passes. The records are written as a JSON report at the end of
+// the run when -telemetry-file is specified.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef LLVM_TOOLS_LLVM_BOLT_TELEMETRY_H
+#define LLVM_TOOLS_LLVM_BOLT_TELEMETRY_H
+
+#include "llvm/ADT/StringRef.h"
+#include <chrono>
+#include <string>
+
+namespace llvm {
+namespace bolt {
+
+/// Record resource usage of the enclosing scope under \p Name in \p Group.
+/// Scopes could be nested, in which case the usage of the inner scope is
+/// included in the outer one.
+class TelemetryScope {
+  bool Enabled;
+  std::string Group;
+  std::string Name;
+  std::chrono::steady_clock::time_point StartTime;
+  double StartCPUTime{0.0};
+  uint64_t StartMaxRSS{0};
+  uint64_t StartMallocUsage{0};
+
+public:
+  TelemetryScope(StringRef Group, StringRef Name);
+  ~TelemetryScope();
+};
+
+namespace Telemetry {
+
+/// Return true if telemetry records are collected.
+bool isEnabled();
+
+/// Record an allocation of \p Size bytes for the emitted section \p Name of
+/// kind \p Kind, e.g. "code" or "note".
+void recordSectionAllocation(StringRef Name, StringRef Kind, uint64_t Size);
+
+/// Write the collected records to the file specified with -telemetry-file.
+void writeReport();
+
+} // namespace Telemetry
+
+} // namespace bolt
+} // namespace llvm
+
+#endif
@@ -12,10 +12,14 @@
 #include "BinaryBasicBlock.h"
 #include "BinaryFunction.h"
 #include "Passes/MCF.h"
+#include "ParallelUtilities.h"
+#include "ProfileBinaryEncoding.h"
 #include "YAMLProfileReader.h"
 #include "ProfileYAMLMapping.h"
 #include "Utils.h"
+#include "llvm/ADT/Hashing.h"
 #include "llvm/Support/CommandLine.h"
+#include <unordered_map>
 
 using namespace llvm;
 
@@ -32,6 +36,31 @@ IgnoreHash("profile-ignore-hash",
   cl::Hidden,
   cl::cat(BoltOptCategory));
 
+static llvm::cl::opt<bool>
+InferStaleProfile("infer-stale-profile",
+  cl::desc("apply profiles of functions that changed since profiling by "
+           "matching their blocks to blocks with the same instruction hash"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static llvm::cl::opt<bool>
+ReportStaleMatching("report-stale-matching",
+  cl::desc("print the sampled weight matched by block hashes for every "
+           "function with a stale profile"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::cat(BoltOptCategory));
+
+static llvm::cl::opt<bool>
+MatchProfileWithFunctionHash("match-profile-with-function-hash",
+  cl::desc("match functions left without a profile after matching by name "
+           "to unused profiles with the same hash"),
+  cl::init(false),
+  cl::ZeroOrMore,
+  cl::Hidden,
+  cl::cat(BoltOptCategory));
+
 }
 
 namespace llvm {
@@ -42,7 +71,7 @@ bool YAMLProfileReader::isYAML(const StringRef Filename) {
   if (std::error_code EC = MB.getError())
     report_error(Filename, EC);
   auto Buffer = MB.get()->getBuffer();
-  if (Buffer.startswith("---\n"))
+  if (Buffer.startswith("---\n") || isBinaryEncodedProfile(Buffer))
     return true;
   return false;
 }
@@ -54,7 +83,10 @@ void YAMLProfileReader::buildNameMaps(
     const auto Pos = Name.find("(*");
     if (Pos != StringRef::npos)
       Name = Name.substr(0, Pos);
-    ProfileNameToProfile[Name] = &YamlBF;
+    const auto ID = Names.getID(Name);
+    if (ID >= ProfileNameToProfile.size())
+      ProfileNameToProfile.resize(ID + 1);
+    ProfileNameToProfile[ID] = &YamlBF;
     if (const auto CommonName = getLTOCommonName(Name)) {
       LTOCommonNameMap[*CommonName].push_back(&YamlBF);
     }
@@ -70,8 +102,10 @@ void YAMLProfileReader::buildNameMaps(
 }
 
 bool YAMLProfileReader::hasLocalsWithFileName() const {
-  for (const auto &KV : ProfileNameToProfile) {
-    const auto &FuncName = KV.getKey();
+  for (uint32_t ID = 0; ID < ProfileNameToProfile.size(); ++ID) {
+    if (!ProfileNameToProfile[ID])
+      continue;
+    const auto FuncName = Names.getName(ID);
     if (FuncName.count('/') == 2 && FuncName[0] != '/')
       return true;
   }
@@ -92,7 +126,7 @@ bool YAMLProfileReader::parseFunctionProfile(
 
   BF.setExecutionCount(YamlBF.ExecCount);
 
-  if (!opts::IgnoreHash && YamlBF.Hash != BF.computeHash(/*UseDFS=*/true)) {
+  if (!opts::IgnoreHash && YamlBF.Hash != BF.getHash()) {
     if (opts::Verbosity >= 1)
       errs() << "BOLT-WARNING: function hash mismatch\n";
     ProfileMatched = false;
@@ -174,27 +208,28 @@ bool YAMLProfileReader::parseFunctionProfile(
         continue;
       }
 
-      auto setAnnotation = [&](StringRef Name, uint64_t Count) {
-        if (BC.MIB->hasAnnotation(*Instr, Name)) {
+      auto setAnnotation = [&](const MCPlus::AnnotationKey<uint64_t> &Key,
+                               uint64_t Count) {
+        if (BC.MIB->hasAnnotation(*Instr, Key)) {
           if (opts::Verbosity >= 1)
-            errs() << "BOLT-WARNING: ignoring duplicate " << Name
+            errs() << "BOLT-WARNING: ignoring duplicate " << Key.getName()
                    << " info for offset 0x" << Twine::utohexstr(YamlCSI.Offset)
                    << " in function " << BF << '\n';
           return;
         }
-        BC.MIB->addAnnotation(*Instr, Name, Count);
+        BC.MIB->addAnnotation(*Instr, Key, Count);
       };
 
       if (BC.MIB->isIndirectCall(*Instr) || BC.MIB->isIndirectBranch(*Instr)) {
         IndirectCallSiteProfile &CSP =
-          BC.MIB->getOrCreateAnnotationAs<IndirectCallSiteProfile>(
-              *Instr, "CallProfile");
+          BC.MIB->getOrCreateAnnotationAs(
+              *Instr, MCPlus::CallProfileAnnotation);
         CSP.emplace_back(CalleeSymbol, YamlCSI.Count, YamlCSI.Mispreds);
       } else if (BC.MIB->getConditionalTailCall(*Instr)) {
-        setAnnotation("CTCTakenCount", YamlCSI.Count);
-        setAnnotation("CTCMispredCount", YamlCSI.Mispreds);
+        setAnnotation(MCPlus::CTCTakenCountAnnotation, YamlCSI.Count);
+        setAnnotation(MCPlus::CTCMispredCountAnnotation, YamlCSI.Mispreds);
       } else {
-        setAnnotation("Count", YamlCSI.Count);
+        setAnnotation(MCPlus::CountAnnotation, YamlCSI.Count);
       }
     }
 
@@ -253,14 +288,23 @@ Error YAMLProfileReader::preprocessProfile(BinaryContext &BC) {
     errs() << "ERROR: cannot open " << Filename << ": " << EC.message() << "\n";
     return errorCodeToError(EC);
   }
-  yaml::Input YamlInput(MB.get()->getBuffer());
-
-  // Consume YAML file.
-  YamlInput >> YamlBP;
-  if (YamlInput.error()) {
-    errs() << "BOLT-ERROR: syntax error parsing profile in " << Filename
-           << " : " << YamlInput.error().message() << '\n';
-    return errorCodeToError(YamlInput.error());
+  const auto Buffer = MB.get()->getBuffer();
+  if (isBinaryEncodedProfile(Buffer)) {
+    if (std::error_code EC = readBinaryEncodedProfile(Buffer, YamlBP)) {
+      errs() << "BOLT-ERROR: malformed binary profile in " << Filename
+             << " : " << EC.message() << '\n';
+      return errorCodeToError(EC);
+    }
+  } else {
+    yaml::Input YamlInput(Buffer);
+
+    // Consume YAML file.
+    YamlInput >> YamlBP;
+    if (YamlInput.error()) {
+      errs() << "BOLT-ERROR: syntax error parsing profile in " << Filename
+             << " : " << YamlInput.error().message() << '\n';
+      return errorCodeToError(YamlInput.error());
+    }
   }
 
   // Sanity check.
@@ -277,15 +321,15 @@ Error YAMLProfileReader::preprocessProfile(BinaryContext &BC) {
 
   // Match profile to function based on a function name.
   buildNameMaps(BC.getBinaryFunctions());
+  if (opts::Verbosity >= 1)
+    Names.printStats(outs(), "BOLT-INFO: YAML profile reader ");
 
   // Preliminary assign function execution count.
   for (auto &KV : BC.getBinaryFunctions()) {
     BinaryFunction &BF = KV.second;
     for (StringRef Name : BF.getNames()) {
-      auto PI = ProfileNameToProfile.find(Name);
-      if (PI != ProfileNameToProfile.end()) {
-        yaml::bolt::BinaryFunctionProfile &YamlBF = *PI->getValue();
-        BF.setExecutionCount(YamlBF.ExecCount);
+      if (auto *YamlBF = getProfileByName(Name)) {
+        BF.setExecutionCount(YamlBF->ExecCount);
         break;
       }
     }
@@ -296,7 +340,7 @@ Error YAMLProfileReader::preprocessProfile(BinaryContext &BC) {
 
 bool YAMLProfileReader::mayHaveProfileData(const BinaryFunction &BF) {
   for (StringRef Name : BF.getNames()) {
-    if (ProfileNameToProfile.find(Name) != ProfileNameToProfile.end())
+    if (getProfileByName(Name))
       return true;
     if (const auto CommonName = getLTOCommonName(Name)) {
       if (LTOCommonNameMap.find(*CommonName) != LTOCommonNameMap.end()) {
@@ -321,6 +365,15 @@ Error YAMLProfileReader::readProfile(BinaryContext &BC) {
     return false;
   };
 
+  // Recompute hash once per function. Hashing is the most expensive part of
+  // matching and only depends on the function itself.
+  if (!opts::IgnoreHash) {
+    ParallelUtilities::runOnEachFunction(
+        BC, ParallelUtilities::SchedulingPolicy::SP_INST_LINEAR,
+        [](BinaryFunction &BF) { BF.computeHash(/*UseDFS=*/true); },
+        ParallelUtilities::PredicateTy(), "computeProfileHash");
+  }
+
   // We have to do 2 passes since LTO introduces an ambiguity in function
   // names. The first pass assigns profiles that match 100% by name and
   // by hash. The second pass allows name ambiguity for LTO private functions.
@@ -331,18 +384,12 @@ Error YAMLProfileReader::readProfile(BinaryContext &BC) {
     // the profile.
     Function.setExecutionCount(BinaryFunction::COUNT_NO_PROFILE);
 
-    // Recompute hash once per function.
-    if (!opts::IgnoreHash)
-      Function.computeHash(/*UseDFS=*/true);
-
     for (auto FunctionName : Function.getNames()) {
-      auto PI = ProfileNameToProfile.find(FunctionName);
-      if (PI == ProfileNameToProfile.end()) {
+      auto *YamlBF = getProfileByName(FunctionName);
+      if (!YamlBF)
         continue;
-      }
-      auto &YamlBF = *PI->getValue();
-      if (profileMatches(YamlBF, Function))
-        matchProfileToFunction(YamlBF, Function);
+      if (profileMatches(*YamlBF, Function))
+        matchProfileToFunction(*YamlBF, Function);
     }
   }
 
@@ -381,19 +428,21 @@ Error YAMLProfileReader::readProfile(BinaryContext &BC) {
           break;
         }
       } else {
-        auto PI = ProfileNameToProfile.find(FunctionName);
-        if (PI == ProfileNameToProfile.end())
+        auto *YamlBF = getProfileByName(FunctionName);
+        if (!YamlBF)
           continue;
 
-        auto &YamlBF = *PI->getValue();
-        if (!YamlBF.Used) {
-          matchProfileToFunction(YamlBF, Function);
+        if (!YamlBF->Used) {
+          matchProfileToFunction(*YamlBF, Function);
           break;
         }
       }
     }
   }
 
+  if (opts::MatchProfileWithFunctionHash)
+    matchProfilesByContents(BC);
+
   for (auto &YamlBF : YamlBP.Functions) {
     if (!YamlBF.Used && opts::Verbosity >= 1) {
       errs() << "BOLT-WARNING: profile ignored for function " << YamlBF.Name
@@ -407,23 +456,231 @@ Error YAMLProfileReader::readProfile(BinaryContext &BC) {
 
   uint64_t NumUnused{0};
   for (auto &YamlBF : YamlBP.Functions) {
-    if (YamlBF.Id >= YamlProfileToFunction.size()) {
-      // Such profile was ignored.
+    const auto Weight = getProfileWeight(YamlBF);
+    auto *BF = YamlBF.Id < YamlProfileToFunction.size()
+                   ? YamlProfileToFunction[YamlBF.Id]
+                   : nullptr;
+    if (!BF) {
       ++NumUnused;
+      ++Staleness.NumUnused;
+      Staleness.UnusedWeight += Weight;
       continue;
     }
-    if (auto *BF = YamlProfileToFunction[YamlBF.Id]) {
-      parseFunctionProfile(*BF, YamlBF);
+
+    if (opts::IgnoreHash || YamlBF.Hash == BF->getHash()) {
+      ++Staleness.NumExact;
+      Staleness.ExactWeight += Weight;
     } else {
-      ++NumUnused;
+      ++Staleness.NumStale;
+      Staleness.StaleWeight += Weight;
+      const auto NumProfileBlocks = YamlBF.Blocks.size();
+      uint64_t Recovered = 0;
+      if (opts::InferStaleProfile)
+        Recovered = inferStaleProfile(*BF, YamlBF);
+      if (Recovered) {
+        ++Staleness.NumRemapped;
+        Staleness.RecoveredWeight += Recovered;
+      }
+      if (opts::ReportStaleMatching) {
+        outs() << "BOLT-INFO: stale profile for " << *BF << ": ";
+        if (opts::InferStaleProfile)
+          outs() << YamlBF.Blocks.size() << " of " << NumProfileBlocks
+                 << " blocks remapped, ";
+        outs() << format("%.1f%% of ",
+                         Weight ? 100.0 * Recovered / Weight : 0.0)
+               << Weight << " samples matched\n";
+      }
     }
+    parseFunctionProfile(*BF, YamlBF);
   }
 
   BC.setNumUnusedProfiledObjects(NumUnused);
 
+  reportStaleness();
+
   return Error::success();
 }
 
+uint64_t YAMLProfileReader::getContentsKey(
+    const yaml::bolt::BinaryFunctionProfile &YamlBF) {
+  if (!opts::IgnoreHash)
+    return YamlBF.Hash;
+  uint64_t NumInstructions = 0;
+  for (const auto &YamlBB : YamlBF.Blocks)
+    NumInstructions += YamlBB.NumInstructions;
+  return hash_combine(YamlBF.NumBasicBlocks, NumInstructions);
+}
+
+uint64_t YAMLProfileReader::getContentsKey(const BinaryFunction &BF) {
+  if (!opts::IgnoreHash)
+    return BF.getHash();
+  uint64_t NumInstructions = 0;
+  for (const auto &BB : BF)
+    NumInstructions += BB.getNumNonPseudos();
+  return hash_combine(static_cast<uint32_t>(BF.size()), NumInstructions);
+}
+
+void YAMLProfileReader::matchProfilesByContents(BinaryContext &BC) {
+  using ProfileListTy = std::vector<yaml::bolt::BinaryFunctionProfile *>;
+  std::unordered_map<uint64_t, ProfileListTy> UnusedProfiles;
+  for (auto &YamlBF : YamlBP.Functions)
+    if (!YamlBF.Used)
+      UnusedProfiles[getContentsKey(YamlBF)].push_back(&YamlBF);
+
+  uint64_t NumMatched = 0;
+  for (auto &BFI : BC.getBinaryFunctions()) {
+    auto &Function = BFI.second;
+    if (Function.empty() || ProfiledFunctions.count(&Function))
+      continue;
+
+    auto I = UnusedProfiles.find(getContentsKey(Function));
+    if (I == UnusedProfiles.end())
+      continue;
+
+    for (auto *YamlBF : I->second) {
+      if (YamlBF->Used || YamlBF->NumBasicBlocks != Function.size())
+        continue;
+      matchProfileToFunction(*YamlBF, Function);
+      ++NumMatched;
+      break;
+    }
+  }
+
+  outs() << "BOLT-INFO: matched " << NumMatched
+         << " functions with profile by function contents\n";
+}
+
+uint64_t YAMLProfileReader::getProfileWeight(
+    const yaml::bolt::BinaryBasicBlockProfile &YamlBB) const {
+  if (YamlBP.Header.Flags & BinaryFunction::PF_SAMPLE)
+    return YamlBB.EventCount;
+  return YamlBB.ExecCount;
+}
+
+uint64_t YAMLProfileReader::getProfileWeight(
+    const yaml::bolt::BinaryFunctionProfile &YamlBF) const {
+  uint64_t Weight = 0;
+  for (const auto &YamlBB : YamlBF.Blocks)
+    Weight += getProfileWeight(YamlBB);
+  return Weight;
+}
+
+uint64_t YAMLProfileReader::inferStaleProfile(
+    BinaryFunction &BF, yaml::bolt::BinaryFunctionProfile &YamlBF) {
+  auto &BC = BF.getBinaryContext();
+  const auto DFSOrder = BF.dfs();
+
+  // Profiles written before block hashes were recorded cannot be remapped.
+  std::unordered_map<uint64_t, unsigned> ProfileHashCount;
+  for (const auto &YamlBB : YamlBF.Blocks)
+    if (YamlBB.Hash)
+      ++ProfileHashCount[YamlBB.Hash];
+  if (ProfileHashCount.empty())
+    return 0;
+
+  std::unordered_map<uint64_t, std::vector<uint32_t>> BlocksByHash;
+  for (uint32_t I = 0; I < DFSOrder.size(); ++I)
+    BlocksByHash[BF.computeBlockHash(*DFSOrder[I])].push_back(I);
+
+  // Blocks with a hash that is unique in both the profile and the function
+  // are matched first. Blocks with a repeated hash, e.g. identical loop
+  // latches, go to the free block with the closest DFS index.
+  std::unordered_map<uint32_t, uint32_t> IndexMap;
+  std::vector<bool> Taken(DFSOrder.size(), false);
+  auto matchBlock = [&](const yaml::bolt::BinaryBasicBlockProfile &YamlBB,
+                        bool UniqueOnly) {
+    if (!YamlBB.Hash || IndexMap.count(YamlBB.Index))
+      return;
+    auto I = BlocksByHash.find(YamlBB.Hash);
+    if (I == BlocksByHash.end())
+      return;
+    if (UniqueOnly &&
+        (I->second.size() != 1 || ProfileHashCount[YamlBB.Hash] != 1))
+      return;
+    auto distance = [&](uint32_t Index) {
+      return Index > YamlBB.Index ? Index - YamlBB.Index
+                                  : YamlBB.Index - Index;
+    };
+    int64_t Best = -1;
+    for (const auto Index : I->second)
+      if (!Taken[Index] && (Best < 0 || distance(Index) < distance(Best)))
+        Best = Index;
+    if (Best < 0)
+      return;
+    Taken[Best] = true;
+    IndexMap[YamlBB.Index] = Best;
+  };
+  for (const auto &YamlBB : YamlBF.Blocks)
+    matchBlock(YamlBB, /*UniqueOnly=*/true);
+  for (const auto &YamlBB : YamlBF.Blocks)
+    matchBlock(YamlBB, /*UniqueOnly=*/false);
+
+  uint64_t Recovered = 0;
+  std::vector<yaml::bolt::BinaryBasicBlockProfile> Blocks;
+  for (const auto &YamlBB : YamlBF.Blocks) {
+    auto I = IndexMap.find(YamlBB.Index);
+    if (I == IndexMap.end())
+      continue;
+    const auto &BB = *DFSOrder[I->second];
+    Blocks.emplace_back(YamlBB);
+    auto &NewBB = Blocks.back();
+    NewBB.Index = I->second;
+
+    NewBB.Successors.clear();
+    for (const auto &YamlSI : YamlBB.Successors) {
+      auto SI = IndexMap.find(YamlSI.Index);
+      if (SI == IndexMap.end() ||
+          !BB.getSuccessor(DFSOrder[SI->second]->getLabel()))
+        continue;
+      NewBB.Successors.emplace_back(YamlSI);
+      NewBB.Successors.back().Index = SI->second;
+    }
+
+    NewBB.CallSites.clear();
+    for (const auto &YamlCSI : YamlBB.CallSites) {
+      if (YamlCSI.Offset >= BB.getOriginalSize())
+        continue;
+      const auto *Instr =
+          BF.getInstructionAtOffset(BB.getInputOffset() + YamlCSI.Offset);
+      if (!Instr ||
+          (!BC.MIB->isCall(*Instr) && !BC.MIB->isIndirectBranch(*Instr)))
+        continue;
+      NewBB.CallSites.emplace_back(YamlCSI);
+    }
+
+    Recovered += getProfileWeight(YamlBB);
+  }
+
+  if (!Recovered)
+    return 0;
+
+  YamlBF.Blocks = std::move(Blocks);
+  YamlBF.Hash = BF.getHash();
+  YamlBF.NumBasicBlocks = BF.size();
+  return Recovered;
+}
+
+void YAMLProfileReader::reportStaleness() const {
+  const auto TotalWeight =
+      Staleness.ExactWeight + Staleness.StaleWeight + Staleness.UnusedWeight;
+  if (!TotalWeight)
+    return;
+  auto percent = [&](uint64_t Weight) {
+    return format("%.1f%%", 100.0 * Weight / TotalWeight);
+  };
+  outs() << "BOLT-INFO: profile staleness: " << Staleness.NumExact
+         << " functions match the binary (" << percent(Staleness.ExactWeight)
+         << " of samples), " << Staleness.NumStale
+         << " functions have a stale profile ("
+         << percent(Staleness.StaleWeight) << "), " << Staleness.NumUnused
+         << " profiles are unused (" << percent(Staleness.UnusedWeight)
+         << ")\n";
+  if (opts::InferStaleProfile && Staleness.NumStale)
+    outs() << "BOLT-INFO: remapped blocks of " << Staleness.NumRemapped
+           << " stale functions by instruction hash, recovering "
+           << percent(Staleness.RecoveredWeight) << " of samples\n";
+}
+
 bool YAMLProfileReader::usesEvent(StringRef Name) const {
   return YamlBP.Header.EventNames.find(Name) != StringRef::npos;
 }
@@ -45,7 +45,7 @@ public:
 
   virtual bool mayHaveProfileData(const BinaryFunction &BF) override;
 
-  /// Check if the file contains YAML.
+  /// Check if the file contains YAML or its binary encoding.
   static bool isYAML(StringRef Filename);
 
 private:
@@ -71,8 +71,17 @@ private:
   StringMap<std::unordered_set<const BinaryFunction *>>
                                                       LTOCommonNameFunctionMap;
 
-  /// Strict matching of a name in a profile to its contents.
-  StringMap<yaml::bolt::BinaryFunctionProfile *> ProfileNameToProfile;
+  /// Strict matching of a name in a profile to its contents. Indexed by
+  /// the ID of the name in the name table.
+  std::vector<yaml::bolt::BinaryFunctionProfile *> ProfileNameToProfile;
+
+  /// Return the profile with an exact \p Name or nullptr.
+  yaml::bolt::BinaryFunctionProfile *getProfileByName(StringRef Name) const {
+    const auto ID = Names.lookup(Name);
+    if (!ID || *ID >= ProfileNameToProfile.size())
+      return nullptr;
+    return ProfileNameToProfile[*ID];
+  }
 
   /// Populate \p Function profile with the one supplied in YAML format.
   bool parseFunctionProfile(BinaryFunction &Function,
@@ -94,8 +103,48 @@ private:
     ProfiledFunctions.emplace(&BF);
   }
 
+  /// Return the key used to match a profile to a function regardless of
+  /// the name: the function hash or, if hashes are ignored, the number of
+  /// blocks and instructions.
+  static uint64_t getContentsKey(
+      const yaml::bolt::BinaryFunctionProfile &YamlBF);
+  static uint64_t getContentsKey(const BinaryFunction &BF);
+
+  /// Match functions without a profile to unused profiles with the same
+  /// contents key.
+  void matchProfilesByContents(BinaryContext &BC);
+
   /// Check if the profile uses an event with a given \p Name.
   bool usesEvent(StringRef Name) const;
+
+  /// Sampled weight of functions whose profile matches the binary and of
+  /// those with a stale profile, i.e. a function hash mismatch.
+  struct StalenessStats {
+    uint64_t NumExact{0};
+    uint64_t NumStale{0};
+    uint64_t NumRemapped{0};
+    uint64_t NumUnused{0};
+    uint64_t ExactWeight{0};
+    uint64_t StaleWeight{0};
+    uint64_t RecoveredWeight{0};
+    uint64_t UnusedWeight{0};
+  } Staleness;
+
+  /// Return the sampled weight of blocks in \p YamlBB or \p YamlBF.
+  uint64_t getProfileWeight(
+      const yaml::bolt::BinaryBasicBlockProfile &YamlBB) const;
+  uint64_t getProfileWeight(
+      const yaml::bolt::BinaryFunctionProfile &YamlBF) const;
+
+  /// Rewrite the stale profile \p YamlBF in terms of the blocks of \p BF by
+  /// matching blocks with the same instruction hash. Profile blocks, edges
+  /// and call sites without a counterpart in \p BF are dropped. Return the
+  /// sampled weight of the remapped blocks.
+  uint64_t inferStaleProfile(BinaryFunction &BF,
+                             yaml::bolt::BinaryFunctionProfile &YamlBF);
+
+  /// Print the fraction of the sampled weight matched, recovered and lost.
+  void reportStaleness() const;
 };
 
 }
@@ -13,6 +13,7 @@
 #include "BinaryBasicBlock.h"
 #include "BinaryFunction.h"
 #include "DataAggregator.h"
+#include "ProfileBinaryEncoding.h"
 #include "ProfileYAMLMapping.h"
 #include "YAMLProfileWriter.h"
 #include "llvm/ADT/STLExtras.h"
@@ -24,6 +25,19 @@
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt-prof"
 
+namespace opts {
+
+extern llvm::cl::OptionCategory BoltOutputCategory;
+
+static llvm::cl::opt<bool>
+SaveProfileBinary("w-binary",
+  llvm::cl::desc("save the profile specified with -w in a compact binary "
+                 "encoding instead of YAML"),
+  llvm::cl::ZeroOrMore,
+  llvm::cl::cat(BoltOutputCategory));
+
+}
+
 namespace llvm {
 namespace bolt {
 
@@ -44,6 +58,7 @@ convert(const BinaryFunction &BF, yaml::bolt::BinaryFunctionProfile &YamlBF) {
     yaml::bolt::BinaryBasicBlockProfile YamlBB;
     YamlBB.Index = BB->getLayoutIndex();
     YamlBB.NumInstructions = BB->getNumNonPseudos();
+    YamlBB.Hash = BF.computeBlockHash(*BB);
 
     if (!LBRProfile) {
       YamlBB.EventCount = BB->getKnownExecutionCount();
@@ -59,15 +74,14 @@ convert(const BinaryFunction &BF, yaml::bolt::BinaryFunctionProfile &YamlBF) {
         continue;
 
       yaml::bolt::CallSiteInfo CSI;
-      auto Offset = BC.MIB->tryGetAnnotationAs<uint32_t>(Instr, "Offset");
+      auto Offset = BC.MIB->tryGetAnnotationAs(Instr, MCPlus::OffsetAnnotation);
       if (!Offset || Offset.get() < BB->getInputOffset())
         continue;
       CSI.Offset = Offset.get() - BB->getInputOffset();
 
       if (BC.MIB->isIndirectCall(Instr) || BC.MIB->isIndirectBranch(Instr)) {
         auto ICSP =
-          BC.MIB->tryGetAnnotationAs<IndirectCallSiteProfile>(Instr,
-                                                              "CallProfile");
+          BC.MIB->tryGetAnnotationAs(Instr, MCPlus::CallProfileAnnotation);
         if (!ICSP)
           continue;
         for (auto &CSP : ICSP.get()) {
@@ -94,16 +108,17 @@ convert(const BinaryFunction &BF, yaml::bolt::BinaryFunctionProfile &YamlBF) {
 
         if (BC.MIB->getConditionalTailCall(Instr)) {
           auto CTCCount =
-            BC.MIB->tryGetAnnotationAs<uint64_t>(Instr, "CTCTakenCount");
+            BC.MIB->tryGetAnnotationAs(Instr, MCPlus::CTCTakenCountAnnotation);
           if (CTCCount) {
             CSI.Count = *CTCCount;
-            auto CTCMispreds =
-              BC.MIB->tryGetAnnotationAs<uint64_t>(Instr, "CTCMispredCount");
+            auto CTCMispreds = BC.MIB->tryGetAnnotationAs(
+                Instr, MCPlus::CTCMispredCountAnnotation);
             if (CTCMispreds)
               CSI.Mispreds = *CTCMispreds;
           }
         } else {
-          auto Count = BC.MIB->tryGetAnnotationAs<uint64_t>(Instr, "Count");
+          auto Count =
+              BC.MIB->tryGetAnnotationAs(Instr, MCPlus::CountAnnotation);
           if (Count)
             CSI.Count = *Count;
         }
@@ -205,6 +220,10 @@ YAMLProfileWriter::writeProfile(const RewriteInstance &RI) {
   }
 
   // Write the profile.
+  if (opts::SaveProfileBinary) {
+    writeBinaryEncodedProfile(*OS, BP);
+    return std::error_code();
+  }
   yaml::Output Out(*OS, nullptr, 0);
   Out << BP;
 
@@ -15,7 +15,9 @@
 
 #include "DataAggregator.h"
 #include "MachORewriteInstance.h"
+#include "ParallelUtilities.h"
 #include "RewriteInstance.h"
+#include "Telemetry.h"
 #include "llvm/Object/Binary.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Error.h"
@@ -25,7 +27,13 @@
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/StringSaver.h"
 #include "llvm/Support/ThreadPool.h"
+#include <cerrno>
+#include <fstream>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #undef  DEBUG_TYPE
 #define DEBUG_TYPE "bolt"
@@ -62,7 +70,17 @@ cl::SubCommand HeatmapCommand("heatmap", "generate heatmap");
 
 extern cl::opt<std::string> OutputFilename;
 extern cl::opt<bool> AggregateOnly;
+extern cl::opt<bool> CheckProfile;
 extern cl::opt<bool> DiffOnly;
+extern cl::opt<std::string> HeatmapCountsInput;
+
+static cl::list<std::string>
+BinaryOutputs("binary-output",
+  cl::desc("also aggregate the perf data for another executable and write "
+           "its profile to the given file (perf2bolt only)"),
+  cl::value_desc("executable=output"),
+  cl::ZeroOrMore,
+  cl::cat(AggregatorCategory));
 
 static cl::opt<std::string>
 InputDataFilename("data",
@@ -110,6 +128,15 @@ PerfDataA("p",
   cl::aliasopt(PerfData),
   cl::cat(AggregatorCategory));
 
+static cl::opt<std::string>
+ServerRequests("server",
+  cl::desc("keep the input binary loaded and serve the requests read from "
+           "the given file or pipe (- for stdin), one per line with the "
+           "options of a run, e.g. -data=<profile> -o=<output>"),
+  cl::value_desc("file"),
+  cl::Optional,
+  cl::cat(BoltCategory));
+
 cl::opt<bool>
   PrintSections("print-sections",
   cl::desc("print all registered sections"),
@@ -167,10 +194,21 @@ void perf2boltMode(int argc, char **argv) {
            << "': expected valid perf.data file.\n";
     exit(1);
   }
-  if (opts::OutputFilename.empty()) {
+  if (opts::OutputFilename.empty() && !opts::CheckProfile) {
     errs() << ToolName << ": expected -o=<output file> option.\n";
     exit(1);
   }
+  for (const auto &BinaryOutput : opts::BinaryOutputs) {
+    StringRef Executable, Output;
+    std::tie(Executable, Output) = StringRef(BinaryOutput).split('=');
+    if (Executable.empty() || Output.empty()) {
+      errs() << ToolName << ": expected -binary-output=<executable>=<output "
+                "file>, got '" << BinaryOutput << "'.\n";
+      exit(1);
+    }
+  }
+  if (!opts::BinaryOutputs.empty())
+    DataAggregator::setSharePerfOutputs(true);
   opts::AggregateOnly = true;
 }
 
@@ -193,7 +231,7 @@ void heatmapMode(int argc, char **argv) {
   if (!sys::fs::exists(opts::InputFilename))
     report_error(opts::InputFilename, errc::no_such_file_or_directory);
 
-  if (opts::PerfData.empty()) {
+  if (opts::PerfData.empty() && opts::HeatmapCountsInput.empty()) {
     errs() << ToolName << ": expected -perfdata=<filename> option.\n";
     exit(1);
   }
@@ -236,7 +274,7 @@ void boltMode(int argc, char **argv) {
   cl::ParseCommandLineOptions(argc, argv,
                               "BOLT - Binary Optimization and Layout Tool\n");
 
-  if (opts::OutputFilename.empty()) {
+  if (opts::OutputFilename.empty() && opts::ServerRequests.empty()) {
     errs() << ToolName << ": expected -o=<output file> option.\n";
     exit(1);
   }
@@ -252,6 +290,144 @@ std::string GetExecutablePath(const char *Argv0) {
   return ExecutablePath.str();
 }
 
+/// Assign the profiles given with -perfdata and -data to \p RI.
+static void setProfiles(RewriteInstance &RI) {
+  if (!opts::PerfData.empty()) {
+    if (!opts::AggregateOnly) {
+      errs() << ToolName
+        << ": WARNING: reading perf data directly is unsupported, please use "
+        "-aggregate-only or perf2bolt.\n!!! Proceed on your own risk. !!!\n";
+    }
+    if (auto E = RI.setProfile(opts::PerfData))
+      report_error(opts::PerfData, std::move(E));
+  }
+  if (!opts::InputDataFilename.empty()) {
+    if (auto E = RI.setProfile(opts::InputDataFilename))
+      report_error(opts::InputDataFilename, std::move(E));
+  }
+  if (opts::AggregateOnly && opts::PerfData.empty()) {
+    errs() << ToolName << ": missing required -perfdata option.\n";
+    exit(1);
+  }
+}
+
+/// Serve one request of the server mode in a forked process and exit. The
+/// options are parsed again from the command line of the server followed by
+/// the options of the request, and the latter override the former.
+static void serveRequest(RewriteInstance &RI, int argc, char **argv,
+                         StringRef Request) {
+  BumpPtrAllocator Alloc;
+  StringSaver Saver(Alloc);
+  SmallVector<const char *, 32> Args(argv, argv + argc);
+  cl::TokenizeGNUCommandLine(Request, Saver, Args);
+  cl::ResetAllOptionOccurrences();
+  if (!cl::ParseCommandLineOptions(Args.size(), Args.data(), "", &errs()))
+    exit(1);
+  if (opts::OutputFilename.empty()) {
+    errs() << ToolName << ": expected -o=<output file> option.\n";
+    exit(1);
+  }
+  setProfiles(RI);
+
+  RI.serveRequest();
+
+  ParallelUtilities::saveCostHistory();
+  Telemetry::writeReport();
+  exit(0);
+}
+
+/// Keep the binary read by \p RI loaded and serve the requests read from
+/// -server until the end of the input. Every request runs in a process
+/// forked from this one, which starts from the loaded state and shares its
+/// memory until it is modified.
+static void runServer(RewriteInstance &RI, int argc, char **argv) {
+  if (!opts::PerfData.empty() || !opts::InputDataFilename.empty()) {
+    errs() << ToolName << ": profiles are given with the requests in server "
+              "mode.\n";
+    exit(1);
+  }
+  std::ifstream RequestsFile;
+  if (opts::ServerRequests != "-") {
+    RequestsFile.open(opts::ServerRequests);
+    if (!RequestsFile)
+      report_error(opts::ServerRequests, errc::no_such_file_or_directory);
+  }
+  std::istream &Requests =
+      opts::ServerRequests == "-" ? std::cin : RequestsFile;
+
+  if (!RI.loadBinary())
+    exit(1);
+  // Worker threads are not copied to the forked processes.
+  ParallelUtilities::resetThreadPool();
+  outs() << "BOLT-INFO: server ready for requests from "
+         << opts::ServerRequests << '\n';
+
+  unsigned NumRequests = 0;
+  unsigned NumFailed = 0;
+  std::string Line;
+  while (std::getline(Requests, Line)) {
+    const StringRef Request = StringRef(Line).trim();
+    if (Request.empty() || Request.startswith("#"))
+      continue;
+    ++NumRequests;
+
+    // Do not let the child process print the buffered output once more.
+    outs().flush();
+    errs().flush();
+    const pid_t PID = fork();
+    if (PID < 0) {
+      errs() << ToolName << ": cannot fork for request " << NumRequests
+             << ".\n";
+      exit(1);
+    }
+    if (!PID)
+      serveRequest(RI, argc, argv, Request);
+
+    int Status;
+    pid_t Waited;
+    do {
+      Waited = waitpid(PID, &Status, 0);
+    } while (Waited < 0 && errno == EINTR);
+    const bool Success =
+        Waited == PID && WIFEXITED(Status) && !WEXITSTATUS(Status);
+    if (!Success)
+      ++NumFailed;
+    outs() << "BOLT-INFO: server request " << NumRequests << " ("
+           << Request << ") " << (Success ? "done" : "failed") << '\n';
+    outs().flush();
+  }
+  outs() << "BOLT-INFO: server processed " << NumRequests << " requests, "
+         << NumFailed << " failed\n";
+}
+
+/// Process the binary opts::InputFilename.
+static void processBinary(int argc, char **argv, StringRef ToolPath) {
+  if (!sys::fs::exists(opts::InputFilename))
+    report_error(opts::InputFilename, errc::no_such_file_or_directory);
+
+  Expected<OwningBinary<Binary>> BinaryOrErr =
+      createBinary(opts::InputFilename);
+  if (auto E = BinaryOrErr.takeError())
+    report_error(opts::InputFilename, std::move(E));
+  Binary &Binary = *BinaryOrErr.get().getBinary();
+
+  if (auto *e = dyn_cast<ELFObjectFileBase>(&Binary)) {
+    RewriteInstance RI(e, argc, argv, ToolPath);
+    if (!opts::ServerRequests.empty()) {
+      runServer(RI, argc, argv);
+      return;
+    }
+    setProfiles(RI);
+
+    RI.run();
+  } else if (auto *O = dyn_cast<MachOObjectFile>(&Binary)) {
+    MachORewriteInstance MachORI(O, ToolPath);
+    MachORI.run();
+  } else {
+    report_error(opts::InputFilename, object_error::invalid_file_type);
+  }
+}
+
 int main(int argc, char **argv) {
   // Print a stack trace if we signal out.
   sys::PrintStackTraceOnErrorSignal(argv[0]);
@@ -288,45 +464,25 @@ int main(int argc, char **argv) {
   else
     boltMode(argc, argv);
 
+  if (opts::HeatmapMode && DataAggregator::printSavedHeatMap())
+    return EXIT_SUCCESS;
 
-  if (!sys::fs::exists(opts::InputFilename))
-    report_error(opts::InputFilename, errc::no_such_file_or_directory);
-
-  // Attempt to open the binary.
   if (!opts::DiffOnly) {
-    Expected<OwningBinary<Binary>> BinaryOrErr =
-        createBinary(opts::InputFilename);
-    if (auto E = BinaryOrErr.takeError())
-      report_error(opts::InputFilename, std::move(E));
-    Binary &Binary = *BinaryOrErr.get().getBinary();
-
-    if (auto *e = dyn_cast<ELFObjectFileBase>(&Binary)) {
-      RewriteInstance RI(e, argc, argv, ToolPath);
-      if (!opts::PerfData.empty()) {
-        if (!opts::AggregateOnly) {
-          errs() << ToolName
-            << ": WARNING: reading perf data directly is unsupported, please use "
-            "-aggregate-only or perf2bolt.\n!!! Proceed on your own risk. !!!\n";
-        }
-        if (auto E = RI.setProfile(opts::PerfData))
-          report_error(opts::PerfData, std::move(E));
-      }
-      if (!opts::InputDataFilename.empty()) {
-        if (auto E = RI.setProfile(opts::InputDataFilename))
-          report_error(opts::InputDataFilename, std::move(E));
-      }
-      if (opts::AggregateOnly && opts::PerfData.empty()) {
-        errs() << ToolName << ": missing required -perfdata option.\n";
-        exit(1);
-      }
-
-      RI.run();
-    } else if (auto *O = dyn_cast<MachOObjectFile>(&Binary)) {
-      MachORewriteInstance MachORI(O, ToolPath);
-      MachORI.run();
-    } else {
-      report_error(opts::InputFilename, object_error::invalid_file_type);
+    processBinary(argc, argv, ToolPath);
+
+    // perf2bolt: aggregate other binaries reusing the output of perf jobs.
+    for (const auto &BinaryOutput : opts::BinaryOutputs) {
+      StringRef Executable, Output;
+      std::tie(Executable, Output) = StringRef(BinaryOutput).split('=');
+      outs() << "PERF2BOLT: *** Aggregating profile for " << Executable
+             << "\n";
+      opts::InputFilename = Executable;
+      opts::OutputFilename = Output;
+      processBinary(argc, argv, ToolPath);
     }
+    DataAggregator::deleteSharedPerfOutputs();
+    ParallelUtilities::saveCostHistory();
+    Telemetry::writeReport();
 
     return EXIT_SUCCESS;
   }
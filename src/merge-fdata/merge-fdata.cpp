@@ -12,16 +12,27 @@
 //===----------------------------------------------------------------------===//
 
 #include "../ProfileYAMLMapping.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/StringMap.h"
 #include "llvm/Object/Binary.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/DataExtractor.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/ManagedStatic.h"
 #include "llvm/Support/Signals.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include <cmath>
+#include <map>
+#include <queue>
+#include <set>
 #include <unordered_map>
 
 using namespace llvm;
+using namespace llvm::object;
 using namespace llvm::yaml::bolt;
 
 namespace opts {
@@ -64,6 +75,67 @@ SuppressMergedDataOutput("q",
   cl::Optional,
   cl::cat(MergeFdataCategory));
 
+static cl::opt<unsigned>
+ThreadCount("thread-count",
+  cl::desc("number of threads used for merging"),
+  cl::init(hardware_concurrency()),
+  cl::cat(MergeFdataCategory));
+
+static cl::list<double>
+InputWeights("weights",
+  cl::CommaSeparated,
+  cl::desc("weights of the input profiles, in the order of the inputs"),
+  cl::value_desc("w1,w2,..."),
+  cl::cat(MergeFdataCategory));
+
+static cl::opt<double>
+AgeDecay("age-decay",
+  cl::desc("multiply the counts of an input by this factor for every day the "
+           "input is older than the newest one"),
+  cl::init(1.0),
+  cl::cat(MergeFdataCategory));
+
+static cl::opt<double>
+PruneThreshold("prune",
+  cl::desc("drop legacy profile entries with a count below this fraction "
+           "of the total count of their kind (branches, samples, or memory "
+           "accesses)"),
+  cl::init(0.0),
+  cl::value_desc("fraction"),
+  cl::cat(MergeFdataCategory));
+
+static cl::opt<unsigned>
+MergeFanIn("fan-in",
+  cl::desc("maximum number of sorted legacy profiles merged at once"),
+  cl::init(16),
+  cl::Hidden,
+  cl::cat(MergeFdataCategory));
+
+static cl::opt<std::string>
+InstrumentedBinary("instrumented-binary",
+  cl::desc("instrumented binary that wrote the binary profiles among the "
+           "inputs, used to turn its raw counters into fdata"),
+  cl::value_desc("path"),
+  cl::cat(MergeFdataCategory));
+
+static cl::list<std::string>
+ExactProfiles("exact-profiles",
+  cl::CommaSeparated,
+  cl::desc("YAML profiles with exact counts, e.g. from instrumentation, "
+           "combined with the sampled inputs: function hotness comes from "
+           "the samples and the edge ratios within functions from the exact "
+           "profiles"),
+  cl::value_desc("p1,p2,..."),
+  cl::cat(MergeFdataCategory));
+
+static cl::opt<double>
+ExactConfidence("exact-confidence",
+  cl::desc("confidence in the edge ratios of -exact-profiles over the ones "
+           "of the sampled inputs, between 0 and 1"),
+  cl::init(0.9),
+  cl::value_desc("fraction"),
+  cl::cat(MergeFdataCategory));
+
 } // namespace opts
 
 namespace {
@@ -81,6 +153,71 @@ static void report_error(Twine Message, StringRef CustomError) {
   exit(1);
 }
 
+uint64_t scaleCount(uint64_t Count, double Weight) {
+  return static_cast<uint64_t>(std::llround(Count * Weight));
+}
+
+/// Return the weight of every input: the weight given with -weights times
+/// the decay for the age of the input relative to the newest input.
+std::vector<double> getInputWeights(const cl::list<std::string> &Filenames) {
+  if (!opts::InputWeights.empty() &&
+      opts::InputWeights.size() != Filenames.size()) {
+    errs() << "ERROR: " << opts::InputWeights.size() << " weights specified "
+           << "for " << Filenames.size() << " inputs\n";
+    exit(1);
+  }
+  if (opts::AgeDecay <= 0.0 || opts::AgeDecay > 1.0) {
+    errs() << "ERROR: -age-decay must be in (0, 1]\n";
+    exit(1);
+  }
+
+  std::vector<double> Weights(Filenames.size(), 1.0);
+  for (size_t I = 0; I < opts::InputWeights.size(); ++I) {
+    if (opts::InputWeights[I] < 0.0)
+      report_error(Filenames[I], "negative weight");
+    Weights[I] = opts::InputWeights[I];
+  }
+  if (opts::AgeDecay == 1.0)
+    return Weights;
+
+  std::vector<sys::TimePoint<>> Times(Filenames.size());
+  sys::TimePoint<> Newest;
+  for (size_t I = 0; I < Filenames.size(); ++I) {
+    if (Filenames[I] == "-")
+      continue;
+    sys::fs::file_status Status;
+    if (std::error_code EC = sys::fs::status(Filenames[I], Status))
+      report_error(Filenames[I], EC);
+    Times[I] = Status.getLastModificationTime();
+    Newest = std::max(Newest, Times[I]);
+  }
+  for (size_t I = 0; I < Filenames.size(); ++I) {
+    if (Filenames[I] == "-")
+      continue;
+    const double AgeInDays =
+        std::chrono::duration<double>(Newest - Times[I]).count() / 86400;
+    Weights[I] *= std::pow(opts::AgeDecay, AgeInDays);
+  }
+  return Weights;
+}
+
+/// Multiply all counts in \p BF by \p Weight.
+void scaleFunctionProfile(BinaryFunctionProfile &BF, double Weight) {
+  BF.ExecCount = scaleCount(BF.ExecCount, Weight);
+  for (auto &BB : BF.Blocks) {
+    BB.ExecCount = scaleCount(BB.ExecCount, Weight);
+    BB.EventCount = scaleCount(BB.EventCount, Weight);
+    for (auto &CS : BB.CallSites) {
+      CS.Count = scaleCount(CS.Count, Weight);
+      CS.Mispreds = scaleCount(CS.Mispreds, Weight);
+    }
+    for (auto &SI : BB.Successors) {
+      SI.Count = scaleCount(SI.Count, Weight);
+      SI.Mispreds = scaleCount(SI.Mispreds, Weight);
+    }
+  }
+}
+
 void mergeProfileHeaders(BinaryProfileHeader &MergedHeader,
                          const BinaryProfileHeader &Header) {
   if (MergedHeader.FileName.empty()) {
@@ -233,6 +370,147 @@ void mergeFunctionProfile(BinaryFunctionProfile &MergedBF,
   }
 }
 
+/// Profile merged from a group of YAML inputs.
+struct MergedYAMLProfile {
+  BinaryProfileHeader Header;
+  StringMap<BinaryFunctionProfile> BFs;
+};
+
+void mergeFunctionProfiles(StringMap<BinaryFunctionProfile> &MergedBFs,
+                           std::vector<BinaryFunctionProfile> &&BFs) {
+  for (auto &BF : BFs) {
+    auto I = MergedBFs.find(BF.Name);
+    if (I == MergedBFs.end()) {
+      MergedBFs.insert(std::make_pair(BF.Name, std::move(BF)));
+      continue;
+    }
+    mergeFunctionProfile(I->second, std::move(BF));
+  }
+}
+
+/// Read YAML profile \p Filename, scale its counts by \p Weight, and merge
+/// it into \p Merged.
+void mergeYAMLProfile(MergedYAMLProfile &Merged, StringRef Filename,
+                      double Weight) {
+  auto MB = MemoryBuffer::getFileOrSTDIN(Filename);
+  if (std::error_code EC = MB.getError())
+    report_error(Filename, EC);
+  yaml::Input YamlInput(MB.get()->getBuffer());
+
+  BinaryProfile BP;
+  YamlInput >> BP;
+  if (YamlInput.error())
+    report_error(Filename, YamlInput.error());
+
+  // Sanity check.
+  if (BP.Header.Version != 1) {
+    errs() << "Unable to merge data from profile using version "
+           << BP.Header.Version << '\n';
+    exit(1);
+  }
+
+  // Merge the header.
+  mergeProfileHeaders(Merged.Header, BP.Header);
+
+  if (Weight != 1.0)
+    for (auto &BF : BP.Functions)
+      scaleFunctionProfile(BF, Weight);
+
+  // Do the function merge.
+  mergeFunctionProfiles(Merged.BFs, std::move(BP.Functions));
+}
+
+/// Merge the profile of one group of inputs \p Other into \p Merged.
+void mergeYAMLProfiles(MergedYAMLProfile &Merged, MergedYAMLProfile &&Other) {
+  mergeProfileHeaders(Merged.Header, Other.Header);
+
+  std::vector<BinaryFunctionProfile> BFs;
+  BFs.reserve(Other.BFs.size());
+  for (auto &Entry : Other.BFs)
+    BFs.emplace_back(std::move(Entry.second));
+  Other.BFs.clear();
+  mergeFunctionProfiles(Merged.BFs, std::move(BFs));
+}
+
+/// Return the total execution count of the basic blocks of \p BF, or the
+/// execution count of the function if blocks have no counts.
+uint64_t getFunctionMass(const BinaryFunctionProfile &BF) {
+  uint64_t Mass = 0;
+  for (const auto &BB : BF.Blocks)
+    Mass += BB.ExecCount;
+  return Mass ? Mass : BF.ExecCount;
+}
+
+/// Combine the exact profile \p Exact into the sampled profile \p Sampled.
+/// For a function in both, the exact counts are scaled to the mass of the
+/// sampled ones, and the two are blended with -exact-confidence as the
+/// weight of the exact counts. This keeps the hotness of the function
+/// relative to the rest of the binary from the samples, and takes the
+/// distribution of that mass across blocks and edges mostly from the exact
+/// profile. Functions only in the exact profile are scaled by the ratio of
+/// sampled to exact mass over the functions in both.
+void combineExactProfile(MergedYAMLProfile &Sampled,
+                         MergedYAMLProfile &&Exact) {
+  if (opts::ExactConfidence < 0.0 || opts::ExactConfidence > 1.0) {
+    errs() << "ERROR: -exact-confidence must be in [0, 1]\n";
+    exit(1);
+  }
+  mergeProfileHeaders(Sampled.Header, Exact.Header);
+
+  uint64_t SampledMass = 0;
+  uint64_t ExactMass = 0;
+  uint64_t NumCombined = 0;
+  uint64_t NumMismatched = 0;
+  std::vector<BinaryFunctionProfile *> ExactOnly;
+  for (auto &Entry : Exact.BFs) {
+    auto &ExactBF = Entry.second;
+    auto I = Sampled.BFs.find(ExactBF.Name);
+    if (I == Sampled.BFs.end()) {
+      ExactOnly.push_back(&ExactBF);
+      continue;
+    }
+    auto &SampledBF = I->second;
+    if (ExactBF.NumBasicBlocks != SampledBF.NumBasicBlocks ||
+        ExactBF.Hash != SampledBF.Hash || ExactBF.Id != SampledBF.Id) {
+      ++NumMismatched;
+      continue;
+    }
+
+    const auto FunctionSampledMass = getFunctionMass(SampledBF);
+    const auto FunctionExactMass = getFunctionMass(ExactBF);
+    if (!FunctionExactMass)
+      continue;
+    SampledMass += FunctionSampledMass;
+    ExactMass += FunctionExactMass;
+
+    // Without samples, the function is cold in the sampled inputs and the
+    // exact profile only provides the ratios.
+    if (!FunctionSampledMass)
+      continue;
+    const double Scale =
+        static_cast<double>(FunctionSampledMass) / FunctionExactMass;
+    scaleFunctionProfile(ExactBF, opts::ExactConfidence * Scale);
+    scaleFunctionProfile(SampledBF, 1.0 - opts::ExactConfidence);
+    mergeFunctionProfile(SampledBF, std::move(ExactBF));
+    ++NumCombined;
+  }
+
+  const double Scale =
+      ExactMass ? static_cast<double>(SampledMass) / ExactMass : 1.0;
+  for (auto *ExactBF : ExactOnly) {
+    scaleFunctionProfile(*ExactBF, Scale);
+    Sampled.BFs.insert(std::make_pair(ExactBF->Name, std::move(*ExactBF)));
+  }
+
+  errs() << "Combined exact counts of " << NumCombined << " functions with "
+         << "samples, added " << ExactOnly.size() << " functions without "
+         << "samples\n";
+  if (NumMismatched)
+    errs() << "WARNING: " << NumMismatched << " functions in the exact "
+           << "profiles do not match the sampled ones and keep the sampled "
+           << "counts\n";
+}
+
 bool isYAML(const StringRef Filename) {
   auto MB = MemoryBuffer::getFileOrSTDIN(Filename);
   if (std::error_code EC = MB.getError())
@@ -243,41 +521,711 @@ bool isYAML(const StringRef Filename) {
   return false;
 }
 
+/// Flags from the first lines of a legacy profile, and the total counts of
+/// its entries.
+struct LegacyProfileHeader {
+  bool BoltedCollection{false};
+  bool NoLBR{false};
+  std::set<std::string> EventNames;
+
+  /// Sum of counts of branches or samples, and of memory accesses.
+  uint64_t TotalCounts[2] = {0, 0};
+};
+
+/// A line of a legacy profile split into the description of the object and
+/// the counts. Only branches in LBR profiles have a misprediction count.
+struct LegacyEntry {
+  StringRef Key;
+  uint64_t Mispreds{0};
+  uint64_t Count{0};
+
+  bool operator<(const LegacyEntry &Other) const { return Key < Other.Key; }
+};
+
+bool parseLegacyEntry(StringRef Line, bool NoLBR, LegacyEntry &Entry) {
+  StringRef Rest, Field;
+  std::tie(Rest, Field) = Line.rsplit(' ');
+  if (Field.getAsInteger(10, Entry.Count))
+    return false;
+  Entry.Mispreds = 0;
+  if (!NoLBR && Line[0] >= '0' && Line[0] <= '2') {
+    std::tie(Rest, Field) = Rest.rsplit(' ');
+    if (Field.getAsInteger(10, Entry.Mispreds))
+      return false;
+  }
+  Entry.Key = Rest;
+  return !Rest.empty() && Rest.size() != Line.size();
+}
+
+/// Return 1 for memory access entries, and 0 for branches and samples.
+unsigned getEntryKind(const LegacyEntry &Entry) {
+  return Entry.Key[0] >= '3' && Entry.Key[0] <= '5';
+}
+
+void writeLegacyEntry(raw_ostream &OS, const LegacyEntry &Entry, bool NoLBR) {
+  OS << Entry.Key << ' ';
+  if (!NoLBR && Entry.Key[0] >= '0' && Entry.Key[0] <= '2')
+    OS << Entry.Mispreds << ' ';
+  OS << Entry.Count << '\n';
+}
+
+/// Description of an instrumented binary read from its .bolt.instr.tables
+/// note, needed to reconstruct an fdata profile from the raw counters written
+/// with -instrumentation-binary-profile. This mirrors the reconstruction done
+/// by the runtime in runtime/instr.cpp, and the layout is sync'ed with
+/// InstrumentationRuntimeLibrary::emitTablesAsELFNote().
+class InstrumentationTables {
+  struct Location {
+    uint32_t FunctionName;
+    uint32_t Offset;
+  };
+
+  struct EdgeDescription {
+    Location From;
+    uint32_t FromNode;
+    Location To;
+    uint32_t ToNode;
+    uint32_t Counter;
+  };
+
+  struct CallDescription {
+    Location From;
+    uint32_t FromNode;
+    Location To;
+    uint32_t Counter;
+    uint64_t TargetAddress;
+  };
+
+  struct FunctionDescription {
+    std::vector<std::pair<uint32_t, uint32_t>> LeafNodes; // Node, Counter
+    std::vector<EdgeDescription> Edges;
+    std::vector<CallDescription> Calls;
+    std::vector<std::pair<uint64_t, uint64_t>> EntryNodes; // Node, Address
+  };
+
+  /// Number of calls to and frequency of the entry block of a call target
+  struct CallFlow {
+    uint64_t Calls{0};
+    uint64_t Val{0};
+  };
+
+  std::unique_ptr<MemoryBuffer> MB;
+  StringRef BuildID;
+  std::vector<Location> IndCallDescriptions;
+  std::vector<std::pair<uint64_t, Location>> IndCallTargets;
+  std::vector<Location> ValueSites;
+  std::vector<FunctionDescription> FuncDescriptions;
+  StringRef Strings;
+
+  void readTables(StringRef Filename, StringRef Contents);
+  Location readLocation(DataExtractor &DE, uint32_t *Offset) const;
+  void writeLocation(raw_ostream &OS, Location Loc) const;
+  const Location *lookupIndCallTarget(uint64_t Address) const;
+  void writeFunctionProfile(raw_ostream &OS, const FunctionDescription &F,
+                            const uint64_t *Counters,
+                            std::map<uint64_t, CallFlow> &CallFlows) const;
+
+public:
+  /// Read the tables of the instrumented binary \p Filename, exiting on
+  /// failure.
+  explicit InstrumentationTables(StringRef Filename);
+
+  /// Write the fdata profile for the raw profile \p Buf read from
+  /// \p Filename to \p OS.
+  void convert(StringRef Filename, StringRef Buf, raw_ostream &OS) const;
+};
+
+/// Header of a binary profile, see runtime/instr.cpp:writeRawProfile()
+struct RawProfileHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t BuildIDSize;
+  uint8_t BuildID[32];
+  uint32_t NumCounters;
+  uint32_t NumIndCallEntries;
+  uint32_t NumValueEntries;
+  uint32_t Reserved;
+};
+
+struct RawProfileEntry {
+  uint32_t Site;
+  uint32_t Reserved;
+  uint64_t Key;
+  uint64_t Count;
+};
+
+bool isRawProfile(StringRef Buf) {
+  return Buf.size() >= sizeof(RawProfileHeader) && Buf.startswith("BOLTRAW");
+}
+
+InstrumentationTables::InstrumentationTables(StringRef Filename) {
+  auto MBOrErr = MemoryBuffer::getFile(Filename);
+  if (std::error_code EC = MBOrErr.getError())
+    report_error(Filename, EC);
+  MB = std::move(MBOrErr.get());
+
+  auto ObjOrErr = ObjectFile::createObjectFile(MB->getMemBufferRef());
+  if (!ObjOrErr)
+    report_error(Filename, toString(ObjOrErr.takeError()));
+  bool FoundTables = false;
+  for (const auto &Section : (*ObjOrErr)->sections()) {
+    StringRef SectionName;
+    StringRef Contents;
+    if (Section.getName(SectionName) || Section.getContents(Contents))
+      continue;
+    if (SectionName == ".note.gnu.build-id") {
+      DataExtractor DE(Contents, /*IsLittleEndian=*/true, /*AddressSize=*/8);
+      uint32_t Offset = 0;
+      const auto NameSz = DE.getU32(&Offset);
+      const auto DescSz = DE.getU32(&Offset);
+      Offset = alignTo(Offset + 4 + NameSz, 4);
+      BuildID = Contents.slice(Offset, Offset + DescSz);
+    } else if (SectionName == ".bolt.instr.tables") {
+      // Past the note header: name size, contents size, type, and "BOLT"
+      readTables(Filename, Contents.drop_front(20));
+      FoundTables = true;
+    }
+  }
+  if (!FoundTables)
+    report_error(Filename, "no .bolt.instr.tables section, the binary is not "
+                           "instrumented");
+}
+
+InstrumentationTables::Location
+InstrumentationTables::readLocation(DataExtractor &DE, uint32_t *Offset) const {
+  Location Loc;
+  Loc.FunctionName = DE.getU32(Offset);
+  Loc.Offset = DE.getU32(Offset);
+  return Loc;
+}
+
+void InstrumentationTables::readTables(StringRef Filename, StringRef Contents) {
+  DataExtractor DE(Contents, /*IsLittleEndian=*/true, /*AddressSize=*/8);
+  uint32_t Offset = 0;
+  uint32_t Size = DE.getU32(&Offset);
+  uint32_t End = Offset + Size;
+  while (Offset < End)
+    IndCallDescriptions.push_back(readLocation(DE, &Offset));
+
+  Size = DE.getU32(&Offset);
+  End = Offset + Size;
+  while (Offset < End) {
+    const auto Loc = readLocation(DE, &Offset);
+    IndCallTargets.emplace_back(DE.getU64(&Offset), Loc);
+  }
+
+  Size = DE.getU32(&Offset);
+  End = Offset + Size;
+  while (Offset < End)
+    ValueSites.push_back(readLocation(DE, &Offset));
+
+  Size = DE.getU32(&Offset);
+  End = Offset + Size;
+  while (Offset < End) {
+    FunctionDescription F;
+    for (auto I = DE.getU32(&Offset); I > 0; --I) {
+      const auto Node = DE.getU32(&Offset);
+      F.LeafNodes.emplace_back(Node, DE.getU32(&Offset));
+    }
+    for (auto I = DE.getU32(&Offset); I > 0; --I) {
+      EdgeDescription Edge;
+      Edge.From = readLocation(DE, &Offset);
+      Edge.FromNode = DE.getU32(&Offset);
+      Edge.To = readLocation(DE, &Offset);
+      Edge.ToNode = DE.getU32(&Offset);
+      Edge.Counter = DE.getU32(&Offset);
+      F.Edges.push_back(Edge);
+    }
+    for (auto I = DE.getU32(&Offset); I > 0; --I) {
+      CallDescription Call;
+      Call.From = readLocation(DE, &Offset);
+      Call.FromNode = DE.getU32(&Offset);
+      Call.To = readLocation(DE, &Offset);
+      Call.Counter = DE.getU32(&Offset);
+      Call.TargetAddress = DE.getU64(&Offset);
+      F.Calls.push_back(Call);
+    }
+    for (auto I = DE.getU32(&Offset); I > 0; --I) {
+      const auto Node = DE.getU64(&Offset);
+      F.EntryNodes.emplace_back(Node, DE.getU64(&Offset));
+    }
+    FuncDescriptions.emplace_back(std::move(F));
+  }
+  if (Offset != End || !DE.isValidOffset(Offset - 1))
+    report_error(Filename, "malformed .bolt.instr.tables section");
+  Strings = Contents.drop_front(Offset);
+}
+
+void InstrumentationTables::writeLocation(raw_ostream &OS,
+                                          Location Loc) const {
+  OS << "1 " << Strings.drop_front(Loc.FunctionName).data() << ' '
+     << utohexstr(Loc.Offset, /*LowerCase=*/true) << ' ';
+}
+
+const InstrumentationTables::Location *
+InstrumentationTables::lookupIndCallTarget(uint64_t Address) const {
+  auto I = std::lower_bound(
+      IndCallTargets.begin(), IndCallTargets.end(), Address,
+      [](const std::pair<uint64_t, Location> &Target, uint64_t Address) {
+        return Target.first < Address;
+      });
+  if (I == IndCallTargets.end() || I->first != Address)
+    return nullptr;
+  return &I->second;
+}
+
+/// Infer the counts of the edges without counters in \p F from the spanning
+/// tree, like Graph::computeEdgeFrequencies() in the runtime, and write its
+/// edges and calls.
+void InstrumentationTables::writeFunctionProfile(
+    raw_ostream &OS, const FunctionDescription &F, const uint64_t *Counters,
+    std::map<uint64_t, CallFlow> &CallFlows) const {
+  // Skip funcs we know are cold
+  uint64_t CountersFreq = 0;
+  for (const auto &Leaf : F.LeafNodes)
+    CountersFreq += Counters[Leaf.second];
+  for (const auto &Edge : F.Edges)
+    if (Edge.Counter != 0xffffffff)
+      CountersFreq += Counters[Edge.Counter];
+  for (const auto &Call : F.Calls)
+    if (Call.Counter != 0xffffffff)
+      CountersFreq += Counters[Call.Counter];
+  if (CountersFreq == 0)
+    return;
+
+  uint32_t NumNodes = 0;
+  for (const auto &Edge : F.Edges)
+    NumNodes = std::max({NumNodes, Edge.FromNode + 1, Edge.ToNode + 1});
+  for (const auto &Leaf : F.LeafNodes)
+    NumNodes = std::max(NumNodes, Leaf.first + 1);
+  for (const auto &Call : F.Calls)
+    NumNodes = std::max(NumNodes, Call.FromNode + 1);
+  if (NumNodes == 0)
+    return;
+
+  std::vector<std::vector<uint32_t>> InEdges(NumNodes);
+  std::vector<std::vector<uint32_t>> OutEdges(NumNodes);
+  std::vector<std::vector<uint32_t>> TreeChildren(NumNodes);
+  std::vector<int64_t> TreeParentEdge(NumNodes, -1);
+  std::vector<uint64_t> EdgeFreqs(F.Edges.size());
+  for (uint32_t I = 0; I < F.Edges.size(); ++I) {
+    const auto &Edge = F.Edges[I];
+    OutEdges[Edge.FromNode].push_back(I);
+    InEdges[Edge.ToNode].push_back(I);
+    if (Edge.Counter != 0xffffffff) {
+      EdgeFreqs[I] = Counters[Edge.Counter];
+      continue;
+    }
+    TreeChildren[Edge.FromNode].push_back(Edge.ToNode);
+    TreeParentEdge[Edge.ToNode] = I;
+  }
+  std::vector<std::vector<uint32_t>> NodeCalls(NumNodes);
+  for (uint32_t I = 0; I < F.Calls.size(); ++I)
+    NodeCalls[F.Calls[I].FromNode].push_back(I);
+  std::vector<uint64_t> LeafFrequency(NumNodes);
+  for (const auto &Leaf : F.LeafNodes)
+    LeafFrequency[Leaf.first] = Counters[Leaf.second];
+  std::vector<uint64_t> EntryAddress(NumNodes);
+  for (const auto &Entry : F.EntryNodes)
+    EntryAddress[Entry.first] = Entry.second;
+
+  // Bottom-up traversal of the spanning tree from all of its roots. The count
+  // of the edge into a node is its frequency minus the counts of its other
+  // incoming edges.
+  std::vector<uint64_t> CallFreqs(F.Calls.size());
+  std::vector<std::pair<uint32_t, bool>> Stack;
+  for (uint32_t I = 0; I < NumNodes; ++I)
+    if (TreeParentEdge[I] == -1)
+      Stack.emplace_back(I, false);
+  while (!Stack.empty()) {
+    const auto Cur = Stack.back().first;
+    if (!Stack.back().second) {
+      Stack.back().second = true;
+      for (const auto Child : TreeChildren[Cur])
+        Stack.emplace_back(Child, false);
+      continue;
+    }
+    Stack.pop_back();
+
+    uint64_t CurNodeFreq = LeafFrequency[Cur];
+    if (!CurNodeFreq)
+      for (const auto EdgeID : OutEdges[Cur])
+        CurNodeFreq += EdgeFreqs[EdgeID];
+
+    // Calls with their own counters have landing pads, and their frequency
+    // fixes the node frequency in the presence of exceptions.
+    uint64_t MaxCallFreq = 0;
+    for (const auto CallID : NodeCalls[Cur]) {
+      const auto &Call = F.Calls[CallID];
+      if (Call.Counter == 0xffffffff) {
+        CallFreqs[CallID] = CurNodeFreq;
+      } else {
+        CallFreqs[CallID] = Counters[Call.Counter];
+        MaxCallFreq = std::max(MaxCallFreq, CallFreqs[CallID]);
+      }
+      if (CallFreqs[CallID])
+        CallFlows[Call.TargetAddress].Calls += CallFreqs[CallID];
+    }
+    CurNodeFreq = std::max(CurNodeFreq, MaxCallFreq);
+    if (CurNodeFreq && EntryAddress[Cur])
+      CallFlows[EntryAddress[Cur]].Val = CurNodeFreq;
+
+    if (TreeParentEdge[Cur] == -1)
+      continue;
+    int64_t ParentEdgeFreq = CurNodeFreq;
+    for (const auto EdgeID : InEdges[Cur])
+      ParentEdgeFreq -= EdgeFreqs[EdgeID];
+    // Tolerate incorrect flow from the conservative CFG, as the runtime does
+    EdgeFreqs[TreeParentEdge[Cur]] = std::max<int64_t>(ParentEdgeFreq, 0);
+  }
+
+  for (uint32_t I = 0; I < F.Edges.size(); ++I) {
+    if (!EdgeFreqs[I])
+      continue;
+    writeLocation(OS, F.Edges[I].From);
+    writeLocation(OS, F.Edges[I].To);
+    OS << "0 " << EdgeFreqs[I] << '\n';
+  }
+  for (uint32_t I = 0; I < F.Calls.size(); ++I) {
+    if (!CallFreqs[I])
+      continue;
+    writeLocation(OS, F.Calls[I].From);
+    writeLocation(OS, F.Calls[I].To);
+    OS << "0 " << CallFreqs[I] << '\n';
+  }
+}
+
+void InstrumentationTables::convert(StringRef Filename, StringRef Buf,
+                                    raw_ostream &OS) const {
+  RawProfileHeader Header;
+  memcpy(&Header, Buf.data(), sizeof(Header));
+  if (Header.Version != 1)
+    report_error(Filename, "unsupported binary profile version " +
+                               std::to_string(Header.Version));
+  if (StringRef(reinterpret_cast<const char *>(Header.BuildID),
+                std::min<uint32_t>(Header.BuildIDSize,
+                                   sizeof(Header.BuildID))) !=
+      BuildID.take_front(sizeof(Header.BuildID)))
+    report_error(Filename, "build-id does not match the instrumented binary " +
+                               opts::InstrumentedBinary.getValue());
+  const uint64_t NumEntries =
+      uint64_t(Header.NumIndCallEntries) + Header.NumValueEntries;
+  if (Buf.size() != sizeof(Header) + 8ull * Header.NumCounters +
+                         NumEntries * sizeof(RawProfileEntry))
+    report_error(Filename, "truncated binary profile");
+
+  std::vector<uint64_t> Counters(Header.NumCounters);
+  memcpy(Counters.data(), Buf.data() + sizeof(Header), 8 * Counters.size());
+  std::vector<RawProfileEntry> Entries(NumEntries);
+  memcpy(Entries.data(), Buf.data() + sizeof(Header) + 8 * Counters.size(),
+         NumEntries * sizeof(RawProfileEntry));
+
+  std::map<uint64_t, CallFlow> CallFlows;
+  for (const auto &F : FuncDescriptions) {
+    for (const auto &Leaf : F.LeafNodes)
+      if (Leaf.second >= Counters.size())
+        report_error(Filename, "counter out of range");
+    for (const auto &Edge : F.Edges)
+      if (Edge.Counter != 0xffffffff && Edge.Counter >= Counters.size())
+        report_error(Filename, "counter out of range");
+    for (const auto &Call : F.Calls)
+      if (Call.Counter != 0xffffffff && Call.Counter >= Counters.size())
+        report_error(Filename, "counter out of range");
+    writeFunctionProfile(OS, F, Counters.data(), CallFlows);
+  }
+
+  for (uint32_t I = 0; I < Header.NumIndCallEntries; ++I) {
+    const auto &Entry = Entries[I];
+    if (Entry.Site >= IndCallDescriptions.size())
+      report_error(Filename, "indirect call site out of range");
+    writeLocation(OS, IndCallDescriptions[Entry.Site]);
+    if (const auto *Target = lookupIndCallTarget(Entry.Key)) {
+      CallFlows[Entry.Key].Calls += Entry.Count;
+      writeLocation(OS, *Target);
+      OS << "0 " << Entry.Count << '\n';
+    } else {
+      OS << "0 [unknown] 0 0 " << Entry.Count << '\n';
+    }
+  }
+
+  // Calls into the entry points of functions from uninstrumented code
+  for (const auto &Flow : CallFlows) {
+    if (Flow.second.Val <= Flow.second.Calls)
+      continue;
+    const auto *Target = lookupIndCallTarget(Flow.first);
+    if (!Target)
+      continue;
+    OS << "0 [unknown] 0 ";
+    writeLocation(OS, *Target);
+    OS << "0 " << Flow.second.Val - Flow.second.Calls << '\n';
+  }
+
+  // Memory event records must follow all branch records
+  for (uint32_t I = Header.NumIndCallEntries; I < NumEntries; ++I) {
+    const auto &Entry = Entries[I];
+    if (Entry.Site >= ValueSites.size())
+      report_error(Filename, "value profiling site out of range");
+    const auto &Loc = ValueSites[Entry.Site];
+    // Keys are biased by one since zero marks a vacant entry
+    OS << "4 " << Strings.drop_front(Loc.FunctionName).data() << ' '
+       << utohexstr(Loc.Offset, /*LowerCase=*/true) << " 3 [value] "
+       << utohexstr(Entry.Key - 1, /*LowerCase=*/true) << ' ' << Entry.Count
+       << '\n';
+  }
+}
+
+/// Return the tables of -instrumented-binary, read on first use.
+const InstrumentationTables &getInstrumentationTables(StringRef Filename) {
+  if (opts::InstrumentedBinary.empty())
+    report_error(Filename, "binary profile requires -instrumented-binary");
+  static const InstrumentationTables Tables(opts::InstrumentedBinary);
+  return Tables;
+}
+
+/// Open \\p Filename for writing a temporary file with sorted entries.
+std::unique_ptr<raw_fd_ostream> createSortedRun(std::string &Filename) {
+  int FD;
+  SmallString<128> Path;
+  if (std::error_code EC =
+          sys::fs::createTemporaryFile("merge-fdata", "fdata", FD, Path))
+    report_error("cannot create temporary file", EC);
+  Filename.assign(Path.begin(), Path.end());
+  return llvm::make_unique<raw_fd_ostream>(FD, /*shouldClose=*/true);
+}
+
+/// Read the legacy profile \p Filename, and write its entries scaled by
+/// \p Weight, sorted by key, and with equal keys combined to a temporary
+/// file. Only one input is held in memory by a task.
+std::string sortLegacyProfile(StringRef Filename, double Weight,
+                              LegacyProfileHeader &Header) {
+  auto MB = MemoryBuffer::getFileOrSTDIN(Filename);
+  if (std::error_code EC = MB.getError())
+    report_error(Filename, EC);
+
+  auto Buf = MB.get()->getBuffer();
+  std::string RawProfileData;
+  if (isRawProfile(Buf)) {
+    raw_string_ostream OS(RawProfileData);
+    getInstrumentationTables(Filename).convert(Filename, Buf, OS);
+    Buf = OS.str();
+  }
+  if (Buf.consume_front("boltedcollection\n"))
+    Header.BoltedCollection = true;
+  if (Buf.startswith("no_lbr")) {
+    Header.NoLBR = true;
+    StringRef Line;
+    std::tie(Line, Buf) = Buf.split('\n');
+    SmallVector<StringRef, 4> Events;
+    Line.drop_front(6).split(Events, ' ', -1, /*KeepEmpty=*/false);
+    for (auto Event : Events)
+      Header.EventNames.insert(Event.str());
+  }
+
+  std::vector<LegacyEntry> Entries;
+  while (!Buf.empty()) {
+    StringRef Line;
+    std::tie(Line, Buf) = Buf.split('\n');
+    if (Line.empty())
+      continue;
+    LegacyEntry Entry;
+    if (!parseLegacyEntry(Line, Header.NoLBR, Entry))
+      report_error(Filename, "malformed profile entry: " + Line.str());
+    if (Weight != 1.0) {
+      Entry.Count = scaleCount(Entry.Count, Weight);
+      Entry.Mispreds = scaleCount(Entry.Mispreds, Weight);
+      if (!Entry.Count && !Entry.Mispreds)
+        continue;
+    }
+    Header.TotalCounts[getEntryKind(Entry)] += Entry.Count;
+    Entries.push_back(Entry);
+  }
+  if (!std::is_sorted(Entries.begin(), Entries.end()))
+    std::stable_sort(Entries.begin(), Entries.end());
+
+  std::string RunName;
+  auto OS = createSortedRun(RunName);
+  for (auto I = Entries.begin(), E = Entries.end(); I != E;) {
+    LegacyEntry Merged = *I;
+    while (++I != E && I->Key == Merged.Key) {
+      Merged.Count += I->Count;
+      Merged.Mispreds += I->Mispreds;
+    }
+    writeLegacyEntry(*OS, Merged, Header.NoLBR);
+  }
+
+  return RunName;
+}
+
+/// Merge temporary files \p Runs with sorted unique entries into \p OS and
+/// delete them. Only the current entry of every run is kept in memory.
+/// Merged entries rejected by \p Filter are not written.
+void mergeSortedRuns(
+    ArrayRef<std::string> Runs, bool NoLBR, raw_ostream &OS,
+    function_ref<bool(const LegacyEntry &)> Filter =
+        [](const LegacyEntry &) { return true; }) {
+  struct RunReader {
+    std::unique_ptr<MemoryBuffer> MB;
+    StringRef Buf;
+    LegacyEntry Entry;
+
+    bool next(bool NoLBR) {
+      StringRef Line;
+      do {
+        if (Buf.empty())
+          return false;
+        std::tie(Line, Buf) = Buf.split('\n');
+      } while (Line.empty());
+      if (!parseLegacyEntry(Line, NoLBR, Entry))
+        report_error(MB->getBufferIdentifier(), "malformed temporary file");
+      return true;
+    }
+  };
+
+  std::vector<RunReader> Readers(Runs.size());
+  auto Greater = [&](size_t A, size_t B) {
+    return Readers[B].Entry < Readers[A].Entry;
+  };
+  std::priority_queue<size_t, std::vector<size_t>, decltype(Greater)>
+      Queue(Greater);
+  for (size_t I = 0; I < Runs.size(); ++I) {
+    auto MB = MemoryBuffer::getFile(Runs[I]);
+    if (std::error_code EC = MB.getError())
+      report_error(Runs[I], EC);
+    Readers[I].MB = std::move(MB.get());
+    Readers[I].Buf = Readers[I].MB->getBuffer();
+    if (Readers[I].next(NoLBR))
+      Queue.push(I);
+  }
+
+  while (!Queue.empty()) {
+    auto I = Queue.top();
+    Queue.pop();
+    LegacyEntry Merged = Readers[I].Entry;
+    if (Readers[I].next(NoLBR))
+      Queue.push(I);
+    while (!Queue.empty() && Readers[Queue.top()].Entry.Key == Merged.Key) {
+      I = Queue.top();
+      Queue.pop();
+      Merged.Count += Readers[I].Entry.Count;
+      Merged.Mispreds += Readers[I].Entry.Mispreds;
+      if (Readers[I].next(NoLBR))
+        Queue.push(I);
+    }
+    if (Filter(Merged))
+      writeLegacyEntry(OS, Merged, NoLBR);
+  }
+
+  Readers.clear();
+  for (const auto &Run : Runs)
+    sys::fs::remove(Run);
+}
+
+/// Merge legacy profiles summing the counts of equal entries. Every input is
+/// first sorted into a temporary file in parallel. The sorted files are then
+/// merged in groups of up to MergeFanIn files, with groups at the same level
+/// of the merge tree processed in parallel.
 void mergeLegacyProfiles(const cl::list<std::string> &Filenames) {
   errs() << "Using legacy profile format.\n";
-  bool BoltedCollection{false};
-  bool First{true};
   for (auto &Filename : Filenames) {
     if (isYAML(Filename))
       report_error(Filename, "cannot mix YAML and legacy formats");
-    auto MB = MemoryBuffer::getFileOrSTDIN(Filename);
-    if (std::error_code EC = MB.getError())
-      report_error(Filename, EC);
-    errs() << "Merging data from " << Filename << "...\n";
-
-    auto Buf = MB.get()->getBuffer();
-    // Check if the string "boltedcollection" is in the first line
-    if (Buf.startswith("boltedcollection\n")) {
-      if (!First && !BoltedCollection) {
-        report_error(
-            Filename,
-            "cannot mix profile collected in BOLT and non-BOLT deployments");
-      }
-      BoltedCollection = true;
-      if (!First)
-        Buf = Buf.drop_front(17);
-    } else {
-      if (BoltedCollection) {
-        report_error(
-            Filename,
-            "cannot mix profile collected in BOLT and non-BOLT deployments");
-      }
+  }
+
+  if (opts::PruneThreshold < 0.0 || opts::PruneThreshold >= 1.0) {
+    errs() << "ERROR: -prune must be in [0, 1)\n";
+    exit(1);
+  }
+
+  const auto Weights = getInputWeights(Filenames);
+  ThreadPool Pool(std::max(1U, unsigned(opts::ThreadCount)));
+  std::vector<LegacyProfileHeader> Headers(Filenames.size());
+  std::vector<std::string> Runs(Filenames.size());
+  for (size_t I = 0; I < Filenames.size(); ++I) {
+    errs() << "Merging data from " << Filenames[I] << "...\n";
+    Pool.async([&, I] {
+      Runs[I] = sortLegacyProfile(Filenames[I], Weights[I], Headers[I]);
+    });
+  }
+  Pool.wait();
+
+  LegacyProfileHeader MergedHeader = Headers.front();
+  for (size_t I = 1; I < Headers.size(); ++I) {
+    if (Headers[I].BoltedCollection != MergedHeader.BoltedCollection) {
+      report_error(
+          Filenames[I],
+          "cannot mix profile collected in BOLT and non-BOLT deployments");
+    }
+    if (Headers[I].NoLBR != MergedHeader.NoLBR)
+      report_error(Filenames[I], "cannot mix LBR and non-LBR profiles");
+    if (Headers[I].EventNames != MergedHeader.EventNames) {
+      errs() << "WARNING: merging profiles with different sampling events\n";
+      MergedHeader.EventNames.insert(Headers[I].EventNames.begin(),
+                                     Headers[I].EventNames.end());
     }
+    for (unsigned Kind = 0; Kind < 2; ++Kind)
+      MergedHeader.TotalCounts[Kind] += Headers[I].TotalCounts[Kind];
+  }
+  const bool NoLBR = MergedHeader.NoLBR;
+
+  const size_t FanIn = std::max(2U, unsigned(opts::MergeFanIn));
+  while (Runs.size() > FanIn) {
+    std::vector<std::string> NextRuns((Runs.size() + FanIn - 1) / FanIn);
+    for (size_t I = 0; I < NextRuns.size(); ++I) {
+      Pool.async([&, I] {
+        const auto Begin = I * FanIn;
+        const auto Size = std::min(FanIn, Runs.size() - Begin);
+        auto OS = createSortedRun(NextRuns[I]);
+        mergeSortedRuns(makeArrayRef(Runs).slice(Begin, Size), NoLBR, *OS);
+      });
+    }
+    Pool.wait();
+    Runs = std::move(NextRuns);
+  }
 
-    outs() << Buf;
-    First = false;
+  raw_ostream &OS = opts::SuppressMergedDataOutput ? nulls() : outs();
+  if (MergedHeader.BoltedCollection)
+    OS << "boltedcollection\n";
+  if (NoLBR) {
+    OS << "no_lbr";
+    for (const auto &Event : MergedHeader.EventNames)
+      OS << ' ' << Event;
+    OS << '\n';
   }
+  // Entries below the threshold are dropped while writing the final merge
+  // since only then the total counts of entries are known.
+  uint64_t MinCounts[2];
+  uint64_t KeptCounts[2] = {0, 0};
+  uint64_t NumEntries = 0;
+  uint64_t NumKeptEntries = 0;
+  for (unsigned Kind = 0; Kind < 2; ++Kind)
+    MinCounts[Kind] = static_cast<uint64_t>(
+        std::ceil(MergedHeader.TotalCounts[Kind] * opts::PruneThreshold));
+  mergeSortedRuns(Runs, NoLBR, OS, [&](const LegacyEntry &Entry) {
+    const auto Kind = getEntryKind(Entry);
+    ++NumEntries;
+    if (Entry.Count < MinCounts[Kind])
+      return false;
+    ++NumKeptEntries;
+    KeptCounts[Kind] += Entry.Count;
+    return true;
+  });
+
   errs() << "Profile from " << Filenames.size() << " files merged.\n";
+  if (opts::PruneThreshold > 0.0) {
+    errs() << "Kept " << NumKeptEntries << " out of " << NumEntries
+           << " entries";
+    const char *KindNames[] = {NoLBR ? "samples" : "branches",
+                               "memory accesses"};
+    for (unsigned Kind = 0; Kind < 2; ++Kind) {
+      if (!MergedHeader.TotalCounts[Kind])
+        continue;
+      errs() << format(", %.2lf%% of %s",
+                       100.0 * KeptCounts[Kind] /
+                           MergedHeader.TotalCounts[Kind],
+                       KindNames[Kind]);
+    }
+    errs() << '\n';
+  }
 }
 
 } // anonymous namespace
@@ -297,52 +1245,63 @@ int main(int argc, char **argv) {
   ToolName = argv[0];
 
   if (!isYAML(opts::InputDataFilenames.front())) {
+    if (!opts::ExactProfiles.empty()) {
+      errs() << "ERROR: -exact-profiles requires YAML inputs\n";
+      exit(1);
+    }
     mergeLegacyProfiles(opts::InputDataFilenames);
     return 0;
   }
 
-  // Merged header.
-  BinaryProfileHeader MergedHeader;
-  MergedHeader.Version = 1;
-
-  // Merged information for all functions.
-  StringMap<BinaryFunctionProfile> MergedBFs;
-
-  for (auto &InputDataFilename : opts::InputDataFilenames) {
-    auto MB = MemoryBuffer::getFileOrSTDIN(InputDataFilename);
-    if (std::error_code EC = MB.getError())
-      report_error(InputDataFilename, EC);
-    yaml::Input YamlInput(MB.get()->getBuffer());
-
+  // Inputs are split into contiguous groups merged in parallel, and the
+  // merged groups are then combined pairwise. Memory use is bounded by the
+  // number of groups rather than by the number of inputs.
+  const auto &Filenames = opts::InputDataFilenames;
+  const size_t NumGroups =
+      std::max<size_t>(1, std::min<size_t>(opts::ThreadCount,
+                                           Filenames.size()));
+  std::vector<MergedYAMLProfile> Groups(NumGroups);
+  const auto Weights = getInputWeights(Filenames);
+  for (auto &InputDataFilename : Filenames)
     errs() << "Merging data from " << InputDataFilename << "...\n";
 
-    BinaryProfile BP;
-    YamlInput >> BP;
-    if (YamlInput.error())
-      report_error(InputDataFilename, YamlInput.error());
+  ThreadPool Pool(NumGroups);
+  for (size_t I = 0; I < NumGroups; ++I) {
+    Pool.async([&, I] {
+      const auto Begin = I * Filenames.size() / NumGroups;
+      const auto End = (I + 1) * Filenames.size() / NumGroups;
+      for (auto J = Begin; J < End; ++J)
+        mergeYAMLProfile(Groups[I], Filenames[J], Weights[J]);
+    });
+  }
+  Pool.wait();
 
-    // Sanity check.
-    if (BP.Header.Version != 1) {
-      errs() << "Unable to merge data from profile using version "
-             << BP.Header.Version << '\n';
-      exit(1);
+  for (size_t Step = 1; Step < NumGroups; Step *= 2) {
+    for (size_t I = 0; I + Step < NumGroups; I += 2 * Step) {
+      Pool.async([&, I, Step] {
+        mergeYAMLProfiles(Groups[I], std::move(Groups[I + Step]));
+      });
     }
+    Pool.wait();
+  }
 
-    // Merge the header.
-    mergeProfileHeaders(MergedHeader, BP.Header);
-
-    // Do the function merge.
-    for (auto &BF : BP.Functions) {
-      if (!MergedBFs.count(BF.Name)) {
-        MergedBFs.insert(std::make_pair(BF.Name, BF));
-        continue;
-      }
-
-      auto &MergedBF = MergedBFs.find(BF.Name)->second;
-      mergeFunctionProfile(MergedBF, std::move(BF));
+  if (!opts::ExactProfiles.empty()) {
+    MergedYAMLProfile Exact;
+    for (auto &Filename : opts::ExactProfiles) {
+      if (!isYAML(Filename))
+        report_error(Filename, "exact profile is not in YAML format");
+      errs() << "Merging exact data from " << Filename << "...\n";
+      mergeYAMLProfile(Exact, Filename, 1.0);
     }
+    combineExactProfile(Groups.front(), std::move(Exact));
   }
 
+  // Merged header.
+  BinaryProfileHeader &MergedHeader = Groups.front().Header;
+
+  // Merged information for all functions.
+  StringMap<BinaryFunctionProfile> &MergedBFs = Groups.front().BFs;
+
   if (!opts::SuppressMergedDataOutput) {
     yaml::Output YamlOut(outs());
 
@@ -363,6 +1322,24 @@ int main(int argc, char **argv) {
                 return A.Id < B.Id;
               });
 
+    // The order of blocks, calls, and successors depends on the order the
+    // inputs were merged in. Sort them to get the same output regardless of
+    // the number of threads.
+    for (auto &BF : MergedProfile.Functions) {
+      std::sort(BF.Blocks.begin(), BF.Blocks.end(),
+                [] (const BinaryBasicBlockProfile &A,
+                    const BinaryBasicBlockProfile &B) {
+                  return A.Index < B.Index;
+                });
+      for (auto &BB : BF.Blocks) {
+        std::sort(BB.CallSites.begin(), BB.CallSites.end());
+        std::sort(BB.Successors.begin(), BB.Successors.end(),
+                  [] (const SuccessorInfo &A, const SuccessorInfo &B) {
+                    return A.Index < B.Index;
+                  });
+      }
+    }
+
     YamlOut << MergedProfile;
   }
 
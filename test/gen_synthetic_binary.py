@@ -0,0 +1,295 @@
+#!/usr/bin/env python3
+#===------------- llvm/tools/llvm-bolt/test/gen_synthetic_binary.py -------===//
+#
+#                     The LLVM Compiler Infrastructure
+#
+# This file is distributed under the University of Illinois Open Source
+# License. See LICENSE.TXT for details.
+#
+#===-----------------------------------------------------------------------===//
+#
+# Generator of synthetic x86-64 inputs for BOLT scaling tests. The generated
+# assembly contains a configurable number of functions with a mix of CFG
+# shapes: chains of conditional branches, loops, switches dispatched through
+# jump tables, and calls covered by landing pads with a hand-written LSDA.
+# Every function is placed into its own section and annotated with "# FDATA:"
+# lines in the format used by link_fdata.sh.
+#
+# With -o, only the assembly is written. With --build, the assembly is
+# assembled and linked with -Wl,-q, and a matching profile is produced. The
+# profile is resolved here instead of link_fdata.sh, which does not scale to
+# millions of symbols:
+#
+#   gen_synthetic_binary.py --functions 1000000 --build <dir> \
+#     --llvm-mc <path> --cc <path>
+#
+# produces <dir>/synthetic.exe and <dir>/synthetic.fdata.
+#
+#===-----------------------------------------------------------------------===//
+
+import argparse
+import os
+import random
+import re
+import subprocess
+import sys
+
+SHAPES = ('chain', 'loop', 'switch', 'eh')
+
+
+class FunctionWriter:
+    """Writes a single function and its profile."""
+
+    def __init__(self, out, rng, args, index, hot):
+        self.out = out
+        self.rng = rng
+        self.args = args
+        self.name = 'f%d' % index
+        self.index = index
+        self.hot = hot
+        self.labels = 0
+
+    def label(self, kind):
+        self.labels += 1
+        return '%s.%s%d' % (self.name, kind, self.labels)
+
+    def emit(self, line):
+        self.out.write(line + '\n')
+
+    def count(self):
+        if not self.hot:
+            return 0
+        return self.rng.randint(1, self.args.max_count)
+
+    def branch(self, source, target_function, target, count, mispreds=0):
+        if count:
+            self.emit('# FDATA: 1 %s #%s# 1 %s #%s# %d %d'
+                      % (self.name, source, target_function, target,
+                         mispreds, count))
+
+    def callee(self):
+        return 'f%d' % self.rng.randrange(self.args.functions)
+
+    def call(self):
+        callee = self.callee()
+        site = self.label('call')
+        self.emit('%s:' % site)
+        self.emit('  callq %s' % callee)
+        if self.hot:
+            self.emit('# FDATA: 1 %s #%s# 1 %s 0 0 %d'
+                      % (self.name, site, callee, self.count()))
+
+    def write(self, shape):
+        self.emit('  .section .text.%s,"ax",@progbits' % self.name)
+        self.emit('  .globl %s' % self.name)
+        self.emit('  .type %s,@function' % self.name)
+        self.emit('%s:' % self.name)
+        self.emit('  .cfi_startproc')
+        if shape == 'eh':
+            self.emit('  .cfi_personality 3, __synthetic_personality')
+            self.emit('  .cfi_lsda 3, %s.lsda' % self.name)
+        self.emit('  pushq %rbp')
+        self.emit('  .cfi_def_cfa_offset 16')
+        self.emit('  .cfi_offset %rbp, -16')
+        getattr(self, 'write_' + shape)()
+        self.emit('%s.exit:' % self.name)
+        self.emit('  popq %rbp')
+        self.emit('  .cfi_def_cfa_offset 8')
+        self.emit('  retq')
+        self.emit('  .cfi_endproc')
+        self.emit('  .size %s, .-%s' % (self.name, self.name))
+
+    def write_chain(self):
+        for _ in range(self.rng.randint(1, self.args.max_blocks)):
+            source = self.label('b')
+            target = self.label('t')
+            self.emit('  testq %rdi, %rdi')
+            self.emit('%s:' % source)
+            self.emit('  je %s' % target)
+            self.emit('  addq $1, %rdi')
+            if self.rng.random() < self.args.call_ratio:
+                self.call()
+            self.emit('%s:' % target)
+            self.branch(source, self.name, target, self.count(),
+                        self.rng.randint(0, 1))
+
+    def write_loop(self):
+        head = self.label('loop')
+        latch = self.label('latch')
+        self.emit('  movq $%d, %%rcx' % self.rng.randint(2, 100))
+        self.emit('%s:' % head)
+        self.emit('  addq %rcx, %rdi')
+        if self.rng.random() < self.args.call_ratio:
+            self.call()
+        self.emit('  decq %rcx')
+        self.emit('%s:' % latch)
+        self.emit('  jnz %s' % head)
+        self.branch(latch, self.name, head, self.count() * 10)
+
+    def write_switch(self):
+        cases = [self.label('case')
+                 for _ in range(self.rng.randint(2, self.args.max_cases))]
+        table = '%s.jt' % self.name
+        default = self.label('default')
+        jump = self.label('jmp')
+        self.emit('  cmpq $%d, %%rdi' % (len(cases) - 1))
+        self.emit('  ja %s' % default)
+        self.emit('%s:' % jump)
+        self.emit('  jmpq *%s(,%%rdi,8)' % table)
+        for case in cases:
+            self.emit('%s:' % case)
+            self.emit('  addq $%d, %%rax' % self.rng.randint(1, 1000))
+            self.emit('  jmp %s.exit' % self.name)
+            self.branch(jump, self.name, case, self.count())
+        self.emit('%s:' % default)
+        self.emit('  xorq %rax, %rax')
+        self.emit('  jmp %s.exit' % self.name)
+        self.emit('  .section .rodata.%s,"a",@progbits' % self.name)
+        self.emit('  .p2align 3')
+        self.emit('%s:' % table)
+        for case in cases:
+            self.emit('  .quad %s' % case)
+        self.emit('  .section .text.%s,"ax",@progbits' % self.name)
+
+    def write_eh(self):
+        begin = self.label('csbegin')
+        end = self.label('csend')
+        pad = self.label('lpad')
+        self.emit('%s:' % begin)
+        self.call()
+        self.emit('%s:' % end)
+        self.emit('  jmp %s.exit' % self.name)
+        self.emit('%s:' % pad)
+        self.emit('  xorq %rax, %rax')
+        self.emit('  jmp %s.exit' % self.name)
+
+        # Cleanup-only LSDA with a single call site.
+        self.emit('  .section .gcc_except_table.%s,"a",@progbits'
+                  % self.name)
+        self.emit('%s.lsda:' % self.name)
+        self.emit('  .byte 255')
+        self.emit('  .byte 255')
+        self.emit('  .byte 1')
+        self.emit('  .uleb128 %s.cse-%s.csb' % (self.name, self.name))
+        self.emit('%s.csb:' % self.name)
+        self.emit('  .uleb128 %s-%s' % (begin, self.name))
+        self.emit('  .uleb128 %s-%s' % (end, begin))
+        self.emit('  .uleb128 %s-%s' % (pad, self.name))
+        self.emit('  .byte 0')
+        self.emit('%s.cse:' % self.name)
+        self.emit('  .section .text.%s,"ax",@progbits' % self.name)
+
+
+def generate(out, args):
+    rng = random.Random(args.seed)
+    weights = [args.chain_weight, args.loop_weight, args.switch_weight,
+               args.eh_weight]
+
+    out.write('# Synthetic input generated by gen_synthetic_binary.py with '
+              '%d functions, seed %d.\n' % (args.functions, args.seed))
+    out.write('  .text\n')
+    out.write('  .globl _start\n')
+    out.write('  .type _start,@function\n')
+    out.write('_start:\n')
+    out.write('  xorq %rdi, %rdi\n')
+    out.write('  callq f0\n')
+    out.write('  movl $60, %eax\n')
+    out.write('  xorl %edi, %edi\n')
+    out.write('  syscall\n')
+    out.write('  .size _start, .-_start\n')
+    out.write('  .globl __synthetic_personality\n')
+    out.write('  .type __synthetic_personality,@function\n')
+    out.write('__synthetic_personality:\n')
+    out.write('  retq\n')
+    out.write('  .size __synthetic_personality, .-__synthetic_personality\n')
+
+    for index in range(args.functions):
+        shape = rng.choices(SHAPES, weights)[0]
+        hot = rng.random() < args.hot_fraction
+        FunctionWriter(out, rng, args, index, hot).write(shape)
+
+
+def resolve_fdata(asm, obj, fdata, nm):
+    """Produce the profile from FDATA lines of asm, resolving #symbol#
+    references to symbol values in obj. Since every function is in its own
+    section, symbol values are offsets from the start of the function."""
+    symbols = {}
+    output = subprocess.check_output([nm, '--defined-only', obj],
+                                     universal_newlines=True)
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) == 3:
+            symbols[fields[2]] = fields[0].lstrip('0') or '0'
+
+    reference = re.compile(r'#([^#\s]+)#')
+    with open(asm) as src, open(fdata, 'w') as dst:
+        for line in src:
+            if not line.startswith('# FDATA: '):
+                continue
+            dst.write(reference.sub(lambda m: symbols[m.group(1)],
+                                    line[len('# FDATA: '):]))
+
+
+def build(args):
+    os.makedirs(args.build, exist_ok=True)
+    asm = os.path.join(args.build, 'synthetic.s')
+    obj = os.path.join(args.build, 'synthetic.o')
+    exe = os.path.join(args.build, 'synthetic.exe')
+    fdata = os.path.join(args.build, 'synthetic.fdata')
+
+    with open(asm, 'w') as out:
+        generate(out, args)
+    subprocess.check_call([args.llvm_mc, '-filetype=obj',
+                           '-triple', 'x86_64-unknown-unknown', asm,
+                           '-o', obj])
+    resolve_fdata(asm, obj, fdata, args.nm)
+    subprocess.check_call([args.strip, '--strip-unneeded', obj])
+    subprocess.check_call([args.cc, obj, '-o', exe, '-Wl,-q', '-nostdlib',
+                           '-no-pie'])
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Generate a synthetic input binary for BOLT.')
+    parser.add_argument('--functions', type=int, default=1000,
+                        help='number of functions')
+    parser.add_argument('--seed', type=int, default=0,
+                        help='seed of the random generator')
+    parser.add_argument('--hot-fraction', type=float, default=0.15,
+                        help='fraction of functions with profile')
+    parser.add_argument('--max-count', type=int, default=10000,
+                        help='maximum branch count in the profile')
+    parser.add_argument('--max-blocks', type=int, default=16,
+                        help='maximum number of branches in a chain')
+    parser.add_argument('--max-cases', type=int, default=64,
+                        help='maximum number of jump table entries')
+    parser.add_argument('--call-ratio', type=float, default=0.2,
+                        help='probability of a call in a block')
+    parser.add_argument('--chain-weight', type=float, default=5)
+    parser.add_argument('--loop-weight', type=float, default=2)
+    parser.add_argument('--switch-weight', type=float, default=1)
+    parser.add_argument('--eh-weight', type=float, default=2)
+    parser.add_argument('-o', '--output',
+                        help='write the assembly to this file')
+    parser.add_argument('--build',
+                        help='directory to write the binary and profile to')
+    parser.add_argument('--llvm-mc', default='llvm-mc')
+    parser.add_argument('--nm', default='nm')
+    parser.add_argument('--strip', default='strip')
+    parser.add_argument('--cc', default='cc')
+    args = parser.parse_args()
+
+    if args.functions < 1:
+        parser.error('at least one function is required')
+
+    if args.build:
+        build(args)
+    elif args.output and args.output != '-':
+        with open(args.output, 'w') as out:
+            generate(out, args)
+    else:
+        generate(sys.stdout, args)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+#===----------------- llvm/tools/llvm-bolt/utils/bolt-bench.py ------------===//
+#
+#                     The LLVM Compiler Infrastructure
+#
+# This file is distributed under the University of Illinois Open Source
+# License. See LICENSE.TXT for details.
+#
+#===-----------------------------------------------------------------------===//
+#
+# This script measures the throughput of BOLT itself. Every benchmark runs
+# perf2bolt or llvm-bolt several times with -telemetry-file and reports the
+# median, minimum and maximum of the wall time, CPU time and peak memory of
+# the whole run and of every rewriting phase and optimization pass in JSON.
+#
+# By default, the benchmarks use a synthetic input built from the test inputs
+# with yaml2obj. A recorded binary and its profile could be benchmarked with
+# --binary and --fdata (or --perfdata) in addition to the synthetic input.
+# For scaling tests, --synthetic-functions generates an input of the given
+# size with test/gen_synthetic_binary.py.
+#
+# Usage:
+#
+#   bolt-bench.py --tools-dir <llvm-bin> [--repeat N] [-o report.json]
+#
+#===-----------------------------------------------------------------------===//
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+DEFAULT_INPUTS_DIR = os.path.join(SCRIPT_DIR, '..', 'test', 'X86', 'Inputs')
+GENERATOR = os.path.join(SCRIPT_DIR, '..', 'test', 'gen_synthetic_binary.py')
+
+# Options of llvm-bolt that exercise the optimizations measured by the layout
+# benchmarks.
+LAYOUT_OPTIONS = ['-reorder-blocks=cache+', '-reorder-functions=hfsort+',
+                  '-split-functions=3', '-split-all-cold']
+
+
+def get_benchmarks(exe, fdata, perfdata, preaggregated):
+    """Return (name, tool, arguments) triples. Arguments may refer to the
+    output file via the '{out}' placeholder."""
+    benchmarks = []
+    if perfdata:
+        benchmarks.append(('aggregate-perf', 'perf2bolt',
+                           [exe, '-p', perfdata, '-o', '{out}']))
+    if preaggregated:
+        benchmarks.append(('aggregate-preaggregated', 'perf2bolt',
+                           [exe, '-pa', '-p', preaggregated, '-o', '{out}']))
+    if fdata:
+        benchmarks += [
+            ('read-fdata', 'llvm-bolt',
+             [exe, '-data', fdata, '-o', '{out}']),
+            ('layout', 'llvm-bolt',
+             [exe, '-data', fdata, '-o', '{out}'] + LAYOUT_OPTIONS),
+            ('icf', 'llvm-bolt',
+             [exe, '-data', fdata, '-o', '{out}', '-icf']),
+            ('mcf', 'llvm-bolt',
+             [exe, '-data', fdata, '-o', '{out}', '-mcf=log']),
+        ]
+    benchmarks.append(('emit-no-profile', 'llvm-bolt',
+                       [exe, '-o', '{out}', '-lite=0']))
+    return benchmarks
+
+
+def summarize(values):
+    return {
+        'median': statistics.median(values),
+        'min': min(values),
+        'max': max(values),
+    }
+
+
+def run_benchmark(tool, args, repeat, work_dir, threads):
+    """Run the benchmark and return the summary of the measurements."""
+    runs = []
+    for iteration in range(repeat):
+        out = os.path.join(work_dir, 'out.%d' % iteration)
+        telemetry = os.path.join(work_dir, 'telemetry.%d.json' % iteration)
+        cmd = [tool] + [a.replace('{out}', out) for a in args]
+        cmd.append('-telemetry-file=' + telemetry)
+        if threads:
+            cmd.append('-thread-count=%d' % threads)
+
+        start = time.monotonic()
+        result = subprocess.run(cmd, stdout=subprocess.DEVNULL,
+                                stderr=subprocess.PIPE,
+                                universal_newlines=True)
+        wall_time = time.monotonic() - start
+        if result.returncode != 0:
+            raise RuntimeError('command failed: %s\n%s'
+                               % (' '.join(cmd), result.stderr))
+
+        with open(telemetry) as f:
+            report = json.load(f)
+        runs.append((wall_time, report))
+
+    summary = {
+        'command': [tool] + args,
+        'repeat': repeat,
+        'threads': runs[0][1]['threads'],
+        'wall_time': summarize([wall for wall, _ in runs]),
+        'records': {},
+    }
+
+    # Records of the same run are kept in order of their completion. Records
+    # with the same name are summed up per run, e.g. for repeated passes.
+    keys = []
+    per_run = []
+    for _, report in runs:
+        totals = {}
+        for record in report['records']:
+            key = record['group'] + '/' + record['name']
+            if key not in totals:
+                totals[key] = {'wall_time': 0.0, 'cpu_time': 0.0,
+                               'max_rss': 0}
+                if key not in keys:
+                    keys.append(key)
+            totals[key]['wall_time'] += record['wall_time']
+            totals[key]['cpu_time'] += record['cpu_time']
+            totals[key]['max_rss'] = max(totals[key]['max_rss'],
+                                         record['max_rss'])
+        per_run.append(totals)
+
+    for key in keys:
+        values = [totals[key] for totals in per_run if key in totals]
+        summary['records'][key] = {
+            metric: summarize([v[metric] for v in values])
+            for metric in ('wall_time', 'cpu_time', 'max_rss')
+        }
+    return summary
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Measure the throughput of BOLT rewriting stages.')
+    parser.add_argument('--tools-dir', required=True,
+                        help='directory with llvm-bolt, perf2bolt and yaml2obj')
+    parser.add_argument('--inputs-dir', default=DEFAULT_INPUTS_DIR,
+                        help='directory with synthetic benchmark inputs')
+    parser.add_argument('--binary', help='recorded input binary')
+    parser.add_argument('--fdata', help='profile of the recorded binary')
+    parser.add_argument('--perfdata', help='perf.data of the recorded binary')
+    parser.add_argument('--synthetic-functions', type=int, default=0,
+                        help='number of functions in a generated input for '
+                             'scaling benchmarks')
+    parser.add_argument('--cc', default='cc',
+                        help='compiler driver used to link generated inputs')
+    parser.add_argument('--repeat', type=int, default=5,
+                        help='number of runs of every benchmark')
+    parser.add_argument('--threads', type=int, default=0,
+                        help='value of -thread-count, default is host '
+                             'concurrency')
+    parser.add_argument('--filter', default='',
+                        help='run only benchmarks containing this string')
+    parser.add_argument('-o', '--output', default='-',
+                        help='file to write the JSON report to')
+    args = parser.parse_args()
+
+    def tool(name):
+        return os.path.join(args.tools_dir, name)
+
+    report = {'benchmarks': {}}
+    with tempfile.TemporaryDirectory(prefix='bolt-bench.') as work_dir:
+        # Synthetic input.
+        exe = os.path.join(work_dir, 'blarge.exe')
+        subprocess.check_call([tool('yaml2obj'),
+                               os.path.join(args.inputs_dir, 'blarge.yaml'),
+                               '-o', exe])
+        preaggregated = os.path.join(args.inputs_dir, 'pre-aggregated.txt')
+        fdata = os.path.join(work_dir, 'blarge.fdata')
+        subprocess.check_call([tool('perf2bolt'), exe, '-pa', '-p',
+                               preaggregated, '-o', fdata],
+                              stdout=subprocess.DEVNULL)
+        inputs = [('synthetic', exe, fdata, None, preaggregated)]
+        if args.synthetic_functions:
+            build_dir = os.path.join(work_dir, 'scaling')
+            subprocess.check_call([sys.executable, GENERATOR,
+                                   '--functions',
+                                   str(args.synthetic_functions),
+                                   '--build', build_dir,
+                                   '--llvm-mc', tool('llvm-mc'),
+                                   '--nm', tool('llvm-nm'),
+                                   '--strip', tool('llvm-strip'),
+                                   '--cc', args.cc])
+            inputs.append(('scaling',
+                           os.path.join(build_dir, 'synthetic.exe'),
+                           os.path.join(build_dir, 'synthetic.fdata'),
+                           None, None))
+        if args.binary:
+            inputs.append(('recorded', os.path.abspath(args.binary),
+                           args.fdata and os.path.abspath(args.fdata),
+                           args.perfdata and os.path.abspath(args.perfdata),
+                           None))
+
+        for prefix, binary, profile, perfdata, pa in inputs:
+            for name, tool_name, tool_args in get_benchmarks(
+                    binary, profile, perfdata, pa):
+                name = prefix + '/' + name
+                if args.filter not in name:
+                    continue
+                print('bolt-bench: running ' + name, file=sys.stderr)
+                report['benchmarks'][name] = run_benchmark(
+                    tool(tool_name), tool_args, args.repeat, work_dir,
+                    args.threads)
+
+    output = json.dumps(report, indent=2, sort_keys=True)
+    if args.output == '-':
+        print(output)
+    else:
+        with open(args.output, 'w') as f:
+            f.write(output + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+#===-------------- llvm/tools/llvm-bolt/utils/bolt-instr-bench.py ---------===//
+#
+#                     The LLVM Compiler Infrastructure
+#
+# This file is distributed under the University of Illinois Open Source
+# License. See LICENSE.TXT for details.
+#
+#===-----------------------------------------------------------------------===//
+#
+# This script measures the overhead of instrumented binaries. It builds the
+# workloads in utils/instr-bench (tight loops, virtual dispatch, deep
+# recursion and multithreaded counters), instruments each of them with every
+# configuration of llvm-bolt options below, and reports in JSON the median,
+# minimum and maximum of:
+#
+#   - the slowdown of the workload proper against the uninstrumented binary,
+#   - the time between the end of the workload and the exit of the process,
+#     minus the same time for the uninstrumented binary, which is the time
+#     taken to write the profile.
+#
+# The workloads print the CLOCK_MONOTONIC time at which they are done, which
+# is the clock of time.monotonic() on Linux.
+#
+# Usage:
+#
+#   bolt-instr-bench.py --tools-dir <llvm-bin> [--cxx c++] [--repeat N]
+#                       [-o report.json]
+#
+#===-----------------------------------------------------------------------===//
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import time
+
+SCRIPT_DIR = os.path.dirname(os.path.abspath(__file__))
+WORKLOADS_DIR = os.path.join(SCRIPT_DIR, 'instr-bench')
+WORKLOADS = ['loops', 'dispatch', 'recursion', 'threads']
+
+# Instrumentation options to measure. Configurations marked as needing a
+# profile get the profile written by the default configuration with -data.
+CONFIGURATIONS = [
+    ('default', [], False),
+    ('no-calls', ['-instrument-calls=0'], False),
+    ('calls-only', ['-instrument-calls-only'], False),
+    ('hot-only', ['-instrument-hot-only'], True),
+    ('conservative', ['-conservative-instrumentation'], False),
+    ('no-atomic', ['-instrumentation-no-atomic'], False),
+    ('skip-dead-flags', ['-instrumentation-skip-dead-flags'], False),
+    ('counter-shards', ['-instrumentation-counter-shards=8'], False),
+    ('sort-counters', ['-instrumentation-sort-counters'], True),
+]
+
+
+def summarize(values):
+    return {
+        'median': statistics.median(values),
+        'min': min(values),
+        'max': max(values),
+    }
+
+
+def run_once(cmd):
+    """Run the workload and return the time it took to do its work and the
+    time from then to its exit, in seconds."""
+    start = time.monotonic()
+    result = subprocess.run(cmd, stdout=subprocess.PIPE,
+                            stderr=subprocess.PIPE,
+                            universal_newlines=True)
+    exit_time = time.monotonic()
+    if result.returncode != 0:
+        raise RuntimeError('command failed: %s\n%s'
+                           % (' '.join(cmd), result.stderr))
+    end = None
+    for line in result.stdout.splitlines():
+        if line.startswith('bench-end '):
+            end = int(line.split()[1]) / 1e9
+    if end is None:
+        raise RuntimeError('no end time reported by %s' % cmd[0])
+    return end - start, exit_time - end
+
+
+def run_workload(exe, scale, repeat):
+    runs = [run_once([exe, str(scale)]) for _ in range(repeat)]
+    return [work for work, _ in runs], [tail for _, tail in runs]
+
+
+def build_workload(cxx, name, work_dir):
+    exe = os.path.join(work_dir, name + '.exe')
+    # Relocations are needed by llvm-bolt to instrument the binary.
+    subprocess.check_call([cxx, '-O2', '-pthread', '-fno-pie', '-no-pie',
+                           '-Wl,-q', '-o', exe,
+                           os.path.join(WORKLOADS_DIR, name + '.cpp')])
+    return exe
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Measure the overhead of instrumented binaries.')
+    parser.add_argument('--tools-dir', required=True,
+                        help='directory with llvm-bolt')
+    parser.add_argument('--cxx', default='c++',
+                        help='compiler driver used to build the workloads')
+    parser.add_argument('--runtime-lib',
+                        help='instrumentation runtime library, passed with '
+                             '-runtime-instrumentation-lib')
+    parser.add_argument('--scale', type=int, default=1,
+                        help='amount of work done by every workload')
+    parser.add_argument('--repeat', type=int, default=5,
+                        help='number of runs of every binary')
+    parser.add_argument('--filter', default='',
+                        help='run only benchmarks containing this string')
+    parser.add_argument('-o', '--output', default='-',
+                        help='file to write the JSON report to')
+    args = parser.parse_args()
+    bolt = os.path.join(args.tools_dir, 'llvm-bolt')
+
+    report = {'benchmarks': {}}
+    with tempfile.TemporaryDirectory(prefix='bolt-instr-bench.') as work_dir:
+        for workload in WORKLOADS:
+            if not any(args.filter in workload + '/' + config
+                       for config, _, _ in CONFIGURATIONS):
+                continue
+            print('bolt-instr-bench: building ' + workload, file=sys.stderr)
+            exe = build_workload(args.cxx, workload, work_dir)
+            base_work, base_tail = run_workload(exe, args.scale, args.repeat)
+            base_work = statistics.median(base_work)
+            base_tail = statistics.median(base_tail)
+            profile = None
+
+            for config, options, needs_profile in CONFIGURATIONS:
+                name = workload + '/' + config
+                if needs_profile and not profile:
+                    continue
+                if args.filter not in name and config != 'default':
+                    continue
+                print('bolt-instr-bench: running ' + name, file=sys.stderr)
+                fdata = os.path.join(work_dir, '%s.%s.fdata'
+                                     % (workload, config))
+                instrumented = os.path.join(work_dir, '%s.%s.exe'
+                                            % (workload, config))
+                cmd = [bolt, exe, '-instrument', '-o', instrumented,
+                       '-instrumentation-file=' + fdata] + options
+                if needs_profile:
+                    cmd.append('-data=' + profile)
+                if args.runtime_lib:
+                    cmd.append('-runtime-instrumentation-lib=' +
+                               args.runtime_lib)
+                subprocess.check_call(cmd, stdout=subprocess.DEVNULL)
+
+                work, tail = run_workload(instrumented, args.scale,
+                                          args.repeat)
+                if config == 'default':
+                    profile = fdata
+                    if args.filter not in name:
+                        continue
+                report['benchmarks'][name] = {
+                    'options': options,
+                    'repeat': args.repeat,
+                    'baseline_time': base_work,
+                    'slowdown': summarize([w / base_work for w in work]),
+                    'dump_time': summarize([max(t - base_tail, 0.0)
+                                            for t in tail]),
+                    'profile_size': os.path.getsize(fdata),
+                }
+
+    output = json.dumps(report, indent=2, sort_keys=True)
+    if args.output == '-':
+        print(output)
+    else:
+        with open(args.output, 'w') as f:
+            f.write(output + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,74 @@
+//===-- dispatch.cpp - Virtual dispatch -----------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Virtual calls over a mix of receiver types, exercising indirect call
+// tracking.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/// Print the time at which the workload is done, so the time spent after it,
+/// e.g. writing the instrumentation profile, can be told apart.
+static void reportEnd() {
+  timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  printf("bench-end %lld\n",
+         static_cast<long long>(TS.tv_sec) * 1000000000ll + TS.tv_nsec);
+}
+
+namespace {
+
+struct Shape {
+  virtual ~Shape() {}
+  virtual uint64_t area(uint64_t Size) const = 0;
+};
+
+struct Square : Shape {
+  uint64_t area(uint64_t Size) const override { return Size * Size; }
+};
+
+struct Triangle : Shape {
+  uint64_t area(uint64_t Size) const override { return Size * Size / 2; }
+};
+
+struct Circle : Shape {
+  uint64_t area(uint64_t Size) const override { return Size * Size * 3; }
+};
+
+struct Line : Shape {
+  uint64_t area(uint64_t) const override { return 0; }
+};
+
+} // namespace
+
+int main(int argc, char **argv) {
+  const uint64_t Scale = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1;
+  std::vector<std::unique_ptr<Shape>> Shapes;
+  for (unsigned I = 0; I < 1024; ++I) {
+    switch ((I * 7919) % 4) {
+    case 0: Shapes.emplace_back(new Square()); break;
+    case 1: Shapes.emplace_back(new Triangle()); break;
+    case 2: Shapes.emplace_back(new Circle()); break;
+    default: Shapes.emplace_back(new Line()); break;
+    }
+  }
+  uint64_t Sum = 0;
+  for (uint64_t Round = 0; Round < Scale * 100000; ++Round)
+    for (const auto &S : Shapes)
+      Sum += S->area(Round);
+  printf("%llu\n", static_cast<unsigned long long>(Sum));
+  reportEnd();
+  return 0;
+}
@@ -0,0 +1,50 @@
+//===-- loops.cpp - Tight loops -------------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Nested loops with data dependent branches, where every taken edge of the
+// inner loop carries a counter.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cstdint>
+
+/// Print the time at which the workload is done, so the time spent after it,
+/// e.g. writing the instrumentation profile, can be told apart.
+static void reportEnd() {
+  timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  printf("bench-end %lld\n",
+         static_cast<long long>(TS.tv_sec) * 1000000000ll + TS.tv_nsec);
+}
+
+__attribute__((noinline)) static uint64_t collatzSteps(uint64_t N) {
+  uint64_t Steps = 0;
+  while (N != 1) {
+    if (N & 1)
+      N = 3 * N + 1;
+    else
+      N /= 2;
+    ++Steps;
+  }
+  return Steps;
+}
+
+int main(int argc, char **argv) {
+  const uint64_t Scale = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1;
+  uint64_t Sum = 0;
+  for (uint64_t Round = 0; Round < Scale; ++Round)
+    for (uint64_t I = 1; I < 1000000; ++I)
+      Sum += collatzSteps(I + Round);
+  printf("%llu\n", static_cast<unsigned long long>(Sum));
+  reportEnd();
+  return 0;
+}
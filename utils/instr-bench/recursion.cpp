@@ -0,0 +1,52 @@
+//===-- recursion.cpp - Deep recursion ------------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Deeply recursive calls, where the call counters and the red zone adjustment
+// of leaf functions dominate.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cstdint>
+
+/// Print the time at which the workload is done, so the time spent after it,
+/// e.g. writing the instrumentation profile, can be told apart.
+static void reportEnd() {
+  timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  printf("bench-end %lld\n",
+         static_cast<long long>(TS.tv_sec) * 1000000000ll + TS.tv_nsec);
+}
+
+__attribute__((noinline)) static uint64_t leaf(uint64_t N) { return N ^ 0x5a; }
+
+__attribute__((noinline)) static uint64_t descend(uint64_t Depth) {
+  if (Depth == 0)
+    return leaf(Depth);
+  return descend(Depth - 1) + leaf(Depth);
+}
+
+__attribute__((noinline)) static uint64_t fib(uint64_t N) {
+  return N < 2 ? N : fib(N - 1) + fib(N - 2);
+}
+
+int main(int argc, char **argv) {
+  const uint64_t Scale = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1;
+  uint64_t Sum = 0;
+  for (uint64_t Round = 0; Round < Scale; ++Round) {
+    for (unsigned I = 0; I < 2000; ++I)
+      Sum += descend(10000);
+    Sum += fib(30);
+  }
+  printf("%llu\n", static_cast<unsigned long long>(Sum));
+  reportEnd();
+  return 0;
+}
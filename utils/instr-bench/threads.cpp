@@ -0,0 +1,58 @@
+//===-- threads.cpp - Multithreaded counters ------------------------------===//
+//
+//                     The LLVM Compiler Infrastructure
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.TXT for details.
+//
+//===----------------------------------------------------------------------===//
+//
+// Several threads running the same code, so they contend for the cache
+// lines of the same instrumentation counters.
+//
+//===----------------------------------------------------------------------===//
+
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+/// Print the time at which the workload is done, so the time spent after it,
+/// e.g. writing the instrumentation profile, can be told apart.
+static void reportEnd() {
+  timespec TS;
+  clock_gettime(CLOCK_MONOTONIC, &TS);
+  printf("bench-end %lld\n",
+         static_cast<long long>(TS.tv_sec) * 1000000000ll + TS.tv_nsec);
+}
+
+__attribute__((noinline)) static uint64_t hash(uint64_t X) {
+  X ^= X >> 33;
+  X *= 0xff51afd7ed558ccdull;
+  if (X & 1)
+    X ^= X >> 29;
+  return X;
+}
+
+int main(int argc, char **argv) {
+  const uint64_t Scale = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1;
+  const unsigned NumThreads = 8;
+  std::atomic<uint64_t> Sum{0};
+  std::vector<std::thread> Threads;
+  for (unsigned T = 0; T < NumThreads; ++T) {
+    Threads.emplace_back([&, T] {
+      uint64_t Local = 0;
+      for (uint64_t I = 0; I < Scale * 20000000; ++I)
+        Local += hash(I + T);
+      Sum += Local;
+    });
+  }
+  for (auto &T : Threads)
+    T.join();
+  printf("%llu\n", static_cast<unsigned long long>(Sum.load()));
+  reportEnd();
+  return 0;
+}